@@ -111,6 +111,75 @@ VertexShader vsArray20[ 4 ] = { compile vs_2_0 VertSkinning( 1 ),
                                 compile vs_2_0 VertSkinning( 4 ) };
 
 
+//--------------------------------------------------------------------------------------
+// Crowd skinning.  The bone palettes of a whole crowd are in one float texture, a row
+// per instance, and the mesh is drawn with stream instancing; the instance stream
+// gives the row.  A palette entry takes three texels: the columns of its 4x3 matrix.
+//--------------------------------------------------------------------------------------
+texture g_txPalettes;
+float   g_fPaletteTexelWidth;   // 1 / width of g_txPalettes
+float   g_fPaletteBase;         // texel where the palette of the attribute group starts
+
+sampler g_samPalettes =
+sampler_state
+{
+    Texture = <g_txPalettes>;
+    MinFilter = Point;
+    MagFilter = Point;
+    MipFilter = None;
+    AddressU = Clamp;
+    AddressV = Clamp;
+};
+
+
+void SkinInstanced( float4 vPos, float3 vNor, float fRow, int iEntry, float fWeight,
+                    inout float3 Pos, inout float3 Normal )
+{
+    float  u = ( g_fPaletteBase + iEntry * 3 + 0.5f ) * g_fPaletteTexelWidth;
+    float4 c0 = tex2Dlod( g_samPalettes, float4( u, fRow, 0, 0 ) );
+    float4 c1 = tex2Dlod( g_samPalettes, float4( u + g_fPaletteTexelWidth, fRow, 0, 0 ) );
+    float4 c2 = tex2Dlod( g_samPalettes, float4( u + 2 * g_fPaletteTexelWidth, fRow, 0, 0 ) );
+
+    Pos    += float3( dot( vPos, c0 ), dot( vPos, c1 ), dot( vPos, c2 ) ) * fWeight;
+    Normal += float3( dot( vNor, c0.xyz ), dot( vNor, c1.xyz ), dot( vNor, c2.xyz ) ) * fWeight;
+}
+
+
+VS_OUTPUT VertSkinningInstanced( VS_INPUT i, float fRow : TEXCOORD1, uniform int iNumBones )
+{
+    VS_OUTPUT   o;
+    float3      Pos = 0.0f;
+    float3      Normal = 0.0f;
+    float       LastWeight = 1.0f;
+    float       afBlendWeights[ 3 ] = (float[ 3 ]) i.BlendWeights;
+    int         aiIndices[ 4 ] = (int[ 4 ]) D3DCOLORtoUBYTE4( i.BlendIndices );
+
+    // same blending as VS_Skin(), with the palette read from the texture
+    for( int iBone = 0; (iBone < 3) && (iBone < iNumBones - 1); ++ iBone )
+    {
+        LastWeight -= afBlendWeights[ iBone ];
+        SkinInstanced( i.Pos, i.Normal, fRow, aiIndices[ iBone ], afBlendWeights[ iBone ], Pos, Normal );
+    }
+    SkinInstanced( i.Pos, i.Normal, fRow, aiIndices[ iNumBones - 1 ], LastWeight, Pos, Normal );
+
+    // the palette is already in world space
+    o.Pos = mul( float4( Pos, 1.0f ), g_mViewProj );
+
+    Normal = normalize( Normal );
+    o.Diffuse = float4( MaterialAmbient.xyz + saturate( dot( Normal, lhtDir.xyz ) ) * MaterialDiffuse.xyz, 1.0 );
+
+    o.Tex0  = i.Tex0.xy;
+
+    return o;
+}
+
+
+VertexShader vsArray30Instanced[ 4 ] = { compile vs_3_0 VertSkinningInstanced( 1 ),
+                                         compile vs_3_0 VertSkinningInstanced( 2 ),
+                                         compile vs_3_0 VertSkinningInstanced( 3 ),
+                                         compile vs_3_0 VertSkinningInstanced( 4 ) };
+
+
 //--------------------------------------------------------------------------------------
 // Techniques
 //--------------------------------------------------------------------------------------
@@ -134,3 +203,13 @@ technique Skinning20
         PixelShader = compile ps_2_0 PixScene();
     }
 }
+
+
+technique SkinningInstanced30
+{
+    pass p0
+    {
+        VertexShader = ( vsArray30Instanced[ CurNumBones ] );
+        PixelShader = compile ps_3_0 PixScene();
+    }
+}
@@ -180,6 +180,15 @@ HRESULT CMultiAnimAllocateHierarchy::CreateMeshContainer( THIS_
     if( NumMaterials > 0 )
     {
         CopyMemory( pMC->pMaterials, pMaterials, NumMaterials * sizeof( D3DXMATERIAL ) );
+
+        // the texture names point into D3DX's load buffer; keep our own copies
+        // so the hierarchy can still be saved to the mesh cache after loading
+        for( DWORD i = 0; i < NumMaterials; ++ i )
+        {
+            if( pMaterials[ i ].pTextureFilename )
+                pMC->pMaterials[ i ].pTextureFilename = HeapCopy( pMaterials[ i ].pTextureFilename );
+        }
+
         for( DWORD i = 0; i < NumMaterials; ++ i )
         {
             if( pMC->pMaterials[ i ].pTextureFilename )
@@ -253,25 +262,6 @@ HRESULT CMultiAnimAllocateHierarchy::CreateMeshContainer( THIS_
     if( FAILED( hr ) )
         goto e_Exit;
 
-    // Make sure the working set is large enough for this mesh.
-    // This is a bone array used for all mesh containers as a working
-    // set during drawing.  If one was created previously that isn't 
-    // large enough for this mesh, we have to reallocate.
-    if( m_pMA->m_dwWorkingPaletteSize < pMC->m_dwNumPaletteEntries )
-    {
-        if( m_pMA->m_amxWorkingPalette )
-            delete [] m_pMA->m_amxWorkingPalette;
-
-        m_pMA->m_dwWorkingPaletteSize = pMC->m_dwNumPaletteEntries;
-        m_pMA->m_amxWorkingPalette = new D3DXMATRIX[ m_pMA->m_dwWorkingPaletteSize ];
-        if( m_pMA->m_amxWorkingPalette == NULL )
-        {
-            m_pMA->m_dwWorkingPaletteSize = 0;
-            hr = E_OUTOFMEMORY;
-            goto e_Exit;
-        }
-    }
-
     // ensure the proper vertex format for the mesh
     {
         DWORD dwOldFVF = pMC->m_pWorkingMesh->GetFVF();
@@ -381,7 +371,14 @@ HRESULT CMultiAnimAllocateHierarchy::DestroyMeshContainer( THIS_ LPD3DXMESHCONTA
         delete [] pMC->pAdjacency;
 
     if( pMC->pMaterials )
+    {
+        for( DWORD i = 0; i < pMC->NumMaterials; ++ i )
+        {
+            if( pMC->pMaterials[ i ].pTextureFilename )
+                delete [] pMC->pMaterials[ i ].pTextureFilename;
+        }
         delete [] pMC->pMaterials;
+    }
 
     for( DWORD i = 0; i < pMC->NumMaterials; ++ i )
     {
@@ -414,8 +411,8 @@ HRESULT CMultiAnimAllocateHierarchy::DestroyMeshContainer( THIS_ LPD3DXMESHCONTA
         pMC->m_pBufBoneCombos = NULL;
     }
 
-    if( pMC->m_apmxBonePointers )
-        delete [] pMC->m_apmxBonePointers;
+    if( pMC->m_adwBoneFrames )
+        delete [] pMC->m_adwBoneFrames;
 
     delete pMeshContainerToFree;
 
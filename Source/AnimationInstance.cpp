@@ -10,6 +10,33 @@
 #pragma warning(disable: 4995)
 #include "MultiAnimation.h"
 #pragma warning(default: 4995)
+#include <xmmintrin.h>
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: MultiplyMatrixSSE()
+// Desc: pOut = pM1 * pM2, a row of the result at a time with SSE.  pOut may
+//       be either input, but must be 16 byte aligned.
+//-----------------------------------------------------------------------------
+static inline void MultiplyMatrixSSE( D3DXMATRIXA16 * pOut, const D3DXMATRIX * pM1, const D3DXMATRIX * pM2 )
+{
+    __m128 r0 = _mm_loadu_ps( pM2->m[ 0 ] );
+    __m128 r1 = _mm_loadu_ps( pM2->m[ 1 ] );
+    __m128 r2 = _mm_loadu_ps( pM2->m[ 2 ] );
+    __m128 r3 = _mm_loadu_ps( pM2->m[ 3 ] );
+
+    for( int i = 0; i < 4; ++ i )
+    {
+        const FLOAT * a = pM1->m[ i ];
+        __m128 v = _mm_mul_ps( _mm_set1_ps( a[ 0 ] ), r0 );
+        v = _mm_add_ps( v, _mm_mul_ps( _mm_set1_ps( a[ 1 ] ), r1 ) );
+        v = _mm_add_ps( v, _mm_mul_ps( _mm_set1_ps( a[ 2 ] ), r2 ) );
+        v = _mm_add_ps( v, _mm_mul_ps( _mm_set1_ps( a[ 3 ] ), r3 ) );
+        _mm_store_ps( pOut->m[ i ], v );
+    }
+}
 
 
 
@@ -17,13 +44,15 @@
 //-----------------------------------------------------------------------------
 // Name: CAnimInstance::Setup()
 // Desc: Initialize ourselves to use the animation controller passed in. Then
-//       initialize the animation controller.
+//       initialize the animation controller.  The controller is pointed at
+//       our own copy of the frame transforms, so instances don't share the
+//       frames and can be updated independently (and in parallel).
 //-----------------------------------------------------------------------------
 HRESULT CAnimInstance::Setup( LPD3DXANIMATIONCONTROLLER pAC )
 {
     assert( pAC != NULL );
 
-    DWORD i, dwTracks;
+    DWORD i, dwTracks, dwNumFrames;
 
     m_pAC = pAC;
 
@@ -32,57 +61,150 @@ HRESULT CAnimInstance::Setup( LPD3DXANIMATIONCONTROLLER pAC )
     for( i = 0; i < dwTracks; ++ i )
         m_pAC->SetTrackEnable( i, FALSE );
 
+    ReleaseTransforms();
+    dwNumFrames = (DWORD) m_pMultiAnim->m_v_pFlatFrames.size();
+    m_amxLocal = (D3DXMATRIXA16 *) _aligned_malloc( dwNumFrames * sizeof( D3DXMATRIXA16 ), 16 );
+    m_amxCombined = (D3DXMATRIXA16 *) _aligned_malloc( dwNumFrames * sizeof( D3DXMATRIXA16 ), 16 );
+    m_amxPalette = (D3DXMATRIXA16 *) _aligned_malloc( max( m_pMultiAnim->m_dwPaletteSize, 1 ) * sizeof( D3DXMATRIXA16 ), 16 );
+    m_amxPalettePrev = (D3DXMATRIXA16 *) _aligned_malloc( max( m_pMultiAnim->m_dwPaletteSize, 1 ) * sizeof( D3DXMATRIXA16 ), 16 );
+    m_amxPaletteNext = (D3DXMATRIXA16 *) _aligned_malloc( max( m_pMultiAnim->m_dwPaletteSize, 1 ) * sizeof( D3DXMATRIXA16 ), 16 );
+    if( m_amxLocal == NULL || m_amxCombined == NULL || m_amxPalette == NULL ||
+        m_amxPalettePrev == NULL || m_amxPaletteNext == NULL )
+        return E_OUTOFMEMORY;
+
+    // unused palette entries are never read by the vertices, but are uploaded
+    for( i = 0; i < m_pMultiAnim->m_dwPaletteSize; ++ i )
+    {
+        D3DXMatrixIdentity( &m_amxPalette[ i ] );
+        D3DXMatrixIdentity( &m_amxPalettePrev[ i ] );
+        D3DXMatrixIdentity( &m_amxPaletteNext[ i ] );
+    }
+
+    // start from the pose in the file (frames the animations don't touch keep it);
+    // registering a name again moves the clone's output to our matrix
+    for( i = 0; i < dwNumFrames; ++ i )
+    {
+        MultiAnimFrame * pFrame = m_pMultiAnim->m_v_pFlatFrames[ i ];
+        m_amxLocal[ i ] = pFrame->TransformationMatrix;
+        m_amxCombined[ i ] = pFrame->TransformationMatrix;
+        m_pAC->RegisterAnimationOutput( pFrame->Name, &m_amxLocal[ i ], NULL, NULL, NULL );
+    }
+
     return S_OK;
 }
 
 
 
 
+//-----------------------------------------------------------------------------
+// Name: CAnimInstance::ReleaseTransforms()
+// Desc: Frees our frame transforms.
+//-----------------------------------------------------------------------------
+void CAnimInstance::ReleaseTransforms()
+{
+    if( m_amxLocal )
+    {
+        _aligned_free( m_amxLocal );
+        m_amxLocal = NULL;
+    }
+
+    if( m_amxCombined )
+    {
+        _aligned_free( m_amxCombined );
+        m_amxCombined = NULL;
+    }
+
+    if( m_amxPalette )
+    {
+        _aligned_free( m_amxPalette );
+        m_amxPalette = NULL;
+    }
+
+    if( m_amxPalettePrev )
+    {
+        _aligned_free( m_amxPalettePrev );
+        m_amxPalettePrev = NULL;
+    }
+
+    if( m_amxPaletteNext )
+    {
+        _aligned_free( m_amxPaletteNext );
+        m_amxPaletteNext = NULL;
+    }
+}
+
+
+
+
 //-----------------------------------------------------------------------------
 // Name: CAnimInstance::UpdateFrame()
-// Desc: Recursively walk the animation frame hierarchy and for each frame,
-//       transform the frame by its parent, starting with a world transform to
-//       place the mesh in world space.  This has the effect of a hierarchical
-//       transform over all the frames.
+// Desc: For each frame, transform the frame by its parent, starting with
+//       pmxRoot (normally the world transform, to place the mesh in world
+//       space).  This has the effect of a hierarchical transform over all
+//       the frames.  The frames are flattened with parents first, so this is
+//       one pass over arrays.
 //-----------------------------------------------------------------------------
-void CAnimInstance::UpdateFrames( MultiAnimFrame * pFrame, D3DXMATRIX * pmxBase )
+void CAnimInstance::UpdateFrames( const D3DXMATRIX * pmxRoot )
 {
-    assert( pFrame != NULL );
-    assert( pmxBase != NULL );
-
-    // transform the bone
-    D3DXMatrixMultiply( &pFrame->TransformationMatrix,
-                        &pFrame->TransformationMatrix,
-                        pmxBase );
-
-    // transform siblings by the same matrix
-    if( pFrame->pFrameSibling )
-        UpdateFrames( (MultiAnimFrame *) pFrame->pFrameSibling, pmxBase );
-
-    // transform children by the transformed matrix - hierarchical transformation
-    if( pFrame->pFrameFirstChild )
-        UpdateFrames( (MultiAnimFrame *) pFrame->pFrameFirstChild,
-                      &pFrame->TransformationMatrix );
+    const DWORD dwNumFrames = (DWORD) m_pMultiAnim->m_v_iFlatParents.size();
+    const int * aiParents = dwNumFrames ? & m_pMultiAnim->m_v_iFlatParents[ 0 ] : NULL;
+
+    for( DWORD i = 0; i < dwNumFrames; ++ i )
+    {
+        const D3DXMATRIX * pmxBase = aiParents[ i ] < 0 ? pmxRoot : & m_amxCombined[ aiParents[ i ] ];
+        MultiplyMatrixSSE( & m_amxCombined[ i ], & m_amxLocal[ i ], pmxBase );
+    }
 }
 
 
 
 
 //-----------------------------------------------------------------------------
-// Name: CAnimInstance::DrawFrames()
-// Desc: Recursively walk the frame hierarchy and draw each mesh container as
-//       we find it.
+// Name: CAnimInstance::UpdatePalettes()
+// Desc: Sets up the matrix palette of each attribute group of each skinned
+//       mesh container by multiplying the bone offsets to their bone
+//       transformations.  This gives us the completed bone matrices that can
+//       be used and blended by the pipeline, ready for drawing.  The
+//       matrices go to amxPalette (laid out like m_amxPalette).
 //-----------------------------------------------------------------------------
-void CAnimInstance::DrawFrames( MultiAnimFrame * pFrame )
+void CAnimInstance::UpdatePalettes( D3DXMATRIXA16 * amxPalette )
 {
-    if( pFrame->pMeshContainer )
-        DrawMeshFrame( pFrame );
+    std::vector< MultiAnimMC* >::iterator itCur, itEnd = m_pMultiAnim->m_v_pSkinnedMCs.end();
+    for( itCur = m_pMultiAnim->m_v_pSkinnedMCs.begin(); itCur != itEnd; ++ itCur )
+    {
+        MultiAnimMC * pMC = * itCur;
+        LPD3DXBONECOMBINATION pBC = ( LPD3DXBONECOMBINATION )( pMC->m_pBufBoneCombos->GetBufferPointer() );
+        D3DXMATRIXA16 * pmxPalette = &amxPalette[ pMC->m_dwPaletteBase ];
+
+        for( DWORD dwAttrib = 0; dwAttrib < pMC->m_dwNumAttrGroups; ++ dwAttrib )
+        {
+            for( DWORD dwPalEntry = 0; dwPalEntry < pMC->m_dwNumPaletteEntries; ++ dwPalEntry, ++ pmxPalette )
+            {
+                DWORD dwMatrixIndex = pBC[ dwAttrib ].BoneId[ dwPalEntry ];
+                if( dwMatrixIndex != UINT_MAX )
+                    MultiplyMatrixSSE( pmxPalette,
+                                       &( pMC->m_amxBoneOffsets[ dwMatrixIndex ] ),
+                                       &m_amxCombined[ pMC->m_adwBoneFrames[ dwMatrixIndex ] ] );
+            }
+        }
+    }
+}
 
-    if( pFrame->pFrameSibling )
-        DrawFrames( (MultiAnimFrame *) pFrame->pFrameSibling );
 
-    if( pFrame->pFrameFirstChild )
-        DrawFrames( (MultiAnimFrame *) pFrame->pFrameFirstChild );
+
+
+//-----------------------------------------------------------------------------
+// Name: CAnimInstance::DrawFrames()
+// Desc: Walk the frame hierarchy and draw each mesh container as we find it.
+//-----------------------------------------------------------------------------
+void CAnimInstance::DrawFrames()
+{
+    std::vector< MultiAnimFrame* >::iterator itCur, itEnd = m_pMultiAnim->m_v_pFlatFrames.end();
+    for( itCur = m_pMultiAnim->m_v_pFlatFrames.begin(); itCur != itEnd; ++ itCur )
+    {
+        if( ( * itCur )->pMeshContainer )
+            DrawMeshFrame( * itCur );
+    }
 }
 
 
@@ -91,39 +213,26 @@ void CAnimInstance::DrawFrames( MultiAnimFrame * pFrame )
 //-----------------------------------------------------------------------------
 // Name: CAnimInstance::DrawMeshFrame()
 // Desc: Renders a mesh container.  Here we go through each attribute group
-//       and set up the matrix palette for each group by multiplying the
-//       bone offsets to its bone transformation.  This gives us the completed
-//       bone matrices that can be used and blended by the pipeline.  We then
-//       set up the effect and render the mesh.
+//       and set its matrix palette (computed by UpdatePalettes()) into the
+//       effect.  We then set up the effect and render the mesh.
 //-----------------------------------------------------------------------------
 void CAnimInstance::DrawMeshFrame( MultiAnimFrame * pFrame )
 {
     MultiAnimMC * pMC = (MultiAnimMC *) pFrame->pMeshContainer;
-    D3DXMATRIX mx;
 
     if( pMC->pSkinInfo == NULL )
         return;
 
     // get bone combinations
     LPD3DXBONECOMBINATION pBC = ( LPD3DXBONECOMBINATION )( pMC->m_pBufBoneCombos->GetBufferPointer() );
-    DWORD dwAttrib, dwPalEntry;
+    DWORD dwAttrib;
 
     // for each palette
     for( dwAttrib = 0; dwAttrib < pMC->m_dwNumAttrGroups; ++ dwAttrib )
     {
-        // set each transform into the palette
-        for( dwPalEntry = 0; dwPalEntry < pMC->m_dwNumPaletteEntries; ++ dwPalEntry )
-        {
-            DWORD dwMatrixIndex = pBC[ dwAttrib ].BoneId[ dwPalEntry ];
-            if( dwMatrixIndex != UINT_MAX )
-                D3DXMatrixMultiply( &m_pMultiAnim->m_amxWorkingPalette[ dwPalEntry ],
-                                    &( pMC->m_amxBoneOffsets[ dwMatrixIndex ] ),
-                                    pMC->m_apmxBonePointers[ dwMatrixIndex ] );
-        }
-
         // set the matrix palette into the effect
         m_pMultiAnim->m_pEffect->SetMatrixArray( "amPalette",
-                                                 m_pMultiAnim->m_amxWorkingPalette,
+                                                 &m_amxPalette[ pMC->m_dwPaletteBase + dwAttrib * pMC->m_dwNumPaletteEntries ],
                                                  pMC->m_dwNumPaletteEntries );
 
         // we're pretty much ignoring the materials we got from the x-file; just set
@@ -160,7 +269,13 @@ void CAnimInstance::DrawMeshFrame( MultiAnimFrame * pFrame )
 //-----------------------------------------------------------------------------
 CAnimInstance::CAnimInstance( CMultiAnim * pMultiAnim )
 :   m_pMultiAnim( pMultiAnim ),
-    m_pAC( NULL )
+    m_pAC( NULL ),
+    m_amxLocal( NULL ),
+    m_amxCombined( NULL ),
+    m_amxPalette( NULL ),
+    m_amxPalettePrev( NULL ),
+    m_amxPaletteNext( NULL ),
+    m_dPoseQuantum( 0.0 )
 {
     assert( pMultiAnim != NULL );
 }
@@ -187,6 +302,8 @@ void CAnimInstance::Cleanup()
 {
     if( m_pAC )
         m_pAC->Release();
+
+    ReleaseTransforms();
 }
 
 
@@ -243,6 +360,20 @@ void CAnimInstance::SetWorldTransform( const D3DXMATRIX * pmxWorld )
 
 
 
+//-----------------------------------------------------------------------------
+// Name: CAnimInstance::SetPoseQuantum()
+// Desc: Lets this instance share its pose with the instances in the same one
+//       (see CMultiAnim::GetCachedPose()): track times within dQuantum
+//       seconds of each other count as the same.  0 turns sharing off.
+//-----------------------------------------------------------------------------
+void CAnimInstance::SetPoseQuantum( double dQuantum )
+{
+    m_dPoseQuantum = dQuantum;
+}
+
+
+
+
 //-----------------------------------------------------------------------------
 // Name: CAnimInstance::AdvanceTime()
 // Desc: Advance the local time of this instance by dTimeDelta with a
@@ -254,13 +385,11 @@ HRESULT CAnimInstance::AdvanceTime( DOUBLE dTimeDelta, ID3DXAnimationCallbackHan
 {
     HRESULT hr;
 
-    // apply all the animations to the bones in the frame hierarchy.
-    hr = m_pAC->AdvanceTime( dTimeDelta, pCH );
+    hr = AdvanceAnimation( dTimeDelta, pCH );
     if( FAILED( hr ) )
         return hr;
 
-    // apply the animations recursively through the hierarchy, and set the world.
-    UpdateFrames( m_pMultiAnim->m_pFrameRoot, & m_mxWorld );
+    UpdateTransforms();
 
     return S_OK;
 }
@@ -268,6 +397,108 @@ HRESULT CAnimInstance::AdvanceTime( DOUBLE dTimeDelta, ID3DXAnimationCallbackHan
 
 
 
+//-----------------------------------------------------------------------------
+// Name: CAnimInstance::AdvanceAnimation()
+// Desc: The first half of AdvanceTime(): advance the animation controller,
+//       which sets the local frame transforms.
+//-----------------------------------------------------------------------------
+HRESULT CAnimInstance::AdvanceAnimation( DOUBLE dTimeDelta, ID3DXAnimationCallbackHandler * pCH )
+{
+    // apply all the animations to the bones in the frame hierarchy.
+    return m_pAC->AdvanceTime( dTimeDelta, pCH );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CAnimInstance::UpdateTransforms()
+// Desc: The second half of AdvanceTime(): propagate the animations through
+//       the hierarchy, and set the world, then compute the skinning palettes.
+//       This only touches the instance's own transforms, so instances can
+//       be updated on different threads.
+//-----------------------------------------------------------------------------
+void CAnimInstance::UpdateTransforms()
+{
+    // in a pose another instance computed, we only place its palette
+    const D3DXMATRIXA16 * amxPose = m_pMultiAnim->GetCachedPose( this );
+    if( amxPose )
+    {
+        for( DWORD i = 0; i < m_pMultiAnim->m_dwPaletteSize; ++ i )
+            MultiplyMatrixSSE( & m_amxPalette[ i ], & amxPose[ i ], & m_mxWorld );
+        return;
+    }
+
+    UpdateFrames( & m_mxWorld );
+    UpdatePalettes( m_amxPalette );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CAnimInstance::UpdateTransformsBlended()
+// Desc: UpdateTransforms() for an instance that is only updated every few
+//       frames (see CTiny::AdvanceAnimationLOD()).  The palette is computed
+//       in model space and kept with the one of the previous such update;
+//       BlendPalettes() fills the frames in between.  This update shows the
+//       previous palette, so the motion stays continuous.  bRestart says
+//       there is no previous palette (the last update wasn't blended).
+//-----------------------------------------------------------------------------
+void CAnimInstance::UpdateTransformsBlended( bool bRestart )
+{
+    D3DXMATRIXA16 * amxTemp = m_amxPalettePrev;
+    m_amxPalettePrev = m_amxPaletteNext;
+    m_amxPaletteNext = amxTemp;
+
+    const D3DXMATRIXA16 * amxPose = m_pMultiAnim->GetCachedPose( this );
+    if( amxPose )
+        CopyMemory( m_amxPaletteNext, amxPose, m_pMultiAnim->m_dwPaletteSize * sizeof( D3DXMATRIXA16 ) );
+    else
+    {
+        D3DXMATRIX mxIdentity;
+        D3DXMatrixIdentity( & mxIdentity );
+        UpdateFrames( & mxIdentity );
+        UpdatePalettes( m_amxPaletteNext );
+    }
+
+    if( bRestart )
+        CopyMemory( m_amxPalettePrev, m_amxPaletteNext, m_pMultiAnim->m_dwPaletteSize * sizeof( D3DXMATRIXA16 ) );
+
+    BlendPalettes( 0.f );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CAnimInstance::BlendPalettes()
+// Desc: Sets the skinning matrices to the blend of the last two updates of
+//       UpdateTransformsBlended() (fAlpha = 0 is the older one), placed with
+//       the current world transform.  The matrices are blended linearly,
+//       which is close enough over the few frames between the updates.
+//-----------------------------------------------------------------------------
+void CAnimInstance::BlendPalettes( float fAlpha )
+{
+    const __m128 a = _mm_set1_ps( fAlpha );
+    D3DXMATRIXA16 mxBlend;
+
+    for( DWORD i = 0; i < m_pMultiAnim->m_dwPaletteSize; ++ i )
+    {
+        for( int r = 0; r < 4; ++ r )
+        {
+            __m128 p = _mm_load_ps( m_amxPalettePrev[ i ].m[ r ] );
+            __m128 n = _mm_load_ps( m_amxPaletteNext[ i ].m[ r ] );
+            _mm_store_ps( mxBlend.m[ r ], _mm_add_ps( p, _mm_mul_ps( a, _mm_sub_ps( n, p ) ) ) );
+        }
+
+        MultiplyMatrixSSE( & m_amxPalette[ i ], & mxBlend, & m_mxWorld );
+    }
+}
+
+
+
+
 //-----------------------------------------------------------------------------
 // Name: CAnimInstance::ResetTime()
 // Desc: Resets the local time for this instance.
@@ -284,11 +515,16 @@ HRESULT CAnimInstance::ResetTime()
 // Name: CAnimInstance::Draw()
 // Desc: Renders the frame hierarchy of our CMultiAnimation object.  This is
 //       normally called right after AdvanceTime() so that we render the
-//       mesh with the animation for this instance.
+//       mesh with the animation for this instance.  Inside a crowd (see
+//       CMultiAnim::BeginCrowd()) the instance is only queued, and drawn
+//       together with the others at CMultiAnim::EndCrowd().
 //-----------------------------------------------------------------------------
 HRESULT CAnimInstance::Draw()
 {
-    DrawFrames( m_pMultiAnim->m_pFrameRoot );
+    if( m_pMultiAnim->m_bCrowdActive )
+        return m_pMultiAnim->AddCrowdInstance( this );
+
+    DrawFrames();
 
     return S_OK;
 }
@@ -0,0 +1,491 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "global.h"
+#include "time.h"
+#include "database.h"
+#include "msgroute.h"
+#include "debuglog.h"
+#include "jobsystem.h"
+#include "telemetry.h"
+#include "msgrecorder.h"
+#include "gameobject.h"
+#include "benchmark.h"
+#include "benchmarkmachines.h"
+#include "memtrack.h"
+#include <new>
+
+//Headless benchmark of the state machine engine. Spawns N objects running one
+//of the benchmark machines, steps the database with a fixed timestep and reports
+//messages/sec, transitions/sec, time per state machine event, memory per agent
+//(by subsystem, see memtrack.h) and the allocations made in the measured frames.
+//
+//Usage: StateMachineBenchmark [-agents N] [-frames F] [-scenario name|all]
+//                             [-scheduler list|heap] [-batched] [-workers W] [-parallel] [-csv]
+//                             [-sortupdate N] [-record file]
+//       StateMachineBenchmark -msgroute ...   (see msgroutebenchmark.cpp)
+//       StateMachineBenchmark -replay file [-workers W] [-parallel]
+//
+//-record writes the message traffic of the measured frames of one scenario (see
+//msgrecorder.h), and -replay runs a recording from any build headless and reports
+//the frames whose deliveries differ from the recording. -sortupdate N re-sorts the
+//update order every N frames (see Database::SetUpdateOrderSort), to compare the
+//time per event with and without it.
+//
+//A scenario whose measured frames allocate on the heap fails the run (exit code 2),
+//since after the warm up every container on the frame should be reusing storage.
+
+
+#define BENCHMARK_WARMUP_FRAMES (10)		//Not measured (start up and first deliveries)
+#define BENCHMARK_BROADCASTER_RATIO (32)	//One broadcaster per this many agents
+
+enum BenchmarkScenario {
+	BENCHMARK_PING_PONG,
+	BENCHMARK_TIMER_STORM,
+	BENCHMARK_CHAIN,
+	BENCHMARK_BROADCAST,
+
+	BENCHMARK_NUM_SCENARIOS
+};
+
+static const char* BenchmarkScenarioText[] =
+{
+	"pingpong",
+	"timers",
+	"chain",
+	"broadcast"
+};
+
+struct BenchmarkOptions
+{
+	unsigned int m_agents;
+	unsigned int m_frames;
+	unsigned int m_workers;			//0 = one per hardware thread
+	int m_scenario;					//-1 = all
+	MsgSchedulerType m_scheduler;
+	bool m_batched;					//Batched delayed message delivery
+	bool m_parallel;
+	unsigned int m_sortInterval;	//Update order sort (0 = insertion order)
+	bool m_csv;
+	const char * m_record;			//Recording of the measured frames (0 = none)
+};
+
+struct BenchmarkResult
+{
+	double m_seconds;				//Time spent in Database::Update over the measured frames
+	double m_messages;				//Messages delivered
+	double m_transitions;			//State changes
+	double m_events;				//State machine Process and Update calls
+	double m_bytesPerAgent;			//Heap in use per agent after the warm up
+	double m_tagBytesPerAgent[MEMORY_NUM_TAGS];	//The part of it tracked by subsystem
+	unsigned int m_hotPathAllocs;	//Heap allocations during the measured updates, tagged or not (must be 0 - the run fails otherwise)
+};
+
+
+//Heap tracking, for the memory per agent. Each block is prefixed with its size.
+//Engine allocations with a memory tag go to MemoryTracker instead, and are added in.
+//The untagged ones made inside Database::Update are counted as hot path
+//allocations too, so the count covers every container the frame touches.
+static volatile LONG g_heapBytes = 0;
+
+#define BENCHMARK_HEAP_HEADER (16)		//Keeps the returned blocks 16 byte aligned
+
+void * operator new( size_t size )
+{
+	char * block = (char*)malloc( size + BENCHMARK_HEAP_HEADER );
+	if( block == 0 ) {
+		throw std::bad_alloc();
+	}
+	*(size_t*)block = size;
+	InterlockedExchangeAdd( &g_heapBytes, (LONG)size );
+	MemoryTracker::CountUntrackedAlloc();
+	return( block + BENCHMARK_HEAP_HEADER );
+}
+
+void operator delete( void * p )
+{
+	if( p ) {
+		char * block = (char*)p - BENCHMARK_HEAP_HEADER;
+		InterlockedExchangeAdd( &g_heapBytes, -(LONG)*(size_t*)block );
+		free( block );
+	}
+}
+
+void * operator new[]( size_t size )	{ return( operator new( size ) ); }
+void operator delete[]( void * p )		{ operator delete( p ); }
+
+
+double GetBenchmarkSeconds( void )
+{
+	LARGE_INTEGER qwTime, qwFreq;
+	QueryPerformanceCounter( &qwTime );
+	QueryPerformanceFrequency( &qwFreq );
+	return( (double)qwTime.QuadPart / (double)qwFreq.QuadPart );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SpawnAgents
+
+  Description:  Creates the objects of a scenario and their state machines,
+                as one batch (the machines initialize on the first update).
+
+  Arguments:    scenario : which benchmark machine to run
+                agents   : the number of objects
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+static void SpawnAgents( BenchmarkScenario scenario, unsigned int agents )
+{
+	dbObjectIDList ids;
+	dbCompositionList spawned;
+	g_database.GetNewObjectIDs( agents, ids );
+	spawned.reserve( agents );
+
+	objectID partner = INVALID_OBJECT_ID;
+	for( unsigned int i=0; i<agents; ++i )
+	{
+		char name[GAME_OBJECT_MAX_NAME_SIZE];
+		sprintf( name, "Agent%u", i );
+		GameObject* agent = new GameObject( ids[i], OBJECT_NPC, name );
+		agent->CreateStateMachineManager();
+		spawned.push_back( agent );
+
+		StateMachine* machine = 0;
+		switch( scenario )
+		{
+			case BENCHMARK_PING_PONG:
+				//Pairs: odd objects start the exchange with the object before them (the other side replies to the sender)
+				if( i % 2 == 0 ) {
+					machine = new BenchmarkPingPong( *agent, INVALID_OBJECT_ID, false );
+					partner = agent->GetID();
+				}
+				else {
+					machine = new BenchmarkPingPong( *agent, partner, true );
+				}
+				break;
+			case BENCHMARK_TIMER_STORM:
+				machine = new BenchmarkTimerStorm( *agent );
+				break;
+			case BENCHMARK_CHAIN:
+				machine = new BenchmarkChain( *agent );
+				break;
+			default:
+				machine = new BenchmarkBroadcast( *agent, i % BENCHMARK_BROADCASTER_RATIO == 0 );
+				break;
+		}
+		agent->GetStateMachineManager()->PushStateMachineLazy( *machine, STATE_MACHINE_QUEUE_0 );
+	}
+
+	g_database.StoreBatch( spawned );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RunScenario
+
+  Description:  Runs one scenario with its own set of singletons, so every
+                scenario starts from an empty database and message queue.
+
+  Arguments:    scenario : which benchmark machine to run
+                options  : the command line options
+                result   : filled with the measurements
+
+  Returns:      None. (The result is stored in the result argument.)
+ *---------------------------------------------------------------------------*/
+static void RunScenario( BenchmarkScenario scenario, BenchmarkOptions & options, BenchmarkResult & result )
+{
+	Time* time = new Time();
+	Database* database = new Database();
+	MsgRoute* msgroute = new MsgRoute( options.m_scheduler );
+	DebugLog* debuglog = new DebugLog();
+	JobSystem* jobsystem = new JobSystem( options.m_workers );
+
+	msgroute->SetLoadBalancingConstraint( 0.0f );	//Deliver everything that is due, to measure throughput
+	msgroute->SetBatchedDelivery( options.m_batched );
+	debuglog->SetSampleRate( 0 );		//No object logs
+	debuglog->SetEchoToOutput( false );
+	database->SetParallelUpdate( options.m_parallel );
+	database->SetUpdateOrderSort( options.m_sortInterval );
+	time->SetFixedTimestep( 1.0 / 60.0 );	//Game time doesn't depend on how fast the frames run
+
+	MemoryReport before, after, end;
+	LONG heapBefore = g_heapBytes;
+	MemoryTracker::GetReport( before );
+	SpawnAgents( scenario, options.m_agents );
+	for( unsigned int frame=0; frame<BENCHMARK_WARMUP_FRAMES; ++frame )
+	{
+		g_time.MarkFixedStep();
+		g_database.Update();
+	}
+	MemoryTracker::GetReport( after );
+	result.m_bytesPerAgent = ( (double)( g_heapBytes - heapBefore ) + (double)after.m_currentBytes - (double)before.m_currentBytes ) / (double)options.m_agents;
+	for( unsigned int i=0; i<MEMORY_NUM_TAGS; ++i ) {
+		result.m_tagBytesPerAgent[i] = ( (double)after.m_tags[i].m_currentBytes - (double)before.m_tags[i].m_currentBytes ) / (double)options.m_agents;
+	}
+
+	FrameTelemetry* telemetry = new FrameTelemetry();
+	MsgRecorder* recorder = 0;
+	if( options.m_record )
+	{
+		recorder = new MsgRecorder();
+		if( !recorder->StartRecording( options.m_record ) ) {
+			printf( "Can't record %s into %s (its state machines aren't all registered)\n", BenchmarkScenarioText[scenario], options.m_record );
+		}
+	}
+
+	double seconds = 0.0;
+	for( unsigned int frame=0; frame<options.m_frames; ++frame )
+	{
+		g_time.MarkFixedStep();
+		g_telemetry.BeginFrame();
+
+		double start = GetBenchmarkSeconds();
+		g_database.Update();
+		seconds += GetBenchmarkSeconds() - start;
+	}
+	g_telemetry.BeginFrame();	//Completes the last frame
+
+	MemoryTracker::GetReport( end );
+	result.m_hotPathAllocs = end.m_numHotPathAllocs - after.m_numHotPathAllocs;
+	result.m_seconds = seconds;
+	result.m_messages = g_telemetry.GetTotal( TELEMETRY_MSGS_DELIVERED );
+	result.m_transitions = g_telemetry.GetTotal( TELEMETRY_STATE_CHANGES );
+	result.m_events = g_telemetry.GetTotal( TELEMETRY_EVENTS_PROCESSED );
+
+	delete recorder;
+	delete telemetry;
+	delete database;
+	delete msgroute;
+	delete debuglog;
+	delete time;
+	delete jobsystem;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         PrintResult
+
+  Description:  Prints the measurements of one scenario.
+
+  Arguments:    scenario : the scenario
+                options  : the command line options
+                result   : the measurements
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+static void PrintResult( BenchmarkScenario scenario, BenchmarkOptions & options, BenchmarkResult & result )
+{
+	double seconds = result.m_seconds > 0.0 ? result.m_seconds : 1.0e-9;
+	double nsPerEvent = result.m_events > 0.0 ? result.m_seconds * 1.0e9 / result.m_events : 0.0;
+
+	if( options.m_csv )
+	{
+		printf( "%s,%u,%u,%.6f,%.0f,%.0f,%.0f,%.1f,%.1f,%u\n", BenchmarkScenarioText[scenario], options.m_agents, options.m_frames,
+			result.m_seconds, result.m_messages / seconds, result.m_transitions / seconds, result.m_events / seconds, nsPerEvent, result.m_bytesPerAgent,
+			result.m_hotPathAllocs );
+	}
+	else
+	{
+		printf( "%-10s agents %u, frames %u, %.3f s\n", BenchmarkScenarioText[scenario], options.m_agents, options.m_frames, result.m_seconds );
+		printf( "           %12.0f messages/sec\n", result.m_messages / seconds );
+		printf( "           %12.0f transitions/sec\n", result.m_transitions / seconds );
+		printf( "           %12.1f ns per event (%.0f events)\n", nsPerEvent, result.m_events );
+		printf( "           %12.1f bytes per agent\n", result.m_bytesPerAgent );
+		MemoryReport report;
+		MemoryTracker::GetReport( report );		//For the tag names
+		for( unsigned int i=0; i<MEMORY_NUM_TAGS; ++i )
+		{
+			if( result.m_tagBytesPerAgent[i] != 0.0 ) {
+				printf( "           %12.1f   %s\n", result.m_tagBytesPerAgent[i], report.m_tags[i].m_name );
+			}
+		}
+		printf( "           %12u allocations in the measured updates\n", result.m_hotPathAllocs );
+	}
+}
+
+static bool ParseOptions( int argc, char** argv, BenchmarkOptions & options )
+{
+	options.m_agents = 10000;
+	options.m_frames = 600;
+	options.m_workers = 0;
+	options.m_scenario = -1;
+	options.m_scheduler = MSG_SCHEDULER_HEAP;
+	options.m_batched = false;
+	options.m_parallel = false;
+	options.m_sortInterval = 0;
+	options.m_csv = false;
+	options.m_record = 0;
+
+	for( int i=1; i<argc; ++i )
+	{
+		bool hasValue = i+1 < argc;
+		if( strcmp( argv[i], "-agents" ) == 0 && hasValue )			{ options.m_agents = (unsigned int)atoi( argv[++i] ); }
+		else if( strcmp( argv[i], "-frames" ) == 0 && hasValue )	{ options.m_frames = (unsigned int)atoi( argv[++i] ); }
+		else if( strcmp( argv[i], "-workers" ) == 0 && hasValue )	{ options.m_workers = (unsigned int)atoi( argv[++i] ); }
+		else if( strcmp( argv[i], "-parallel" ) == 0 )				{ options.m_parallel = true; }
+		else if( strcmp( argv[i], "-batched" ) == 0 )				{ options.m_batched = true; }
+		else if( strcmp( argv[i], "-sortupdate" ) == 0 && hasValue )	{ options.m_sortInterval = (unsigned int)atoi( argv[++i] ); }
+		else if( strcmp( argv[i], "-csv" ) == 0 )					{ options.m_csv = true; }
+		else if( strcmp( argv[i], "-record" ) == 0 && hasValue )	{ options.m_record = argv[++i]; }
+		else if( strcmp( argv[i], "-scheduler" ) == 0 && hasValue )
+		{
+			++i;
+			if( strcmp( argv[i], "list" ) == 0 )		{ options.m_scheduler = MSG_SCHEDULER_LIST; }
+			else if( strcmp( argv[i], "heap" ) == 0 )	{ options.m_scheduler = MSG_SCHEDULER_HEAP; }
+			else										{ return( false ); }
+		}
+		else if( strcmp( argv[i], "-scenario" ) == 0 && hasValue )
+		{
+			++i;
+			options.m_scenario = -2;
+			if( strcmp( argv[i], "all" ) == 0 ) {
+				options.m_scenario = -1;
+			}
+			for( int s=0; s<BENCHMARK_NUM_SCENARIOS; ++s )
+			{
+				if( strcmp( argv[i], BenchmarkScenarioText[s] ) == 0 ) {
+					options.m_scenario = s;
+				}
+			}
+			if( options.m_scenario == -2 ) {
+				return( false );
+			}
+		}
+		else
+		{
+			return( false );
+		}
+	}
+
+	//A recording holds one scenario
+	return( options.m_agents >= 2 && options.m_frames > 0 && ( !options.m_record || options.m_scenario >= 0 ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RunReplay
+
+  Description:  Replays a message recording headless, as fast as possible,
+                and reports whether it matched.
+
+  Arguments:    argc, argv : the command line (-replay file [-workers W] [-parallel])
+
+  Returns:      0 if the replay matched the recording, 2 if it diverged, 
+                1 if the recording couldn't be replayed.
+ *---------------------------------------------------------------------------*/
+static int RunReplay( int argc, char** argv )
+{
+	unsigned int workers = 0;
+	bool parallel = false;
+	for( int i=3; i<argc; ++i )
+	{
+		if( strcmp( argv[i], "-workers" ) == 0 && i+1 < argc )	{ workers = (unsigned int)atoi( argv[++i] ); }
+		else if( strcmp( argv[i], "-parallel" ) == 0 )			{ parallel = true; }
+	}
+
+	Time* time = new Time();
+	Database* database = new Database();
+	MsgRoute* msgroute = new MsgRoute();
+	DebugLog* debuglog = new DebugLog();
+	JobSystem* jobsystem = new JobSystem( workers );
+	FrameTelemetry* telemetry = new FrameTelemetry();
+	MsgRecorder* recorder = new MsgRecorder();
+
+	msgroute->SetLoadBalancingConstraint( 0.0f );	//Deliver everything that is due, as the recording presumably did
+	debuglog->SetSampleRate( 0 );
+	debuglog->SetEchoToOutput( false );
+	database->SetParallelUpdate( parallel );
+
+	int result = 1;
+	if( recorder->StartReplay( argv[2] ) )
+	{
+		double seconds = 0.0;
+		while( recorder->MarkReplayedStep() )
+		{
+			g_telemetry.BeginFrame();
+
+			double start = GetBenchmarkSeconds();
+			g_database.Update();
+			seconds += GetBenchmarkSeconds() - start;
+		}
+		g_telemetry.BeginFrame();	//Completes the last frame
+
+		printf( "replay     frames %u, %.3f s, %.0f messages delivered\n", recorder->GetNumReplayFrames(), seconds, g_telemetry.GetTotal( TELEMETRY_MSGS_DELIVERED ) );
+		if( recorder->GetNumDivergences() > 0 ) {
+			printf( "           %u frames diverged, the first is frame %d\n", recorder->GetNumDivergences(), recorder->GetFirstDivergentFrame() );
+			result = 2;
+		}
+		else {
+			printf( "           matches the recording\n" );
+			result = 0;
+		}
+	}
+	else
+	{
+		printf( "Can't replay %s (missing, from another version, or its state machines aren't registered)\n", argv[2] );
+	}
+
+	delete recorder;
+	delete telemetry;
+	delete database;
+	delete msgroute;
+	delete debuglog;
+	delete time;
+	delete jobsystem;
+	return( result );
+}
+
+
+int main( int argc, char** argv )
+{
+	COMPILE_TIME_ASSERT( sizeof( BenchmarkScenarioText ) / sizeof( BenchmarkScenarioText[0] ) == BENCHMARK_NUM_SCENARIOS, benchmark_scenario_names_must_match_enum );
+
+	if( argc > 1 && strcmp( argv[1], "-msgroute" ) == 0 ) {
+		return( RunMsgRouteBenchmark( argc, argv ) );
+	}
+	if( argc > 2 && strcmp( argv[1], "-replay" ) == 0 ) {
+		return( RunReplay( argc, argv ) );
+	}
+
+	BenchmarkOptions options;
+	if( !ParseOptions( argc, argv, options ) )
+	{
+		printf( "Usage: %s [-agents N] [-frames F] [-scenario pingpong|timers|chain|broadcast|all]\n", argv[0] );
+		printf( "       [-scheduler list|heap] [-batched] [-workers W] [-parallel] [-csv] [-sortupdate N]\n" );
+		printf( "       [-record file (one scenario)]\n" );
+		printf( "   or: %s -msgroute [options] (delayed message scaling, -msgroute -help for the options)\n", argv[0] );
+		printf( "   or: %s -replay file [-workers W] [-parallel] (replays a recording headless)\n", argv[0] );
+		return( 1 );
+	}
+
+	if( options.m_csv ) {
+		printf( "scenario,agents,frames,seconds,messages_per_sec,transitions_per_sec,events_per_sec,ns_per_event,bytes_per_agent,hot_path_allocs\n" );
+	}
+
+	int exitCode = 0;
+	for( int s=0; s<BENCHMARK_NUM_SCENARIOS; ++s )
+	{
+		if( options.m_scenario < 0 || options.m_scenario == s )
+		{
+			BenchmarkResult result;
+			RunScenario( (BenchmarkScenario)s, options, result );
+			PrintResult( (BenchmarkScenario)s, options, result );
+
+			//Once warmed up, a frame should only use storage it has already grown.
+			//(A recording writes out as it goes, so it isn't held to this.)
+			if( result.m_hotPathAllocs != 0 && !options.m_record )
+			{
+				fprintf( stderr, "FAILED: %s made %u heap allocations in the measured updates (expected 0)\n", 
+					BenchmarkScenarioText[s], result.m_hotPathAllocs );
+				exitCode = 2;
+			}
+		}
+	}
+
+	return( exitCode );
+}
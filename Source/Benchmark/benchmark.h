@@ -0,0 +1,19 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+#pragma once
+
+#include "global.h"
+
+
+//Shared by the benchmarks
+double GetBenchmarkSeconds( void );		//Wall clock, from the performance counter
+
+//Delayed message scaling benchmark (StateMachineBenchmark -msgroute ...)
+int RunMsgRouteBenchmark( int argc, char** argv );
@@ -0,0 +1,233 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "benchmarkmachines.h"
+#include "snapshot.h"
+
+
+//Add new states here
+enum StateName {
+	STATE_Initialize,	//Note: the first enum is the starting state
+	STATE_Running,
+	STATE_Chain1,
+	STATE_Chain2,
+	STATE_Chain3,
+	STATE_Chain4,
+	STATE_Chain5,
+	STATE_Chain6,
+	STATE_Chain7,
+	STATE_Chain8,
+	STATE_Chain9,
+	STATE_Chain10
+};
+
+//Add new substates here
+enum SubstateName {
+	//empty
+};
+
+
+//So benchmark runs can be recorded and replayed (see StateMachineBenchmark -record). The
+//ping pong members only matter on entering the first state, which a snapshot is past; 
+//the broadcast machines keep their role in a member, so they can't be restored.
+static StateMachine * CreateBenchmarkPingPong( GameObject & object ) { return( new BenchmarkPingPong( object, INVALID_OBJECT_ID, false ) ); }
+static StateMachineRegistration stateMachineRegistrationBenchmarkPingPong( typeid( BenchmarkPingPong ).name(), CreateBenchmarkPingPong );
+REGISTER_STATE_MACHINE( BenchmarkTimerStorm )
+REGISTER_STATE_MACHINE( BenchmarkChain )
+REGISTER_STATE_MACHINE( BenchmarkReceiver )
+
+
+bool BenchmarkPingPong::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
+{
+BeginStateMachine
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Initialize )
+
+		OnEnter
+			if( m_initiator ) {
+				SendMsg( MSG_BenchmarkPing, m_partner );
+			}
+			ChangeState( STATE_Running );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Running )
+
+		OnMsg( MSG_BenchmarkPing )
+			SendMsg( MSG_BenchmarkPong, msg->GetSender() );
+
+		OnMsg( MSG_BenchmarkPong )
+			SendMsg( MSG_BenchmarkPing, msg->GetSender() );
+
+
+EndStateMachine
+}
+
+
+bool BenchmarkTimerStorm::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
+{
+BeginStateMachine
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Initialize )
+
+		OnEnter
+			ChangeState( STATE_Running );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Running )
+
+		OnEnter
+			SetTimerState( 0.05f, MSG_BenchmarkTimer );
+			SetTimerState( 0.1f, MSG_BenchmarkTimer2 );
+			SetTimerState( 0.25f, MSG_BenchmarkTimer3 );
+
+		OnMsg( MSG_BenchmarkTimer )
+			//Nothing to do - the delivery is what is measured
+
+		OnMsg( MSG_BenchmarkTimer2 )
+			//Nothing to do
+
+		OnMsg( MSG_BenchmarkTimer3 )
+			//Nothing to do
+
+
+EndStateMachine
+}
+
+
+bool BenchmarkChain::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
+{
+BeginStateMachine
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Initialize )
+
+		OnEnter
+			ChangeState( STATE_Chain1 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain1 )
+
+		OnUpdate
+			ChangeState( STATE_Chain2 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain2 )
+
+		OnEnter
+			ChangeState( STATE_Chain3 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain3 )
+
+		OnEnter
+			ChangeState( STATE_Chain4 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain4 )
+
+		OnEnter
+			ChangeState( STATE_Chain5 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain5 )
+
+		OnEnter
+			ChangeState( STATE_Chain6 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain6 )
+
+		OnEnter
+			ChangeState( STATE_Chain7 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain7 )
+
+		OnEnter
+			ChangeState( STATE_Chain8 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain8 )
+
+		OnEnter
+			ChangeState( STATE_Chain9 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain9 )
+
+		OnEnter
+			ChangeState( STATE_Chain10 );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain10 )
+
+		OnUpdate
+			ChangeState( STATE_Chain1 );	//Next update, to stay under the state change limit of a single update
+
+
+EndStateMachine
+}
+
+
+bool BenchmarkBroadcast::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
+{
+BeginStateMachine
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Initialize )
+
+		OnEnter
+			ChangeState( STATE_Running );
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Running )
+
+		OnUpdate
+			if( m_broadcaster ) {
+				SendMsgBroadcastNow( MSG_BenchmarkBroadcast, OBJECT_NPC );
+			}
+
+		OnMsg( MSG_BenchmarkBroadcast )
+			//Nothing to do - the delivery is what is measured
+
+
+EndStateMachine
+}
+
+
+bool BenchmarkReceiver::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
+{
+BeginStateMachine
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Initialize )
+
+		OnMsg( MSG_BenchmarkPing )
+			//Nothing to do - the delivery is what is measured
+
+
+EndStateMachine
+}
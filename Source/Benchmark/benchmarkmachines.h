@@ -0,0 +1,105 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "statemch.h"
+
+
+//Message ping-pong between two objects (one message in flight per pair)
+class BenchmarkPingPong : public StateMachine
+{
+public:
+
+	BenchmarkPingPong( GameObject & object, objectID partner, bool initiator )
+		: StateMachine( object ), m_partner( partner ), m_initiator( initiator ) {}
+	~BenchmarkPingPong( void ) {}
+
+
+private:
+
+	virtual bool States( State_Machine_Event event, MSG_Object * msg, int state, int substate );
+
+	//Put state variables here
+	objectID m_partner;
+	bool m_initiator;
+
+};
+
+
+//Several repeating timers per object
+class BenchmarkTimerStorm : public StateMachine
+{
+public:
+
+	BenchmarkTimerStorm( GameObject & object )
+		: StateMachine( object ) {}
+	~BenchmarkTimerStorm( void ) {}
+
+
+private:
+
+	virtual bool States( State_Machine_Event event, MSG_Object * msg, int state, int substate );
+
+};
+
+
+//Chain of ten states, walked through by immediate state changes
+class BenchmarkChain : public StateMachine
+{
+public:
+
+	BenchmarkChain( GameObject & object )
+		: StateMachine( object ) {}
+	~BenchmarkChain( void ) {}
+
+
+private:
+
+	virtual bool States( State_Machine_Event event, MSG_Object * msg, int state, int substate );
+
+};
+
+
+//A few broadcasters send to all NPCs every update; everyone receives
+class BenchmarkBroadcast : public StateMachine
+{
+public:
+
+	BenchmarkBroadcast( GameObject & object, bool broadcaster )
+		: StateMachine( object ), m_broadcaster( broadcaster ) {}
+	~BenchmarkBroadcast( void ) {}
+
+
+private:
+
+	virtual bool States( State_Machine_Event event, MSG_Object * msg, int state, int substate );
+
+	//Put state variables here
+	bool m_broadcaster;
+
+};
+
+
+//Receives delayed messages and does nothing with them
+class BenchmarkReceiver : public StateMachine
+{
+public:
+
+	BenchmarkReceiver( GameObject & object )
+		: StateMachine( object ) {}
+	~BenchmarkReceiver( void ) {}
+
+
+private:
+
+	virtual bool States( State_Machine_Event event, MSG_Object * msg, int state, int substate );
+
+};
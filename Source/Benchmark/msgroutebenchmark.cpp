@@ -0,0 +1,365 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "benchmark.h"
+#include "benchmarkmachines.h"
+#include "time.h"
+#include "database.h"
+#include "msgroute.h"
+#include "debuglog.h"
+#include "jobsystem.h"
+#include "gameobject.h"
+#include <vector>
+
+//Scaling benchmark of the delayed message queue. For each scheduler backend,
+//delay distribution and queue size (powers of ten) the queue is filled, then a
+//sample of RemoveMsg and PurgeScopedMsg calls is timed, then the game time is
+//stepped until everything has been delivered. One CSV line per case on stdout.
+//
+//Usage: StateMachineBenchmark -msgroute [-min N] [-max N] [-listmax N]
+//                             [-scheduler list|heap|all] [-distribution name|all]
+
+
+#define MSGROUTE_BENCHMARK_RECEIVERS (1024)		//Messages are spread over this many objects
+#define MSGROUTE_BENCHMARK_SENDERS (16)			//Each receiver gets messages from this many senders
+#define MSGROUTE_BENCHMARK_SCOPED_RATIO (4)		//One message in this many is scoped to the state
+#define MSGROUTE_BENCHMARK_HORIZON (10.0f)		//Seconds over which the delays are spread
+#define MSGROUTE_BENCHMARK_BURSTS (10)			//Bursty: number of bursts within the horizon
+#define MSGROUTE_BENCHMARK_REMOVE_CALLS (1000)		//At most (about 1% of the messages are removed)
+#define MSGROUTE_BENCHMARK_PURGE_CALLS (256)		//At most
+#define MSGROUTE_BENCHMARK_STEP (1.0 / 60.0)
+
+enum MsgRouteDistribution {
+	MSGROUTE_UNIFORM,				//Evenly spread over the horizon
+	MSGROUTE_BURSTY,				//90% in a few short bursts (for example a wave of timers started together)
+	MSGROUTE_NEXT_FRAME_HEAVY,		//70% due next frame (the SendMsg default), the rest spread out
+
+	MSGROUTE_NUM_DISTRIBUTIONS
+};
+
+static const char* MsgRouteDistributionText[] =
+{
+	"uniform",
+	"bursty",
+	"nextframe"
+};
+
+static const char* MsgSchedulerText[] =
+{
+	"list",
+	"heap"
+};
+
+struct MsgRouteBenchmarkOptions
+{
+	unsigned int m_min;
+	unsigned int m_max;
+	unsigned int m_listMax;			//The list backend has O(n) inserts, so the large sizes take hours
+	int m_scheduler;				//-1 = all
+	int m_distribution;				//-1 = all
+};
+
+struct MsgRouteBenchmarkResult
+{
+	double m_sendSeconds;
+	unsigned int m_removeCalls;
+	double m_removeSeconds;
+	unsigned int m_removed;
+	unsigned int m_purgeCalls;
+	double m_purgeSeconds;
+	unsigned int m_purged;
+	double m_deliverSeconds;
+	unsigned int m_delivered;
+	unsigned int m_frames;
+	double m_maxFrameSeconds;
+	unsigned int m_capacity;		//Pool capacity after filling (messages)
+	unsigned int m_poolBytes;		//Pool storage after filling
+};
+
+
+//Deterministic random numbers, so every backend sees the same delays
+static unsigned int NextRandom( unsigned int & seed )
+{
+	seed = seed * 1664525 + 1013904223;
+	return( seed >> 8 );
+}
+
+static float NextRandomFloat( unsigned int & seed )
+{
+	return( (float)NextRandom( seed ) / (float)( 1 << 24 ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         MakeDelays
+
+  Description:  Creates the delays of the messages for a distribution.
+
+  Arguments:    distribution : how the delays are spread
+                count        : the number of messages
+                delays       : filled with the delays (seconds)
+
+  Returns:      None. (The result is stored in the delays argument.)
+ *---------------------------------------------------------------------------*/
+static void MakeDelays( MsgRouteDistribution distribution, unsigned int count, std::vector<float> & delays )
+{
+	unsigned int seed = 12345;
+	delays.resize( count );
+	for( unsigned int i=0; i<count; ++i )
+	{
+		float uniform = NEXT_FRAME + NextRandomFloat( seed ) * MSGROUTE_BENCHMARK_HORIZON;
+		switch( distribution )
+		{
+			case MSGROUTE_BURSTY:
+				if( NextRandom( seed ) % 10 != 0 )
+				{	//Within 2ms of the start of a burst
+					float burst = (float)( 1 + NextRandom( seed ) % MSGROUTE_BENCHMARK_BURSTS ) * MSGROUTE_BENCHMARK_HORIZON / (float)( MSGROUTE_BENCHMARK_BURSTS + 1 );
+					uniform = burst + NextRandomFloat( seed ) * 0.002f;
+				}
+				break;
+			case MSGROUTE_NEXT_FRAME_HEAVY:
+				if( NextRandom( seed ) % 10 < 7 ) {
+					uniform = NEXT_FRAME;
+				}
+				break;
+			default:
+				break;
+		}
+		delays[i] = uniform;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RunCase
+
+  Description:  Fills a new message router with delayed messages, then times
+                the removal calls and the delivery of the rest.
+
+  Arguments:    scheduler    : the scheduler backend
+                distribution : how the delays are spread
+                count        : the number of messages
+                result       : filled with the measurements
+
+  Returns:      None. (The result is stored in the result argument.)
+ *---------------------------------------------------------------------------*/
+static void RunCase( MsgSchedulerType scheduler, MsgRouteDistribution distribution, unsigned int count, MsgRouteBenchmarkResult & result )
+{
+	Time* time = new Time();
+	Database* database = new Database();
+	MsgRoute* msgroute = new MsgRoute( scheduler );
+	DebugLog* debuglog = new DebugLog();
+	JobSystem* jobsystem = new JobSystem( 1 );
+
+	msgroute->SetLoadBalancingConstraint( 0.0f );	//Deliver everything that is due
+	debuglog->SetSampleRate( 0 );
+	debuglog->SetEchoToOutput( false );
+	time->SetFixedTimestep( MSGROUTE_BENCHMARK_STEP );
+
+	objectID receivers[MSGROUTE_BENCHMARK_RECEIVERS];
+	for( unsigned int i=0; i<MSGROUTE_BENCHMARK_RECEIVERS; ++i )
+	{
+		char name[GAME_OBJECT_MAX_NAME_SIZE];
+		sprintf( name, "Receiver%u", i );
+		GameObject* receiver = new GameObject( g_database.GetNewObjectID(), OBJECT_Ignore_Type, name );
+		receiver->CreateStateMachineManager();
+		g_database.Store( *receiver );
+		receiver->GetStateMachineManager()->PushStateMachine( *new BenchmarkReceiver( *receiver ), STATE_MACHINE_QUEUE_0, TRUE );
+		receivers[i] = receiver->GetID();
+	}
+	g_time.MarkFixedStep();
+	g_database.Update();	//Starts the state machines
+
+	std::vector<float> delays;
+	MakeDelays( distribution, count, delays );
+
+	//SendMsg (the data makes every message unique, so none are dropped as duplicates)
+	double start = GetBenchmarkSeconds();
+	for( unsigned int i=0; i<count; ++i )
+	{
+		objectID receiver = receivers[i % MSGROUTE_BENCHMARK_RECEIVERS];
+		objectID sender = receivers[( i / MSGROUTE_BENCHMARK_RECEIVERS ) % MSGROUTE_BENCHMARK_SENDERS];
+		Scope_Rule rule = i % MSGROUTE_BENCHMARK_SCOPED_RATIO == 0 ? SCOPE_TO_STATE : SCOPE_TO_STATE_MACHINE;
+		MSG_Data data( (int)i );
+		g_msgroute.SendMsg( delays[i], MSG_BenchmarkPing, receiver, sender, rule, 0, STATE_MACHINE_QUEUE_0, data, false, false );
+	}
+	result.m_sendSeconds = GetBenchmarkSeconds() - start;
+	result.m_capacity = g_msgroute.GetDelayedMessageCapacity();
+	result.m_poolBytes = g_msgroute.GetDelayedMessageBytes();
+
+	//RemoveMsg (each call removes the messages of one receiver and sender pair)
+	result.m_removeCalls = count / 100 < MSGROUTE_BENCHMARK_REMOVE_CALLS ? count / 100 : MSGROUTE_BENCHMARK_REMOVE_CALLS;
+	unsigned int pending = g_msgroute.GetNumDelayedMessages();
+	start = GetBenchmarkSeconds();
+	for( unsigned int i=0; i<result.m_removeCalls; ++i )
+	{
+		objectID receiver = receivers[i % MSGROUTE_BENCHMARK_RECEIVERS];
+		objectID sender = receivers[( i / MSGROUTE_BENCHMARK_RECEIVERS ) % MSGROUTE_BENCHMARK_SENDERS];
+		g_msgroute.RemoveMsg( MSG_BenchmarkPing, receiver, sender, false );
+	}
+	result.m_removeSeconds = GetBenchmarkSeconds() - start;
+	result.m_removed = pending - g_msgroute.GetNumDelayedMessages();
+
+	//PurgeScopedMsg (from the last receivers, which RemoveMsg touched least)
+	result.m_purgeCalls = count / 100 < MSGROUTE_BENCHMARK_PURGE_CALLS ? count / 100 : MSGROUTE_BENCHMARK_PURGE_CALLS;
+	pending = g_msgroute.GetNumDelayedMessages();
+	start = GetBenchmarkSeconds();
+	for( unsigned int i=0; i<result.m_purgeCalls; ++i )
+	{
+		g_msgroute.PurgeScopedMsg( receivers[MSGROUTE_BENCHMARK_RECEIVERS - 1 - i], STATE_MACHINE_QUEUE_0 );
+	}
+	result.m_purgeSeconds = GetBenchmarkSeconds() - start;
+	result.m_purged = pending - g_msgroute.GetNumDelayedMessages();
+
+	//DeliverDelayedMessages, a frame at a time until the queue is empty
+	result.m_deliverSeconds = 0.0;
+	result.m_maxFrameSeconds = 0.0;
+	result.m_delivered = 0;
+	result.m_frames = 0;
+	unsigned int maxFrames = (unsigned int)( MSGROUTE_BENCHMARK_HORIZON / MSGROUTE_BENCHMARK_STEP ) + 2;
+	while( g_msgroute.GetNumDelayedMessages() > 0 && result.m_frames < maxFrames )
+	{
+		g_time.MarkFixedStep();
+
+		start = GetBenchmarkSeconds();
+		g_msgroute.DeliverDelayedMessages( g_frame );
+		double seconds = GetBenchmarkSeconds() - start;
+
+		result.m_deliverSeconds += seconds;
+		if( seconds > result.m_maxFrameSeconds ) {
+			result.m_maxFrameSeconds = seconds;
+		}
+		result.m_delivered += g_msgroute.GetNumDeliveredLastFrame();
+		result.m_frames++;
+	}
+
+	delete database;
+	delete msgroute;
+	delete debuglog;
+	delete time;
+	delete jobsystem;
+}
+
+static double PerCall( double seconds, unsigned int calls )
+{
+	return( calls > 0 ? seconds * 1.0e9 / (double)calls : 0.0 );
+}
+
+static bool ParseMsgRouteOptions( int argc, char** argv, MsgRouteBenchmarkOptions & options )
+{
+	options.m_min = 1000;
+	options.m_max = 1000000;
+	options.m_listMax = 100000;
+	options.m_scheduler = -1;
+	options.m_distribution = -1;
+
+	for( int i=2; i<argc; ++i )		//argv[1] is -msgroute
+	{
+		bool hasValue = i+1 < argc;
+		if( strcmp( argv[i], "-min" ) == 0 && hasValue )			{ options.m_min = (unsigned int)atoi( argv[++i] ); }
+		else if( strcmp( argv[i], "-max" ) == 0 && hasValue )		{ options.m_max = (unsigned int)atoi( argv[++i] ); }
+		else if( strcmp( argv[i], "-listmax" ) == 0 && hasValue )	{ options.m_listMax = (unsigned int)atoi( argv[++i] ); }
+		else if( strcmp( argv[i], "-scheduler" ) == 0 && hasValue )
+		{
+			++i;
+			options.m_scheduler = strcmp( argv[i], "all" ) == 0 ? -1 : -2;
+			for( int s=0; s<=MSG_SCHEDULER_HEAP; ++s )
+			{
+				if( strcmp( argv[i], MsgSchedulerText[s] ) == 0 ) {
+					options.m_scheduler = s;
+				}
+			}
+			if( options.m_scheduler == -2 ) {
+				return( false );
+			}
+		}
+		else if( strcmp( argv[i], "-distribution" ) == 0 && hasValue )
+		{
+			++i;
+			options.m_distribution = strcmp( argv[i], "all" ) == 0 ? -1 : -2;
+			for( int d=0; d<MSGROUTE_NUM_DISTRIBUTIONS; ++d )
+			{
+				if( strcmp( argv[i], MsgRouteDistributionText[d] ) == 0 ) {
+					options.m_distribution = d;
+				}
+			}
+			if( options.m_distribution == -2 ) {
+				return( false );
+			}
+		}
+		else
+		{
+			return( false );
+		}
+	}
+
+	return( options.m_min > 0 && options.m_min <= options.m_max );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RunMsgRouteBenchmark
+
+  Description:  Runs every requested case and prints the results as CSV. The
+                per call columns are in nanoseconds.
+
+  Arguments:    argc, argv : the command line (starting with -msgroute)
+
+  Returns:      The process exit code.
+ *---------------------------------------------------------------------------*/
+int RunMsgRouteBenchmark( int argc, char** argv )
+{
+	COMPILE_TIME_ASSERT( sizeof( MsgRouteDistributionText ) / sizeof( MsgRouteDistributionText[0] ) == MSGROUTE_NUM_DISTRIBUTIONS, msgroute_distribution_names_must_match_enum );
+	COMPILE_TIME_ASSERT( sizeof( MsgSchedulerText ) / sizeof( MsgSchedulerText[0] ) == MSG_SCHEDULER_HEAP + 1, scheduler_names_must_match_enum );
+
+	MsgRouteBenchmarkOptions options;
+	if( !ParseMsgRouteOptions( argc, argv, options ) )
+	{
+		printf( "Usage: %s -msgroute [-min N] [-max N] [-listmax N]\n", argv[0] );
+		printf( "       [-scheduler list|heap|all] [-distribution uniform|bursty|nextframe|all]\n" );
+		printf( "Queue sizes go from min to max in powers of ten (the list backend stops at listmax).\n" );
+		return( 1 );
+	}
+
+	printf( "scheduler,distribution,messages,send_ns,remove_calls,remove_ns,removed,purge_calls,purge_ns,purged,"
+			"delivered,deliver_ns,frames,max_frame_ms,pool_capacity,pool_bytes_per_msg\n" );
+
+	for( int s=0; s<=MSG_SCHEDULER_HEAP; ++s )
+	{
+		if( options.m_scheduler >= 0 && options.m_scheduler != s ) {
+			continue;
+		}
+
+		for( int d=0; d<MSGROUTE_NUM_DISTRIBUTIONS; ++d )
+		{
+			if( options.m_distribution >= 0 && options.m_distribution != d ) {
+				continue;
+			}
+
+			for( double count=options.m_min; count<=options.m_max; count*=10.0 )
+			{
+				if( s == MSG_SCHEDULER_LIST && count > options.m_listMax ) {
+					break;
+				}
+
+				MsgRouteBenchmarkResult result;
+				RunCase( (MsgSchedulerType)s, (MsgRouteDistribution)d, (unsigned int)count, result );
+
+				printf( "%s,%s,%u,%.1f,%u,%.1f,%u,%u,%.1f,%u,%u,%.1f,%u,%.3f,%u,%.1f\n", MsgSchedulerText[s], MsgRouteDistributionText[d], (unsigned int)count,
+					PerCall( result.m_sendSeconds, (unsigned int)count ),
+					result.m_removeCalls, PerCall( result.m_removeSeconds, result.m_removeCalls ), result.m_removed,
+					result.m_purgeCalls, PerCall( result.m_purgeSeconds, result.m_purgeCalls ), result.m_purged,
+					result.m_delivered, PerCall( result.m_deliverSeconds, result.m_delivered ), result.m_frames,
+					result.m_maxFrameSeconds * 1000.0, result.m_capacity, (double)result.m_poolBytes / count );
+				fflush( stdout );
+			}
+		}
+	}
+
+	return( 0 );
+}
@@ -0,0 +1,26 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+//Stand-in for the DXUT precompiled header in the headless library build.
+//The engine source files include "DXUT.h" first; with this directory on the
+//include path they get the plain Windows headers instead of DXUT/Direct3D.
+
+#ifndef STATE_MACHINE_HEADLESS
+#error "Headless\DXUT.h is only for builds with STATE_MACHINE_HEADLESS defined"
+#endif
+
+#include <windows.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
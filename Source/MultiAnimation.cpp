@@ -19,6 +19,7 @@
 #include "body.h"
 #include "statemch.h"
 #include "database.h"
+#include "stateinspector.h"
 #include "global.h"
 #pragma warning(default: 4995)
 
@@ -29,6 +30,8 @@ using namespace std;
 
 #define TXFILE_FLOOR L"floor.jpg"
 #define FLOOR_TILECOUNT 2
+#define INSPECTOR_ROWS_PER_PAGE 40
+#define INSPECTOR_CAPACITY 4096
 
 
 //--------------------------------------------------------------------------------------
@@ -55,6 +58,8 @@ bool                    g_bPlaySounds = true;   // whether to play sounds
 double                  g_fLastAnimTime = 0.0;  // Time for the animations
 
 World*					g_pWorld = NULL;		// World object
+DWORD                   g_dwInspectorPage = 0;  // page of the state overlay
+DWORD                   g_dwInspectorFilter = STATE_INSPECTOR_NO_MACHINE;	// state machine class shown by the overlay (all of them if none)
 
 
 
@@ -196,6 +201,7 @@ void InitApp()
 	// Create the World
 	g_pWorld = new World();
 	g_pWorld->InitializeSingletons();
+	g_pWorld->CreateStateInspector( "StateMachineInspector", INSPECTOR_CAPACITY );	// external viewers map it by this name
 
     // Setup the camera with view matrix
     D3DXVECTOR3 vEye( .5f, .55f, -.4f );
@@ -587,7 +593,7 @@ void CALLBACK OnFrameRender( IDirect3DDevice9* pd3dDevice, double fTime, float f
             // set follow transforms
             CTiny * pChar = g_v_pCharacters[ g_dwFollow ];
 
-            D3DXVECTOR3 vCharPos = pChar->GetOwner()->GetBody().GetPos();
+            D3DXVECTOR3 vCharPos = pChar->GetOwner()->GetBody().GetRenderPos();
             D3DXVECTOR3 vCharFacing = pChar->GetOwner()->GetBody().GetDir();
             vEye = D3DXVECTOR3  ( vCharPos.x, 0.25f, vCharPos.z );
             D3DXVECTOR3 vAt     ( vCharPos.x, 0.0125f, vCharPos.z ),
@@ -697,49 +703,58 @@ void RenderText()
     //txtHelper.DrawFormattedTextLine( L"  Number of models: %d", g_v_pCharacters.size() );
 
 	
-	// Print out states
-    txtHelper.SetForegroundColor( D3DXCOLOR( 1.0f, 0.0f, 0.0f, 1.0f ) );
-	dbCompositionList list;
-	g_database.ComposeList( list, OBJECT_Ignore_Type );
-	int starttext = 5;
-	int count = 0;
-	dbCompositionList::iterator i;
-	for( i=list.begin(); i!=list.end(); ++i )
+	// Print out states (one page of the inspector table, queue 0 only)
+	StateInspector* pInspector = g_pWorld->GetStateInspector();
+	if( pInspector && pInspector->IsOpen() )
 	{
-		StateMachine* pStateMachine = (*i)->GetStateMachineManager()->GetStateMachine(STATE_MACHINE_QUEUE_0);
-		if( pStateMachine )
+		const StateInspectorHeader* pHeader = pInspector->GetHeader();
+		unsigned int skip = g_dwInspectorPage * INSPECTOR_ROWS_PER_PAGE;
+		int starttext = 5;
+		int count = 0;
+		for( unsigned int r=0; r<pHeader->m_numRecords && count<INSPECTOR_ROWS_PER_PAGE; ++r )
 		{
-			char* name = (*i)->GetName();
-			char* statename = pStateMachine->GetCurrentStateNameString();
-			char* substatename = pStateMachine->GetCurrentSubstateNameString();
-			TCHAR* unicode_name = new TCHAR[strlen(name)+1];
-			TCHAR* unicode_statename = new TCHAR[strlen(statename)+1];
-			TCHAR* unicode_substatename = new TCHAR[strlen(substatename)+1];
-			mbstowcs(unicode_name, name, strlen(name)+1);
-			mbstowcs(unicode_statename, statename, strlen(statename)+1);
-			mbstowcs(unicode_substatename, substatename, strlen(substatename)+1);
+			const StateInspectorRecord* pRecord = pInspector->GetRecord( r );
+			if( pRecord->m_queue != 0 ||
+				( g_dwInspectorFilter != STATE_INSPECTOR_NO_MACHINE && pRecord->m_machine != g_dwInspectorFilter ) )
+			{
+				continue;
+			}
+			if( skip > 0 )
+			{
+				skip--;
+				continue;
+			}
+
+			// Names are narrow strings in the table (%S), so nothing is converted or allocated
+			const char* statename = pInspector->GetStateName( *pRecord );
+			const char* substatename = pInspector->GetSubstateName( *pRecord );
 			if( substatename[0] != 0 )
 			{
 				txtHelper.SetForegroundColor( D3DXCOLOR( 0.0f, 0.0f, 0.0f, 1.0f ) );
 				txtHelper.SetInsertionPos( 5, starttext-1+(12*count) );
-				txtHelper.DrawFormattedTextLine( L"%s:   %s, %s", unicode_name, unicode_statename, unicode_substatename );
+				txtHelper.DrawFormattedTextLine( L"%S:   %S, %S", pRecord->m_name, statename, substatename );
 				txtHelper.SetForegroundColor( D3DXCOLOR( 1.0f, 1.0f, 1.0f, 1.0f ) );
 				txtHelper.SetInsertionPos( 4, starttext+(12*count++) );
-				txtHelper.DrawFormattedTextLine( L"%s:   %s, %s", unicode_name, unicode_statename, unicode_substatename );
+				txtHelper.DrawFormattedTextLine( L"%S:   %S, %S", pRecord->m_name, statename, substatename );
 			}
 			else
 			{
 				txtHelper.SetForegroundColor( D3DXCOLOR( 0.0f, 0.0f, 0.0f, 1.0f ) );
 				txtHelper.SetInsertionPos( 4, starttext-1+(12*count) );
-				txtHelper.DrawFormattedTextLine( L"%s:   %s", unicode_name, unicode_statename );
+				txtHelper.DrawFormattedTextLine( L"%S:   %S", pRecord->m_name, statename );
 				txtHelper.SetForegroundColor( D3DXCOLOR( 1.0f, 1.0f, 1.0f, 1.0f ) );
 				txtHelper.SetInsertionPos( 5, starttext+(12*count++) );
-				txtHelper.DrawFormattedTextLine( L"%s:   %s", unicode_name, unicode_statename );
+				txtHelper.DrawFormattedTextLine( L"%S:   %S", pRecord->m_name, statename );
 			}
-			delete unicode_name;
-			delete unicode_statename;
-			delete unicode_substatename;
 		}
+
+		if( count == 0 && g_dwInspectorPage > 0 )
+			--g_dwInspectorPage;	// paged past the end
+
+		const StateInspectorMachine* pFilter = pInspector->GetMachine( g_dwInspectorFilter );
+		txtHelper.SetForegroundColor( D3DXCOLOR( 1.0f, 1.0f, 0.0f, 1.0f ) );
+		txtHelper.SetInsertionPos( 5, starttext+(12*count) );
+		txtHelper.DrawFormattedTextLine( L"Page %d, %S (PgUp/PgDn: page, F3: class)", g_dwInspectorPage + 1, pFilter ? pFilter->m_className : "all classes" );
 	}
 	
 
@@ -912,6 +927,32 @@ void CALLBACK KeyboardProc( UINT nChar, bool bKeyDown, bool bAltDown, void* pUse
 				g_database.SendMsgFromSystem( MSG_Reset );
 				break;
 
+            case VK_PRIOR:
+				if( g_dwInspectorPage > 0 )
+					--g_dwInspectorPage;
+				break;
+
+            case VK_NEXT:
+				++g_dwInspectorPage;
+				break;
+
+            case VK_F3:
+			{
+				// Cycle through the state machine classes seen so far, then all of them
+				StateInspector* pInspector = g_pWorld->GetStateInspector();
+				if( pInspector && pInspector->IsOpen() )
+				{
+					if( g_dwInspectorFilter == STATE_INSPECTOR_NO_MACHINE )
+						g_dwInspectorFilter = 0;
+					else
+						++g_dwInspectorFilter;
+					if( g_dwInspectorFilter >= pInspector->GetHeader()->m_numMachines )
+						g_dwInspectorFilter = STATE_INSPECTOR_NO_MACHINE;
+				}
+				g_dwInspectorPage = 0;
+				break;
+			}
+
         }
     }
 }
@@ -21,6 +21,7 @@
 #pragma warning( push, 3 )
 #pragma warning(disable:4786 4788)
 #include <vector>
+#include <string>
 #pragma warning( pop )
 #pragma warning(disable:4786 4788)
 
@@ -32,6 +33,12 @@
 //#define DEBUG_PS   // Uncomment this line to debug pixel shaders 
 
 
+#define MULTIANIM_CROWD_MAX_INSTANCES 256   // instances drawn by one crowd draw call
+#define MULTIANIM_POSE_CACHE_SIZE     64    // poses whose palettes are kept in a frame (see GetCachedPose())
+#define MULTIANIM_POSE_TRACKS         4     // instances blending more tracks than this compute their own
+#define MULTIANIM_POSE_WEIGHT_STEPS   16    // track weights are told apart in steps of 1/16
+
+
 
 
 //-----------------------------------------------------------------------------
@@ -84,6 +91,7 @@ private:
 //-----------------------------------------------------------------------------
 struct MultiAnimFrame : public D3DXFRAME
 {
+    DWORD               m_dwFlatIndex;     // position in CMultiAnim::m_v_pFlatFrames
 };
 
 
@@ -100,12 +108,18 @@ struct MultiAnimMC : public D3DXMESHCONTAINER
     LPDIRECT3DTEXTURE9 *m_apTextures;
     LPD3DXMESH          m_pWorkingMesh;
     D3DXMATRIX *        m_amxBoneOffsets;  // Bone offset matrices retrieved from pSkinInfo
-    D3DXMATRIX **       m_apmxBonePointers;  // Provides index to bone matrix lookup
+    DWORD *             m_adwBoneFrames;   // flat frame index of each bone, to look up its matrix
 
     DWORD               m_dwNumPaletteEntries;
     DWORD               m_dwMaxNumFaceInfls;
     DWORD               m_dwNumAttrGroups;
     LPD3DXBUFFER        m_pBufBoneCombos;
+    DWORD               m_dwPaletteBase;           // first of our palettes in an instance's palettes
+
+    // crowd rendering, set up by CMultiAnim::SetupCrowd()
+    LPDIRECT3DVERTEXDECLARATION9 m_pCrowdDecl;     // working mesh declaration plus the instance stream
+    D3DXATTRIBUTERANGE *m_aCrowdRanges;            // attribute table of the working mesh
+    DWORD               m_dwNumCrowdRanges;
 
     HRESULT SetupBonePtrs( D3DXFRAME * pFrameRoot );
 };
@@ -134,21 +148,79 @@ protected:
 
     LPD3DXEFFECT              m_pEffect;
     char *                    m_sTechnique;           // character rendering technique
-    DWORD                     m_dwWorkingPaletteSize;
-    D3DXMATRIX *              m_amxWorkingPalette;
 
     std::vector< CAnimInstance* >  m_v_pAnimInstances;     // must be at lesat 1; otherwise, clear all
+    std::vector< CAnimInstance* >  m_v_pInstancePool;       // instances created ahead of time (see ReserveInstances())
+    DWORD                     m_dwInstanceMaxTracks;  // limits of the instances' controllers (0 == as m_pAC)
+    DWORD                     m_dwInstanceMaxEvents;
 
     MultiAnimFrame *          m_pFrameRoot;           // shared between all instances
+    std::vector< MultiAnimFrame* > m_v_pFlatFrames;   // the hierarchy flattened, parents before children
+    std::vector< int >        m_v_iFlatParents;       // flat index of each frame's parent (-1 for a root)
+    std::vector< MultiAnimMC* > m_v_pSkinnedMCs;      // skinned mesh containers
+    DWORD                     m_dwPaletteSize;        // palette entries of an instance (see SetupPalettes())
     LPD3DXANIMATIONCONTROLLER m_pAC;                  // AC that all children clone from -- to clone clean, no keys
+    bool                      m_bSetsShared;          // the app has prepared the sets of m_pAC (see ReplaceAnimationSet())
 
     // useful data an app can retrieve
     float                     m_fBoundingRadius;
 
+    // keyframes compressed once and shared by every instance (see GetCompressedAnimationSet)
+    struct CompressedAnimSet
+    {
+        std::string           sName;
+        DWORD                 dwFlags;
+        FLOAT                 fCompression;
+        LPD3DXBUFFER          pBuf;
+    };
+    std::vector< CompressedAnimSet > m_v_CompressedSets;
+    WCHAR                     m_wszAnimCache[ MAX_PATH ];  // file the compressed sets are cached in ("" if none)
+    bool                      m_bAnimCacheDirty;           // sets were compressed that aren't in the file yet
+
+    // crowd rendering (see BeginCrowd()); m_pCrowdPalettes is NULL if the device can't do it
+    LPDIRECT3DTEXTURE9        m_pCrowdPalettes;       // bone palettes of the queued instances, a row each
+    LPDIRECT3DVERTEXBUFFER9   m_pCrowdRows;           // instance stream: texture coordinate of each row
+    std::vector< D3DXVECTOR4 > m_v_vCrowdStaging;     // palettes of the queued instances
+    DWORD                     m_dwCrowdRowTexels;     // texels in a row: all palettes of all containers
+    DWORD                     m_dwNumCrowdInstances;  // instances queued since the last flush
+    bool                      m_bCrowdActive;         // between BeginCrowd() and EndCrowd()
+
+    // model space palettes of the poses computed this frame (see GetCachedPose())
+    struct PoseKey
+    {
+        double                dQuantum;               // of the instances' time
+        LPD3DXANIMATIONSET    apSets[ MULTIANIM_POSE_TRACKS ];
+        LONG                  alTimes[ MULTIANIM_POSE_TRACKS ];
+        LONG                  alWeights[ MULTIANIM_POSE_TRACKS ];
+    };
+    struct PoseEntry
+    {
+        PoseKey               key;
+        bool                  bReady;                 // the palette is computed
+    };
+    PoseEntry                 m_aPoses[ MULTIANIM_POSE_CACHE_SIZE ];
+    DWORD                     m_dwNumPoses;
+    D3DXMATRIXA16 *           m_amxPoses;             // m_dwPaletteSize matrices per entry; NULL if no cache
+    CRITICAL_SECTION          m_csPoses;
+
 private:
 
             HRESULT           CreateInstance( CAnimInstance ** ppAnimInstance );
+            HRESULT           CloneController( LPD3DXANIMATIONCONTROLLER * ppAC );
             HRESULT           SetupBonePtrs( MultiAnimFrame * pFrame );
+            void              FlattenFrames( MultiAnimFrame * pFrame, int iParent );
+            void              SetupPalettes();
+            HRESULT           LoadMeshHierarchy( WCHAR sXPath[], CMultiAnimAllocateHierarchy *pAH, LPD3DXLOADUSERDATA pLUD );
+            HRESULT           LoadAnimCache();
+            HRESULT           SaveAnimCache();
+            void              ReleaseCompressedSets();
+            HRESULT           SetupCrowd();
+            void              ReleaseCrowd();
+            HRESULT           AddCrowdInstance( CAnimInstance * pAI );
+            HRESULT           FlushCrowd();
+            HRESULT           SetupPoseCache();
+            void              ReleasePoseCache();
+            const D3DXMATRIXA16 * GetCachedPose( CAnimInstance * pAI );
 
 public:
 
@@ -165,10 +237,25 @@ public:
             float             GetBoundingRadius();
 
     virtual HRESULT           CreateNewInstance( DWORD * pdwNewIdx );
+            void              SetInstanceLimits( DWORD dwMaxTracks, DWORD dwMaxEvents );
+            HRESULT           ReserveInstances( DWORD dwCount );
+
+            // the animation sets are shared by the instances (the controllers only hold track state)
+            void              GetAnimController( LPD3DXANIMATIONCONTROLLER * ppAC );
+            HRESULT           ReplaceAnimationSet( LPD3DXANIMATIONSET pASNew );
+            bool              AreAnimationSetsShared()                 { return m_bSetsShared; }
+            void              SetAnimationSetsShared()                 { m_bSetsShared = true; }
+
+            HRESULT           GetCompressedAnimationSet( LPD3DXKEYFRAMEDANIMATIONSET pAS, DWORD dwCompressionFlags, FLOAT fCompression, LPD3DXBUFFER * ppBufCompressed );
 
     virtual void              SetTechnique( char * sTechnique );
 
     virtual HRESULT           Draw();
+
+            bool              BeginCrowd();
+            HRESULT           EndCrowd();
+
+            void              ClearPoseCache();
 };
 
 
@@ -187,12 +274,20 @@ protected:
     CMultiAnim                *m_pMultiAnim;
     D3DXMATRIX                 m_mxWorld;
     LPD3DXANIMATIONCONTROLLER  m_pAC;
+    D3DXMATRIXA16 *            m_amxLocal;       // frame transforms animated by m_pAC (per flat frame)
+    D3DXMATRIXA16 *            m_amxCombined;    // frame transforms in world space (per flat frame)
+    D3DXMATRIXA16 *            m_amxPalette;     // skinning matrices (see CMultiAnim::SetupPalettes())
+    D3DXMATRIXA16 *            m_amxPalettePrev; // the last two reduced rate updates, in model space
+    D3DXMATRIXA16 *            m_amxPaletteNext; // (see UpdateTransformsBlended())
+    double                     m_dPoseQuantum;   // time step of the poses shared with other instances (0 == none)
 
 private:
 
     virtual HRESULT     Setup( LPD3DXANIMATIONCONTROLLER pAC );
-    virtual void        UpdateFrames( MultiAnimFrame * pFrame, D3DXMATRIX * pmxBase );
-    virtual void        DrawFrames( MultiAnimFrame * pFrame );
+            void        ReleaseTransforms();
+    virtual void        UpdateFrames( const D3DXMATRIX * pmxRoot );
+    virtual void        UpdatePalettes( D3DXMATRIXA16 * amxPalette );
+    virtual void        DrawFrames();
     virtual void        DrawMeshFrame( MultiAnimFrame * pFrame );
 
 public:
@@ -207,8 +302,13 @@ public:
 
             D3DXMATRIX  GetWorldTransform();
             void        SetWorldTransform( const D3DXMATRIX * pmxWorld );
+            void        SetPoseQuantum( double dQuantum );
 
     virtual HRESULT     AdvanceTime( DOUBLE dTimeDelta, ID3DXAnimationCallbackHandler * pCH );
+    virtual HRESULT     AdvanceAnimation( DOUBLE dTimeDelta, ID3DXAnimationCallbackHandler * pCH );
+    virtual void        UpdateTransforms();
+    virtual void        UpdateTransformsBlended( bool bRestart );
+    virtual void        BlendPalettes( float fAlpha );
     virtual HRESULT     ResetTime();
     virtual HRESULT     Draw();
 };
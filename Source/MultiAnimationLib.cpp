@@ -15,23 +15,123 @@
 using namespace std;
 
 
+#define MULTIANIM_ANIM_CACHE_MAGIC   0x4341414D   // "MAAC"
+#define MULTIANIM_ANIM_CACHE_VERSION 1
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: GetCachePath()
+// Desc: Builds the path of a cache file for an X file: its file name with a
+//       suffix, in the working directory (the media folder may be read-only).
+//-----------------------------------------------------------------------------
+static void GetCachePath( WCHAR sCache[], const WCHAR sXPath[], const WCHAR sSuffix[] )
+{
+    const WCHAR * sName = sXPath;
+    for( const WCHAR * p = sXPath; * p; ++ p )
+    {
+        if( * p == L'\\' || * p == L'/' || * p == L':' )
+            sName = p + 1;
+    }
+
+    StringCchCopy( sCache, MAX_PATH, sName );
+    StringCchCat( sCache, MAX_PATH, sSuffix );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: IsCacheCurrent()
+// Desc: A cache file can be used if it was written after its source file.
+//-----------------------------------------------------------------------------
+static bool IsCacheCurrent( const WCHAR sCache[], const WCHAR sSource[] )
+{
+    WIN32_FILE_ATTRIBUTE_DATA cache, source;
+    if( !GetFileAttributesEx( sCache, GetFileExInfoStandard, & cache ) ||
+        !GetFileAttributesEx( sSource, GetFileExInfoStandard, & source ) )
+        return false;
+
+    return CompareFileTime( & cache.ftLastWriteTime, & source.ftLastWriteTime ) >= 0;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: MapCacheFile()
+// Desc: Maps a cache file into memory (read only).  UnmapCacheFile() releases
+//       the view and handles.
+//-----------------------------------------------------------------------------
+static HRESULT MapCacheFile( const WCHAR sPath[], HANDLE * phFile, HANDLE * phMapping, LPCVOID * ppView, DWORD * pdwSize )
+{
+    * phMapping = NULL;
+    * ppView = NULL;
+
+    * phFile = CreateFile( sPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if( * phFile == INVALID_HANDLE_VALUE )
+        return E_FAIL;
+
+    * pdwSize = GetFileSize( * phFile, NULL );
+    if( * pdwSize > 0 && * pdwSize != INVALID_FILE_SIZE )
+    {
+        * phMapping = CreateFileMapping( * phFile, NULL, PAGE_READONLY, 0, 0, NULL );
+        if( * phMapping )
+            * ppView = MapViewOfFile( * phMapping, FILE_MAP_READ, 0, 0, 0 );
+    }
+
+    return * ppView ? S_OK : E_FAIL;
+}
+
+static void UnmapCacheFile( HANDLE hFile, HANDLE hMapping, LPCVOID pView )
+{
+    if( pView )
+        UnmapViewOfFile( pView );
+    if( hMapping )
+        CloseHandle( hMapping );
+    if( hFile != INVALID_HANDLE_VALUE )
+        CloseHandle( hFile );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: ReplaceControllerSet()
+// Desc: Replaces the animation set of the same name as pASNew in one
+//       controller (see CMultiAnim::ReplaceAnimationSet()).
+//-----------------------------------------------------------------------------
+static HRESULT ReplaceControllerSet( LPD3DXANIMATIONCONTROLLER pAC, LPD3DXANIMATIONSET pASNew )
+{
+    LPD3DXANIMATIONSET pASOld = NULL;
+    if( SUCCEEDED( pAC->GetAnimationSetByName( pASNew->GetName(), & pASOld ) ) )
+    {
+        pAC->UnregisterAnimationSet( pASOld );
+        pASOld->Release();
+    }
+
+    return pAC->RegisterAnimationSet( pASNew );
+}
+
+
 //-----------------------------------------------------------------------------
 // Name: MultiAnimMC::SetupBonePtrs()
-// Desc: Initialize the m_apmxBonePointers member to point to the bone matrices
-//       so that we can access the bones by index easily.  Called from
-//       CMultiAnim::SetupBonePtrs().
+// Desc: Initialize the m_adwBoneFrames member to the flat indices of the bone
+//       frames so that we can access the bones by index easily.  Called from
+//       CMultiAnim::SetupBonePtrs(), after the frames are flattened.
 //-----------------------------------------------------------------------------
 HRESULT MultiAnimMC::SetupBonePtrs( D3DXFRAME * pFrameRoot )
 {
     if( pSkinInfo )
     {
-        if( m_apmxBonePointers )
-            delete [] m_apmxBonePointers;
+        if( m_adwBoneFrames )
+            delete [] m_adwBoneFrames;
 
         DWORD dwNumBones = pSkinInfo->GetNumBones();
 
-        m_apmxBonePointers = new D3DXMATRIX* [ dwNumBones ];
-        if( m_apmxBonePointers == NULL )
+        m_adwBoneFrames = new DWORD [ dwNumBones ];
+        if( m_adwBoneFrames == NULL )
             return E_OUTOFMEMORY;
 
         for( DWORD i = 0; i < dwNumBones; ++ i )
@@ -40,7 +140,7 @@ HRESULT MultiAnimMC::SetupBonePtrs( D3DXFRAME * pFrameRoot )
             if( pFrame == NULL )
                 return E_FAIL;
 
-            m_apmxBonePointers[ i ] = &pFrame->TransformationMatrix;
+            m_adwBoneFrames[ i ] = pFrame->m_dwFlatIndex;
         }
     }
 
@@ -66,11 +166,7 @@ HRESULT CMultiAnim::CreateInstance( CAnimInstance ** ppAnimInstance )
     // Clone the original AC.  This clone is what we will use to animate
     // this mesh; the original never gets used except to clone, since we
     // always need to be able to add another instance at any time.
-    hr = m_pAC->CloneAnimationController( m_pAC->GetMaxNumAnimationOutputs(),
-                                          m_pAC->GetMaxNumAnimationSets(),
-                                          m_pAC->GetMaxNumTracks(),
-                                          m_pAC->GetMaxNumEvents(),
-                                          &pNewAC );
+    hr = CloneController( &pNewAC );
     if( SUCCEEDED( hr ) )
     {
         // create the new AI
@@ -106,6 +202,26 @@ e_Exit:
 
 
 
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::CloneController()
+// Desc: Clones the original AC for an instance.  The clone refers to the
+//       same animation sets, so it only holds the instance's outputs, tracks
+//       and events; it is sized for exactly the frames and sets we have, and
+//       for the tracks and events of SetInstanceLimits().
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::CloneController( LPD3DXANIMATIONCONTROLLER * ppAC )
+{
+    UINT uiOutputs = max( (UINT) m_v_pFlatFrames.size(), 1 );
+    UINT uiSets = max( m_pAC->GetNumAnimationSets(), 1 );
+    UINT uiTracks = m_dwInstanceMaxTracks ? m_dwInstanceMaxTracks : m_pAC->GetMaxNumTracks();
+    UINT uiEvents = m_dwInstanceMaxEvents ? m_dwInstanceMaxEvents : m_pAC->GetMaxNumEvents();
+
+    return m_pAC->CloneAnimationController( uiOutputs, uiSets, uiTracks, uiEvents, ppAC );
+}
+
+
+
+
 //-----------------------------------------------------------------------------
 // Name: CMultiAnim::SetupBonePtrs()
 // Desc: Recursively initialize the bone pointers for all the mesh
@@ -144,14 +260,82 @@ HRESULT CMultiAnim::SetupBonePtrs( MultiAnimFrame * pFrame )
     return S_OK;
 }
 
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::FlattenFrames()
+// Desc: Appends pFrame, its siblings and all their descendants to the flat
+//       frame arrays, parents before children, so that an instance can
+//       update its transforms in one pass (see CAnimInstance::UpdateFrames()).
+//-----------------------------------------------------------------------------
+void CMultiAnim::FlattenFrames( MultiAnimFrame * pFrame, int iParent )
+{
+    for( ; pFrame; pFrame = (MultiAnimFrame *) pFrame->pFrameSibling )
+    {
+        pFrame->m_dwFlatIndex = (DWORD) m_v_pFlatFrames.size();
+        m_v_pFlatFrames.push_back( pFrame );
+        m_v_iFlatParents.push_back( iParent );
+
+        if( pFrame->pFrameFirstChild )
+            FlattenFrames( (MultiAnimFrame *) pFrame->pFrameFirstChild, (int) pFrame->m_dwFlatIndex );
+    }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::SetupPalettes()
+// Desc: Collects the skinned mesh containers and lays out the palettes of an
+//       instance (see CAnimInstance::UpdatePalettes()): the palette of every
+//       attribute group of every skinned container, one after the other.
+//-----------------------------------------------------------------------------
+void CMultiAnim::SetupPalettes()
+{
+    m_v_pSkinnedMCs.clear();
+    m_dwPaletteSize = 0;
+
+    vector< MultiAnimFrame* >::iterator itCur, itEnd = m_v_pFlatFrames.end();
+    for( itCur = m_v_pFlatFrames.begin(); itCur != itEnd; ++ itCur )
+    {
+        MultiAnimMC * pMC = (MultiAnimMC *) ( * itCur )->pMeshContainer;
+        if( pMC == NULL || pMC->pSkinInfo == NULL )
+            continue;
+
+        pMC->m_dwPaletteBase = m_dwPaletteSize;
+        m_dwPaletteSize += pMC->m_dwNumAttrGroups * pMC->m_dwNumPaletteEntries;
+        m_v_pSkinnedMCs.push_back( pMC );
+    }
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::CMultiAnim()
+// Desc: Constructor for CMultiAnim
+//-----------------------------------------------------------------------------
 CMultiAnim::CMultiAnim() :
     m_pDevice( NULL ),
     m_pEffect( NULL ),
-    m_dwWorkingPaletteSize( 0 ),
-    m_amxWorkingPalette( NULL ),
+    m_dwPaletteSize( 0 ),
     m_pFrameRoot( NULL ),
-    m_pAC( NULL )
+    m_dwInstanceMaxTracks( 0 ),
+    m_dwInstanceMaxEvents( 0 ),
+    m_pAC( NULL ),
+    m_bSetsShared( false ),
+    m_bAnimCacheDirty( false ),
+    m_pCrowdPalettes( NULL ),
+    m_pCrowdRows( NULL ),
+    m_dwCrowdRowTexels( 0 ),
+    m_dwNumCrowdInstances( 0 ),
+    m_bCrowdActive( false ),
+    m_dwNumPoses( 0 ),
+    m_amxPoses( NULL )
 {
+    m_wszAnimCache[ 0 ] = L'\0';
+    InitializeCriticalSection( & m_csPoses );
 }
 
 
@@ -171,6 +355,17 @@ CMultiAnim::~CMultiAnim()
     }
 
     m_v_pAnimInstances.clear();
+
+    for( itCur = m_v_pInstancePool.begin(); itCur != m_v_pInstancePool.end(); ++ itCur )
+    {
+        ( * itCur )->Cleanup();
+        delete * itCur;
+    }
+
+    m_v_pInstancePool.clear();
+
+    ReleasePoseCache();
+    DeleteCriticalSection( & m_csPoses );
 }
 
 
@@ -265,13 +460,7 @@ HRESULT CMultiAnim::Setup( LPDIRECT3DDEVICE9 pDevice,
     if( FAILED( hr ) )
         goto e_Exit;
 
-    hr = D3DXLoadMeshHierarchyFromX( wszPath,
-                                     0,
-                                     m_pDevice,
-                                     pAH,
-                                     pLUD,
-                                     (LPD3DXFRAME *) &m_pFrameRoot,
-                                     &m_pAC );
+    hr = LoadMeshHierarchy( wszPath, pAH, pLUD );
     if( FAILED( hr ) )
         goto e_Exit;
 
@@ -284,6 +473,20 @@ HRESULT CMultiAnim::Setup( LPDIRECT3DDEVICE9 pDevice,
         goto e_Exit;
     }
 
+    // flatten the hierarchy for the instances' transform updates
+    m_v_pFlatFrames.clear();
+    m_v_iFlatParents.clear();
+    try
+    {
+        FlattenFrames( m_pFrameRoot, -1 );
+        SetupPalettes();
+    }
+    catch( ... )
+    {
+        hr = E_OUTOFMEMORY;
+        goto e_Exit;
+    }
+
     // set up bone pointers
     hr = SetupBonePtrs( m_pFrameRoot );
     if( FAILED( hr ) )
@@ -294,17 +497,24 @@ HRESULT CMultiAnim::Setup( LPDIRECT3DDEVICE9 pDevice,
     if( FAILED( hr ) )
         goto e_Exit;
 
-    // If there are existing instances, update their animation controllers.
+    // crowd rendering is optional; without it every instance draws itself
+    if( FAILED( SetupCrowd() ) )
+        ReleaseCrowd();
+
+    // so is sharing the palettes of identical poses
+    SetupPoseCache();
+
+    // If there are existing instances (used or pooled), update their animation
+    // controllers.  The app prepares the new sets again (see ReplaceAnimationSet()).
+    m_bSetsShared = false;
+    for( int iList = 0; iList < 2; ++ iList )
     {
-        vector< CAnimInstance* >::iterator itCur, itEnd = m_v_pAnimInstances.end();
-        for( itCur = m_v_pAnimInstances.begin(); itCur != itEnd; ++ itCur )
+        vector< CAnimInstance* > & v_pInstances = iList == 0 ? m_v_pAnimInstances : m_v_pInstancePool;
+        vector< CAnimInstance* >::iterator itCur, itEnd = v_pInstances.end();
+        for( itCur = v_pInstances.begin(); itCur != itEnd; ++ itCur )
         {
             LPD3DXANIMATIONCONTROLLER pNewAC = NULL;
-            hr = m_pAC->CloneAnimationController( m_pAC->GetMaxNumAnimationOutputs(),
-                                                  m_pAC->GetMaxNumAnimationSets(),
-                                                  m_pAC->GetMaxNumTracks(),
-                                                  m_pAC->GetMaxNumEvents(),
-                                                  &pNewAC );
+            hr = CloneController( &pNewAC );
             // Release existing animation controller
             if( ( * itCur )->m_pAC )
                 ( * itCur )->m_pAC->Release();
@@ -317,12 +527,9 @@ e_Exit:
 
     if( FAILED( hr ) )
     {
-        if( m_amxWorkingPalette )
-        {
-            delete [] m_amxWorkingPalette;
-            m_amxWorkingPalette = NULL;
-            m_dwWorkingPaletteSize = 0;
-        }
+        ReleaseCrowd();
+        ReleasePoseCache();
+        m_v_pSkinnedMCs.clear();
 
         if( m_pAC )
         {
@@ -354,30 +561,281 @@ e_Exit:
 
 
 
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::LoadMeshHierarchy()
+// Desc: Loads the frame hierarchy, meshes and animation controller.  Parsing
+//       the text X file is slow, so after the first load the hierarchy is
+//       saved as a compressed binary X file in the working directory, and 
+//       later runs load that instead, straight from a mapping of the file.
+//       The cache is rebuilt whenever the X file is newer.  Hierarchies with
+//       custom user data aren't cached (D3DX can't save it without a saver).
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::LoadMeshHierarchy( WCHAR sXPath[], CMultiAnimAllocateHierarchy *pAH, LPD3DXLOADUSERDATA pLUD )
+{
+    HRESULT hr = E_FAIL;
+    WCHAR wszMeshCache[ MAX_PATH ];
+    GetCachePath( wszMeshCache, sXPath, L".mesh.cache" );
+    GetCachePath( m_wszAnimCache, sXPath, L".anim.cache" );
+
+    if( pLUD == NULL && IsCacheCurrent( wszMeshCache, sXPath ) )
+    {
+        HANDLE hFile, hMapping;
+        LPCVOID pView;
+        DWORD dwSize;
+        if( SUCCEEDED( MapCacheFile( wszMeshCache, & hFile, & hMapping, & pView, & dwSize ) ) )
+        {
+            hr = D3DXLoadMeshHierarchyFromXInMemory( pView,
+                                                     dwSize,
+                                                     0,
+                                                     m_pDevice,
+                                                     pAH,
+                                                     NULL,
+                                                     (LPD3DXFRAME *) &m_pFrameRoot,
+                                                     &m_pAC );
+        }
+        UnmapCacheFile( hFile, hMapping, pView );
+
+        if( FAILED( hr ) && m_pFrameRoot )
+        {
+            D3DXFrameDestroy( m_pFrameRoot, pAH );
+            m_pFrameRoot = NULL;
+        }
+    }
+
+    if( FAILED( hr ) )
+    {
+        hr = D3DXLoadMeshHierarchyFromX( sXPath,
+                                         0,
+                                         m_pDevice,
+                                         pAH,
+                                         pLUD,
+                                         (LPD3DXFRAME *) &m_pFrameRoot,
+                                         &m_pAC );
+        if( FAILED( hr ) )
+            return hr;
+
+        // a failure to write the cache only costs the next start up
+        if( pLUD == NULL &&
+            FAILED( D3DXSaveMeshHierarchyToFile( wszMeshCache,
+                                                 D3DXF_FILEFORMAT_BINARY | D3DXF_FILEFORMAT_COMPRESSED,
+                                                 m_pFrameRoot,
+                                                 m_pAC,
+                                                 NULL ) ) )
+        {
+            OutputDebugString( L"CMultiAnim::LoadMeshHierarchy - could not write the mesh cache\n" );
+        }
+    }
+
+    // the compressed keyframes are only valid for the X file they came from
+    ReleaseCompressedSets();
+    if( IsCacheCurrent( m_wszAnimCache, sXPath ) )
+        LoadAnimCache();
+
+    return S_OK;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::GetCompressedAnimationSet()
+// Desc: Returns the compressed keyframes of an animation set.  Every instance
+//       compresses the same sets from its clone of our animation controller,
+//       so each set is only compressed once (or never, if it was in the
+//       cache file) and the buffer is shared.  The caller releases the
+//       returned buffer.
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::GetCompressedAnimationSet( LPD3DXKEYFRAMEDANIMATIONSET pAS,
+                                               DWORD dwCompressionFlags,
+                                               FLOAT fCompression,
+                                               LPD3DXBUFFER * ppBufCompressed )
+{
+    vector< CompressedAnimSet >::iterator itCur, itEnd = m_v_CompressedSets.end();
+    for( itCur = m_v_CompressedSets.begin(); itCur != itEnd; ++ itCur )
+    {
+        if( itCur->dwFlags == dwCompressionFlags &&
+            itCur->fCompression == fCompression &&
+            itCur->sName == pAS->GetName() )
+        {
+            * ppBufCompressed = itCur->pBuf;
+            itCur->pBuf->AddRef();
+            return S_OK;
+        }
+    }
+
+    HRESULT hr = pAS->Compress( dwCompressionFlags, fCompression, NULL, ppBufCompressed );
+    if( FAILED( hr ) )
+        return hr;
+
+    CompressedAnimSet set;
+    set.sName = pAS->GetName();
+    set.dwFlags = dwCompressionFlags;
+    set.fCompression = fCompression;
+    set.pBuf = * ppBufCompressed;
+    set.pBuf->AddRef();
+    m_v_CompressedSets.push_back( set );
+
+    m_bAnimCacheDirty = m_wszAnimCache[ 0 ] != L'\0';
+    return S_OK;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::LoadAnimCache()
+// Desc: Reads the compressed animation sets from the cache file (mapped, and
+//       copied into D3DX buffers).  The layout is a header (magic, version, 
+//       count), then for each set: name length and name (with the null),
+//       compression flags, compression ratio, size and data.
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::LoadAnimCache()
+{
+    HANDLE hFile, hMapping;
+    LPCVOID pView;
+    DWORD dwSize;
+    HRESULT hr = MapCacheFile( m_wszAnimCache, & hFile, & hMapping, & pView, & dwSize );
+    if( SUCCEEDED( hr ) )
+    {
+        const BYTE * pCur = (const BYTE *) pView;
+        const BYTE * pEnd = pCur + dwSize;
+        DWORD adwHeader[ 3 ];
+
+        hr = E_FAIL;
+        if( dwSize >= sizeof( adwHeader ) )
+        {
+            CopyMemory( adwHeader, pCur, sizeof( adwHeader ) );
+            pCur += sizeof( adwHeader );
+            if( adwHeader[ 0 ] == MULTIANIM_ANIM_CACHE_MAGIC && adwHeader[ 1 ] == MULTIANIM_ANIM_CACHE_VERSION )
+                hr = S_OK;
+        }
+
+        for( DWORD i = 0; SUCCEEDED( hr ) && i < adwHeader[ 2 ]; ++ i )
+        {
+            DWORD dwNameLen, dwDataSize;
+            CompressedAnimSet set;
+
+            hr = E_FAIL;
+            if( pEnd - pCur < (ptrdiff_t) sizeof( DWORD ) )
+                break;
+            CopyMemory( & dwNameLen, pCur, sizeof( DWORD ) );
+            pCur += sizeof( DWORD );
+            if( dwNameLen == 0 || pEnd - pCur < (ptrdiff_t) ( dwNameLen + 3 * sizeof( DWORD ) ) || pCur[ dwNameLen - 1 ] != '\0' )
+                break;
+            set.sName = (const char *) pCur;
+            pCur += dwNameLen;
+            CopyMemory( & set.dwFlags, pCur, sizeof( DWORD ) );
+            CopyMemory( & set.fCompression, pCur + sizeof( DWORD ), sizeof( FLOAT ) );
+            CopyMemory( & dwDataSize, pCur + 2 * sizeof( DWORD ), sizeof( DWORD ) );
+            pCur += 3 * sizeof( DWORD );
+            if( pEnd - pCur < (ptrdiff_t) dwDataSize )
+                break;
+
+            hr = D3DXCreateBuffer( dwDataSize, & set.pBuf );
+            if( FAILED( hr ) )
+                break;
+            CopyMemory( set.pBuf->GetBufferPointer(), pCur, dwDataSize );
+            pCur += dwDataSize;
+            m_v_CompressedSets.push_back( set );
+        }
+
+        if( FAILED( hr ) )
+            ReleaseCompressedSets();
+    }
+    UnmapCacheFile( hFile, hMapping, pView );
+
+    return hr;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::SaveAnimCache()
+// Desc: Writes the compressed animation sets to the cache file, for the next
+//       run (see LoadAnimCache() for the layout).
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::SaveAnimCache()
+{
+    FILE * pFile = NULL;
+    if( _wfopen_s( & pFile, m_wszAnimCache, L"wb" ) != 0 || pFile == NULL )
+        return E_FAIL;
+
+    DWORD adwHeader[ 3 ] = { MULTIANIM_ANIM_CACHE_MAGIC, MULTIANIM_ANIM_CACHE_VERSION, (DWORD) m_v_CompressedSets.size() };
+    bool bWritten = fwrite( adwHeader, sizeof( adwHeader ), 1, pFile ) == 1;
+
+    vector< CompressedAnimSet >::iterator itCur, itEnd = m_v_CompressedSets.end();
+    for( itCur = m_v_CompressedSets.begin(); bWritten && itCur != itEnd; ++ itCur )
+    {
+        DWORD dwNameLen = (DWORD) itCur->sName.size() + 1;
+        DWORD dwDataSize = itCur->pBuf->GetBufferSize();
+        bWritten = fwrite( & dwNameLen, sizeof( DWORD ), 1, pFile ) == 1 &&
+                   fwrite( itCur->sName.c_str(), dwNameLen, 1, pFile ) == 1 &&
+                   fwrite( & itCur->dwFlags, sizeof( DWORD ), 1, pFile ) == 1 &&
+                   fwrite( & itCur->fCompression, sizeof( FLOAT ), 1, pFile ) == 1 &&
+                   fwrite( & dwDataSize, sizeof( DWORD ), 1, pFile ) == 1 &&
+                   fwrite( itCur->pBuf->GetBufferPointer(), dwDataSize, 1, pFile ) == 1;
+    }
+    fclose( pFile );
+
+    if( !bWritten )
+    {   // don't leave a truncated cache behind
+        DeleteFile( m_wszAnimCache );
+        return E_FAIL;
+    }
+
+    m_bAnimCacheDirty = false;
+    return S_OK;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::ReleaseCompressedSets()
+// Desc: Releases the shared compressed animation sets.
+//-----------------------------------------------------------------------------
+void CMultiAnim::ReleaseCompressedSets()
+{
+    vector< CompressedAnimSet >::iterator itCur, itEnd = m_v_CompressedSets.end();
+    for( itCur = m_v_CompressedSets.begin(); itCur != itEnd; ++ itCur )
+        itCur->pBuf->Release();
+
+    m_v_CompressedSets.clear();
+    m_bAnimCacheDirty = false;
+}
+
+
+
+
 //-----------------------------------------------------------------------------
 // Name: CMultiAnim::Cleanup()
 // Desc: Performs clean up work and free up memory.
 //-----------------------------------------------------------------------------
 HRESULT CMultiAnim::Cleanup( CMultiAnimAllocateHierarchy * pAH )
 {
-    if( m_amxWorkingPalette )
-    {
-        delete [] m_amxWorkingPalette;
-        m_amxWorkingPalette = NULL;
-        m_dwWorkingPaletteSize = 0;
-    }
+    if( m_bAnimCacheDirty )
+        SaveAnimCache();
+    ReleaseCompressedSets();
+    ReleaseCrowd();
+    ReleasePoseCache();
+    m_v_pSkinnedMCs.clear();
+    m_dwPaletteSize = 0;
 
     if( m_pAC )
     {
         m_pAC->Release();
         m_pAC = NULL;
     }
+    m_bSetsShared = false;
 
     if( m_pFrameRoot )
     {
         D3DXFrameDestroy( m_pFrameRoot, pAH );
         m_pFrameRoot = NULL;
     }
+    m_v_pFlatFrames.clear();
+    m_v_iFlatParents.clear();
 
     if( m_pEffect )
     {
@@ -471,11 +929,21 @@ float CMultiAnim::GetBoundingRadius()
 //-----------------------------------------------------------------------------
 HRESULT CMultiAnim::CreateNewInstance( DWORD * pdwNewIdx )
 {
-    // create the AI
+    HRESULT hr = S_OK;
     CAnimInstance * pAI;
-    HRESULT hr = CreateInstance( & pAI );
-    if( FAILED( hr ) )
-        goto e_Exit;
+
+    // take one from the pool, or create the AI
+    if( ! m_v_pInstancePool.empty() )
+    {
+        pAI = m_v_pInstancePool.back();
+        m_v_pInstancePool.pop_back();
+    }
+    else
+    {
+        hr = CreateInstance( & pAI );
+        if( FAILED( hr ) )
+            goto e_Exit;
+    }
 
     // add it
     try
@@ -484,6 +952,8 @@ HRESULT CMultiAnim::CreateNewInstance( DWORD * pdwNewIdx )
     }
     catch( ... )
     {
+        pAI->Cleanup();
+        delete pAI;
         hr = E_OUTOFMEMORY;
         goto e_Exit;
     }
@@ -498,6 +968,101 @@ e_Exit:
 
 
 
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::SetInstanceLimits()
+// Desc: Sets the number of tracks and track events the controllers of new
+//       instances have room for (0 keeps the number of the original AC).  An
+//       app that knows how many it uses keeps the clones small.
+//-----------------------------------------------------------------------------
+void CMultiAnim::SetInstanceLimits( DWORD dwMaxTracks, DWORD dwMaxEvents )
+{
+    m_dwInstanceMaxTracks = dwMaxTracks;
+    m_dwInstanceMaxEvents = dwMaxEvents;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::ReserveInstances()
+// Desc: Makes sure dwCount more instances can be created without cloning a
+//       controller or growing the instance array: the instances are created
+//       now and kept in a pool that CreateNewInstance() takes from.
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::ReserveInstances( DWORD dwCount )
+{
+    HRESULT hr = S_OK;
+
+    try
+    {
+        m_v_pAnimInstances.reserve( m_v_pAnimInstances.size() + dwCount );
+        m_v_pInstancePool.reserve( dwCount );
+    }
+    catch( ... )
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    while( m_v_pInstancePool.size() < dwCount )
+    {
+        CAnimInstance * pAI;
+        hr = CreateInstance( & pAI );
+        if( FAILED( hr ) )
+            break;
+
+        m_v_pInstancePool.push_back( pAI );
+    }
+
+    return hr;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::GetAnimController()
+// Desc: Returns the original AC, that the instances clone from.  Its
+//       animation sets are the ones the instances share.  The caller must
+//       call Release() on the pointer when done with it.
+//-----------------------------------------------------------------------------
+void CMultiAnim::GetAnimController( LPD3DXANIMATIONCONTROLLER * ppAC )
+{
+    assert( ppAC != NULL );
+    m_pAC->AddRef();
+    * ppAC = m_pAC;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::ReplaceAnimationSet()
+// Desc: Replaces the animation set of the same name with pASNew, in the
+//       original AC and in the controller of every instance, so all of them
+//       keep sharing one copy of the keyframes (instances created later get
+//       it from the clone).  The callback keys of a shared set can't point
+//       to data of one instance; the instances' callback handlers tell them
+//       apart.  Once done, the app calls SetAnimationSetsShared(), so the 
+//       next instance knows not to prepare the sets again.
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::ReplaceAnimationSet( LPD3DXANIMATIONSET pASNew )
+{
+    HRESULT hr = ReplaceControllerSet( m_pAC, pASNew );
+
+    for( int iList = 0; SUCCEEDED( hr ) && iList < 2; ++ iList )
+    {
+        vector< CAnimInstance* > & v_pInstances = iList == 0 ? m_v_pAnimInstances : m_v_pInstancePool;
+        vector< CAnimInstance* >::iterator itCur, itEnd = v_pInstances.end();
+        for( itCur = v_pInstances.begin(); SUCCEEDED( hr ) && itCur != itEnd; ++ itCur )
+            hr = ReplaceControllerSet( ( * itCur )->m_pAC, pASNew );
+    }
+
+    return hr;
+}
+
+
+
+
 //-----------------------------------------------------------------------------
 // Name: CMultiAnim::SetTechnique()
 // Desc: Sets the name of the technique to render the mesh in.
@@ -516,9 +1081,8 @@ void CMultiAnim::SetTechnique( char * sTechnique )
 //-----------------------------------------------------------------------------
 HRESULT CMultiAnim::Draw()
 {
-    // TODO: modify this for much faster bulk rendering
-
     HRESULT hr = S_OK, hrT;
+    bool bCrowd = !m_bCrowdActive && BeginCrowd();
 
     vector< CAnimInstance* >::iterator itCur, itEnd = m_v_pAnimInstances.end();
     for( itCur = m_v_pAnimInstances.begin(); itCur != itEnd; ++ itCur )
@@ -527,5 +1091,494 @@ HRESULT CMultiAnim::Draw()
             hr = hrT;
     }
 
+    if( bCrowd && FAILED( hrT = EndCrowd() ) )
+        hr = hrT;
+
+    return hr;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::BeginCrowd()
+// Desc: Starts queueing instances instead of drawing them.  Until EndCrowd(),
+//       CAnimInstance::Draw() only copies the instance's bone palettes into
+//       a row of the crowd palette texture, and the crowd is drawn with one
+//       instanced draw call per attribute group (per MULTIANIM_CROWD_MAX_-
+//       INSTANCES instances).  Returns false if the device can't do this, in
+//       which case the instances keep drawing themselves.
+//-----------------------------------------------------------------------------
+bool CMultiAnim::BeginCrowd()
+{
+    m_dwNumCrowdInstances = 0;
+    m_bCrowdActive = m_pCrowdPalettes != NULL;
+    return m_bCrowdActive;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::EndCrowd()
+// Desc: Draws the instances queued since BeginCrowd().
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::EndCrowd()
+{
+    if( !m_bCrowdActive )
+        return S_OK;
+
+    HRESULT hr = FlushCrowd();
+    m_bCrowdActive = false;
     return hr;
 }
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::SetupCrowd()
+// Desc: Creates what crowd rendering needs: the palette texture, which the
+//       vertex shader reads (so vs_3_0 and vertex textures of float4 are
+//       required), the instance stream and, per skinned mesh container, a
+//       vertex declaration with the instance stream added and the attribute
+//       table to draw the attribute groups with.  A row of the texture holds
+//       the palettes of every attribute group of every container.
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::SetupCrowd()
+{
+    HRESULT hr;
+    D3DCAPS9 caps;
+    m_pDevice->GetDeviceCaps( & caps );
+    if( caps.VertexShaderVersion < D3DVS_VERSION( 3, 0 ) )
+        return E_NOTIMPL;
+
+    {
+        LPDIRECT3D9 pD3D = NULL;
+        D3DDEVICE_CREATION_PARAMETERS cp;
+        D3DDISPLAYMODE mode;
+        m_pDevice->GetCreationParameters( & cp );
+        m_pDevice->GetDisplayMode( 0, & mode );
+        m_pDevice->GetDirect3D( & pD3D );
+        hr = pD3D->CheckDeviceFormat( cp.AdapterOrdinal,
+                                      cp.DeviceType,
+                                      mode.Format,
+                                      D3DUSAGE_QUERY_VERTEXTEXTURE,
+                                      D3DRTYPE_TEXTURE,
+                                      D3DFMT_A32B32G32R32F );
+        pD3D->Release();
+        if( FAILED( hr ) )
+            return hr;
+    }
+
+    hr = m_pEffect->ValidateTechnique( "SkinningInstanced30" );
+    if( FAILED( hr ) )
+        return hr;
+
+    if( m_v_pSkinnedMCs.empty() )
+        return E_FAIL;
+
+    // a row holds an instance's palettes as laid out by SetupPalettes()
+    m_dwCrowdRowTexels = m_dwPaletteSize * 3;
+    vector< MultiAnimMC* >::iterator itCur, itEnd = m_v_pSkinnedMCs.end();
+    for( itCur = m_v_pSkinnedMCs.begin(); itCur != itEnd; ++ itCur )
+    {
+        MultiAnimMC * pMC = * itCur;
+
+        // the mesh's own declaration, plus the palette row from stream 1
+        D3DVERTEXELEMENT9 pDecl[ MAX_FVF_DECL_SIZE ];
+        D3DVERTEXELEMENT9 elRow = { 1, 0, D3DDECLTYPE_FLOAT1, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_TEXCOORD, 1 };
+        D3DVERTEXELEMENT9 elEnd = D3DDECL_END();
+        UINT iEnd = 0;
+        hr = pMC->m_pWorkingMesh->GetDeclaration( pDecl );
+        if( FAILED( hr ) )
+            return hr;
+        while( pDecl[ iEnd ].Stream != 0xff )
+            ++ iEnd;
+        if( iEnd + 2 > MAX_FVF_DECL_SIZE )
+            return E_FAIL;
+        pDecl[ iEnd ] = elRow;
+        pDecl[ iEnd + 1 ] = elEnd;
+
+        hr = m_pDevice->CreateVertexDeclaration( pDecl, & pMC->m_pCrowdDecl );
+        if( FAILED( hr ) )
+            return hr;
+
+        hr = pMC->m_pWorkingMesh->GetAttributeTable( NULL, & pMC->m_dwNumCrowdRanges );
+        if( FAILED( hr ) )
+            return hr;
+        pMC->m_aCrowdRanges = new D3DXATTRIBUTERANGE[ pMC->m_dwNumCrowdRanges ];
+        if( pMC->m_aCrowdRanges == NULL )
+            return E_OUTOFMEMORY;
+        hr = pMC->m_pWorkingMesh->GetAttributeTable( pMC->m_aCrowdRanges, & pMC->m_dwNumCrowdRanges );
+        if( FAILED( hr ) )
+            return hr;
+    }
+
+    if( m_dwCrowdRowTexels > caps.MaxTextureWidth )
+        return E_FAIL;
+
+    hr = m_pDevice->CreateTexture( m_dwCrowdRowTexels,
+                                   MULTIANIM_CROWD_MAX_INSTANCES,
+                                   1,
+                                   D3DUSAGE_DYNAMIC,
+                                   D3DFMT_A32B32G32R32F,
+                                   D3DPOOL_DEFAULT,
+                                   & m_pCrowdPalettes,
+                                   NULL );
+    if( FAILED( hr ) )
+        return hr;
+
+    // the instance stream never changes: instance i reads row i
+    hr = m_pDevice->CreateVertexBuffer( MULTIANIM_CROWD_MAX_INSTANCES * sizeof( FLOAT ),
+                                        D3DUSAGE_WRITEONLY,
+                                        0,
+                                        D3DPOOL_MANAGED,
+                                        & m_pCrowdRows,
+                                        NULL );
+    if( FAILED( hr ) )
+        return hr;
+
+    FLOAT * pfRows;
+    hr = m_pCrowdRows->Lock( 0, 0, (void **) & pfRows, 0 );
+    if( FAILED( hr ) )
+        return hr;
+    for( DWORD i = 0; i < MULTIANIM_CROWD_MAX_INSTANCES; ++ i )
+        pfRows[ i ] = ( i + 0.5f ) / MULTIANIM_CROWD_MAX_INSTANCES;
+    m_pCrowdRows->Unlock();
+
+    try
+    {
+        m_v_vCrowdStaging.resize( m_dwCrowdRowTexels * MULTIANIM_CROWD_MAX_INSTANCES );
+    }
+    catch( ... )
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return S_OK;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::ReleaseCrowd()
+// Desc: Releases everything SetupCrowd() created, which turns crowd rendering
+//       off.
+//-----------------------------------------------------------------------------
+void CMultiAnim::ReleaseCrowd()
+{
+    vector< MultiAnimMC* >::iterator itCur, itEnd = m_v_pSkinnedMCs.end();
+    for( itCur = m_v_pSkinnedMCs.begin(); itCur != itEnd; ++ itCur )
+    {
+        MultiAnimMC * pMC = * itCur;
+        if( pMC->m_pCrowdDecl )
+        {
+            pMC->m_pCrowdDecl->Release();
+            pMC->m_pCrowdDecl = NULL;
+        }
+        if( pMC->m_aCrowdRanges )
+        {
+            delete [] pMC->m_aCrowdRanges;
+            pMC->m_aCrowdRanges = NULL;
+        }
+        pMC->m_dwNumCrowdRanges = 0;
+    }
+    m_v_vCrowdStaging.clear();
+
+    if( m_pCrowdPalettes )
+    {
+        m_pCrowdPalettes->Release();
+        m_pCrowdPalettes = NULL;
+    }
+
+    if( m_pCrowdRows )
+    {
+        m_pCrowdRows->Release();
+        m_pCrowdRows = NULL;
+    }
+
+    m_dwCrowdRowTexels = 0;
+    m_dwNumCrowdInstances = 0;
+    m_bCrowdActive = false;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::AddCrowdInstance()
+// Desc: Queues an instance for the crowd draw: its palettes (see
+//       CAnimInstance::UpdatePalettes()) go into the next staging row.  The
+//       columns of each matrix are stored, three texels per entry.
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::AddCrowdInstance( CAnimInstance * pAI )
+{
+    HRESULT hr = S_OK;
+    if( m_dwNumCrowdInstances == MULTIANIM_CROWD_MAX_INSTANCES )
+        hr = FlushCrowd();
+
+    D3DXVECTOR4 * pTexel = & m_v_vCrowdStaging[ m_dwNumCrowdInstances * m_dwCrowdRowTexels ];
+
+    for( DWORD i = 0; i < m_dwPaletteSize; ++ i, pTexel += 3 )
+    {
+        const D3DXMATRIXA16 & mx = pAI->m_amxPalette[ i ];
+        pTexel[ 0 ] = D3DXVECTOR4( mx._11, mx._21, mx._31, mx._41 );
+        pTexel[ 1 ] = D3DXVECTOR4( mx._12, mx._22, mx._32, mx._42 );
+        pTexel[ 2 ] = D3DXVECTOR4( mx._13, mx._23, mx._33, mx._43 );
+    }
+
+    ++ m_dwNumCrowdInstances;
+    return hr;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::FlushCrowd()
+// Desc: Uploads the queued palettes and draws the queued instances: per mesh
+//       container one effect pass, and per attribute group one instanced
+//       DrawIndexedPrimitive() over all of them.
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::FlushCrowd()
+{
+    if( m_dwNumCrowdInstances == 0 )
+        return S_OK;
+
+    HRESULT hr;
+    DWORD dwNumInstances = m_dwNumCrowdInstances;
+    m_dwNumCrowdInstances = 0;
+
+    // upload the palettes
+    D3DLOCKED_RECT lr;
+    hr = m_pCrowdPalettes->LockRect( 0, & lr, NULL, D3DLOCK_DISCARD );
+    if( FAILED( hr ) )
+        return hr;
+    for( DWORD i = 0; i < dwNumInstances; ++ i )
+        CopyMemory( (BYTE *) lr.pBits + i * lr.Pitch,
+                    & m_v_vCrowdStaging[ i * m_dwCrowdRowTexels ],
+                    m_dwCrowdRowTexels * sizeof( D3DXVECTOR4 ) );
+    m_pCrowdPalettes->UnlockRect( 0 );
+
+    hr = m_pEffect->SetTechnique( "SkinningInstanced30" );
+    if( FAILED( hr ) )
+        return hr;
+    m_pEffect->SetTexture( "g_txPalettes", m_pCrowdPalettes );
+    m_pEffect->SetFloat( "g_fPaletteTexelWidth", 1.0f / m_dwCrowdRowTexels );
+
+    m_pDevice->SetStreamSource( 1, m_pCrowdRows, 0, sizeof( FLOAT ) );
+    m_pDevice->SetStreamSourceFreq( 1, D3DSTREAMSOURCE_INSTANCEDATA | 1 );
+
+    vector< MultiAnimMC* >::iterator itCur, itEnd = m_v_pSkinnedMCs.end();
+    for( itCur = m_v_pSkinnedMCs.begin(); itCur != itEnd; ++ itCur )
+    {
+        MultiAnimMC * pMC = * itCur;
+        LPD3DXBONECOMBINATION pBC = ( LPD3DXBONECOMBINATION )( pMC->m_pBufBoneCombos->GetBufferPointer() );
+
+        // the device keeps its own references to the buffers
+        LPDIRECT3DVERTEXBUFFER9 pVB = NULL;
+        LPDIRECT3DINDEXBUFFER9 pIB = NULL;
+        pMC->m_pWorkingMesh->GetVertexBuffer( & pVB );
+        pMC->m_pWorkingMesh->GetIndexBuffer( & pIB );
+        m_pDevice->SetVertexDeclaration( pMC->m_pCrowdDecl );
+        m_pDevice->SetStreamSource( 0, pVB, 0, pMC->m_pWorkingMesh->GetNumBytesPerVertex() );
+        m_pDevice->SetStreamSourceFreq( 0, D3DSTREAMSOURCE_INDEXEDDATA | dwNumInstances );
+        m_pDevice->SetIndices( pIB );
+        pVB->Release();
+        pIB->Release();
+
+        // set the current number of bones; this tells the effect which shader to use
+        m_pEffect->SetInt( "CurNumBones", pMC->m_dwMaxNumFaceInfls - 1 );
+
+        UINT uiPasses, uiPass;
+        m_pEffect->Begin( & uiPasses, 0 );
+        for( uiPass = 0; uiPass < uiPasses; ++ uiPass )
+        {
+            m_pEffect->BeginPass( uiPass );
+            for( DWORD dwRange = 0; dwRange < pMC->m_dwNumCrowdRanges; ++ dwRange )
+            {
+                const D3DXATTRIBUTERANGE & range = pMC->m_aCrowdRanges[ dwRange ];
+                if( range.FaceCount == 0 )
+                    continue;
+
+                // the attribute id is the bone combination, as in DrawSubset()
+                m_pEffect->SetTexture( "g_txScene", pMC->m_apTextures[ pBC[ range.AttribId ].AttribId ] );
+                m_pEffect->SetFloat( "g_fPaletteBase", (FLOAT) ( ( pMC->m_dwPaletteBase + range.AttribId * pMC->m_dwNumPaletteEntries ) * 3 ) );
+                m_pEffect->CommitChanges();
+
+                hr = m_pDevice->DrawIndexedPrimitive( D3DPT_TRIANGLELIST,
+                                                      0,
+                                                      range.VertexStart,
+                                                      range.VertexCount,
+                                                      range.FaceStart * 3,
+                                                      range.FaceCount );
+            }
+            m_pEffect->EndPass();
+        }
+        m_pEffect->End();
+    }
+
+    // back to drawing one instance at a time
+    m_pDevice->SetStreamSourceFreq( 0, 1 );
+    m_pDevice->SetStreamSourceFreq( 1, 1 );
+    m_pDevice->SetStreamSource( 1, NULL, 0, 0 );
+
+    return hr;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::SetupPoseCache()
+// Desc: Allocates the palettes of the pose cache (see GetCachedPose()).
+//-----------------------------------------------------------------------------
+HRESULT CMultiAnim::SetupPoseCache()
+{
+    ReleasePoseCache();
+    if( m_dwPaletteSize == 0 )
+        return E_FAIL;
+
+    m_amxPoses = (D3DXMATRIXA16 *) _aligned_malloc( MULTIANIM_POSE_CACHE_SIZE * m_dwPaletteSize * sizeof( D3DXMATRIXA16 ), 16 );
+    return m_amxPoses ? S_OK : E_OUTOFMEMORY;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::ReleasePoseCache()
+// Desc: Frees the palettes of the pose cache.
+//-----------------------------------------------------------------------------
+void CMultiAnim::ReleasePoseCache()
+{
+    if( m_amxPoses )
+    {
+        _aligned_free( m_amxPoses );
+        m_amxPoses = NULL;
+    }
+    m_dwNumPoses = 0;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::ClearPoseCache()
+// Desc: Forgets the poses of the last frame.  Call once a frame, before the
+//       instances are updated (not while they are).
+//-----------------------------------------------------------------------------
+void CMultiAnim::ClearPoseCache()
+{
+    m_dwNumPoses = 0;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CMultiAnim::GetCachedPose()
+// Desc: Many instances play the same animation at about the same time (idle
+//       characters loitering, say).  An instance with a pose quantum (see
+//       CAnimInstance::SetPoseQuantum()) is in the same pose as any other
+//       playing the same shared animation sets, at the same weights, with
+//       the track times in the same quantum.  The first instance in a pose
+//       this frame computes the model space palette of the pose into the
+//       cache; the others get it from there, and only have to place it in
+//       the world.  Returns NULL if the instance has to compute its own
+//       palette: it doesn't share poses, the cache is full, or another
+//       thread is still computing the pose.  Instances may be updated in
+//       parallel; the palette returned stays valid until ClearPoseCache().
+//-----------------------------------------------------------------------------
+const D3DXMATRIXA16 * CMultiAnim::GetCachedPose( CAnimInstance * pAI )
+{
+    if( m_amxPoses == NULL || pAI->m_dPoseQuantum <= 0.0 )
+        return NULL;
+
+    // the key: the enabled tracks, sorted so the track they're on doesn't matter
+    PoseKey key;
+    ZeroMemory( & key, sizeof( key ) );
+    key.dQuantum = pAI->m_dPoseQuantum;
+
+    DWORD dwNumKeyTracks = 0;
+    UINT uiTracks = pAI->m_pAC->GetMaxNumTracks();
+    for( UINT uiTrack = 0; uiTrack < uiTracks; ++ uiTrack )
+    {
+        D3DXTRACK_DESC td;
+        if( FAILED( pAI->m_pAC->GetTrackDesc( uiTrack, & td ) ) || ! td.Enable || td.Weight <= 0.f )
+            continue;
+
+        LPD3DXANIMATIONSET pAS = NULL;
+        pAI->m_pAC->GetTrackAnimationSet( uiTrack, & pAS );
+        if( pAS == NULL )
+            continue;
+
+        if( dwNumKeyTracks == MULTIANIM_POSE_TRACKS )
+        {
+            pAS->Release();
+            return NULL;
+        }
+
+        // the controller keeps the set alive; we only compare the address
+        LPD3DXANIMATIONSET pASKey = pAS;
+        LONG lTime = (LONG) floor( pAS->GetPeriodicPosition( td.Position ) / key.dQuantum );
+        LONG lWeight = (LONG) ( td.Weight * MULTIANIM_POSE_WEIGHT_STEPS + .5f );
+        pAS->Release();
+
+        DWORD i = dwNumKeyTracks ++;
+        for( ; i > 0 && key.apSets[ i - 1 ] > pASKey; -- i )
+        {
+            key.apSets[ i ] = key.apSets[ i - 1 ];
+            key.alTimes[ i ] = key.alTimes[ i - 1 ];
+            key.alWeights[ i ] = key.alWeights[ i - 1 ];
+        }
+        key.apSets[ i ] = pASKey;
+        key.alTimes[ i ] = lTime;
+        key.alWeights[ i ] = lWeight;
+    }
+
+    // find the pose, or claim an entry to compute it in
+    D3DXMATRIXA16 * amxPose = NULL;
+    DWORD dwEntry;
+
+    EnterCriticalSection( & m_csPoses );
+    for( dwEntry = 0; dwEntry < m_dwNumPoses; ++ dwEntry )
+    {
+        if( memcmp( & m_aPoses[ dwEntry ].key, & key, sizeof( key ) ) == 0 )
+            break;
+    }
+
+    if( dwEntry < m_dwNumPoses )
+    {
+        if( m_aPoses[ dwEntry ].bReady )
+            amxPose = & m_amxPoses[ dwEntry * m_dwPaletteSize ];
+        LeaveCriticalSection( & m_csPoses );
+        return amxPose;
+    }
+
+    if( m_dwNumPoses == MULTIANIM_POSE_CACHE_SIZE )
+    {
+        LeaveCriticalSection( & m_csPoses );
+        return NULL;
+    }
+
+    dwEntry = m_dwNumPoses ++;
+    m_aPoses[ dwEntry ].key = key;
+    m_aPoses[ dwEntry ].bReady = false;
+    LeaveCriticalSection( & m_csPoses );
+
+    // compute it outside the lock
+    D3DXMATRIX mxIdentity;
+    D3DXMatrixIdentity( & mxIdentity );
+    amxPose = & m_amxPoses[ dwEntry * m_dwPaletteSize ];
+    pAI->UpdateFrames( & mxIdentity );
+    pAI->UpdatePalettes( amxPose );
+
+    EnterCriticalSection( & m_csPoses );
+    m_aPoses[ dwEntry ].bReady = true;
+    LeaveCriticalSection( & m_csPoses );
+
+    return amxPose;
+}
@@ -18,6 +18,7 @@
 #include "Tiny.h"
 #include "gameobject.h"
 #include "body.h"
+#include "spatialgrid.h"
 #pragma warning(default: 4995)
 
 using namespace std;
@@ -45,10 +46,16 @@ CTiny::CTiny( GameObject& owner ) :
     m_bPlaySounds( true ),
     m_dwCurrentTrack( 0 ),
 
+    m_dTimeLODPending( 0.0 ),
+    m_dwLODInterval( 1 ),
+    m_dwLODFrame( 0 ),
+    m_bLODBlending( false ),
+
     //m_fSpeed( 0.f ),
     m_fSpeedTurn( 0.f ),
     m_pCallbackHandler( NULL ),
     m_fPersonalRadius( 0.f ),
+    m_fBoundingRadius( 0.f ),
 
     m_fSpeedWalk( 1.f / 5.7f ),
     m_fSpeedJog( 1.f / 2.3f ),
@@ -116,6 +123,7 @@ HRESULT CTiny::Setup( CMultiAnim *pMA,
         return E_OUTOFMEMORY;
 
     m_pAI = m_pMA->GetInstance( m_dwMultiAnimIdx );
+    m_pAI->SetPoseQuantum( TINY_POSE_QUANTUM );
 
 
     // set up anim indices
@@ -135,11 +143,11 @@ HRESULT CTiny::Setup( CMultiAnim *pMA,
 
     // set up footstep callbacks
     SetupCallbacksAndCompression();
-    m_pCallbackHandler = new CBHandlerTiny;
+    m_pCallbackHandler = new CBHandlerTiny( m_CallbackData );
     if( m_pCallbackHandler == NULL )
         return E_OUTOFMEMORY;
 
-    // set up footstep sounds
+    // set up footstep sounds (a buffer per voice, see FootstepVoices)
     WCHAR sPath[ MAX_PATH ];
     if( g_apSoundsTiny[ 0 ] == NULL )
     {
@@ -147,7 +155,7 @@ HRESULT CTiny::Setup( CMultiAnim *pMA,
         if( FAILED( hr ) )
             StringCchCopy( sPath, MAX_PATH, FOOTFALLSOUND00 );
 
-        hr = m_pSM->Create( & g_apSoundsTiny[ 0 ], sPath, DSBCAPS_CTRLVOLUME );
+        hr = m_pSM->Create( & g_apSoundsTiny[ 0 ], sPath, DSBCAPS_CTRLVOLUME, GUID_NULL, FOOTSTEP_VOICES_MAX_VOICES );
         if( FAILED( hr ) )
         {
             OutputDebugString( FOOTFALLSOUND00 L" not found; continuing without sound.\n" );
@@ -161,7 +169,7 @@ HRESULT CTiny::Setup( CMultiAnim *pMA,
         if( FAILED( hr ) )
             StringCchCopy( sPath, MAX_PATH, FOOTFALLSOUND01 );
 
-        hr = m_pSM->Create( & g_apSoundsTiny[ 1 ], sPath, DSBCAPS_CTRLVOLUME );
+        hr = m_pSM->Create( & g_apSoundsTiny[ 1 ], sPath, DSBCAPS_CTRLVOLUME, GUID_NULL, FOOTSTEP_VOICES_MAX_VOICES );
         if( FAILED( hr ) )
         {
             OutputDebugString( FOOTFALLSOUND01 L" not found; continuing without sound.\n" );
@@ -178,6 +186,7 @@ HRESULT CTiny::Setup( CMultiAnim *pMA,
     D3DXMatrixMultiply( & m_mxOrientation, & m_mxOrientation, & mx );
     D3DXMatrixRotationY( & mx, D3DX_PI / 2.0f );
     D3DXMatrixMultiply( & m_mxOrientation, & m_mxOrientation, & mx );
+    m_fBoundingRadius = m_pMA->GetBoundingRadius() * fScale;
 
     LPD3DXANIMATIONCONTROLLER pAC;
     m_pAI->GetAnimController( & pAC );
@@ -250,7 +259,7 @@ void CTiny::SetOrientation( void )
 	mxWorld._21 = up.x; mxWorld._22 = up.y; mxWorld._23 = up.z;
 	mxWorld._31 = right.x; mxWorld._32 = right.y; mxWorld._33 = right.z;
 	
-	D3DXVECTOR3 pos = m_owner->GetBody().GetPos();
+	D3DXVECTOR3 pos = m_owner->GetBody().GetRenderPos();
 	D3DXMatrixTranslation( & mx, pos.x, pos.y, pos.z );
 	D3DXMatrixMultiply( &mxWorld, &mxWorld, &mx );
 	D3DXMatrixMultiply( &mxWorld, &m_mxOrientation, &mxWorld );
@@ -266,6 +275,8 @@ void CTiny::SetOrientation( void )
 HRESULT CTiny::ResetTime()
 {
     m_dTimeCurrent = m_dTimePrev = 0.0;
+    m_dTimeLODPending = 0.0;
+    m_bLODBlending = false;
     return m_pAI->ResetTime();
 }
 
@@ -279,8 +290,53 @@ HRESULT CTiny::ResetTime()
 //-----------------------------------------------------------------------------
 HRESULT CTiny::AdvanceTime( double dTimeDelta, D3DXVECTOR3 *pvEye )
 {
-    // if we're playing sounds, set the sound source position
-    if( m_bPlaySounds )
+    HRESULT hr = AdvanceAnimation( dTimeDelta, pvEye );
+    if( FAILED( hr ) )
+        return hr;
+
+    UpdateTransforms();
+    PlayCallbacks();
+    return S_OK;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CTiny::AdvanceAnimation()
+// Desc: Advances the local animation time by dTimeDelta, without updating
+//       the frames yet (see UpdateTransforms()).  Only touches this instance
+//       (the footstep callbacks wait for PlayCallbacks()), so it can run on a
+//       worker thread.
+//-----------------------------------------------------------------------------
+HRESULT CTiny::AdvanceAnimation( double dTimeDelta, D3DXVECTOR3 *pvEye )
+{
+    return AdvanceAnimationLOD( dTimeDelta, pvEye, 1 );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CTiny::AdvanceAnimationLOD()
+// Desc: AdvanceAnimation() for a character that is only animated every
+//       dwUpdateInterval frames (see AnimationLOD), or not at all when
+//       dwUpdateInterval is 0 (it isn't seen).  The local time still moves
+//       every frame, so the track keys are set at the right time; the
+//       animation controller is advanced by all the time it missed once the
+//       character is updated again.  In between updates, UpdateTransforms()
+//       blends the palettes of the last two updates.  A character too far
+//       away to be heard (see FootstepVoices) is advanced without the
+//       callback handler, so its footstep keys are skipped altogether.
+//-----------------------------------------------------------------------------
+HRESULT CTiny::AdvanceAnimationLOD( double dTimeDelta, D3DXVECTOR3 *pvEye, DWORD dwUpdateInterval )
+{
+    // if we're playing sounds and can be heard, set the sound source position
+    bool bAudible = m_bPlaySounds && pvEye != NULL;
+    if( bAudible && FootstepVoices::DoesSingletonExist() )
+        bAudible = g_footstepvoices.IsAudible( *m_CallbackData[ 0 ].m_pvTinyPos );
+
+    if( bAudible )
     {
         m_CallbackData[ 0 ].m_pvCameraPos = pvEye;
         m_CallbackData[ 1 ].m_pvCameraPos = pvEye;
@@ -293,7 +349,62 @@ HRESULT CTiny::AdvanceTime( double dTimeDelta, D3DXVECTOR3 *pvEye )
 
     m_dTimePrev = m_dTimeCurrent;
     m_dTimeCurrent += dTimeDelta;
-    return m_pAI->AdvanceTime( dTimeDelta, m_pCallbackHandler );
+    m_dTimeLODPending += dTimeDelta;
+
+    m_dwLODInterval = dwUpdateInterval;
+    if( dwUpdateInterval == 0 )
+    {
+        m_bLODBlending = false;
+        return S_OK;
+    }
+
+    if( dwUpdateInterval > 1 && m_bLODBlending && ++ m_dwLODFrame < dwUpdateInterval )
+        return S_OK;
+
+    m_dwLODFrame = 0;
+    double dTimeAdvance = m_dTimeLODPending;
+    m_dTimeLODPending = 0.0;
+    return m_pAI->AdvanceAnimation( dTimeAdvance, bAudible ? m_pCallbackHandler : NULL );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CTiny::UpdateTransforms()
+// Desc: Sets up the frames to reflect the last AdvanceAnimation().  Only
+//       touches this instance, so it can run on a worker thread.
+//-----------------------------------------------------------------------------
+void CTiny::UpdateTransforms()
+{
+    if( m_dwLODInterval == 0 )
+        return;
+
+    if( m_dwLODInterval == 1 )
+    {
+        m_pAI->UpdateTransforms();
+        m_bLODBlending = false;
+    }
+    else if( m_dwLODFrame == 0 )
+    {
+        m_pAI->UpdateTransformsBlended( ! m_bLODBlending );
+        m_bLODBlending = true;
+    }
+    else
+        m_pAI->BlendPalettes( (float) m_dwLODFrame / (float) m_dwLODInterval );
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// Name: CTiny::PlayCallbacks()
+// Desc: Plays the footstep sounds of the last AdvanceAnimation().  Must be
+//       called on the main thread.
+//-----------------------------------------------------------------------------
+void CTiny::PlayCallbacks()
+{
+    m_pCallbackHandler->PlayCallbacks();
 }
 
 
@@ -305,6 +416,10 @@ HRESULT CTiny::AdvanceTime( double dTimeDelta, D3DXVECTOR3 *pvEye )
 //-----------------------------------------------------------------------------
 HRESULT CTiny::Draw()
 {
+    // not seen, and not animated (see AdvanceAnimationLOD())
+    if( m_dwLODInterval == 0 )
+        return S_OK;
+
     return m_pAI->Draw();
 }
 
@@ -436,6 +551,31 @@ void CTiny::ChooseNewLocation( D3DXVECTOR3 *pV )
 //-----------------------------------------------------------------------------
 bool CTiny::IsBlockedByCharacter( D3DXVECTOR3 * pV )
 {
+    if( SpatialGrid::DoesSingletonExist() )
+    {
+        // only the characters near the location (every character has the same personal radius)
+        SpatialObjectList nearby;
+        g_spatialgrid.FindInRadius( *pV, m_fPersonalRadius + m_fPersonalRadius, nearby, SPATIAL_GRID_ANY_TYPE, m_owner );
+
+        SpatialObjectList::iterator i;
+        for( i = nearby.begin(); i != nearby.end(); ++ i )
+        {
+            if( !(*i)->HasTiny() )
+                continue;
+
+            CTiny * pChar = & (*i)->GetTiny();
+            D3DXVECTOR3 vSub;
+            D3DXVec3Subtract( & vSub, & pChar->m_owner->GetBody().GetPos(), pV );
+            float fRadiiSq = pChar->m_fPersonalRadius + m_fPersonalRadius;
+            fRadiiSq *= fRadiiSq;
+
+            if( D3DXVec3LengthSq( & vSub ) < fRadiiSq )
+                return true;
+        }
+
+        return false;
+    }
+
     D3DXVECTOR3 vSub;
 
     // move through each character to see if it blocks this
@@ -522,11 +662,11 @@ DWORD CTiny::GetAnimIndex( char sString[] )
 
 //-----------------------------------------------------------------------------
 // Name: CTiny::AddCallbackKeysAndCompress()
-// Desc: Replaces an animation set in the animation controller with the
-//       compressed version and callback keys added to it.
+// Desc: Replaces an animation set in the shared animation controller (and
+//       the instances') with the compressed version and callback keys added
+//       to it.
 //-----------------------------------------------------------------------------
-HRESULT CTiny::AddCallbackKeysAndCompress( LPD3DXANIMATIONCONTROLLER pAC,
-                                           LPD3DXKEYFRAMEDANIMATIONSET pAS,
+HRESULT CTiny::AddCallbackKeysAndCompress( LPD3DXKEYFRAMEDANIMATIONSET pAS,
                                            DWORD dwNumCallbackKeys,
                                            D3DXKEY_CALLBACK aKeys[],
                                            DWORD dwCompressionFlags,
@@ -536,7 +676,7 @@ HRESULT CTiny::AddCallbackKeysAndCompress( LPD3DXANIMATIONCONTROLLER pAC,
     LPD3DXCOMPRESSEDANIMATIONSET pASNew = NULL;
     LPD3DXBUFFER pBufCompressed = NULL;
 
-    hr = pAS->Compress( dwCompressionFlags, fCompression, NULL, &pBufCompressed );
+    hr = m_pMA->GetCompressedAnimationSet( pAS, dwCompressionFlags, fCompression, &pBufCompressed );
     if( FAILED( hr ) )
         goto e_Exit;
 
@@ -552,10 +692,9 @@ HRESULT CTiny::AddCallbackKeysAndCompress( LPD3DXANIMATIONCONTROLLER pAC,
     if( FAILED( hr ) )
         goto e_Exit;
 
-    pAC->UnregisterAnimationSet( pAS );
     pAS->Release();
 
-    hr = pAC->RegisterAnimationSet( pASNew );
+    hr = m_pMA->ReplaceAnimationSet( pASNew );
     if( FAILED( hr ) )
         goto e_Exit;
 
@@ -578,34 +717,48 @@ e_Exit:
 // Name: CTiny::SetupCallbacksAndCompression()
 // Desc: Add callback keys to the walking and jogging animation sets in the
 //       animation controller for playing footstepping sound.  Then compress
-//       all animation sets in the animation controller.
+//       all animation sets in the animation controller.  The sets are shared
+//       by all the characters (see CMultiAnim::ReplaceAnimationSet()), so
+//       only the first character to get here does this; the others only
+//       look up the indices of the sets.
 //-----------------------------------------------------------------------------
 HRESULT CTiny::SetupCallbacksAndCompression()
 {
-    LPD3DXANIMATIONCONTROLLER pAC;
-    LPD3DXKEYFRAMEDANIMATIONSET pASLoiter, pASWalk, pASJog;
-
-    m_pAI->GetAnimController( & pAC );
-    pAC->GetAnimationSet( m_dwAnimIdxLoiter, (LPD3DXANIMATIONSET *) & pASLoiter );
-    pAC->GetAnimationSet( m_dwAnimIdxWalk, (LPD3DXANIMATIONSET *) & pASWalk );
-    pAC->GetAnimationSet( m_dwAnimIdxJog, (LPD3DXANIMATIONSET *) & pASJog );
-
-    D3DXKEY_CALLBACK aKeysWalk[ 2 ];
-    aKeysWalk[ 0 ].Time = 0;
-    aKeysWalk[ 0 ].pCallbackData = & m_CallbackData[ 0 ];
-    aKeysWalk[ 1 ].Time = float( pASWalk->GetPeriod() / 2.0 * pASWalk->GetSourceTicksPerSecond() );
-    aKeysWalk[ 1 ].pCallbackData = & m_CallbackData[ 1 ];
-
-    D3DXKEY_CALLBACK aKeysJog[ 8 ];
-    for( int i = 0; i < 8; ++ i )
+    if( ! m_pMA->AreAnimationSetsShared() )
     {
-        aKeysJog[ i ].Time = float( pASJog->GetPeriod() / 8 * (double) i * pASWalk->GetSourceTicksPerSecond() );
-        aKeysJog[ i ].pCallbackData = & m_CallbackData[ ( i + 1 ) % 2 ];
-    }
+        LPD3DXANIMATIONCONTROLLER pAC;
+        LPD3DXKEYFRAMEDANIMATIONSET pASLoiter, pASWalk, pASJog;
+
+        // our controller was cloned from the shared one, so the indices match
+        m_dwAnimIdxLoiter = GetAnimIndex( "Loiter" );
+        m_dwAnimIdxWalk = GetAnimIndex( "Walk" );
+        m_dwAnimIdxJog = GetAnimIndex( "Jog" );
+
+        m_pMA->GetAnimController( & pAC );
+        pAC->GetAnimationSet( m_dwAnimIdxLoiter, (LPD3DXANIMATIONSET *) & pASLoiter );
+        pAC->GetAnimationSet( m_dwAnimIdxWalk, (LPD3DXANIMATIONSET *) & pASWalk );
+        pAC->GetAnimationSet( m_dwAnimIdxJog, (LPD3DXANIMATIONSET *) & pASJog );
+
+        D3DXKEY_CALLBACK aKeysWalk[ 2 ];
+        aKeysWalk[ 0 ].Time = 0;
+        aKeysWalk[ 0 ].pCallbackData = TINY_FOOT_KEY( 0 );
+        aKeysWalk[ 1 ].Time = float( pASWalk->GetPeriod() / 2.0 * pASWalk->GetSourceTicksPerSecond() );
+        aKeysWalk[ 1 ].pCallbackData = TINY_FOOT_KEY( 1 );
+
+        D3DXKEY_CALLBACK aKeysJog[ 8 ];
+        for( int i = 0; i < 8; ++ i )
+        {
+            aKeysJog[ i ].Time = float( pASJog->GetPeriod() / 8 * (double) i * pASWalk->GetSourceTicksPerSecond() );
+            aKeysJog[ i ].pCallbackData = TINY_FOOT_KEY( ( i + 1 ) % 2 );
+        }
 
-    AddCallbackKeysAndCompress( pAC, pASLoiter, 0, NULL, D3DXCOMPRESS_DEFAULT, .8f );
-    AddCallbackKeysAndCompress( pAC, pASWalk, 2, aKeysWalk, D3DXCOMPRESS_DEFAULT, .4f );
-    AddCallbackKeysAndCompress( pAC, pASJog, 8, aKeysJog, D3DXCOMPRESS_DEFAULT, .25f );
+        AddCallbackKeysAndCompress( pASLoiter, 0, NULL, D3DXCOMPRESS_DEFAULT, .8f );
+        AddCallbackKeysAndCompress( pASWalk, 2, aKeysWalk, D3DXCOMPRESS_DEFAULT, .4f );
+        AddCallbackKeysAndCompress( pASJog, 8, aKeysJog, D3DXCOMPRESS_DEFAULT, .25f );
+
+        pAC->Release();
+        m_pMA->SetAnimationSetsShared();
+    }
 
     m_dwAnimIdxLoiter = GetAnimIndex( "Loiter" );
     m_dwAnimIdxWalk = GetAnimIndex( "Walk" );
@@ -615,8 +768,6 @@ HRESULT CTiny::SetupCallbacksAndCompression()
         m_dwAnimIdxJog == ANIMINDEX_FAIL )
         return E_FAIL;
 
-    pAC->Release();
-
     return S_OK;
 }
 
@@ -788,6 +939,8 @@ HRESULT CTiny::RestoreDeviceObjects( LPDIRECT3DDEVICE9 pd3dDevice )
     m_pAI->GetAnimController( & pAC );
     pAC->ResetTime();
     pAC->AdvanceTime( m_dTimeCurrent, NULL );
+    m_dTimeLODPending = 0.0;
+    m_bLODBlending = false;
 
     // Initialize current track
     if( m_szASName[0] != '\0' )
@@ -11,6 +11,8 @@
 #define TINY_H
 
 #include "DXUT\SDKsound.h"
+#include "memtrack.h"
+#include "footstepvoices.h"
 
 #define IDLE_TRANSITION_TIME 0.125f
 #define MOVE_TRANSITION_TIME 0.25f
@@ -25,6 +27,14 @@ typedef std::basic_string< TCHAR > String;
 #define FOOTFALLSOUND00     L"footfall00.wav"
 #define FOOTFALLSOUND01     L"footfall01.wav"
 
+#define TINY_MAX_TRACKS         2           // tracks and track events a character uses at once
+#define TINY_MAX_TRACK_EVENTS   8           // (see CMultiAnim::SetInstanceLimits())
+#define TINY_POSE_QUANTUM       ( 1.0 / 30.0 )  // characters this close in an animation share the pose
+
+// The animation sets are shared by all the characters, so a footstep callback
+// key only holds the foot; each character's handler finds its own data.
+#define TINY_FOOT_KEY( dwFoot ) ( (LPVOID) (DWORD_PTR) ( ( dwFoot ) + 1 ) )
+
 
 extern CSound * g_apSoundsTiny[ 2 ];
 
@@ -45,17 +55,49 @@ struct CallbackDataTiny
 //-----------------------------------------------------------------------------
 // Name: class CBHandlerTiny
 // Desc: Derived from ID3DXAnimationCallbackHandler.  Callback handler for
-//       CTiny -- plays the footstep sounds
+//       CTiny -- plays the footstep sounds.  The animation controller may be
+//       advancing on a worker thread, so the callbacks are only recorded, and
+//       played on the main thread by PlayCallbacks().
 //-----------------------------------------------------------------------------
 class CBHandlerTiny : public ID3DXAnimationCallbackHandler
 {
     HRESULT CALLBACK HandleCallback( THIS_ UINT Track, LPVOID pCallbackData )
     {
-        CallbackDataTiny * pCD = (CallbackDataTiny *) pCallbackData;
+        // the key holds the foot (see TINY_FOOT_KEY)
+        DWORD dwFoot = (DWORD) (DWORD_PTR) pCallbackData - 1;
+        if( dwFoot < 2 )
+            m_v_pPending.push_back( & m_aCallbackData[ dwFoot ] );
+        return S_OK;
+    }
+
+public:
+
+    CBHandlerTiny( CallbackDataTiny aCallbackData[ 2 ] ) : m_aCallbackData( aCallbackData ) {}
+
+    void PlayCallbacks()
+    {
+        for( size_t i = 0; i < m_v_pPending.size(); ++ i )
+            Play( m_v_pPending[ i ] );
+        m_v_pPending.clear();
+    }
+
+private:
+
+    CallbackDataTiny * m_aCallbackData;     // the data of each foot of our character
+    std::vector< CallbackDataTiny* > m_v_pPending;
 
+    void Play( CallbackDataTiny * pCD )
+    {
         // this is set to NULL if we're not playing sounds
         if( /*fornow*/ ! pCD || ! pCD->m_pvCameraPos )
-            return S_OK;
+            return;
+
+        // the voice manager plays the nearest footsteps at the end of the frame
+        if( FootstepVoices::DoesSingletonExist() )
+        {
+            g_footstepvoices.Request( g_apSoundsTiny[ pCD->m_dwFoot ], *pCD->m_pvTinyPos );
+            return;
+        }
 
         // scale volume by distance from tiny
         D3DXVECTOR3 vDiff;
@@ -66,8 +108,6 @@ class CBHandlerTiny : public ID3DXAnimationCallbackHandler
         // play the sound
         if( pCD && g_apSoundsTiny[ pCD->m_dwFoot ] )
             g_apSoundsTiny[ pCD->m_dwFoot ]->Play( 0, 0, (LONG) fVolume );
-
-        return S_OK;
     }
 };
 
@@ -103,12 +143,18 @@ protected:
     bool                 m_bPlaySounds;       // true == this instance is playing sounds
     DWORD                m_dwCurrentTrack;    // current animation track for primary animation
 
+    // animation level of detail (see AdvanceAnimationLOD())
+    double               m_dTimeLODPending;   // time the animation controller hasn't been advanced by yet
+    DWORD                m_dwLODInterval;     // update interval of this frame (0 == culled)
+    DWORD                m_dwLODFrame;        // frames since the last reduced rate update
+    bool                 m_bLODBlending;      // the last update was a reduced rate one
+
     // character traits
     float                m_fSpeedTurn;        // character's turning speed -- in radians/second
-    ID3DXAnimationCallbackHandler *
-                         m_pCallbackHandler;  // pointer to callback inteface to handle callback keys
+    CBHandlerTiny *      m_pCallbackHandler;  // pointer to callback inteface to handle callback keys
     D3DXMATRIX           m_mxOrientation;     // transform that gets the mesh into a common world space
     float                m_fPersonalRadius;   // personal space radius -- things can't get closer than this
+    float                m_fBoundingRadius;   // bounding radius of the mesh in world space
                                               // (note that no height information is given--not necessary for this sample)
     // character status
     //D3DXVECTOR3          m_vPos;              // current position in the map -- in our sample, y is always == 0
@@ -128,6 +174,8 @@ protected:
 
 public:
 
+    DeclareMemoryTag( MEMORY_TAG_COMPONENT )
+
     CTiny( GameObject& owner );
     virtual ~CTiny();
     virtual HRESULT Setup( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoundManager *pSM, double dTimeCurrent );
@@ -136,6 +184,10 @@ public:
     void GetPosition( D3DXVECTOR3 *pV );
     virtual HRESULT ResetTime();
     virtual HRESULT AdvanceTime( double dTimeDelta, D3DXVECTOR3 *pvEye );
+    virtual HRESULT AdvanceAnimation( double dTimeDelta, D3DXVECTOR3 *pvEye );
+    virtual HRESULT AdvanceAnimationLOD( double dTimeDelta, D3DXVECTOR3 *pvEye, DWORD dwUpdateInterval );
+    virtual void UpdateTransforms();
+    virtual void PlayCallbacks();
     virtual HRESULT Draw();
     virtual void Report( std::vector < String > & v_sReport );
     virtual void SetUserControl();
@@ -143,6 +195,7 @@ public:
     virtual void SetSounds( bool bSounds );
     virtual void ChooseNewLocation( D3DXVECTOR3 *pV );
 	inline GameObject* GetOwner( void )			{ return( m_owner ); }
+    float GetBoundingRadius()                   { return m_fBoundingRadius; }
 
 	void SmoothLoiter();
     void SetMoveKey();
@@ -158,7 +211,7 @@ protected:      // ************ The following are not callable by the app -- int
 
     bool IsBlockedByCharacter( D3DXVECTOR3 *pV );
     DWORD GetAnimIndex( char sString[] );
-    HRESULT AddCallbackKeysAndCompress( LPD3DXANIMATIONCONTROLLER pAC, LPD3DXKEYFRAMEDANIMATIONSET pAS, DWORD dwNumCallbackKeys, D3DXKEY_CALLBACK aKeys[], DWORD dwCompressionFlags, FLOAT fCompression );
+    HRESULT AddCallbackKeysAndCompress( LPD3DXKEYFRAMEDANIMATIONSET pAS, DWORD dwNumCallbackKeys, D3DXKEY_CALLBACK aKeys[], DWORD dwCompressionFlags, FLOAT fCompression );
     HRESULT SetupCallbacksAndCompression();
     void SetIdleState();
     virtual bool IsOutOfBounds( D3DXVECTOR3 *pV );
@@ -0,0 +1,137 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "animationlod.h"
+
+
+AnimationLOD::AnimationLOD( void )
+: m_numTiers( 0 ),
+  m_culling( true ),
+  m_hasView( false ),
+  m_eye( 0.0f, 0.0f, 0.0f )
+{
+	//The characters walk within [0,1] on x and z
+	AddTier( 1.0f, 1 );
+	AddTier( 2.0f, 2 );
+	AddTier( 4.0f, 4 );
+}
+
+void AnimationLOD::ClearTiers( void )
+{
+	m_numTiers = 0;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AddTier
+
+  Description:  Adds a distance tier after the existing ones.
+
+  Arguments:    maxDistance    : the farthest distance from the eye in the tier
+                updateInterval : the characters in the tier are animated every
+				                 this many frames (at least 1)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void AnimationLOD::AddTier( float maxDistance, unsigned int updateInterval )
+{
+	ASSERTMSG( m_numTiers < ANIMATION_LOD_MAX_TIERS, "AnimationLOD::AddTier - Too many tiers." );
+	ASSERTMSG( updateInterval > 0, "AnimationLOD::AddTier - The update interval must be at least 1." );
+	ASSERTMSG( m_numTiers == 0 || maxDistance * maxDistance > m_tiers[m_numTiers - 1].m_maxDistanceSq, "AnimationLOD::AddTier - The tiers must be in order of increasing distance." );
+
+	if( m_numTiers < ANIMATION_LOD_MAX_TIERS )
+	{
+		m_tiers[m_numTiers].m_maxDistanceSq = maxDistance * maxDistance;
+		m_tiers[m_numTiers].m_updateInterval = updateInterval > 0 ? updateInterval : 1;
+		m_numTiers++;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BeginFrame
+
+  Description:  Takes the view of the frame about to be drawn. The frustum
+                planes are extracted from the view projection matrix (they
+				point inwards).
+
+  Arguments:    viewProj : the view projection matrix
+                eye      : the camera position
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void AnimationLOD::BeginFrame( const D3DXMATRIX * viewProj, const D3DXVECTOR3 * eye )
+{
+	m_hasView = ( viewProj != 0 && eye != 0 );
+	if( !m_hasView )
+	{
+		return;
+	}
+
+	const D3DXMATRIX & m = *viewProj;
+	m_frustum[0] = D3DXPLANE( m._14 + m._11, m._24 + m._21, m._34 + m._31, m._44 + m._41 );	//Left
+	m_frustum[1] = D3DXPLANE( m._14 - m._11, m._24 - m._21, m._34 - m._31, m._44 - m._41 );	//Right
+	m_frustum[2] = D3DXPLANE( m._14 + m._12, m._24 + m._22, m._34 + m._32, m._44 + m._42 );	//Bottom
+	m_frustum[3] = D3DXPLANE( m._14 - m._12, m._24 - m._22, m._34 - m._32, m._44 - m._42 );	//Top
+	m_frustum[4] = D3DXPLANE( m._13, m._23, m._33, m._43 );									//Near
+	m_frustum[5] = D3DXPLANE( m._14 - m._13, m._24 - m._23, m._34 - m._33, m._44 - m._43 );	//Far
+	for( int i = 0; i < 6; i++ )
+	{
+		D3DXPlaneNormalize( &m_frustum[i], &m_frustum[i] );
+	}
+
+	m_eye = *eye;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetUpdateInterval
+
+  Description:  Finds how often a character is animated this frame.
+
+  Arguments:    center : the center of the character's bounding sphere
+                radius : the radius of the sphere
+
+  Returns:      The update interval in frames, or ANIMATION_LOD_CULLED when
+                the sphere is outside the view. Without a view (BeginFrame
+				wasn't given one), every character is animated every frame.
+ *---------------------------------------------------------------------------*/
+unsigned int AnimationLOD::GetUpdateInterval( const D3DXVECTOR3 & center, float radius )
+{
+	if( !m_hasView )
+	{
+		return( 1 );
+	}
+
+	if( m_culling )
+	{
+		for( int i = 0; i < 6; i++ )
+		{
+			if( D3DXPlaneDotCoord( &m_frustum[i], &center ) < -radius )
+			{
+				return( ANIMATION_LOD_CULLED );
+			}
+		}
+	}
+
+	if( m_numTiers == 0 )
+	{
+		return( 1 );
+	}
+
+	D3DXVECTOR3 diff = center - m_eye;
+	float distanceSq = D3DXVec3LengthSq( &diff );
+	for( unsigned int i = 0; i < m_numTiers; i++ )
+	{
+		if( distanceSq <= m_tiers[i].m_maxDistanceSq )
+		{
+			return( m_tiers[i].m_updateInterval );
+		}
+	}
+	return( m_tiers[m_numTiers - 1].m_updateInterval );
+}
@@ -0,0 +1,64 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+
+
+#define ANIMATION_LOD_MAX_TIERS (8)
+#define ANIMATION_LOD_CULLED (0)		//Update interval of a character that isn't seen
+
+
+//Level of detail for the character animations. Each frame, a character whose
+//bounding sphere is outside the view frustum is culled: its animation time
+//accumulates and it catches up once it is seen again. The others fall in the
+//first tier (by distance from the eye) that reaches them, and are animated
+//every updateInterval frames; their skinning palettes are blended in between
+//(see CTiny::AdvanceAnimationLOD). Characters beyond the last tier use its
+//interval. With no tiers, every seen character is animated every frame.
+//
+//BeginFrame is for the main thread; GetUpdateInterval only reads, so the
+//parallel animation update can call it.
+class AnimationLOD : public Singleton <AnimationLOD>
+{
+public:
+
+	AnimationLOD( void );
+	~AnimationLOD( void ) {}
+
+	//Configuration
+	void ClearTiers( void );
+	void AddTier( float maxDistance, unsigned int updateInterval );		//In order of increasing distance
+	inline void SetCulling( bool enable )			{ m_culling = enable; }
+	inline bool IsCulling( void )					{ return( m_culling ); }
+
+	void BeginFrame( const D3DXMATRIX * viewProj, const D3DXVECTOR3 * eye );
+	unsigned int GetUpdateInterval( const D3DXVECTOR3 & center, float radius );	//ANIMATION_LOD_CULLED if not seen
+
+private:
+
+	struct Tier
+	{
+		float m_maxDistanceSq;
+		unsigned int m_updateInterval;
+	};
+
+	Tier m_tiers[ANIMATION_LOD_MAX_TIERS];
+	unsigned int m_numTiers;
+	bool m_culling;
+
+	//The view of the current frame
+	bool m_hasView;
+	D3DXPLANE m_frustum[6];
+	D3DXVECTOR3 m_eye;
+
+};
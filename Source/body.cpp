@@ -11,22 +11,59 @@
 #include "DXUT.h"
 #include "body.h"
 
-Body::Body( int health, D3DXVECTOR3& pos, GameObject& owner )
+Body::Body( int health, Vector3& pos, GameObject& owner )
 : m_health( health ),
   m_owner( &owner ),
-  m_speed( 0.0f ),
-  m_radius( 1.0f )
+  m_storeIndex( BODY_STORE_NO_INDEX ),
+  m_gridEntry( SPATIAL_GRID_NO_ENTRY )
 {
-	m_pos = pos;
+	if( BodyStore::DoesSingletonExist() ) {
+		m_storeIndex = g_bodystore.Allocate( owner );
+	}
 
-	m_dir.x = 1.0f;
-	m_dir.y = 0.0f;
-	m_dir.z = 0.0f;
+	if( IsStored() )
+	{
+		m_pos = &g_bodystore.GetPos( m_storeIndex );
+		m_prevPos = &g_bodystore.GetPrevPos( m_storeIndex );
+		m_renderPos = &g_bodystore.GetRenderPos( m_storeIndex );
+		m_dir = &g_bodystore.GetDir( m_storeIndex );
+		m_speed = &g_bodystore.GetSpeed( m_storeIndex );
+		m_radius = &g_bodystore.GetRadius( m_storeIndex );
+	}
+	else
+	{
+		m_pos = &m_localPos;
+		m_prevPos = &m_localPrevPos;
+		m_renderPos = &m_localRenderPos;
+		m_dir = &m_localDir;
+		m_speed = &m_localSpeed;
+		m_radius = &m_localRadius;
+	}
+
+	*m_pos = pos;
+	*m_prevPos = pos;
+	*m_renderPos = pos;
+
+	m_dir->x = 1.0f;
+	m_dir->y = 0.0f;
+	m_dir->z = 0.0f;
+
+	*m_speed = 0.0f;
+	*m_radius = 1.0f;
+
+	if( SpatialGrid::DoesSingletonExist() ) {
+		m_gridEntry = g_spatialgrid.Insert( owner, m_pos );
+	}
 }
 
 Body::~Body( void )
 {
-
+	if( IsInGrid() && SpatialGrid::DoesSingletonExist() ) {
+		g_spatialgrid.Remove( m_gridEntry );
+	}
+	if( IsStored() && BodyStore::DoesSingletonExist() ) {
+		g_bodystore.Release( m_storeIndex );
+	}
 }
 
 
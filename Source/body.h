@@ -10,30 +10,50 @@
 
 #pragma once
 
+#include "vector.h"
+#include "bodystore.h"
+#include "spatialgrid.h"
+#include "memtrack.h"
+
 class GameObject;
 
 
 class Body
 {
 public:
-	Body( int health, D3DXVECTOR3& pos, GameObject& owner );
+	DeclareMemoryTag( MEMORY_TAG_COMPONENT )
+
+	Body( int health, Vector3& pos, GameObject& owner );
 	~Body( void );
 
 	inline int GetHealth( void )					{ return( m_health ); }
 	inline void SetHealth( int health )				{ if( health > 0 ) { m_health = health; } else { m_health = 0; } }
 	inline bool IsAlive( void )						{ return( m_health > 0 ); }
 
-	inline void SetSpeed( float speed )				{ m_speed = speed; }
-	inline float GetSpeed( void )					{ return( m_speed ); }
+	inline void SetSpeed( float speed )				{ *m_speed = speed; }
+	inline float GetSpeed( void )					{ return( *m_speed ); }
+
+	inline void SetPos( Vector3& pos )			{ *m_prevPos = pos; MoveTo( pos ); }		//Teleport (not interpolated from the old position)
+	inline void MoveTo( Vector3& pos )			{ *m_pos = pos; *m_renderPos = pos; if( IsInGrid() ) { g_spatialgrid.Move( m_gridEntry ); } }	//Movement within a simulation step
+	inline Vector3& GetPos( void )				{ return( *m_pos ); }
+
+	//Fixed timestep rendering (the render position lags between the last two simulation steps)
+	inline void BeginStep( void )					{ *m_prevPos = *m_pos; }
+	inline void Interpolate( float alpha )			{ *m_renderPos = *m_prevPos + ( *m_pos - *m_prevPos ) * alpha; }
+	inline Vector3& GetRenderPos( void )		{ return( *m_renderPos ); }
 
-	inline void SetPos( D3DXVECTOR3& pos )			{ m_pos = pos; }
-	inline D3DXVECTOR3& GetPos( void )				{ return( m_pos ); }
+	inline void SetDir( Vector3& dir )			{ *m_dir = dir; }
+	inline Vector3& GetDir( void )				{ return( *m_dir ); }
 
-	inline void SetDir( D3DXVECTOR3& dir )			{ m_dir = dir; }
-	inline D3DXVECTOR3& GetDir( void )				{ return( m_dir ); }
+	inline void SetRadius( float radius )			{ *m_radius = radius; }
+	inline float GetRadius( void )					{ return( *m_radius ); }
 
-	inline void SetRadius( float radius )			{ m_radius = radius; }
-	inline float GetRadius( void )					{ return( m_radius ); }
+	//Whether the fields live in the BodyStore arrays (then they are swept by the store)
+	inline bool IsStored( void )					{ return( m_storeIndex != BODY_STORE_NO_INDEX ); }
+	inline unsigned int GetStoreIndex( void )		{ return( m_storeIndex ); }
+
+	//Whether the position is indexed by the SpatialGrid (bodies register themselves if it exists)
+	inline bool IsInGrid( void )					{ return( m_gridEntry != SPATIAL_GRID_NO_ENTRY ); }
 
 
 protected:
@@ -41,11 +61,22 @@ protected:
 	GameObject* m_owner;
 
 	int m_health;
-
-	D3DXVECTOR3 m_pos;		//Current position
-	D3DXVECTOR3 m_dir;		//Current facing direction
-	float m_speed;			//Current movement speed
-
-	float m_radius;			//Personal bounding radius
+	unsigned int m_storeIndex;	//BODY_STORE_NO_INDEX if the fields are the local ones
+	unsigned int m_gridEntry;	//SPATIAL_GRID_NO_ENTRY if not in the grid
+
+	//The fields, in the BodyStore if it exists (and has room), otherwise the local copies below
+	Vector3* m_pos;		//Current position
+	Vector3* m_prevPos;	//Position at the start of the current simulation step
+	Vector3* m_renderPos;	//Position to draw at
+	Vector3* m_dir;		//Current facing direction
+	float* m_speed;			//Current movement speed
+	float* m_radius;		//Personal bounding radius
+
+	Vector3 m_localPos;
+	Vector3 m_localPrevPos;
+	Vector3 m_localRenderPos;
+	Vector3 m_localDir;
+	float m_localSpeed;
+	float m_localRadius;
 
 };
\ No newline at end of file
@@ -0,0 +1,433 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+#include "DXUT.h"
+#include "bodystore.h"
+#include "gameobject.h"
+#include <math.h>
+#ifdef BODY_STORE_SIMD
+#include <emmintrin.h>
+#endif
+
+
+BodyStore::BodyStore( unsigned int capacity )
+: m_capacity( capacity ),
+  m_numBodies( 0 ),
+  m_end( 0 )
+{
+#ifdef BODY_STORE_SIMD
+	COMPILE_TIME_ASSERT( sizeof( Vector3 ) == 3 * sizeof( float ), vector3_must_be_three_packed_floats );
+#endif
+
+	m_owner = new GameObject*[capacity];
+	m_pos = new Vector3[capacity];
+	m_prevPos = new Vector3[capacity];
+	m_renderPos = new Vector3[capacity];
+	m_dir = new Vector3[capacity];
+	m_speed = new float[capacity];
+	m_radius = new float[capacity];
+	m_target = new Vector3[capacity];
+	m_speedScale = new float[capacity];
+	m_movable = new bool[capacity];
+	m_arrivalPending = new bool[capacity];
+	m_followIndex = new unsigned int[capacity];
+	m_followID = new objectID[capacity];
+
+	m_free.reserve( capacity );
+}
+
+BodyStore::~BodyStore( void )
+{
+	delete[] m_owner;
+	delete[] m_pos;
+	delete[] m_prevPos;
+	delete[] m_renderPos;
+	delete[] m_dir;
+	delete[] m_speed;
+	delete[] m_radius;
+	delete[] m_target;
+	delete[] m_speedScale;
+	delete[] m_movable;
+	delete[] m_arrivalPending;
+	delete[] m_followIndex;
+	delete[] m_followID;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Allocate
+
+  Description:  Reserves the fields of a new body. Released indices are
+                reused first, so the arrays stay dense.
+
+  Arguments:    owner : the game object of the body
+
+  Returns:      The store index, or BODY_STORE_NO_INDEX if the store is full.
+ *---------------------------------------------------------------------------*/
+unsigned int BodyStore::Allocate( GameObject & owner )
+{
+	unsigned int index;
+	if( !m_free.empty() )
+	{
+		index = m_free.back();
+		m_free.pop_back();
+	}
+	else if( m_end < m_capacity )
+	{
+		index = m_end++;
+	}
+	else
+	{
+		return( BODY_STORE_NO_INDEX );
+	}
+
+	m_owner[index] = &owner;
+	m_target[index] = Vector3( 0.0f, 0.0f, 0.0f );
+	m_speedScale[index] = 1.0f;
+	m_movable[index] = false;
+	m_arrivalPending[index] = false;
+	m_followIndex[index] = BODY_STORE_NO_INDEX;
+	m_followID[index] = 0;
+	m_numBodies++;
+	return( index );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Release
+
+  Description:  Frees the fields of a destroyed body.
+
+  Arguments:    index : the store index
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void BodyStore::Release( unsigned int index )
+{
+	ASSERTMSG( index < m_end && m_owner[index], "BodyStore::Release - Index not in use" );
+
+	ClearFollow( index );	//Bodies that follow this one notice it's gone by its ID
+	m_owner[index] = 0;
+	m_movable[index] = false;
+	m_arrivalPending[index] = false;
+	m_numBodies--;
+
+	if( index + 1 == m_end ) {
+		m_end--;
+	}
+	else {
+		m_free.push_back( index );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetFollow
+
+  Description:  Makes a body follow another stored body: the position of the
+                followed body becomes its target at the start of every
+				Integrate, until ClearFollow or the followed body is released.
+
+  Arguments:    index       : the store index of the follower
+                followIndex : the store index of the followed body
+				followID    : the ID of the followed body
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void BodyStore::SetFollow( unsigned int index, unsigned int followIndex, objectID followID )
+{
+	ASSERTMSG( followIndex < m_end && m_owner[followIndex], "BodyStore::SetFollow - Followed index not in use" );
+
+	if( m_followIndex[index] == BODY_STORE_NO_INDEX ) {
+		m_followers.push_back( index );
+	}
+	m_followIndex[index] = followIndex;
+	m_followID[index] = followID;
+	m_target[index] = m_pos[followIndex];
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ClearFollow
+
+  Description:  Stops a body following another. The target stays where the
+                followed body was last.
+
+  Arguments:    index : the store index of the follower
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void BodyStore::ClearFollow( unsigned int index )
+{
+	if( m_followIndex[index] == BODY_STORE_NO_INDEX ) {
+		return;
+	}
+
+	m_followIndex[index] = BODY_STORE_NO_INDEX;
+	for( unsigned int f=0; f<m_followers.size(); ++f )
+	{
+		if( m_followers[f] == index )
+		{
+			m_followers[f] = m_followers.back();
+			m_followers.pop_back();
+			break;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         UpdateFollowTargets
+
+  Description:  Moves the target of every follower to the position of the
+                body it follows. Followers whose body has been released
+				(its index is free or belongs to another object now) stop
+				following.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void BodyStore::UpdateFollowTargets( void )
+{
+	unsigned int f = 0;
+	while( f < m_followers.size() )
+	{
+		unsigned int index = m_followers[f];
+		unsigned int followed = m_followIndex[index];
+		if( m_owner[followed] && m_owner[followed]->GetID() == m_followID[index] )
+		{
+			m_target[index] = m_pos[followed];
+			f++;
+		}
+		else
+		{
+			m_followIndex[index] = BODY_STORE_NO_INDEX;
+			m_followers[f] = m_followers.back();
+			m_followers.pop_back();
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Integrate
+
+  Description:  Moves every movable body towards its target (the position
+                and facing part of Movement::Animate, for all bodies in one
+				sweep). Unused indices are never movable. Followers get the
+				current position of the body they follow as their target
+				first. The last step to a target lands on it rather than
+				past it.
+
+  Arguments:    dTimeDelta : the elapsed time
+                arrived    : filled with the owners of the bodies that have
+				             reached their goal this sweep (in index order).
+							 Each goal is reported once.
+
+  Returns:      None. (The arrivals are stored in the arrived argument.)
+ *---------------------------------------------------------------------------*/
+void BodyStore::Integrate( double dTimeDelta, BodyOwnerList & arrived )
+{
+	arrived.clear();
+	UpdateFollowTargets();
+
+	unsigned int i = 0;
+#ifdef BODY_STORE_SIMD
+	for( ; i + BODY_STORE_SIMD_WIDTH <= m_end; i += BODY_STORE_SIMD_WIDTH )
+	{
+		IntegrateBatch( i, dTimeDelta, arrived );
+	}
+#endif
+	for( ; i<m_end; ++i )
+	{
+		IntegrateOne( i, dTimeDelta, arrived );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         IntegrateOne
+
+  Description:  Integrate for a single body.
+
+  Arguments:    index      : the store index
+                dTimeDelta : the elapsed time
+                arrived    : the owner is added if the goal has been reached
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void BodyStore::IntegrateOne( unsigned int index, double dTimeDelta, BodyOwnerList & arrived )
+{
+	if( !m_movable[index] || m_speed[index] == 0.0f ) {
+		return;
+	}
+
+	Vector3 toTarget = m_target[index] - m_pos[index];
+	float length = sqrtf( toTarget.x * toTarget.x + toTarget.y * toTarget.y + toTarget.z * toTarget.z );
+
+	if( length < BODY_STORE_ARRIVAL_DISTANCE )
+	{
+		if( m_arrivalPending[index] )
+		{
+			m_arrivalPending[index] = false;
+			arrived.push_back( m_owner[index] );
+		}
+	}
+	else
+	{	//Face the target and move towards it
+		m_dir[index] = toTarget * ( 1.0f / length );
+		float step = float( m_speed[index] * m_speedScale[index] * dTimeDelta );
+		if( step > length ) {
+			step = length;
+		}
+		Vector3 newPos = m_pos[index] + m_dir[index] * step;
+		m_pos[index] = newPos;
+		m_renderPos[index] = newPos;
+	}
+}
+
+#ifdef BODY_STORE_SIMD
+
+//Four consecutive Vector3s (12 floats) to and from one register per component
+static inline void LoadVector3x4( Vector3 * v, __m128 & x, __m128 & y, __m128 & z )
+{
+	float * f = &v->x;
+	__m128 a = _mm_loadu_ps( f );		//x0 y0 z0 x1
+	__m128 b = _mm_loadu_ps( f + 4 );	//y1 z1 x2 y2
+	__m128 c = _mm_loadu_ps( f + 8 );	//z2 x3 y3 z3
+
+	__m128 xy23 = _mm_shuffle_ps( b, c, _MM_SHUFFLE( 2, 1, 3, 2 ) );	//x2 y2 x3 y3
+	__m128 yz01 = _mm_shuffle_ps( a, b, _MM_SHUFFLE( 1, 0, 2, 1 ) );	//y0 z0 y1 z1
+	x = _mm_shuffle_ps( a, xy23, _MM_SHUFFLE( 2, 0, 3, 0 ) );
+	y = _mm_shuffle_ps( yz01, xy23, _MM_SHUFFLE( 3, 1, 2, 0 ) );
+	z = _mm_shuffle_ps( yz01, c, _MM_SHUFFLE( 3, 0, 3, 1 ) );
+}
+
+static inline void StoreVector3x4( Vector3 * v, __m128 x, __m128 y, __m128 z )
+{
+	float * f = &v->x;
+	__m128 xy01 = _mm_shuffle_ps( x, y, _MM_SHUFFLE( 1, 0, 1, 0 ) );	//x0 x1 y0 y1
+	__m128 zx01 = _mm_shuffle_ps( z, x, _MM_SHUFFLE( 1, 1, 0, 0 ) );	//z0 z0 x1 x1
+	__m128 yz11 = _mm_shuffle_ps( y, z, _MM_SHUFFLE( 1, 1, 1, 1 ) );	//y1 y1 z1 z1
+	__m128 xy22 = _mm_shuffle_ps( x, y, _MM_SHUFFLE( 2, 2, 2, 2 ) );	//x2 x2 y2 y2
+	__m128 zx23 = _mm_shuffle_ps( z, x, _MM_SHUFFLE( 3, 3, 2, 2 ) );	//z2 z2 x3 x3
+	__m128 yz33 = _mm_shuffle_ps( y, z, _MM_SHUFFLE( 3, 3, 3, 3 ) );	//y3 y3 z3 z3
+	_mm_storeu_ps( f, _mm_shuffle_ps( xy01, zx01, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+	_mm_storeu_ps( f + 4, _mm_shuffle_ps( yz11, xy22, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+	_mm_storeu_ps( f + 8, _mm_shuffle_ps( zx23, yz33, _MM_SHUFFLE( 2, 0, 2, 0 ) ) );
+}
+
+static inline __m128 Select( __m128 mask, __m128 a, __m128 b )	//mask ? a : b
+{
+	return( _mm_or_ps( _mm_and_ps( mask, a ), _mm_andnot_ps( mask, b ) ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         IntegrateBatch
+
+  Description:  Integrate for BODY_STORE_SIMD_WIDTH consecutive bodies. Gives
+                the same results as IntegrateOne (the same operations in the
+				same order, with the speed scale done in double precision).
+
+  Arguments:    first      : the store index of the first body
+                dTimeDelta : the elapsed time
+                arrived    : the owners are added if the goal has been reached
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void BodyStore::IntegrateBatch( unsigned int first, double dTimeDelta, BodyOwnerList & arrived )
+{
+	const __m128 zero = _mm_setzero_ps();
+	__m128 speed = _mm_loadu_ps( &m_speed[first] );
+	__m128 movable = _mm_set_ps( m_movable[first+3] ? 1.0f : 0.0f, m_movable[first+2] ? 1.0f : 0.0f, m_movable[first+1] ? 1.0f : 0.0f, m_movable[first] ? 1.0f : 0.0f );
+	__m128 active = _mm_and_ps( _mm_cmpneq_ps( movable, zero ), _mm_cmpneq_ps( speed, zero ) );
+	if( _mm_movemask_ps( active ) == 0 ) {
+		return;
+	}
+
+	__m128 posX, posY, posZ, targetX, targetY, targetZ;
+	LoadVector3x4( &m_pos[first], posX, posY, posZ );
+	LoadVector3x4( &m_target[first], targetX, targetY, targetZ );
+
+	__m128 toX = _mm_sub_ps( targetX, posX );
+	__m128 toY = _mm_sub_ps( targetY, posY );
+	__m128 toZ = _mm_sub_ps( targetZ, posZ );
+	__m128 length = _mm_sqrt_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( toX, toX ), _mm_mul_ps( toY, toY ) ), _mm_mul_ps( toZ, toZ ) ) );
+
+	__m128 reached = _mm_cmplt_ps( length, _mm_set1_ps( BODY_STORE_ARRIVAL_DISTANCE ) );
+	int arrivedMask = _mm_movemask_ps( _mm_and_ps( active, reached ) );
+	for( int lane=0; lane<BODY_STORE_SIMD_WIDTH; ++lane )
+	{
+		if( ( arrivedMask & ( 1 << lane ) ) && m_arrivalPending[first + lane] )
+		{
+			m_arrivalPending[first + lane] = false;
+			arrived.push_back( m_owner[first + lane] );
+		}
+	}
+
+	__m128 moving = _mm_andnot_ps( reached, active );
+	if( _mm_movemask_ps( moving ) == 0 ) {
+		return;
+	}
+
+	//Face the target (lanes that aren't moving keep their values)
+	__m128 invLength = _mm_div_ps( _mm_set1_ps( 1.0f ), length );
+	__m128 dirX, dirY, dirZ;
+	LoadVector3x4( &m_dir[first], dirX, dirY, dirZ );
+	dirX = Select( moving, _mm_mul_ps( toX, invLength ), dirX );
+	dirY = Select( moving, _mm_mul_ps( toY, invLength ), dirY );
+	dirZ = Select( moving, _mm_mul_ps( toZ, invLength ), dirZ );
+	StoreVector3x4( &m_dir[first], dirX, dirY, dirZ );
+
+	//Step length: float( speed * speedScale * dTimeDelta ), the last product in double, no longer than the distance
+	__m128 speedScaled = _mm_mul_ps( speed, _mm_loadu_ps( &m_speedScale[first] ) );
+	__m128d dt = _mm_set1_pd( dTimeDelta );
+	__m128 step01 = _mm_cvtpd_ps( _mm_mul_pd( _mm_cvtps_pd( speedScaled ), dt ) );
+	__m128 step23 = _mm_cvtpd_ps( _mm_mul_pd( _mm_cvtps_pd( _mm_movehl_ps( speedScaled, speedScaled ) ), dt ) );
+	__m128 step = _mm_min_ps( _mm_movelh_ps( step01, step23 ), length );
+
+	posX = Select( moving, _mm_add_ps( posX, _mm_mul_ps( dirX, step ) ), posX );
+	posY = Select( moving, _mm_add_ps( posY, _mm_mul_ps( dirY, step ) ), posY );
+	posZ = Select( moving, _mm_add_ps( posZ, _mm_mul_ps( dirZ, step ) ), posZ );
+	StoreVector3x4( &m_pos[first], posX, posY, posZ );
+
+	__m128 renderX, renderY, renderZ;
+	LoadVector3x4( &m_renderPos[first], renderX, renderY, renderZ );
+	StoreVector3x4( &m_renderPos[first], Select( moving, posX, renderX ), Select( moving, posY, renderY ), Select( moving, posZ, renderZ ) );
+}
+
+#endif
+
+/*---------------------------------------------------------------------------*
+  Name:         BeginStep
+
+  Description:  Body::BeginStep for all bodies.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void BodyStore::BeginStep( void )
+{
+	for( unsigned int i=0; i<m_end; ++i )
+	{
+		m_prevPos[i] = m_pos[i];
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Interpolate
+
+  Description:  Body::Interpolate for all bodies.
+
+  Arguments:    alpha : the fraction of a step since the last simulation step
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void BodyStore::Interpolate( float alpha )
+{
+	for( unsigned int i=0; i<m_end; ++i )
+	{
+		m_renderPos[i] = m_prevPos[i] + ( m_pos[i] - m_prevPos[i] ) * alpha;
+	}
+}
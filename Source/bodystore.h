@@ -0,0 +1,107 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+#include "vector.h"
+#include <vector>
+
+class GameObject;
+
+
+#define BODY_STORE_NO_INDEX (0xFFFFFFFF)	//Store index of a body that keeps its own fields
+#define BODY_STORE_ARRIVAL_DISTANCE (0.01f)	//Movement target reached
+
+//SSE2 batch integration, 4 bodies at a time (the scalar loop is the fallback)
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#define BODY_STORE_SIMD
+#define BODY_STORE_SIMD_WIDTH (4)
+#endif
+
+typedef std::vector<GameObject*> BodyOwnerList;
+
+
+//Optional component store that keeps the fields of all bodies in contiguous
+//arrays (one array per field), so per frame work on them is a linear sweep
+//instead of a walk through every game object. The arrays never move, so
+//references to the fields of a body stay valid. Bodies created once the store
+//is full keep their own fields and are handled per object as before.
+class BodyStore : public Singleton <BodyStore>
+{
+public:
+
+	BodyStore( unsigned int capacity );
+	~BodyStore( void );
+
+	unsigned int Allocate( GameObject & owner );	//BODY_STORE_NO_INDEX if full
+	void Release( unsigned int index );
+
+	inline unsigned int GetCapacity( void )			{ return( m_capacity ); }
+	inline unsigned int GetNumBodies( void )		{ return( m_numBodies ); }
+	inline unsigned int GetEnd( void )				{ return( m_end ); }				//One past the highest index in use
+
+	//The fields of a body
+	inline Vector3 & GetPos( unsigned int index )			{ return( m_pos[index] ); }
+	inline Vector3 & GetPrevPos( unsigned int index )		{ return( m_prevPos[index] ); }
+	inline Vector3 & GetRenderPos( unsigned int index )		{ return( m_renderPos[index] ); }
+	inline Vector3 & GetDir( unsigned int index )			{ return( m_dir[index] ); }
+	inline float & GetSpeed( unsigned int index )			{ return( m_speed[index] ); }
+	inline float & GetRadius( unsigned int index )			{ return( m_radius[index] ); }
+
+	//Movement (only bodies with a movement component are integrated)
+	inline Vector3 & GetTarget( unsigned int index )		{ return( m_target[index] ); }
+	inline void SetMovable( unsigned int index, bool movable )	{ m_movable[index] = movable; }
+	inline void SetSpeedScale( unsigned int index, float scale )	{ m_speedScale[index] = scale; }
+
+	//Movement goals. The arrival at a goal is reported once (the body then holds
+	//at its target until a new goal is set). A body can follow another stored
+	//body, whose position becomes its target at the start of every sweep.
+	inline bool IsArrivalPending( unsigned int index )		{ return( m_arrivalPending[index] ); }
+	inline void SetArrivalPending( unsigned int index, bool pending )	{ m_arrivalPending[index] = pending; }
+	void SetFollow( unsigned int index, unsigned int followIndex, objectID followID );
+	void ClearFollow( unsigned int index );
+	inline bool IsFollowing( unsigned int index )			{ return( m_followIndex[index] != BODY_STORE_NO_INDEX ); }
+	inline objectID GetFollowID( unsigned int index )		{ return( IsFollowing( index ) ? m_followID[index] : 0 ); }
+
+	void Integrate( double dTimeDelta, BodyOwnerList & arrived );
+	void BeginStep( void );
+	void Interpolate( float alpha );
+
+private:
+
+	unsigned int m_capacity;
+	unsigned int m_numBodies;
+	unsigned int m_end;
+	std::vector<unsigned int> m_free;	//Released indices below m_end
+
+	GameObject ** m_owner;				//0 for unused indices
+	Vector3 * m_pos;
+	Vector3 * m_prevPos;
+	Vector3 * m_renderPos;
+	Vector3 * m_dir;
+	float * m_speed;
+	float * m_radius;
+
+	Vector3 * m_target;
+	float * m_speedScale;				//Animation speed of the movement (from the last animate)
+	bool * m_movable;
+	bool * m_arrivalPending;			//The arrival at the current goal hasn't been reported yet
+	unsigned int * m_followIndex;		//Store index of the followed body (BODY_STORE_NO_INDEX if none)
+	objectID * m_followID;				//ID of the followed body (the index may be reused once it's released)
+	std::vector<unsigned int> m_followers;	//Indices of the bodies that follow another
+
+	void UpdateFollowTargets( void );
+	void IntegrateOne( unsigned int index, double dTimeDelta, BodyOwnerList & arrived );
+#ifdef BODY_STORE_SIMD
+	void IntegrateBatch( unsigned int first, double dTimeDelta, BodyOwnerList & arrived );
+#endif
+
+};
@@ -11,29 +11,72 @@
 #include "DXUT.h"
 #include "database.h"
 #include "gameobject.h"
+#include "movement.h"
 #include "statemch.h"
+#include "jobsystem.h"
+#include "telemetry.h"
+#include "spatialgrid.h"
+#include "snapshot.h"
+#include "msgrecorder.h"
+#include "shard.h"
+#include "memtrack.h"
+#include <algorithm>
+#ifndef STATE_MACHINE_HEADLESS
+#include "animationlod.h"
+#include "footstepvoices.h"
+#endif
 
 
 Database::Database( void )
-: m_nextFreeID( SYSTEM_OBJECT_ID + 1 )
+: m_updateFrame( 0 ),
+  m_slotStride( 1 ),
+  m_slotOffset( 0 ),
+  m_parallelUpdate( false ),
+  m_parallelGrainSize( 16 ),
+  m_updatingInParallel( false ),
+  m_parallelUpdateFrame( 0 ),
+  m_sortInterval( 0 )
 {
+	InitializeCriticalSection( &m_pendingDeletionLock );
 
+	//Slots for INVALID_OBJECT_ID and SYSTEM_OBJECT_ID are never handed out
+	dbSlot slot;
+	slot.m_object = 0;
+	slot.m_generation = 0;
+	slot.m_denseIndex = 0;
+	slot.m_reserved = true;
+	slot.m_nameHandle = INVALID_NAME_HANDLE;
+	m_slots.push_back( slot );
+	m_slots.push_back( slot );
 }
 
 Database::~Database( void )
 {
-	dbContainer::iterator i = m_database.begin();
-	while( i != m_database.end() )
+	for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); ++i )
 	{	//Destroy object
 		delete( *i );
-		i = m_database.erase( i );
 	}
+	m_database.clear();
+
+	for( dbNameContainer::iterator i = m_names.begin(); i != m_names.end(); ++i )
+	{
+		delete[] i->m_name;
+	}
+
+	DeleteCriticalSection( &m_pendingDeletionLock );
 }
 
 /*---------------------------------------------------------------------------*
   Name:         Update
 
-  Description:  Calls the update function for all objects within the database.
+  Description:  Calls the update function for all objects within the database
+                that are update active. Objects without anything to do in
+				EVENT_Update are not visited at all.
+				Also starts a MemoryTracker frame and holds a hot path scope
+				while updating. Both are process-wide: with several worlds,
+				each world's Update rolls the per-frame counters, so the last
+				frame counts cover only the world updated last, and the hot
+				path count covers the allocations of all of them.
 
   Arguments:    None.
 
@@ -41,44 +84,309 @@ Database::~Database( void )
  *---------------------------------------------------------------------------*/
 void Database::Update( void )
 {
-	for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); ++i )
+	MemoryTracker::BeginFrame();
+	MemoryHotPathScope hotPath;
+
+	m_updateFrame++;
+	if( m_sortInterval > 0 && m_updateFrame % m_sortInterval == 0 ) {
+		SortUpdateOrder();
+	}
+	m_queryCache.Invalidate();
+
+	bool recorder = MsgRecorder::DoesSingletonExist();
+	if( recorder ) {
+		g_msgrecorder.BeginUpdate();
+	}
+
+	bool sharded = Shard::DoesSingletonExist();
+	if( sharded )
+	{	//Objects and messages from the other processes
+		g_shard.Receive();
+	}
+
+	//Every object and the delivery see the same tick. It is read once here, since
+	//g_frame is a thread local lookup (see singleton.h), and handed down.
+	const FrameContext & frame = g_frame;
 	{
-		(*i)->Update();
+		TelemetryScope telemetry( TELEMETRY_OBJECT_UPDATE );
+		if( m_parallelUpdate && JobSystem::DoesSingletonExist() && g_jobsystem.GetNumWorkers() > 1 )
+		{
+			UpdateObjectsInParallel( frame );
+		}
+		else
+		{	//Search for the next index each time since objects may join or leave
+			//the update set (or be stored) while updating
+			unsigned int next = 0;
+			dbUpdateSet::iterator i;
+			while( ( i = m_updateSet.lower_bound( next ) ) != m_updateSet.end() )
+			{
+				next = *i + 1;
+				m_database[*i]->Update( frame );
+			}
+		}
 	}
 
-	g_msgroute.DeliverDelayedMessages();
+	{
+		TelemetryScope telemetry( TELEMETRY_DELIVER_DELAYED_MESSAGES );
+		g_msgroute.DeliverDelayedMessages( frame );
+	}
 
 	//Destroy objects that have requested it
-	dbContainer::iterator i = m_database.begin();
-	while( i != m_database.end() )
+	if( !m_pendingDeletion.empty() ) {
+		TelemetryScope telemetry( TELEMETRY_DELETION_SWEEP );
+		DestroyPendingObjects();
+	}
+
+	if( sharded ) {
+		g_shard.Flush();
+	}
+
+	if( recorder ) {
+		g_msgrecorder.EndUpdate();
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SortUpdateOrder
+
+  Description:  Reorders the objects by the class of the state machine on
+                their first queue, then by its state and substate (see
+				SetUpdateOrderSort). Classes are ranked in the order they
+				are first seen rather than by address, so the order is the
+				same from run to run.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::SortUpdateOrder( void )
+{
+	m_sortKeys.resize( m_database.size() );
+	for( unsigned int i = 0; i < m_database.size(); ++i )
 	{
-		if( (*i)->IsMarkedForDeletion() )
-		{	//Destroy object
-			delete( *i );
-			i = m_database.erase( i );
+		dbSortKey & key = m_sortKeys[i];
+		key.m_class = 0;
+		key.m_state = 0;
+		key.m_substate = 0;
+		key.m_index = i;
+		key.m_object = m_database[i];
+
+		StateMachineManager * mgr = key.m_object->GetStateMachineManager();
+		StateMachine * machine = mgr ? mgr->GetStateMachine( STATE_MACHINE_QUEUE_0 ) : 0;
+		if( machine && machine->GetDefinition() )
+		{
+			dbClassRankContainer::iterator rank = m_classRanks.find( machine->GetDefinition() );
+			if( rank == m_classRanks.end() ) {
+				rank = m_classRanks.insert( std::make_pair( machine->GetDefinition(), (unsigned int)m_classRanks.size() + 1 ) ).first;
+			}
+			key.m_class = rank->second;
+			key.m_state = machine->GetState();
+			key.m_substate = machine->GetSubstate();
 		}
-		else
+	}
+
+	std::sort( m_sortKeys.begin(), m_sortKeys.end(), CompareSortKeys );
+
+	bool moved = false;
+	for( unsigned int i = 0; i < m_sortKeys.size(); ++i )
+	{
+		if( m_sortKeys[i].m_index != i )
 		{
-			++i;
+			moved = true;
+			m_database[i] = m_sortKeys[i].m_object;
+			m_slots[GetSlotIndex( m_database[i]->GetID() )].m_denseIndex = i;
 		}
 	}
+	if( moved ) {
+		RebuildUpdateSet();
+	}
+}
+
+bool Database::CompareSortKeys( const dbSortKey & a, const dbSortKey & b )
+{
+	if( a.m_class != b.m_class ) {
+		return( a.m_class < b.m_class );
+	}
+	if( a.m_state != b.m_state ) {
+		return( a.m_state < b.m_state );
+	}
+	if( a.m_substate != b.m_substate ) {
+		return( a.m_substate < b.m_substate );
+	}
+	return( a.m_index < b.m_index );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         UpdateObjectsInParallel
+
+  Description:  Updates all objects on the job system. MsgRoute buffers the
+                calls made by each object and replays them (in update order)
+				once every object has been updated, so the outcome is the
+				same regardless of the number of threads.
+
+  Arguments:    frame : the current tick
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::UpdateObjectsInParallel( const FrameContext & frame )
+{
+	m_parallelUpdateList.clear();
+	for( dbUpdateSet::iterator i = m_updateSet.begin(); i != m_updateSet.end(); ++i )
+	{
+		m_parallelUpdateList.push_back( m_database[*i] );
+	}
+
+	m_updatingInParallel = true;
+	m_parallelUpdateFrame = &frame;
+	g_msgroute.BeginDeferral();
+
+	g_jobsystem.ParallelFor( (unsigned int)m_parallelUpdateList.size(), m_parallelGrainSize, UpdateObjectJob, this );
+
+	m_updatingInParallel = false;
+	m_parallelUpdateFrame = 0;
+
+	//Objects can only change their own states during the parallel update,
+	//so only the updated objects can have joined or left the update set
+	for( dbContainer::iterator i = m_parallelUpdateList.begin(); i != m_parallelUpdateList.end(); ++i )
+	{
+		UpdateActiveChanged( **i );
+	}
+
+	g_msgroute.EndDeferral();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         UpdateObjectJob
+
+  Description:  Job function that updates a single object.
+
+  Arguments:    index   : the update order of the object
+                worker  : the worker running the job
+				context : the database
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::UpdateObjectJob( unsigned int index, unsigned int worker, void * context )
+{
+	Database * database = (Database*)context;
+	GameObject * object = database->m_parallelUpdateList[index];
+
+	g_msgroute.SetDeferralContext( worker, index, object->GetID() );
+	object->Update( *database->m_parallelUpdateFrame );
 }
 
 void Database::Animate( double dTimeDelta )
 {
+	m_queryCache.Invalidate();	//Everything moves
+	if( BodyStore::DoesSingletonExist() )
+	{	//Movement of the stored bodies in one sweep (the objects then only animate)
+		for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); i++ )
+		{	//This frame's speed scales first, so the sweep moves as the per object path would
+			if( (*i)->HasMovement() && (*i)->GetMovement().IsIntegratedByStore() ) {
+				(*i)->GetMovement().AdvanceSpeedScale( dTimeDelta );
+			}
+		}
+		g_bodystore.Integrate( dTimeDelta, m_arrived );
+		if( SpatialGrid::DoesSingletonExist() ) {
+			g_spatialgrid.Refresh();	//The sweep moved the bodies without SetPos
+		}
+		SendMsgFromSystem( m_arrived, MSG_Arrived );
+	}
+
 	for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); i++ )
 	{
 		(*i)->Animate( dTimeDelta );
 	}
 }
 
+void Database::BeginStep( void )
+{
+	if( BodyStore::DoesSingletonExist() ) {
+		g_bodystore.BeginStep();
+	}
+
+	for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); i++ )
+	{
+		(*i)->BeginStep();
+	}
+}
+
+void Database::Interpolate( float alpha )
+{
+	if( BodyStore::DoesSingletonExist() ) {
+		g_bodystore.Interpolate( alpha );
+	}
+
+	for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); i++ )
+	{
+		(*i)->Interpolate( alpha );
+	}
+}
+
+#ifndef STATE_MACHINE_HEADLESS
+/*---------------------------------------------------------------------------*
+  Name:         AdvanceTimeAndDraw
+
+  Description:  Advances the animations of all objects and computes their
+                bone transforms and skinning palettes, then draws them. The
+				first stage runs on the job system when there are workers,
+				since every object only touches its own animation state; the
+				draw calls (and the footstep sounds) stay on this thread.
+				Characters are skipped or animated at a reduced rate by
+				their distance and visibility (see AnimationLOD).
+
+  Arguments:    pd3dDevice : the device to draw with
+                pViewProj  : the view projection matrix
+				dTimeDelta : the time since the last frame
+				pvEye      : the camera position
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
 void Database::AdvanceTimeAndDraw( IDirect3DDevice9* pd3dDevice, D3DXMATRIX* pViewProj, double dTimeDelta, D3DXVECTOR3 *pvEye )
 {
+	m_advanceTimeDelta = dTimeDelta;
+	m_advanceEye = pvEye;
+
+	if( AnimationLOD::DoesSingletonExist() )
+	{
+		g_animationlod.BeginFrame( pViewProj, pvEye );
+	}
+	bool voices = FootstepVoices::DoesSingletonExist();
+	if( voices ) {
+		g_footstepvoices.BeginFrame( pvEye );
+	}
+
+	if( JobSystem::DoesSingletonExist() && g_jobsystem.GetNumWorkers() > 1 )
+	{
+		g_jobsystem.ParallelFor( (unsigned int)m_database.size(), DATABASE_ANIMATION_GRAIN_SIZE, AdvanceTimeJob, this );
+	}
+	else
+	{
+		for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); i++ )
+		{
+			(*i)->AdvanceTime( dTimeDelta, pvEye );
+			(*i)->UpdateTransforms();
+		}
+	}
+
 	for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); i++ )
 	{
-		(*i)->AdvanceTime( dTimeDelta, pvEye );
 		(*i)->Draw( pd3dDevice, pViewProj );
 	}
+
+	if( voices )
+	{	//The footsteps requested this frame, from the animation jobs or the draw loop
+		g_footstepvoices.EndFrame();
+	}
+}
+
+void Database::AdvanceTimeJob( unsigned int index, unsigned int worker, void * context )
+{
+	Database * database = (Database*)context;
+	GameObject * object = database->m_database[index];
+
+	object->AdvanceTime( database->m_advanceTimeDelta, database->m_advanceEye );
+	object->UpdateTransforms();
 }
 
 void Database::RestoreDeviceObjects( LPDIRECT3DDEVICE9 pd3dDevice )
@@ -96,6 +404,7 @@ void Database::InvalidateDeviceObjects( void )
 		(*i)->InvalidateDeviceObjects();
 	}
 }
+#endif
 
 void Database::Initialize( void )
 {
@@ -121,7 +430,7 @@ void Database::SendMsgFromSystem( objectID id, MSG_Name name, MSG_Data& data )
 {
 	GameObject* object = Find( id );
 
-	if( object )
+	if( object && ( !MsgRecorder::DoesSingletonExist() || g_msgrecorder.AcceptInjection( id, name, data ) ) )
 	{
 		MSG_Object msg( 0.0f, name, SYSTEM_OBJECT_ID, id, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
 		if(object->GetStateMachineManager())
@@ -145,7 +454,7 @@ void Database::SendMsgFromSystem( objectID id, MSG_Name name, MSG_Data& data )
  *---------------------------------------------------------------------------*/
 void Database::SendMsgFromSystem( GameObject* object, MSG_Name name, MSG_Data& data )
 {
-	if( object )
+	if( object && ( !MsgRecorder::DoesSingletonExist() || g_msgrecorder.AcceptInjection( object->GetID(), name, data ) ) )
 	{
 		MSG_Object msg( 0.0f, name, SYSTEM_OBJECT_ID, object->GetID(), SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
 		if(object->GetStateMachineManager())
@@ -160,6 +469,8 @@ void Database::SendMsgFromSystem( GameObject* object, MSG_Name name, MSG_Data& d
 
   Description:  Send a message from the system to all game objects. For example,
                 a keystroke or event can be sent in the form of a message.
+				One message is shared by all receivers (only the receiver
+				is set for each).
 
   Arguments:    name : the name of the message
 				data : data to be delivered with the message
@@ -168,12 +479,48 @@ void Database::SendMsgFromSystem( GameObject* object, MSG_Name name, MSG_Data& d
  *---------------------------------------------------------------------------*/
 void Database::SendMsgFromSystem( MSG_Name name, MSG_Data& data )
 {
-	for( dbContainer::iterator i=m_database.begin(); i!=m_database.end(); ++i )
+	if( MsgRecorder::DoesSingletonExist() && !g_msgrecorder.AcceptInjection( INVALID_OBJECT_ID, name, data ) ) {
+		return;
+	}
+
+	MSG_Object msg( 0.0f, name, SYSTEM_OBJECT_ID, INVALID_OBJECT_ID, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
+
+	//Indexed loop since objects may be stored while handling the message
+	for( unsigned int i=0; i<m_database.size(); ++i )
+	{
+		GameObject * object = m_database[i];
+		if(object->GetStateMachineManager())
+		{
+			msg.SetReceiver( object->GetID() );
+			object->GetStateMachineManager()->SendMsg( msg );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SendMsgFromSystem
+
+  Description:  Send a message from the system to a list of game objects (in
+                list order), for example the results of a batch update.
+				One message is shared by all receivers.
+
+  Arguments:    objects : the game objects
+                name : the name of the message
+				data : data to be delivered with the message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::SendMsgFromSystem( dbCompositionList & objects, MSG_Name name, MSG_Data& data )
+{
+	MSG_Object msg( 0.0f, name, SYSTEM_OBJECT_ID, INVALID_OBJECT_ID, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
+
+	for( dbCompositionList::iterator i = objects.begin(); i != objects.end(); ++i )
 	{
-		MSG_Object msg( 0.0f, name, SYSTEM_OBJECT_ID, (*i)->GetID(), SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
-		if((*i)->GetStateMachineManager())
+		GameObject * object = *i;
+		if(object->GetStateMachineManager() && ( !MsgRecorder::DoesSingletonExist() || g_msgrecorder.AcceptInjection( object->GetID(), name, data ) ) )
 		{
-			(*i)->GetStateMachineManager()->SendMsg( msg );
+			msg.SetReceiver( object->GetID() );
+			object->GetStateMachineManager()->SendMsg( msg );
 		}
 	}
 }
@@ -189,8 +536,23 @@ void Database::SendMsgFromSystem( MSG_Name name, MSG_Data& data )
  *---------------------------------------------------------------------------*/
 void Database::Store( GameObject & object )
 {
-	if( Find( object.GetID() ) == 0 ) {
+	ASSERTMSG( !m_updatingInParallel, "Database::Store - Objects can't be created during a parallel update." );
+
+	dbSlot * slot = FindSlot( object.GetID() );
+
+	if( slot == 0 || object.GetID() <= SYSTEM_OBJECT_ID ) {
+		ASSERTMSG( 0, "Database::Store - Object ID was not created by GetNewObjectID or is stale." );
+	}
+	else if( slot->m_object == 0 ) {
+		slot->m_object = &object;
+		slot->m_denseIndex = (unsigned int)m_database.size();
+		slot->m_nameHandle = GetNameHandle( object.GetName() );
 		m_database.push_back( &object );
+		m_names[slot->m_nameHandle].m_objects.push_back( &object );
+		AddToTypeLists( &object );
+		if( object.IsUpdateActive() ) {
+			m_updateSet.insert( m_updateSet.end(), slot->m_denseIndex );
+		}
 	}
 	else {
 		ASSERTMSG( 0, "Database::Store - Object ID already represented in database." );
@@ -198,102 +560,911 @@ void Database::Store( GameObject & object )
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         Remove
+  Name:         GetNewObjectIDs
 
-  Description:  Removes an object from the database.
+  Description:  Gets a batch of fresh object IDs, growing the slot table
+                once for the whole batch.
 
-  Arguments:    id : the ID of the object
+  Arguments:    count : the number of IDs
+                ids   : the IDs are appended to this list
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void Database::Remove( objectID id )
+void Database::GetNewObjectIDs( unsigned int count, dbObjectIDList & ids )
 {
-	for( dbContainer::iterator i=m_database.begin(); i!=m_database.end(); ++i )
+	if( count > m_freeSlots.size() ) {
+		m_slots.reserve( m_slots.size() + count - m_freeSlots.size() );
+	}
+	ids.reserve( ids.size() + count );
+
+	for( unsigned int i=0; i<count; ++i )
 	{
-		if( (*i)->GetID() == id ) {
-			m_database.erase(i);	
-			return;
-		}
+		ids.push_back( GetNewObjectID() );
 	}
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         Find
+  Name:         ReserveObjects
 
-  Description:  Find an object given its id.
+  Description:  Reserves room for more objects in the dense object list, so
+                storing them doesn't reallocate it along the way.
 
-  Arguments:    id : the ID of the object
+  Arguments:    count : the number of objects about to be stored
 
-  Returns:      An object pointer. If object is not found, returns 0.
+  Returns:      None.
  *---------------------------------------------------------------------------*/
-GameObject* Database::Find( objectID id )
+void Database::ReserveObjects( unsigned int count )
 {
-	for( dbContainer::iterator i=m_database.begin(); i!=m_database.end(); ++i )
+	m_database.reserve( m_database.size() + count );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         StoreBatch
+
+  Description:  Stores a batch of objects (in list order), reserving the 
+                object and type lists once for the whole batch.
+
+  Arguments:    objects : the game objects
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::StoreBatch( dbCompositionList & objects )
+{
+	unsigned int typeCounts[DATABASE_NUM_TYPE_BITS] = { 0 };
+	for( dbCompositionList::iterator i = objects.begin(); i != objects.end(); ++i )
+	{
+		unsigned int type = (*i)->GetType();
+		for( unsigned int bit=0; bit<DATABASE_NUM_TYPE_BITS; bit++ )
+		{
+			if( type & ( 1 << bit ) ) {
+				typeCounts[bit]++;
+			}
+		}
+	}
+	for( unsigned int bit=0; bit<DATABASE_NUM_TYPE_BITS; bit++ )
 	{
-		if( (*i)->GetID() == id ) {
-			return( *i );
+		if( typeCounts[bit] > 0 ) {
+			m_typeLists[bit].reserve( m_typeLists[bit].size() + typeCounts[bit] );
 		}
 	}
+	ReserveObjects( (unsigned int)objects.size() );
 
-	return( 0 );
+	for( dbCompositionList::iterator i = objects.begin(); i != objects.end(); ++i )
+	{
+		Store( **i );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DespawnBatch
+
+  Description:  Marks a batch of objects for deletion. They are destroyed 
+                together at the end of the next update, with one compaction
+				of each list and one purge of their delayed messages.
 
+  Arguments:    objects : the game objects
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::DespawnBatch( dbCompositionList & objects )
+{
+	for( dbCompositionList::iterator i = objects.begin(); i != objects.end(); ++i )
+	{
+		(*i)->MarkForDeletion();
+	}
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         GetIDByName
+  Name:         Remove
 
-  Description:  Get an object's id given its name.
+  Description:  Removes an object from the database (without destroying
+                it). The ID becomes stale and can't be stored again.
 
-  Arguments:    name : the name of the object
+  Arguments:    id : the ID of the object
 
-  Returns:      An ID. If object is not found, returns INVALID_OBJECT_ID.
+  Returns:      None.
  *---------------------------------------------------------------------------*/
-objectID Database::GetIDByName( char* name )
+void Database::Remove( objectID id )
 {
-	for( dbContainer::iterator i=m_database.begin(); i!=m_database.end(); ++i )
+	dbSlot * slot = FindSlot( id );
+
+	if( slot && slot->m_object )
 	{
-		if( strcmp( (*i)->GetName(), name ) == 0 ) {
-			return( (*i)->GetID() );
+		Unlink( slot );
+		FreeSlot( id );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Unlink
+
+  Description:  Takes the object of a slot out of all lists (without
+                destroying it or freeing the slot).
+
+  Arguments:    slot : the slot of a stored object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::Unlink( dbSlot * slot )
+{
+	//Close the gap to keep the update order
+	unsigned int index = slot->m_denseIndex;
+	m_database.erase( m_database.begin() + index );
+	for( ; index < m_database.size(); ++index ) {
+		m_slots[GetSlotIndex( m_database[index]->GetID() )].m_denseIndex = index;
+	}
+	RebuildUpdateSet();
+
+	RemoveFromNameIndex( slot->m_object, slot->m_nameHandle );
+	RemoveFromTypeLists( slot->m_object );
+	for( dbContainer::iterator i=m_pendingDeletion.begin(); i!=m_pendingDeletion.end(); ++i )
+	{	//No longer ours to destroy
+		if( *i == slot->m_object ) {
+			m_pendingDeletion.erase( i );
+			break;
 		}
 	}
+	slot->m_object = 0;
+}
 
-	return( INVALID_OBJECT_ID );
+/*---------------------------------------------------------------------------*
+  Name:         SetSlotPartition
+
+  Description:  Restricts the IDs handed out by this database to its own
+                slots, when the objects are spread over several processes
+				(see Shard). Must be called before any ID is handed out.
+
+  Arguments:    stride : the number of processes
+                offset : the index of this process
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::SetSlotPartition( unsigned int stride, unsigned int offset )
+{
+	ASSERTMSG( stride > 0 && offset < stride, "Database::SetSlotPartition - Invalid partition" );
+	ASSERTMSG( m_slots.size() == 2, "Database::SetSlotPartition - IDs have already been handed out" );
+
+	m_slotStride = stride;
+	m_slotOffset = offset;
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         GetNewObjectID
+  Name:         Detach
 
-  Description:  Get a fresh object ID.
+  Description:  Removes an object that moves to another process. If the
+                slot is one of ours, it stays reserved (the ID lives on
+				elsewhere, and the object may come back). A slot of another
+				process is released without telling that process.
 
-  Arguments:    None.
+  Arguments:    id : the ID of the object
 
-  Returns:      An id.
+  Returns:      The object (now owned by the caller), or 0 if not stored.
  *---------------------------------------------------------------------------*/
-objectID Database::GetNewObjectID( void )
+GameObject* Database::Detach( objectID id )
 {
-	return( m_nextFreeID++ );
+	dbSlot * slot = FindSlot( id );
+	if( slot == 0 || slot->m_object == 0 ) {
+		return( 0 );
+	}
 
+	GameObject * object = slot->m_object;
+	Unlink( slot );
+	if( !IsOwnSlot( GetSlotIndex( id ) ) ) {
+		slot->m_reserved = false;
+	}
+	return( object );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         ComposeList
+  Name:         Adopt
 
-  Description:  Compose a list of objects given certain type.
+  Description:  Stores an object that arrived from another process under
+                the ID it already has. An object coming back finds its slot
+				still reserved; otherwise the slot (of another process) is
+				taken with the generation of the ID.
 
-  Arguments:    list   : the list to fill with the result of the operation
-                type   : the type of object to add to the list (optional)
+  Arguments:    object : the game object
 
-  Returns:      None. (The result is stored in the list argument.)
+  Returns:      Whether the object was stored.
  *---------------------------------------------------------------------------*/
-void Database::ComposeList( dbCompositionList & list, unsigned int type )
+bool Database::Adopt( GameObject & object )
 {
-	//Find all objects of "type"
-	for( dbContainer::iterator i=m_database.begin(); i!=m_database.end(); ++i )
+	objectID id = object.GetID();
+	unsigned int index = GetSlotIndex( id );
+	if( index <= SYSTEM_OBJECT_ID ) {
+		return( false );
+	}
+
+	while( m_slots.size() <= index )
 	{
-		if( type == OBJECT_Ignore_Type || (*i)->GetType() & type )
-		{	//Type matches
-			list.push_back(*i);
+		unsigned int added = AddSlot();
+		if( IsOwnSlot( added ) ) {
+			m_freeSlots.push_back( added );
+		}
+	}
+
+	dbSlot & slot = m_slots[index];
+	if( IsOwnSlot( index ) )
+	{	//Coming back
+		if( !slot.m_reserved || slot.m_object != 0 || slot.m_generation != GetSlotGeneration( id ) ) {
+			return( false );
+		}
+	}
+	else
+	{
+		if( slot.m_reserved ) {
+			return( false );
 		}
+		slot.m_reserved = true;
+		slot.m_generation = GetSlotGeneration( id );
 	}
+
+	Store( object );
+	return( true );
 }
 
+/*---------------------------------------------------------------------------*
+  Name:         ReleaseID
+
+  Description:  Frees one of our slots that was kept reserved while its
+                object was away, once the object has been destroyed in
+				the other process.
+
+  Arguments:    id : the ID of the object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::ReleaseID( objectID id )
+{
+	dbSlot * slot = FindSlot( id );
+	if( slot && slot->m_object == 0 && IsOwnSlot( GetSlotIndex( id ) ) ) {
+		FreeSlot( id );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         QueueForDeletion
+
+  Description:  Adds an object to the batch that is destroyed at the end of
+                the update. Called by GameObject::MarkForDeletion.
+
+  Arguments:    object : the game object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::QueueForDeletion( GameObject & object )
+{
+	EnterCriticalSection( &m_pendingDeletionLock );
+	m_pendingDeletion.push_back( &object );
+	LeaveCriticalSection( &m_pendingDeletionLock );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         UpdateActiveChanged
+
+  Description:  Adds or removes an object from the update set. Called by
+                GameObject::SetUpdateActive. During a parallel update the
+				change is applied once all jobs are done.
+
+  Arguments:    object : the game object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::UpdateActiveChanged( GameObject & object )
+{
+	if( m_updatingInParallel ) {
+		return;
+	}
+
+	dbSlot * slot = FindSlot( object.GetID() );
+	if( slot && slot->m_object == &object )
+	{	//Objects that aren't stored yet join when they are stored
+		if( object.IsUpdateActive() ) {
+			m_updateSet.insert( slot->m_denseIndex );
+		}
+		else {
+			m_updateSet.erase( slot->m_denseIndex );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RebuildUpdateSet
+
+  Description:  Rebuilds the update set after the dense indices have moved.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::RebuildUpdateSet( void )
+{
+	m_updateSet.clear();
+	for( unsigned int i = 0; i < m_database.size(); ++i )
+	{
+		if( m_database[i]->IsUpdateActive() ) {
+			m_updateSet.insert( m_updateSet.end(), i );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DestroyPendingObjects
+
+  Description:  Destroys every object marked for deletion this frame as one
+                batch: a single compaction pass over each affected list, a 
+				single purge of their delayed messages, then the deletes.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::DestroyPendingObjects( void )
+{
+	//The pending list only tells us there is work - the batch is collected from
+	//the compaction pass, so it only holds stored objects and is in update order
+	//(objects may have been marked from several threads in any order)
+	m_pendingDeletion.clear();
+
+	//Remove all of them from the lists in one pass each (keeps the update order)
+	dbContainer batch;
+	CompactMarkedObjects( m_database, &batch );
+	RebuildUpdateSet();
+	m_queryCache.Invalidate();
+
+	ObjectIDList ids;
+	unsigned int typeMask = 0;
+	for( dbContainer::iterator i=batch.begin(); i!=batch.end(); ++i )
+	{
+		ids.push_back( (*i)->GetID() );
+		typeMask |= (*i)->GetType();
+		RemoveFromNameIndex( *i, m_slots[GetSlotIndex( (*i)->GetID() )].m_nameHandle );
+	}
+
+	for( unsigned int bit=0; bit<DATABASE_NUM_TYPE_BITS; bit++ )
+	{
+		if( typeMask & ( 1 << bit ) ) {
+			CompactMarkedObjects( m_typeLists[bit], 0 );
+		}
+	}
+
+	//Nobody can receive their delayed messages anymore
+	g_msgroute.PurgeMsgsForReceivers( ids );
+
+	for( dbContainer::iterator i=batch.begin(); i!=batch.end(); ++i )
+	{	//Destroy object
+		objectID id = (*i)->GetID();
+		m_slots[GetSlotIndex( id )].m_object = 0;
+		FreeSlot( id );
+		delete( *i );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CompactMarkedObjects
+
+  Description:  Removes all objects marked for deletion from a list, keeping
+                the order of the remaining objects.
+
+  Arguments:    objects : the list to compact
+                removed : if given, the list is the dense object list - the
+				          slots' dense indices are updated and the removed 
+						  objects are added to this list
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::CompactMarkedObjects( dbContainer & objects, dbContainer * removed )
+{
+	unsigned int count = 0;
+	for( unsigned int i = 0; i < objects.size(); ++i )
+	{
+		GameObject * object = objects[i];
+		if( object->IsMarkedForDeletion() )
+		{
+			if( removed ) {
+				removed->push_back( object );
+			}
+		}
+		else
+		{
+			if( removed ) {
+				m_slots[GetSlotIndex( object->GetID() )].m_denseIndex = count;
+			}
+			objects[count++] = object;
+		}
+	}
+	objects.resize( count );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Find
+
+  Description:  Find an object given its id. Time complexity O(1).
+
+  Arguments:    id : the ID of the object
+
+  Returns:      An object pointer. If object is not found (or the ID is
+                stale), returns 0.
+ *---------------------------------------------------------------------------*/
+GameObject* Database::Find( objectID id )
+{
+	dbSlot * slot = FindSlot( id );
+
+	return( slot ? slot->m_object : 0 );
+
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetIDByName
+
+  Description:  Get an object's id given its name. If several objects share
+                the name, the one stored first is returned.
+
+  Arguments:    name : the name of the object
+
+  Returns:      An ID. If object is not found, returns INVALID_OBJECT_ID.
+ *---------------------------------------------------------------------------*/
+objectID Database::GetIDByName( char* name )
+{
+	return( GetIDByName( FindNameHandle( name ) ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetIDByName
+
+  Description:  Get an object's id given its interned name. Time complexity
+                O(1).
+
+  Arguments:    handle : the name handle (from GetNameHandle)
+
+  Returns:      An ID. If object is not found, returns INVALID_OBJECT_ID.
+ *---------------------------------------------------------------------------*/
+objectID Database::GetIDByName( dbNameHandle handle )
+{
+	if( handle < m_names.size() && !m_names[handle].m_objects.empty() ) {
+		return( m_names[handle].m_objects.front()->GetID() );
+	}
+
+	return( INVALID_OBJECT_ID );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetNameHandle
+
+  Description:  Interns a name and returns its handle. The name doesn't
+                need to belong to an object yet, so handles can be cached
+                before the object is created.
+
+  Arguments:    name : the name of the object
+
+  Returns:      The name handle.
+ *---------------------------------------------------------------------------*/
+dbNameHandle Database::GetNameHandle( char* name )
+{
+	dbNameHandle handle = FindNameHandle( name );
+
+	if( handle == INVALID_NAME_HANDLE )
+	{	//First time this name is seen
+		dbName entry;
+		entry.m_name = new char[strlen( name ) + 1];
+		strcpy( entry.m_name, name );
+		entry.m_hash = HashName( name );
+
+		handle = (dbNameHandle)m_names.size();
+		m_names.push_back( entry );
+		m_nameIndex.insert( dbNameIndex::value_type( entry.m_hash, handle ) );
+	}
+
+	return( handle );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindNameHandle
+
+  Description:  Looks up an interned name without interning it.
+
+  Arguments:    name : the name of the object
+
+  Returns:      The name handle or INVALID_NAME_HANDLE.
+ *---------------------------------------------------------------------------*/
+dbNameHandle Database::FindNameHandle( char* name )
+{
+	std::pair<dbNameIndex::iterator, dbNameIndex::iterator> range = m_nameIndex.equal_range( HashName( name ) );
+
+	for( dbNameIndex::iterator i=range.first; i!=range.second; ++i )
+	{	//Only names with the same hash are compared
+		if( strcmp( m_names[i->second].m_name, name ) == 0 ) {
+			return( i->second );
+		}
+	}
+
+	return( INVALID_NAME_HANDLE );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         HashName
+
+  Description:  FNV-1a hash of a name.
+
+  Arguments:    name : the name of the object
+
+  Returns:      The hash value.
+ *---------------------------------------------------------------------------*/
+unsigned int Database::HashName( char* name )
+{
+	unsigned int hash = 2166136261u;
+
+	for( ; *name; ++name ) {
+		hash = ( hash ^ (unsigned char)*name ) * 16777619u;
+	}
+
+	return( hash );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RemoveFromNameIndex
+
+  Description:  Removes a stored object from the list of objects with its
+                name.
+
+  Arguments:    object : the game object
+                handle : the interned name of the object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::RemoveFromNameIndex( GameObject * object, dbNameHandle handle )
+{
+	if( handle < m_names.size() )
+	{
+		dbContainer & objects = m_names[handle].m_objects;
+		for( dbContainer::iterator i=objects.begin(); i!=objects.end(); ++i )
+		{
+			if( *i == object ) {
+				objects.erase( i );
+				return;
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetNewObjectID
+
+  Description:  Get a fresh object ID. This reserves a slot, reusing freed
+                slots first (with a new generation).
+
+  Arguments:    None.
+
+  Returns:      An id.
+ *---------------------------------------------------------------------------*/
+objectID Database::GetNewObjectID( void )
+{
+	unsigned int index;
+
+	if( !m_freeSlots.empty() )
+	{
+		index = m_freeSlots.back();
+		m_freeSlots.pop_back();
+	}
+	else
+	{	//Slots of other processes are skipped (only Adopt fills them)
+		do {
+			index = AddSlot();
+		} while( !IsOwnSlot( index ) );
+	}
+
+	m_slots[index].m_reserved = true;
+	return( MakeObjectID( index, m_slots[index].m_generation ) );
+
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AddSlot
+
+  Description:  Appends a free slot to the slot table (not to the free list).
+
+  Arguments:    None.
+
+  Returns:      The index of the slot.
+ *---------------------------------------------------------------------------*/
+unsigned int Database::AddSlot( void )
+{
+	ASSERTMSG( m_slots.size() <= OBJECT_ID_INDEX_MASK, "Database::AddSlot - Out of object slots. Increase OBJECT_ID_INDEX_BITS." );
+	dbSlot slot;
+	slot.m_object = 0;
+	slot.m_generation = 0;
+	slot.m_denseIndex = 0;
+	slot.m_reserved = false;
+	slot.m_nameHandle = INVALID_NAME_HANDLE;
+	m_slots.push_back( slot );
+	return( (unsigned int)m_slots.size() - 1 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindSlot
+
+  Description:  Find the slot that an ID refers to. 
+
+  Arguments:    id : the ID of the object
+
+  Returns:      The slot, or 0 if the ID is out of range or stale.
+ *---------------------------------------------------------------------------*/
+Database::dbSlot * Database::FindSlot( objectID id )
+{
+	unsigned int index = GetSlotIndex( id );
+
+	if( index < m_slots.size() && 
+		m_slots[index].m_reserved && 
+		m_slots[index].m_generation == GetSlotGeneration( id ) )
+	{
+		return( &m_slots[index] );
+	}
+
+	return( 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FreeSlot
+
+  Description:  Releases the slot of an ID so it can be reused. The 
+                generation is bumped so the old ID becomes stale. The slot
+				of another process (an adopted object) isn't reused here;
+				that process is told, so it can reuse it.
+
+  Arguments:    id : the ID of the object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::FreeSlot( objectID id )
+{
+	unsigned int index = GetSlotIndex( id );
+	dbSlot & slot = m_slots[index];
+
+	slot.m_reserved = false;
+	slot.m_generation = ( slot.m_generation + 1 ) & OBJECT_ID_GENERATION_MASK;
+	if( IsOwnSlot( index ) ) {
+		m_freeSlots.push_back( index );
+	}
+	else if( Shard::DoesSingletonExist() ) {
+		g_shard.Released( id );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ComposeList
+
+  Description:  Compose a list of objects given certain type.
+
+  Arguments:    list   : the list to fill with the result of the operation
+                type   : the type of object to add to the list (optional)
+
+  Returns:      None. (The result is stored in the list argument.)
+ *---------------------------------------------------------------------------*/
+void Database::ComposeList( dbCompositionList & list, unsigned int type )
+{
+	if( IsSingleType( type ) )
+	{	//Copy the membership list directly
+		dbCompositionList & objects = GetObjectsOfType( type );
+		list.insert( list.end(), objects.begin(), objects.end() );
+		return;
+	}
+
+	//Find all objects of "type"
+	for( dbContainer::iterator i=m_database.begin(); i!=m_database.end(); ++i )
+	{
+		if( type == OBJECT_Ignore_Type || (*i)->GetType() & type )
+		{	//Type matches
+			list.push_back(*i);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetObjectsOfType
+
+  Description:  Get the objects of a single type without copying them.
+
+  Arguments:    type : a single OBJECT_* type bit, or OBJECT_Ignore_Type for
+                       all objects
+
+  Returns:      The list of objects (owned by the database).
+ *---------------------------------------------------------------------------*/
+dbCompositionList & Database::GetObjectsOfType( unsigned int type )
+{
+	ASSERTMSG( IsSingleType( type ), "Database::GetObjectsOfType - Only one type bit can be requested. Use ComposeList for combinations." );
+
+	if( type == OBJECT_Ignore_Type ) {
+		return( m_database );
+	}
+
+	return( m_typeLists[GetTypeBit( type )] );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetTypeBit
+
+  Description:  Converts a single type bit into its bit position.
+
+  Arguments:    type : a single OBJECT_* type bit
+
+  Returns:      The bit position.
+ *---------------------------------------------------------------------------*/
+unsigned int Database::GetTypeBit( unsigned int type )
+{
+	unsigned int bit = 0;
+	while( ( type & 1 ) == 0 && bit < DATABASE_NUM_TYPE_BITS - 1 )
+	{
+		type >>= 1;
+		bit++;
+	}
+
+	return( bit );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AddToTypeLists
+
+  Description:  Adds an object to the membership list of each of its type bits.
+
+  Arguments:    object : the game object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::AddToTypeLists( GameObject * object )
+{
+	unsigned int type = object->GetType();
+	m_queryCache.Invalidate();
+
+	for( unsigned int bit=0; bit<DATABASE_NUM_TYPE_BITS; bit++ )
+	{
+		if( type & ( 1 << bit ) ) {
+			m_typeLists[bit].push_back( object );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RemoveFromTypeLists
+
+  Description:  Removes an object from the membership list of each of its
+                type bits.
+
+  Arguments:    object : the game object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::RemoveFromTypeLists( GameObject * object )
+{
+	unsigned int type = object->GetType();
+	m_queryCache.Invalidate();
+
+	for( unsigned int bit=0; bit<DATABASE_NUM_TYPE_BITS; bit++ )
+	{
+		if( type & ( 1 << bit ) )
+		{
+			dbContainer & objects = m_typeLists[bit];
+			for( dbContainer::iterator i=objects.begin(); i!=objects.end(); ++i )
+			{
+				if( *i == object ) {
+					objects.erase( i );
+					break;
+				}
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Save
+
+  Description:  Saves the slot table and every stored object (in insertion
+                order, which is also the update order).
+
+  Arguments:    writer : the snapshot being written
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Database::Save( SnapshotWriter & writer )
+{
+	ASSERTMSG( !m_updatingInParallel, "Database::Save - Can't save during a parallel update." );
+
+	writer.Write( (unsigned int)m_slots.size() );
+	for( dbSlotContainer::iterator i = m_slots.begin(); i != m_slots.end(); ++i )
+	{
+		writer.Write( i->m_generation );
+		writer.Write( i->m_reserved );
+	}
+
+	writer.Write( (unsigned int)m_freeSlots.size() );
+	for( dbFreeSlotContainer::iterator i = m_freeSlots.begin(); i != m_freeSlots.end(); ++i )
+	{
+		writer.Write( *i );
+	}
+
+	writer.Write( (unsigned int)m_database.size() );
+	for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); ++i )
+	{
+		writer.Write( (*i)->GetID() );
+		writer.Write( (*i)->GetType() );
+		writer.WriteString( (*i)->GetName() );
+		(*i)->Save( writer );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Restore
+
+  Description:  Restores the slot table and the objects saved by Save. The
+                database must be empty. The objects keep their saved update
+				order; the class ranks of the update order sort are cleared
+				(see SetUpdateOrderSort).
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      Whether the objects were restored.
+ *---------------------------------------------------------------------------*/
+bool Database::Restore( SnapshotReader & reader )
+{
+	ASSERTMSG( m_database.empty() && m_freeSlots.empty(), "Database::Restore - Can only restore into an empty database." );
+	if( !m_database.empty() || !m_freeSlots.empty() ) {
+		return( false );
+	}
+	m_classRanks.clear();		//Their classes may not exist in the restored world
+
+	//The saved table starts with the slots of INVALID_OBJECT_ID and SYSTEM_OBJECT_ID too
+	unsigned int numSlots = reader.Read<unsigned int>();
+	if( numSlots < 2 || numSlots > OBJECT_ID_INDEX_MASK + 1 ) {
+		reader.Fail();
+	}
+	m_slots.clear();
+	for( unsigned int i = 0; i < numSlots && reader.IsValid(); ++i )
+	{
+		dbSlot slot;
+		slot.m_object = 0;
+		slot.m_generation = reader.Read<unsigned int>();
+		slot.m_denseIndex = 0;
+		slot.m_reserved = reader.Read<bool>();
+		slot.m_nameHandle = INVALID_NAME_HANDLE;
+		m_slots.push_back( slot );
+	}
+
+	unsigned int numFreeSlots = reader.Read<unsigned int>();
+	for( unsigned int i = 0; i < numFreeSlots && reader.IsValid(); ++i )
+	{
+		unsigned int index = reader.Read<unsigned int>();
+		if( index >= numSlots ) {
+			reader.Fail();
+		}
+		m_freeSlots.push_back( index );
+	}
+
+	unsigned int numObjects = reader.Read<unsigned int>();
+	for( unsigned int i = 0; i < numObjects && reader.IsValid(); ++i )
+	{
+		objectID id = reader.Read<objectID>();
+		unsigned int type = reader.Read<unsigned int>();
+		const char * name = reader.ReadString();
+
+		dbSlot * slot = FindSlot( id );
+		if( !reader.IsValid() || slot == 0 || slot->m_object != 0 || strlen( name ) >= GAME_OBJECT_MAX_NAME_SIZE ) {
+			reader.Fail();
+			break;
+		}
+
+		GameObject * object = new GameObject( id, type, const_cast<char*>( name ) );
+		if( !object->Restore( reader ) ) {
+			delete( object );
+			break;
+		}
+		Store( *object );
+	}
+
+	for( dbContainer::iterator i = m_database.begin(); i != m_database.end(); ++i )
+	{	//The followed objects exist now
+		if( (*i)->HasMovement() ) {
+			(*i)->GetMovement().ResumeFollowing();
+		}
+	}
+
+	return( reader.IsValid() );
+}
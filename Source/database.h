@@ -13,15 +13,39 @@
 #include "global.h"
 #include "msg.h"
 #include "singleton.h"
-#include <list>
+#include "bodystore.h"
+#include "dbquerycache.h"
 #include <vector>
+#include <map>
+#include <set>
 
 class GameObject;
+class SnapshotWriter;
+class SnapshotReader;
+struct StateMachineDefinition;
+struct FrameContext;
 
 
 #define INVALID_OBJECT_ID 0
 
+//An objectID is a handle into the database slot table:
+//the low bits are the slot index and the high bits are the slot generation.
+//The generation is bumped every time a slot is freed, so a stale ID held
+//after the object was destroyed will never find the slot's next occupant.
+#define OBJECT_ID_INDEX_BITS 20
+#define OBJECT_ID_INDEX_MASK ((1 << OBJECT_ID_INDEX_BITS) - 1)
+#define OBJECT_ID_GENERATION_MASK ((1 << (32 - OBJECT_ID_INDEX_BITS)) - 1)
+
 typedef std::vector<GameObject*> dbCompositionList;
+typedef std::vector<objectID> dbObjectIDList;
+
+#define DATABASE_NUM_TYPE_BITS 32		//One membership list per bit of the OBJECT_* type mask
+#define DATABASE_ANIMATION_GRAIN_SIZE 4	//Objects per job chunk when advancing the animations
+
+//Interned object name - resolve a name once with GetNameHandle and
+//reuse the handle for repeated lookups (no string compares)
+typedef unsigned int dbNameHandle;
+#define INVALID_NAME_HANDLE 0xFFFFFFFF
 
 class Database : public Singleton <Database>
 {
@@ -31,34 +55,197 @@ public:
 	~Database( void );
 
 	void Update( void );
+
+	//Opt-in parallel update: objects are updated on the job system, and the
+	//MsgRoute calls they make are buffered and replayed in update order afterwards.
+	//Only safe for objects that touch nothing but their own state in EVENT_Update.
+	inline void SetParallelUpdate( bool enable, unsigned int grainSize = 16 )	{ m_parallelUpdate = enable; m_parallelGrainSize = grainSize; }
+	inline bool IsParallelUpdate( void )										{ return( m_parallelUpdate ); }
+
+	//Opt-in update order sort: every interval updates (0 = never) the objects are
+	//reordered by the class of their active state machine, then by its state and
+	//substate, so consecutive updates run the same States() code on similar data.
+	//Objects with equal keys keep their relative order, so the order stays
+	//deterministic, but it is no longer the insertion order.
+	//Neither the interval, the class ranks nor the phase of the sort (the update
+	//frame) is saved in snapshots or recordings. Restore keeps the saved object
+	//order and clears the ranks, so the classes are ranked again by the first sort
+	//after it. Set the interval again after restoring, and set it the same way
+	//before replaying a recording, or the update order may differ from the run.
+	inline void SetUpdateOrderSort( unsigned int interval )						{ m_sortInterval = interval; }
+	inline unsigned int GetUpdateOrderSort( void )								{ return( m_sortInterval ); }
+
+	//Number of the current update (used to stagger state machines that update every Nth frame)
+	inline unsigned int GetUpdateFrame( void )									{ return( m_updateFrame ); }
 	void Animate( double dTimeDelta );
+	void BeginStep( void );					//Fixed timestep: remember positions before a simulation step
+	void Interpolate( float alpha );		//Fixed timestep: place objects for rendering between the last two steps
+#ifndef STATE_MACHINE_HEADLESS
 	void AdvanceTimeAndDraw( IDirect3DDevice9* pd3dDevice, D3DXMATRIX* pViewProj, double dTimeDelta, D3DXVECTOR3 *pvEye );
-	void Initialize( void );
 	void RestoreDeviceObjects( LPDIRECT3DDEVICE9 pd3dDevice );
 	void InvalidateDeviceObjects( void );
+#endif
+	void Initialize( void );
 	void SendMsgFromSystem( objectID id, MSG_Name name, MSG_Data& data = MSG_Data() );
 	void SendMsgFromSystem( GameObject* object, MSG_Name name, MSG_Data& data = MSG_Data() );
 	void SendMsgFromSystem( MSG_Name name, MSG_Data& data = MSG_Data() );
+	void SendMsgFromSystem( dbCompositionList & objects, MSG_Name name, MSG_Data& data = MSG_Data() );
 
 
 	void Store( GameObject & object );
 	void Remove( objectID id );
+
+	//Batched spawning and despawning, for streaming many objects in and out. Reserve 
+	//the IDs and storage up front, build the objects (pushing their state machines 
+	//with PushStateMachineLazy, so they initialize on their first update), then store
+	//them together. Despawned objects are destroyed in one sweep at the end of the update.
+	void GetNewObjectIDs( unsigned int count, dbObjectIDList & ids );
+	void ReserveObjects( unsigned int count );
+	void StoreBatch( dbCompositionList & objects );
+	void DespawnBatch( dbCompositionList & objects );
+
+	void QueueForDeletion( GameObject & object );
+	void UpdateActiveChanged( GameObject & object );
 	GameObject* Find( objectID id );
 	objectID GetIDByName( char* name );
+	objectID GetIDByName( dbNameHandle handle );
+	dbNameHandle GetNameHandle( char* name );
 
 	objectID GetNewObjectID( void );
 	
 	void ComposeList( dbCompositionList & list, unsigned int type = 0 );
 
+	//Non-allocating access to the objects of a single type bit (or all objects
+	//for OBJECT_Ignore_Type). The list is owned by the database and is only 
+	//valid until objects are stored or removed.
+	dbCompositionList & GetObjectsOfType( unsigned int type );
+	inline bool IsSingleType( unsigned int type )					{ return( ( type & ( type - 1 ) ) == 0 ); }
+
+	//Queries shared by every state machine within an update (see dbquerycache.h).
+	//Results reflect the objects as of the start of the update (or the last store
+	//or removal), so an object moved earlier in the same update isn't seen moving.
+	inline dbCompositionList & GetObjectsOfTypes( unsigned int type )							{ return( m_queryCache.GetObjectsOfTypes( type ) ); }
+	inline GameObject * FindFarthest( const Vector3 & center, unsigned int type, GameObject * exclude = 0 )	{ return( m_queryCache.FindFarthest( center, type, exclude ) ); }
+	inline DatabaseQueryCache & GetQueryCache( void )											{ return( m_queryCache ); }
+
+	//Snapshots (see snapshot.h) - the objects keep their IDs, and the slot table is
+	//restored too, so the IDs handed out afterwards are the same as in the original
+	void Save( SnapshotWriter & writer );
+	bool Restore( SnapshotReader & reader );
+
+	//Sharding (see shard.h) - each process only hands out the IDs of its own slots
+	//(every strideth slot, starting at offset), so IDs are unique across processes.
+	//Objects that move between processes keep their IDs; the process that owns the
+	//slot keeps it reserved while the object is away.
+	void SetSlotPartition( unsigned int stride, unsigned int offset );	//Before any ID is handed out
+	inline bool IsOwnID( objectID id )								{ return( IsOwnSlot( GetSlotIndex( id ) ) ); }
+	GameObject* Detach( objectID id );			//Removes an object that moves to another process (0 if not stored)
+	bool Adopt( GameObject & object );			//Stores an object that arrived from another process, under its ID
+	void ReleaseID( objectID id );				//The object with an ID of ours was destroyed in another process
 
-private:
 
-	typedef std::list<GameObject*> dbContainer;
+private:
 
-	//Make this a more efficient data structure (like a hash table)
+	typedef std::vector<GameObject*> dbContainer;
+
+	struct dbSlot
+	{
+		GameObject * m_object;			//0 if the ID has been handed out but not stored yet
+		unsigned int m_generation;
+		unsigned int m_denseIndex;		//Position in m_database
+		bool m_reserved;				//ID handed out by GetNewObjectID and not yet freed
+		dbNameHandle m_nameHandle;		//Interned name of the stored object
+	};
+
+	struct dbName
+	{
+		char * m_name;
+		unsigned int m_hash;
+		dbContainer m_objects;			//Stored objects with this name (in insertion order)
+	};
+
+	typedef std::vector<dbName> dbNameContainer;
+	typedef std::multimap<unsigned int, dbNameHandle> dbNameIndex;
+
+	typedef std::vector<dbSlot> dbSlotContainer;
+	typedef std::set<unsigned int> dbUpdateSet;
+	typedef std::vector<unsigned int> dbFreeSlotContainer;
+
+	struct dbSortKey
+	{
+		unsigned int m_class;			//Rank of the state machine class (0 for none)
+		int m_state;
+		int m_substate;
+		unsigned int m_index;			//Position before sorting (keeps the sort stable)
+		GameObject * m_object;
+	};
+
+	typedef std::vector<dbSortKey> dbSortKeyContainer;
+	typedef std::map<const StateMachineDefinition*, unsigned int> dbClassRankContainer;
+
+	//Objects are kept densely packed (in insertion order, unless sorted, see
+	//SetUpdateOrderSort) for iteration, while the slot table maps an objectID
+	//to its object in O(1)
 	dbContainer m_database;
-
-	objectID m_nextFreeID;
+	dbSlotContainer m_slots;
+	dbFreeSlotContainer m_freeSlots;
+	dbContainer m_typeLists[DATABASE_NUM_TYPE_BITS];	//Objects per type bit (in insertion order)
+	dbContainer m_pendingDeletion;						//Objects marked for deletion this frame
+	dbUpdateSet m_updateSet;							//Dense indices of the objects that are update active (in update order)
+	dbContainer m_parallelUpdateList;					//The update active objects of the current parallel update
+	CRITICAL_SECTION m_pendingDeletionLock;				//Objects can be marked from job threads
+	BodyOwnerList m_arrived;							//Objects that reached their movement target this animate
+	DatabaseQueryCache m_queryCache;					//Invalidated whenever the objects may have changed or moved
+
+	unsigned int m_updateFrame;
+	unsigned int m_slotStride;							//Slot partition (see SetSlotPartition)
+	unsigned int m_slotOffset;
+
+	bool m_parallelUpdate;
+	unsigned int m_parallelGrainSize;
+	bool m_updatingInParallel;
+	const FrameContext * m_parallelUpdateFrame;	//The tick of the parallel update, handed to the jobs
+
+	unsigned int m_sortInterval;
+	dbSortKeyContainer m_sortKeys;						//Reused by every sort
+	dbClassRankContainer m_classRanks;					//State machine classes in the order they were first sorted
+#ifndef STATE_MACHINE_HEADLESS
+	double m_advanceTimeDelta;							//Arguments of the AdvanceTimeAndDraw in progress (for the jobs)
+	D3DXVECTOR3 * m_advanceEye;
+#endif
+
+	//Interned names are never released, so handles stay valid for the lifetime of the database
+	dbNameContainer m_names;
+	dbNameIndex m_nameIndex;			//Name hash to handle
+
+	inline unsigned int GetSlotIndex( objectID id )					{ return( id & OBJECT_ID_INDEX_MASK ); }
+	inline unsigned int GetSlotGeneration( objectID id )			{ return( id >> OBJECT_ID_INDEX_BITS ); }
+	inline objectID MakeObjectID( unsigned int index, unsigned int generation )	{ return( ( generation << OBJECT_ID_INDEX_BITS ) | index ); }
+	inline bool IsOwnSlot( unsigned int index )						{ return( index % m_slotStride == m_slotOffset ); }
+
+	dbSlot * FindSlot( objectID id );
+	void FreeSlot( objectID id );
+	unsigned int AddSlot( void );
+	void Unlink( dbSlot * slot );
+	void SortUpdateOrder( void );
+	static bool CompareSortKeys( const dbSortKey & a, const dbSortKey & b );
+
+	unsigned int HashName( char* name );
+	dbNameHandle FindNameHandle( char* name );
+	void RemoveFromNameIndex( GameObject * object, dbNameHandle handle );
+
+	unsigned int GetTypeBit( unsigned int type );
+	void AddToTypeLists( GameObject * object );
+	void RemoveFromTypeLists( GameObject * object );
+
+	void RebuildUpdateSet( void );
+	void DestroyPendingObjects( void );
+	void UpdateObjectsInParallel( const FrameContext & frame );
+	static void UpdateObjectJob( unsigned int index, unsigned int worker, void * context );
+#ifndef STATE_MACHINE_HEADLESS
+	static void AdvanceTimeJob( unsigned int index, unsigned int worker, void * context );
+#endif
+	void CompactMarkedObjects( dbContainer & objects, dbContainer * removed );
 
 
 };
@@ -0,0 +1,247 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "dbquerycache.h"
+#include "database.h"
+#include "gameobject.h"
+#include "body.h"
+#include <algorithm>
+
+
+bool DatabaseQueryCache::ComparePositions( const Position & a, const Position & b )
+{
+	return( a.m_x < b.m_x || ( a.m_x == b.m_x && a.m_z < b.m_z ) );
+}
+
+float DatabaseQueryCache::Cross( const Position & o, const Position & a, const Position & b )
+{
+	return( ( a.m_x - o.m_x ) * ( b.m_z - o.m_z ) - ( a.m_z - o.m_z ) * ( b.m_x - o.m_x ) );
+}
+
+
+DatabaseQueryCache::DatabaseQueryCache( void )
+: m_epoch( 1 ),
+  m_numQueries( 0 ),
+  m_numBuilds( 0 )
+{
+	InitializeCriticalSection( &m_lock );
+}
+
+DatabaseQueryCache::~DatabaseQueryCache( void )
+{
+	DeleteCriticalSection( &m_lock );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetObjectsOfTypes
+
+  Description:  Gets the objects matching any bit of a type mask. Single
+                types go straight to the database's membership lists;
+				combinations are composed once per invalidation.
+
+  Arguments:    type : the OBJECT_* type mask
+
+  Returns:      The list of objects (owned by the cache). Valid until the
+                next invalidation.
+ *---------------------------------------------------------------------------*/
+dbCompositionList & DatabaseQueryCache::GetObjectsOfTypes( unsigned int type )
+{
+	if( g_database.IsSingleType( type ) ) {
+		return( g_database.GetObjectsOfType( type ) );
+	}
+
+	InterlockedIncrement( &m_numQueries );
+
+	TypeList & list = FindTypeList( type );
+	if( list.m_epoch != m_epoch )
+	{
+		EnterCriticalSection( &m_lock );
+		if( list.m_epoch != m_epoch )
+		{	//First query since the objects changed
+			list.m_objects.clear();
+			g_database.ComposeList( list.m_objects, type );
+			InterlockedIncrement( &m_numBuilds );
+			list.m_epoch = m_epoch;
+		}
+		LeaveCriticalSection( &m_lock );
+	}
+
+	return( list.m_objects );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindFarthest
+
+  Description:  Finds the object farthest from a point on the ground plane
+                (as SpatialGrid::FindFarthest). The positions of the type are
+				gathered once per invalidation with their convex hull; the
+				farthest object from any point is a hull vertex, so a query
+				only looks at the hull unless that vertex is the excluded
+				object.
+
+  Arguments:    center  : the point
+                type    : the object types to accept
+                exclude : an object to skip (optional)
+
+  Returns:      The object, or 0 if none (or all are at the point itself).
+ *---------------------------------------------------------------------------*/
+GameObject * DatabaseQueryCache::FindFarthest( const Vector3 & center, unsigned int type, GameObject * exclude )
+{
+	InterlockedIncrement( &m_numQueries );
+
+	PositionSet & set = FindPositionSet( type );
+	if( set.m_epoch != m_epoch )
+	{
+		EnterCriticalSection( &m_lock );
+		if( set.m_epoch != m_epoch )
+		{
+			set.m_positions.clear();
+			dbCompositionList & objects = GetObjectsOfTypes( type );
+			for( dbCompositionList::iterator i=objects.begin(); i!=objects.end(); ++i )
+			{
+				if( (*i)->HasBody() )
+				{
+					Vector3 & pos = (*i)->GetBody().GetPos();
+					Position p;
+					p.m_x = pos.x;
+					p.m_z = pos.z;
+					p.m_object = *i;
+					set.m_positions.push_back( p );
+				}
+			}
+			BuildHull( set );
+			InterlockedIncrement( &m_numBuilds );
+			set.m_epoch = m_epoch;
+		}
+		LeaveCriticalSection( &m_lock );
+	}
+
+	//Best hull vertex; if the excluded object is the only one that far,
+	//the runner-up may be inside the hull
+	float farthestDistSq = 0.0f;
+	GameObject * farthest = 0;
+	bool excluded = false;
+	for( PositionContainer::iterator i=set.m_hull.begin(); i!=set.m_hull.end(); ++i )
+	{
+		float dx = i->m_x - center.x;
+		float dz = i->m_z - center.z;
+		float distSq = dx * dx + dz * dz;
+		if( distSq >= farthestDistSq && i->m_object == exclude ) {
+			excluded = true;
+		}
+		else if( distSq > farthestDistSq ) {
+			farthestDistSq = distSq;
+			farthest = i->m_object;
+			excluded = false;
+		}
+	}
+
+	if( !excluded ) {
+		return( farthest );
+	}
+
+	farthestDistSq = 0.0f;
+	farthest = 0;
+	for( PositionContainer::iterator i=set.m_positions.begin(); i!=set.m_positions.end(); ++i )
+	{
+		float dx = i->m_x - center.x;
+		float dz = i->m_z - center.z;
+		float distSq = dx * dx + dz * dz;
+		if( distSq > farthestDistSq && i->m_object != exclude )
+		{
+			farthestDistSq = distSq;
+			farthest = i->m_object;
+		}
+	}
+
+	return( farthest );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindTypeList / FindPositionSet
+
+  Description:  Looks up the entry of a type mask, creating it (under the
+                lock, since the maps may be searched from job threads) if it
+				doesn't exist yet. Entries are never erased, so references
+				stay valid.
+
+  Arguments:    type : the OBJECT_* type mask
+
+  Returns:      The entry.
+ *---------------------------------------------------------------------------*/
+DatabaseQueryCache::TypeList & DatabaseQueryCache::FindTypeList( unsigned int type )
+{
+	EnterCriticalSection( &m_lock );
+	TypeListContainer::iterator i = m_typeLists.find( type );
+	if( i == m_typeLists.end() )
+	{
+		i = m_typeLists.insert( TypeListContainer::value_type( type, TypeList() ) ).first;
+		i->second.m_epoch = 0;
+	}
+	LeaveCriticalSection( &m_lock );
+	return( i->second );
+}
+
+DatabaseQueryCache::PositionSet & DatabaseQueryCache::FindPositionSet( unsigned int type )
+{
+	EnterCriticalSection( &m_lock );
+	PositionSetContainer::iterator i = m_positionSets.find( type );
+	if( i == m_positionSets.end() )
+	{
+		i = m_positionSets.insert( PositionSetContainer::value_type( type, PositionSet() ) ).first;
+		i->second.m_epoch = 0;
+	}
+	LeaveCriticalSection( &m_lock );
+	return( i->second );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BuildHull
+
+  Description:  Computes the convex hull of a position set (monotone chain).
+                Collinear points are left out, except that every position is
+				kept when there are three or fewer.
+
+  Arguments:    set : the position set
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void DatabaseQueryCache::BuildHull( PositionSet & set )
+{
+	set.m_hull.clear();
+
+	PositionContainer sorted( set.m_positions );
+	if( sorted.size() <= 3 )
+	{
+		set.m_hull.swap( sorted );
+		return;
+	}
+	std::sort( sorted.begin(), sorted.end(), ComparePositions );
+
+	PositionContainer & hull = set.m_hull;
+	hull.resize( sorted.size() * 2 );
+	unsigned int k = 0;
+	for( unsigned int i=0; i<sorted.size(); ++i )
+	{	//Lower hull
+		while( k >= 2 && Cross( hull[k-2], hull[k-1], sorted[i] ) <= 0.0f ) {
+			k--;
+		}
+		hull[k++] = sorted[i];
+	}
+	for( int i=(int)sorted.size()-2, lower=k+1; i>=0; --i )
+	{	//Upper hull
+		while( (int)k >= lower && Cross( hull[k-2], hull[k-1], sorted[i] ) <= 0.0f ) {
+			k--;
+		}
+		hull[k++] = sorted[i];
+	}
+	hull.resize( k - 1 );	//The last point is the first one
+}
@@ -0,0 +1,87 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include <vector>
+#include <map>
+
+class GameObject;
+typedef std::vector<GameObject*> dbCompositionList;
+
+
+//Results of world queries that many state machines make in the same frame (the
+//objects of a type mask, the farthest object of a type), computed by the first
+//query and shared by the rest. Keyed by query kind and type mask. The database
+//invalidates everything when the objects update or move, or are stored or removed,
+//so a result is never older than the current update. Queries can come from the
+//job threads of a parallel update: a result is built once under a lock, then only
+//read until the next invalidation.
+class DatabaseQueryCache
+{
+public:
+
+	DatabaseQueryCache( void );
+	~DatabaseQueryCache( void );
+
+	inline void Invalidate( void )							{ m_epoch++; }
+
+	dbCompositionList & GetObjectsOfTypes( unsigned int type );		//Like Database::ComposeList, without the copy
+	GameObject * FindFarthest( const Vector3 & center, unsigned int type, GameObject * exclude );	//On the ground plane
+
+	//Stats (totals since startup)
+	inline unsigned int GetNumQueries( void )				{ return( m_numQueries ); }
+	inline unsigned int GetNumBuilds( void )				{ return( m_numBuilds ); }	//Queries that had to compute the result
+
+private:
+
+	struct TypeList
+	{
+		volatile unsigned int m_epoch;		//Epoch the list was built in (0 if never)
+		dbCompositionList m_objects;
+	};
+
+	struct Position
+	{
+		float m_x;
+		float m_z;
+		GameObject * m_object;
+	};
+	typedef std::vector<Position> PositionContainer;
+
+	//The objects of a type mask that have a body, and their convex hull on the
+	//ground plane. The farthest object from any point is on the hull, so each
+	//FindFarthest only looks at the hull.
+	struct PositionSet
+	{
+		volatile unsigned int m_epoch;
+		PositionContainer m_positions;
+		PositionContainer m_hull;
+	};
+
+	typedef std::map<unsigned int, TypeList> TypeListContainer;
+	typedef std::map<unsigned int, PositionSet> PositionSetContainer;
+
+	volatile unsigned int m_epoch;
+	TypeListContainer m_typeLists;
+	PositionSetContainer m_positionSets;
+	CRITICAL_SECTION m_lock;
+
+	volatile LONG m_numQueries;
+	volatile LONG m_numBuilds;
+
+	TypeList & FindTypeList( unsigned int type );
+	PositionSet & FindPositionSet( unsigned int type );
+	void BuildHull( PositionSet & set );
+	static bool ComparePositions( const Position & a, const Position & b );
+	static float Cross( const Position & o, const Position & a, const Position & b );
+
+};
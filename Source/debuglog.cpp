@@ -12,43 +12,98 @@
 #include "debuglog.h"
 #include "database.h"
 
-#define MAX_DEBUG_LOG_SIZE 200
 
 
-LogEntry::LogEntry( void )
+/*---------------------------------------------------------------------------*
+  Name:         DebugLog
+
+  Description:  Constructor. The record buffer is allocated once; logging
+                never allocates.
+ *---------------------------------------------------------------------------*/
+DebugLog::DebugLog( void )
+: m_next( 0 ),
+  m_echo( true ),
+  m_sampleRate( 1 ),
+  m_loggedTypes( 0 )
 {
-	m_owner = INVALID_OBJECT_ID;
-	m_name[0] = 0;
-	m_handled = false;
-
-	m_timestamp = -1.0f;
-	m_statename[0] = 0;
-	m_eventmsgname[0] = 0;
-	m_msg = false;
-	m_receiver = INVALID_OBJECT_ID;
-	m_sender = INVALID_OBJECT_ID;
-	m_data = 0;
-	
+	COMPILE_TIME_ASSERT( ( DEBUG_LOG_CAPACITY & ( DEBUG_LOG_CAPACITY - 1 ) ) == 0, debug_log_capacity_must_be_a_power_of_two );
+
+	for( int i=0; i<DEBUG_LOG_CAPACITY; ++i )
+	{
+		m_records[i].m_sequence = 0;
+	}
 }
 
 
 /*---------------------------------------------------------------------------*
-  Name:         ~DebugLog
+  Name:         LogObject
 
-  Description:  Destructor
+  Description:  Always log (or stop always logging) a particular object,
+                regardless of the sample rate and type mask.
+
+  Arguments:    id     : the object
+                logged : whether the object is always logged
+
+  Returns:      None.
  *---------------------------------------------------------------------------*/
-DebugLog::~DebugLog( void )
+void DebugLog::LogObject( objectID id, bool logged )
 {
-	LoggingContainer::iterator i;
-	for( i=m_log.begin(); i!=m_log.end(); ++i )
-	{
-		LogEntry* entry = *i;
-		delete(entry);
+	if( logged ) {
+		m_loggedObjects.insert( id );
+	}
+	else {
+		m_loggedObjects.erase( id );
 	}
 
-	m_log.clear();
+	GameObject * object = g_database.Find( id );
+	if( object ) {
+		object->SetDebugLogged( IsObjectSelected( id, object->GetType() ) );
+	}
 }
 
+/*---------------------------------------------------------------------------*
+  Name:         IsObjectSelected
+
+  Description:  Applies the selection policy to an object.
+
+  Arguments:    id   : the object
+                type : the object's type
+
+  Returns:      True if the object's state machines should log events.
+ *---------------------------------------------------------------------------*/
+bool DebugLog::IsObjectSelected( objectID id, unsigned int type )
+{
+	if( !m_loggedObjects.empty() && m_loggedObjects.find( id ) != m_loggedObjects.end() ) {
+		return( true );
+	}
+	if( m_loggedTypes != 0 && ( type & m_loggedTypes ) == 0 ) {
+		return( false );
+	}
+	if( m_sampleRate == 0 ) {
+		return( false );
+	}
+
+	return( ( id & OBJECT_ID_INDEX_MASK ) % m_sampleRate == 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ApplySelection
+
+  Description:  Refreshes the cached selection of every existing object (new
+                objects pick up the selection when they are created).
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void DebugLog::ApplySelection( void )
+{
+	dbCompositionList & objects = g_database.GetObjectsOfType( OBJECT_Ignore_Type );
+	for( dbCompositionList::iterator i=objects.begin(); i!=objects.end(); ++i )
+	{
+		(*i)->SetDebugLogged( IsObjectSelected( (*i)->GetID(), (*i)->GetType() ) );
+	}
+}
 
 /*---------------------------------------------------------------------------*
   Name:         LogStateMachineEvent
@@ -58,96 +113,104 @@ DebugLog::~DebugLog( void )
   Arguments:    id           : ID of the object
                 name         : string name of the object
                 msg          : pointer to message object containing event
-				statename    : current state of object
-				substatename : current substate of object
+				names        : state/substate names of the state machine class
+				state        : state scope of the event (-1 for global)
+				substate     : substate scope of the event (-1 if none)
 				eventmsgname : the name of the event
 				handled      : whether the event was handled by the object
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void DebugLog::LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const char* statename, const char* substatename, MSG_Name eventmsgname, bool handled )
+void DebugLog::LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const StateNameTable * names, int state, int substate, MSG_Name eventmsgname, bool handled )
 {
-	LogStateMachineEvent( id, name, msg, statename, substatename, (char*)TranslateMsgNameToString( eventmsgname ), handled );
+	LogStateMachineEvent( id, name, msg, names, state, substate, (char*)TranslateMsgNameToString( eventmsgname ), handled );
 }
 
-void DebugLog::LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const char* statename, const char* substatename, char* eventmsgname, bool handled )
+void DebugLog::LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const StateNameTable * names, int state, int substate, State_Machine_Event event, bool handled )
 {
-	if( msg && ( strcmp( MessageNameText[msg->GetName()], "MSG_CHANGE_STATE_DELAYED" ) == 0 ||
-		strcmp( MessageNameText[msg->GetName()], "MSG_CHANGE_SUBSTATE_DELAYED" ) == 0 ))
+	if( msg && ( msg->GetName() == MSG_CHANGE_STATE_DELAYED || msg->GetName() == MSG_CHANGE_SUBSTATE_DELAYED ) )
 	{	//Don't log these events
 		return;
 	}
 
-	LogEntry * entry = new LogEntry();
+	ASSERTMSG( handled || ( event > EVENT_INVALID && event <= EVENT_Timer ), "DebugLog::LogStateMachineEvent - event not handled" );
 
-	entry->m_owner = id;
-	strcpy(entry->m_name, name);
-	entry->m_handled = handled;
-	entry->m_timestamp = g_time.GetCurTime();
-	strcpy( entry->m_statename, statename );
-	strcpy( entry->m_substatename, substatename );
+	LONG slot;
+	LogRecord & record = BeginRecord( slot );
 
-	if( !handled )
-	{
-		if( eventmsgname[0] == '1')
-		{
-			strcpy( entry->m_eventmsgname, "EVENT_Update" );
-		}
-		else if( eventmsgname[0] == '2' && msg )
-		{
-			strcpy( entry->m_eventmsgname, MessageNameText[msg->GetName()] );
-		}
-		else if( eventmsgname[0] == '3')
-		{
-			strcpy( entry->m_eventmsgname, "EVENT_CCMessage" );
-		}
-		else if( eventmsgname[0] == '4') 
-		{
-			strcpy( entry->m_eventmsgname, "EVENT_Enter" );
-		}
-		else if( eventmsgname[0] == '5') 
-		{
-			strcpy( entry->m_eventmsgname, "EVENT_Exit" );
-		}
-		else if( eventmsgname[0] == '6') 
-		{
-			strcpy( entry->m_eventmsgname, "EVENT_Probe" );
+	record.m_type = LOG_RECORD_EVENT;
+	record.m_owner = id;
+	record.m_handled = handled;
+	record.m_timestamp = g_time.GetCurTime();
+	record.m_names = names;
+	record.m_state = state;
+	record.m_substate = substate;
+	record.m_event = (unsigned char)event;
+	record.m_eventmsgname = 0;
+
+	record.m_msg = msg != 0;
+	if( msg ) {
+		record.m_msgname = msg->GetName();
+		record.m_receiver = msg->GetReceiver();
+		record.m_sender = msg->GetSender();
+		if( msg->IsIntData() )
+		{ 
+			record.m_data = msg->GetIntData();
 		}
 		else
-		{
-			ASSERTMSG( 0, "DebugLog::LogStateMachineEvent - eventmsgname not handled" );
-			strcpy( entry->m_eventmsgname, "INVALID_EVENT" );
+		{	//TODO: Deal with float data properly
+			record.m_data = 0;
 		}
 	}
-	else
+
+	EndRecord( record, slot );
+
+	if( m_echo && event == EVENT_Message )
 	{
-		strcpy( entry->m_eventmsgname, eventmsgname );
+		PrintRecord( record, name );
+	}
+}
+
+void DebugLog::LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const StateNameTable * names, int state, int substate, char* eventmsgname, bool handled )
+{
+	if( msg && ( msg->GetName() == MSG_CHANGE_STATE_DELAYED || msg->GetName() == MSG_CHANGE_SUBSTATE_DELAYED ) )
+	{	//Don't log these events
+		return;
 	}
 
+	LONG slot;
+	LogRecord & record = BeginRecord( slot );
+
+	record.m_type = LOG_RECORD_EVENT;
+	record.m_owner = id;
+	record.m_handled = handled;
+	record.m_timestamp = g_time.GetCurTime();
+	record.m_names = names;
+	record.m_state = state;
+	record.m_substate = substate;
+	record.m_event = EVENT_INVALID;
+	record.m_eventmsgname = eventmsgname;
+
+	record.m_msg = msg != 0;
 	if( msg ) {
-		entry->m_msg = true;
-		entry->m_receiver = msg->GetReceiver();
-		entry->m_sender = msg->GetSender();
+		record.m_msgname = msg->GetName();
+		record.m_receiver = msg->GetReceiver();
+		record.m_sender = msg->GetSender();
 		if( msg->IsIntData() )
 		{ 
-			entry->m_data = msg->GetIntData();
+			record.m_data = msg->GetIntData();
 		}
 		else
 		{	//TODO: Deal with float data properly
-			entry->m_data = 0;
+			record.m_data = 0;
 		}
 	}
 
-	if( (handled || eventmsgname[0] == '2') &&
-		strcmp(entry->m_eventmsgname, "EVENT_Update") != 0 )
-	{
-		PrintLogEntry( *entry );
-	}
+	EndRecord( record, slot );
 
-	m_log.push_back( entry );
-	if( m_log.size() > MAX_DEBUG_LOG_SIZE ) {
-		delete( m_log.front() );
-		m_log.pop_front();
+	if( m_echo && handled && strcmp( eventmsgname, "EVENT_Update" ) != 0 )
+	{
+		PrintRecord( record, name );
 	}
 }
 
@@ -160,37 +223,74 @@ void DebugLog::LogStateMachineEvent( objectID id, char* name, MSG_Object * msg,
                 name      : string name of the object
                 state     : new state index
                 substate  : new substate index
-				statename : current state of object
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
 void DebugLog::LogStateMachineStateChange( objectID id, char* name, unsigned int state, int substate )
 {
-	LogEntry * entry = new LogEntry();
-
-	entry->m_owner = id;
-	strcpy(entry->m_name, name);
-	entry->m_handled = true;
-	entry->m_timestamp = g_time.GetCurTime();
-	sprintf( entry->m_statename, "%d", state );
-	sprintf( entry->m_substatename, "%d", substate );
-	strcpy( entry->m_eventmsgname, "STATE_CHANGE" );
-	entry->m_msg = false;
-
-	PrintLogEntry( *entry );
-
-	m_log.push_back( entry );
-	if( m_log.size() > MAX_DEBUG_LOG_SIZE ) {
-		delete( m_log.front() );
-		m_log.pop_front();
+	LONG slot;
+	LogRecord & record = BeginRecord( slot );
+
+	record.m_type = LOG_RECORD_STATE_CHANGE;
+	record.m_owner = id;
+	record.m_handled = true;
+	record.m_timestamp = g_time.GetCurTime();
+	record.m_names = 0;
+	record.m_event = EVENT_INVALID;
+	record.m_eventmsgname = "STATE_CHANGE";
+	record.m_state = state;
+	record.m_substate = substate;
+	record.m_msg = false;
+
+	EndRecord( record, slot );
+
+	if( m_echo )
+	{
+		PrintRecord( record, name );
 	}
 }
 
+/*---------------------------------------------------------------------------*
+  Name:         BeginRecord
+
+  Description:  Claims the next record of the ring buffer, overwriting the
+                oldest record once the buffer is full. Lock free, so it is
+				safe to log from job threads.
+
+  Arguments:    slot : set to the slot number of the record
+
+  Returns:      The record to fill in (passed to EndRecord when done).
+ *---------------------------------------------------------------------------*/
+LogRecord & DebugLog::BeginRecord( LONG & slot )
+{
+	slot = InterlockedIncrement( &m_next ) - 1;
+
+	LogRecord & record = m_records[slot & ( DEBUG_LOG_CAPACITY - 1 )];
+	InterlockedExchange( &record.m_sequence, 0 );
+	return( record );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         EndRecord
+
+  Description:  Publishes a record that was filled in after BeginRecord.
+
+  Arguments:    record : the record
+                slot   : the slot number from BeginRecord
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void DebugLog::EndRecord( LogRecord & record, LONG slot )
+{
+	InterlockedExchange( &record.m_sequence, slot + 1 );
+}
+
 /*---------------------------------------------------------------------------*
   Name:         Dump
 
   Description:  Dumps the accumulated log of a particular object to the debug
-                console.
+                console. Records that are overwritten while the log is read
+				are skipped.
 
   Arguments:    id : ID of the object
 
@@ -199,56 +299,118 @@ void DebugLog::LogStateMachineStateChange( objectID id, char* name, unsigned int
 void DebugLog::Dump( objectID id )
 {
 	GameObject* obj = g_database.Find( id );
-	printf( "DebugLog: %s, id=%d\n", obj->GetName(), id );
+	const char * name = obj ? obj->GetName() : "deleted";
+	printf( "DebugLog: %s, id=%d\n", name, id );
+
+	LONG next = m_next;
+	LONG first = next > DEBUG_LOG_CAPACITY ? next - DEBUG_LOG_CAPACITY : 0;
 
-	LoggingContainer::iterator i;
-	for( i=m_log.begin(); i!=m_log.end(); ++i )
+	for( LONG slot=first; slot<next; ++slot )
 	{
-		LogEntry* log = *i;
-		if( log && log->m_owner == id )
-		{
-			PrintLogEntry( *log );
+		LogRecord & source = m_records[slot & ( DEBUG_LOG_CAPACITY - 1 )];
+		if( source.m_sequence != slot + 1 || source.m_owner != id ) {
+			continue;
+		}
+
+		LogRecord copy = source;
+		if( source.m_sequence == slot + 1 )
+		{	//Not overwritten while copying
+			PrintRecord( copy, name );
 		}
 	}
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         PrintLogEntry
+  Name:         GetEventName
 
-  Description:  Prints a single log entry.
+  Description:  Decodes the event or message name of a record.
 
-  Arguments:    entry : the log entry to print
+  Arguments:    record : the log record
+
+  Returns:      The name.
+ *---------------------------------------------------------------------------*/
+const char * DebugLog::GetEventName( LogRecord & record )
+{
+	if( record.m_eventmsgname ) {
+		return( record.m_eventmsgname );
+	}
+
+	switch( record.m_event )
+	{
+		case EVENT_Update:		return( "EVENT_Update" );
+		case EVENT_Message:		return( record.m_msg ? MessageNameText[record.m_msgname] : "INVALID_EVENT" );
+		case EVENT_CCMessage:	return( "EVENT_CCMessage" );
+		case EVENT_Enter:		return( "EVENT_Enter" );
+		case EVENT_Exit:		return( "EVENT_Exit" );
+		case EVENT_Probe:		return( "EVENT_Probe" );
+		case EVENT_Timer:		return( "EVENT_Timer" );
+		default:				return( "INVALID_EVENT" );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetScopeName
+
+  Description:  Resolves the name of the scope (substate, state or global
+                state) an event was logged in.
+
+  Arguments:    record : the log record
+
+  Returns:      The name.
+ *---------------------------------------------------------------------------*/
+const char * DebugLog::GetScopeName( LogRecord & record )
+{
+	if( record.m_state < 0 ) {
+		return( "STATE_Global" );
+	}
+	if( record.m_names == 0 ) {
+		return( "" );
+	}
+	if( record.m_substate >= 0 ) {
+		return( record.m_names->GetSubstateName( record.m_substate ) );
+	}
+
+	return( record.m_names->GetStateName( record.m_state ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         PrintRecord
+
+  Description:  Prints a single log record.
+
+  Arguments:    record : the log record to print
+                name   : string name of the object
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void DebugLog::PrintLogEntry( LogEntry& entry )
+void DebugLog::PrintRecord( LogRecord & record, const char * name )
 {
 	char debug0[1024];
 	char debug1[1024];
 	char debug2[1024];
 	char state[64];
 
-	if( entry.m_statename[0] != 0 )
-	{	//Use state
-		strcpy( state, entry.m_statename );
+	if( record.m_type == LOG_RECORD_STATE_CHANGE )
+	{
+		sprintf( state, "%d", record.m_state );
 	}
 	else
-	{	//Use substate
-		strcpy( state, entry.m_substatename );
+	{
+		strcpy( state, GetScopeName( record ) );
 	}
 
-	sprintf( debug0, "%.3f-[%s,%d] %s:%s ", entry.m_timestamp, entry.m_name, entry.m_owner, state, entry.m_eventmsgname );
+	sprintf( debug0, "%.3f-[%s,%d] %s:%s ", record.m_timestamp, name, record.m_owner, state, GetEventName( record ) );
 	
-	if( entry.m_msg )
+	if( record.m_msg )
 	{
-		sprintf( debug1, "from:%d to:%d data:%d ", entry.m_sender, entry.m_receiver, entry.m_data );
+		sprintf( debug1, "from:%d to:%d data:%d ", record.m_sender, record.m_receiver, record.m_data );
 	}
 	else
 	{
 		debug1[0] = 0;
 	}
 
-	if( entry.m_handled )
+	if( record.m_handled )
 	{
 		strcpy( debug2, "\n" );
 	}
@@ -257,10 +419,6 @@ void DebugLog::PrintLogEntry( LogEntry& entry )
 		strcpy( debug2, "(not handled)\n" );
 	}
 
-	//char final[4096];
-	//sprintf( final, "%s%s%s\n", debug0, debug1, debug2 );
-	//LPCWSTR utf16str = wstring_to_utf16str(utf8str_to_wstring(final));
-
 	char msg[1024];
 	sprintf(msg, "%s%s%s", debug0, debug1, debug2);
 	WCHAR final[1024];
@@ -268,4 +426,4 @@ void DebugLog::PrintLogEntry( LogEntry& entry )
 	MultiByteToWideChar (CP_ACP, 0, msg, length, final, length);
 	final[length] = 0;
 	OutputDebugString(final);
-}
\ No newline at end of file
+}
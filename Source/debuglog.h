@@ -17,65 +17,114 @@
 #include "global.h"
 #include "singleton.h"
 #include <list>
+#include <set>
+
+struct StateNameTable;
 
 #define REGISTER_MESSAGE_NAME(x) #x,
+#define REGISTER_MESSAGE_NAME_COALESCED(x, rule) #x,
 static const char* MessageNameText[] =
 {
 	#include "msgnames.h"
 	"Invalid"
 };
 #undef REGISTER_MESSAGE_NAME
+#undef REGISTER_MESSAGE_NAME_COALESCED
+
+
+#define DEBUG_LOG_CAPACITY (256)		//Number of records kept (must be a power of two)
 
 
-class LogEntry
+enum LogRecordType {
+	LOG_RECORD_EVENT,
+	LOG_RECORD_STATE_CHANGE
+};
+
+//Compact binary log record. No strings are copied: the state and substate are
+//stored as enums and resolved through the state machine class's name table, the
+//event name pointer refers to a string literal, and the object name is looked up
+//when the record is printed.
+class LogRecord
 {
 public:
-	
-	LogEntry( void );
-	~LogEntry( void ) {}
 
+	volatile LONG m_sequence;		//Slot number + 1 once the record is complete (0 while being written)
+
+	double m_timestamp;
 	objectID m_owner;
-	char m_name[GAME_OBJECT_MAX_NAME_SIZE];
-	bool m_handled;
+	unsigned char m_type;			//LogRecordType
+	unsigned char m_handled;
+	unsigned char m_event;			//State_Machine_Event (for unhandled events)
+	unsigned char m_msg;			//Whether the msg info is valid
 
-	float m_timestamp;
-	char m_statename[64];
-	char m_substatename[64];
-	char m_eventmsgname[64];
+	const StateNameTable * m_names;	//Names of the state machine class (0 for state changes)
+	const char * m_eventmsgname;	//String literal (0 if decoded from m_event)
+	int m_state;					//State scope of the event (-1 for global), or the new state
+	int m_substate;					//Substate scope of the event (-1 for none), or the new substate
 
 	//msg only info
-	bool m_msg;
+	MSG_Name m_msgname;
 	objectID m_receiver;
 	objectID m_sender;
 	unsigned int m_data;
 
-
 };
 
 class DebugLog : public Singleton <DebugLog>
 {
 public:
 
-	DebugLog( void ) {}
-	~DebugLog( void );
+	DeclareMemoryTag( MEMORY_TAG_LOG )
+
+	DebugLog( void );
+	~DebugLog( void ) {}
 
-	void LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const char* statename, const char* substatename, char* eventmsgname, bool handled ); 
-	void LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const char* statename, const char* substatename, MSG_Name eventmsgname, bool handled ); 
+	//The event name strings must be string literals, since only the pointers are recorded
+	void LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const StateNameTable * names, int state, int substate, char* eventmsgname, bool handled ); 
+	void LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const StateNameTable * names, int state, int substate, MSG_Name eventmsgname, bool handled ); 
+	void LogStateMachineEvent( objectID id, char* name, MSG_Object * msg, const StateNameTable * names, int state, int substate, State_Machine_Event event, bool handled ); 
 	void LogStateMachineStateChange( objectID id, char* name, unsigned int state, int substate );
 
 	const char * TranslateMsgNameToString( MSG_Name msgname )		{ return( MessageNameText[ msgname ] ); }
 
+	//Whether new records are also printed to the debug output as they are logged
+	inline void SetEchoToOutput( bool echo )							{ m_echo = echo; }
+	inline bool IsEchoToOutput( void )									{ return( m_echo ); }
+
 	void Dump( objectID id );
 
+	//Object selection. An object logs if its ID was chosen with LogObject, or if
+	//its type matches the type mask (0 = any type) and it falls in the sample
+	//(1 in N objects by slot index; 1 = all, 0 = none). The choice is cached in
+	//each object when it is created, so unselected objects skip logging with a
+	//single flag check. Call ApplySelection to refresh existing objects.
+	inline void SetSampleRate( unsigned int rate )						{ m_sampleRate = rate; }
+	inline unsigned int GetSampleRate( void )							{ return( m_sampleRate ); }
+	inline void SetLoggedTypes( unsigned int typeMask )					{ m_loggedTypes = typeMask; }
+	inline unsigned int GetLoggedTypes( void )							{ return( m_loggedTypes ); }
+	void LogObject( objectID id, bool logged );
+	bool IsObjectSelected( objectID id, unsigned int type );
+	void ApplySelection( void );
+
 	void OutputDebugStringX( const wchar_t * string, ... ) { va_list args; va_start(args, string); wchar_t buf[2048]; vswprintf(buf, string, args); OutputDebugString(buf); }
 
 
 private:
 
-	typedef std::list<LogEntry*> LoggingContainer;
+	LogRecord m_records[DEBUG_LOG_CAPACITY];
+	volatile LONG m_next;			//Next slot number (objects may log from job threads during a parallel update)
+	bool m_echo;
+
+	typedef std::set<objectID> ObjectIDSet;
 
-	LoggingContainer m_log;
+	unsigned int m_sampleRate;
+	unsigned int m_loggedTypes;
+	ObjectIDSet m_loggedObjects;
 
-	void PrintLogEntry( LogEntry& entry );
+	LogRecord & BeginRecord( LONG & slot );
+	void EndRecord( LogRecord & record, LONG slot );
+	void PrintRecord( LogRecord & record, const char * name );
+	const char * GetEventName( LogRecord & record );
+	const char * GetScopeName( LogRecord & record );
 
 };
@@ -11,9 +11,11 @@
 
 #include "DXUT.h"
 #include "example.h"
+#include "snapshot.h"
 #include "database.h"
 #include "movement.h"
 #include "body.h"
+#include "spatialgrid.h"
 
 
 
@@ -30,6 +32,8 @@ enum SubstateName {
 	//empty
 };
 
+REGISTER_STATE_MACHINE( Example )
+
 bool Example::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
@@ -60,15 +64,7 @@ BeginStateMachine
 			if( m_curTarget == 0 ) {
 				ChangeState( STATE_MoveToRandomTarget );
 			}
-			SendMsgToStateMachineNow( MSG_SetTargetPosition );
-
-		OnMsg( MSG_SetTargetPosition )
-			GameObject* go = g_database.Find( m_curTarget );
-			if( go ) {
-				D3DXVECTOR3 target = go->GetBody().GetPos();
-				m_owner->GetMovement().SetTarget( target );
-			}
-			SendMsgToState( MSG_SetTargetPosition );
+			m_owner->GetMovement().SetFollowTarget( m_curTarget );	//Tracked by the movement every frame
 
 		OnMsg( MSG_Arrived )
 			ChangeState( STATE_Idle );
@@ -107,36 +103,13 @@ EndStateMachine
 
 objectID Example::GetFarthestNPC( void )
 {
-	float farthestDistance = 0.0f;
-	GameObject* farthestGameObject = 0;
-	dbCompositionList list;
-	g_database.ComposeList( list, OBJECT_NPC );
-	
-	dbCompositionList::iterator i;
-	for( i=list.begin(); i!=list.end(); ++i )
-	{
-		if( (*i)->GetID() != m_owner->GetID() )
-		{
-			D3DXVECTOR3 npcPos = (*i)->GetBody().GetPos();
-			D3DXVECTOR3 myPos = m_owner->GetBody().GetPos();
-			D3DXVECTOR3 diff = npcPos - myPos;
-			float distance = D3DXVec3Length( &diff );
-
-			if( farthestGameObject )
-			{
-				if( distance > farthestDistance )
-				{
-					farthestDistance = distance;
-					farthestGameObject = *i;
-				}
-			}
-			else
-			{
-				farthestDistance = distance;
-				farthestGameObject = *i;
-			}
-		}
+	if( SpatialGrid::DoesSingletonExist() )
+	{	//Only visits the cells that could be farther than the best so far
+		GameObject* farthest = g_spatialgrid.FindFarthest( m_owner->GetBody().GetPos(), OBJECT_NPC, m_owner );
+		return( farthest ? farthest->GetID() : 0 );
 	}
 
-	return( farthestGameObject->GetID() );
+	//Every agent picking a target this update shares the same hull of NPC positions
+	GameObject* farthest = g_database.FindFarthest( m_owner->GetBody().GetPos(), OBJECT_NPC, m_owner );
+	return( farthest ? farthest->GetID() : 0 );
 }
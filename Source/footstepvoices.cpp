@@ -0,0 +1,164 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "footstepvoices.h"
+#include "DXUT\SDKsound.h"
+
+
+FootstepVoices::FootstepVoices( void )
+: m_numNearest( 0 ),
+  m_numRequested( 0 ),
+  m_numSounds( 0 ),
+  m_maxVoices( FOOTSTEP_VOICES_MAX_VOICES ),
+  m_audibleDistanceSq( 1.0f ),		//The characters walk within [0,1] on x and z
+  m_hasListener( false ),
+  m_eye( 0.0f, 0.0f, 0.0f ),
+  m_numRequestedLastFrame( 0 ),
+  m_numPlayedLastFrame( 0 )
+{
+	InitializeCriticalSection( &m_lock );
+}
+
+FootstepVoices::~FootstepVoices( void )
+{
+	DeleteCriticalSection( &m_lock );
+}
+
+void FootstepVoices::SetMaxVoices( unsigned int voices )
+{
+	ASSERTMSG( voices <= FOOTSTEP_VOICES_MAX_VOICES, "FootstepVoices::SetMaxVoices - The footstep sounds don't have that many buffers." );
+	m_maxVoices = voices < FOOTSTEP_VOICES_MAX_VOICES ? voices : FOOTSTEP_VOICES_MAX_VOICES;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BeginFrame
+
+  Description:  Takes the listener of the frame about to be animated. Any
+                requests left from a frame that wasn't ended are dropped.
+
+  Arguments:    eye : the camera position (0 for none)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void FootstepVoices::BeginFrame( const D3DXVECTOR3 * eye )
+{
+	m_hasListener = ( eye != 0 );
+	if( eye ) {
+		m_eye = *eye;
+	}
+	m_numNearest = 0;
+	m_numRequested = 0;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Request
+
+  Description:  Asks for a footstep to be played this frame. Only the nearest
+                FOOTSTEP_VOICES_MAX_VOICES requests are kept (no more could
+				be played), in a fixed array. Can be called from any thread
+				between BeginFrame and EndFrame.
+
+  Arguments:    sound : the footstep sound
+                pos   : where the footstep is
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void FootstepVoices::Request( CSound * sound, const D3DXVECTOR3 & pos )
+{
+	if( !sound || !m_hasListener ) {
+		return;
+	}
+	float distanceSq = DistanceSq( pos );	//The listener only changes in BeginFrame
+
+	EnterCriticalSection( &m_lock );
+	m_numRequested++;
+
+	if( distanceSq <= m_audibleDistanceSq )
+	{
+		unsigned int i = m_numNearest < m_maxVoices ? m_numNearest++ : m_maxVoices;
+		for( ; i > 0 && m_nearest[i - 1].m_distanceSq > distanceSq; --i )
+		{	//Shift the farther ones down (the farthest falls off the end when full)
+			if( i < m_maxVoices ) {
+				m_nearest[i] = m_nearest[i - 1];
+			}
+		}
+		if( i < m_maxVoices )
+		{
+			m_nearest[i].m_sound = sound;
+			m_nearest[i].m_distanceSq = distanceSq;
+		}
+
+		unsigned int s = 0;
+		while( s < m_numSounds && m_sounds[s] != sound ) {
+			++s;
+		}
+		if( s == m_numSounds && m_numSounds < FOOTSTEP_VOICES_MAX_SOUNDS ) {
+			m_sounds[m_numSounds++] = sound;
+		}
+	}
+	LeaveCriticalSection( &m_lock );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         EndFrame
+
+  Description:  Plays the nearest requests of the frame in the voices that
+                are free, quieter with the distance.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void FootstepVoices::EndFrame( void )
+{
+	unsigned int playing = CountPlayingVoices();
+	unsigned int freeVoices = playing < m_maxVoices ? m_maxVoices - playing : 0;
+	unsigned int numPlayed = m_numNearest < freeVoices ? m_numNearest : freeVoices;
+
+	for( unsigned int i=0; i<numPlayed; ++i )
+	{
+		float fraction = m_audibleDistanceSq > 0.0f ? m_nearest[i].m_distanceSq / m_audibleDistanceSq : 1.0f;
+		LONG volume = (LONG)( min( fraction, 1.0f ) * FOOTSTEP_VOICES_QUIET_VOLUME );
+		m_nearest[i].m_sound->Play( 0, 0, volume );
+	}
+
+	m_numRequestedLastFrame = m_numRequested;
+	m_numPlayedLastFrame = numPlayed;
+	m_numNearest = 0;
+	m_numRequested = 0;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CountPlayingVoices
+
+  Description:  Counts the buffers of the footstep sounds that are playing.
+
+  Arguments:    None.
+
+  Returns:      The number of voices in use.
+ *---------------------------------------------------------------------------*/
+unsigned int FootstepVoices::CountPlayingVoices( void )
+{
+	unsigned int playing = 0;
+	for( unsigned int s=0; s<m_numSounds; ++s )
+	{
+		LPDIRECTSOUNDBUFFER buffer;
+		for( DWORD i=0; ( buffer = m_sounds[s]->GetBuffer( i ) ) != NULL; ++i )
+		{
+			DWORD status = 0;
+			buffer->GetStatus( &status );
+			if( status & DSBSTATUS_PLAYING ) {
+				playing++;
+			}
+		}
+	}
+	return( playing );
+}
@@ -0,0 +1,85 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+
+class CSound;
+
+
+#define FOOTSTEP_VOICES_MAX_VOICES (8)			//Buffers of each footstep sound (see CTiny::Setup), and the most voices at once
+#define FOOTSTEP_VOICES_MAX_SOUNDS (4)			//Different sounds whose buffers are counted as voices
+#define FOOTSTEP_VOICES_QUIET_VOLUME (-3000)	//Volume at the audible distance (hundredths of a decibel)
+
+
+//Voice management for the character footsteps. Each frame, a character farther
+//than the audible distance from the eye is culled: it is animated without its
+//callback handler, so its footstep keys cost nothing (see CTiny::AdvanceAnimationLOD).
+//The footsteps of the others are requested as they are played back; only the
+//nearest ones that fit in the free voices are played, at the end of the frame,
+//and the rest are dropped. A voice is a buffer of a footstep sound that is still
+//playing, so the sounds are created with FOOTSTEP_VOICES_MAX_VOICES buffers each.
+//
+//BeginFrame and EndFrame are for the main thread. Request takes a lock, since
+//the footstep callbacks can be played back from any thread (CTiny::AdvanceTime
+//plays them right away, wherever it runs); IsAudible only reads, so the
+//parallel animation update can call it.
+class FootstepVoices : public Singleton <FootstepVoices>
+{
+public:
+
+	FootstepVoices( void );
+	~FootstepVoices( void );
+
+	//Configuration
+	void SetMaxVoices( unsigned int voices );		//At most FOOTSTEP_VOICES_MAX_VOICES
+	inline unsigned int GetMaxVoices( void )			{ return( m_maxVoices ); }
+	inline void SetAudibleDistance( float distance )	{ m_audibleDistanceSq = distance * distance; }
+
+	void BeginFrame( const D3DXVECTOR3 * eye );		//0 if there is no listener (every character is culled)
+	inline bool IsAudible( const D3DXVECTOR3 & pos )	{ return( m_hasListener && DistanceSq( pos ) <= m_audibleDistanceSq ); }
+	void Request( CSound * sound, const D3DXVECTOR3 & pos );
+	void EndFrame( void );
+
+	//Stats (last frame)
+	inline unsigned int GetNumRequested( void )			{ return( m_numRequestedLastFrame ); }
+	inline unsigned int GetNumPlayed( void )			{ return( m_numPlayedLastFrame ); }
+	inline unsigned int GetNumDropped( void )			{ return( m_numRequestedLastFrame - m_numPlayedLastFrame ); }
+
+private:
+
+	struct Footstep
+	{
+		CSound * m_sound;
+		float m_distanceSq;
+	};
+
+	Footstep m_nearest[FOOTSTEP_VOICES_MAX_VOICES];	//The nearest requests this frame, nearest first
+	unsigned int m_numNearest;
+	unsigned int m_numRequested;
+	CRITICAL_SECTION m_lock;						//Guards the requests
+
+	CSound * m_sounds[FOOTSTEP_VOICES_MAX_SOUNDS];	//The sounds requested so far
+	unsigned int m_numSounds;
+
+	unsigned int m_maxVoices;
+	float m_audibleDistanceSq;
+	bool m_hasListener;
+	D3DXVECTOR3 m_eye;
+
+	unsigned int m_numRequestedLastFrame;
+	unsigned int m_numPlayedLastFrame;
+
+	inline float DistanceSq( const D3DXVECTOR3 & pos )	{ D3DXVECTOR3 diff = pos - m_eye; return( D3DXVec3LengthSq( &diff ) ); }
+	unsigned int CountPlayingVoices( void );
+
+};
@@ -11,13 +11,20 @@
 #include "DXUT.h"
 #include "gameobject.h"
 #include "msgroute.h"
+#include "database.h"
 #include "statemch.h"
-#include "movement.h"
 #include "body.h"
+#include "debuglog.h"
+#include "snapshot.h"
+#include "movement.h"
+#ifndef STATE_MACHINE_HEADLESS
+#include "animationlod.h"
+#endif
 
 
 GameObject::GameObject( objectID id, unsigned int type, char* name )
 : m_markedForDeletion(false),
+  m_updateActive(false),
   m_stateMachineManager(0),
   m_body(0),
   m_movement(0),
@@ -25,6 +32,8 @@ GameObject::GameObject( objectID id, unsigned int type, char* name )
 {
 	m_id = id;
 	m_type = type;
+	m_debugLogged = g_debuglog.IsObjectSelected( id, type );
+	m_ccObserved = false;
 	
 	if( strlen(name) < GAME_OBJECT_MAX_NAME_SIZE ) {
 		strcpy( m_name, name );
@@ -41,18 +50,59 @@ GameObject::~GameObject( void )
 	{
 		delete m_stateMachineManager;
 	}
-	if(m_body)
-	{
-		delete m_body;
-	}
 	if(m_movement)
 	{
 		delete m_movement;
 	}
+#ifndef STATE_MACHINE_HEADLESS
 	if(m_tiny)
 	{
 		delete m_tiny;
 	}
+#endif
+	if(m_body)
+	{	//Last, the other components use the body
+		delete m_body;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         MarkForDeletion
+
+  Description:  Schedules this object to be destroyed at the end of the 
+                database update (when it is safe to do so).
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void GameObject::MarkForDeletion( void )
+{
+	if( !m_markedForDeletion )
+	{
+		m_markedForDeletion = true;
+		g_database.QueueForDeletion( *this );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetUpdateActive
+
+  Description:  Sets whether this object is part of the database update. 
+                Objects whose state machines have no OnUpdate (and no 
+				pending state machine change) are skipped every frame.
+
+  Arguments:    active : whether Update should be called
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void GameObject::SetUpdateActive( bool active )
+{
+	if( m_updateActive != active )
+	{
+		m_updateActive = active;
+		g_database.UpdateActiveChanged( *this );
+	}
 }
 
 void GameObject::CreateStateMachineManager( void )
@@ -60,16 +110,22 @@ void GameObject::CreateStateMachineManager( void )
 	m_stateMachineManager = new StateMachineManager( *this );
 }
 
-void GameObject::CreateMovement( void )
+void GameObject::CreateStateMachineManager( unsigned int numQueues )
 {
-	m_movement = new Movement( *this ); 
+	m_stateMachineManager = new StateMachineManager( *this, numQueues );
 }
 
-void GameObject::CreateBody( int health, D3DXVECTOR3& pos )
+void GameObject::CreateBody( int health, Vector3& pos )
 {
 	m_body = new Body( health, pos, *this );
 }
 
+void GameObject::CreateMovement( void )
+{
+	m_movement = new Movement( *this ); 
+}
+
+#ifndef STATE_MACHINE_HEADLESS
 void GameObject::CreateTiny( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoundManager *pSM, double dTimeCurrent )
 {
     m_tiny = new CTiny( *this );
@@ -87,6 +143,7 @@ void GameObject::CreateTiny( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars,
 		delete m_tiny;
 	}
 }
+#endif
 
 void GameObject::Initialize( void )
 {
@@ -98,15 +155,15 @@ void GameObject::Initialize( void )
 
   Description:  Calls the update function of the currect state machine.
 
-  Arguments:    None.
+  Arguments:    frame : the current tick
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void GameObject::Update( void )
+void GameObject::Update( const FrameContext & frame )
 {
 	if(m_stateMachineManager)
 	{
-		m_stateMachineManager->Update();
+		m_stateMachineManager->Update( frame );
 	}
 }
 
@@ -118,11 +175,53 @@ void GameObject::Animate( double dTimeDelta )
 	}
 }
 
+void GameObject::BeginStep( void )
+{
+	if( m_body && !m_body->IsStored() )	//Stored bodies are swept by the database
+	{
+		m_body->BeginStep();
+	}
+}
+
+void GameObject::Interpolate( float alpha )
+{
+	if( m_body )
+	{
+		if( !m_body->IsStored() ) {
+			m_body->Interpolate( alpha );
+		}
+
+#ifndef STATE_MACHINE_HEADLESS
+		if( m_tiny )
+		{
+			m_tiny->SetOrientation();
+		}
+#endif
+	}
+}
+
+#ifndef STATE_MACHINE_HEADLESS
 void GameObject::AdvanceTime( double dTimeDelta, D3DXVECTOR3 *pvEye )
 {
 	if( m_tiny )
 	{
-		m_tiny->AdvanceTime( dTimeDelta, pvEye );
+		if( AnimationLOD::DoesSingletonExist() )
+		{
+			unsigned int interval = g_animationlod.GetUpdateInterval( GetBody().GetPos(), m_tiny->GetBoundingRadius() );
+			m_tiny->AdvanceAnimationLOD( dTimeDelta, pvEye, interval );
+		}
+		else
+		{
+			m_tiny->AdvanceAnimation( dTimeDelta, pvEye );
+		}
+	}
+}
+
+void GameObject::UpdateTransforms( void )
+{
+	if( m_tiny )
+	{
+		m_tiny->UpdateTransforms();
 	}
 }
 
@@ -130,6 +229,7 @@ void GameObject::Draw( IDirect3DDevice9* pd3dDevice, D3DXMATRIX* pViewProj )
 {
 	if( m_tiny )
 	{
+		m_tiny->PlayCallbacks();	//The footsteps of the last AdvanceTime (which may have run on a worker)
 		m_tiny->Draw();
 	}
 }
@@ -146,4 +246,89 @@ void GameObject::InvalidateDeviceObjects( void )
 {
 
 }
+#endif
+
+
+/*---------------------------------------------------------------------------*
+  Name:         Save
+
+  Description:  Saves the components and the state machines of the object.
+                The animation of a rendered character isn't saved.
+
+  Arguments:    writer : the snapshot being written
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void GameObject::Save( SnapshotWriter & writer )
+{
+	writer.Write( m_markedForDeletion );
+
+	writer.Write( HasBody() );
+	if( m_body )
+	{
+		writer.Write( m_body->GetHealth() );
+		writer.Write( m_body->GetPos() );
+		writer.Write( m_body->GetDir() );
+		writer.Write( m_body->GetSpeed() );
+		writer.Write( m_body->GetRadius() );
+	}
+
+	writer.Write( m_movement != 0 );
+	if( m_movement ) {
+		m_movement->Save( writer );
+	}
+
+	writer.Write( m_stateMachineManager ? m_stateMachineManager->GetNumQueues() : 0u );
+	if( m_stateMachineManager ) {
+		m_stateMachineManager->Save( writer );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Restore
 
+  Description:  Recreates the components and the state machines saved by
+                Save.
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      Whether the object was restored.
+ *---------------------------------------------------------------------------*/
+bool GameObject::Restore( SnapshotReader & reader )
+{
+	bool markedForDeletion = reader.Read<bool>();
+
+	if( reader.Read<bool>() )
+	{
+		int health = reader.Read<int>();
+		Vector3 pos = reader.Read<Vector3>();
+		Vector3 dir = reader.Read<Vector3>();
+		float speed = reader.Read<float>();
+		float radius = reader.Read<float>();
+		CreateBody( health, pos );
+		m_body->SetDir( dir );
+		m_body->SetSpeed( speed );
+		m_body->SetRadius( radius );
+	}
+
+	if( reader.Read<bool>() )
+	{
+		CreateMovement();
+		m_movement->Restore( reader );
+	}
+
+	unsigned int numQueues = reader.Read<unsigned int>();
+	if( numQueues > STATE_MACHINE_MAX_QUEUES ) {
+		reader.Fail();
+	}
+	if( numQueues > 0 && reader.IsValid() )
+	{
+		CreateStateMachineManager( numQueues );
+		m_stateMachineManager->Restore( reader );
+	}
+
+	if( markedForDeletion ) {
+		MarkForDeletion();
+	}
+	return( reader.IsValid() );
+}
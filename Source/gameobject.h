@@ -12,8 +12,11 @@
 
 #include <list>
 #include "global.h"
+#include "memtrack.h"
+#ifndef STATE_MACHINE_HEADLESS
 #include "MultiAnimation.h"
 #include "Tiny.h"
+#endif
 
 
 //Add new object types here (bitfield mask - objects can be combinations of types)
@@ -35,12 +38,18 @@ class StateMachineManager;
 class MSG_Object;
 class Movement;
 class Body;
+class CTiny;
+class SnapshotWriter;
+struct FrameContext;
+class SnapshotReader;
 
 
 class GameObject
 {
 public:
 
+	DeclareMemoryTag( MEMORY_TAG_GAME_OBJECT )
+
 	GameObject( objectID id, unsigned int type, char* name );
 	~GameObject( void );
 
@@ -49,42 +58,73 @@ public:
 	inline char* GetName( void )					{ return( m_name ); }
 	
 	void Initialize( void );
-	void Update( void );
+	void Update( const FrameContext & frame );
 	void Animate( double dTimeDelta );
-	void AdvanceTime( double dTimeDelta, D3DXVECTOR3 *pvEye );
+	void BeginStep( void );
+	void Interpolate( float alpha );
+#ifndef STATE_MACHINE_HEADLESS
+	void AdvanceTime( double dTimeDelta, D3DXVECTOR3 *pvEye );	//Advances the animation; the bones follow in UpdateTransforms
+	void UpdateTransforms( void );								//AdvanceTime and UpdateTransforms are safe to call for different objects in parallel
 	void Draw( IDirect3DDevice9* pd3dDevice, D3DXMATRIX* pViewProj );
 	void RestoreDeviceObjects( LPDIRECT3DDEVICE9 pd3dDevice );
 	void InvalidateDeviceObjects( void );
+#endif
 
 	//State machine related
 	void CreateStateMachineManager( void );
+	void CreateStateMachineManager( unsigned int numQueues );	//Simple objects can use a single queue, complex ones up to STATE_MACHINE_MAX_QUEUES
 	inline StateMachineManager* GetStateMachineManager( void )	{ ASSERTMSG(m_stateMachineManager, "GameObject::GetStateMachineManager - m_stateMachineManager not set"); return( m_stateMachineManager ); }
+	inline bool HasStateMachineManager( void )		{ return( m_stateMachineManager != 0 ); }
 
 	//Scheduled deletion
-	inline void MarkForDeletion( void )				{ m_markedForDeletion = true; }
+	void MarkForDeletion( void );
 	inline bool IsMarkedForDeletion( void )			{ return( m_markedForDeletion ); }
 
-	//Movement component
-	void CreateMovement( void );
-	inline Movement& GetMovement( void )			{ ASSERTMSG(m_movement, "GameObject::GetMovement - m_movement not set"); return( *m_movement ); }
+	//Whether the database needs to call Update (set by the StateMachineManager)
+	void SetUpdateActive( bool active );
+	inline bool IsUpdateActive( void )				{ return( m_updateActive ); }
+
+	//Whether the state machines log events to the debug log (chosen by the debug log selection)
+	inline void SetDebugLogged( bool logged )		{ m_debugLogged = logged; }
+	inline bool IsDebugLogged( void )				{ return( m_debugLogged ); }
+
+	//Whether other objects are CCd its messages (set by MsgRoute::SubscribeCC)
+	inline void SetCCObserved( bool observed )		{ m_ccObserved = observed; }
+	inline bool IsCCObserved( void )				{ return( m_ccObserved ); }
 
 	//Body component
-	void CreateBody( int health, D3DXVECTOR3& pos );
+	void CreateBody( int health, Vector3& pos );
 	inline Body& GetBody( void )					{ ASSERTMSG(m_body, "GameObject::GetBody - m_body not set"); return( *m_body ); }
+	inline bool HasBody( void )						{ return( m_body != 0 ); }
 
+	//Movement component (moves the body; without a tiny, with a plain locomotion model)
+	void CreateMovement( void );
+	inline Movement& GetMovement( void )			{ ASSERTMSG(m_movement, "GameObject::GetMovement - m_movement not set"); return( *m_movement ); }
+	inline bool HasMovement( void )					{ return( m_movement != 0 ); }
+
+#ifndef STATE_MACHINE_HEADLESS
 	//Tiny
 	void CreateTiny( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoundManager *pSM, double dTimeCurrent );
 	inline CTiny& GetTiny( void )					{ ASSERTMSG(m_tiny, "GameObject::GetModel - m_tiny not set"); return( *m_tiny ); }
+	inline bool HasTiny( void )						{ return( m_tiny != 0 ); }
+#endif
+
+	//Snapshots (see snapshot.h) - the components and state machines (the ID, type and name are saved by the database)
+	void Save( SnapshotWriter & writer );
+	bool Restore( SnapshotReader & reader );
 
 private:
 
 	objectID m_id;									//Unique id of object (safer than a pointer).
 	unsigned int m_type;							//Type of object (can be combination).
 	bool m_markedForDeletion;						//Flag to delete this object (when it is safe to do so).
+	bool m_updateActive;							//Flag to be visited by the database update.
+	bool m_debugLogged;								//Flag to record state machine events in the debug log.
+	bool m_ccObserved;								//Flag to copy handled messages to CC subscribers.
 	char m_name[GAME_OBJECT_MAX_NAME_SIZE];			//String name of object.
 
 
-	//Components
+	//Components (tiny is never created in the headless build)
 	Movement* m_movement;
 	Body* m_body;
 	CTiny* m_tiny;
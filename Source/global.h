@@ -11,17 +11,32 @@
 #pragma once
 
 #include <assert.h>
+#ifndef STATE_MACHINE_HEADLESS
 #include "DXUT\DXUT.h"
+#else
+#include <windows.h>
+#endif
+#include "vector.h"
 
 #define ASSERTMSG(eval, message) assert(eval && message)
-#define COMPILE_TIME_ASSERT(expression, message) { typedef int ASSERT__##message[1][(expression)]; }
+#define COMPILE_TIME_ASSERT(expression, message) { typedef int ASSERT__##message[1][(expression)]; (void)sizeof( ASSERT__##message ); }
 
 
 #define g_time Time::GetSingleton()
+#define g_frame Time::GetFrame()
 #define g_database Database::GetSingleton()
 #define g_msgroute MsgRoute::GetSingleton()
 #define g_debuglog DebugLog::GetSingleton()
 #define g_debugdrawing DebugDrawing::GetSingleton()
+#define g_jobsystem JobSystem::GetSingleton()
+#define g_profiler StateMachineProfiler::GetSingleton()
+#define g_telemetry FrameTelemetry::GetSingleton()
+#define g_bodystore BodyStore::GetSingleton()
+#define g_spatialgrid SpatialGrid::GetSingleton()
+#define g_msgrecorder MsgRecorder::GetSingleton()
+#define g_animationlod AnimationLOD::GetSingleton()
+#define g_footstepvoices FootstepVoices::GetSingleton()
+#define g_shard Shard::GetSingleton()
 
 
 #define INVALID_OBJECT_ID 0
@@ -0,0 +1,240 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "jobsystem.h"
+
+
+
+/*---------------------------------------------------------------------------*
+  Name:         JobSystem
+
+  Description:  Constructor. Creates the worker threads, which sleep until
+                ParallelFor is called.
+
+  Arguments:    numWorkers : the number of workers including the main thread
+                             (0 to use one per hardware thread)
+ *---------------------------------------------------------------------------*/
+JobSystem::JobSystem( unsigned int numWorkers )
+: m_func( 0 ),
+  m_context( 0 ),
+  m_grainSize( 1 ),
+  m_running( false ),
+  m_quit( false )
+{
+	if( numWorkers == 0 )
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo( &info );
+		numWorkers = info.dwNumberOfProcessors;
+	}
+	if( numWorkers < 1 ) {
+		numWorkers = 1;
+	}
+	if( numWorkers > JOB_SYSTEM_MAX_WORKERS ) {
+		numWorkers = JOB_SYSTEM_MAX_WORKERS;
+	}
+	m_numWorkers = numWorkers;
+
+	m_tlsIndex = TlsAlloc();
+	ASSERTMSG( m_tlsIndex != TLS_OUT_OF_INDEXES, "JobSystem::JobSystem - Out of TLS indices" );
+
+	//Worker 0 is the main thread, so only start the others
+	for( unsigned int i=1; i<m_numWorkers; i++ )
+	{
+		m_startEvents[i] = CreateEvent( 0, FALSE, FALSE, 0 );
+		m_doneEvents[i] = CreateEvent( 0, FALSE, FALSE, 0 );
+		m_workerStart[i].m_jobSystem = this;
+		m_workerStart[i].m_worker = i;
+		m_threads[i] = CreateThread( 0, 0, WorkerThread, &m_workerStart[i], 0, 0 );
+		ASSERTMSG( m_threads[i] != 0, "JobSystem::JobSystem - Failed to create worker thread" );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ~JobSystem
+
+  Description:  Destructor. Stops and joins the worker threads.
+ *---------------------------------------------------------------------------*/
+JobSystem::~JobSystem( void )
+{
+	m_quit = true;
+
+	for( unsigned int i=1; i<m_numWorkers; i++ ) {
+		SetEvent( m_startEvents[i] );
+	}
+
+	for( unsigned int i=1; i<m_numWorkers; i++ )
+	{
+		WaitForSingleObject( m_threads[i], INFINITE );
+		CloseHandle( m_threads[i] );
+		CloseHandle( m_startEvents[i] );
+		CloseHandle( m_doneEvents[i] );
+	}
+
+	TlsFree( m_tlsIndex );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ParallelFor
+
+  Description:  Calls func for every index in [0, count), spread over the 
+                workers. Blocks until all indices are done. Must not be 
+				called from inside a job.
+
+  Arguments:    count     : the number of indices
+                grainSize : the number of indices claimed at a time
+				func      : the loop body
+				context   : passed to func
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void JobSystem::ParallelFor( unsigned int count, unsigned int grainSize, JobFunction func, void * context )
+{
+	ASSERTMSG( !m_running, "JobSystem::ParallelFor - Nested ParallelFor is not supported" );
+
+	if( count == 0 ) {
+		return;
+	}
+
+	if( m_numWorkers == 1 || count <= grainSize )
+	{	//Not worth waking the pool
+		for( unsigned int i=0; i<count; i++ ) {
+			func( i, 0, context );
+		}
+		return;
+	}
+
+	m_func = func;
+	m_context = context;
+	m_world = WorldContext::Capture();
+	m_grainSize = grainSize > 0 ? (LONG)grainSize : 1;
+
+	//Split the range evenly (workers will steal if their share runs out early)
+	for( unsigned int i=0; i<m_numWorkers; i++ )
+	{
+		m_ranges[i].m_next = (LONG)( (unsigned long long)count * i / m_numWorkers );
+		m_ranges[i].m_end = (LONG)( (unsigned long long)count * ( i + 1 ) / m_numWorkers );
+	}
+
+	m_running = true;
+	for( unsigned int i=1; i<m_numWorkers; i++ ) {
+		SetEvent( m_startEvents[i] );
+	}
+
+	RunWorker( 0 );
+
+	WaitForMultipleObjects( m_numWorkers - 1, &m_doneEvents[1], TRUE, INFINITE );
+	m_running = false;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetCurrentWorker
+
+  Description:  Returns the worker index of the calling thread.
+
+  Arguments:    None.
+
+  Returns:      The worker index (0 for the main thread).
+ *---------------------------------------------------------------------------*/
+unsigned int JobSystem::GetCurrentWorker( void )
+{
+	intptr_t value = (intptr_t)TlsGetValue( m_tlsIndex );
+	return( value > 0 ? (unsigned int)( value - 1 ) : 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WorkerThread
+
+  Description:  Thread entry point for the pool threads.
+
+  Arguments:    param : the WorkerStart for this thread
+
+  Returns:      Thread exit code.
+ *---------------------------------------------------------------------------*/
+DWORD WINAPI JobSystem::WorkerThread( LPVOID param )
+{
+	WorkerStart * start = (WorkerStart*)param;
+	JobSystem * jobSystem = start->m_jobSystem;
+	unsigned int worker = start->m_worker;
+
+	TlsSetValue( jobSystem->m_tlsIndex, (LPVOID)(intptr_t)( worker + 1 ) );
+
+	for(;;)
+	{
+		WaitForSingleObject( jobSystem->m_startEvents[worker], INFINITE );
+		if( jobSystem->m_quit ) {
+			break;
+		}
+
+		jobSystem->m_world.Bind();
+		jobSystem->RunWorker( worker );
+		SetEvent( jobSystem->m_doneEvents[worker] );
+	}
+
+	return( 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RunWorker
+
+  Description:  Processes chunks from the worker's own range, then steals
+                from the other ranges until no work is left.
+
+  Arguments:    worker : the worker index
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void JobSystem::RunWorker( unsigned int worker )
+{
+	LONG start, end;
+
+	for( unsigned int offset=0; offset<m_numWorkers; offset++ )
+	{	//Own range first (offset 0), then the others in turn
+		unsigned int range = ( worker + offset ) % m_numWorkers;
+		while( ClaimChunk( range, start, end ) )
+		{
+			for( LONG i=start; i<end; i++ ) {
+				m_func( (unsigned int)i, worker, m_context );
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ClaimChunk
+
+  Description:  Atomically claims the next chunk of a range.
+
+  Arguments:    range : the range to claim from
+                start : set to the first index of the chunk
+				end   : set to one past the last index of the chunk
+
+  Returns:      False if the range is exhausted.
+ *---------------------------------------------------------------------------*/
+bool JobSystem::ClaimChunk( unsigned int range, LONG & start, LONG & end )
+{
+	WorkRange & r = m_ranges[range];
+
+	if( r.m_next >= r.m_end ) {
+		return( false );
+	}
+
+	start = InterlockedExchangeAdd( &r.m_next, m_grainSize );
+	if( start >= r.m_end ) {
+		return( false );
+	}
+
+	end = start + m_grainSize;
+	if( end > r.m_end ) {
+		end = r.m_end;
+	}
+	return( true );
+}
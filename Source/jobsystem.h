@@ -0,0 +1,79 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+#include "worldcontext.h"
+
+
+#define JOB_SYSTEM_MAX_WORKERS 32		//Including the main thread (must not exceed MAXIMUM_WAIT_OBJECTS)
+
+//Job function for ParallelFor. Worker 0 is the calling (main) thread.
+typedef void (*JobFunction)( unsigned int index, unsigned int worker, void * context );
+
+
+//Thread pool that runs a loop body over a range of indices. The range is
+//split evenly between the workers, each worker claims chunks from the front 
+//of its own range, and a worker that runs dry steals chunks from the other
+//workers' ranges. The calling thread takes part as worker 0 and ParallelFor
+//returns once every index has been processed. The pool threads run each job with
+//the world context of the calling thread (see worldcontext.h).
+class JobSystem : public Singleton <JobSystem>
+{
+public:
+
+	JobSystem( unsigned int numWorkers = 0 );		//0 = one worker per hardware thread
+	~JobSystem( void );
+
+	void ParallelFor( unsigned int count, unsigned int grainSize, JobFunction func, void * context );
+
+	inline unsigned int GetNumWorkers( void )		{ return( m_numWorkers ); }
+	inline bool IsRunningJobs( void )				{ return( m_running ); }
+	unsigned int GetCurrentWorker( void );
+	inline bool IsPoolThread( void )				{ return( TlsGetValue( m_tlsIndex ) != 0 ); }
+
+private:
+
+	struct WorkRange
+	{
+		volatile LONG m_next;		//Next index to claim
+		LONG m_end;
+	};
+
+	struct WorkerStart
+	{
+		JobSystem * m_jobSystem;
+		unsigned int m_worker;
+	};
+
+	unsigned int m_numWorkers;
+	DWORD m_tlsIndex;				//Holds the worker index + 1 for pool threads (0 for the main thread)
+
+	HANDLE m_threads[JOB_SYSTEM_MAX_WORKERS];
+	HANDLE m_startEvents[JOB_SYSTEM_MAX_WORKERS];
+	HANDLE m_doneEvents[JOB_SYSTEM_MAX_WORKERS];
+	WorkerStart m_workerStart[JOB_SYSTEM_MAX_WORKERS];
+
+	//Current job (only valid while m_running)
+	WorkRange m_ranges[JOB_SYSTEM_MAX_WORKERS];
+	JobFunction m_func;
+	void * m_context;
+	WorldContext m_world;			//Bound by the pool threads for the job
+	LONG m_grainSize;
+	volatile bool m_running;
+	volatile bool m_quit;
+
+	static DWORD WINAPI WorkerThread( LPVOID param );
+	void RunWorker( unsigned int worker );
+	bool ClaimChunk( unsigned int range, LONG & start, LONG & end );
+
+};
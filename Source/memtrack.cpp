@@ -0,0 +1,186 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "memtrack.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+
+static const char* MemoryTagText[] =
+{
+	"GameObject",
+	"Component",
+	"StateMachineManager",
+	"StateMachine",
+	"StateVariables",
+	"Msg",
+	"Log"
+};
+
+MemoryTracker::TagCounters MemoryTracker::s_tags[MEMORY_NUM_TAGS];
+volatile LONG MemoryTracker::s_hotPathDepth = 0;
+volatile LONG MemoryTracker::s_numHotPathAllocs = 0;
+volatile LONG MemoryTracker::s_numHotPathAllocsFrame = 0;
+unsigned int MemoryTracker::s_numHotPathAllocsLastFrame = 0;
+
+
+/*---------------------------------------------------------------------------*
+  Name:         Allocate
+
+  Description:  Allocates a block from the heap and counts it against a tag.
+
+  Arguments:    size : the size of the block
+                tag  : the subsystem it belongs to
+
+  Returns:      The block (16 byte aligned). Throws std::bad_alloc like
+                operator new if the heap is exhausted.
+ *---------------------------------------------------------------------------*/
+void * MemoryTracker::Allocate( size_t size, MemoryTag tag )
+{
+	COMPILE_TIME_ASSERT( sizeof( MemoryTagText ) / sizeof( MemoryTagText[0] ) == MEMORY_NUM_TAGS, memory_tag_text_must_match_the_tags );
+	COMPILE_TIME_ASSERT( MEMORY_TRACKER_HEADER >= sizeof( size_t ) + sizeof( unsigned int ), memory_tracker_header_holds_size_and_tag );
+
+	char * block = (char*)malloc( size + MEMORY_TRACKER_HEADER );
+	if( block == 0 ) {
+		throw std::bad_alloc();
+	}
+	*(size_t*)block = size;
+	*(unsigned int*)( block + sizeof( size_t ) ) = tag;
+
+	TagCounters & counters = s_tags[tag];
+	LONG current = InterlockedExchangeAdd( &counters.m_currentBytes, (LONG)size ) + (LONG)size;
+	LONG peak = counters.m_peakBytes;
+	while( current > peak )
+	{	//Another thread may have raised the peak meanwhile
+		LONG previous = InterlockedCompareExchange( &counters.m_peakBytes, current, peak );
+		if( previous == peak ) {
+			break;
+		}
+		peak = previous;
+	}
+	InterlockedIncrement( &counters.m_currentBlocks );
+	InterlockedIncrement( &counters.m_numAllocs );
+	InterlockedIncrement( &counters.m_numAllocsFrame );
+
+	CountHotPathAlloc();
+
+	return( block + MEMORY_TRACKER_HEADER );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Free
+
+  Description:  Returns a block from Allocate to the heap.
+
+  Arguments:    p : the block (may be 0)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MemoryTracker::Free( void * p )
+{
+	if( !p ) {
+		return;
+	}
+
+	char * block = (char*)p - MEMORY_TRACKER_HEADER;
+	size_t size = *(size_t*)block;
+	unsigned int tag = *(unsigned int*)( block + sizeof( size_t ) );
+	ASSERTMSG( tag < MEMORY_NUM_TAGS, "MemoryTracker::Free - Block wasn't allocated by the tracker" );
+
+	InterlockedExchangeAdd( &s_tags[tag].m_currentBytes, -(LONG)size );
+	InterlockedDecrement( &s_tags[tag].m_currentBlocks );
+	free( block );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BeginFrame
+
+  Description:  Makes the allocations counted since the last call the last
+                frame's, and starts counting the next frame.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MemoryTracker::BeginFrame( void )
+{
+	for( unsigned int i=0; i<MEMORY_NUM_TAGS; ++i )
+	{
+		s_tags[i].m_numAllocsLastFrame = (unsigned int)InterlockedExchange( &s_tags[i].m_numAllocsFrame, 0 );
+	}
+	s_numHotPathAllocsLastFrame = (unsigned int)InterlockedExchange( &s_numHotPathAllocsFrame, 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetReport
+
+  Description:  Copies out the counters of every tag.
+
+  Arguments:    report : filled with the counters
+
+  Returns:      None. (The report is stored in the report argument.)
+ *---------------------------------------------------------------------------*/
+void MemoryTracker::GetReport( MemoryReport & report )
+{
+	report.m_currentBytes = 0;
+	report.m_numAllocsLastFrame = 0;
+	for( unsigned int i=0; i<MEMORY_NUM_TAGS; ++i )
+	{
+		MemoryTagStats & stats = report.m_tags[i];
+		stats.m_name = MemoryTagText[i];
+		stats.m_currentBytes = (unsigned int)s_tags[i].m_currentBytes;
+		stats.m_peakBytes = (unsigned int)s_tags[i].m_peakBytes;
+		stats.m_currentBlocks = (unsigned int)s_tags[i].m_currentBlocks;
+		stats.m_numAllocs = (unsigned int)s_tags[i].m_numAllocs;
+		stats.m_numAllocsLastFrame = s_tags[i].m_numAllocsLastFrame;
+
+		report.m_currentBytes += stats.m_currentBytes;
+		report.m_numAllocsLastFrame += stats.m_numAllocsLastFrame;
+	}
+	report.m_numHotPathAllocsLastFrame = s_numHotPathAllocsLastFrame;
+	report.m_numHotPathAllocs = (unsigned int)s_numHotPathAllocs;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Dump
+
+  Description:  Prints the report to the debug output, one line per tag.
+
+  Arguments:    numObjects : divides the current bytes into bytes per object
+                             (0 to leave that column out)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MemoryTracker::Dump( unsigned int numObjects )
+{
+	MemoryReport report;
+	GetReport( report );
+
+	wchar_t buffer[256];
+	for( unsigned int i=0; i<MEMORY_NUM_TAGS; ++i )
+	{
+		MemoryTagStats & stats = report.m_tags[i];
+		swprintf( buffer, sizeof( buffer ) / sizeof( buffer[0] ), L"%-20S current %9u  peak %9u  blocks %7u  allocs %9u  last frame %5u",
+		          stats.m_name, stats.m_currentBytes, stats.m_peakBytes, stats.m_currentBlocks,
+		          stats.m_numAllocs, stats.m_numAllocsLastFrame );
+		OutputDebugString( buffer );
+		if( numObjects > 0 )
+		{
+			swprintf( buffer, sizeof( buffer ) / sizeof( buffer[0] ), L"  per object %8.1f", (double)stats.m_currentBytes / numObjects );
+			OutputDebugString( buffer );
+		}
+		OutputDebugString( L"\n" );
+	}
+
+	swprintf( buffer, sizeof( buffer ) / sizeof( buffer[0] ), L"Total %u bytes, %u allocations last frame (%u in the hot path)\n",
+	          report.m_currentBytes, report.m_numAllocsLastFrame, report.m_numHotPathAllocsLastFrame );
+	OutputDebugString( buffer );
+}
@@ -0,0 +1,168 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include <stddef.h>
+#include <new>
+
+
+#define MEMORY_TRACKER_HEADER (16)		//Size and tag in front of each block (keeps blocks 16 byte aligned)
+
+
+//What an engine allocation belongs to
+enum MemoryTag {
+	MEMORY_TAG_GAME_OBJECT,
+	MEMORY_TAG_COMPONENT,				//Body, Movement, CTiny
+	MEMORY_TAG_STATE_MACHINE_MANAGER,	//The manager and its queues
+	MEMORY_TAG_STATE_MACHINE,
+	MEMORY_TAG_STATE_VARIABLES,			//StateMachinePersistentData blocks
+	MEMORY_TAG_MSG,						//Pooled MSG_Objects and message payloads
+	MEMORY_TAG_LOG,						//DebugLog records
+
+	MEMORY_NUM_TAGS
+};
+
+struct MemoryTagStats
+{
+	const char * m_name;
+	unsigned int m_currentBytes;
+	unsigned int m_peakBytes;
+	unsigned int m_currentBlocks;
+	unsigned int m_numAllocs;			//Total since startup
+	unsigned int m_numAllocsLastFrame;
+};
+
+struct MemoryReport
+{
+	MemoryTagStats m_tags[MEMORY_NUM_TAGS];
+	unsigned int m_currentBytes;		//All tags
+	unsigned int m_numAllocsLastFrame;
+	unsigned int m_numHotPathAllocsLastFrame;	//Made while a MemoryHotPathScope was open (should be 0 in steady state)
+	unsigned int m_numHotPathAllocs;			//Total since startup
+};
+
+
+//Counts the engine's heap allocations by subsystem. Engine classes route their
+//allocations through here with DeclareMemoryTag (class operator new/delete),
+//MemoryTagAllocator (STL containers) or Allocate/Free directly. Each block is
+//prefixed with its size and tag, so Free needs neither.
+//
+//The counters are process-wide (allocations don't know their World) and are
+//updated with interlocked operations, so job threads can allocate during a
+//parallel update. Database::Update starts a frame and holds a hot path scope
+//for its duration: an allocation inside it is counted as a hot path allocation,
+//which a benchmark can require to be zero once warmed up. Allocations that don't
+//go through the tracker (untagged containers, the CRT) are only counted if the
+//program's own operator new reports them with CountUntrackedAlloc, as the
+//benchmark does.
+class MemoryTracker
+{
+public:
+
+	static void * Allocate( size_t size, MemoryTag tag );
+	static void Free( void * p );
+	static inline void CountUntrackedAlloc( void )			{ CountHotPathAlloc(); }	//From a global operator new
+
+	static void BeginFrame( void );		//Rolls the per-frame counters (main thread)
+	static inline void EnterHotPath( void )					{ InterlockedIncrement( &s_hotPathDepth ); }
+	static inline void LeaveHotPath( void )					{ InterlockedDecrement( &s_hotPathDepth ); }
+
+	static void GetReport( MemoryReport & report );
+	static void Dump( unsigned int numObjects );	//The report to the debug output, with bytes per object if numObjects isn't 0
+
+	static inline unsigned int GetCurrentBytes( MemoryTag tag )		{ return( (unsigned int)s_tags[tag].m_currentBytes ); }
+	static inline unsigned int GetNumHotPathAllocsLastFrame( void )	{ return( s_numHotPathAllocsLastFrame ); }
+
+private:
+
+	struct TagCounters
+	{
+		volatile LONG m_currentBytes;
+		volatile LONG m_peakBytes;
+		volatile LONG m_currentBlocks;
+		volatile LONG m_numAllocs;
+		volatile LONG m_numAllocsFrame;		//This frame so far
+		unsigned int m_numAllocsLastFrame;
+	};
+
+	static inline void CountHotPathAlloc( void )
+	{
+		if( s_hotPathDepth > 0 )
+		{
+			InterlockedIncrement( &s_numHotPathAllocs );
+			InterlockedIncrement( &s_numHotPathAllocsFrame );
+		}
+	}
+
+	static TagCounters s_tags[MEMORY_NUM_TAGS];
+	static volatile LONG s_hotPathDepth;
+	static volatile LONG s_numHotPathAllocs;
+	static volatile LONG s_numHotPathAllocsFrame;
+	static unsigned int s_numHotPathAllocsLastFrame;
+
+};
+
+
+//Marks the enclosing block as a hot path (see MemoryTracker)
+class MemoryHotPathScope
+{
+public:
+	inline MemoryHotPathScope( void )						{ MemoryTracker::EnterHotPath(); }
+	inline ~MemoryHotPathScope( void )						{ MemoryTracker::LeaveHotPath(); }
+};
+
+
+//Routes a class's (and its subclasses') heap allocations through the tracker:
+//  class Body
+//  {
+//  public:
+//      DeclareMemoryTag( MEMORY_TAG_COMPONENT )
+//      ...
+#define DeclareMemoryTag( tag ) \
+	static void * operator new( size_t size )				{ return( MemoryTracker::Allocate( size, tag ) ); } \
+	static void * operator new[]( size_t size )				{ return( MemoryTracker::Allocate( size, tag ) ); } \
+	static void operator delete( void * p )					{ MemoryTracker::Free( p ); } \
+	static void operator delete[]( void * p )				{ MemoryTracker::Free( p ); }
+
+
+//STL allocator that routes a container's storage through the tracker:
+//  std::list<StateMachine*, MemoryTagAllocator<StateMachine*, MEMORY_TAG_STATE_MACHINE_MANAGER> >
+template <class T, MemoryTag Tag> class MemoryTagAllocator
+{
+public:
+
+	typedef T value_type;
+	typedef T * pointer;
+	typedef const T * const_pointer;
+	typedef T & reference;
+	typedef const T & const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <class U> struct rebind { typedef MemoryTagAllocator<U, Tag> other; };
+
+	MemoryTagAllocator( void ) {}
+	MemoryTagAllocator( const MemoryTagAllocator & ) {}
+	template <class U> MemoryTagAllocator( const MemoryTagAllocator<U, Tag> & ) {}
+
+	inline pointer address( reference x ) const				{ return( &x ); }
+	inline const_pointer address( const_reference x ) const	{ return( &x ); }
+	inline pointer allocate( size_type n, const void * = 0 )	{ return( (pointer)MemoryTracker::Allocate( n * sizeof( T ), Tag ) ); }
+	inline void deallocate( pointer p, size_type )			{ MemoryTracker::Free( p ); }
+	inline size_type max_size( void ) const					{ return( (size_type)( -1 ) / sizeof( T ) ); }
+	inline void construct( pointer p, const T & value )		{ ::new( (void*)p ) T( value ); }
+	inline void destroy( pointer p )						{ p->~T(); }
+
+	template <class U> inline bool operator==( const MemoryTagAllocator<U, Tag> & ) const	{ return( true ); }
+	template <class U> inline bool operator!=( const MemoryTagAllocator<U, Tag> & ) const	{ return( false ); }
+
+};
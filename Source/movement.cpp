@@ -13,74 +13,393 @@
 #include "movement.h"
 #include "gameobject.h"
 #include "body.h"
+#include "bodystore.h"
+#include "snapshot.h"
+#ifndef STATE_MACHINE_HEADLESS
 #include "tiny.h"
+#endif
+#include <math.h>
 
 
 Movement::Movement( GameObject& owner )
 : m_owner( &owner ),
+  m_target( &m_localTarget ),
+  m_integratedByStore( false ),
+  m_arrivalPending( false ),
+  m_followID( 0 ),
   m_speedWalk( 1.f / 5.7f ),
-  m_speedJog( 1.f / 2.3f )
+  m_speedJog( 1.f / 2.3f ),
+  m_speedScale( 1.0f )
 {
-	m_target.x = m_target.y = m_target.z = 0.0f;
+	Body& body = m_owner->GetBody();
+	if( body.IsStored() )
+	{
+		m_target = &g_bodystore.GetTarget( body.GetStoreIndex() );
+		g_bodystore.SetMovable( body.GetStoreIndex(), true );
+		m_integratedByStore = true;
+	}
+
+	m_target->x = m_target->y = m_target->z = 0.0f;
 }
 
 Movement::~Movement( void )
 {
+	if( m_integratedByStore && BodyStore::DoesSingletonExist() )
+	{
+		g_bodystore.ClearFollow( m_owner->GetBody().GetStoreIndex() );
+		g_bodystore.SetMovable( m_owner->GetBody().GetStoreIndex(), false );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AdvanceSpeedScale
+
+  Description:  Brings the locomotion model up to speed, and hands the speed
+                scale to the BodyStore when the store integrates the body.
+				Called by the database for stored bodies before the sweep,
+				so the sweep moves them at this frame's scale (as the per
+				object path does).
 
+  Arguments:    dTimeDelta : the time step
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Movement::AdvanceSpeedScale( double dTimeDelta )
+{
+	if( !HasModel() && m_speedScale < 1.0f )
+	{	//Locomotion model: get up to speed
+		m_speedScale += float( dTimeDelta / MOVEMENT_TRANSITION_TIME );
+		if( m_speedScale > 1.0f ) {
+			m_speedScale = 1.0f;
+		}
+	}
+
+	if( m_integratedByStore ) {
+		g_bodystore.SetSpeedScale( m_owner->GetBody().GetStoreIndex(), GetSpeedScale() );
+	}
 }
 
 void Movement::Animate( double dTimeDelta )
 {
-	if( m_owner->GetBody().GetSpeed() == 0.0f )
-	{
-		m_owner->GetTiny().SmoothLoiter();
+	if( !m_integratedByStore ) {
+		AdvanceSpeedScale( dTimeDelta );
 	}
-	else
+
+	UpdateFollowTarget();
+
+	if( m_integratedByStore )
+	{	//Position, facing and arrival were done for all bodies by BodyStore::Integrate
+		UpdateModel( m_owner->GetBody().GetSpeed() == 0.0f );
+		return;
+	}
+
+	if( m_owner->GetBody().GetSpeed() != 0.0f )
 	{
-		float speed = m_owner->GetBody().GetSpeed();
-		D3DXVECTOR3 pos = m_owner->GetBody().GetPos();
-		D3DXVECTOR3 toTarget = m_target - pos;
-
-		if( D3DXVec3Length( &toTarget ) < 0.01f )
-		{	//Notify target reached
-			//m_owner->GetBody().SetPos( m_target );
-			g_database.SendMsgFromSystem( m_owner, MSG_Arrived );
+		Vector3 pos = m_owner->GetBody().GetPos();
+		Vector3 toTarget = *m_target - pos;
+		float length = sqrtf( toTarget.x * toTarget.x + toTarget.y * toTarget.y + toTarget.z * toTarget.z );
+
+		if( length < BODY_STORE_ARRIVAL_DISTANCE )
+		{	//Notify goal reached (once)
+			if( m_arrivalPending )
+			{
+				m_arrivalPending = false;
+				g_database.SendMsgFromSystem( m_owner, MSG_Arrived );
+			}
 		}
 		else
 		{	
 			//Point character towards target this frame
-			D3DXVECTOR3 dir;
-			D3DXVec3Normalize( &dir, &toTarget );
+			Vector3 dir = toTarget * ( 1.0f / length );
 			m_owner->GetBody().SetDir( dir );
 
 			//Move character towards target this frame
-			double speedScale = m_owner->GetTiny().GetSpeedScale();
-			D3DXVec3Scale( &dir, &dir, float( m_owner->GetBody().GetSpeed() * speedScale * dTimeDelta ) );
-
-			D3DXVECTOR3 newPos;
-			D3DXVec3Add( &newPos, &dir, &m_owner->GetBody().GetPos() );
-			m_owner->GetBody().SetPos( newPos );
+			float step = float( m_owner->GetBody().GetSpeed() * GetSpeedScale() * dTimeDelta );
+			if( step > length ) {
+				step = length;	//Land on the target
+			}
+			Vector3 newPos = pos + dir * step;
+			m_owner->GetBody().MoveTo( newPos );
 		}
 	}
 
-	m_owner->GetTiny().SetOrientation();
+	UpdateModel( m_owner->GetBody().GetSpeed() == 0.0f );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetTarget
 
+  Description:  Sets a point as the goal. MSG_Arrived is sent once, when the
+                body gets there.
+
+  Arguments:    target : the point to move to
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Movement::SetTarget( Vector3& target )
+{
+	StopFollowing();
+	*m_target = target;
+	SetArrivalPending( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetFollowTarget
+
+  Description:  Sets another object as the goal. Its position becomes the
+                target every frame (for stored bodies by BodyStore::Integrate,
+				otherwise by Animate) and MSG_Arrived is sent once, when the
+				body catches up with it. If the object is destroyed, the
+				body heads for where it was last.
+
+  Arguments:    target : the ID of the object to follow
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Movement::SetFollowTarget( objectID target )
+{
+	StopFollowing();
+
+	GameObject* go = g_database.Find( target );
+	if( go == 0 ) {
+		return;
+	}
+
+	*m_target = go->GetBody().GetPos();
+	SetArrivalPending( true );
+
+	if( m_integratedByStore && go->GetBody().IsStored() ) {
+		g_bodystore.SetFollow( m_owner->GetBody().GetStoreIndex(), go->GetBody().GetStoreIndex(), target );
+	}
+	else {
+		m_followID = target;
+	}
+}
+
+bool Movement::IsArrivalPending( void )
+{
+	if( m_integratedByStore ) {
+		return( g_bodystore.IsArrivalPending( m_owner->GetBody().GetStoreIndex() ) );
+	}
+	return( m_arrivalPending );
+}
+
+bool Movement::IsFollowing( void )
+{
+	if( m_followID != 0 ) {
+		return( true );
+	}
+	return( m_integratedByStore && g_bodystore.IsFollowing( m_owner->GetBody().GetStoreIndex() ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetTimeToArrival
+
+  Description:  Estimates how long the body will take to reach its goal at
+                its current speed. While the body gets up to speed or the
+				followed object moves the estimate changes, so it suits
+				scheduling ahead (ChangeStateDelayed, OnTime) with MSG_Arrived
+				as the exact event.
+
+  Arguments:    None.
+
+  Returns:      The time in seconds, 0 if the goal is reached but not yet
+                reported, or -1 if there's no goal or the body isn't moving.
+ *---------------------------------------------------------------------------*/
+float Movement::GetTimeToArrival( void )
+{
+	if( !IsArrivalPending() ) {
+		return( -1.0f );
+	}
+
+	Vector3 toTarget = *m_target - m_owner->GetBody().GetPos();
+	float length = sqrtf( toTarget.x * toTarget.x + toTarget.y * toTarget.y + toTarget.z * toTarget.z );
+	if( length < BODY_STORE_ARRIVAL_DISTANCE ) {
+		return( 0.0f );
+	}
+
+	float speed = m_owner->GetBody().GetSpeed() * GetSpeedScale();
+	if( speed <= 0.0f ) {
+		return( -1.0f );
+	}
+	return( length / speed );
+}
+
+void Movement::SetArrivalPending( bool pending )
+{
+	if( m_integratedByStore ) {
+		g_bodystore.SetArrivalPending( m_owner->GetBody().GetStoreIndex(), pending );
+	}
+	else {
+		m_arrivalPending = pending;
+	}
+}
+
+void Movement::StopFollowing( void )
+{
+	m_followID = 0;
+	if( m_integratedByStore ) {
+		g_bodystore.ClearFollow( m_owner->GetBody().GetStoreIndex() );
+	}
+}
+
+void Movement::UpdateFollowTarget( void )
+{	//Following that BodyStore::Integrate can't do (either body isn't stored)
+	if( m_followID == 0 ) {
+		return;
+	}
+
+	GameObject* go = g_database.Find( m_followID );
+	if( go ) {
+		*m_target = go->GetBody().GetPos();
+	}
+	else {
+		m_followID = 0;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Save
+
+  Description:  Saves the goal (the target, whether the arrival is still to
+                be reported and the followed object) and the speed scale of
+				the locomotion model.
+
+  Arguments:    writer : the snapshot being written
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Movement::Save( SnapshotWriter & writer )
+{
+	objectID followID = m_followID;
+	if( m_integratedByStore && followID == 0 ) {
+		followID = g_bodystore.GetFollowID( m_owner->GetBody().GetStoreIndex() );
+	}
+
+	writer.Write( *m_target );
+	writer.Write( IsArrivalPending() );
+	writer.Write( followID );
+	writer.Write( m_speedScale );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Restore
+
+  Description:  Restores what Save wrote. The followed object is remembered
+                by ID until ResumeFollowing.
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Movement::Restore( SnapshotReader & reader )
+{
+	*m_target = reader.Read<Vector3>();
+	SetArrivalPending( reader.Read<bool>() );
+	m_followID = reader.Read<objectID>();
+	m_speedScale = reader.Read<float>();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ResumeFollowing
+
+  Description:  Hands a restored follow over to the BodyStore, once the
+                followed object has been restored too (if it isn't stored
+				here, it keeps being followed by ID, see UpdateFollowTarget).
+				The saved target is kept.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Movement::ResumeFollowing( void )
+{
+	if( m_followID == 0 || !m_integratedByStore ) {
+		return;
+	}
+
+	GameObject* go = g_database.Find( m_followID );
+	if( go && go->HasBody() && go->GetBody().IsStored() )
+	{
+		Vector3 target = *m_target;
+		g_bodystore.SetFollow( m_owner->GetBody().GetStoreIndex(), go->GetBody().GetStoreIndex(), m_followID );
+		*m_target = target;
+		m_followID = 0;
+	}
 }
 
 void Movement::SetIdleSpeed( void )
 {
 	m_owner->GetBody().SetSpeed( 0.0f );
-	m_owner->GetTiny().SetIdleKey( true );
+	m_speedScale = 1.0f;
+#ifndef STATE_MACHINE_HEADLESS
+	if( HasModel() ) {
+		m_owner->GetTiny().SetIdleKey( true );
+	}
+#endif
 }
 
 void Movement::SetWalkSpeed( void )
 {
 	m_owner->GetBody().SetSpeed( m_speedWalk );
-	m_owner->GetTiny().SetMoveKey();
+	StartMoving();
 }
 
 void Movement::SetJogSpeed( void )
 {
 	m_owner->GetBody().SetSpeed( m_speedJog );
-	m_owner->GetTiny().SetMoveKey();
+	StartMoving();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetSpeedScale
+
+  Description:  Gets how fast the body moves, as a fraction of its speed:
+                the speed of the move animation of the model, or of the
+				locomotion model without one.
+
+  Arguments:    None.
+
+  Returns:      The speed scale (1 when idle).
+ *---------------------------------------------------------------------------*/
+float Movement::GetSpeedScale( void )
+{
+#ifndef STATE_MACHINE_HEADLESS
+	if( HasModel() ) {
+		return( (float)m_owner->GetTiny().GetSpeedScale() );
+	}
+#endif
+	return( m_speedScale );
+}
+
+bool Movement::HasModel( void )
+{
+#ifndef STATE_MACHINE_HEADLESS
+	return( m_owner->HasTiny() );
+#else
+	return( false );
+#endif
+}
+
+void Movement::StartMoving( void )
+{
+	m_speedScale = 0.0f;	//The move animation blends in from a standstill
+#ifndef STATE_MACHINE_HEADLESS
+	if( HasModel() ) {
+		m_owner->GetTiny().SetMoveKey();
+	}
+#endif
+}
+
+void Movement::UpdateModel( bool idle )
+{
+#ifndef STATE_MACHINE_HEADLESS
+	if( HasModel() )
+	{
+		if( idle ) {
+			m_owner->GetTiny().SmoothLoiter();
+		}
+		m_owner->GetTiny().SetOrientation();
+	}
+#endif
 }
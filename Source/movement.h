@@ -10,30 +10,76 @@
 
 #pragma once
 
+#include "global.h"
+#include "memtrack.h"
+
 class GameObject;
+class SnapshotWriter;
+class SnapshotReader;
+
 
+#define MOVEMENT_TRANSITION_TIME (0.25f)	//Time to get up to speed (as long as the move animations take to blend in)
 
+
+//Moves the body of an object towards its target. When the object has an
+//animated model (a CTiny), the model follows the movement and sets how fast
+//the body moves (the speed of its move animation, which ramps up as the
+//animation blends in). Without one - always in the headless build - a plain
+//locomotion model stands in: the speed ramps up over MOVEMENT_TRANSITION_TIME
+//each time the object starts walking or jogging, so the simulation moves the
+//same way with no animation cost.
 class Movement
 {
 public:
+	DeclareMemoryTag( MEMORY_TAG_COMPONENT )
+
 	Movement( GameObject& owner );
 	~Movement( void );
 
-	inline void SetTarget( D3DXVECTOR3& target )			{ m_target = target; }
-	inline D3DXVECTOR3& GetTarget( void )					{ return( m_target ); }
+	//Goals: MSG_Arrived is sent once when the body reaches its goal, which is
+	//either a point or another object (its current position, every frame)
+	void SetTarget( Vector3& target );
+	void SetFollowTarget( objectID target );
+	inline Vector3& GetTarget( void )						{ return( *m_target ); }
+	bool IsArrivalPending( void );			//The goal hasn't been reached yet
+	bool IsFollowing( void );
+	float GetTimeToArrival( void );			//At the current speed (-1 if not moving towards a goal)
 
+	void AdvanceSpeedScale( double dTimeDelta );	//Before BodyStore::Integrate for stored bodies (otherwise done by Animate)
 	void Animate( double dTimeDelta );
+	inline bool IsIntegratedByStore( void )					{ return( m_integratedByStore ); }
 
 	void SetIdleSpeed( void );
 	void SetWalkSpeed( void );
 	void SetJogSpeed( void );
 
+	float GetSpeedScale( void );			//The fraction of the body's speed it moves at
+
+	//Snapshots (see snapshot.h) - the goal, the arrival and the locomotion model. A
+	//followed object may be restored later, so ResumeFollowing is called once it is.
+	void Save( SnapshotWriter & writer );
+	void Restore( SnapshotReader & reader );
+	void ResumeFollowing( void );
+
 protected:
 
 	GameObject* m_owner;
 
-	D3DXVECTOR3 m_target;
+	Vector3* m_target;			//In the BodyStore if the body is stored, otherwise m_localTarget
+	Vector3 m_localTarget;
+	bool m_integratedByStore;	//Position and facing are done by BodyStore::Integrate
+	bool m_arrivalPending;		//When not integrated by the store (otherwise it's in the store)
+	objectID m_followID;		//Followed object (0 if none) when the store doesn't do the following
 	float m_speedWalk;
 	float m_speedJog;
+	float m_speedScale;			//Locomotion model (when there's no animated model)
+
+	void SetArrivalPending( bool pending );
+	void StopFollowing( void );
+	void UpdateFollowTarget( void );
+
+	bool HasModel( void );
+	void StartMoving( void );
+	void UpdateModel( bool idle );
 
 };
\ No newline at end of file
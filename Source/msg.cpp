@@ -10,6 +10,34 @@
 
 #include "DXUT.h"
 #include "msg.h"
+#include "msgpayload.h"
+
+
+//Coalescing rule of each message name, from msgnames.h
+#define REGISTER_MESSAGE_NAME(x) COALESCE_NONE,
+#define REGISTER_MESSAGE_NAME_COALESCED(x, rule) rule,
+static const Coalesce_Rule MessageCoalesceRule[] =
+{
+	#include "msgnames.h"
+	COALESCE_NONE
+};
+#undef REGISTER_MESSAGE_NAME
+#undef REGISTER_MESSAGE_NAME_COALESCED
+
+/*---------------------------------------------------------------------------*
+  Name:         GetMsgCoalesceRule
+
+  Description:  Returns how redundant delayed messages of a name are folded.
+
+  Arguments:    name : the message name
+
+  Returns:      The coalescing rule.
+ *---------------------------------------------------------------------------*/
+Coalesce_Rule GetMsgCoalesceRule( MSG_Name name )
+{
+	return( MessageCoalesceRule[name] );
+}
+
 
 bool MSG_Data::operator== (MSG_Data& a)
 {
@@ -31,14 +59,17 @@ bool MSG_Data::operator== (MSG_Data& a)
 				return( m_data.pointerValue == a.GetPointer() );
 			case MSG_DATA_VECTOR2:
 				{
-					D3DXVECTOR2 vec2 = a.GetVector2();
-					return( m_data.x == vec2.x && y == vec2.y );
+					Vector2 vec2 = a.GetVector2();
+					return( m_data.vector2Value[0] == vec2.x && m_data.vector2Value[1] == vec2.y );
 				}
 			case MSG_DATA_VECTOR3:
 				{
-					D3DXVECTOR3 vec3 = a.GetVector3();
-					return( m_data.x == vec3.x && y == vec3.y && z == vec3.z );
+					Vector3 vec = GetVector3();
+					Vector3 vec3 = a.GetVector3();
+					return( vec.x == vec3.x && vec.y == vec3.y && vec.z == vec3.z );
 				}
+			case MSG_DATA_PAYLOAD:
+				return( m_data.payloadValue->IsEqual( *a.GetPayload() ) );
 			default:
 				ASSERTMSG( 0, "Unknown type" );
 				return false;
@@ -50,23 +81,86 @@ bool MSG_Data::operator== (MSG_Data& a)
 	}
 }
 
+static unsigned int HashFloat( float value )
+{	//Equal floats must hash the same (0.0f and -0.0f compare equal)
+	if( value == 0.0f ) {
+		return( 0 );
+	}
+	union { float f; unsigned int i; } bits;
+	bits.f = value;
+	return( bits.i );
+}
+
+unsigned int MSG_Data::GetHash( void )
+{
+	unsigned int hash = (unsigned int)m_valueType * 2654435761u;
+
+	switch( m_valueType )
+	{
+		case MSG_DATA_INT:
+			return( hash ^ (unsigned int)m_data.intValue );
+		case MSG_DATA_FLOAT:
+			return( hash ^ HashFloat( m_data.floatValue ) );
+		case MSG_DATA_BOOL:
+			return( hash ^ ( m_data.boolValue ? 1 : 0 ) );
+		case MSG_DATA_OBJECTID:
+			return( hash ^ (unsigned int)m_data.objectIDValue );
+		case MSG_DATA_POINTER:
+			return( hash ^ (unsigned int)(size_t)m_data.pointerValue );
+		case MSG_DATA_VECTOR2:
+			return( hash ^ HashFloat( m_data.vector2Value[0] ) ^ ( HashFloat( m_data.vector2Value[1] ) * 31 ) );
+		case MSG_DATA_VECTOR3:
+			{
+				Vector3 vec = GetVector3();
+				return( hash ^ HashFloat( vec.x ) ^ ( HashFloat( vec.y ) * 31 ) ^ ( HashFloat( vec.z ) * 961 ) );
+			}
+		case MSG_DATA_PAYLOAD:
+			return( hash ^ m_data.payloadValue->GetHash() );
+		default:
+			return( hash );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetVector3
+
+  Description:  Reads a Vector3, which is kept out of line.
+
+  Arguments:    None.
+
+  Returns:      The vector.
+ *---------------------------------------------------------------------------*/
+Vector3 MSG_Data::GetVector3( void )
+{
+	ASSERTMSG( m_valueType == MSG_DATA_VECTOR3, "Message data not of correct type" );
+	return( *(Vector3*)m_data.payloadValue->GetData() );
+}
+
 MSG_Object::MSG_Object( void )
-: m_name( MSG_NULL ),
+: m_deliveryTime( 0.0 ),
   m_sender( INVALID_OBJECT_ID ),
   m_receiver( INVALID_OBJECT_ID ),
-  m_scopeRule( SCOPE_TO_STATE_MACHINE ),
   m_scope( 0 ),
+  m_schedulerIndex( 0 ),
+  m_sendSequence( 0 ),
+  m_period( 0.0f ),
+  m_name( MSG_NULL ),
   m_queue( 0 ),
-  m_deliveryTime( 0.0f ),
+  m_scopeRule( SCOPE_TO_STATE_MACHINE ),
   m_delivered( false ),
   m_timer( 0 ),
-  m_cc( false )
+  m_cc( false ),
+  m_priority( 0 ),
+  m_batched( false ),
+  m_queuedNextFrame( false ),
+  m_receiverPrev( 0 ),
+  m_receiverNext( 0 )
 {
 
 }
 
 
-MSG_Object::MSG_Object( float deliveryTime, MSG_Name name,
+MSG_Object::MSG_Object( double deliveryTime, MSG_Name name,
                         objectID sender, objectID receiver,
                         Scope_Rule rule, unsigned int scope,
                         unsigned int queue, MSG_Data& data, 
@@ -82,6 +176,14 @@ MSG_Object::MSG_Object( float deliveryTime, MSG_Name name,
 	SetDelivered( false );
 	SetTimer( timer );
 	SetCC( cc );
+	SetPriority( 0 );
+	SetBatched( false );
+	SetQueuedNextFrame( false );
+	SetSchedulerIndex( 0 );
+	SetSendSequence( 0 );
+	SetPeriod( 0.0f );
+	SetReceiverPrev( 0 );
+	SetReceiverNext( 0 );
 	m_data = data;
 }
 
@@ -12,17 +12,42 @@
 #pragma once
 
 #include "global.h"
+#include "memtrack.h"
 
 
 //Macro trick to make message names enums
 //rom the file msgnames.h
 #define REGISTER_MESSAGE_NAME(x) x,
+#define REGISTER_MESSAGE_NAME_COALESCED(x, rule) x,
 typedef enum
 {
 	#include "msgnames.h"
 	MSG_NUM
 } MSG_Name;
 #undef REGISTER_MESSAGE_NAME
+#undef REGISTER_MESSAGE_NAME_COALESCED
+
+
+//Delayed messages can be coalesced per message name (declared with
+//REGISTER_MESSAGE_NAME_COALESCED in msgnames.h). A coalesced message that is
+//sent while an equivalent one is pending (same receiver, sender, scope, 
+//queue and timer flag - the data may differ) is folded into the pending one
+//in O(1) instead of being queued:
+//COALESCE_FIRST_WINS  - the new message is dropped
+//COALESCE_LATEST_WINS - the pending message takes the new data and delay
+//COALESCE_COUNT       - the pending message keeps its delay, and its data is
+//                       the (int) number of sends it stands for
+//Without a rule (COALESCE_NONE) only an identical pending message (same
+//data too) is redundant, which asserts.
+//
+enum Coalesce_Rule {
+	COALESCE_NONE,
+	COALESCE_FIRST_WINS,
+	COALESCE_LATEST_WINS,
+	COALESCE_COUNT
+};
+
+Coalesce_Rule GetMsgCoalesceRule( MSG_Name name );
 
 
 //Delayed messages can be scoped with the following enum.
@@ -45,7 +70,15 @@ enum Scope_Rule {
 
 #define NEXT_FRAME 0.0001f
 
+struct MsgPayload;	//Variable size data (msgpayload.h)
+
+//Creates a payload in the frame arena of the MsgRoute (defined in msgroute.cpp)
+MsgPayload * CreateMsgPayload( const void * data, unsigned int elementSize, unsigned int count, const char * type );
 
+
+//Message data is kept to 8 bytes plus the type, since every pending delayed
+//message carries one. Data that doesn't fit (a Vector3 or a payload) is kept
+//out of line, in the frame arena or the MsgPool (see msgpayload.h).
 union MSG_Data_Union
 {
 	int intValue;
@@ -53,7 +86,8 @@ union MSG_Data_Union
 	bool boolValue;
 	objectID objectIDValue;
 	void* pointerValue;
-	float x;
+	MsgPayload* payloadValue;		//Payloads and Vector3s
+	float vector2Value[2];
 };
 
 enum MSG_Data_Value
@@ -65,7 +99,8 @@ enum MSG_Data_Value
 	MSG_DATA_OBJECTID,
 	MSG_DATA_POINTER,
 	MSG_DATA_VECTOR2,
-	MSG_DATA_VECTOR3
+	MSG_DATA_VECTOR3,
+	MSG_DATA_PAYLOAD
 };
 	
 class MSG_Data
@@ -77,8 +112,9 @@ public:
 	MSG_Data( bool data )						{ m_data.boolValue = data; m_valueType = MSG_DATA_BOOL; }
 	MSG_Data( objectID data )					{ m_data.objectIDValue = data; m_valueType = MSG_DATA_OBJECTID; }
 	MSG_Data( void* data )						{ m_data.pointerValue = data; m_valueType = MSG_DATA_POINTER; }
-	MSG_Data( D3DXVECTOR2 data )				{ m_data.x = data.x; y = data.y; m_valueType = MSG_DATA_VECTOR2; }
-	MSG_Data( D3DXVECTOR3 data )				{ m_data.x = data.x; y = data.y; z = data.z; m_valueType = MSG_DATA_VECTOR3; }
+	MSG_Data( Vector2 data )				{ m_data.vector2Value[0] = data.x; m_data.vector2Value[1] = data.y; m_valueType = MSG_DATA_VECTOR2; }
+	MSG_Data( Vector3 data )				{ m_data.payloadValue = CreateMsgPayload( &data, sizeof( Vector3 ), 1, "Vector3" ); m_valueType = MSG_DATA_VECTOR3; }
+	explicit MSG_Data( MsgPayload* data )		{ m_data.payloadValue = data; m_valueType = MSG_DATA_PAYLOAD; }	//See MakeMsgPayload
 
 	~MSG_Data()	{}
 
@@ -90,6 +126,8 @@ public:
 	inline bool IsPointer( void )				{ return( m_valueType == MSG_DATA_POINTER ); }
 	inline bool IsVector2( void )				{ return( m_valueType == MSG_DATA_VECTOR2 ); }
 	inline bool IsVector3( void )				{ return( m_valueType == MSG_DATA_VECTOR3 ); }
+	inline bool IsPayload( void )				{ return( m_valueType == MSG_DATA_PAYLOAD ); }
+	inline bool IsOutOfLine( void )				{ return( m_valueType == MSG_DATA_VECTOR3 || m_valueType == MSG_DATA_PAYLOAD ); }
 
 	inline MSG_Data_Value GetType( void )		{ return( m_valueType ); }
 
@@ -99,16 +137,21 @@ public:
 	inline bool GetBool( void )					{ ASSERTMSG( m_valueType == MSG_DATA_BOOL, "Message data not of correct type" ); return( m_data.boolValue ); }
 	inline objectID GetObjectID( void )			{ ASSERTMSG( m_valueType == MSG_DATA_OBJECTID, "Message data not of correct type" ); return( m_data.objectIDValue ); }
 	inline void* GetPointer( void )				{ ASSERTMSG( m_valueType == MSG_DATA_POINTER, "Message data not of correct type" ); return( m_data.pointerValue ); }
-	inline D3DXVECTOR2 GetVector2( void )		{ ASSERTMSG( m_valueType == MSG_DATA_VECTOR2, "Message data not of correct type" ); D3DXVECTOR2 v; v.x = m_data.x; v.y = y; return( v ); }
-	inline D3DXVECTOR3 GetVector3( void )		{ ASSERTMSG( m_valueType == MSG_DATA_VECTOR3, "Message data not of correct type" ); D3DXVECTOR3 v; v.x = m_data.x; v.y = y; v.z = z; return( v ); }
+	inline Vector2 GetVector2( void )		{ ASSERTMSG( m_valueType == MSG_DATA_VECTOR2, "Message data not of correct type" ); Vector2 v; v.x = m_data.vector2Value[0]; v.y = m_data.vector2Value[1]; return( v ); }
+	Vector3 GetVector3( void );
+	inline MsgPayload* GetPayload( void )		{ ASSERTMSG( m_valueType == MSG_DATA_PAYLOAD, "Message data not of correct type" ); return( m_data.payloadValue ); }
+
+	//Only to be used by the MsgPool (moves out of line data into pooled memory)
+	inline MsgPayload* GetOutOfLine( void )		{ ASSERTMSG( IsOutOfLine(), "Message data not of correct type" ); return( m_data.payloadValue ); }
+	inline void SetOutOfLine( MsgPayload* data )	{ ASSERTMSG( IsOutOfLine(), "Message data not of correct type" ); m_data.payloadValue = data; }
 
 	bool operator== (MSG_Data& a);
+	unsigned int GetHash( void );	//Consistent with operator==
 	//bool operator!= (MSG_Data& a)				{ return( !(this == a) ); }
 
 private:
-	MSG_Data_Value m_valueType;
 	MSG_Data_Union m_data;
-	float y, z;	//For 2D and 3D vectors
+	MSG_Data_Value m_valueType;
 };
 
 
@@ -116,8 +159,10 @@ class MSG_Object
 {
 public:
 
+	DeclareMemoryTag( MEMORY_TAG_MSG )
+
 	MSG_Object( void );
-	MSG_Object( float deliveryTime, MSG_Name name, 
+	MSG_Object( double deliveryTime, MSG_Name name, 
 	            objectID sender, objectID receiver, 
 	            Scope_Rule rule, unsigned int scope, 
 				unsigned int queue, MSG_Data& data, 
@@ -125,8 +170,8 @@ public:
 	            
 	~MSG_Object( void ) {}
 
-	inline MSG_Name GetName( void )					{ return( m_name ); }
-	inline void SetName( MSG_Name name )			{ m_name = name; }
+	inline MSG_Name GetName( void )					{ return( (MSG_Name)m_name ); }
+	inline void SetName( MSG_Name name )			{ ASSERTMSG( name < ( 1 << 16 ), "MSG_Object::SetName - name out of bounds for 16 bit encoding. Change encoding if needed." ); m_name = name; }
 
 	inline objectID GetSender( void )				{ return( m_sender ); }
 	inline void SetSender( objectID sender )		{ m_sender = sender; }
@@ -141,10 +186,10 @@ public:
 	inline void SetScope( unsigned int scope )		{ m_scope = scope; }
 
 	inline unsigned int GetQueue( void )			{ return( m_queue ); }
-	inline void SetQueue( unsigned int queue )		{ ASSERTMSG( queue < 8, "MSG_Object::SetQueue - queue out of bounds for 3 bit encoding. Change encoding if needed." ); m_queue = queue; }
+	inline void SetQueue( unsigned int queue )		{ ASSERTMSG( queue < 32, "MSG_Object::SetQueue - queue out of bounds for 5 bit encoding. Change encoding if needed." ); m_queue = queue; }
 
-	inline float GetDeliveryTime( void )			{ return( m_deliveryTime ); }
-	inline void SetDeliveryTime( float time )		{ m_deliveryTime = time; }
+	inline double GetDeliveryTime( void )			{ return( m_deliveryTime ); }
+	inline void SetDeliveryTime( double time )		{ m_deliveryTime = time; }
 
 	inline bool IsDelivered( void )					{ return( m_delivered ); }
 	inline void SetDelivered( bool value )			{ m_delivered = value; }
@@ -157,6 +202,7 @@ public:
 	inline bool IsPointerData( void )				{ return( m_data.IsPointer() ); }
 	inline bool IsVector2Data( void )				{ return( m_data.IsVector2() ); }
 	inline bool IsVector3Data( void )				{ return( m_data.IsVector3() ); }
+	inline bool IsPayloadData( void )				{ return( m_data.IsPayload() ); }
 
 	inline MSG_Data_Value GetDataType( void )		{ return( m_data.GetType() ); }
 
@@ -166,30 +212,64 @@ public:
 	inline bool GetBoolData( void )					{ return( m_data.GetBool() ); }
 	inline objectID GetObjectIDData( void )			{ return( m_data.GetObjectID() ); }
 	inline void* GetPointerData( void )				{ return( m_data.GetPointer() ); }
-	inline D3DXVECTOR2 GetVector2Data( void )		{ return( m_data.GetVector2() ); }
-	inline D3DXVECTOR3 GetVector3Data( void )		{ return( m_data.GetVector3() ); }
+	inline Vector2 GetVector2Data( void )		{ return( m_data.GetVector2() ); }
+	inline Vector3 GetVector3Data( void )		{ return( m_data.GetVector3() ); }
+	inline MsgPayload* GetPayloadData( void )		{ return( m_data.GetPayload() ); }	//Only valid while handling the message
 
 	inline MSG_Data& GetMsgData( void )				{ return( m_data ); }
 
 	inline bool IsTimer( void )						{ return( m_timer ); }
 	inline void SetTimer( bool value )				{ m_timer = value; }
+	inline float GetPeriod( void )					{ return( m_period ); }		//Timers only
+	inline void SetPeriod( float period )			{ m_period = period; }
 	
 	inline bool IsCC( void )						{ return( m_cc ); }
 	inline void SetCC( bool value )					{ m_cc = value; }
+
+	//Only to be used by the delayed message scheduler
+	inline unsigned int GetSchedulerIndex( void )		{ return( m_schedulerIndex ); }
+	inline unsigned int GetPriority( void )				{ return( m_priority ); }
+	inline void SetPriority( unsigned int priority )	{ ASSERTMSG( priority < 2, "MSG_Object::SetPriority - priority out of bounds for 1 bit encoding. Change encoding if needed." ); m_priority = priority; }
+	inline void SetSchedulerIndex( unsigned int index )	{ m_schedulerIndex = index; }
+	inline unsigned int GetSendSequence( void )			{ return( m_sendSequence ); }
+	inline void SetSendSequence( unsigned int sequence )	{ m_sendSequence = sequence; }
+
+	//Only to be used by MsgRoute (taken out of the scheduler, waiting in a delivery batch)
+	inline bool IsBatched( void )						{ return( m_batched ); }
+	inline void SetBatched( bool value )				{ m_batched = value; }
+	inline bool IsQueuedNextFrame( void )				{ return( m_queuedNextFrame ); }		//Batched, but not taken for delivery yet
+	inline void SetQueuedNextFrame( bool value )		{ m_queuedNextFrame = value; }
+
+	//Only to be used by the delayed message receiver index
+	inline MSG_Object * GetReceiverPrev( void )			{ return( m_receiverPrev ); }
+	inline void SetReceiverPrev( MSG_Object * msg )		{ m_receiverPrev = msg; }
+	inline MSG_Object * GetReceiverNext( void )			{ return( m_receiverNext ); }
+	inline void SetReceiverNext( MSG_Object * msg )		{ m_receiverNext = msg; }
 	
 
 private:
 
-	MSG_Name m_name;				//Message name
+	//Ordered by size with no padding holes, since the pool keeps one of these
+	//per pending delayed message (56 bytes with 32 bit pointers, 72 with 64 bit)
+	double m_deliveryTime;			//Time at which to send the message
+	MSG_Data m_data;				//Data that is passed with the message
 	objectID m_sender;				//Object that sent the message
 	objectID m_receiver;			//Object that will get the message
-	MSG_Data m_data;				//Data that is passed with the message
-	float m_deliveryTime;			//Time at which to send the message
 	unsigned int m_scope;			//State or substate instance in which the receiver is allowed to get the message
+	unsigned int m_schedulerIndex;	//Position inside the delayed message scheduler (bookkeeping for fast removal)
+	unsigned int m_sendSequence;	//Order in which delayed messages were sent (breaks ties between priority classes)
+	float m_period;					//Seconds between deliveries of a timer (rescheduled in place)
 
-	unsigned int m_queue: 3;		//Queue index to deliver message to (only valid when sender = receiver)
+	unsigned int m_name: 16;		//Message name (MSG_Name)
+	unsigned int m_queue: 5;		//Queue index to deliver message to (only valid when sender = receiver)
 	unsigned int m_scopeRule: 2;	//Rule for how to interpret scope
 	unsigned int m_delivered: 1;	//Whether the message has been delivered
 	unsigned int m_timer: 1;		//Message is sent periodically
 	unsigned int m_cc: 1;			//Message is a carbon copy that was received by someone else
+	unsigned int m_priority: 1;		//Delivery priority class (which scheduler holds the delayed message)
+	unsigned int m_batched: 1;		//Waiting in a batched delivery (out of the scheduler, still indexed)
+	unsigned int m_queuedNextFrame: 1;	//Waiting in the next frame queue (still a duplicate of a new send)
+
+	MSG_Object * m_receiverPrev;	//Neighbors in the receiver index list of pending messages
+	MSG_Object * m_receiverNext;
 };
@@ -0,0 +1,193 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "msghashindex.h"
+
+
+#define MSG_HASH_INDEX_INITIAL_BUCKETS 64	//Must be a power of two
+
+
+/*---------------------------------------------------------------------------*
+  Name:         MsgHashIndex
+
+  Description:  Constructor
+ *---------------------------------------------------------------------------*/
+MsgHashIndex::MsgHashIndex( void )
+: m_buckets( MSG_HASH_INDEX_INITIAL_BUCKETS ),
+  m_count( 0 )
+{
+
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Insert
+
+  Description:  Adds a message to the index. Time complexity O(1).
+
+  Arguments:    msg : the message to index
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgHashIndex::Insert( MSG_Object * msg )
+{
+	if( m_count >= m_buckets.size() )
+	{	//Keep the load factor at or below one
+		Grow();
+	}
+
+	GetBucket( Hash( *msg ) ).push_back( msg );
+	m_count++;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Remove
+
+  Description:  Removes a message from the index. Time complexity O(1).
+
+  Arguments:    msg : the message to remove
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgHashIndex::Remove( MSG_Object * msg )
+{
+	Bucket & bucket = GetBucket( Hash( *msg ) );
+
+	for( Bucket::iterator i=bucket.begin(); i!=bucket.end(); ++i )
+	{
+		if( *i == msg )
+		{	//Order within a bucket doesn't matter, so swap with the last entry
+			*i = bucket.back();
+			bucket.pop_back();
+			m_count--;
+			return;
+		}
+	}
+
+	ASSERTMSG( 0, "MsgHashIndex::Remove - Message not in index" );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Clear
+
+  Description:  Removes all messages from the index.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgHashIndex::Clear( void )
+{
+	for( BucketContainer::iterator i=m_buckets.begin(); i!=m_buckets.end(); ++i )
+	{
+		i->clear();
+	}
+	m_count = 0;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Find
+
+  Description:  Finds a pending message that is identical to the one 
+                described by the arguments (apart from the data, for 
+				coalesced message names). Time complexity O(1).
+
+  Arguments:    name     : the message name
+				receiver : the ID of the receiver
+				sender   : the ID of the sender
+				rule     : the scoping rule for the message
+				scope    : the scope of the message (a state index)
+				queue    : the queue to send the message to
+				data     : a piece of data
+				timer    : if this message is a timer (sent periodically)
+				period   : the period of a timer (0 otherwise)
+
+  Returns:      The matching message or 0 if there is none.
+ *---------------------------------------------------------------------------*/
+MSG_Object * MsgHashIndex::Find( MSG_Name name, objectID receiver, objectID sender, 
+                                 Scope_Rule rule, unsigned int scope, unsigned int queue, 
+                                 MSG_Data& data, bool timer, float period )
+{
+	Bucket & bucket = GetBucket( Hash( name, receiver, sender, rule, scope, queue, data, timer ) );
+	bool anyData = GetMsgCoalesceRule( name ) != COALESCE_NONE;
+
+	for( Bucket::iterator i=bucket.begin(); i!=bucket.end(); ++i )
+	{
+		MSG_Object * msg = *i;
+		if( ( !msg->IsBatched() || msg->IsQueuedNextFrame() ) &&
+			msg->GetName() == name &&
+			msg->GetReceiver() == receiver &&
+			msg->GetSender() == sender &&
+			msg->GetScopeRule() == rule &&
+			msg->GetScope() == scope &&
+			msg->GetQueue() == queue &&
+			msg->IsTimer() == timer &&
+			msg->GetPeriod() == period &&
+			( anyData || msg->GetMsgData() == data ) )
+		{
+			return( msg );
+		}
+	}
+
+	return( 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Hash
+
+  Description:  Combines the fields that identify a duplicate message.
+
+  Arguments:    (see Find)
+
+  Returns:      The hash value.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgHashIndex::Hash( MSG_Name name, objectID receiver, objectID sender, 
+                                 Scope_Rule rule, unsigned int scope, unsigned int queue, 
+                                 MSG_Data& data, bool timer )
+{
+	//FNV-1a style mixing of each field
+	unsigned int hash = 2166136261u;
+	hash = ( hash ^ (unsigned int)name ) * 16777619u;
+	hash = ( hash ^ (unsigned int)receiver ) * 16777619u;
+	hash = ( hash ^ (unsigned int)sender ) * 16777619u;
+	hash = ( hash ^ (unsigned int)rule ) * 16777619u;
+	hash = ( hash ^ scope ) * 16777619u;
+	hash = ( hash ^ queue ) * 16777619u;
+	hash = ( hash ^ (unsigned int)timer ) * 16777619u;
+	if( GetMsgCoalesceRule( name ) == COALESCE_NONE ) {
+		hash = ( hash ^ data.GetHash() ) * 16777619u;
+	}
+
+	//Fold the high bits down since buckets are selected with a mask
+	return( hash ^ ( hash >> 16 ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Grow
+
+  Description:  Doubles the number of buckets and redistributes the messages.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgHashIndex::Grow( void )
+{
+	BucketContainer old( m_buckets.size() * 2 );
+	old.swap( m_buckets );
+
+	for( BucketContainer::iterator i=old.begin(); i!=old.end(); ++i )
+	{
+		for( Bucket::iterator j=i->begin(); j!=i->end(); ++j )
+		{
+			GetBucket( Hash( **j ) ).push_back( *j );
+		}
+	}
+}
@@ -0,0 +1,59 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "msg.h"
+#include <vector>
+
+
+//Hash index over the pending delayed messages, keyed on every field that
+//makes two delayed messages redundant (name, receiver, sender, scope rule,
+//scope, queue, timer flag and period, and data). Used by MsgRoute to detect duplicate
+//messages in O(1) instead of searching the whole scheduler. For coalesced
+//message names (see Coalesce_Rule) the data is left out of the key.
+//Messages taken out for delivery (batched) are no longer pending, so Find
+//skips them. The ones waiting in MsgRoute's next frame queue are batched too,
+//but still pending until that queue is taken for delivery, so Find sees them.
+//The index never allocates or deletes messages - ownership stays with MsgRoute.
+class MsgHashIndex
+{
+public:
+
+	MsgHashIndex( void );
+	~MsgHashIndex( void ) {}
+
+	void Insert( MSG_Object * msg );
+	void Remove( MSG_Object * msg );
+	void Clear( void );
+
+	MSG_Object * Find( MSG_Name name, objectID receiver, objectID sender, 
+	                   Scope_Rule rule, unsigned int scope, unsigned int queue, 
+	                   MSG_Data& data, bool timer, float period );
+
+	inline unsigned int GetSize( void )						{ return( m_count ); }
+
+private:
+
+	typedef std::vector<MSG_Object*> Bucket;
+	typedef std::vector<Bucket> BucketContainer;
+
+	BucketContainer m_buckets;
+	unsigned int m_count;
+
+	unsigned int Hash( MSG_Name name, objectID receiver, objectID sender, 
+	                   Scope_Rule rule, unsigned int scope, unsigned int queue, 
+	                   MSG_Data& data, bool timer );
+	inline unsigned int Hash( MSG_Object & msg )			{ return( Hash( msg.GetName(), msg.GetReceiver(), msg.GetSender(), msg.GetScopeRule(), msg.GetScope(), msg.GetQueue(), msg.GetMsgData(), msg.IsTimer() ) ); }
+	inline Bucket & GetBucket( unsigned int hash )			{ return( m_buckets[hash & ((unsigned int)m_buckets.size() - 1)] ); }
+
+	void Grow( void );
+
+};
@@ -0,0 +1,92 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "msgmailbox.h"
+
+
+
+/*---------------------------------------------------------------------------*
+  Name:         MsgMailbox
+
+  Description:  Constructor
+ *---------------------------------------------------------------------------*/
+MsgMailbox::MsgMailbox( void )
+: m_head( 0 )
+{
+
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ~MsgMailbox
+
+  Description:  Destructor. Any undrained calls are thrown away.
+ *---------------------------------------------------------------------------*/
+MsgMailbox::~MsgMailbox( void )
+{
+	DeferredMsgContainer msgs;
+	Drain( msgs );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Push
+
+  Description:  Adds a call to the mailbox. Safe to call from any thread.
+
+  Arguments:    msg : the call to add
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgMailbox::Push( DeferredMsg & msg )
+{
+	MailboxNode * node = new MailboxNode;
+	node->m_msg = msg;
+
+	MailboxNode * head;
+	do
+	{
+		head = m_head;
+		node->m_next = head;
+	}
+	while( InterlockedCompareExchangePointer( (PVOID volatile*)&m_head, node, head ) != head );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Drain
+
+  Description:  Takes every call out of the mailbox, in the order they were
+                pushed (per thread). Only the owner may call this.
+
+  Arguments:    msgs : the list to add the calls to
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgMailbox::Drain( DeferredMsgContainer & msgs )
+{
+	MailboxNode * node = (MailboxNode*)InterlockedExchangePointer( (PVOID volatile*)&m_head, 0 );
+
+	//The list is newest first, so reverse it
+	MailboxNode * reversed = 0;
+	while( node )
+	{
+		MailboxNode * next = node->m_next;
+		node->m_next = reversed;
+		reversed = node;
+		node = next;
+	}
+
+	while( reversed )
+	{
+		MailboxNode * next = reversed->m_next;
+		msgs.push_back( reversed->m_msg );
+		delete( reversed );
+		reversed = next;
+	}
+}
@@ -0,0 +1,75 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "msg.h"
+#include "vector.h"
+#include <vector>
+
+
+//MsgRoute calls that couldn't be made directly (from another thread or 
+//during a parallel update) and are replayed later on the main thread
+enum DeferredMsgCommand {
+	DEFERRED_SEND,
+	DEFERRED_BROADCAST,
+	DEFERRED_AREA_BROADCAST,
+	DEFERRED_REMOVE,
+	DEFERRED_PURGE,
+	DEFERRED_TIMER_WAKE,
+	DEFERRED_SUBSCRIBE,
+	DEFERRED_UNSUBSCRIBE,
+	DEFERRED_PUBLISH,
+	DEFERRED_SUBSCRIBE_CC,
+	DEFERRED_UNSUBSCRIBE_CC
+};
+
+struct DeferredMsg
+{
+	DeferredMsgCommand m_command;
+	unsigned int m_order;			//Update order of the object that made the call
+	float m_delay;
+	unsigned int m_broadcastType;	//Or the topic
+	Vector3 m_center;				//Area broadcasts only
+	float m_radius;
+	bool m_nextFrame;
+	MSG_Object m_msg;				//The message (or the removal criteria)
+};
+
+typedef std::vector<DeferredMsg> DeferredMsgContainer;
+
+
+//Lock-free multiple producer, single consumer mailbox. Any thread can Push,
+//only the owner (MsgRoute on the main thread) can Drain. Producers link their
+//node onto the head with a compare-and-swap, and the consumer takes the whole 
+//list with a single exchange, so there is no lock and no ABA problem.
+class MsgMailbox
+{
+public:
+
+	MsgMailbox( void );
+	~MsgMailbox( void );
+
+	void Push( DeferredMsg & msg );
+	void Drain( DeferredMsgContainer & msgs );
+
+	inline bool IsEmpty( void )						{ return( m_head == 0 ); }
+
+private:
+
+	struct MailboxNode
+	{
+		MailboxNode * m_next;
+		DeferredMsg m_msg;
+	};
+
+	MailboxNode * volatile m_head;		//Most recently pushed first
+
+};
@@ -9,9 +9,12 @@
  */
 
 //These message names are processed inside msg.h
+//Names registered with REGISTER_MESSAGE_NAME_COALESCED(name, rule) fold
+//redundant pending delayed messages (see Coalesce_Rule in msg.h)
 
 REGISTER_MESSAGE_NAME(MSG_NULL)							//Reserved message name
 REGISTER_MESSAGE_NAME(MSG_GENERIC_TIMER)				//Reserved message name
+REGISTER_MESSAGE_NAME(MSG_GENERIC_COROUTINE)			//Reserved message name
 REGISTER_MESSAGE_NAME(MSG_CHANGE_STATE_DELAYED)			//Reserved message name
 REGISTER_MESSAGE_NAME(MSG_CHANGE_SUBSTATE_DELAYED)		//Reserved message name
 
@@ -21,7 +24,7 @@ REGISTER_MESSAGE_NAME(MSG_CHANGE_SUBSTATE_DELAYED)		//Reserved message name
 //Used for Zombie and Human demo state machines
 REGISTER_MESSAGE_NAME(MSG_CheckTouch)
 REGISTER_MESSAGE_NAME(MSG_Tagged)
-REGISTER_MESSAGE_NAME(MSG_SetTargetPosition)
+REGISTER_MESSAGE_NAME_COALESCED(MSG_SetTargetPosition, COALESCE_LATEST_WINS)	//Re-armed every frame
 REGISTER_MESSAGE_NAME(MSG_Arrived)
 REGISTER_MESSAGE_NAME(MSG_Reset)
 REGISTER_MESSAGE_NAME(MSG_MouseClick)
@@ -42,3 +45,12 @@ REGISTER_MESSAGE_NAME(MSG_UnitTestPing)
 REGISTER_MESSAGE_NAME(MSG_UnitTestAck)
 REGISTER_MESSAGE_NAME(MSG_UnitTestDone)
 REGISTER_MESSAGE_NAME(MSG_UnitTestTimer)
+
+
+//Benchmark messages
+REGISTER_MESSAGE_NAME(MSG_BenchmarkPing)
+REGISTER_MESSAGE_NAME(MSG_BenchmarkPong)
+REGISTER_MESSAGE_NAME(MSG_BenchmarkTimer)
+REGISTER_MESSAGE_NAME(MSG_BenchmarkTimer2)
+REGISTER_MESSAGE_NAME(MSG_BenchmarkTimer3)
+REGISTER_MESSAGE_NAME(MSG_BenchmarkBroadcast)
@@ -0,0 +1,219 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "msgpayload.h"
+
+
+//Header size rounded up, so the data behind it is aligned for any type
+#define MSG_PAYLOAD_HEADER_SIZE ( ( sizeof( MsgPayload ) + 7 ) & ~7 )
+#define MSG_PAYLOAD_ALIGN(size) ( ( (size) + 7 ) & ~7 )
+
+static inline unsigned int GetSizeClass( unsigned int size )
+{
+	unsigned int sizeClass = 0;
+	while( ( (unsigned int)MSG_PAYLOAD_MIN_CLASS_SIZE << sizeClass ) < size ) {
+		sizeClass++;
+	}
+	return( sizeClass );
+}
+
+
+/*---------------------------------------------------------------------------*
+  Name:         IsEqual
+
+  Description:  Whether two payloads hold the same type and bytes.
+
+  Arguments:    payload : the other payload
+
+  Returns:      True if equal.
+ *---------------------------------------------------------------------------*/
+bool MsgPayload::IsEqual( MsgPayload & payload )
+{
+	return( m_size == payload.m_size &&
+			m_count == payload.m_count &&
+			strcmp( m_type, payload.m_type ) == 0 &&
+			memcmp( GetData(), payload.GetData(), m_size ) == 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetHash
+
+  Description:  Hash of the bytes (FNV-1a).
+
+  Arguments:    None.
+
+  Returns:      The hash.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgPayload::GetHash( void )
+{
+	unsigned int hash = 2166136261u;
+	const unsigned char * bytes = (const unsigned char *)GetData();
+	for( unsigned int i=0; i<m_size; ++i )
+	{
+		hash = ( hash ^ bytes[i] ) * 16777619u;
+	}
+	return( hash );
+}
+
+
+MsgPayloadArena::MsgPayloadArena( void )
+: m_chunk( 0 ),
+  m_offset( 0 ),
+  m_bytesUsed( 0 )
+{
+	InitializeCriticalSection( &m_lock );
+	m_chunks.push_back( (char*)MemoryTracker::Allocate( MSG_PAYLOAD_ARENA_CHUNK_SIZE, MEMORY_TAG_MSG ) );
+}
+
+MsgPayloadArena::~MsgPayloadArena( void )
+{
+	for( unsigned int i=0; i<m_chunks.size(); ++i )
+	{
+		MemoryTracker::Free( m_chunks[i] );
+	}
+	DeleteCriticalSection( &m_lock );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Allocate
+
+  Description:  Takes room for a payload from the current chunk, moving on
+                to the next chunk (allocated if needed) when it is full.
+
+  Arguments:    size : the bytes of data
+
+  Returns:      The payload (header not filled in).
+ *---------------------------------------------------------------------------*/
+MsgPayload * MsgPayloadArena::Allocate( unsigned int size )
+{
+	ASSERTMSG( size <= MSG_PAYLOAD_MAX_SIZE, "MsgPayloadArena::Allocate - Payload too large. Increase MSG_PAYLOAD_MAX_SIZE if needed." );
+	unsigned int bytes = MSG_PAYLOAD_HEADER_SIZE + MSG_PAYLOAD_ALIGN( size );
+
+	EnterCriticalSection( &m_lock );
+	if( m_offset + bytes > MSG_PAYLOAD_ARENA_CHUNK_SIZE )
+	{
+		m_chunk++;
+		m_offset = 0;
+		if( m_chunk == m_chunks.size() ) {
+			m_chunks.push_back( (char*)MemoryTracker::Allocate( MSG_PAYLOAD_ARENA_CHUNK_SIZE, MEMORY_TAG_MSG ) );
+		}
+	}
+	MsgPayload * payload = (MsgPayload*)( m_chunks[m_chunk] + m_offset );
+	m_offset += bytes;
+	m_bytesUsed += bytes;
+	LeaveCriticalSection( &m_lock );
+
+	return( payload );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Reset
+
+  Description:  Recycles every payload in the arena (the chunks are kept).
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgPayloadArena::Reset( void )
+{
+	EnterCriticalSection( &m_lock );
+	m_chunk = 0;
+	m_offset = 0;
+	m_bytesUsed = 0;
+	LeaveCriticalSection( &m_lock );
+}
+
+
+MsgPayloadPool::MsgPayloadPool( void )
+: m_numInUse( 0 ),
+  m_bytesAllocated( 0 )
+{
+	COMPILE_TIME_ASSERT( ( MSG_PAYLOAD_MIN_CLASS_SIZE << ( MSG_PAYLOAD_NUM_CLASSES - 1 ) ) == MSG_PAYLOAD_MAX_SIZE, payload_size_classes_must_reach_the_max_size );
+}
+
+MsgPayloadPool::~MsgPayloadPool( void )
+{
+	ASSERTMSG( m_numInUse == 0, "MsgPayloadPool::~MsgPayloadPool - Payloads still in use" );
+
+	for( unsigned int i=0; i<m_blocks.size(); ++i )
+	{
+		MemoryTracker::Free( m_blocks[i] );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Copy
+
+  Description:  Copies a payload into the pool.
+
+  Arguments:    payload : the payload (for example in the frame arena)
+
+  Returns:      The pooled copy.
+ *---------------------------------------------------------------------------*/
+MsgPayload * MsgPayloadPool::Copy( MsgPayload & payload )
+{
+	unsigned int sizeClass = GetSizeClass( payload.m_size );
+	if( m_free[sizeClass].empty() ) {
+		AllocateBlock( sizeClass );
+	}
+
+	MsgPayload * copy = m_free[sizeClass].back();
+	m_free[sizeClass].pop_back();
+	m_numInUse++;
+
+	copy->m_type = payload.m_type;
+	copy->m_size = payload.m_size;
+	copy->m_count = payload.m_count;
+	copy->m_class = sizeClass;
+	memcpy( copy->GetData(), payload.GetData(), payload.m_size );
+	return( copy );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Release
+
+  Description:  Returns a payload to its size class.
+
+  Arguments:    payload : the payload (must have come from Copy)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgPayloadPool::Release( MsgPayload * payload )
+{
+	ASSERTMSG( payload->m_class < MSG_PAYLOAD_NUM_CLASSES, "MsgPayloadPool::Release - Payload isn't pooled" );
+
+	m_free[payload->m_class].push_back( payload );
+	m_numInUse--;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AllocateBlock
+
+  Description:  Allocates another block of payloads of a size class and adds
+                them to its free list.
+
+  Arguments:    sizeClass : the size class
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgPayloadPool::AllocateBlock( unsigned int sizeClass )
+{
+	unsigned int stride = MSG_PAYLOAD_HEADER_SIZE + ( MSG_PAYLOAD_MIN_CLASS_SIZE << sizeClass );
+	char * block = (char*)MemoryTracker::Allocate( stride * MSG_PAYLOAD_POOL_BLOCK_SIZE, MEMORY_TAG_MSG );
+	m_blocks.push_back( block );
+	m_bytesAllocated += stride * MSG_PAYLOAD_POOL_BLOCK_SIZE;
+
+	for( int i=MSG_PAYLOAD_POOL_BLOCK_SIZE-1; i>=0; i-- )
+	{	//Reverse order so payloads are handed out in address order
+		m_free[sizeClass].push_back( (MsgPayload*)( block + i * stride ) );
+	}
+}
@@ -0,0 +1,121 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "msg.h"
+#include <vector>
+#include <typeinfo>
+#include <string.h>
+
+
+#define MSG_PAYLOAD_MAX_SIZE (512)				//Largest payload (bytes, without the header)
+#define MSG_PAYLOAD_MIN_CLASS_SIZE (16)			//Smallest pooled size class (bytes)
+#define MSG_PAYLOAD_NUM_CLASSES (6)				//16, 32, 64, 128, 256 and 512 bytes
+#define MSG_PAYLOAD_POOL_BLOCK_SIZE (64)		//Payloads allocated at a time when a size class runs dry
+#define MSG_PAYLOAD_ARENA_CHUNK_SIZE (64*1024)	//Bytes allocated at a time when the frame arena runs out
+#define MSG_PAYLOAD_FRAME_CLASS (0xFFFFFFFF)	//Size class of the payloads in the frame arena
+
+
+//Variable size message data (a plain struct or an array of them), copied in
+//behind this header. Payloads are owned by the message system:
+//- Sending creates the payload in the frame arena, which is recycled at the
+//  start of the next message delivery (immediate messages are handled by then).
+//- Delayed messages copy their payload into the MsgPool's payload pool, and it
+//  is released with the message once delivered (or removed).
+//So a payload is only valid while its message is being handled. Only types
+//that can be copied with memcpy (no pointers to owned memory) can be sent.
+struct MsgPayload
+{
+	const char * m_type;		//Element type name (from RTTI), for checking the type when reading
+	unsigned int m_size;		//Bytes of data after the header
+	unsigned int m_count;		//Number of elements
+	unsigned int m_class;		//Pool size class, or MSG_PAYLOAD_FRAME_CLASS
+
+	inline void * GetData( void )					{ return( this + 1 ); }
+
+	template <class T> inline T & Get( void )		{ ASSERTMSG( IsType<T>() && m_count == 1, "MsgPayload::Get - Payload is not of this type" ); return( *(T*)GetData() ); }
+	template <class T> inline T * GetArray( void )	{ ASSERTMSG( IsType<T>(), "MsgPayload::GetArray - Payload is not of this type" ); return( (T*)GetData() ); }
+	inline unsigned int GetCount( void )			{ return( m_count ); }
+	template <class T> inline bool IsType( void )	{ return( strcmp( m_type, typeid( T ).name() ) == 0 ); }
+
+	bool IsEqual( MsgPayload & payload );
+	unsigned int GetHash( void );	//Consistent with IsEqual
+};
+
+
+//Per frame bump allocator for the payloads of messages being sent. Chunks are
+//kept when the arena is reset, so in steady state there is no allocation.
+//Allocating is thread safe (messages are sent from job threads too).
+class MsgPayloadArena
+{
+public:
+
+	MsgPayloadArena( void );
+	~MsgPayloadArena( void );
+
+	MsgPayload * Allocate( unsigned int size );
+	void Reset( void );			//Main thread, when no payload in the arena is referenced
+
+	inline unsigned int GetBytesUsed( void )		{ return( m_bytesUsed ); }		//Since the last reset
+
+private:
+
+	std::vector<char*> m_chunks;
+	unsigned int m_chunk;		//Chunk being allocated from
+	unsigned int m_offset;		//Next free byte in that chunk
+	unsigned int m_bytesUsed;
+	CRITICAL_SECTION m_lock;
+
+};
+
+
+//Size class free lists for the payloads of pending delayed messages (main
+//thread only, like the MsgPool it belongs to)
+class MsgPayloadPool
+{
+public:
+
+	MsgPayloadPool( void );
+	~MsgPayloadPool( void );
+
+	MsgPayload * Copy( MsgPayload & payload );
+	void Release( MsgPayload * payload );
+
+	inline unsigned int GetNumInUse( void )			{ return( m_numInUse ); }
+	inline unsigned int GetBytesAllocated( void )	{ return( m_bytesAllocated ); }
+
+private:
+
+	std::vector<char*> m_blocks;
+	std::vector<MsgPayload*> m_free[MSG_PAYLOAD_NUM_CLASSES];
+	unsigned int m_numInUse;
+	unsigned int m_bytesAllocated;
+
+	void AllocateBlock( unsigned int sizeClass );
+
+};
+
+
+//Message data holding a copy of a value, for example:
+//  HitInfo hit = { damage, direction };
+//  MSG_Data data = MakeMsgPayload( hit );
+//  SendMsg( MSG_Hit, target, data );
+//and when handling it: msg->GetPayloadData()->Get<HitInfo>()
+template <class T> inline MSG_Data MakeMsgPayload( const T & value )
+{
+	return( MSG_Data( CreateMsgPayload( &value, sizeof( T ), 1, typeid( T ).name() ) ) );
+}
+
+//Message data holding a copy of an array (read with GetArray<T>() and GetCount())
+template <class T> inline MSG_Data MakeMsgPayloadArray( const T * values, unsigned int count )
+{
+	return( MSG_Data( CreateMsgPayload( values, sizeof( T ), count, typeid( T ).name() ) ) );
+}
@@ -0,0 +1,143 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "msgpool.h"
+
+
+
+/*---------------------------------------------------------------------------*
+  Name:         MsgPool
+
+  Description:  Constructor
+ *---------------------------------------------------------------------------*/
+MsgPool::MsgPool( void )
+: m_numInUse( 0 ),
+  m_highWaterMark( 0 )
+{
+	AllocateBlock();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ~MsgPool
+
+  Description:  Destructor
+ *---------------------------------------------------------------------------*/
+MsgPool::~MsgPool( void )
+{
+	ASSERTMSG( m_numInUse == 0, "MsgPool::~MsgPool - Messages still in use" );
+
+	for( MsgPointerContainer::iterator i=m_blocks.begin(); i!=m_blocks.end(); ++i )
+	{
+		delete[] *i;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Acquire
+
+  Description:  Takes a message from the pool and initializes it. The pool
+                only grows when every message is in use. Out of line data
+				is copied, since the sent one only lives until the next frame.
+
+  Arguments:    (same as the MSG_Object constructor)
+
+  Returns:      The message.
+ *---------------------------------------------------------------------------*/
+MSG_Object * MsgPool::Acquire( double deliveryTime, MSG_Name name, 
+                               objectID sender, objectID receiver, 
+                               Scope_Rule rule, unsigned int scope, 
+                               unsigned int queue, MSG_Data& data, 
+                               bool timer, bool cc )
+{
+	if( m_free.empty() ) {
+		AllocateBlock();
+	}
+
+	MSG_Object * msg = m_free.back();
+	m_free.pop_back();
+
+	MSG_Data none;
+	*msg = MSG_Object( deliveryTime, name, sender, receiver, rule, scope, queue, none, timer, cc );
+	SetData( msg, data );
+
+	m_numInUse++;
+	if( m_numInUse > m_highWaterMark ) {
+		m_highWaterMark = m_numInUse;
+	}
+
+	return( msg );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Release
+
+  Description:  Returns a message to the pool.
+
+  Arguments:    msg : the message (must have come from Acquire)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgPool::Release( MSG_Object * msg )
+{
+	ASSERTMSG( m_numInUse > 0, "MsgPool::Release - More messages released than acquired" );
+
+	if( msg->GetMsgData().IsOutOfLine() ) {
+		m_payloadPool.Release( msg->GetMsgData().GetOutOfLine() );
+	}
+
+	m_free.push_back( msg );
+	m_numInUse--;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetData
+
+  Description:  Replaces the data of an acquired message. Out of line data
+                is copied into the payload pool (and the old copy released).
+
+  Arguments:    msg  : the message (must have come from Acquire)
+                data : the new data
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgPool::SetData( MSG_Object * msg, MSG_Data& data )
+{
+	if( msg->GetMsgData().IsOutOfLine() ) {
+		m_payloadPool.Release( msg->GetMsgData().GetOutOfLine() );
+	}
+
+	msg->GetMsgData() = data;
+	if( data.IsOutOfLine() ) {
+		msg->GetMsgData().SetOutOfLine( m_payloadPool.Copy( *data.GetOutOfLine() ) );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AllocateBlock
+
+  Description:  Allocates another block of messages and adds them to the
+                free list.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgPool::AllocateBlock( void )
+{
+	MSG_Object * block = new MSG_Object[MSG_POOL_BLOCK_SIZE];
+	m_blocks.push_back( block );
+
+	m_free.reserve( GetCapacity() );
+	for( int i=MSG_POOL_BLOCK_SIZE-1; i>=0; i-- )
+	{	//Reverse order so messages are handed out in address order
+		m_free.push_back( &block[i] );
+	}
+}
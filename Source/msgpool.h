@@ -0,0 +1,61 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "msg.h"
+#include "msgpayload.h"
+#include <vector>
+
+
+#define MSG_POOL_BLOCK_SIZE 256		//Messages allocated at a time when the pool runs dry
+
+
+//Free-list pool of MSG_Objects for the delayed message path. Messages are
+//allocated in blocks and recycled, so in steady state (once the high-water 
+//mark has been reached) sending and delivering delayed messages never 
+//touches the global heap. Payloads (msgpayload.h) of the messages are copied
+//out of the frame arena into a size class pool, which recycles them the same way.
+class MsgPool
+{
+public:
+
+	MsgPool( void );
+	~MsgPool( void );
+
+	MSG_Object * Acquire( double deliveryTime, MSG_Name name, 
+	                      objectID sender, objectID receiver, 
+	                      Scope_Rule rule, unsigned int scope, 
+	                      unsigned int queue, MSG_Data& data, 
+	                      bool timer, bool cc );
+	void Release( MSG_Object * msg );
+	void SetData( MSG_Object * msg, MSG_Data& data );	//Replaces the data of an acquired message
+
+	//Stats
+	inline unsigned int GetNumInUse( void )					{ return( m_numInUse ); }
+	inline unsigned int GetHighWaterMark( void )			{ return( m_highWaterMark ); }
+	inline unsigned int GetCapacity( void )					{ return( (unsigned int)m_blocks.size() * MSG_POOL_BLOCK_SIZE ); }
+	inline unsigned int GetNumPayloadsInUse( void )			{ return( m_payloadPool.GetNumInUse() ); }
+	inline unsigned int GetBytesAllocated( void )			{ return( GetCapacity() * sizeof( MSG_Object ) + m_payloadPool.GetBytesAllocated() ); }
+
+private:
+
+	typedef std::vector<MSG_Object*> MsgPointerContainer;
+
+	MsgPointerContainer m_blocks;		//Each entry is an array of MSG_POOL_BLOCK_SIZE messages
+	MsgPointerContainer m_free;
+	MsgPayloadPool m_payloadPool;
+
+	unsigned int m_numInUse;
+	unsigned int m_highWaterMark;
+
+	void AllocateBlock( void );
+
+};
@@ -0,0 +1,418 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "msgreceiverindex.h"
+#include "database.h"
+
+
+
+/*---------------------------------------------------------------------------*
+  Name:         FindLists
+
+  Description:  Looks up the pooled lists of a receiver.
+                Time complexity O(1) unless the receiver's slot collides.
+
+  Arguments:    receiver : the receiver ID
+
+  Returns:      The index into m_lists, or MSG_RECEIVER_INDEX_NO_LISTS if the
+                receiver has nothing pending.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgReceiverIndex::FindLists( objectID receiver )
+{
+	unsigned int slot = receiver & OBJECT_ID_INDEX_MASK;
+	if( slot < m_slots.size() && 
+		m_slots[slot].m_lists != MSG_RECEIVER_INDEX_NO_LISTS &&
+		m_slots[slot].m_receiver == receiver )
+	{
+		return( m_slots[slot].m_lists );
+	}
+
+	if( !m_collisions.empty() )
+	{
+		CollisionContainer::iterator i = m_collisions.find( receiver );
+		if( i != m_collisions.end() ) {
+			return( i->second );
+		}
+	}
+	return( MSG_RECEIVER_INDEX_NO_LISTS );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AcquireLists
+
+  Description:  Takes empty lists from the pool for a receiver that had 
+                nothing pending. Only allocates while the pool or slots are
+				still growing, or when an older generation of the receiver 
+				still holds its slot.
+
+  Arguments:    receiver : the receiver ID
+
+  Returns:      The index into m_lists.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgReceiverIndex::AcquireLists( objectID receiver )
+{
+	unsigned int index;
+	if( m_freeLists.empty() )
+	{
+		index = static_cast<unsigned int>( m_lists.size() );
+		m_lists.push_back( ReceiverLists() );
+	}
+	else
+	{
+		index = m_freeLists.back();
+		m_freeLists.pop_back();
+	}
+
+	ReceiverLists & lists = m_lists[index];
+	for( unsigned int q=0; q<MSG_RECEIVER_INDEX_QUEUES; q++ )
+	{
+		lists.m_head[q] = 0;
+		for( unsigned int r=0; r<MSG_RECEIVER_INDEX_SCOPES; r++ )
+		{
+			lists.m_scopes[q][r].m_scope = MSG_RECEIVER_INDEX_NO_SCOPE;
+			lists.m_scopes[q][r].m_count = 0;
+		}
+	}
+	lists.m_count = 0;
+	lists.m_receiver = receiver;
+
+	unsigned int slot = receiver & OBJECT_ID_INDEX_MASK;
+	if( slot >= m_slots.size() )
+	{
+		ReceiverSlot empty;
+		empty.m_receiver = INVALID_OBJECT_ID;
+		empty.m_lists = MSG_RECEIVER_INDEX_NO_LISTS;
+		m_slots.resize( slot + 1, empty );
+	}
+
+	if( m_slots[slot].m_lists == MSG_RECEIVER_INDEX_NO_LISTS )
+	{
+		m_slots[slot].m_receiver = receiver;
+		m_slots[slot].m_lists = index;
+	}
+	else
+	{	//A destroyed object that reused this slot still has messages pending
+		m_collisions[receiver] = index;
+	}
+	return( index );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReleaseLists
+
+  Description:  Returns the lists of a receiver with nothing left pending to
+                the pool.
+
+  Arguments:    index : the index into m_lists
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::ReleaseLists( unsigned int index )
+{
+	objectID receiver = m_lists[index].m_receiver;
+	unsigned int slot = receiver & OBJECT_ID_INDEX_MASK;
+	if( slot < m_slots.size() && m_slots[slot].m_lists == index ) {
+		m_slots[slot].m_lists = MSG_RECEIVER_INDEX_NO_LISTS;
+	}
+	else {
+		m_collisions.erase( receiver );
+	}
+	m_lists[index].m_receiver = INVALID_OBJECT_ID;
+	m_freeLists.push_back( index );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Clear
+
+  Description:  Drops every list (the messages themselves are untouched).
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::Clear( void )
+{
+	m_slots.clear();
+	m_lists.clear();
+	m_freeLists.clear();
+	m_collisions.clear();
+	m_numStale = 0;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Insert
+
+  Description:  Links a message into the list for its receiver and queue.
+
+  Arguments:    msg : the message to index
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::Insert( MSG_Object * msg )
+{
+	unsigned int index = FindLists( msg->GetReceiver() );
+	if( index == MSG_RECEIVER_INDEX_NO_LISTS )
+	{	//First pending message for this receiver
+		index = AcquireLists( msg->GetReceiver() );
+	}
+	ReceiverLists & lists = m_lists[index];
+
+	MSG_Object * & head = lists.m_head[msg->GetQueue()];
+	msg->SetReceiverPrev( 0 );
+	msg->SetReceiverNext( head );
+	if( head ) {
+		head->SetReceiverPrev( msg );
+	}
+	head = msg;
+	lists.m_count++;
+
+	if( msg->GetScopeRule() != SCOPE_TO_STATE_MACHINE )
+	{
+		ScopeCount & scope = lists.m_scopes[msg->GetQueue()][msg->GetScopeRule()];
+		if( scope.m_scope != msg->GetScope() )
+		{	//The receiver has moved on to a new scope, so the old one's messages are stale
+			m_numStale += scope.m_count;
+			scope.m_scope = msg->GetScope();
+			scope.m_count = 0;
+		}
+		scope.m_count++;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Remove
+
+  Description:  Unlinks a message from the list for its receiver and queue.
+                Time complexity O(1).
+
+  Arguments:    msg : the message to remove
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::Remove( MSG_Object * msg )
+{
+	unsigned int index = FindLists( msg->GetReceiver() );
+	if( index == MSG_RECEIVER_INDEX_NO_LISTS )
+	{
+		ASSERTMSG( 0, "MsgReceiverIndex::Remove - Message not in index" );
+		return;
+	}
+	ReceiverLists & lists = m_lists[index];
+
+	MSG_Object * prev = msg->GetReceiverPrev();
+	MSG_Object * next = msg->GetReceiverNext();
+	if( prev ) {
+		prev->SetReceiverNext( next );
+	}
+	else {
+		lists.m_head[msg->GetQueue()] = next;
+	}
+	if( next ) {
+		next->SetReceiverPrev( prev );
+	}
+	msg->SetReceiverPrev( 0 );
+	msg->SetReceiverNext( 0 );
+
+	if( msg->GetScopeRule() != SCOPE_TO_STATE_MACHINE )
+	{
+		ScopeCount & scope = lists.m_scopes[msg->GetQueue()][msg->GetScopeRule()];
+		if( scope.m_scope == msg->GetScope() ) {
+			scope.m_count--;
+		}
+		else {
+			m_numStale--;
+		}
+	}
+
+	if( --lists.m_count == 0 )
+	{	//Hand the lists back to the pool for the next idle receiver
+		ReleaseLists( index );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RetireScopes
+
+  Description:  Marks every scoped message for a receiver on one queue stale
+                (used when the receiver changes state machines). The 
+				messages stay linked until they are removed.
+
+  Arguments:    receiver : the receiver ID of the messages
+                queue    : the queue of the messages
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::RetireScopes( objectID receiver, unsigned int queue )
+{
+	ASSERTMSG( queue < MSG_RECEIVER_INDEX_QUEUES, "MsgReceiverIndex::RetireScopes - queue out of bounds" );
+
+	unsigned int index = FindLists( receiver );
+	if( index != MSG_RECEIVER_INDEX_NO_LISTS && queue < MSG_RECEIVER_INDEX_QUEUES )
+	{
+		for( unsigned int r=0; r<MSG_RECEIVER_INDEX_SCOPES; r++ )
+		{
+			ScopeCount & scope = m_lists[index].m_scopes[queue][r];
+			m_numStale += scope.m_count;
+			scope.m_scope = MSG_RECEIVER_INDEX_NO_SCOPE;
+			scope.m_count = 0;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetNumPending
+
+  Description:  Counts the pending messages of a receiver (on every queue,
+                stale ones included).
+
+  Arguments:    receiver : the receiver ID
+
+  Returns:      The number of messages.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgReceiverIndex::GetNumPending( objectID receiver )
+{
+	unsigned int index = FindLists( receiver );
+	if( index == MSG_RECEIVER_INDEX_NO_LISTS ) {
+		return( 0 );
+	}
+	return( m_lists[index].m_count );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindStale
+
+  Description:  Finds every pending scoped message whose scope has been left.
+
+  Arguments:    results : the list to fill with the stale messages
+
+  Returns:      None. (The result is stored in the results argument.)
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::FindStale( MessageList & results )
+{
+	//Pooled lists that aren't in use have empty heads, so they're skipped for free
+	for( ListsContainer::iterator i=m_lists.begin(); i!=m_lists.end(); ++i )
+	{
+		for( unsigned int q=0; q<MSG_RECEIVER_INDEX_QUEUES; q++ )
+		{
+			for( MSG_Object * msg = i->m_head[q]; msg != 0; msg = msg->GetReceiverNext() )
+			{
+				if( msg->GetScopeRule() != SCOPE_TO_STATE_MACHINE &&
+					i->m_scopes[q][msg->GetScopeRule()].m_scope != msg->GetScope() )
+				{
+					results.push_back( msg );
+				}
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindAll
+
+  Description:  Finds all messages for a receiver (on any queue) that match
+                the predicate.
+
+  Arguments:    receiver : the receiver ID of the messages
+                pred     : the search criteria
+                results  : the list to fill with matching messages
+
+  Returns:      None. (The result is stored in the results argument.)
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::FindAll( objectID receiver, MsgPredicate & pred, MessageList & results )
+{
+	unsigned int index = FindLists( receiver );
+	if( index != MSG_RECEIVER_INDEX_NO_LISTS )
+	{
+		for( unsigned int q=0; q<MSG_RECEIVER_INDEX_QUEUES; q++ ) {
+			FindAll( m_lists[index].m_head[q], pred, results );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindAll
+
+  Description:  Finds all messages for a receiver on one queue that match 
+                the predicate.
+
+  Arguments:    receiver : the receiver ID of the messages
+                queue    : the queue of the messages
+                pred     : the search criteria
+                results  : the list to fill with matching messages
+
+  Returns:      None. (The result is stored in the results argument.)
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::FindAll( objectID receiver, unsigned int queue, MsgPredicate & pred, MessageList & results )
+{
+	ASSERTMSG( queue < MSG_RECEIVER_INDEX_QUEUES, "MsgReceiverIndex::FindAll - queue out of bounds" );
+
+	unsigned int index = FindLists( receiver );
+	if( index != MSG_RECEIVER_INDEX_NO_LISTS && queue < MSG_RECEIVER_INDEX_QUEUES )
+	{
+		FindAll( m_lists[index].m_head[queue], pred, results );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindFirstDue
+
+  Description:  Finds the message for a receiver (on any queue) that matches
+                the predicate and is due first, walking the lists in place.
+
+  Arguments:    receiver : the receiver ID of the messages
+                pred     : the search criteria
+
+  Returns:      The matching message with the earliest delivery time (the
+                earliest sent on a tie), or 0 if none.
+ *---------------------------------------------------------------------------*/
+MSG_Object * MsgReceiverIndex::FindFirstDue( objectID receiver, MsgPredicate & pred )
+{
+	MSG_Object * first = 0;
+	unsigned int index = FindLists( receiver );
+	if( index != MSG_RECEIVER_INDEX_NO_LISTS )
+	{
+		for( unsigned int q=0; q<MSG_RECEIVER_INDEX_QUEUES; q++ )
+		{
+			for( MSG_Object * msg = m_lists[index].m_head[q]; msg != 0; msg = msg->GetReceiverNext() )
+			{
+				if( pred.Match( *msg ) &&
+					( !first ||
+					  msg->GetDeliveryTime() < first->GetDeliveryTime() ||
+					  ( msg->GetDeliveryTime() == first->GetDeliveryTime() && msg->GetSendSequence() < first->GetSendSequence() ) ) )
+				{
+					first = msg;
+				}
+			}
+		}
+	}
+	return( first );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindAll
+
+  Description:  Walks one intrusive list and collects the matching messages.
+
+  Arguments:    head    : the first message in the list
+                pred    : the search criteria
+                results : the list to fill with matching messages
+
+  Returns:      None. (The result is stored in the results argument.)
+ *---------------------------------------------------------------------------*/
+void MsgReceiverIndex::FindAll( MSG_Object * head, MsgPredicate & pred, MessageList & results )
+{
+	for( MSG_Object * msg = head; msg != 0; msg = msg->GetReceiverNext() )
+	{
+		if( pred.Match( *msg ) ) {
+			results.push_back( msg );
+		}
+	}
+}
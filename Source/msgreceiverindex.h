@@ -0,0 +1,99 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "msgscheduler.h"
+#include <vector>
+#include <map>
+
+
+#define MSG_RECEIVER_INDEX_QUEUES 18		//One list per StateMachineQueue value up to STATE_MACHINE_QUEUE_ALL
+#define MSG_RECEIVER_INDEX_SCOPES 2		//SCOPE_TO_SUBSTATE and SCOPE_TO_STATE
+#define MSG_RECEIVER_INDEX_NO_SCOPE (0xFFFFFFFF)
+#define MSG_RECEIVER_INDEX_NO_LISTS (0xFFFFFFFF)
+
+
+//Index of the pending delayed messages grouped by receiver and queue.
+//Each message is linked into an intrusive list for its (receiver, queue) pair, 
+//so RemoveMsg and PurgeScopedMsg only touch the messages of one object 
+//instead of every pending message in the world.
+//The index never allocates or deletes messages - ownership stays with MsgRoute.
+//
+//A receiver's lists are found through the slot index of its ID and come from
+//a pool that is reused when the receiver runs out of pending messages, so 
+//once the pool and slots have grown, indexing a message doesn't allocate.
+//
+//The index also tracks the live scope of each (receiver, queue, rule). State
+//machines hand out a fresh scope on every state change and reset, so once a
+//newer scope has been seen (or the scopes are retired) the older scoped 
+//messages are stale. They aren't unlinked, just counted, and are dropped when
+//they come due or by MsgRoute compacting once enough of them have built up.
+class MsgReceiverIndex
+{
+public:
+
+	MsgReceiverIndex( void ) : m_numStale( 0 ) {}
+	~MsgReceiverIndex( void ) {}
+
+	void Insert( MSG_Object * msg );
+	void Remove( MSG_Object * msg );
+	void Clear( void );
+
+	//Marks the scoped messages of a receiver's queue stale - time complexity O(1)
+	void RetireScopes( objectID receiver, unsigned int queue );
+	void FindStale( MessageList & results );					//Time complexity O(receiver lists pooled + messages pending)
+	inline unsigned int GetNumStale( void )						{ return( m_numStale ); }
+	unsigned int GetNumPending( objectID receiver );			//Time complexity O(1)
+
+	//Searching - time complexity O(messages pending for the receiver)
+	void FindAll( objectID receiver, MsgPredicate & pred, MessageList & results );
+	void FindAll( objectID receiver, unsigned int queue, MsgPredicate & pred, MessageList & results );
+	MSG_Object * FindFirstDue( objectID receiver, MsgPredicate & pred );
+
+private:
+
+	struct ScopeCount
+	{
+		unsigned int m_scope;		//Live scope, or MSG_RECEIVER_INDEX_NO_SCOPE
+		unsigned int m_count;		//Pending messages in the live scope
+	};
+
+	struct ReceiverLists
+	{
+		MSG_Object * m_head[MSG_RECEIVER_INDEX_QUEUES];
+		ScopeCount m_scopes[MSG_RECEIVER_INDEX_QUEUES][MSG_RECEIVER_INDEX_SCOPES];
+		unsigned int m_count;
+		objectID m_receiver;
+	};
+
+	struct ReceiverSlot
+	{
+		objectID m_receiver;		//Receiver holding the slot
+		unsigned int m_lists;		//Index into m_lists, or MSG_RECEIVER_INDEX_NO_LISTS
+	};
+
+	typedef std::vector<ReceiverSlot> SlotContainer;
+	typedef std::vector<ReceiverLists> ListsContainer;
+	typedef std::vector<unsigned int> FreeListsContainer;
+	typedef std::map<objectID, unsigned int> CollisionContainer;
+
+	SlotContainer m_slots;				//By the slot index of the receiver ID
+	ListsContainer m_lists;				//Pooled - never shrinks until Clear
+	FreeListsContainer m_freeLists;		//Unused entries of m_lists
+	CollisionContainer m_collisions;	//Receivers whose slot is held by another generation (rare)
+	unsigned int m_numStale;			//Pending scoped messages whose scope has been left
+
+	unsigned int FindLists( objectID receiver );
+	unsigned int AcquireLists( objectID receiver );
+	void ReleaseLists( unsigned int lists );
+	void FindAll( MSG_Object * head, MsgPredicate & pred, MessageList & results );
+
+};
@@ -0,0 +1,429 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "msgrecorder.h"
+#include "database.h"
+#include "msgroute.h"
+#include "time.h"
+
+
+#define MSG_RECORDING_HEADER_SIZE (3 * sizeof( unsigned int ))	//Magic, version and snapshot size
+
+
+MsgRecorder::MsgRecorder( void )
+: m_file( 0 ),
+  m_startTime( 0.0 ),
+  m_frame( 0 ),
+  m_inUpdate( false ),
+  m_replaying( false ),
+  m_injecting( false ),
+  m_deliveries( 0 ),
+  m_checksum( 0 ),
+  m_divergences( 0 ),
+  m_firstDivergentFrame( -1 )
+{
+	InitializeCriticalSection( &m_lock );
+}
+
+MsgRecorder::~MsgRecorder( void )
+{
+	StopRecording();
+	DeleteCriticalSection( &m_lock );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         StartRecording
+
+  Description:  Starts recording the message traffic into a file, beginning
+                with a snapshot of the simulation. Must be called from the
+				main thread between frames.
+
+  Arguments:    filename : the file to write
+
+  Returns:      Whether the recording started (a state machine class that
+                isn't registered can't be saved in the snapshot).
+ *---------------------------------------------------------------------------*/
+bool MsgRecorder::StartRecording( const char * filename )
+{
+	ASSERTMSG( !m_replaying, "MsgRecorder::StartRecording - Can't record while replaying" );
+	StopRecording();
+
+	SnapshotImage image;
+	if( m_replaying || !SaveSnapshot( image ) ) {
+		return( false );
+	}
+
+	FILE * file = fopen( filename, "wb" );
+	if( !file ) {
+		return( false );
+	}
+
+	unsigned int header[3] = { MSG_RECORDING_MAGIC, MSG_RECORDING_VERSION, (unsigned int)image.size() };
+	if( fwrite( header, 1, sizeof( header ), file ) != sizeof( header ) ||
+		fwrite( &image[0], 1, image.size(), file ) != image.size() )
+	{
+		fclose( file );
+		return( false );
+	}
+
+	m_file = file;
+	m_buffer.clear();
+	m_startTime = g_time.GetCurTime();
+	m_frame = 0;
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         StopRecording
+
+  Description:  Writes the remaining records and closes the recording.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRecorder::StopRecording( void )
+{
+	if( m_file )
+	{
+		Flush();
+		fclose( m_file );
+		m_file = 0;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Flush
+
+  Description:  Appends the buffered records to the recording.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRecorder::Flush( void )
+{
+	if( !m_buffer.empty() )
+	{
+		fwrite( &m_buffer[0], 1, m_buffer.size(), m_file );
+		m_buffer.clear();
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         StartReplay
+
+  Description:  Loads a recording and restores its snapshot, so the following
+                database updates replay it (see MarkReplayedStep). Must be
+				called from the main thread, with an empty database.
+
+  Arguments:    filename : the recording
+
+  Returns:      Whether the replay started.
+ *---------------------------------------------------------------------------*/
+bool MsgRecorder::StartReplay( const char * filename )
+{
+	ASSERTMSG( !m_file, "MsgRecorder::StartReplay - Can't replay while recording" );
+	StopReplay();
+
+	FILE * file = fopen( filename, "rb" );
+	if( !file ) {
+		return( false );
+	}
+	fseek( file, 0, SEEK_END );
+	long size = ftell( file );
+	fseek( file, 0, SEEK_SET );
+	if( size < (long)MSG_RECORDING_HEADER_SIZE )
+	{
+		fclose( file );
+		return( false );
+	}
+	m_recording.resize( size );
+	bool read = fread( &m_recording[0], 1, size, file ) == (size_t)size;
+	fclose( file );
+
+	m_startTime = g_time.GetCurTime();
+	SnapshotReader reader( &m_recording[0], (unsigned int)size, m_startTime );
+	unsigned int magic = reader.Read<unsigned int>();
+	unsigned int version = reader.Read<unsigned int>();
+	unsigned int snapshotSize = reader.Read<unsigned int>();
+	const void * snapshot = reader.ReadInPlace( snapshotSize );
+	if( !read || magic != MSG_RECORDING_MAGIC || version != MSG_RECORDING_VERSION || !snapshot ||
+		!RestoreSnapshot( snapshot, snapshotSize ) || !ParseRecords( reader ) )
+	{
+		m_recording.clear();
+		m_injections.clear();
+		m_frames.clear();
+		return( false );
+	}
+
+	m_replaying = true;
+	m_frame = 0;
+	m_deliveries = 0;
+	m_checksum = 0;
+	m_divergences = 0;
+	m_firstDivergentFrame = -1;
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ParseRecords
+
+  Description:  Splits the records of a recording into frames. Injections
+                are only located (they are decoded when replayed, since 
+				their data goes into the frame arena) and deliveries are 
+				summed into a count and checksum per frame. Records after
+				the last frame are dropped.
+
+  Arguments:    reader : positioned after the snapshot
+
+  Returns:      Whether the records are valid.
+ *---------------------------------------------------------------------------*/
+bool MsgRecorder::ParseRecords( SnapshotReader & reader )
+{
+	m_injections.clear();
+	m_frames.clear();
+
+	ReplayFrame frame = { 0.0, 0, 0, 0, 0 };
+	while( !reader.IsAtEnd() && reader.IsValid() )
+	{
+		switch( reader.Read<unsigned char>() )
+		{
+			case RECORD_INJECTED:
+				{
+					unsigned int size = reader.Read<unsigned int>();
+					const unsigned char * record = (const unsigned char *)reader.ReadInPlace( size );
+					if( record ) {
+						m_injections.push_back( (unsigned int)( record - &m_recording[0] ) );
+					}
+				}
+				break;
+			case RECORD_DELIVERED:
+				{
+					MSG_Name name = reader.Read<MSG_Name>();
+					objectID sender = reader.Read<objectID>();
+					objectID receiver = reader.Read<objectID>();
+					frame.m_deliveries++;
+					frame.m_checksum += HashDelivery( name, sender, receiver );
+				}
+				break;
+			case RECORD_FRAME:
+				if( reader.Read<unsigned int>() != m_frames.size() ) {
+					reader.Fail();
+				}
+				frame.m_time = reader.ReadTime();
+				frame.m_numInjections = (unsigned int)m_injections.size() - frame.m_firstInjection;
+				m_frames.push_back( frame );
+
+				frame.m_firstInjection = (unsigned int)m_injections.size();
+				frame.m_deliveries = 0;
+				frame.m_checksum = 0;
+				break;
+			default:
+				reader.Fail();
+				break;
+		}
+	}
+
+	return( reader.IsValid() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         StopReplay
+
+  Description:  Ends a replay. The simulation carries on live from where
+                the replay got to.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRecorder::StopReplay( void )
+{
+	m_replaying = false;
+	m_recording.clear();
+	m_injections.clear();
+	m_frames.clear();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         MarkReplayedStep
+
+  Description:  Replays the injections that came before the next frame of
+                the recording (at the time they were made), then sets the 
+				time of that frame. Called in place of marking the time, 
+				before each database update.
+
+  Arguments:    None.
+
+  Returns:      False once every frame has been replayed.
+ *---------------------------------------------------------------------------*/
+bool MsgRecorder::MarkReplayedStep( void )
+{
+	if( !m_replaying || m_frame >= m_frames.size() ) {
+		return( false );
+	}
+
+	ReplayFrame & frame = m_frames[m_frame];
+	m_injecting = true;
+	for( unsigned int i=0; i<frame.m_numInjections; ++i )
+	{
+		unsigned int offset = m_injections[frame.m_firstInjection + i];
+		SnapshotReader reader( &m_recording[offset], (unsigned int)m_recording.size() - offset, m_startTime );
+		objectID receiver = reader.Read<objectID>();
+		MSG_Name name = reader.Read<MSG_Name>();
+		MSG_Data data = reader.ReadMsgData();
+		if( !reader.IsValid() ) {
+			continue;
+		}
+
+		if( receiver == INVALID_OBJECT_ID ) {
+			g_database.SendMsgFromSystem( name, data );
+		}
+		else {
+			g_database.SendMsgFromSystem( receiver, name, data );
+		}
+	}
+	m_injecting = false;
+
+	g_time.MarkReplayedTime( frame.m_time );
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AcceptInjection
+
+  Description:  Records a message sent from the system between database
+                updates. While replaying, only the recorded injections are
+				let through.
+
+  Arguments:    receiver : the receiver (INVALID_OBJECT_ID for all objects)
+                name     : the name of the message
+				data     : the data of the message
+
+  Returns:      False if the message must not be sent.
+ *---------------------------------------------------------------------------*/
+bool MsgRecorder::AcceptInjection( objectID receiver, MSG_Name name, MSG_Data & data )
+{
+	if( m_inUpdate || m_injecting ) {
+		return( true );		//Part of the simulation itself
+	}
+	if( m_replaying ) {
+		return( false );
+	}
+
+	if( m_file )
+	{	//Prefixed with its size, so a replay can skip it without decoding the data
+		SnapshotImage record;
+		SnapshotWriter recordWriter( record, m_startTime );
+		recordWriter.Write( receiver );
+		recordWriter.Write( name );
+		recordWriter.WriteMsgData( data );
+
+		SnapshotWriter writer( m_buffer, m_startTime );
+		writer.Write( (unsigned char)RECORD_INJECTED );
+		writer.Write( (unsigned int)record.size() );
+		writer.WriteBytes( &record[0], (unsigned int)record.size() );
+	}
+	return( true );
+}
+
+void MsgRecorder::BeginUpdate( void )
+{
+	m_inUpdate = true;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         EndUpdate
+
+  Description:  Ends a frame: writes its frame record and flushes the 
+                recording, or compares the deliveries of the frame against 
+				the recording.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRecorder::EndUpdate( void )
+{
+	m_inUpdate = false;
+
+	if( m_file )
+	{
+		SnapshotWriter writer( m_buffer, m_startTime );
+		writer.Write( (unsigned char)RECORD_FRAME );
+		writer.Write( m_frame );
+		writer.WriteTime( g_time.GetCurTime() );
+		Flush();
+	}
+	else if( m_replaying && m_frame < m_frames.size() )
+	{
+		ReplayFrame & frame = m_frames[m_frame];
+		if( frame.m_deliveries != m_deliveries || frame.m_checksum != m_checksum )
+		{
+			if( m_divergences == 0 ) {
+				m_firstDivergentFrame = (int)m_frame;
+			}
+			m_divergences++;
+		}
+	}
+	else
+	{
+		return;
+	}
+
+	m_deliveries = 0;
+	m_checksum = 0;
+	m_frame++;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Delivered
+
+  Description:  Records (or, while replaying, tallies) a message delivered
+                to a state machine. Can be called from job threads, for the
+				messages an object sends itself during a parallel update.
+
+  Arguments:    msg : the delivered message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRecorder::Delivered( MSG_Object & msg )
+{
+	if( !m_file && !m_replaying ) {
+		return;
+	}
+
+	EnterCriticalSection( &m_lock );
+	if( m_file )
+	{
+		SnapshotWriter writer( m_buffer, m_startTime );
+		writer.Write( (unsigned char)RECORD_DELIVERED );
+		writer.Write( msg.GetName() );
+		writer.Write( msg.GetSender() );
+		writer.Write( msg.GetReceiver() );
+	}
+	else
+	{
+		m_deliveries++;
+		m_checksum += HashDelivery( msg.GetName(), msg.GetSender(), msg.GetReceiver() );
+	}
+	LeaveCriticalSection( &m_lock );
+}
+
+//Well mixed, so the sum over a frame doesn't depend on the delivery order
+unsigned int MsgRecorder::HashDelivery( MSG_Name name, objectID sender, objectID receiver )
+{
+	unsigned int hash = (unsigned int)name * 0x9E3779B1;
+	hash = ( hash ^ sender ) * 0x85EBCA6B;
+	hash = ( hash ^ ( hash >> 13 ) ^ receiver ) * 0xC2B2AE35;
+	return( hash ^ ( hash >> 16 ) );
+}
@@ -0,0 +1,109 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+#include "msg.h"
+#include "snapshot.h"
+#include <vector>
+
+class GameObject;
+
+
+#define MSG_RECORDING_MAGIC (0x4C4D5253)		//"SRML"
+#define MSG_RECORDING_VERSION (1)			//Bump whenever the record layout (or SNAPSHOT_VERSION) changes
+
+
+//Optional recorder of the message traffic, for reproducing a run. A recording
+//starts with a snapshot of the simulation (see snapshot.h), followed by an
+//append-only stream of records:
+//
+//  - every message injected from outside the simulation (SendMsgFromSystem
+//    between database updates, e.g. mouse clicks or arrivals), with its data
+//  - every message delivered to a state machine (name, sender and receiver)
+//  - the end of each database update (frame number and simulation time)
+//
+//Replaying restores the snapshot into an empty database, then each update
+//sets the recorded time, injects the recorded messages and compares what is
+//delivered against the recording. Injections made by the host while replaying
+//are ignored, since the recording stands in for them, so a replay can run in a
+//headless build (StateMachineBenchmark -replay). Deliveries are compared as a
+//count and an order independent checksum per frame, since the order within a
+//frame depends on the number of threads in a parallel update.
+//
+//Replay needs every recorded state machine class to be registered (see
+//REGISTER_STATE_MACHINE) and linked in.
+class MsgRecorder : public Singleton <MsgRecorder>
+{
+public:
+
+	MsgRecorder( void );
+	~MsgRecorder( void );
+
+	//Between frames, from the main thread
+	bool StartRecording( const char * filename );
+	void StopRecording( void );
+	inline bool IsRecording( void )							{ return( m_file != 0 ); }
+
+	bool StartReplay( const char * filename );			//The database must be empty
+	void StopReplay( void );
+	bool MarkReplayedStep( void );						//Sets the time of the next frame (false once the recording ends)
+	inline bool IsReplaying( void )							{ return( m_replaying ); }
+	inline unsigned int GetNumReplayFrames( void )			{ return( (unsigned int)m_frames.size() ); }
+	inline unsigned int GetNumDivergences( void )			{ return( m_divergences ); }
+	inline int GetFirstDivergentFrame( void )				{ return( m_firstDivergentFrame ); }	//-1 if none
+
+	//Hooks (database and message router)
+	bool AcceptInjection( objectID receiver, MSG_Name name, MSG_Data & data );	//False if the injection must be dropped
+	void BeginUpdate( void );
+	void EndUpdate( void );
+	void Delivered( MSG_Object & msg );					//Any thread
+
+private:
+
+	enum RecordType {
+		RECORD_INJECTED,		//receiver (INVALID_OBJECT_ID = all objects), name, data
+		RECORD_DELIVERED,		//name, sender, receiver
+		RECORD_FRAME			//frame, time - ends the records of the frame
+	};
+
+	struct ReplayFrame
+	{
+		double m_time;							//Relative to the start of the recording
+		unsigned int m_firstInjection;			//In m_injections
+		unsigned int m_numInjections;
+		unsigned int m_deliveries;
+		unsigned int m_checksum;
+	};
+
+	static unsigned int HashDelivery( MSG_Name name, objectID sender, objectID receiver );
+	void Flush( void );
+	bool ParseRecords( SnapshotReader & reader );
+
+	FILE * m_file;
+	SnapshotImage m_buffer;						//Records not written yet (flushed every frame)
+	CRITICAL_SECTION m_lock;					//Deliveries can come from job threads
+	double m_startTime;
+	unsigned int m_frame;						//Since the start of the recording or replay
+	bool m_inUpdate;
+
+	bool m_replaying;
+	bool m_injecting;							//Replaying the injections of a frame
+	SnapshotImage m_recording;					//The replayed file
+	std::vector<unsigned int> m_injections;		//Offsets of the injection records
+	std::vector<ReplayFrame> m_frames;
+	unsigned int m_deliveries;					//This frame
+	unsigned int m_checksum;
+	unsigned int m_divergences;
+	int m_firstDivergentFrame;
+
+};
@@ -12,6 +12,96 @@
 #include "msgroute.h"
 #include "statemch.h"
 #include "database.h"
+#include "telemetry.h"
+#include "spatialgrid.h"
+#include "body.h"
+#include "snapshot.h"
+#include "msgrecorder.h"
+#include "shard.h"
+#include <algorithm>
+
+
+//Search criteria for pending delayed messages
+class RemoveMsgPredicate : public MsgPredicate
+{
+public:
+	RemoveMsgPredicate( MSG_Name name, objectID receiver, objectID sender, bool timer )
+	: m_name( name ), m_receiver( receiver ), m_sender( sender ), m_timer( timer ) {}
+
+	virtual bool Match( MSG_Object & msg )	{ return( msg.GetName() == m_name &&
+													  msg.GetReceiver() == m_receiver &&
+													  msg.GetSender() == m_sender &&
+													  msg.IsTimer() == m_timer &&
+													  !msg.IsDelivered() ); }
+private:
+	MSG_Name m_name;
+	objectID m_receiver;
+	objectID m_sender;
+	bool m_timer;
+};
+
+class AnyMsgPredicate : public MsgPredicate
+{
+public:
+	virtual bool Match( MSG_Object & msg )	{ return( true ); }
+};
+
+//Pending messages that can make room in a full inbox (timers would never come back)
+class EvictableMsgPredicate : public MsgPredicate
+{
+public:
+	virtual bool Match( MSG_Object & msg )	{ return( !msg.IsTimer() && !msg.IsDelivered() ); }
+};
+
+//Sort criteria for replaying deferred calls
+class DeferredMsgOrder
+{
+public:
+	bool operator()( const DeferredMsg & a, const DeferredMsg & b ) const	{ return( a.m_order < b.m_order ); }
+};
+
+//Sort criteria for grouping a batched delivery (stable, so each group stays in time order)
+class BatchedMsgReceiverOrder
+{
+public:
+	bool operator()( const BatchedMsg & a, const BatchedMsg & b ) const	{ return( a.m_msg->GetReceiver() < b.m_msg->GetReceiver() ); }
+};
+
+//Sort criteria for putting carried over messages back in time order
+class BatchedMsgTimeOrder
+{
+public:
+	bool operator()( const BatchedMsg & a, const BatchedMsg & b ) const	{ return( a.m_order < b.m_order ); }
+};
+
+//Sort criteria for saving the pending messages in delivery order
+class PendingMsgOrder
+{
+public:
+	bool operator()( MSG_Object * a, MSG_Object * b ) const
+	{
+		if( a->GetDeliveryTime() != b->GetDeliveryTime() ) {
+			return( a->GetDeliveryTime() < b->GetDeliveryTime() );
+		}
+		return( a->GetSendSequence() < b->GetSendSequence() );
+	}
+};
+
+//Heap criteria for the state machine wake-ups (earliest on top, ties in receiver and queue order)
+class TimerWakeLater
+{
+public:
+	bool operator()( const TimerWake & a, const TimerWake & b ) const
+	{
+		if( a.m_time != b.m_time ) {
+			return( a.m_time > b.m_time );
+		}
+		if( a.m_receiver != b.m_receiver ) {
+			return( a.m_receiver > b.m_receiver );
+		}
+		return( a.m_queue > b.m_queue );
+	}
+};
 
 
 
@@ -20,10 +110,53 @@
 
   Description:  Constructor
  *---------------------------------------------------------------------------*/
-MsgRoute::MsgRoute( void )
-: m_loadBalancingTimeLimit(0.05f/60.0f) //5% of a 60Hz frame
+MsgRoute::MsgRoute( MsgSchedulerType scheduler )
+: m_frameArenaIndex( 0 ),
+  m_loadBalancingTimeLimit(0.05f/60.0f), //5% of a 60Hz frame
+  m_nextSendSequence( 0 ),
+  m_numDeliveredLastFrame( 0 ),
+  m_deliveryBacklog( 0 ),
+  m_oldestLateMessageAge( 0.0f ),
+  m_numFramesOverBudget( 0 ),
+  m_batchedDelivery( false ),
+  m_nextFrameIndex( 0 ),
+  m_deferring( false ),
+  m_mainThreadId( GetCurrentThreadId() ),
+  m_broadcastDepth( 0 ),
+  m_flowLimited( false ),
+  m_flowFrame( 1 ),
+  m_overflowHandler( 0 ),
+  m_overflowContext( 0 ),
+  m_numOverflows( 0 ),
+  m_numOverflowsThisFrame( 0 ),
+  m_numOverflowsLastFrame( 0 ),
+  m_worstSender( INVALID_OBJECT_ID ),
+  m_worstName( MSG_NULL ),
+  m_worstOverflows( 0 ),
+  m_ccDepth( 0 ),
+  m_ccDelivering( false ),
+  m_numCCBatches( 0 )
 {
+	COMPILE_TIME_ASSERT( STATE_MACHINE_QUEUE_ALL < MSG_RECEIVER_INDEX_QUEUES, receiver_index_needs_a_list_per_queue );
+
+	for( int i=0; i<MSG_PRIORITY_NUM; ++i )
+	{
+		if( scheduler == MSG_SCHEDULER_LIST ) {
+			m_delayedMessages[i] = new MsgSchedulerList();
+		}
+		else {
+			m_delayedMessages[i] = new MsgSchedulerHeap();
+		}
+	}
+
+	for( int i=0; i<MSG_NUM; ++i )
+	{
+		m_msgPriority[i] = MSG_PRIORITY_NORMAL;
+	}
 
+	//State changes are never starved by bulk timers
+	m_msgPriority[MSG_CHANGE_STATE_DELAYED] = MSG_PRIORITY_HIGH;
+	m_msgPriority[MSG_CHANGE_SUBSTATE_DELAYED] = MSG_PRIORITY_HIGH;
 }
 
 /*---------------------------------------------------------------------------*
@@ -33,13 +166,28 @@ MsgRoute::MsgRoute( void )
  *---------------------------------------------------------------------------*/
 MsgRoute::~MsgRoute( void )
 {
-	for( MessageContainer::iterator i=m_delayedMessages.begin(); i!=m_delayedMessages.end(); ++i )
+	for( int i=0; i<MSG_PRIORITY_NUM; ++i )
 	{
-		MSG_Object * msg = *i;
-		delete( msg );
+		while( !m_delayedMessages[i]->IsEmpty() )
+		{
+			MSG_Object * msg = m_delayedMessages[i]->GetNext();
+			m_delayedMessages[i]->PopNext();
+			m_msgPool.Release( msg );
+		}
+		delete( m_delayedMessages[i] );
+	}
+
+	for( int i=0; i<2; ++i )
+	{	//Removed ones included (the queue owns them until delivery)
+		for( MessageList::iterator m=m_nextFrame[i].begin(); m!=m_nextFrame[i].end(); ++m )
+		{
+			m_msgPool.Release( *m );
+		}
+		m_nextFrame[i].clear();
 	}
 
-	m_delayedMessages.clear();
+	m_duplicateIndex.Clear();
+	m_receiverIndex.Clear();
 
 }
 
@@ -48,8 +196,8 @@ MsgRoute::~MsgRoute( void )
   Name:         SendMsg
 
   Description:  Sends a message through the message router. This function
-                determines if the message should be delivered immediately
-				or should be held until the delivery time.
+                determines if the message should be delivered immediately,
+				next frame or should be held until the delivery time.
 
   Arguments:    delay    : the number of seconds to delay the message
                 name     : the message name
@@ -70,276 +218,2489 @@ void MsgRoute::SendMsg( float delay, MSG_Name name,
                         StateMachineQueue queue, MSG_Data& data, 
 						bool timer, bool cc )
 {
+	if( MustDefer() )
+	{	//Parallel update or another thread - only immediate messages to the object
+		//being updated by this job thread can be delivered right away (they only 
+		//touch its own state)
+		if( delay > 0.0f || !IsParallelUpdateThread() || receiver != GetDeferralBuffer().m_object )
+		{
+			MSG_Object msg( 0.0f, name, sender, receiver, rule, scope, queue, data, timer, cc );
+			Defer( DEFERRED_SEND, delay, msg, 0 );
+			return;
+		}
+	}
+
+	if( m_flowLimited && !timer && !m_deferring )
+	{	//May be dropped, merged or held back to the next frame
+		if( !AdmitMsg( delay, name, receiver, sender, rule, scope, queue, data ) ) {
+			return;
+		}
+	}
+
+	if( Shard::DoesSingletonExist() && !g_shard.IsLocal( receiver ) )
+	{	//The receiver lives in another process (delayed there)
+		g_shard.ForwardMsg( delay, name, receiver, sender, rule, scope, queue, data, timer, cc );
+		return;
+	}
+
+	CountTelemetry( TELEMETRY_MSGS_SENT );
 
 	if( delay <= 0.0f )
 	{	//Deliver immediately
-		MSG_Object msg( g_time.GetCurTime(), name, sender, receiver, rule, scope, queue, data, timer, cc );
+		MSG_Object msg( g_frame.m_time, name, sender, receiver, rule, scope, queue, data, timer, cc );
 		RouteMsg( msg );
 	}
 	else
 	{	
-		float deliveryTime = delay + g_time.GetCurTime();
-
-		//Check for duplicates - time complexity O(n)
-		bool set = false;
-		float lastDeliveryTime = 0.0f;
-		MessageContainer::iterator insertPosition = m_delayedMessages.end();
-		MessageContainer::iterator i;
-		for( i=m_delayedMessages.begin(); i!=m_delayedMessages.end(); ++i )
-		{
-			if( (*i)->IsDelivered() == false &&
-				(*i)->GetName() == name &&
-				(*i)->GetReceiver() == receiver &&
-				(*i)->GetSender() == sender &&
-				(*i)->GetScopeRule() == rule &&
-				(*i)->GetScope() == scope &&
-				(*i)->GetQueue() == queue &&
-				(*i)->IsTimer() == timer &&
-				(*i)->GetMsgData() == data )
-			{	//Already in list - don't add
-				ASSERTMSG(0, "MsgRoute::SendMsg - Message already in list. This assert is designed "
-							 "to promote good coding practices. If you know what you're doing, you "
-							 "can certainly remove this assert and have the engine silently ignore "
-							 "redundant messages.");
-				return;
-			}
+		double deliveryTime = delay + g_frame.m_time;
 
-			//Sanity check that list is in order
-			if( (*i)->GetDeliveryTime() < lastDeliveryTime )
+		//Check for duplicates - time complexity O(1)
+		Coalesce_Rule coalesce = GetMsgCoalesceRule( name );
+		float period = timer ? delay : 0.0f;
+		MSG_Object * pending = m_duplicateIndex.Find( name, receiver, sender, rule, scope, queue, data, timer, period );
+		if( pending )
+		{	//Already in list - don't add
+			switch( coalesce )
 			{
-				ASSERTMSG( 0, "MsgRoute::SendMsg - Message list not in order" );
+				case COALESCE_NONE:
+					ASSERTMSG(0, "MsgRoute::SendMsg - Message already in list. This assert is designed "
+								 "to promote good coding practices. If you know what you're doing, you "
+								 "can certainly remove this assert and have the engine silently ignore "
+								 "redundant messages (or declare a coalescing rule in msgnames.h).");
+					break;
+				case COALESCE_FIRST_WINS:
+					break;
+				case COALESCE_LATEST_WINS:
+					if( pending->IsBatched() )
+					{	//In the next frame queue - replaced by a new message, the old
+						//one is released when the queue is delivered
+						RemoveDelayedMsg( pending );
+						pending = 0;
+					}
+					else
+					{	//Rescheduled as if just sent (the index keys don't use the data or time)
+						MsgScheduler * scheduler = m_delayedMessages[pending->GetPriority()];
+						scheduler->Remove( pending );
+						m_msgPool.SetData( pending, data );
+						pending->SetDeliveryTime( deliveryTime );
+						pending->SetSendSequence( m_nextSendSequence++ );
+						scheduler->Insert( pending );
+					}
+					break;
+				case COALESCE_COUNT:
+					pending->SetIntData( pending->GetIntData() + 1 );
+					break;
 			}
-			lastDeliveryTime = (*i)->GetDeliveryTime();
-
-			if( !set && (*i)->GetDeliveryTime() > deliveryTime )
-			{	//Record place to insert new delayed message (we need the entry one beyond)
-				set = true;
-				insertPosition = i;
+			if( pending ) {
+				return;
 			}
 		}
 		
-		//Store in delivery list
-		MSG_Object * msg = new MSG_Object( deliveryTime, name, sender, receiver, rule, scope, queue, data, timer, false );
-		if( m_delayedMessages.empty() || deliveryTime <= m_delayedMessages.front()->GetDeliveryTime() )
-		{	//Put at the front if the list is empty or the delivery time is sooner than the first entry
-			m_delayedMessages.push_front( msg );
+		//Store in delivery list (messages come from the pool, not the heap)
+		MSG_Data count( 1 );
+		MSG_Object * msg = m_msgPool.Acquire( deliveryTime, name, sender, receiver, rule, scope, queue, coalesce == COALESCE_COUNT ? count : data, timer, false );
+		msg->SetPeriod( period );
+		msg->SetPriority( m_msgPriority[name] );
+		msg->SetSendSequence( m_nextSendSequence++ );
+		if( delay <= NEXT_FRAME && !timer )
+		{	//Due next frame whatever the time - no ordering needed
+			msg->SetBatched( true );
+			msg->SetQueuedNextFrame( true );
+			m_nextFrame[m_nextFrameIndex].push_back( msg );
 		}
 		else
 		{
-			m_delayedMessages.insert( insertPosition, msg );
+			m_delayedMessages[msg->GetPriority()]->Insert( msg );
 		}
+		m_duplicateIndex.Insert( msg );
+		m_receiverIndex.Insert( msg );
 	}
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         VerifyDelayedMessageOrder
+  Name:         SetFlowLimits
 
-  Description:  Verifies that the delayed messages are being ordered properly.
+  Description:  Sets the caps on the sends of each object and on the pending
+                messages of each receiver. The counts start over.
 
-  Arguments:    None.
+  Arguments:    limits : the caps and the overflow policy
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-bool MsgRoute::VerifyDelayedMessageOrder( void )
-{	//Test for order - time complexity O(n)
-	float lastDeliveryTime = 0;
+void MsgRoute::SetFlowLimits( const MsgFlowLimits & limits )
+{
+	m_flowLimits = limits;
+	m_flowLimited = limits.m_maxPendingPerReceiver > 0 || limits.m_maxSendsPerReceiver > 0 || limits.m_maxSendsPerSender > 0;
+	m_flowFrame++;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CountSend
 
-	MessageContainer::iterator i;
-	for( i=m_delayedMessages.begin(); i!=m_delayedMessages.end(); ++i )
+  Description:  Counts one more send this frame for an object.
+
+  Arguments:    counts : the counts to add to (by sender or by receiver)
+                id     : the ID of the object
+
+  Returns:      The number of sends this frame, this one included.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgRoute::CountSend( SendCountContainer & counts, objectID id )
+{
+	unsigned int slot = id & OBJECT_ID_INDEX_MASK;
+	if( slot >= counts.size() )
+	{
+		SendCount empty;
+		empty.m_id = INVALID_OBJECT_ID;
+		empty.m_flowFrame = 0;
+		empty.m_count = 0;
+		counts.resize( slot + 1, empty );
+	}
+
+	SendCount & count = counts[slot];
+	if( count.m_flowFrame != m_flowFrame || count.m_id != id )
+	{	//First send this frame, or the slot has been reused
+		count.m_id = id;
+		count.m_flowFrame = m_flowFrame;
+		count.m_count = 0;
+	}
+	return( ++count.m_count );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         AdmitMsg
+
+  Description:  Applies the flow limits to a send (not a timer). A send over
+                the sender or receiver rate is dropped or held back to the 
+				next frame (merged into an identical pending message, if
+				any), depending on the policy. A delayed send to a full
+				inbox is dropped, merged or makes room by dropping the
+				receiver's oldest pending message.
+
+  Arguments:    delay    : the delay of the send (raised to NEXT_FRAME if
+                           the send is held back)
+                name     : the message name
+				receiver : the ID of the receiver
+				sender   : the ID of the sender
+				rule     : the scoping rule for the message
+				scope    : the scope of the message
+				queue    : the queue to send the message to
+				data     : a piece of data
+
+  Returns:      True if the send goes ahead.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::AdmitMsg( float & delay, MSG_Name name, objectID receiver, objectID sender,
+                         Scope_Rule rule, unsigned int scope, StateMachineQueue queue, MSG_Data & data )
+{
+	MsgOverflowPolicy policy = m_flowLimits.m_policy;
+
+	bool overRate = false;
+	MsgOverflowReason reason = MSG_OVERFLOW_SENDER_RATE;
+	if( m_flowLimits.m_maxSendsPerSender > 0 && sender != SYSTEM_OBJECT_ID && sender != INVALID_OBJECT_ID ) {
+		overRate = CountSend( m_sendsBySender, sender ) > m_flowLimits.m_maxSendsPerSender;
+	}
+	if( m_flowLimits.m_maxSendsPerReceiver > 0 && CountSend( m_sendsByReceiver, receiver ) > m_flowLimits.m_maxSendsPerReceiver && !overRate )
 	{
-		float time = (*i)->GetDeliveryTime();
-		if( time < lastDeliveryTime )
+		overRate = true;
+		reason = MSG_OVERFLOW_RECEIVER_RATE;
+	}
+
+	if( overRate )
+	{
+		if( policy == MSG_OVERFLOW_DROP_NEW )
 		{
-			ASSERTMSG( 0, "MsgRoute::VerifyDelayedMessageOrder - Message list not in order" );
-			return false;
+			ReportOverflow( reason, MSG_OVERFLOW_DROPPED, name, sender, receiver );
+			return( false );
+		}
+
+		MSG_Object * pending = policy == MSG_OVERFLOW_COALESCE ? FindMergeTarget( name, receiver, sender ) :
+		                       m_duplicateIndex.Find( name, receiver, sender, rule, scope, queue, data, false, 0.0f );
+		if( pending )
+		{	//Latest data wins
+			MergeInto( pending, data );
+			ReportOverflow( reason, MSG_OVERFLOW_MERGED, name, sender, receiver );
+			return( false );
+		}
+
+		if( delay < NEXT_FRAME ) {
+			delay = NEXT_FRAME;
 		}
-		lastDeliveryTime = (*i)->GetDeliveryTime();
 	}
 
-	return true;
+	if( delay > 0.0f && m_flowLimits.m_maxPendingPerReceiver > 0 &&
+	    m_receiverIndex.GetNumPending( receiver ) >= m_flowLimits.m_maxPendingPerReceiver &&
+	    !m_duplicateIndex.Find( name, receiver, sender, rule, scope, queue, data, false, 0.0f ) )
+	{	//Would add to a full inbox
+		MSG_Object * pending;
+		switch( policy )
+		{
+			case MSG_OVERFLOW_DROP_NEW:
+				ReportOverflow( MSG_OVERFLOW_INBOX_FULL, MSG_OVERFLOW_DROPPED, name, sender, receiver );
+				return( false );
+
+			case MSG_OVERFLOW_DROP_OLDEST:
+				if( !EvictOldest( receiver ) )
+				{	//Only timers pending
+					ReportOverflow( MSG_OVERFLOW_INBOX_FULL, MSG_OVERFLOW_DROPPED, name, sender, receiver );
+					return( false );
+				}
+				ReportOverflow( MSG_OVERFLOW_INBOX_FULL, MSG_OVERFLOW_EVICTED, name, sender, receiver );
+				break;
+
+			case MSG_OVERFLOW_COALESCE:
+				pending = FindMergeTarget( name, receiver, sender );
+				if( pending ) {
+					MergeInto( pending, data );
+				}
+				ReportOverflow( MSG_OVERFLOW_INBOX_FULL, pending ? MSG_OVERFLOW_MERGED : MSG_OVERFLOW_DROPPED, name, sender, receiver );
+				return( false );
+		}
+	}
+
+	if( overRate ) {
+		ReportOverflow( reason, MSG_OVERFLOW_POSTPONED, name, sender, receiver );
+	}
+	return( true );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         SendMsgBroadcast
+  Name:         FindMergeTarget
 
-  Description:  Sends a message to every object of a certain type.
+  Description:  Finds a pending message that a send can be merged into.
 
-  Arguments:    msg    : the message to broadcast
-                type   : the type of object (optional)
+  Arguments:    name     : the message name
+				receiver : the ID of the receiver
+				sender   : the ID of the sender
+
+  Returns:      The message with the same name, sender and receiver that is
+                due first (not a timer), or 0 if none.
+ *---------------------------------------------------------------------------*/
+MSG_Object * MsgRoute::FindMergeTarget( MSG_Name name, objectID receiver, objectID sender )
+{
+	RemoveMsgPredicate match( name, receiver, sender, false );
+	return( m_receiverIndex.FindFirstDue( receiver, match ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         MergeInto
+
+  Description:  Merges a send into a pending message. The message keeps its
+                delivery time and takes the new data, or counts one more
+				send for COALESCE_COUNT messages.
+
+  Arguments:    pending : the pending message
+                data    : the data of the send
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
+void MsgRoute::MergeInto( MSG_Object * pending, MSG_Data & data )
+{
+	if( GetMsgCoalesceRule( pending->GetName() ) == COALESCE_COUNT ) {
+		pending->SetIntData( pending->GetIntData() + 1 );
+	}
+	else {
+		m_msgPool.SetData( pending, data );
+	}
+}
 
-void MsgRoute::SendMsgBroadcast( MSG_Object & msg, unsigned int type )
+/*---------------------------------------------------------------------------*
+  Name:         EvictOldest
+
+  Description:  Drops the pending message of a receiver that is due first
+                (timers are kept).
+
+  Arguments:    receiver : the ID of the receiver
+
+  Returns:      True if a message was dropped.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::EvictOldest( objectID receiver )
 {
-	dbCompositionList list;
-	g_database.ComposeList( list, type );
+	EvictableMsgPredicate match;
+	MSG_Object * oldest = m_receiverIndex.FindFirstDue( receiver, match );
+	if( !oldest ) {
+		return( false );
+	}
+	RemoveDelayedMsg( oldest );
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReportOverflow
+
+  Description:  Counts a send over a flow limit and tells the overflow 
+                handler about it.
+
+  Arguments:    reason   : the limit that was reached
+                outcome  : what happened to the send
+                name     : the message name
+				sender   : the ID of the sender
+				receiver : the ID of the receiver
 
-	dbCompositionList::iterator i;
-	for( i=list.begin(); i!=list.end(); ++i )
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::ReportOverflow( MsgOverflowReason reason, MsgOverflowOutcome outcome, MSG_Name name, objectID sender, objectID receiver )
+{
+	m_numOverflows++;
+	m_numOverflowsThisFrame++;
+	if( !m_offenders.empty() && m_offenders.back().m_sender == sender && m_offenders.back().m_name == name ) {
+		m_offenders.back().m_count++;
+	}
+	else
 	{
-		if( msg.GetSender() != (*i)->GetID() )
-		{
-			if((*i)->GetStateMachineManager())
-			{
-				(*i)->GetStateMachineManager()->SendMsg( msg );
-			}
-		}
+		Offender offender;
+		offender.m_sender = sender;
+		offender.m_name = name;
+		offender.m_count = 1;
+		m_offenders.push_back( offender );
+	}
+	CountTelemetry( TELEMETRY_MSGS_OVER_LIMIT );
+
+	if( m_overflowHandler )
+	{
+		MsgOverflow overflow;
+		overflow.m_reason = reason;
+		overflow.m_outcome = outcome;
+		overflow.m_name = name;
+		overflow.m_sender = sender;
+		overflow.m_receiver = receiver;
+		m_overflowHandler( overflow, m_overflowContext );
 	}
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         DeliverDelayedMessages
+  Name:         BeginFlowFrame
 
-  Description:  Sends delayed messages if the time is right.
+  Description:  Starts a new frame for the flow limits: the send counts 
+                start over, and the overflows of the frame that ended 
+				become the last frame stats.
 
   Arguments:    None.
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void MsgRoute::DeliverDelayedMessages( void )
+void MsgRoute::BeginFlowFrame( void )
 {
-	double timeStart = g_time.GetHighestResolutionTime();
+	m_numOverflowsLastFrame = m_numOverflowsThisFrame;
+	m_numOverflowsThisFrame = 0;
+	m_worstSender = INVALID_OBJECT_ID;
+	m_worstName = MSG_NULL;
+	m_worstOverflows = 0;
 
-	MessageContainer::iterator i = m_delayedMessages.begin();
-	while( i != m_delayedMessages.end() )
+	//Bring the overflows of each sender and message together and total them
+	std::sort( m_offenders.begin(), m_offenders.end(), OffenderLess );
+	OffenderContainer::iterator i = m_offenders.begin();
+	while( i != m_offenders.end() )
 	{
-		if( (*i)->GetDeliveryTime() <= g_time.GetCurTime() )
-		{	//Deliver and delete msg
-			MSG_Object * msg = *i;
-			RouteMsg( *msg );
-			delete( msg );
-			i = m_delayedMessages.erase( i );
-		}
-		else
-		{	//All messages beyond this one are not ready to fire, since the list is sorted
-			return;
+		OffenderContainer::iterator run = i;
+		unsigned int overflows = 0;
+		for( ; i != m_offenders.end() && i->m_sender == run->m_sender && i->m_name == run->m_name; ++i ) {
+			overflows += i->m_count;
 		}
-
-		//Decide whether to stop sending for this frame
-		double curTime = g_time.GetHighestResolutionTime();
-		if( curTime - timeStart > m_loadBalancingTimeLimit )
+		if( overflows > m_worstOverflows )
 		{
-			return;
+			m_worstSender = run->m_sender;
+			m_worstName = run->m_name;
+			m_worstOverflows = overflows;
 		}
+	}
+
+	m_offenders.clear();
+	m_flowFrame++;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         OffenderLess
+
+  Description:  Sort criteria for the overflows, by sender then message.
 
+  Arguments:    a : an overflow
+                b : another overflow
+
+  Returns:      True if a sorts before b.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::OffenderLess( const Offender & a, const Offender & b )
+{
+	if( a.m_sender != b.m_sender ) {
+		return( a.m_sender < b.m_sender );
 	}
+	return( a.m_name < b.m_name );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         RouteMsg
+  Name:         GetWorstOffenderLastFrame
 
-  Description:  Routes the message to the receiver, only if the scoping rules
-                allow it.
+  Description:  Finds the sender and message that went over the flow limits
+                the most times in the last frame.
 
-  Arguments:    msg : the message to route
+  Arguments:    sender    : set to the ID of the sender
+                name      : set to the message name
+				overflows : set to the number of sends over a limit
 
-  Returns:      None.
+  Returns:      False if nothing went over a limit.
  *---------------------------------------------------------------------------*/
-void MsgRoute::RouteMsg( MSG_Object & msg )
+bool MsgRoute::GetWorstOffenderLastFrame( objectID & sender, MSG_Name & name, unsigned int & overflows )
 {
-	GameObject * object = g_database.Find( msg.GetReceiver() );
+	sender = m_worstSender;
+	name = m_worstName;
+	overflows = m_worstOverflows;
+	return( m_worstOverflows > 0 );
+}
 
-	if( object != 0 && object->GetStateMachineManager() )
+/*---------------------------------------------------------------------------*
+  Name:         VerifyDelayedMessageOrder
+
+  Description:  Verifies that the delayed messages are being ordered properly.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::VerifyDelayedMessageOrder( void )
+{	//Test for order - time complexity O(n)
+	for( int i=0; i<MSG_PRIORITY_NUM; ++i )
 	{
-		Scope_Rule rule = msg.GetScopeRule();
-		if( rule == SCOPE_TO_STATE_MACHINE ||
-			( rule == SCOPE_TO_SUBSTATE && msg.GetScope() == object->GetStateMachineManager()->GetStateMachine((StateMachineQueue)msg.GetQueue())->GetScopeSubstate() ) ||
-			( rule == SCOPE_TO_STATE && msg.GetScope() == object->GetStateMachineManager()->GetStateMachine((StateMachineQueue)msg.GetQueue())->GetScopeState() ) )
-		{	//Scope matches
-			msg.SetDelivered( true );	//Important to set as delivered since timer messages 
-										//will resend themselves immediately (and would get
-										//thrown away if we didn't set this, since it would look
-										//like a redundant message)
-			
-			if( msg.IsTimer() )
-			{	//Timer message that occurs periodically
-				float delay = msg.GetFloatData();	//Timer value stored in data field
-				msg.SetIntData( 0 );				//Zero out data field
-				//Queue up next periodic msg
-				object->GetStateMachineManager()->GetStateMachine((StateMachineQueue)msg.GetQueue())->SetTimerExternal( delay, msg.GetName(), rule );
-			}
-			
-			if( msg.IsCC() ) {
-				object->GetStateMachineManager()->Process( EVENT_CCMessage, &msg, (StateMachineQueue)msg.GetQueue() );
-			}
-			else {
-				object->GetStateMachineManager()->Process( EVENT_Message, &msg, (StateMachineQueue)msg.GetQueue() );
-			}
+		if( !m_delayedMessages[i]->VerifyOrder() )
+		{
+			ASSERTMSG( 0, "MsgRoute::VerifyDelayedMessageOrder - Message list not in order" );
+			return false;
 		}
 	}
+
+	return true;
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         RemoveMsg
+  Name:         SendMsgBroadcast
 
-  Description:  Removes messages from the delayed message list that meet
-                the criteria. This is useful to avoid duplicate delayed
-				messages.
+  Description:  Sends a message to every object of a certain type.
 
-  Arguments:    name     : the name of the message
-                receiver : the receiver ID of the message
-				sender   : the sender ID of the message
-				timer    : whether the message is a timer
+  Arguments:    msg    : the message to broadcast
+                type   : the type of object (optional)
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void MsgRoute::RemoveMsg( MSG_Name name, objectID receiver, objectID sender, bool timer )
+
+void MsgRoute::SendMsgBroadcast( MSG_Object & msg, unsigned int type )
 {
-	MessageContainer::iterator i = m_delayedMessages.begin();
-	while( i != m_delayedMessages.end() )
-	{
-		MSG_Object * msg = *i;
-		if( msg->GetName() == name &&
-			msg->GetReceiver() == receiver &&
-			msg->GetSender() == sender &&
-			msg->IsTimer() == timer &&
-			!msg->IsDelivered() )
-		{
-			delete( msg );
-			i = m_delayedMessages.erase( i );
+	if( MustDefer() )
+	{	//Receivers can't be touched from here
+		Defer( DEFERRED_BROADCAST, 0.0f, msg, type );
+		return;
+	}
+
+	CountTelemetry( TELEMETRY_MSGS_SENT );
+
+	//The receivers are taken up front, since handlers may store or remove objects
+	//of the type. Objects removed before their turn are skipped (looked up by ID),
+	//and objects stored while broadcasting don't get the message.
+	if( m_broadcastDepth == m_broadcastSnapshots.size() ) {
+		m_broadcastSnapshots.push_back( ObjectIDList() );
+	}
+	ObjectIDList & receivers = m_broadcastSnapshots[m_broadcastDepth++];
+	receivers.clear();
+
+	if( g_database.IsSingleType( type ) )
+	{	//The database's membership list (no allocation once the snapshot has grown)
+		dbCompositionList & list = g_database.GetObjectsOfType( type );
+		for( unsigned int i=0; i<list.size(); ++i ) {
+			receivers.push_back( list[i]->GetID() );
 		}
-		else
-		{
-			++i;
+	}
+	else
+	{	//Combinations of types need their own list
+		dbCompositionList list;
+		g_database.ComposeList( list, type );
+		for( unsigned int i=0; i<list.size(); ++i ) {
+			receivers.push_back( list[i]->GetID() );
+		}
+	}
+
+	for( unsigned int i=0; i<receivers.size(); ++i )
+	{
+		GameObject * object = g_database.Find( receivers[i] );
+		if( object ) {
+			BroadcastTo( msg, object );
 		}
 	}
+	m_broadcastDepth--;
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         PurgeScopedMsg
+  Name:         SendMsgBroadcastInRadius
 
-  Description:  Removes messages from the delayed message list for a given
-                receiver if the message is scoped to a particular state. This
-				is useful if the receiver changes state machines, since the 
-				messages are no longer valid.
+  Description:  Sends a message to every object of a certain type within a
+                radius of a point, either now or next frame.
 
-  Arguments:    receiver : the receiver ID of the message
-                queue    : the queue to operate on
+  Arguments:    msg       : the message to broadcast
+                center    : the point
+				radius    : the distance (on the ground plane)
+                type      : the type of object (optional)
+				nextFrame : queue the broadcast for the next delivery (optional)
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void MsgRoute::PurgeScopedMsg( objectID receiver, StateMachineQueue queue )
+void MsgRoute::SendMsgBroadcastInRadius( MSG_Object & msg, const Vector3 & center, float radius, unsigned int type, bool nextFrame )
 {
-	MessageContainer::iterator i = m_delayedMessages.begin();
-	while( i != m_delayedMessages.end() )
+	if( MustDefer() )
+	{	//Receivers (and their positions) can't be touched from here
+		DeferredMsg deferred;
+		deferred.m_command = DEFERRED_AREA_BROADCAST;
+		deferred.m_delay = 0.0f;
+		deferred.m_broadcastType = type;
+		deferred.m_center = center;
+		deferred.m_radius = radius;
+		deferred.m_nextFrame = nextFrame;
+		deferred.m_msg = msg;
+		Defer( deferred );
+		return;
+	}
+
+	if( nextFrame )
 	{
-		MSG_Object * msg = *i;
-		if( msg->GetReceiver() == receiver &&
-			msg->GetQueue() == queue &&
-			msg->GetScopeRule() != SCOPE_TO_STATE_MACHINE &&
-			!msg->IsDelivered() )
-		{
-			delete( msg );
-			i = m_delayedMessages.erase( i );
-		}
-		else
-		{
-			++i;
-		}
+		AreaBroadcast broadcast;
+		broadcast.m_msg = msg;
+		broadcast.m_center = center;
+		broadcast.m_radius = radius;
+		broadcast.m_type = type;
+		m_areaBroadcasts.push_back( broadcast );
+		return;
+	}
+
+	CountTelemetry( TELEMETRY_MSGS_SENT );
+
+	//Receivers are found first, since they may move or store new objects while handling the message
+	std::vector<GameObject*> list;
+	FindObjectsInRadius( center, radius, type, list );
+	for( unsigned int i=0; i<list.size(); ++i )
+	{
+		BroadcastTo( msg, list[i] );
 	}
 }
 
+/*---------------------------------------------------------------------------*
+  Name:         FindObjectsInRadius
+
+  Description:  Finds the objects of a type within a radius of a point, with
+                the SpatialGrid if it exists (otherwise every object of the
+				type is tested).
 
+  Arguments:    center : the point
+				radius : the distance (on the ground plane)
+                type   : the type of object
+				list   : filled with the objects
 
+  Returns:      None. (The result is stored in the list argument.)
+ *---------------------------------------------------------------------------*/
+void MsgRoute::FindObjectsInRadius( const Vector3 & center, float radius, unsigned int type, std::vector<GameObject*> & list )
+{
+	if( SpatialGrid::DoesSingletonExist() )
+	{
+		g_spatialgrid.FindInRadius( center, radius, list, type );
+		return;
+	}
 
+	dbCompositionList candidates;
+	g_database.ComposeList( candidates, type );
+	for( unsigned int i=0; i<candidates.size(); ++i )
+	{
+		if( candidates[i]->HasBody() )
+		{
+			Vector3 & pos = candidates[i]->GetBody().GetPos();
+			float dx = pos.x - center.x;
+			float dz = pos.z - center.z;
+			if( dx * dx + dz * dz <= radius * radius ) {
+				list.push_back( candidates[i] );
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DeliverAreaBroadcasts
+
+  Description:  Delivers the area broadcasts queued for this frame. Ones
+                queued while delivering wait for the next frame.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::DeliverAreaBroadcasts( void )
+{
+	AreaBroadcastContainer broadcasts;
+	broadcasts.swap( m_areaBroadcasts );
+
+	for( AreaBroadcastContainer::iterator i=broadcasts.begin(); i!=broadcasts.end(); ++i )
+	{
+		SendMsgBroadcastInRadius( i->m_msg, i->m_center, i->m_radius, i->m_type, false );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Subscribe
+
+  Description:  Subscribes a state machine to a topic until it leaves the
+                scope. Subscribing again only changes the scope.
+
+  Arguments:    topic : the topic
+                id    : the owner of the state machine
+				queue : the queue of the state machine
+				rule  : what the subscription is scoped to
+				scope : the state or substate scope (see 
+				        StateMachine::GetScopeStateMachine for the state
+						machine's)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::Subscribe( MsgTopic topic, objectID id, StateMachineQueue queue, Scope_Rule rule, unsigned int scope )
+{
+	ASSERTMSG( queue < STATE_MACHINE_QUEUE_ALL, "MsgRoute::Subscribe - A subscription is for a single queue" );
+
+	if( MustDefer() )
+	{
+		MSG_Data data;
+		MSG_Object msg( 0.0f, MSG_NULL, INVALID_OBJECT_ID, id, rule, scope, queue, data, false, false );
+		Defer( DEFERRED_SUBSCRIBE, 0.0f, msg, topic );
+		return;
+	}
+
+	Topic & entry = m_topics[topic];
+	for( MsgTopicSubscriberContainer::iterator i=entry.m_subscribers.begin(); i!=entry.m_subscribers.end(); ++i )
+	{
+		if( i->m_id == id && i->m_queue == (unsigned int)queue )
+		{
+			i->m_rule = rule;
+			i->m_scope = scope;
+			return;
+		}
+	}
+
+	MsgTopicSubscriber subscriber;
+	subscriber.m_id = id;
+	subscriber.m_queue = queue;
+	subscriber.m_rule = rule;
+	subscriber.m_scope = scope;
+	entry.m_subscribers.push_back( subscriber );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Unsubscribe
+
+  Description:  Ends the subscription of a state machine to a topic.
+
+  Arguments:    topic : the topic
+                id    : the owner of the state machine
+				queue : the queue of the state machine
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::Unsubscribe( MsgTopic topic, objectID id, StateMachineQueue queue )
+{
+	if( MustDefer() )
+	{
+		MSG_Data data;
+		MSG_Object msg( 0.0f, MSG_NULL, INVALID_OBJECT_ID, id, SCOPE_TO_STATE_MACHINE, 0, queue, data, false, false );
+		Defer( DEFERRED_UNSUBSCRIBE, 0.0f, msg, topic );
+		return;
+	}
+
+	TopicContainer::iterator t = m_topics.find( topic );
+	if( t == m_topics.end() ) {
+		return;
+	}
+
+	MsgTopicSubscriberContainer & subscribers = t->second.m_subscribers;
+	for( MsgTopicSubscriberContainer::iterator i=subscribers.begin(); i!=subscribers.end(); ++i )
+	{
+		if( i->m_id == id && i->m_queue == (unsigned int)queue )
+		{	//Marked only, since a fan-out may be walking the array
+			i->m_id = INVALID_OBJECT_ID;
+			t->second.m_dirty = true;
+			break;
+		}
+	}
+
+	if( t->second.m_publishing == 0 ) {
+		CompactTopic( t );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Publish
+
+  Description:  Sends a message to the state machines subscribed to a topic,
+                either now or next frame. Subscribers whose scope was left
+				are dropped on the way, and ones added by the handlers only
+				get the next publish.
+
+  Arguments:    topic     : the topic
+                msg       : the message (the receiver and queue are set 
+				            for each subscriber)
+				nextFrame : queue the publish for the next delivery (optional)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::Publish( MsgTopic topic, MSG_Object & msg, bool nextFrame )
+{
+	if( MustDefer() )
+	{	//Receivers can't be touched from here
+		DeferredMsg deferred;
+		deferred.m_command = DEFERRED_PUBLISH;
+		deferred.m_delay = 0.0f;
+		deferred.m_broadcastType = topic;
+		deferred.m_radius = 0.0f;
+		deferred.m_nextFrame = nextFrame;
+		deferred.m_msg = msg;
+		Defer( deferred );
+		return;
+	}
+
+	if( nextFrame )
+	{
+		QueuedPublish publish;
+		publish.m_msg = msg;
+		publish.m_topic = topic;
+		m_publishes.push_back( publish );
+		return;
+	}
+
+	CountTelemetry( TELEMETRY_MSGS_SENT );
+
+	TopicContainer::iterator t = m_topics.find( topic );
+	if( t == m_topics.end() ) {
+		return;
+	}
+
+	Topic & entry = t->second;
+	MSG_Object copy = msg;
+	copy.SetScopeRule( SCOPE_TO_STATE_MACHINE );	//The subscription scope is checked here
+	copy.SetCC( false );
+
+	entry.m_publishing++;
+	unsigned int count = (unsigned int)entry.m_subscribers.size();
+	for( unsigned int i=0; i<count; ++i )
+	{	//Indexed and copied, since handlers may subscribe (growing the array)
+		MsgTopicSubscriber subscriber = entry.m_subscribers[i];
+		if( subscriber.m_id == INVALID_OBJECT_ID ) {
+			continue;
+		}
+
+		GameObject * object = g_database.Find( subscriber.m_id );
+		if( !IsSubscriberInScope( subscriber, object ) )
+		{	//Scope left (or the object is gone) - the subscription is over
+			entry.m_subscribers[i].m_id = INVALID_OBJECT_ID;
+			entry.m_dirty = true;
+			continue;
+		}
+		if( subscriber.m_id == msg.GetSender() ) {
+			continue;
+		}
+
+		copy.SetReceiver( subscriber.m_id );
+		copy.SetQueue( subscriber.m_queue );
+		copy.SetDelivered( false );
+		RouteMsgToObject( copy, object );
+	}
+	entry.m_publishing--;
+
+	if( entry.m_publishing == 0 ) {
+		CompactTopic( t );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetNumSubscribers
+
+  Description:  The number of state machines subscribed to a topic.
+
+  Arguments:    topic : the topic
+
+  Returns:      The number of subscribers.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgRoute::GetNumSubscribers( MsgTopic topic )
+{
+	TopicContainer::iterator t = m_topics.find( topic );
+	if( t == m_topics.end() ) {
+		return( 0 );
+	}
+
+	unsigned int count = 0;
+	for( MsgTopicSubscriberContainer::iterator i=t->second.m_subscribers.begin(); i!=t->second.m_subscribers.end(); ++i )
+	{
+		if( i->m_id != INVALID_OBJECT_ID ) {
+			count++;
+		}
+	}
+	return( count );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SubscribeCC
+
+  Description:  Has an observer get a copy of every message handled by the
+                source's state machines. Subscribing again does nothing.
+
+  Arguments:    source   : the object whose messages are copied
+                observer : the object that gets the copies
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::SubscribeCC( objectID source, objectID observer )
+{
+	if( MustDefer() )
+	{
+		MSG_Data data;
+		MSG_Object msg( 0.0f, MSG_NULL, source, observer, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, true );
+		Defer( DEFERRED_SUBSCRIBE_CC, 0.0f, msg, 0 );
+		return;
+	}
+
+	GameObject * object = g_database.Find( source );
+	ASSERTMSG( object, "MsgRoute::SubscribeCC - The source doesn't exist" );
+	if( !object || observer == INVALID_OBJECT_ID ) {
+		return;
+	}
+
+	ObjectIDList & observers = m_ccSubscriptions[source];
+	if( std::find( observers.begin(), observers.end(), observer ) == observers.end() ) {
+		observers.push_back( observer );
+	}
+	object->SetCCObserved( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         UnsubscribeCC
+
+  Description:  Ends a CC subscription.
+
+  Arguments:    source   : the object whose messages are copied
+                observer : the object that gets the copies
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::UnsubscribeCC( objectID source, objectID observer )
+{
+	if( MustDefer() )
+	{
+		MSG_Data data;
+		MSG_Object msg( 0.0f, MSG_NULL, source, observer, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, true );
+		Defer( DEFERRED_UNSUBSCRIBE_CC, 0.0f, msg, 0 );
+		return;
+	}
+
+	CCSubscriptionContainer::iterator s = m_ccSubscriptions.find( source );
+	if( s == m_ccSubscriptions.end() ) {
+		return;
+	}
+
+	ObjectIDList & observers = s->second;
+	ObjectIDList::iterator i = std::find( observers.begin(), observers.end(), observer );
+	if( i != observers.end() ) {
+		observers.erase( i );
+	}
+	if( observers.empty() )
+	{
+		m_ccSubscriptions.erase( s );
+		GameObject * object = g_database.Find( source );
+		if( object ) {
+			object->SetCCObserved( false );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetNumCCObservers
+
+  Description:  The number of objects subscribed to the messages of a source.
+
+  Arguments:    source : the source
+
+  Returns:      The number of observers.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgRoute::GetNumCCObservers( objectID source )
+{
+	CCSubscriptionContainer::iterator s = m_ccSubscriptions.find( source );
+	return( s == m_ccSubscriptions.end() ? 0 : (unsigned int)s->second.size() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BeginCC
+
+  Description:  Copies a message that the source is about to process to its
+                observers. The copies are batched until the matching EndCC,
+				except during a parallel update (or on another thread),
+				where each copy is sent like any other message.
+
+  Arguments:    msg      : the message
+                source   : the object processing it
+				receiver : the CC receiver of the state machine (0 if none)
+
+  Returns:      True if the copies were batched (EndCC must be called once
+                the processing is done).
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::BeginCC( MSG_Object & msg, GameObject & source, objectID receiver )
+{
+	CCSubscriptionContainer::iterator s = source.IsCCObserved() ? m_ccSubscriptions.find( source.GetID() ) : m_ccSubscriptions.end();
+
+	if( MustDefer() )
+	{	//Deferred sends, replayed in update order (the subscriptions only change on the main thread)
+		if( receiver != INVALID_OBJECT_ID ) {
+			SendMsg( 0.0f, msg.GetName(), receiver, source.GetID(), SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, msg.GetMsgData(), false, true );
+		}
+		if( s != m_ccSubscriptions.end() )
+		{
+			for( ObjectIDList::iterator i=s->second.begin(); i!=s->second.end(); ++i ) {
+				SendMsg( 0.0f, msg.GetName(), *i, source.GetID(), SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, msg.GetMsgData(), false, true );
+			}
+		}
+		return( false );
+	}
+
+	m_ccDepth++;
+	if( receiver != INVALID_OBJECT_ID ) {
+		QueueCC( msg, source.GetID(), receiver );
+	}
+	if( s != m_ccSubscriptions.end() )
+	{
+		for( ObjectIDList::iterator i=s->second.begin(); i!=s->second.end(); ++i ) {
+			QueueCC( msg, source.GetID(), *i );
+		}
+	}
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         QueueCC
+
+  Description:  Adds a copy of a message to the CC batch. Copies that have to
+                go through the send checks (flow limits, other shards) are
+				sent instead.
+
+  Arguments:    msg      : the message
+                source   : the object processing it
+				observer : the object that gets the copy
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::QueueCC( MSG_Object & msg, objectID source, objectID observer )
+{
+	if( m_flowLimited || ( Shard::DoesSingletonExist() && !g_shard.IsLocal( observer ) ) )
+	{
+		SendMsg( 0.0f, msg.GetName(), observer, source, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, msg.GetMsgData(), false, true );
+		return;
+	}
+
+	CountTelemetry( TELEMETRY_MSGS_SENT );
+	m_ccBatch.push_back( MSG_Object( g_frame.m_time, msg.GetName(), source, observer, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, msg.GetMsgData(), false, true ) );
+}
+
+bool MsgRoute::CompareCCObservers( const MSG_Object & a, const MSG_Object & b )
+{
+	return( const_cast<MSG_Object&>( a ).GetReceiver() < const_cast<MSG_Object&>( b ).GetReceiver() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DeliverCCBatch
+
+  Description:  Delivers the batched CC copies, grouped by observer (in the
+                order they were made for each observer). Copies made while
+				delivering (by observers that are observed themselves)
+				follow in another round.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::DeliverCCBatch( void )
+{
+	m_ccDelivering = true;
+	while( !m_ccBatch.empty() )
+	{
+		m_ccRound.swap( m_ccBatch );
+		std::stable_sort( m_ccRound.begin(), m_ccRound.end(), CompareCCObservers );
+		m_numCCBatches++;
+
+		objectID observer = INVALID_OBJECT_ID;
+		GameObject * object = 0;
+		for( CCBatchContainer::iterator i=m_ccRound.begin(); i!=m_ccRound.end(); ++i )
+		{
+			if( i->GetReceiver() != observer )
+			{	//Looked up once per observer
+				observer = i->GetReceiver();
+				object = g_database.Find( observer );
+			}
+			RouteMsgToObject( *i, object );
+		}
+		m_ccRound.clear();
+	}
+	m_ccDelivering = false;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DropCCSubscriptions
+
+  Description:  Ends the CC subscriptions of objects that are destroyed, both
+                the ones they are the source of and the ones they observe.
+
+  Arguments:    ids : the objects
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::DropCCSubscriptions( ObjectIDList & ids )
+{
+	for( ObjectIDList::iterator i=ids.begin(); i!=ids.end(); ++i ) {
+		m_ccSubscriptions.erase( *i );
+	}
+
+	CCSubscriptionContainer::iterator s = m_ccSubscriptions.begin();
+	while( s != m_ccSubscriptions.end() )
+	{
+		ObjectIDList & observers = s->second;
+		for( ObjectIDList::iterator i=ids.begin(); i!=ids.end(); ++i )
+		{
+			ObjectIDList::iterator found = std::find( observers.begin(), observers.end(), *i );
+			if( found != observers.end() ) {
+				observers.erase( found );
+			}
+		}
+
+		if( observers.empty() )
+		{
+			GameObject * object = g_database.Find( s->first );
+			if( object ) {
+				object->SetCCObserved( false );
+			}
+			m_ccSubscriptions.erase( s++ );
+		}
+		else {
+			++s;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DeliverPublishes
+
+  Description:  Fans out the publishes queued for this frame. Ones queued
+                while delivering wait for the next frame.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::DeliverPublishes( void )
+{
+	QueuedPublishContainer publishes;
+	publishes.swap( m_publishes );
+
+	for( QueuedPublishContainer::iterator i=publishes.begin(); i!=publishes.end(); ++i )
+	{
+		Publish( i->m_topic, i->m_msg, false );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         IsSubscriberInScope
+
+  Description:  Whether the state machine of a subscription is still in the
+                substate, state or state machine the subscription is scoped
+				to. Scopes are unique per queue, so a state machine that 
+				replaced the subscriber never matches.
+
+  Arguments:    subscriber : the subscription
+                object     : the subscriber's owner (0 if it doesn't exist)
+
+  Returns:      True if the subscription still holds.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::IsSubscriberInScope( MsgTopicSubscriber & subscriber, GameObject * object )
+{
+	if( object == 0 || !object->GetStateMachineManager() ) {
+		return( false );
+	}
+
+	StateMachine * mch = object->GetStateMachineManager()->GetStateMachine( (StateMachineQueue)subscriber.m_queue );
+	if( mch == 0 ) {
+		return( false );
+	}
+
+	switch( subscriber.m_rule )
+	{
+		case SCOPE_TO_SUBSTATE:		return( subscriber.m_scope == mch->GetScopeSubstate() );
+		case SCOPE_TO_STATE:		return( subscriber.m_scope == mch->GetScopeState() );
+		default:					return( subscriber.m_scope == mch->GetScopeStateMachine() );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CompactTopic
+
+  Description:  Removes the ended subscriptions from a topic (keeping the
+                order of the others), and the topic once it has none.
+
+  Arguments:    topic : the topic
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::CompactTopic( TopicContainer::iterator topic )
+{
+	Topic & entry = topic->second;
+	if( !entry.m_dirty ) {
+		return;
+	}
+
+	MsgTopicSubscriberContainer & subscribers = entry.m_subscribers;
+	unsigned int kept = 0;
+	for( unsigned int i=0; i<subscribers.size(); ++i )
+	{
+		if( subscribers[i].m_id != INVALID_OBJECT_ID ) {
+			subscribers[kept++] = subscribers[i];
+		}
+	}
+	subscribers.resize( kept );
+	entry.m_dirty = false;
+
+	if( subscribers.empty() ) {
+		m_topics.erase( topic );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BroadcastTo
+
+  Description:  Sends a broadcast message to one object (unless it is the
+                sender).
+
+  Arguments:    msg    : the message to broadcast
+                object : the receiver
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::BroadcastTo( MSG_Object & msg, GameObject * object )
+{
+	if( msg.GetSender() != object->GetID() )
+	{
+		if(object->GetStateMachineManager())
+		{
+			CountTelemetry( TELEMETRY_MSGS_DELIVERED );
+			object->GetStateMachineManager()->SendMsg( msg );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DeliverDelayedMessages
+
+  Description:  Sends delayed messages if the time is right. The next frame
+                messages sent before this call go first (in send order), 
+				then the due messages in time order. Once the frame budget
+				is used up only high priority messages are delivered; the
+				normal priority next frame messages left are scheduled as 
+				due. The budget is checked every 
+				MSG_LOAD_BALANCE_CHECK_INTERVAL messages.
+
+  Arguments:    frame : the current tick
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::DeliverDelayedMessages( const FrameContext & frame )
+{
+	ASSERTMSG( IsMainThread() && !m_deferring, "MsgRoute::DeliverDelayedMessages - Must be called from the main thread" );
+
+	BeginFlowFrame();
+
+	//Next frame messages sent from here on (including by the handlers) wait for the next call
+	MessageList & nextFrame = m_nextFrame[m_nextFrameIndex];
+	m_nextFrameIndex = 1 - m_nextFrameIndex;
+	for( MessageList::iterator i=nextFrame.begin(); i!=nextFrame.end(); ++i )
+	{	//Taken for delivery - a send from now on is no longer their duplicate
+		(*i)->SetQueuedNextFrame( false );
+	}
+
+	//Sync point for messages sent from other threads
+	DrainMailbox();
+
+	DeliverAreaBroadcasts();
+	DeliverPublishes();
+
+	CompactStaleMessages();
+
+	//Every message sent before the previous delivery has been handled by now
+	//(the ones still pending have their payloads copied into the pool)
+	m_frameArenaIndex = 1 - m_frameArenaIndex;
+	m_frameArena[m_frameArenaIndex].Reset();
+
+	double time = frame.m_time;
+	double ticksPerSecond = g_time.GetHighestResolutionFrequency();
+	double timeStart = g_time.GetHighestResolutionTime();
+	unsigned int delivered = 0;
+	bool overBudget = false;
+
+	if( m_batchedDelivery )
+	{
+		delivered = DeliverBatch( time, nextFrame, overBudget );
+	}
+	else
+	{
+		for( MessageList::iterator i=nextFrame.begin(); i!=nextFrame.end(); ++i )
+		{
+			MSG_Object * msg = *i;
+			if( !msg->IsBatched() )
+			{	//Removed while waiting
+				m_msgPool.Release( msg );
+				continue;
+			}
+			if( overBudget && msg->GetPriority() == MSG_PRIORITY_NORMAL )
+			{
+				CarryOver( msg );
+				continue;
+			}
+
+			msg->SetBatched( false );
+			m_duplicateIndex.Remove( msg );
+			m_receiverIndex.Remove( msg );
+			DeliverDueMsg( msg, g_database.Find( msg->GetReceiver() ), time );
+			delivered++;
+
+			//Decide whether to stop sending normal priority messages for this frame
+			if( !overBudget && m_loadBalancingTimeLimit > 0.0f && delivered % MSG_LOAD_BALANCE_CHECK_INTERVAL == 0 )
+			{
+				double elapsed = ( g_time.GetHighestResolutionTime() - timeStart ) / ticksPerSecond;
+				overBudget = elapsed > m_loadBalancingTimeLimit;
+			}
+		}
+
+		MsgScheduler * scheduler;
+		while( ( scheduler = GetNextDueScheduler( time, overBudget ) ) != 0 )
+		{	//Deliver and release msg (taken out of the scheduler first, so the
+			//receiver can freely send or remove delayed messages while handling it)
+			MSG_Object * msg = scheduler->GetNext();
+			scheduler->PopNext();
+			m_duplicateIndex.Remove( msg );
+			m_receiverIndex.Remove( msg );
+			DeliverDueMsg( msg, g_database.Find( msg->GetReceiver() ), time );
+			delivered++;
+
+			//Decide whether to stop sending normal priority messages for this frame
+			if( !overBudget && m_loadBalancingTimeLimit > 0.0f && delivered % MSG_LOAD_BALANCE_CHECK_INTERVAL == 0 )
+			{
+				double elapsed = ( g_time.GetHighestResolutionTime() - timeStart ) / ticksPerSecond;
+				overBudget = elapsed > m_loadBalancingTimeLimit;
+			}
+		}
+	}
+
+	nextFrame.clear();
+
+	WakeStateMachines( time );
+
+	//Stats
+	m_numDeliveredLastFrame = delivered;
+	m_deliveryBacklog = 0;
+	m_oldestLateMessageAge = 0.0f;
+	if( overBudget )
+	{
+		m_numFramesOverBudget++;
+		for( int i=0; i<MSG_PRIORITY_NUM; ++i )
+		{
+			MSG_Object * next = m_delayedMessages[i]->GetNext();
+			if( next && next->GetDeliveryTime() <= time )
+			{
+				m_deliveryBacklog += m_delayedMessages[i]->CountDue( time );
+				if( time - next->GetDeliveryTime() > m_oldestLateMessageAge ) {
+					m_oldestLateMessageAge = (float)( time - next->GetDeliveryTime() );
+				}
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DeliverBatch
+
+  Description:  Batched delivery. The next frame messages and every due 
+                message taken out of the schedulers are grouped by receiver
+				(next frame ones first, then in time order within a group)
+				and each group is delivered with a single receiver lookup.
+				The messages stay in the indexes until delivered, so 
+				handlers can still remove them. Once the frame budget is 
+				used up, the normal priority messages left go back to their
+				scheduler for the next frame.
+
+  Arguments:    time       : the current time
+                nextFrame  : the next frame messages (already flagged as batched)
+                overBudget : set if the frame budget was used up
+
+  Returns:      The number of messages delivered.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgRoute::DeliverBatch( double time, MessageList & nextFrame, bool & overBudget )
+{
+	double ticksPerSecond = g_time.GetHighestResolutionFrequency();
+	double timeStart = g_time.GetHighestResolutionTime();
+	unsigned int delivered = 0;
+
+	m_batch.clear();
+	m_carryOver.clear();
+
+	for( MessageList::iterator i=nextFrame.begin(); i!=nextFrame.end(); ++i )
+	{
+		BatchedMsg entry;
+		entry.m_msg = *i;
+		entry.m_order = (unsigned int)m_batch.size();
+		m_batch.push_back( entry );
+	}
+
+	MsgScheduler * scheduler;
+	while( ( scheduler = GetNextDueScheduler( time, false ) ) != 0 )
+	{
+		BatchedMsg entry;
+		entry.m_msg = scheduler->GetNext();
+		entry.m_order = (unsigned int)m_batch.size();
+		scheduler->PopNext();
+		entry.m_msg->SetBatched( true );
+		m_batch.push_back( entry );
+	}
+	std::stable_sort( m_batch.begin(), m_batch.end(), BatchedMsgReceiverOrder() );
+
+	unsigned int i = 0;
+	while( i < m_batch.size() )
+	{	//One group per receiver
+		objectID receiver = m_batch[i].m_msg->GetReceiver();
+		GameObject * object = g_database.Find( receiver );
+
+		for( ; i < m_batch.size() && m_batch[i].m_msg->GetReceiver() == receiver; ++i )
+		{
+			MSG_Object * msg = m_batch[i].m_msg;
+			if( !msg->IsBatched() )
+			{	//Removed while waiting
+				m_msgPool.Release( msg );
+				continue;
+			}
+			if( overBudget && msg->GetPriority() == MSG_PRIORITY_NORMAL )
+			{
+				m_carryOver.push_back( m_batch[i] );
+				continue;
+			}
+
+			msg->SetBatched( false );
+			m_duplicateIndex.Remove( msg );
+			m_receiverIndex.Remove( msg );
+			DeliverDueMsg( msg, object, time );
+			delivered++;
+
+			//Decide whether to stop sending normal priority messages for this frame
+			if( !overBudget && m_loadBalancingTimeLimit > 0.0f && delivered % MSG_LOAD_BALANCE_CHECK_INTERVAL == 0 )
+			{
+				double elapsed = ( g_time.GetHighestResolutionTime() - timeStart ) / ticksPerSecond;
+				overBudget = elapsed > m_loadBalancingTimeLimit;
+			}
+		}
+	}
+
+	//Back into the schedulers in time order, so they keep their place among equal delivery times
+	std::sort( m_carryOver.begin(), m_carryOver.end(), BatchedMsgTimeOrder() );
+	for( BatchedMsgContainer::iterator c=m_carryOver.begin(); c!=m_carryOver.end(); ++c )
+	{
+		MSG_Object * msg = c->m_msg;
+		if( msg->IsBatched() )
+		{
+			CarryOver( msg );
+		}
+		else
+		{	//Removed while waiting
+			m_msgPool.Release( msg );
+		}
+	}
+
+	m_batch.clear();
+	m_carryOver.clear();
+	return( delivered );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CarryOver
+
+  Description:  Puts a message that was due but left over by the frame 
+                budget into its scheduler. It keeps its delivery time, so
+				it comes out among the due messages of the next frame.
+
+  Arguments:    msg : the message (flagged as batched, still indexed)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::CarryOver( MSG_Object * msg )
+{
+	msg->SetBatched( false );
+	m_delayedMessages[msg->GetPriority()]->Insert( msg );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetNextDueScheduler
+
+  Description:  Finds the scheduler holding the earliest message that is due.
+                Ties between the schedulers go to the message sent first.
+
+  Arguments:    time             : the current time
+                highPriorityOnly : only look at the high priority messages
+
+  Returns:      The scheduler or 0 if no message is due.
+ *---------------------------------------------------------------------------*/
+MsgScheduler * MsgRoute::GetNextDueScheduler( double time, bool highPriorityOnly )
+{
+	MsgScheduler * scheduler = 0;
+	MSG_Object * earliest = 0;
+
+	for( int i=highPriorityOnly ? MSG_PRIORITY_HIGH : 0; i<MSG_PRIORITY_NUM; ++i )
+	{
+		MSG_Object * next = m_delayedMessages[i]->GetNext();
+		if( next == 0 || next->GetDeliveryTime() > time ) {
+			continue;
+		}
+
+		if( earliest == 0 ||
+			next->GetDeliveryTime() < earliest->GetDeliveryTime() ||
+			( next->GetDeliveryTime() == earliest->GetDeliveryTime() && (int)( next->GetSendSequence() - earliest->GetSendSequence() ) < 0 ) )
+		{
+			scheduler = m_delayedMessages[i];
+			earliest = next;
+		}
+	}
+
+	return( scheduler );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RouteMsg
+
+  Description:  Routes the message to the receiver, only if the scoping rules
+                allow it.
+
+  Arguments:    msg : the message to route
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::RouteMsg( MSG_Object & msg )
+{
+	RouteMsgToObject( msg, g_database.Find( msg.GetReceiver() ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RouteMsgToObject
+
+  Description:  Routes the message to a receiver that was already looked up,
+                only if the scoping rules allow it.
+
+  Arguments:    msg    : the message to route
+                object : the receiver (0 if it doesn't exist)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::RouteMsgToObject( MSG_Object & msg, GameObject * object )
+{
+	if( object != 0 && object->GetStateMachineManager() )
+	{
+		if( IsInScope( msg, object ) )
+		{	//Scope matches
+			CountTelemetry( TELEMETRY_MSGS_DELIVERED );
+			msg.SetDelivered( true );	//Important to set as delivered, so a handler removing
+										//messages doesn't match the one being handled
+			if( MsgRecorder::DoesSingletonExist() ) {
+				g_msgrecorder.Delivered( msg );
+			}
+			
+			if( msg.IsCC() ) {
+				object->GetStateMachineManager()->Process( EVENT_CCMessage, &msg, (StateMachineQueue)msg.GetQueue() );
+			}
+			else {
+				object->GetStateMachineManager()->Process( EVENT_Message, &msg, (StateMachineQueue)msg.GetQueue() );
+			}
+		}
+		else
+		{	//The receiver left the state or substate the message was scoped to
+			CountTelemetry( TELEMETRY_MSGS_DROPPED_BY_SCOPE );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DeliverDueMsg
+
+  Description:  Delivers a delayed message that was taken out of the
+                scheduler and indexes. A timer still in scope is put back
+				in place for its next period before the handler runs (as
+				if sent again), and a copy is handled; anything else is
+				released once handled.
+
+  Arguments:    msg    : the message (from the pool)
+                object : the receiver (0 if it doesn't exist)
+				time   : the current time
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::DeliverDueMsg( MSG_Object * msg, GameObject * object, double time )
+{
+	if( msg->IsTimer() && object != 0 && object->GetStateMachineManager() && IsInScope( *msg, object ) )
+	{
+		MSG_Object copy = *msg;
+
+		CountTelemetry( TELEMETRY_MSGS_SENT );
+		msg->SetDeliveryTime( time + msg->GetPeriod() );
+		msg->SetSendSequence( m_nextSendSequence++ );
+		m_delayedMessages[msg->GetPriority()]->Insert( msg );
+		m_duplicateIndex.Insert( msg );
+		m_receiverIndex.Insert( msg );
+
+		RouteMsgToObject( copy, object );
+	}
+	else
+	{
+		RouteMsgToObject( *msg, object );
+		m_msgPool.Release( msg );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         IsInScope
+
+  Description:  Whether the receiver is still in the state or substate the
+                message is scoped to.
+
+  Arguments:    msg    : the message
+                object : the receiver (must have a state machine manager)
+
+  Returns:      True if the message can be delivered.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::IsInScope( MSG_Object & msg, GameObject * object )
+{
+	Scope_Rule rule = msg.GetScopeRule();
+	if( rule == SCOPE_TO_STATE_MACHINE ) {
+		return( true );
+	}
+
+	StateMachine * mch = object->GetStateMachineManager()->GetStateMachine( (StateMachineQueue)msg.GetQueue() );
+	return( mch != 0 &&
+			( ( rule == SCOPE_TO_SUBSTATE && msg.GetScope() == mch->GetScopeSubstate() ) ||
+			  ( rule == SCOPE_TO_STATE && msg.GetScope() == mch->GetScopeState() ) ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RemoveMsg
+
+  Description:  Removes messages from the delayed message list that meet
+                the criteria. This is useful to avoid duplicate delayed
+				messages.
+
+  Arguments:    name     : the name of the message
+                receiver : the receiver ID of the message
+				sender   : the sender ID of the message
+				timer    : whether the message is a timer
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::RemoveMsg( MSG_Name name, objectID receiver, objectID sender, bool timer )
+{
+	if( MustDefer() )
+	{
+		MSG_Data data;
+		MSG_Object msg( 0.0f, name, sender, receiver, SCOPE_TO_STATE_MACHINE, 0, 0, data, timer, false );
+		Defer( DEFERRED_REMOVE, 0.0f, msg, 0 );
+		return;
+	}
+
+	RemoveMsgPredicate match( name, receiver, sender, timer );
+	MessageList list;
+	m_receiverIndex.FindAll( receiver, match, list );
+
+	for( MessageList::iterator i=list.begin(); i!=list.end(); ++i )
+	{
+		RemoveDelayedMsg( *i );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         PurgeScopedMsg
+
+  Description:  Retires the delayed messages for a given receiver that are
+                scoped to a particular state. This is useful if the receiver
+				changes state machines, since the messages are no longer 
+				valid. Time complexity O(log receivers) - the messages are 
+				only marked stale (see CompactStaleMessages).
+
+  Arguments:    receiver : the receiver ID of the message
+                queue    : the queue to operate on
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::PurgeScopedMsg( objectID receiver, StateMachineQueue queue )
+{
+	if( MustDefer() )
+	{
+		MSG_Data data;
+		MSG_Object msg( 0.0f, MSG_NULL, INVALID_OBJECT_ID, receiver, SCOPE_TO_STATE_MACHINE, 0, queue, data, false, false );
+		Defer( DEFERRED_PURGE, 0.0f, msg, 0 );
+		return;
+	}
+
+	m_receiverIndex.RetireScopes( receiver, queue );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ScheduleTimerWake
+
+  Description:  Wakes a state machine at a given time, so it can run its
+                OnTimeIn... handlers that are due (see 
+				StateMachine::FireTimers). Time complexity O(log wake-ups).
+
+  Arguments:    time     : when to wake the state machine
+                receiver : the owner of the state machine
+				queue    : the queue of the state machine
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::ScheduleTimerWake( double time, objectID receiver, StateMachineQueue queue )
+{
+	if( MustDefer() )
+	{
+		MSG_Data data;
+		MSG_Object msg( time, MSG_NULL, INVALID_OBJECT_ID, receiver, SCOPE_TO_STATE_MACHINE, 0, queue, data, false, false );
+		Defer( DEFERRED_TIMER_WAKE, 0.0f, msg, 0 );
+		return;
+	}
+
+	TimerWake wake;
+	wake.m_time = time;
+	wake.m_receiver = receiver;
+	wake.m_queue = queue;
+	m_timerWakes.push_back( wake );
+	std::push_heap( m_timerWakes.begin(), m_timerWakes.end(), TimerWakeLater() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WakeStateMachines
+
+  Description:  Wakes the state machines whose wake-up is due, earliest 
+                first. A state machine may schedule another wake-up while
+				it runs its handlers.
+
+  Arguments:    time : the current time
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::WakeStateMachines( double time )
+{
+	while( !m_timerWakes.empty() && m_timerWakes.front().m_time <= time )
+	{
+		TimerWake wake = m_timerWakes.front();
+		std::pop_heap( m_timerWakes.begin(), m_timerWakes.end(), TimerWakeLater() );
+		m_timerWakes.pop_back();
+
+		GameObject * object = g_database.Find( wake.m_receiver );
+		if( object && object->GetStateMachineManager() )
+		{
+			StateMachine * mch = object->GetStateMachineManager()->GetStateMachine( (StateMachineQueue)wake.m_queue );
+			if( mch ) {
+				mch->FireTimers( wake.m_time );
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CompactStaleMessages
+
+  Description:  Removes the pending scoped messages whose scope has been 
+                left, once they make up enough of the pending messages. 
+				Until then they are dropped when they come due, so the cost
+				of the sweep is spread over many state changes.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::CompactStaleMessages( void )
+{
+	unsigned int stale = m_receiverIndex.GetNumStale();
+	if( stale < MSG_STALE_COMPACT_MIN || stale * 2 < GetNumDelayedMessages() ) {
+		return;
+	}
+
+	MessageList list;
+	m_receiverIndex.FindStale( list );
+
+	for( MessageList::iterator i=list.begin(); i!=list.end(); ++i )
+	{
+		CountTelemetry( TELEMETRY_MSGS_DROPPED_BY_SCOPE );
+		RemoveDelayedMsg( *i );
+	}
+	ASSERTMSG( m_receiverIndex.GetNumStale() == 0, "MsgRoute::CompactStaleMessages - Stale count out of sync" );
+}
+
+
+
+/*---------------------------------------------------------------------------*
+  Name:         PurgeMsgsForReceivers
+
+  Description:  Removes every delayed message addressed to any of the given
+                receivers, and their CC subscriptions (as sources and as
+				observers). Used when a batch of objects is destroyed.
+
+  Arguments:    receivers : the receiver IDs
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::PurgeMsgsForReceivers( ObjectIDList & receivers )
+{
+	AnyMsgPredicate match;
+	MessageList list;
+	for( ObjectIDList::iterator i=receivers.begin(); i!=receivers.end(); ++i )
+	{
+		m_receiverIndex.FindAll( *i, match, list );
+	}
+
+	for( MessageList::iterator i=list.begin(); i!=list.end(); ++i )
+	{
+		RemoveDelayedMsg( *i );
+	}
+
+	if( !m_ccSubscriptions.empty() ) {
+		DropCCSubscriptions( receivers );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RemoveDelayedMsg
+
+  Description:  Takes a pending message out of the scheduler and the
+                indexes, then returns it to the pool. A message that isn't
+				in a scheduler (next frame queue or delivery batch) is only
+				taken out of the indexes; its holder releases it.
+
+  Arguments:    msg : the pending message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::RemoveDelayedMsg( MSG_Object * msg )
+{
+	if( msg->IsBatched() )
+	{	//Waiting in the next frame queue or a batched delivery (released when it gets there)
+		msg->SetBatched( false );
+		msg->SetQueuedNextFrame( false );
+		m_duplicateIndex.Remove( msg );
+		m_receiverIndex.Remove( msg );
+		return;
+	}
+
+	m_delayedMessages[msg->GetPriority()]->Remove( msg );
+	m_duplicateIndex.Remove( msg );
+	m_receiverIndex.Remove( msg );
+	m_msgPool.Release( msg );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BeginDeferral
+
+  Description:  Starts buffering MsgRoute calls. Called by the database 
+                before objects are updated in parallel.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::BeginDeferral( void )
+{
+	ASSERTMSG( !m_deferring, "MsgRoute::BeginDeferral - Already deferring" );
+
+	for( unsigned int i=0; i<JOB_SYSTEM_MAX_WORKERS; i++ )
+	{
+		m_deferred[i].m_msgs.clear();
+		m_deferred[i].m_order = 0;
+		m_deferred[i].m_object = INVALID_OBJECT_ID;
+	}
+
+	m_deferring = true;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetDeferralContext
+
+  Description:  Records which object a worker is about to update, so its
+                buffered calls can be replayed in update order.
+
+  Arguments:    worker : the worker index
+                order  : the update order of the object
+				object : the object ID
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::SetDeferralContext( unsigned int worker, unsigned int order, objectID object )
+{
+	m_deferred[worker].m_order = order;
+	m_deferred[worker].m_object = object;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         EndDeferral
+
+  Description:  Stops buffering and replays every buffered call. Calls are 
+                replayed in the update order of the objects that made them
+				(and in call order for each object), so the result doesn't 
+				depend on how objects were spread over the threads.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::EndDeferral( void )
+{
+	ASSERTMSG( m_deferring, "MsgRoute::EndDeferral - Not deferring" );
+
+	DeferredMsgContainer merged;
+	for( unsigned int i=0; i<JOB_SYSTEM_MAX_WORKERS; i++ )
+	{
+		merged.insert( merged.end(), m_deferred[i].m_msgs.begin(), m_deferred[i].m_msgs.end() );
+		m_deferred[i].m_msgs.clear();
+	}
+	std::stable_sort( merged.begin(), merged.end(), DeferredMsgOrder() );
+
+	m_deferring = false;
+
+	Replay( merged );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DrainMailbox
+
+  Description:  Replays the calls made from other threads since the last
+                drain. Main thread only.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::DrainMailbox( void )
+{
+	ASSERTMSG( IsMainThread(), "MsgRoute::DrainMailbox - Must be called from the main thread" );
+
+	if( !m_mailbox.IsEmpty() )
+	{
+		DeferredMsgContainer msgs;
+		m_mailbox.Drain( msgs );
+		Replay( msgs );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Replay
+
+  Description:  Makes buffered calls for real, in list order.
+
+  Arguments:    msgs : the buffered calls
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::Replay( DeferredMsgContainer & msgs )
+{
+	for( DeferredMsgContainer::iterator i=msgs.begin(); i!=msgs.end(); ++i )
+	{
+		MSG_Object & msg = i->m_msg;
+		switch( i->m_command )
+		{
+			case DEFERRED_SEND:
+				SendMsg( i->m_delay, msg.GetName(), msg.GetReceiver(), msg.GetSender(), 
+				         msg.GetScopeRule(), msg.GetScope(), (StateMachineQueue)msg.GetQueue(), 
+				         msg.GetMsgData(), msg.IsTimer(), msg.IsCC() );
+				break;
+
+			case DEFERRED_BROADCAST:
+				SendMsgBroadcast( msg, i->m_broadcastType );
+				break;
+
+			case DEFERRED_AREA_BROADCAST:
+				SendMsgBroadcastInRadius( msg, i->m_center, i->m_radius, i->m_broadcastType, i->m_nextFrame );
+				break;
+
+			case DEFERRED_REMOVE:
+				RemoveMsg( msg.GetName(), msg.GetReceiver(), msg.GetSender(), msg.IsTimer() );
+				break;
+
+			case DEFERRED_PURGE:
+				PurgeScopedMsg( msg.GetReceiver(), (StateMachineQueue)msg.GetQueue() );
+				break;
+
+			case DEFERRED_TIMER_WAKE:
+				ScheduleTimerWake( msg.GetDeliveryTime(), msg.GetReceiver(), (StateMachineQueue)msg.GetQueue() );
+				break;
+
+			case DEFERRED_SUBSCRIBE:
+				Subscribe( i->m_broadcastType, msg.GetReceiver(), (StateMachineQueue)msg.GetQueue(), msg.GetScopeRule(), msg.GetScope() );
+				break;
+
+			case DEFERRED_UNSUBSCRIBE:
+				Unsubscribe( i->m_broadcastType, msg.GetReceiver(), (StateMachineQueue)msg.GetQueue() );
+				break;
+
+			case DEFERRED_PUBLISH:
+				Publish( i->m_broadcastType, msg, i->m_nextFrame );
+				break;
+
+			case DEFERRED_SUBSCRIBE_CC:
+				SubscribeCC( msg.GetSender(), msg.GetReceiver() );
+				break;
+
+			case DEFERRED_UNSUBSCRIBE_CC:
+				UnsubscribeCC( msg.GetSender(), msg.GetReceiver() );
+				break;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Defer
+
+  Description:  Buffers a call on the calling worker's deferral buffer, or
+                in the mailbox when called from any other thread.
+
+  Arguments:    command : the call to buffer
+                delay   : the message delay (sends only)
+				msg     : the message or removal criteria
+				type    : the object type (broadcasts only)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::Defer( DeferredMsgCommand command, float delay, MSG_Object & msg, unsigned int type )
+{
+	DeferredMsg deferred;
+	deferred.m_command = command;
+	deferred.m_delay = delay;
+	deferred.m_broadcastType = type;
+	deferred.m_radius = 0.0f;
+	deferred.m_nextFrame = false;
+	deferred.m_msg = msg;
+	Defer( deferred );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Defer
+
+  Description:  Buffers a call that is already filled in (the update order
+                is set here).
+
+  Arguments:    deferred : the call to buffer
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::Defer( DeferredMsg & deferred )
+{
+	CountTelemetry( TELEMETRY_MSGS_DEFERRED );
+
+	deferred.m_order = 0;
+
+	if( IsParallelUpdateThread() )
+	{	//Owned by this worker - no synchronization needed
+		DeferredMsgBuffer & buffer = GetDeferralBuffer();
+		deferred.m_order = buffer.m_order;
+		buffer.m_msgs.push_back( deferred );
+	}
+	else
+	{
+		m_mailbox.Push( deferred );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CreateMsgPayload
+
+  Description:  Copies message data into the current frame arena of the
+                router (see MakeMsgPayload).
+
+  Arguments:    data        : the elements
+                elementSize : the size of one element
+                count       : the number of elements
+                type        : the type name of the elements
+
+  Returns:      The payload.
+ *---------------------------------------------------------------------------*/
+MsgPayload * CreateMsgPayload( const void * data, unsigned int elementSize, unsigned int count, const char * type )
+{
+	unsigned int size = elementSize * count;
+	MsgPayload * payload = g_msgroute.AllocatePayload( size );
+	payload->m_type = type;
+	payload->m_size = size;
+	payload->m_count = count;
+	payload->m_class = MSG_PAYLOAD_FRAME_CLASS;
+	memcpy( payload->GetData(), data, size );
+	return( payload );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Save
+
+  Description:  Saves the pending delayed messages in delivery order, then
+                the topic subscriptions, then the publishes and area
+				broadcasts queued for the next frame, then the CC
+				subscriptions. The messages and
+				subscriptions that can't be delivered anymore (the receiver
+				is gone or the scope was left) are left out. The state
+				machine wake-ups aren't saved, since the restored state
+				machines schedule them again.
+
+  Arguments:    writer : the snapshot being written
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::Save( SnapshotWriter & writer )
+{
+	ASSERTMSG( IsMainThread() && !m_deferring, "MsgRoute::Save - Must be called from the main thread" );
+
+	AnyMsgPredicate match;
+	MessageList pending;
+	for( int i=0; i<MSG_PRIORITY_NUM; ++i )
+	{
+		m_delayedMessages[i]->FindAll( match, pending );
+	}
+	MessageList & nextFrame = m_nextFrame[m_nextFrameIndex];
+	for( MessageList::iterator i=nextFrame.begin(); i!=nextFrame.end(); ++i )
+	{	//Restored into the scheduler (due by the next frame)
+		if( (*i)->IsBatched() ) {
+			pending.push_back( *i );
+		}
+	}
+
+	writer.Write( m_nextSendSequence );
+	WriteDelayedMsgs( writer, pending );
+	WriteTopics( writer );
+	WriteQueuedBroadcasts( writer );
+	WriteCCSubscriptions( writer, INVALID_OBJECT_ID );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Restore
+
+  Description:  Schedules the delayed messages saved by Save again, with
+                their delivery times, send order and priorities, subscribes
+				to the topics again, queues the next frame publishes and
+				area broadcasts again and subscribes the CC observers again
+				(the ones held before are dropped).
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      Whether the messages were restored.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::Restore( SnapshotReader & reader )
+{
+	ASSERTMSG( IsMainThread() && !m_deferring, "MsgRoute::Restore - Must be called from the main thread" );
+
+	m_ccSubscriptions.clear();		//Their sources were in the database this replaces
+
+	m_nextSendSequence = reader.Read<unsigned int>();
+	return( ReadDelayedMsgs( reader, true ) && ReadTopics( reader ) && ReadQueuedBroadcasts( reader ) && ReadCCSubscriptions( reader ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ExtractMsgsForReceiver
+
+  Description:  Saves the pending delayed messages of an object that moves
+                to another process and the CC subscriptions it is the
+				source of, then removes them here. The state machine
+				wake-ups stay behind (they find no object) since the state
+				machines schedule them again where they are restored. The
+				subscriptions it observes stay with their sources.
+
+  Arguments:    writer   : the handoff being written
+                receiver : the ID of the object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::ExtractMsgsForReceiver( SnapshotWriter & writer, objectID receiver )
+{
+	ASSERTMSG( IsMainThread() && !m_deferring, "MsgRoute::ExtractMsgsForReceiver - Must be called from the main thread" );
+
+	AnyMsgPredicate match;
+	MessageList pending;
+	m_receiverIndex.FindAll( receiver, match, pending );
+	WriteDelayedMsgs( writer, pending );
+
+	for( MessageList::iterator i=pending.begin(); i!=pending.end(); ++i )
+	{
+		RemoveDelayedMsg( *i );
+	}
+
+	WriteCCSubscriptions( writer, receiver );
+	m_ccSubscriptions.erase( receiver );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RestoreMsgs
+
+  Description:  Schedules the delayed messages saved by ExtractMsgsForReceiver.
+                They keep their delivery times and priorities, but get new
+				send sequence numbers (the saved ones are from another
+				process). Then subscribes the object's CC observers again
+				(it must have been adopted already).
+
+  Arguments:    reader : the handoff being read
+
+  Returns:      Whether the messages were restored.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::RestoreMsgs( SnapshotReader & reader )
+{
+	ASSERTMSG( IsMainThread() && !m_deferring, "MsgRoute::RestoreMsgs - Must be called from the main thread" );
+
+	return( ReadDelayedMsgs( reader, false ) && ReadCCSubscriptions( reader ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteDelayedMsgs
+
+  Description:  Writes pending delayed messages in delivery order. The ones
+                that can't be delivered anymore (the receiver is gone or the
+				scope was left) are left out.
+
+  Arguments:    writer  : the snapshot being written
+                pending : the messages
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::WriteDelayedMsgs( SnapshotWriter & writer, MessageList & pending )
+{
+	MessageList list;
+	for( MessageList::iterator i=pending.begin(); i!=pending.end(); ++i )
+	{
+		GameObject * object = g_database.Find( (*i)->GetReceiver() );
+		if( object && ( !object->HasStateMachineManager() || IsInScope( **i, object ) ) ) {
+			list.push_back( *i );
+		}
+	}
+	std::sort( list.begin(), list.end(), PendingMsgOrder() );
+
+	writer.Write( (unsigned int)list.size() );
+	for( MessageList::iterator i=list.begin(); i!=list.end(); ++i )
+	{
+		MSG_Object & msg = **i;
+		writer.WriteTime( msg.GetDeliveryTime() );
+		writer.Write( (unsigned int)msg.GetName() );
+		writer.Write( msg.GetSender() );
+		writer.Write( msg.GetReceiver() );
+		writer.Write( msg.GetScopeRule() );
+		writer.Write( msg.GetScope() );
+		writer.Write( msg.GetQueue() );
+		writer.Write( msg.IsTimer() );
+		writer.Write( msg.IsCC() );
+		writer.Write( msg.GetPeriod() );
+		writer.Write( msg.GetPriority() );
+		writer.Write( msg.GetSendSequence() );
+
+		writer.WriteMsgData( msg.GetMsgData() );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReadDelayedMsgs
+
+  Description:  Schedules the delayed messages written by WriteDelayedMsgs.
+
+  Arguments:    reader        : the snapshot being read
+                keepSendOrder : whether to keep the saved send sequence
+				                numbers (a whole snapshot) or to number
+								them as sent now (a single object)
+
+  Returns:      Whether the messages were read.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::ReadDelayedMsgs( SnapshotReader & reader, bool keepSendOrder )
+{
+	unsigned int count = reader.Read<unsigned int>();
+	for( unsigned int i=0; i<count && reader.IsValid(); ++i )
+	{
+		double deliveryTime = reader.ReadTime();
+		unsigned int name = reader.Read<unsigned int>();
+		objectID sender = reader.Read<objectID>();
+		objectID receiver = reader.Read<objectID>();
+		Scope_Rule rule = reader.Read<Scope_Rule>();
+		unsigned int scope = reader.Read<unsigned int>();
+		unsigned int queue = reader.Read<unsigned int>();
+		bool timer = reader.Read<bool>();
+		bool cc = reader.Read<bool>();
+		float period = reader.Read<float>();
+		unsigned int priority = reader.Read<unsigned int>();
+		unsigned int sequence = reader.Read<unsigned int>();
+
+		MSG_Data data = reader.ReadMsgData();		//Out of line data goes into the frame arena, then into the pool by Acquire
+
+		if( !reader.IsValid() || name >= MSG_NUM || priority >= MSG_PRIORITY_NUM || queue > STATE_MACHINE_QUEUE_ALL ) {
+			reader.Fail();
+			break;
+		}
+
+		MSG_Object * msg = m_msgPool.Acquire( deliveryTime, (MSG_Name)name, sender, receiver, rule, scope, queue, data, timer, cc );
+		msg->SetPeriod( period );
+		msg->SetPriority( priority );
+		msg->SetSendSequence( keepSendOrder ? sequence : m_nextSendSequence++ );
+		m_delayedMessages[priority]->Insert( msg );
+		m_duplicateIndex.Insert( msg );
+		m_receiverIndex.Insert( msg );
+	}
+
+	return( reader.IsValid() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteTopics
+
+  Description:  Writes the topic subscriptions that still hold, in 
+                subscription order.
+
+  Arguments:    writer : the snapshot being written
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::WriteTopics( SnapshotWriter & writer )
+{
+	MsgTopicSubscriberContainer list;
+	std::vector<MsgTopic> topics;
+	for( TopicContainer::iterator t=m_topics.begin(); t!=m_topics.end(); ++t )
+	{
+		for( MsgTopicSubscriberContainer::iterator i=t->second.m_subscribers.begin(); i!=t->second.m_subscribers.end(); ++i )
+		{
+			if( i->m_id != INVALID_OBJECT_ID && IsSubscriberInScope( *i, g_database.Find( i->m_id ) ) )
+			{
+				list.push_back( *i );
+				topics.push_back( t->first );
+			}
+		}
+	}
+
+	writer.Write( (unsigned int)list.size() );
+	for( unsigned int i=0; i<list.size(); ++i )
+	{
+		writer.Write( topics[i] );
+		writer.Write( list[i].m_id );
+		writer.Write( list[i].m_queue );
+		writer.Write( list[i].m_rule );
+		writer.Write( list[i].m_scope );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReadTopics
+
+  Description:  Subscribes again to the topics written by WriteTopics.
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      Whether the subscriptions were read.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::ReadTopics( SnapshotReader & reader )
+{
+	unsigned int count = reader.Read<unsigned int>();
+	for( unsigned int i=0; i<count && reader.IsValid(); ++i )
+	{
+		MsgTopic topic = reader.Read<MsgTopic>();
+		objectID id = reader.Read<objectID>();
+		unsigned int queue = reader.Read<unsigned int>();
+		Scope_Rule rule = reader.Read<Scope_Rule>();
+		unsigned int scope = reader.Read<unsigned int>();
+
+		if( !reader.IsValid() || queue >= STATE_MACHINE_QUEUE_ALL ) {
+			reader.Fail();
+			break;
+		}
+
+		Subscribe( topic, id, (StateMachineQueue)queue, rule, scope );
+	}
+
+	return( reader.IsValid() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteQueuedBroadcasts
+
+  Description:  Writes the publishes (SendMsgToTopic) and area broadcasts
+                queued for the next frame, in the order they were queued.
+				They aren't tied to one receiver, so a shard handoff leaves
+				them with the process that queued them.
+
+  Arguments:    writer : the snapshot being written
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::WriteQueuedBroadcasts( SnapshotWriter & writer )
+{
+	writer.Write( (unsigned int)m_publishes.size() );
+	for( QueuedPublishContainer::iterator i=m_publishes.begin(); i!=m_publishes.end(); ++i )
+	{
+		writer.Write( i->m_topic );
+		WriteQueuedMsg( writer, i->m_msg );
+	}
+
+	writer.Write( (unsigned int)m_areaBroadcasts.size() );
+	for( AreaBroadcastContainer::iterator i=m_areaBroadcasts.begin(); i!=m_areaBroadcasts.end(); ++i )
+	{
+		writer.Write( i->m_center );
+		writer.Write( i->m_radius );
+		writer.Write( i->m_type );
+		WriteQueuedMsg( writer, i->m_msg );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReadQueuedBroadcasts
+
+  Description:  Queues the publishes and area broadcasts written by
+                WriteQueuedBroadcasts for the next frame again.
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      Whether they were read.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::ReadQueuedBroadcasts( SnapshotReader & reader )
+{
+	unsigned int numPublishes = reader.Read<unsigned int>();
+	for( unsigned int i=0; i<numPublishes && reader.IsValid(); ++i )
+	{
+		QueuedPublish publish;
+		publish.m_topic = reader.Read<MsgTopic>();
+		if( !ReadQueuedMsg( reader, publish.m_msg ) ) {
+			break;
+		}
+		m_publishes.push_back( publish );
+	}
+
+	unsigned int numAreaBroadcasts = reader.IsValid() ? reader.Read<unsigned int>() : 0;
+	for( unsigned int i=0; i<numAreaBroadcasts && reader.IsValid(); ++i )
+	{
+		AreaBroadcast broadcast;
+		broadcast.m_center = reader.Read<Vector3>();
+		broadcast.m_radius = reader.Read<float>();
+		broadcast.m_type = reader.Read<unsigned int>();
+		if( !ReadQueuedMsg( reader, broadcast.m_msg ) ) {
+			break;
+		}
+		m_areaBroadcasts.push_back( broadcast );
+	}
+
+	return( reader.IsValid() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteQueuedMsg
+
+  Description:  Writes the message of a queued publish or area broadcast
+                (the fields WriteDelayedMsgs writes, less the scheduling).
+
+  Arguments:    writer : the snapshot being written
+                msg    : the message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::WriteQueuedMsg( SnapshotWriter & writer, MSG_Object & msg )
+{
+	writer.WriteTime( msg.GetDeliveryTime() );
+	writer.Write( (unsigned int)msg.GetName() );
+	writer.Write( msg.GetSender() );
+	writer.Write( msg.GetReceiver() );
+	writer.Write( msg.GetScopeRule() );
+	writer.Write( msg.GetScope() );
+	writer.Write( msg.GetQueue() );
+	writer.Write( msg.IsCC() );
+
+	writer.WriteMsgData( msg.GetMsgData() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReadQueuedMsg
+
+  Description:  Reads a message written by WriteQueuedMsg.
+
+  Arguments:    reader : the snapshot being read
+                msg    : receives the message
+
+  Returns:      Whether the message was read.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::ReadQueuedMsg( SnapshotReader & reader, MSG_Object & msg )
+{
+	double deliveryTime = reader.ReadTime();
+	unsigned int name = reader.Read<unsigned int>();
+	objectID sender = reader.Read<objectID>();
+	objectID receiver = reader.Read<objectID>();
+	Scope_Rule rule = reader.Read<Scope_Rule>();
+	unsigned int scope = reader.Read<unsigned int>();
+	unsigned int queue = reader.Read<unsigned int>();
+	bool cc = reader.Read<bool>();
+
+	MSG_Data data = reader.ReadMsgData();
+
+	if( !reader.IsValid() || name >= MSG_NUM || queue > STATE_MACHINE_QUEUE_ALL ) {
+		reader.Fail();
+		return( false );
+	}
+
+	msg = MSG_Object( deliveryTime, (MSG_Name)name, sender, receiver, rule, scope, queue, data, false, cc );
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteCCSubscriptions
+
+  Description:  Writes the CC subscriptions of one source, or of all of them,
+                as source and observer pairs in subscription order.
+
+  Arguments:    writer : the snapshot being written
+                source : the source (INVALID_OBJECT_ID for all)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgRoute::WriteCCSubscriptions( SnapshotWriter & writer, objectID source )
+{
+	CCSubscriptionContainer::iterator begin = m_ccSubscriptions.begin();
+	CCSubscriptionContainer::iterator end = m_ccSubscriptions.end();
+	if( source != INVALID_OBJECT_ID )
+	{
+		begin = m_ccSubscriptions.find( source );
+		if( begin != end ) {
+			end = begin;
+			++end;
+		}
+	}
+
+	unsigned int count = 0;
+	for( CCSubscriptionContainer::iterator s=begin; s!=end; ++s ) {
+		count += (unsigned int)s->second.size();
+	}
+
+	writer.Write( count );
+	for( CCSubscriptionContainer::iterator s=begin; s!=end; ++s )
+	{
+		for( ObjectIDList::iterator i=s->second.begin(); i!=s->second.end(); ++i )
+		{
+			writer.Write( s->first );
+			writer.Write( *i );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReadCCSubscriptions
+
+  Description:  Subscribes again to the CC subscriptions written by
+                WriteCCSubscriptions. The sources must be in the database.
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      Whether the subscriptions were read.
+ *---------------------------------------------------------------------------*/
+bool MsgRoute::ReadCCSubscriptions( SnapshotReader & reader )
+{
+	unsigned int count = reader.Read<unsigned int>();
+	for( unsigned int i=0; i<count && reader.IsValid(); ++i )
+	{
+		objectID source = reader.Read<objectID>();
+		objectID observer = reader.Read<objectID>();
+
+		if( !reader.IsValid() || g_database.Find( source ) == 0 ) {
+			reader.Fail();
+			break;
+		}
+
+		SubscribeCC( source, observer );
+	}
+
+	return( reader.IsValid() );
+}
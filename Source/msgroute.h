@@ -13,22 +13,118 @@
 #include "msg.h"
 #include "time.h"
 #include "singleton.h"
-#include <list>
+#include "msgscheduler.h"
+#include "msghashindex.h"
+#include "msgreceiverindex.h"
+#include "msgpool.h"
+#include "msgpayload.h"
+#include "jobsystem.h"
+#include "msgmailbox.h"
+#include "vector.h"
+#include <map>
+#include <deque>
 
 //Forward declaration
 enum StateMachineQueue;
+class GameObject;
+class SnapshotWriter;
+class SnapshotReader;
 
+typedef std::vector<objectID> ObjectIDList;
+
+#define MSG_LOAD_BALANCE_CHECK_INTERVAL (8)		//Number of delayed messages delivered between checks of the frame budget
+#define MSG_STALE_COMPACT_MIN (256)				//Stale scoped messages tolerated before compacting (also needs half the pending messages stale)
+
+//Delayed messages are delivered in time order, but once the frame budget is used up
+//only high priority messages are still delivered (the rest carry over to the next frame)
+enum MsgPriority {
+	MSG_PRIORITY_NORMAL,
+	MSG_PRIORITY_HIGH,
+	MSG_PRIORITY_NUM
+};
+
+//What happens to a send that goes over a flow limit (see SetFlowLimits). Sends over a
+//rate are held back to the next frame (unless dropped), which a full inbox then bounds.
+enum MsgOverflowPolicy {
+	MSG_OVERFLOW_DROP_NEW,			//The send is dropped
+	MSG_OVERFLOW_DROP_OLDEST,		//The receiver's oldest pending message (not a timer) is dropped to make room
+	MSG_OVERFLOW_COALESCE			//Merged into a pending message with the same name, sender and receiver (or dropped if none)
+};
+
+//Caps on the messages of one object (0 for no cap). A frame runs from one DeliverDelayedMessages to the next.
+struct MsgFlowLimits
+{
+	MsgFlowLimits( void ) : m_maxPendingPerReceiver( 0 ), m_maxSendsPerReceiver( 0 ), m_maxSendsPerSender( 0 ), m_policy( MSG_OVERFLOW_DROP_NEW ) {}
+
+	unsigned int m_maxPendingPerReceiver;	//Delayed messages waiting for a receiver (its inbox)
+	unsigned int m_maxSendsPerReceiver;		//Sends to a receiver per frame
+	unsigned int m_maxSendsPerSender;		//Sends by an object per frame (the system is exempt)
+	MsgOverflowPolicy m_policy;
+};
+
+enum MsgOverflowReason {
+	MSG_OVERFLOW_SENDER_RATE,
+	MSG_OVERFLOW_RECEIVER_RATE,
+	MSG_OVERFLOW_INBOX_FULL
+};
+
+enum MsgOverflowOutcome {
+	MSG_OVERFLOW_DROPPED,			//The send was dropped
+	MSG_OVERFLOW_MERGED,			//The send was merged into a pending message
+	MSG_OVERFLOW_POSTPONED,			//The send was held back to the next frame
+	MSG_OVERFLOW_EVICTED			//The send went ahead, the receiver's oldest pending message was dropped
+};
+
+//One send that went over a limit, as reported to the overflow handler
+struct MsgOverflow
+{
+	MsgOverflowReason m_reason;
+	MsgOverflowOutcome m_outcome;
+	MSG_Name m_name;
+	objectID m_sender;
+	objectID m_receiver;
+};
+typedef void (*MsgOverflowHandler)( const MsgOverflow & overflow, void * context );
+
+//A due message waiting in a batched delivery
+struct BatchedMsg
+{
+	MSG_Object * m_msg;
+	unsigned int m_order;				//Position in delivery time order
+};
+typedef std::vector<BatchedMsg> BatchedMsgContainer;
+
+//A state machine waiting for its earliest OnTimeIn... handler
+struct TimerWake
+{
+	double m_time;
+	objectID m_receiver;
+	unsigned int m_queue;
+};
+typedef std::vector<TimerWake> TimerWakeContainer;
+
+//Topics are chosen by the game (any number, for example an enum of channels)
+typedef unsigned int MsgTopic;
+
+//A state machine subscribed to a topic
+struct MsgTopicSubscriber
+{
+	objectID m_id;						//INVALID_OBJECT_ID once unsubscribed (until compacted)
+	unsigned int m_queue;
+	Scope_Rule m_rule;					//Scope the subscription ends with
+	unsigned int m_scope;
+};
+typedef std::vector<MsgTopicSubscriber> MsgTopicSubscriberContainer;
 
-typedef std::list<MSG_Object*> MessageContainer;
 
 class MsgRoute : public Singleton <MsgRoute>
 {
 public:
 
-	MsgRoute( void );
+	MsgRoute( MsgSchedulerType scheduler = MSG_SCHEDULER_HEAP );
 	~MsgRoute( void );
 
-	void DeliverDelayedMessages( void );
+	void DeliverDelayedMessages( const FrameContext & frame );
 
 	void SendMsg( float delay, MSG_Name name,
 	              objectID receiver, objectID sender, 
@@ -38,21 +134,291 @@ public:
 	
 	void SendMsgBroadcast( MSG_Object & msg, unsigned int type = 0 );
 
-	//Delayed message load balancing
+	//Broadcast to the objects of a type within a radius of a point (on the ground plane). Only
+	//nearby objects are visited when the SpatialGrid exists. Next frame broadcasts are queued
+	//and delivered together at the start of the next DeliverDelayedMessages, to the objects
+	//that are in the area at that time.
+	void SendMsgBroadcastInRadius( MSG_Object & msg, const Vector3 & center, float radius, unsigned int type = 0, bool nextFrame = false );
+	inline unsigned int GetNumQueuedAreaBroadcasts( void )		{ return( (unsigned int)m_areaBroadcasts.size() ); }
+
+	//Topics - a message published to a topic is handled by every state machine subscribed
+	//to it (except the sender's), each on its own queue. A subscription ends by itself when
+	//the substate, state or state machine it is scoped to is left; this is found when the
+	//topic is next published, so the subscribers are a plain array walked once per publish.
+	//Next frame publishes are queued once and fanned out at the start of the next
+	//DeliverDelayedMessages. Topics are local to each shard (see shard.h).
+	void Subscribe( MsgTopic topic, objectID id, StateMachineQueue queue, Scope_Rule rule, unsigned int scope );
+	void Unsubscribe( MsgTopic topic, objectID id, StateMachineQueue queue );
+	void Publish( MsgTopic topic, MSG_Object & msg, bool nextFrame = false );
+	unsigned int GetNumSubscribers( MsgTopic topic );			//Including the ones whose scope was left since the last publish
+	inline unsigned int GetNumQueuedPublishes( void )			{ return( (unsigned int)m_publishes.size() ); }
+
+	//CC subscriptions - an observer gets a copy (EVENT_CCMessage) of every message handled
+	//by the state machines of the source (StateMachine::SetCCReceiver does the same for one
+	//state machine and one observer). The copies aren't routed one by one: they are collected
+	//while the source processes the message (including whatever its handlers send right away)
+	//and delivered together once that processing ends, grouped by observer so each observer
+	//is looked up once. During a parallel update, and under flow limits or to other shards,
+	//each copy is sent as a message instead. The source must exist when subscribed; the
+	//subscriptions of destroyed objects are dropped (see PurgeMsgsForReceivers). They are
+	//saved in snapshots, and move with the source when it migrates to another shard (the
+	//copies find an observer that moved like any other message).
+	void SubscribeCC( objectID source, objectID observer );
+	void UnsubscribeCC( objectID source, objectID observer );
+	unsigned int GetNumCCObservers( objectID source );
+	inline unsigned int GetNumCCBatches( void )				{ return( m_numCCBatches ); }		//Total since startup
+
+	//Called by StateMachine::Process for a message to an object with observers (receiver is
+	//the state machine's own CC receiver, or 0). EndCC must follow if BeginCC returns true.
+	bool BeginCC( MSG_Object & msg, GameObject & source, objectID receiver );
+	inline void EndCC( void )								{ if( --m_ccDepth == 0 && !m_ccDelivering ) { DeliverCCBatch(); } }
+
+	//Delayed message load balancing (a limit of 0 delivers everything that is due)
 	inline void SetLoadBalancingConstraint(float maxTimePerFrameInSeconds)	{ m_loadBalancingTimeLimit = maxTimePerFrameInSeconds; }
+	inline void SetMsgPriority( MSG_Name name, MsgPriority priority )		{ ASSERTMSG( (unsigned int)name < MSG_NUM, "MsgRoute::SetMsgPriority - Invalid message name" ); if( (unsigned int)name < MSG_NUM ) { m_msgPriority[name] = priority; } }	//Only affects messages sent afterwards
+	inline MsgPriority GetMsgPriority( MSG_Name name )						{ return( (unsigned int)name < MSG_NUM ? m_msgPriority[name] : MSG_PRIORITY_NORMAL ); }
+
+	//Load balancing stats (from the last call to DeliverDelayedMessages)
+	inline unsigned int GetNumDeliveredLastFrame( void )		{ return( m_numDeliveredLastFrame ); }
+	inline unsigned int GetDeliveryBacklog( void )				{ return( m_deliveryBacklog ); }		//Due messages carried over to the next frame
+	inline float GetOldestLateMessageAge( void )				{ return( m_oldestLateMessageAge ); }	//Seconds the oldest carried over message is late
+	inline unsigned int GetNumFramesOverBudget( void )			{ return( m_numFramesOverBudget ); }	//Total since startup
+
+	//Flow limits - caps on the sends of each object, and on the pending messages of each
+	//receiver, so one misbehaving state machine can't flood the router. Sends of the parallel
+	//update are counted when replayed; timers are exempt. Every send over a limit is counted
+	//(TELEMETRY_MSGS_OVER_LIMIT) and reported to the handler, if any.
+	void SetFlowLimits( const MsgFlowLimits & limits );
+	inline const MsgFlowLimits & GetFlowLimits( void )			{ return( m_flowLimits ); }
+	inline void SetOverflowHandler( MsgOverflowHandler handler, void * context )	{ m_overflowHandler = handler; m_overflowContext = context; }
+	inline unsigned int GetNumOverflows( void )					{ return( m_numOverflows ); }		//Total since startup
+	inline unsigned int GetNumOverflowsLastFrame( void )		{ return( m_numOverflowsLastFrame ); }
+	bool GetWorstOffenderLastFrame( objectID & sender, MSG_Name & name, unsigned int & overflows );	//The sender and message with the most overflows
+	inline unsigned int GetNumPendingForReceiver( objectID receiver )	{ return( m_receiverIndex.GetNumPending( receiver ) ); }
+
+	//Batched delivery - the due messages of a frame are collected first and delivered grouped
+	//by receiver (in time order for each receiver), so each receiver is looked up once and
+	//handles its messages back to back. Messages to different receivers may then arrive in a
+	//different order than their delivery times.
+	inline void SetBatchedDelivery( bool batched )				{ m_batchedDelivery = batched; }
+	inline bool IsBatchedDelivery( void )						{ return( m_batchedDelivery ); }
+
+	//Next frame messages - sends with a delay of at most NEXT_FRAME (that aren't timers) skip
+	//the scheduler and are appended to a double buffered queue, which is delivered as a whole
+	//(in send order) by the next DeliverDelayedMessages, before the timed messages that are due.
+	inline unsigned int GetNumNextFrameMessages( void )			{ return( (unsigned int)m_nextFrame[m_nextFrameIndex].size() ); }	//Including removed ones
 	
 	//Removing delayed messages
 	void RemoveMsg( MSG_Name name, objectID receiver, objectID sender, bool timer );
 	void PurgeScopedMsg( objectID receiver, StateMachineQueue queue );
+	void PurgeMsgsForReceivers( ObjectIDList & receivers );
+
+	//State machine timers - the OnTimeIn... handlers keep their deadlines in the state machine,
+	//which only asks to be woken at its earliest one. Due wake-ups run after the delayed messages.
+	void ScheduleTimerWake( double time, objectID receiver, StateMachineQueue queue );
+	inline unsigned int GetNumTimerWakes( void )				{ return( (unsigned int)m_timerWakes.size() ); }
+
+	//Delayed message stats
+	inline unsigned int GetNumDelayedMessages( void )			{ return( m_duplicateIndex.GetSize() ); }	//Every pending message is indexed (scheduled or next frame)
+	inline unsigned int GetDelayedMessageHighWaterMark( void )	{ return( m_msgPool.GetHighWaterMark() ); }
+	inline unsigned int GetDelayedMessageCapacity( void )		{ return( m_msgPool.GetCapacity() ); }
+	inline unsigned int GetNumDelayedPayloads( void )			{ return( m_msgPool.GetNumPayloadsInUse() ); }
+	inline unsigned int GetDelayedMessageBytes( void )			{ return( m_msgPool.GetBytesAllocated() ); }	//Pool storage (not the scheduler and indexes)
+	inline unsigned int GetNumStaleDelayedMessages( void )		{ return( m_receiverIndex.GetNumStale() ); }	//Scope left, still pending (included in GetNumDelayedMessages)
+
+	//Message payloads (see MakeMsgPayload) - any thread
+	inline MsgPayload * AllocatePayload( unsigned int size )	{ return( m_frameArena[m_frameArenaIndex].Allocate( size ) ); }
+
+	//Threading - the router itself is only touched by the main thread. Calls from
+	//other threads go into a lock-free mailbox that is drained at the sync point
+	//(DeliverDelayedMessages or DrainMailbox).
+	void DrainMailbox( void );
+	inline void SetMainThread( void )						{ m_mainThreadId = GetCurrentThreadId(); }	//The thread running the world (the creating one until set)
+
+	//Parallel update support - while deferring, calls made from job threads are
+	//buffered per worker and replayed in object update order by EndDeferral
+	void BeginDeferral( void );
+	void SetDeferralContext( unsigned int worker, unsigned int order, objectID object );
+	void EndDeferral( void );
+	inline bool IsDeferring( void )							{ return( m_deferring ); }
+
+	//Snapshots (see snapshot.h) - the pending delayed messages, with their payloads, and the topic subscriptions
+	void Save( SnapshotWriter & writer );
+	bool Restore( SnapshotReader & reader );
+
+	//Shard handoffs (see shard.h) - the pending delayed messages of an object move with it
+	void ExtractMsgsForReceiver( SnapshotWriter & writer, objectID receiver );	//Saves, then removes them
+	bool RestoreMsgs( SnapshotReader & reader );								//Scheduled after the local ones sent at the same time
 
 	//For testing (unit tests)
 	bool VerifyDelayedMessageOrder( void );
 
 private:
 
-	MessageContainer m_delayedMessages;
+	MsgPool m_msgPool;					//Storage for all pending delayed messages
+	MsgPayloadArena m_frameArena[2];	//Payloads of sent messages, flipped each delivery so a payload lives a whole frame
+	unsigned int m_frameArenaIndex;
+	MsgScheduler * m_delayedMessages[MSG_PRIORITY_NUM];	//One scheduler per priority class
+	MsgHashIndex m_duplicateIndex;		//Pending delayed messages, for duplicate detection
+	MsgReceiverIndex m_receiverIndex;	//Pending delayed messages, grouped by receiver and queue
 	float m_loadBalancingTimeLimit;
+	MsgPriority m_msgPriority[MSG_NUM];	//Priority class of each message name
+	unsigned int m_nextSendSequence;	//Keeps send order between the priority classes
+
+	unsigned int m_numDeliveredLastFrame;
+	unsigned int m_deliveryBacklog;
+	float m_oldestLateMessageAge;
+	unsigned int m_numFramesOverBudget;
+
+	//Batched delivery
+	bool m_batchedDelivery;
+	BatchedMsgContainer m_batch;
+	BatchedMsgContainer m_carryOver;
+
+	//Next frame messages (appended to one buffer while the other is delivered)
+	MessageList m_nextFrame[2];
+	unsigned int m_nextFrameIndex;
+
+	struct DeferredMsgBuffer
+	{
+		DeferredMsgContainer m_msgs;
+		unsigned int m_order;			//Update order of the object the worker is updating
+		objectID m_object;				//The object the worker is updating
+	};
+
+	bool m_deferring;
+	DeferredMsgBuffer m_deferred[JOB_SYSTEM_MAX_WORKERS];
+	MsgMailbox m_mailbox;					//Calls from threads outside the parallel update
+	DWORD m_mainThreadId;
+
+	//Next frame area broadcasts
+	struct AreaBroadcast
+	{
+		MSG_Object m_msg;
+		Vector3 m_center;
+		float m_radius;
+		unsigned int m_type;
+	};
+	typedef std::vector<AreaBroadcast> AreaBroadcastContainer;
+	AreaBroadcastContainer m_areaBroadcasts;
+
+	//Receivers of the broadcasts in progress, one list per nesting level (a deque,
+	//so an inner broadcast adding a level doesn't move the outer lists). Reused,
+	//so a broadcast doesn't allocate once the lists have grown.
+	typedef std::deque<ObjectIDList> BroadcastSnapshotContainer;
+	BroadcastSnapshotContainer m_broadcastSnapshots;
+	unsigned int m_broadcastDepth;
+
+	TimerWakeContainer m_timerWakes;	//State machine wake-ups (a min-heap on time)
+
+	//Flow limits. The send counts are indexed by object slot and stamped with the
+	//flow frame, so starting a frame is a stamp bump instead of a clear, and the 
+	//offenders are a reused list - counting sends doesn't allocate once they've grown.
+	struct SendCount
+	{
+		objectID m_id;
+		unsigned int m_flowFrame;		//Counts from an older frame read as zero
+		unsigned int m_count;
+	};
+	struct Offender
+	{
+		objectID m_sender;
+		MSG_Name m_name;
+		unsigned int m_count;
+	};
+	typedef std::vector<SendCount> SendCountContainer;
+	typedef std::vector<Offender> OffenderContainer;
+	MsgFlowLimits m_flowLimits;
+	bool m_flowLimited;					//Any cap set
+	unsigned int m_flowFrame;
+	SendCountContainer m_sendsBySender;	//This frame
+	SendCountContainer m_sendsByReceiver;
+	OffenderContainer m_offenders;		//Overflows this frame (repeats of the last entry are folded into it)
+	MsgOverflowHandler m_overflowHandler;
+	void * m_overflowContext;
+	unsigned int m_numOverflows;
+	unsigned int m_numOverflowsThisFrame;
+	unsigned int m_numOverflowsLastFrame;
+	objectID m_worstSender;				//Last frame
+	MSG_Name m_worstName;
+	unsigned int m_worstOverflows;
+
+	//Topics
+	struct Topic
+	{
+		Topic( void ) : m_publishing( 0 ), m_dirty( false ) {}
+
+		MsgTopicSubscriberContainer m_subscribers;	//In subscription order
+		unsigned int m_publishing;		//Fan-outs in progress (handlers may publish again)
+		bool m_dirty;					//Has unsubscribed entries (compacted once no fan-out is in progress)
+	};
+	typedef std::map<MsgTopic, Topic> TopicContainer;
+	TopicContainer m_topics;
+
+	struct QueuedPublish
+	{
+		MSG_Object m_msg;
+		MsgTopic m_topic;
+	};
+	typedef std::vector<QueuedPublish> QueuedPublishContainer;
+	QueuedPublishContainer m_publishes;		//Next frame publishes
+
+	//CC subscriptions
+	typedef std::map<objectID, ObjectIDList> CCSubscriptionContainer;
+	typedef std::vector<MSG_Object> CCBatchContainer;
+	CCSubscriptionContainer m_ccSubscriptions;	//Observers of each source, in subscription order
+	CCBatchContainer m_ccBatch;				//Copies waiting for the end of the processing
+	CCBatchContainer m_ccRound;				//Copies being delivered
+	unsigned int m_ccDepth;					//Processing of CCd messages in progress (nested by immediate sends)
+	bool m_ccDelivering;
+	unsigned int m_numCCBatches;
 
 	void RouteMsg( MSG_Object & msg );	
+	void RouteMsgToObject( MSG_Object & msg, GameObject * object );
+	void DeliverDueMsg( MSG_Object * msg, GameObject * object, double time );
+	bool IsInScope( MSG_Object & msg, GameObject * object );
+	unsigned int DeliverBatch( double time, MessageList & nextFrame, bool & overBudget );
+	void CarryOver( MSG_Object * msg );
+	void BroadcastTo( MSG_Object & msg, GameObject * object );
+	void FindObjectsInRadius( const Vector3 & center, float radius, unsigned int type, std::vector<GameObject*> & list );
+	void DeliverAreaBroadcasts( void );
+	void DeliverPublishes( void );
+	bool IsSubscriberInScope( MsgTopicSubscriber & subscriber, GameObject * object );
+	void CompactTopic( TopicContainer::iterator topic );
+	void WriteTopics( SnapshotWriter & writer );
+	bool ReadTopics( SnapshotReader & reader );
+	void WriteQueuedBroadcasts( SnapshotWriter & writer );
+	bool ReadQueuedBroadcasts( SnapshotReader & reader );
+	void WriteQueuedMsg( SnapshotWriter & writer, MSG_Object & msg );
+	bool ReadQueuedMsg( SnapshotReader & reader, MSG_Object & msg );
+	void WriteCCSubscriptions( SnapshotWriter & writer, objectID source );
+	bool ReadCCSubscriptions( SnapshotReader & reader );
+	void QueueCC( MSG_Object & msg, objectID source, objectID observer );
+	void DeliverCCBatch( void );
+	void DropCCSubscriptions( ObjectIDList & ids );
+	static bool CompareCCObservers( const MSG_Object & a, const MSG_Object & b );
+	void WakeStateMachines( double time );
+	bool AdmitMsg( float & delay, MSG_Name name, objectID receiver, objectID sender,
+	               Scope_Rule rule, unsigned int scope, StateMachineQueue queue, MSG_Data & data );
+	MSG_Object * FindMergeTarget( MSG_Name name, objectID receiver, objectID sender );
+	void MergeInto( MSG_Object * pending, MSG_Data & data );
+	bool EvictOldest( objectID receiver );
+	void ReportOverflow( MsgOverflowReason reason, MsgOverflowOutcome outcome, MSG_Name name, objectID sender, objectID receiver );
+	void BeginFlowFrame( void );
+	unsigned int CountSend( SendCountContainer & counts, objectID id );
+	static bool OffenderLess( const Offender & a, const Offender & b );
+	void RemoveDelayedMsg( MSG_Object * msg );
+	void CompactStaleMessages( void );
+	void WriteDelayedMsgs( SnapshotWriter & writer, MessageList & pending );
+	bool ReadDelayedMsgs( SnapshotReader & reader, bool keepSendOrder );
+	MsgScheduler * GetNextDueScheduler( double time, bool highPriorityOnly );
+
+	inline bool IsMainThread( void )						{ return( GetCurrentThreadId() == m_mainThreadId ); }
+	inline bool MustDefer( void )							{ return( m_deferring || !IsMainThread() ); }
+	inline bool IsParallelUpdateThread( void )				{ return( m_deferring && ( IsMainThread() || g_jobsystem.IsPoolThread() ) ); }
+	inline DeferredMsgBuffer & GetDeferralBuffer( void )	{ return( m_deferred[g_jobsystem.GetCurrentWorker()] ); }
+	void Defer( DeferredMsgCommand command, float delay, MSG_Object & msg, unsigned int type );
+	void Defer( DeferredMsg & deferred );
+	void Replay( DeferredMsgContainer & msgs );
 
 };
@@ -0,0 +1,407 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "msgscheduler.h"
+
+
+
+/*---------------------------------------------------------------------------*
+  Name:         Insert
+
+  Description:  Inserts a message into the sorted list. Time complexity O(n).
+
+  Arguments:    msg : the message to schedule
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerList::Insert( MSG_Object * msg )
+{
+	double deliveryTime = msg->GetDeliveryTime();
+
+	if( m_messages.empty() || deliveryTime <= m_messages.front()->GetDeliveryTime() )
+	{	//Put at the front if the list is empty or the delivery time is sooner than the first entry
+		m_messages.push_front( msg );
+		return;
+	}
+
+	//Insert before the first entry that is delivered later
+	MessageContainer::iterator i;
+	for( i=m_messages.begin(); i!=m_messages.end(); ++i )
+	{
+		if( (*i)->GetDeliveryTime() > deliveryTime )
+		{
+			break;
+		}
+	}
+	m_messages.insert( i, msg );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Remove
+
+  Description:  Removes a message from the list. Time complexity O(n).
+
+  Arguments:    msg : the message to remove
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerList::Remove( MSG_Object * msg )
+{
+	m_messages.remove( msg );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CountDue
+
+  Description:  Counts the messages that are due. Time complexity O(k) for
+                k due messages.
+
+  Arguments:    time : the current time
+
+  Returns:      The number of messages with a delivery time <= time.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgSchedulerList::CountDue( double time )
+{
+	unsigned int count = 0;
+	for( MessageContainer::iterator i=m_messages.begin(); i!=m_messages.end() && (*i)->GetDeliveryTime() <= time; ++i )
+	{
+		count++;
+	}
+
+	return( count );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindFirst
+
+  Description:  Finds the earliest message that matches the predicate.
+
+  Arguments:    pred : the search criteria
+
+  Returns:      The message or 0 if none match.
+ *---------------------------------------------------------------------------*/
+MSG_Object * MsgSchedulerList::FindFirst( MsgPredicate & pred )
+{
+	for( MessageContainer::iterator i=m_messages.begin(); i!=m_messages.end(); ++i )
+	{
+		if( pred.Match( **i ) ) {
+			return( *i );
+		}
+	}
+
+	return( 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindAll
+
+  Description:  Finds all messages that match the predicate.
+
+  Arguments:    pred    : the search criteria
+                results : the list to fill with matching messages
+
+  Returns:      None. (The result is stored in the results argument.)
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerList::FindAll( MsgPredicate & pred, MessageList & results )
+{
+	for( MessageContainer::iterator i=m_messages.begin(); i!=m_messages.end(); ++i )
+	{
+		if( pred.Match( **i ) ) {
+			results.push_back( *i );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         VerifyOrder
+
+  Description:  Verifies that the list is sorted by delivery time.
+
+  Arguments:    None.
+
+  Returns:      True if the list is in order.
+ *---------------------------------------------------------------------------*/
+bool MsgSchedulerList::VerifyOrder( void )
+{	//Test for order - time complexity O(n)
+	double lastDeliveryTime = 0;
+
+	for( MessageContainer::iterator i=m_messages.begin(); i!=m_messages.end(); ++i )
+	{
+		double time = (*i)->GetDeliveryTime();
+		if( time < lastDeliveryTime )
+		{
+			return false;
+		}
+		lastDeliveryTime = time;
+	}
+
+	return true;
+}
+
+
+
+
+MsgSchedulerHeap::MsgSchedulerHeap( void )
+: m_nextSequence( 0 )
+{
+
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Insert
+
+  Description:  Inserts a message into the heap. Time complexity O(log n).
+
+  Arguments:    msg : the message to schedule
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerHeap::Insert( MSG_Object * msg )
+{
+	HeapEntry entry;
+	entry.m_deliveryTime = msg->GetDeliveryTime();
+	entry.m_sequence = m_nextSequence++;
+	entry.m_msg = msg;
+
+	m_heap.push_back( entry );
+	msg->SetSchedulerIndex( (unsigned int)m_heap.size() - 1 );
+	SiftUp( (unsigned int)m_heap.size() - 1 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Remove
+
+  Description:  Removes a message from the heap. The message remembers its
+                heap position, so no search is required. Time complexity
+                O(log n).
+
+  Arguments:    msg : the message to remove
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerHeap::Remove( MSG_Object * msg )
+{
+	unsigned int index = msg->GetSchedulerIndex();
+	ASSERTMSG( index < m_heap.size() && m_heap[index].m_msg == msg, "MsgSchedulerHeap::Remove - Message not in scheduler" );
+
+	if( index < m_heap.size() && m_heap[index].m_msg == msg )
+	{
+		RemoveAt( index );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RemoveAt
+
+  Description:  Removes the entry at a heap position by moving the last entry
+                into its place and restoring the heap property.
+
+  Arguments:    index : the heap position to remove
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerHeap::RemoveAt( unsigned int index )
+{
+	unsigned int last = (unsigned int)m_heap.size() - 1;
+
+	if( index != last )
+	{
+		HeapEntry entry = m_heap[last];
+		Place( index, entry );
+		m_heap.pop_back();
+
+		if( index > 0 && IsEarlier( m_heap[index], m_heap[(index-1)/2] ) ) {
+			SiftUp( index );
+		}
+		else {
+			SiftDown( index );
+		}
+	}
+	else
+	{
+		m_heap.pop_back();
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SiftUp
+
+  Description:  Moves an entry towards the root until its parent is earlier.
+
+  Arguments:    index : the heap position to sift
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerHeap::SiftUp( unsigned int index )
+{
+	HeapEntry entry = m_heap[index];
+
+	while( index > 0 )
+	{
+		unsigned int parent = (index - 1) / 2;
+		if( !IsEarlier( entry, m_heap[parent] ) ) {
+			break;
+		}
+		Place( index, m_heap[parent] );
+		index = parent;
+	}
+
+	Place( index, entry );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SiftDown
+
+  Description:  Moves an entry towards the leaves until both children are
+                later.
+
+  Arguments:    index : the heap position to sift
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerHeap::SiftDown( unsigned int index )
+{
+	unsigned int size = (unsigned int)m_heap.size();
+	HeapEntry entry = m_heap[index];
+
+	for(;;)
+	{
+		unsigned int child = index * 2 + 1;
+		if( child >= size ) {
+			break;
+		}
+		if( child + 1 < size && IsEarlier( m_heap[child + 1], m_heap[child] ) ) {
+			child++;
+		}
+		if( !IsEarlier( m_heap[child], entry ) ) {
+			break;
+		}
+		Place( index, m_heap[child] );
+		index = child;
+	}
+
+	Place( index, entry );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CountDue
+
+  Description:  Counts the messages that are due. Only the part of the heap
+                above the time is visited (a parent is never later than its
+				children). Time complexity O(k) for k due messages.
+
+  Arguments:    time : the current time
+
+  Returns:      The number of messages with a delivery time <= time.
+ *---------------------------------------------------------------------------*/
+unsigned int MsgSchedulerHeap::CountDue( double time )
+{
+	unsigned int count = 0;
+	unsigned int size = (unsigned int)m_heap.size();
+	std::vector<unsigned int> pending;
+
+	if( size > 0 ) {
+		pending.push_back( 0 );
+	}
+	while( !pending.empty() )
+	{
+		unsigned int index = pending.back();
+		pending.pop_back();
+
+		if( m_heap[index].m_deliveryTime <= time )
+		{
+			count++;
+			if( index * 2 + 1 < size ) {
+				pending.push_back( index * 2 + 1 );
+			}
+			if( index * 2 + 2 < size ) {
+				pending.push_back( index * 2 + 2 );
+			}
+		}
+	}
+
+	return( count );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindFirst
+
+  Description:  Finds the earliest message that matches the predicate.
+
+  Arguments:    pred : the search criteria
+
+  Returns:      The message or 0 if none match.
+ *---------------------------------------------------------------------------*/
+MSG_Object * MsgSchedulerHeap::FindFirst( MsgPredicate & pred )
+{
+	HeapEntry * found = 0;
+
+	for( HeapContainer::iterator i=m_heap.begin(); i!=m_heap.end(); ++i )
+	{
+		if( pred.Match( *i->m_msg ) && ( found == 0 || IsEarlier( *i, *found ) ) ) {
+			found = &(*i);
+		}
+	}
+
+	return( found ? found->m_msg : 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindAll
+
+  Description:  Finds all messages that match the predicate (in no
+                particular order).
+
+  Arguments:    pred    : the search criteria
+                results : the list to fill with matching messages
+
+  Returns:      None. (The result is stored in the results argument.)
+ *---------------------------------------------------------------------------*/
+void MsgSchedulerHeap::FindAll( MsgPredicate & pred, MessageList & results )
+{
+	for( HeapContainer::iterator i=m_heap.begin(); i!=m_heap.end(); ++i )
+	{
+		if( pred.Match( *i->m_msg ) ) {
+			results.push_back( i->m_msg );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         VerifyOrder
+
+  Description:  Verifies the heap property (no entry is earlier than its
+                parent) and that every message knows its heap position.
+
+  Arguments:    None.
+
+  Returns:      True if the heap is in order.
+ *---------------------------------------------------------------------------*/
+bool MsgSchedulerHeap::VerifyOrder( void )
+{	//Test for order - time complexity O(n)
+	for( unsigned int i=0; i<m_heap.size(); ++i )
+	{
+		if( m_heap[i].m_msg->GetSchedulerIndex() != i )
+		{
+			return false;
+		}
+		if( i > 0 && IsEarlier( m_heap[i], m_heap[(i-1)/2] ) )
+		{
+			return false;
+		}
+		if( m_heap[i].m_deliveryTime != m_heap[i].m_msg->GetDeliveryTime() )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
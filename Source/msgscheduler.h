@@ -0,0 +1,141 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "msg.h"
+#include <list>
+#include <vector>
+
+
+//Delayed message scheduler backends (selected when the MsgRoute is constructed)
+enum MsgSchedulerType {
+	MSG_SCHEDULER_LIST,		//Sorted linked list - O(n) insert, O(1) pop (original implementation)
+	MSG_SCHEDULER_HEAP		//Indexed binary min-heap - O(log n) insert, O(1) peek, O(log n) pop and remove
+};
+
+typedef std::vector<MSG_Object*> MessageList;
+
+
+//Criteria used to search the pending delayed messages
+class MsgPredicate
+{
+public:
+	virtual ~MsgPredicate( void ) {}
+	virtual bool Match( MSG_Object & msg ) = 0;
+};
+
+
+//Interface for the container that holds delayed messages in delivery order.
+//The scheduler never allocates or deletes messages - ownership stays with MsgRoute.
+//Messages with the same delivery time are delivered in the order they were inserted.
+class MsgScheduler
+{
+public:
+
+	virtual ~MsgScheduler( void ) {}
+
+	virtual void Insert( MSG_Object * msg ) = 0;
+	virtual void Remove( MSG_Object * msg ) = 0;
+
+	//Earliest message (0 if empty) and removal of that message
+	virtual MSG_Object * GetNext( void ) = 0;
+	virtual void PopNext( void ) = 0;
+
+	virtual unsigned int GetSize( void ) = 0;
+	inline bool IsEmpty( void )									{ return( GetSize() == 0 ); }
+
+	//Number of messages with a delivery time at or before the given time
+	virtual unsigned int CountDue( double time ) = 0;
+
+	//Searching - time complexity O(n)
+	virtual MSG_Object * FindFirst( MsgPredicate & pred ) = 0;
+	virtual void FindAll( MsgPredicate & pred, MessageList & results ) = 0;
+
+	//For testing (unit tests)
+	virtual bool VerifyOrder( void ) = 0;
+
+};
+
+
+class MsgSchedulerList : public MsgScheduler
+{
+public:
+
+	MsgSchedulerList( void ) {}
+	virtual ~MsgSchedulerList( void ) {}
+
+	virtual void Insert( MSG_Object * msg );
+	virtual void Remove( MSG_Object * msg );
+
+	virtual MSG_Object * GetNext( void )						{ return( m_messages.empty() ? 0 : m_messages.front() ); }
+	virtual void PopNext( void )								{ if( !m_messages.empty() ) { m_messages.pop_front(); } }
+
+	virtual unsigned int GetSize( void )						{ return( (unsigned int)m_messages.size() ); }
+	virtual unsigned int CountDue( double time );
+
+	virtual MSG_Object * FindFirst( MsgPredicate & pred );
+	virtual void FindAll( MsgPredicate & pred, MessageList & results );
+
+	virtual bool VerifyOrder( void );
+
+private:
+
+	typedef std::list<MSG_Object*> MessageContainer;
+
+	MessageContainer m_messages;
+
+};
+
+
+class MsgSchedulerHeap : public MsgScheduler
+{
+public:
+
+	MsgSchedulerHeap( void );
+	virtual ~MsgSchedulerHeap( void ) {}
+
+	virtual void Insert( MSG_Object * msg );
+	virtual void Remove( MSG_Object * msg );
+
+	virtual MSG_Object * GetNext( void )						{ return( m_heap.empty() ? 0 : m_heap.front().m_msg ); }
+	virtual void PopNext( void )								{ if( !m_heap.empty() ) { RemoveAt( 0 ); } }
+
+	virtual unsigned int GetSize( void )						{ return( (unsigned int)m_heap.size() ); }
+	virtual unsigned int CountDue( double time );
+
+	virtual MSG_Object * FindFirst( MsgPredicate & pred );
+	virtual void FindAll( MsgPredicate & pred, MessageList & results );
+
+	virtual bool VerifyOrder( void );
+
+private:
+
+	//The sort key is copied into the heap so comparisons don't touch the message
+	struct HeapEntry
+	{
+		double m_deliveryTime;		//Primary key
+		unsigned int m_sequence;	//Insertion order (breaks ties between equal delivery times)
+		MSG_Object * m_msg;
+	};
+
+	typedef std::vector<HeapEntry> HeapContainer;
+
+	HeapContainer m_heap;
+	unsigned int m_nextSequence;
+
+	inline bool IsEarlier( HeapEntry & a, HeapEntry & b )		{ return( a.m_deliveryTime < b.m_deliveryTime || ( a.m_deliveryTime == b.m_deliveryTime && a.m_sequence < b.m_sequence ) ); }
+	inline void Place( unsigned int index, HeapEntry & entry )	{ m_heap[index] = entry; entry.m_msg->SetSchedulerIndex( index ); }
+
+	void RemoveAt( unsigned int index );
+	void SiftUp( unsigned int index );
+	void SiftDown( unsigned int index );
+
+};
@@ -0,0 +1,323 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "profiler.h"
+#include "statemch.h"
+#include "debuglog.h"
+#include <algorithm>
+#include <typeinfo>
+
+
+//Sort by total time, highest first
+static bool IsHotter( const ProfileEntry & a, const ProfileEntry & b )
+{
+	return( a.m_seconds > b.m_seconds );
+}
+
+
+bool ProfileKey::operator<( const ProfileKey & rhs ) const
+{
+	if( m_machine != rhs.m_machine )	{ return( m_machine < rhs.m_machine ); }
+	if( m_state != rhs.m_state )		{ return( m_state < rhs.m_state ); }
+	if( m_substate != rhs.m_substate )	{ return( m_substate < rhs.m_substate ); }
+	if( m_event != rhs.m_event )		{ return( m_event < rhs.m_event ); }
+	return( m_msgname < rhs.m_msgname );
+}
+
+
+StateMachineProfiler::StateMachineProfiler( void )
+: m_enabled( true )
+{
+	LARGE_INTEGER qwFreq;
+	QueryPerformanceFrequency( &qwFreq );
+	m_ticksPerSecond = (double)qwFreq.QuadPart;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Record
+
+  Description:  Adds one call to the table of the calling thread.
+
+  Arguments:    key   : what was running
+                ticks : how long it took (performance counter ticks)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineProfiler::Record( const ProfileKey & key, LONGLONG ticks )
+{
+	unsigned int worker = JobSystem::DoesSingletonExist() ? g_jobsystem.GetCurrentWorker() : 0;
+
+	ProfileTable::iterator i = m_tables[worker].find( key );
+	if( i == m_tables[worker].end() )
+	{
+		ProfileCounter counter;
+		counter.m_calls = 0;
+		counter.m_ticks = 0;
+		i = m_tables[worker].insert( ProfileTable::value_type( key, counter ) ).first;
+	}
+
+	i->second.m_calls++;
+	i->second.m_ticks += ticks;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Reset
+
+  Description:  Clears all counters.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineProfiler::Reset( void )
+{
+	ASSERTMSG( !JobSystem::DoesSingletonExist() || !g_jobsystem.IsRunningJobs(), "StateMachineProfiler::Reset - Can't reset during a parallel update." );
+
+	for( int i=0; i<JOB_SYSTEM_MAX_WORKERS; ++i )
+	{
+		m_tables[i].clear();
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetSnapshot
+
+  Description:  Merges the tables of all threads.
+
+  Arguments:    snapshot : the list to fill, sorted by total time
+
+  Returns:      None. (The result is stored in the snapshot argument.)
+ *---------------------------------------------------------------------------*/
+void StateMachineProfiler::GetSnapshot( ProfileSnapshot & snapshot )
+{
+	ASSERTMSG( !JobSystem::DoesSingletonExist() || !g_jobsystem.IsRunningJobs(), "StateMachineProfiler::GetSnapshot - Can't take a snapshot during a parallel update." );
+
+	ProfileTable merged;
+	std::map<const char *, const StateNameTable *> names;	//The first calls of a class run before its name table is known
+	for( int t=0; t<JOB_SYSTEM_MAX_WORKERS; ++t )
+	{
+		for( ProfileTable::iterator i=m_tables[t].begin(); i!=m_tables[t].end(); ++i )
+		{
+			if( i->first.m_names ) {
+				names[i->first.m_machine] = i->first.m_names;
+			}
+
+			ProfileTable::iterator m = merged.find( i->first );
+			if( m == merged.end() ) {
+				merged.insert( *i );
+			}
+			else {
+				m->second.m_calls += i->second.m_calls;
+				m->second.m_ticks += i->second.m_ticks;
+			}
+		}
+	}
+
+	snapshot.clear();
+	snapshot.reserve( merged.size() );
+	for( ProfileTable::iterator i=merged.begin(); i!=merged.end(); ++i )
+	{
+		ProfileEntry entry;
+		entry.m_key = i->first;
+		if( entry.m_key.m_names == 0 && names.find( entry.m_key.m_machine ) != names.end() ) {
+			entry.m_key.m_names = names[entry.m_key.m_machine];
+		}
+		entry.m_calls = i->second.m_calls;
+		entry.m_seconds = (double)i->second.m_ticks / m_ticksPerSecond;
+		snapshot.push_back( entry );
+	}
+	std::sort( snapshot.begin(), snapshot.end(), IsHotter );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteCSV
+
+  Description:  Writes a snapshot as comma separated values (one line per
+                entry, with a header line).
+
+  Arguments:    filename : the file to write
+
+  Returns:      True if the file was written.
+ *---------------------------------------------------------------------------*/
+bool StateMachineProfiler::WriteCSV( const char * filename )
+{
+	FILE * file = fopen( filename, "w" );
+	if( file == 0 ) {
+		return( false );
+	}
+
+	ProfileSnapshot snapshot;
+	GetSnapshot( snapshot );
+
+	char state[64];
+	char substate[64];
+	fprintf( file, "machine,state,substate,event,calls,total_ms,average_us\n" );
+	for( ProfileSnapshot::iterator i=snapshot.begin(); i!=snapshot.end(); ++i )
+	{
+		fprintf( file, "%s,%s,%s,%s,%u,%.4f,%.4f\n", i->m_key.m_machine, GetStateText( i->m_key, state ), GetSubstateText( i->m_key, substate ),
+			GetEventText( i->m_key ), i->m_calls, i->m_seconds * 1000.0, i->m_seconds * 1000000.0 / (double)i->m_calls );
+	}
+
+	fclose( file );
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteJSON
+
+  Description:  Writes a snapshot as a JSON array of entries.
+
+  Arguments:    filename : the file to write
+
+  Returns:      True if the file was written.
+ *---------------------------------------------------------------------------*/
+bool StateMachineProfiler::WriteJSON( const char * filename )
+{
+	FILE * file = fopen( filename, "w" );
+	if( file == 0 ) {
+		return( false );
+	}
+
+	ProfileSnapshot snapshot;
+	GetSnapshot( snapshot );
+
+	char state[64];
+	char substate[64];
+	fprintf( file, "[\n" );
+	for( ProfileSnapshot::iterator i=snapshot.begin(); i!=snapshot.end(); ++i )
+	{
+		fprintf( file, "\t{ \"machine\": \"%s\", \"state\": \"%s\", \"substate\": \"%s\", \"event\": \"%s\", \"calls\": %u, \"total_ms\": %.4f, \"average_us\": %.4f }%s\n",
+			i->m_key.m_machine, GetStateText( i->m_key, state ), GetSubstateText( i->m_key, substate ), GetEventText( i->m_key ),
+			i->m_calls, i->m_seconds * 1000.0, i->m_seconds * 1000000.0 / (double)i->m_calls, i+1 != snapshot.end() ? "," : "" );
+	}
+	fprintf( file, "]\n" );
+
+	fclose( file );
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetStateText
+
+  Description:  The state name, or the state number if the name isn't known.
+
+  Arguments:    key    : the entry
+                buffer : storage for the number (at least 16 characters)
+
+  Returns:      The text.
+ *---------------------------------------------------------------------------*/
+const char * StateMachineProfiler::GetStateText( const ProfileKey & key, char * buffer )
+{
+	if( key.m_state < 0 ) {
+		return( "STATE_Global" );
+	}
+	if( key.m_names && key.m_names->GetStateName( key.m_state )[0] != 0 ) {
+		return( key.m_names->GetStateName( key.m_state ) );
+	}
+
+	sprintf( buffer, "%d", key.m_state );
+	return( buffer );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetSubstateText
+
+  Description:  The substate name, or the substate number if the name isn't
+                known (empty if not in a substate).
+
+  Arguments:    key    : the entry
+                buffer : storage for the number (at least 16 characters)
+
+  Returns:      The text.
+ *---------------------------------------------------------------------------*/
+const char * StateMachineProfiler::GetSubstateText( const ProfileKey & key, char * buffer )
+{
+	if( key.m_substate < 0 ) {
+		return( "" );
+	}
+	if( key.m_names && key.m_names->GetSubstateName( key.m_substate )[0] != 0 ) {
+		return( key.m_names->GetSubstateName( key.m_substate ) );
+	}
+
+	sprintf( buffer, "%d", key.m_substate );
+	return( buffer );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetEventText
+
+  Description:  The event name (the message name for message events).
+
+  Arguments:    key : the entry
+
+  Returns:      The text.
+ *---------------------------------------------------------------------------*/
+const char * StateMachineProfiler::GetEventText( const ProfileKey & key )
+{
+	if( key.m_msgname != PROFILE_NO_MSG ) {
+		return( g_debuglog.TranslateMsgNameToString( (MSG_Name)key.m_msgname ) );
+	}
+
+	switch( key.m_event )
+	{
+		case PROFILE_EVENT_STATE_CHANGE:	return( "STATE_CHANGE" );
+		case EVENT_Update:					return( "EVENT_Update" );
+		case EVENT_Message:					return( "EVENT_Message" );
+		case EVENT_CCMessage:				return( "EVENT_CCMessage" );
+		case EVENT_Enter:					return( "EVENT_Enter" );
+		case EVENT_Exit:					return( "EVENT_Exit" );
+		case EVENT_Probe:					return( "EVENT_Probe" );
+		case EVENT_Timer:					return( "EVENT_Timer" );
+		default:							return( "INVALID_EVENT" );
+	}
+}
+
+
+/*---------------------------------------------------------------------------*
+  Name:         Start
+
+  Description:  Captures what is about to run and the start time.
+
+  Arguments:    machine : the state machine
+                event   : the event (or PROFILE_EVENT_STATE_CHANGE)
+                msg     : the message of a message event (optional)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void ProfileScope::Start( StateMachine & machine, int event, MSG_Object * msg )
+{
+	m_key.m_machine = typeid( machine ).name();
+	m_key.m_names = machine.GetStateNameTable();
+	m_key.m_state = machine.GetState();
+	m_key.m_substate = machine.GetSubstate();
+	m_key.m_event = event;
+	m_key.m_msgname = msg ? (int)msg->GetName() : PROFILE_NO_MSG;
+
+	LARGE_INTEGER qwTime;
+	QueryPerformanceCounter( &qwTime );
+	m_start = qwTime.QuadPart;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Stop
+
+  Description:  Records the time since Start.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void ProfileScope::Stop( void )
+{
+	LARGE_INTEGER qwTime;
+	QueryPerformanceCounter( &qwTime );
+	g_profiler.Record( m_key, qwTime.QuadPart - m_start );
+}
@@ -0,0 +1,112 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+#include "jobsystem.h"
+#include <map>
+#include <vector>
+
+class StateMachine;
+class MSG_Object;
+struct StateNameTable;
+
+
+#define PROFILE_EVENT_STATE_CHANGE (-1)		//Event of the entries timing a state change (State_Machine_Event otherwise)
+#define PROFILE_NO_MSG (-1)					//Message name of the entries that aren't message events
+
+
+//What was running: the state machine class, its state and substate when the
+//call started, and the event (plus the message name for message events)
+struct ProfileKey
+{
+	const char * m_machine;				//Class name of the state machine (from RTTI)
+	const StateNameTable * m_names;		//Names of the states (0 without debug macros)
+	int m_state;
+	int m_substate;
+	int m_event;
+	int m_msgname;
+
+	bool operator<( const ProfileKey & rhs ) const;
+};
+
+struct ProfileCounter
+{
+	unsigned int m_calls;
+	LONGLONG m_ticks;					//Performance counter ticks
+};
+
+struct ProfileEntry
+{
+	ProfileKey m_key;
+	unsigned int m_calls;
+	double m_seconds;					//Total time (inclusive - a Process includes its state changes)
+};
+
+typedef std::vector<ProfileEntry> ProfileSnapshot;
+
+
+//Accumulates call counts and time per state machine class, state, substate and
+//event. Each job system worker records into its own table, so recording during
+//a parallel update needs no lock. The tables are merged by GetSnapshot.
+//Only compiled into the state machine when STATE_MACHINE_PROFILING is defined.
+class StateMachineProfiler : public Singleton <StateMachineProfiler>
+{
+public:
+
+	StateMachineProfiler( void );
+	~StateMachineProfiler( void ) {}
+
+	inline void SetEnabled( bool enabled )			{ m_enabled = enabled; }
+	inline bool IsEnabled( void )					{ return( m_enabled ); }
+
+	void Record( const ProfileKey & key, LONGLONG ticks );
+	void Reset( void );
+
+	//Call between frames (not during a parallel update). Sorted by total time, highest first.
+	void GetSnapshot( ProfileSnapshot & snapshot );
+	bool WriteCSV( const char * filename );
+	bool WriteJSON( const char * filename );
+
+private:
+
+	typedef std::map<ProfileKey, ProfileCounter> ProfileTable;
+
+	ProfileTable m_tables[JOB_SYSTEM_MAX_WORKERS];	//Indexed by job system worker
+	double m_ticksPerSecond;
+	bool m_enabled;
+
+	const char * GetStateText( const ProfileKey & key, char * buffer );
+	const char * GetSubstateText( const ProfileKey & key, char * buffer );
+	const char * GetEventText( const ProfileKey & key );
+
+};
+
+
+//Times the enclosing block if the profiler exists and is enabled
+class ProfileScope
+{
+public:
+
+	inline ProfileScope( StateMachine & machine, int event, MSG_Object * msg )	{ m_active = StateMachineProfiler::DoesSingletonExist() && g_profiler.IsEnabled(); if( m_active ) { Start( machine, event, msg ); } }
+	inline ~ProfileScope( void )												{ if( m_active ) { Stop(); } }
+
+private:
+
+	ProfileKey m_key;
+	LONGLONG m_start;
+	bool m_active;
+
+	void Start( StateMachine & machine, int event, MSG_Object * msg );
+	void Stop( void );
+
+};
@@ -0,0 +1,452 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "shard.h"
+#include "database.h"
+#include "gameobject.h"
+#include "msgroute.h"
+#include "statemch.h"
+#include "movement.h"
+#include "time.h"
+
+
+#define SHARD_MSG_QUEUE_MASK (0x1F)		//Queue (5 bits, as in MSG_Object), then the flags
+#define SHARD_MSG_TIMER (0x20)
+#define SHARD_MSG_CC (0x40)
+
+
+Shard::Shard( unsigned int localShard, unsigned int numShards, ShardTransport & transport )
+: m_localShard( localShard ),
+  m_numShards( numShards ),
+  m_transport( transport ),
+  m_numMsgsSent( 0 ),
+  m_numMsgsReceived( 0 ),
+  m_numMsgsDropped( 0 ),
+  m_numMigrations( 0 ),
+  m_numFramesSent( 0 ),
+  m_numBadFrames( 0 )
+{
+	ASSERTMSG( numShards > 0 && numShards <= SHARD_MAX_SHARDS && localShard < numShards, "Shard::Shard - Invalid shard" );
+
+	for( unsigned int i=0; i<SHARD_MAX_SHARDS; ++i )
+	{
+		m_outgoing[i].m_numRecords = 0;
+	}
+
+	g_database.SetSlotPartition( numShards, localShard );
+}
+
+unsigned int Shard::GetHomeShard( objectID id )
+{
+	return( ( id & OBJECT_ID_INDEX_MASK ) % m_numShards );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         IsLocal
+
+  Description:  Whether messages to an object are delivered in this shard:
+                the object is stored here, or the ID is ours and the object
+				hasn't moved away (including IDs that aren't stored yet or
+				are stale, which the message router handles as usual).
+
+  Arguments:    id : the ID of the object
+
+  Returns:      Whether the object is local.
+ *---------------------------------------------------------------------------*/
+bool Shard::IsLocal( objectID id )
+{
+	if( ( id & OBJECT_ID_INDEX_MASK ) <= SYSTEM_OBJECT_ID || g_database.Find( id ) ) {
+		return( true );
+	}
+	if( GetHomeShard( id ) != m_localShard ) {
+		return( false );
+	}
+	return( m_away.find( id ) == m_away.end() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetRoute
+
+  Description:  Gets the shard that messages to a remote object are sent to:
+                where it is if it has an ID of ours, otherwise its home
+				shard (which forwards them if the object has moved on).
+
+  Arguments:    id : the ID of the object
+
+  Returns:      The shard.
+ *---------------------------------------------------------------------------*/
+unsigned int Shard::GetRoute( objectID id )
+{
+	unsigned int home = GetHomeShard( id );
+	if( home == m_localShard )
+	{
+		AwayMap::iterator i = m_away.find( id );
+		return( i != m_away.end() ? i->second : m_localShard );
+	}
+	return( home );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ForwardMsg
+
+  Description:  Sends a message to an object in another shard. It is added
+                to the frame for that shard, and scheduled there with the
+				same delay when the frame is received.
+
+  Arguments:    (the arguments of MsgRoute::SendMsg)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Shard::ForwardMsg( float delay, MSG_Name name, objectID receiver, objectID sender,
+                        Scope_Rule rule, unsigned int scope, unsigned int queue,
+						MSG_Data & data, bool timer, bool cc )
+{
+	if( data.IsPointer() )
+	{
+		ASSERTMSG( 0, "Shard::ForwardMsg - Pointer data can't be sent to another shard" );
+		m_numMsgsDropped++;
+		return;
+	}
+
+	WriteMsg( GetRoute( receiver ), delay, name, receiver, sender, rule, scope, queue, data, timer, cc, 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Migrate
+
+  Description:  Hands an object over to another shard. The object is saved
+                as in a snapshot (components and state machines, not the
+				animated model) together with its pending delayed messages
+				and the CC subscriptions it is the source of, then destroyed
+				here. Messages sent to it afterwards follow
+				it. Must be called from the main thread between frames.
+
+  Arguments:    id    : the ID of the object
+                shard : the shard to move it to
+
+  Returns:      Whether the object was handed over (it must be stored here,
+                not marked for deletion, and its state machines must be
+				registered, see REGISTER_STATE_MACHINE).
+ *---------------------------------------------------------------------------*/
+bool Shard::Migrate( objectID id, unsigned int shard )
+{
+	ASSERTMSG( !g_msgroute.IsDeferring(), "Shard::Migrate - Can't migrate during a parallel update" );
+
+	GameObject * object = g_database.Find( id );
+	if( object == 0 || object->IsMarkedForDeletion() || shard >= m_numShards || shard == m_localShard ) {
+		return( false );
+	}
+
+	//Calls made from other threads are delivered before the object leaves
+	g_msgroute.DrainMailbox();
+
+	SnapshotImage handoff;
+	SnapshotWriter writer( handoff, g_time.GetCurTime() );
+	writer.Write( id );
+	writer.Write( object->GetType() );
+	writer.WriteString( object->GetName() );
+	object->Save( writer );
+	if( !writer.IsValid() ) {
+		return( false );
+	}
+	g_msgroute.ExtractMsgsForReceiver( writer, id );
+
+	SnapshotImage & image = BeginRecord( shard, RECORD_HANDOFF );
+	image.insert( image.end(), handoff.begin(), handoff.end() );
+
+	unsigned int home = GetHomeShard( id );
+	if( home == m_localShard ) {
+		m_away[id] = shard;
+	}
+	else if( home != shard )
+	{	//The home shard forwards the messages sent to it from now on
+		SnapshotImage & moved = BeginRecord( home, RECORD_MOVED );
+		SnapshotWriter movedWriter( moved, 0.0 );
+		movedWriter.Write( id );
+		movedWriter.Write( shard );
+	}
+
+	delete( g_database.Detach( id ) );
+	m_numMigrations++;
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Released
+
+  Description:  Tells the home shard of an adopted object that has been
+                destroyed here that it can reuse the ID.
+
+  Arguments:    id : the ID of the object
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Shard::Released( objectID id )
+{
+	SnapshotImage & image = BeginRecord( GetHomeShard( id ), RECORD_RELEASED );
+	SnapshotWriter writer( image, 0.0 );
+	writer.Write( id );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Flush
+
+  Description:  Sends the frames written during this update, one per shard.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Shard::Flush( void )
+{
+	for( unsigned int i=0; i<m_numShards; ++i )
+	{
+		OutgoingFrame & frame = m_outgoing[i];
+		if( frame.m_numRecords == 0 ) {
+			continue;
+		}
+
+		unsigned int size = (unsigned int)frame.m_image.size();
+		memcpy( &frame.m_image[3 * sizeof( unsigned int )], &frame.m_numRecords, sizeof( unsigned int ) );
+		memcpy( &frame.m_image[4 * sizeof( unsigned int )], &size, sizeof( unsigned int ) );
+		m_transport.Send( i, &frame.m_image[0], size );
+
+		frame.m_image.clear();		//Keeps the capacity for the next frame
+		frame.m_numRecords = 0;
+		m_numFramesSent++;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Receive
+
+  Description:  Handles the frames that have arrived from the other shards:
+                adopts the objects handed over and schedules the messages.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Shard::Receive( void )
+{
+	const void * frame;
+	unsigned int size;
+	while( m_transport.Receive( frame, size ) )
+	{
+		ReadFrame( frame, size );
+	}
+}
+
+void Shard::ReadFrame( const void * frame, unsigned int size )
+{
+	if( size < SHARD_FRAME_HEADER_SIZE ) {
+		m_numBadFrames++;
+		return;
+	}
+
+	SnapshotReader reader( frame, size, g_time.GetCurTime() );
+	unsigned int magic = reader.Read<unsigned int>();
+	unsigned int version = reader.Read<unsigned int>();
+	unsigned int sender = reader.Read<unsigned int>();
+	unsigned int numRecords = reader.Read<unsigned int>();
+	unsigned int frameSize = reader.Read<unsigned int>();
+	if( magic != SHARD_FRAME_MAGIC || version != SNAPSHOT_VERSION || sender >= m_numShards || frameSize != size ) {
+		m_numBadFrames++;
+		return;
+	}
+
+	for( unsigned int i=0; i<numRecords && reader.IsValid(); ++i )
+	{
+		switch( reader.Read<unsigned char>() )
+		{
+			case RECORD_MSG:
+				ReadMsg( reader );
+				break;
+
+			case RECORD_HANDOFF:
+				ReadHandoff( reader );
+				break;
+
+			case RECORD_MOVED:
+				{
+					objectID id = reader.Read<objectID>();
+					unsigned int shard = reader.Read<unsigned int>();
+					if( reader.IsValid() && shard < m_numShards && GetHomeShard( id ) == m_localShard && m_away.find( id ) != m_away.end() ) {
+						m_away[id] = shard;
+					}
+				}
+				break;
+
+			case RECORD_RELEASED:
+				{
+					objectID id = reader.Read<objectID>();
+					if( reader.IsValid() && m_away.erase( id ) > 0 ) {
+						g_database.ReleaseID( id );
+					}
+				}
+				break;
+
+			default:
+				reader.Fail();
+				break;
+		}
+	}
+
+	if( !reader.IsValid() || !reader.IsAtEnd() )
+	{
+		ASSERTMSG( 0, "Shard::ReadFrame - The frame is corrupt (it is partially handled)" );
+		m_numBadFrames++;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BeginRecord
+
+  Description:  Starts a record in the frame for a shard (and the frame, if
+                it is the first record of this update).
+
+  Arguments:    shard : the shard the record is for
+                type  : the record type
+
+  Returns:      The frame image, for the record data to be appended to.
+ *---------------------------------------------------------------------------*/
+SnapshotImage & Shard::BeginRecord( unsigned int shard, RecordType type )
+{
+	ASSERTMSG( shard < m_numShards && shard != m_localShard, "Shard::BeginRecord - Invalid shard" );
+
+	OutgoingFrame & frame = m_outgoing[shard];
+	SnapshotWriter writer( frame.m_image, 0.0 );
+	if( frame.m_numRecords == 0 )
+	{	//The record count and size are filled in by Flush
+		frame.m_image.clear();
+		writer.Write( (unsigned int)SHARD_FRAME_MAGIC );
+		writer.Write( (unsigned int)SNAPSHOT_VERSION );
+		writer.Write( m_localShard );
+		writer.Write( (unsigned int)0 );
+		writer.Write( (unsigned int)0 );
+	}
+	writer.Write( (unsigned char)type );
+	frame.m_numRecords++;
+	return( frame.m_image );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteMsg
+
+  Description:  Writes a message record. The name, queue, flags, scope rule
+                and hop count take 5 bytes, followed by the IDs, scope,
+				delay and data (out of line data is copied in).
+
+  Arguments:    shard : the shard to send it to
+                hops  : the number of times it has been forwarded
+				(the rest are the arguments of MsgRoute::SendMsg)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Shard::WriteMsg( unsigned int shard, float delay, MSG_Name name, objectID receiver, objectID sender,
+                      Scope_Rule rule, unsigned int scope, unsigned int queue,
+					  MSG_Data & data, bool timer, bool cc, unsigned int hops )
+{
+	SnapshotImage & image = BeginRecord( shard, RECORD_MSG );
+	SnapshotWriter writer( image, 0.0 );
+	writer.Write( (unsigned short)name );
+	writer.Write( (unsigned char)( ( queue & SHARD_MSG_QUEUE_MASK ) | ( timer ? SHARD_MSG_TIMER : 0 ) | ( cc ? SHARD_MSG_CC : 0 ) ) );
+	writer.Write( (unsigned char)rule );
+	writer.Write( (unsigned char)hops );
+	writer.Write( receiver );
+	writer.Write( sender );
+	writer.Write( scope );
+	writer.Write( delay );
+	writer.WriteMsgData( data );
+	m_numMsgsSent++;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReadMsg
+
+  Description:  Reads a message record. It is sent on locally if the
+                receiver is here, otherwise forwarded towards it (a message
+				that keeps missing a moving object is eventually dropped).
+
+  Arguments:    reader : the frame being read
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Shard::ReadMsg( SnapshotReader & reader )
+{
+	MSG_Name name = (MSG_Name)reader.Read<unsigned short>();
+	unsigned char queueAndFlags = reader.Read<unsigned char>();
+	Scope_Rule rule = (Scope_Rule)reader.Read<unsigned char>();
+	unsigned int hops = reader.Read<unsigned char>();
+	objectID receiver = reader.Read<objectID>();
+	objectID sender = reader.Read<objectID>();
+	unsigned int scope = reader.Read<unsigned int>();
+	float delay = reader.Read<float>();
+	MSG_Data data = reader.ReadMsgData();		//Out of line data goes into the frame arena
+
+	unsigned int queue = queueAndFlags & SHARD_MSG_QUEUE_MASK;
+	if( !reader.IsValid() || name >= MSG_NUM || queue > STATE_MACHINE_QUEUE_ALL ) {
+		reader.Fail();
+		return;
+	}
+	m_numMsgsReceived++;
+
+	bool timer = ( queueAndFlags & SHARD_MSG_TIMER ) != 0;
+	bool cc = ( queueAndFlags & SHARD_MSG_CC ) != 0;
+	if( IsLocal( receiver ) ) {
+		g_msgroute.SendMsg( delay, name, receiver, sender, rule, scope, (StateMachineQueue)queue, data, timer, cc );
+	}
+	else if( hops < SHARD_MAX_HOPS ) {
+		WriteMsg( GetRoute( receiver ), delay, name, receiver, sender, rule, scope, queue, data, timer, cc, hops + 1 );
+	}
+	else {
+		m_numMsgsDropped++;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ReadHandoff
+
+  Description:  Recreates an object handed over by another shard, stores it
+                under its ID and schedules its pending delayed messages.
+
+  Arguments:    reader : the frame being read
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Shard::ReadHandoff( SnapshotReader & reader )
+{
+	objectID id = reader.Read<objectID>();
+	unsigned int type = reader.Read<unsigned int>();
+	const char * name = reader.ReadString();
+	if( !reader.IsValid() || strlen( name ) >= GAME_OBJECT_MAX_NAME_SIZE ) {
+		reader.Fail();
+		return;
+	}
+
+	GameObject * object = new GameObject( id, type, const_cast<char*>( name ) );
+	if( !object->Restore( reader ) || !g_database.Adopt( *object ) )
+	{
+		ASSERTMSG( !reader.IsValid(), "Shard::ReadHandoff - The ID of the object is in use" );
+		delete( object );
+		reader.Fail();
+		return;
+	}
+
+	if( object->HasMovement() ) {
+		object->GetMovement().ResumeFollowing();
+	}
+
+	if( GetHomeShard( id ) == m_localShard ) {
+		m_away.erase( id );		//Back home
+	}
+	g_msgroute.RestoreMsgs( reader );
+}
@@ -0,0 +1,131 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+#include "msg.h"
+#include "snapshot.h"
+#include <map>
+
+class GameObject;
+
+
+#define SHARD_MAX_SHARDS (64)
+#define SHARD_FRAME_MAGIC (0x44525353)		//"SSRD"
+#define SHARD_FRAME_HEADER_SIZE (5 * sizeof( unsigned int ))	//Magic, version, sender, record count and size
+#define SHARD_MAX_HOPS (8)					//Forwards of a message chasing a moving object before it's dropped
+
+
+//Carries frames between the processes. The engine has no networking of its own,
+//so the host implements this over whatever it uses (sockets, pipes, shared memory).
+//Frames must arrive complete and, between two processes, in the order they were sent.
+class ShardTransport
+{
+public:
+	virtual ~ShardTransport( void ) {}
+
+	virtual void Send( unsigned int shard, const void * frame, unsigned int size ) = 0;
+	virtual bool Receive( const void * & frame, unsigned int & size ) = 0;	//The next frame (valid until the next call), false if none
+};
+
+
+//Optional partitioning of the simulation over several processes (shards), each
+//running its own World. The host creates it, before any object, with its transport
+//(see World::CreateShard).
+//
+//  - Objects are partitioned by ID: each shard hands out the IDs of every Nth
+//    database slot (see Database::SetSlotPartition), so the home shard of an ID
+//    is known everywhere without a lookup.
+//  - MsgRoute::SendMsg to an object in another shard is written into the frame for
+//    that shard (one frame per shard per update, sent at the end of the update).
+//    Messages to an object that has moved away from its home shard go through the
+//    home shard, which keeps track of where its objects are.
+//  - Migrate hands an object over to another shard with its state machines (as in
+//    a snapshot) and its pending delayed messages. It keeps its ID.
+//
+//Broadcasts and area broadcasts stay within each shard, and pointer message data
+//can't be sent to another shard.
+class Shard : public Singleton <Shard>
+{
+public:
+
+	Shard( unsigned int localShard, unsigned int numShards, ShardTransport & transport );
+	~Shard( void ) {}
+
+	inline unsigned int GetLocalShard( void )				{ return( m_localShard ); }
+	inline unsigned int GetNumShards( void )				{ return( m_numShards ); }
+	unsigned int GetHomeShard( objectID id );
+	bool IsLocal( objectID id );							//Messages to the object are delivered here
+	unsigned int GetRoute( objectID id );					//Where messages to a remote object are sent
+
+	//Called by MsgRoute::SendMsg for remote receivers (main thread)
+	void ForwardMsg( float delay, MSG_Name name, objectID receiver, objectID sender,
+	                 Scope_Rule rule, unsigned int scope, unsigned int queue,
+					 MSG_Data & data, bool timer, bool cc );
+
+	//Hands an object over to another shard, between frames
+	bool Migrate( objectID id, unsigned int shard );
+
+	//Called by the database: the start and the end of each update, and
+	//an adopted object was destroyed (its home shard can reuse the ID)
+	void Receive( void );
+	void Flush( void );
+	void Released( objectID id );
+
+	//Stats (totals since startup)
+	inline unsigned int GetNumMsgsSent( void )				{ return( m_numMsgsSent ); }
+	inline unsigned int GetNumMsgsReceived( void )			{ return( m_numMsgsReceived ); }
+	inline unsigned int GetNumMsgsDropped( void )			{ return( m_numMsgsDropped ); }
+	inline unsigned int GetNumMigrations( void )			{ return( m_numMigrations ); }
+	inline unsigned int GetNumFramesSent( void )			{ return( m_numFramesSent ); }
+	inline unsigned int GetNumBadFrames( void )				{ return( m_numBadFrames ); }
+	inline unsigned int GetNumAway( void )					{ return( (unsigned int)m_away.size() ); }
+
+private:
+
+	enum RecordType {
+		RECORD_MSG,			//A message (compact encoding, see WriteMsg)
+		RECORD_HANDOFF,		//An object with its state machines and pending messages
+		RECORD_MOVED,		//To the home shard: one of its objects is now in another shard
+		RECORD_RELEASED		//To the home shard: one of its objects was destroyed
+	};
+
+	struct OutgoingFrame
+	{
+		SnapshotImage m_image;
+		unsigned int m_numRecords;
+	};
+
+	typedef std::map<objectID, unsigned int> AwayMap;
+
+	unsigned int m_localShard;
+	unsigned int m_numShards;
+	ShardTransport & m_transport;
+	OutgoingFrame m_outgoing[SHARD_MAX_SHARDS];
+	AwayMap m_away;						//Objects with IDs of ours that are in other shards, and where
+
+	unsigned int m_numMsgsSent;
+	unsigned int m_numMsgsReceived;
+	unsigned int m_numMsgsDropped;
+	unsigned int m_numMigrations;
+	unsigned int m_numFramesSent;
+	unsigned int m_numBadFrames;
+
+	SnapshotImage & BeginRecord( unsigned int shard, RecordType type );
+	void WriteMsg( unsigned int shard, float delay, MSG_Name name, objectID receiver, objectID sender,
+	               Scope_Rule rule, unsigned int scope, unsigned int queue,
+				   MSG_Data & data, bool timer, bool cc, unsigned int hops );
+	void ReadMsg( SnapshotReader & reader );
+	void ReadHandoff( SnapshotReader & reader );
+	void ReadFrame( const void * frame, unsigned int size );
+
+};
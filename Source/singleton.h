@@ -13,7 +13,14 @@
 #include <assert.h>
 #include <iostream>
 
-//Singleton class as authored by Scott Bilas in the book Game Programming Gems
+//Singleton class as authored by Scott Bilas in the book Game Programming Gems.
+//
+//The instance is per thread, so one process can run several independent worlds
+//(see worldcontext.h). It is bound to the thread that constructs it, and to any 
+//other thread with Bind (or WorldContext::Bind for all of a world's at once).
+//Reaching the instance is a thread local lookup, which costs a few dependent loads
+//more than the plain global it used to be, so hot loops should fetch an instance 
+//(or the value they need from it) once and pass it down - see FrameContext in time.h.
 
 template <typename T>
 class Singleton
@@ -22,19 +29,20 @@ public:
 	Singleton( void )
 	{
 		assert( ms_Singleton == 0 && "Singleton constructor" );
-		intptr_t offset = (intptr_t)(T*)1 - (intptr_t)(Singleton <T> *)(T*)1;
-		ms_Singleton = (T*)((intptr_t)this + offset);
+		ms_Singleton = Self();
 	}
-	~Singleton( void )  {  assert( ms_Singleton != 0 && "Singleton destructor" ); 
-ms_Singleton = 0;  }
+	~Singleton( void )  {  if( ms_Singleton == Self() ) { ms_Singleton = 0; }  }
 
 	static T&   GetSingleton      ( void )  {  assert( ms_Singleton != 0 && "Singleton - GetSingleton" );  return ( *ms_Singleton );  }
 	static T*   GetSingletonPtr   ( void )  {  return ( ms_Singleton );  }
 	static bool DoesSingletonExist( void )  {  return ( ms_Singleton != 0 );  }
+	static void Bind              ( T* instance )  {  ms_Singleton = instance;  }	//For the calling thread (0 unbinds)
 
 private:
-	static T* ms_Singleton;
+	static __declspec(thread) T* ms_Singleton;
+
+	T* Self( void )  {  intptr_t offset = (intptr_t)(T*)1 - (intptr_t)(Singleton <T> *)(T*)1;  return( (T*)((intptr_t)this + offset) );  }
 
 };
 
-template <typename T> T* Singleton <T>::ms_Singleton = 0;
\ No newline at end of file
+template <typename T> __declspec(thread) T* Singleton <T>::ms_Singleton = 0;
\ No newline at end of file
@@ -0,0 +1,301 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "snapshot.h"
+#include "database.h"
+#include "msgroute.h"
+#include "time.h"
+#include "msgpayload.h"
+#include <map>
+#include <set>
+#include <string>
+
+
+#define SNAPSHOT_HEADER_SIZE (3 * sizeof( unsigned int ))	//Magic, version and image size
+
+typedef std::map<std::string, StateMachineCreator> StateMachineCreatorMap;
+
+//Payload type names of restored message data (payloads only keep a pointer to the name).
+//Shared by the worlds of the process (see worldcontext.h), which may restore at the same time.
+class PayloadTypeNames
+{
+public:
+	PayloadTypeNames( void )		{ InitializeCriticalSection( &m_lock ); }
+	~PayloadTypeNames( void )		{ DeleteCriticalSection( &m_lock ); }
+
+	const char * Intern( const char * type )
+	{
+		EnterCriticalSection( &m_lock );
+		const char * name = m_types.insert( type ).first->c_str();
+		LeaveCriticalSection( &m_lock );
+		return( name );
+	}
+
+private:
+	std::set<std::string> m_types;
+	CRITICAL_SECTION m_lock;
+};
+static PayloadTypeNames s_payloadTypeNames;
+
+static const char * InternPayloadType( const char * type )
+{
+	return( s_payloadTypeNames.Intern( type ) );
+}
+
+//Registered state machine classes (a function static, since registrations run during static initialization)
+static StateMachineCreatorMap & GetStateMachineCreators( void )
+{
+	static StateMachineCreatorMap creators;
+	return( creators );
+}
+
+
+/*---------------------------------------------------------------------------*
+  Name:         SaveSnapshot
+
+  Description:  Saves the whole simulation into a binary image. Must be 
+                called from the main thread between frames.
+
+  Arguments:    image : receives the image
+
+  Returns:      Whether everything could be saved (a state machine class
+                that isn't registered can't be).
+ *---------------------------------------------------------------------------*/
+bool SaveSnapshot( SnapshotImage & image )
+{
+	ASSERTMSG( !g_msgroute.IsDeferring(), "SaveSnapshot - Can't save during a parallel update" );
+
+	//Calls made from other threads become part of the image
+	g_msgroute.DrainMailbox();
+
+	image.clear();
+	SnapshotWriter writer( image, g_time.GetCurTime() );
+	writer.Write( (unsigned int)SNAPSHOT_MAGIC );
+	writer.Write( (unsigned int)SNAPSHOT_VERSION );
+	writer.Write( (unsigned int)0 );
+
+	g_database.Save( writer );
+	g_msgroute.Save( writer );
+
+	unsigned int size = (unsigned int)image.size();
+	memcpy( &image[2 * sizeof( unsigned int )], &size, sizeof( size ) );
+	return( writer.IsValid() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SaveSnapshot
+
+  Description:  Saves the whole simulation into a file.
+
+  Arguments:    filename : the file to write
+
+  Returns:      Whether the snapshot was saved.
+ *---------------------------------------------------------------------------*/
+bool SaveSnapshot( const char * filename )
+{
+	SnapshotImage image;
+	if( !SaveSnapshot( image ) ) {
+		return( false );
+	}
+
+	FILE * file = fopen( filename, "wb" );
+	if( !file ) {
+		return( false );
+	}
+	bool written = fwrite( &image[0], 1, image.size(), file ) == image.size();
+	fclose( file );
+	return( written );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RestoreSnapshot
+
+  Description:  Restores the simulation from a binary image, in place of
+                building the objects up front. The database must be empty.
+				The header is checked before anything is restored.
+
+  Arguments:    image : the image (only read, so it can be a mapped file)
+                size  : the size of the image in bytes
+
+  Returns:      Whether the image was restored.
+ *---------------------------------------------------------------------------*/
+bool RestoreSnapshot( const void * image, unsigned int size )
+{
+	if( size < SNAPSHOT_HEADER_SIZE ) {
+		return( false );
+	}
+
+	SnapshotReader reader( image, size, g_time.GetCurTime() );
+	unsigned int magic = reader.Read<unsigned int>();
+	unsigned int version = reader.Read<unsigned int>();
+	unsigned int imageSize = reader.Read<unsigned int>();
+	if( magic != SNAPSHOT_MAGIC || version != SNAPSHOT_VERSION || imageSize != size ) {
+		return( false );
+	}
+
+	if( !g_database.Restore( reader ) || !g_msgroute.Restore( reader ) ) {
+		ASSERTMSG( 0, "RestoreSnapshot - The image is corrupt (the simulation is partially restored)" );
+		return( false );
+	}
+	return( reader.IsAtEnd() );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RestoreSnapshot
+
+  Description:  Restores the simulation from a file, which is memory mapped
+                instead of read.
+
+  Arguments:    filename : the file to read
+
+  Returns:      Whether the snapshot was restored.
+ *---------------------------------------------------------------------------*/
+bool RestoreSnapshot( const char * filename )
+{
+	HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0 );
+	if( file == INVALID_HANDLE_VALUE ) {
+		return( false );
+	}
+
+	bool restored = false;
+	DWORD size = GetFileSize( file, 0 );
+	HANDLE mapping = size > 0 ? CreateFileMappingA( file, 0, PAGE_READONLY, 0, 0, 0 ) : 0;
+	if( mapping )
+	{
+		const void * view = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+		if( view )
+		{
+			restored = RestoreSnapshot( view, (unsigned int)size );
+			UnmapViewOfFile( view );
+		}
+		CloseHandle( mapping );
+	}
+	CloseHandle( file );
+	return( restored );
+}
+
+
+void SnapshotWriter::WriteBytes( const void * data, unsigned int size )
+{
+	const unsigned char * bytes = (const unsigned char *)data;
+	m_image.insert( m_image.end(), bytes, bytes + size );
+}
+
+void SnapshotWriter::WriteString( const char * string )
+{
+	WriteBytes( string, (unsigned int)strlen( string ) + 1 );
+}
+
+void SnapshotWriter::WriteMsgData( MSG_Data & data )
+{
+	Write( data.GetType() );
+	if( data.IsOutOfLine() )
+	{
+		MsgPayload * payload = data.GetOutOfLine();
+		WriteString( payload->m_type );
+		Write( payload->m_count );
+		Write( payload->m_size );
+		WriteBytes( payload->GetData(), payload->m_size );
+	}
+	else
+	{
+		Write( data );
+	}
+}
+
+
+SnapshotReader::SnapshotReader( const void * image, unsigned int size, double baseTime )
+: m_image( (const unsigned char *)image ),
+  m_size( size ),
+  m_pos( 0 ),
+  m_baseTime( baseTime ),
+  m_failed( false )
+{
+
+}
+
+void SnapshotReader::ReadBytes( void * data, unsigned int size )
+{
+	const void * bytes = ReadInPlace( size );
+	if( bytes ) {
+		memcpy( data, bytes, size );
+	}
+	else {
+		memset( data, 0, size );
+	}
+}
+
+const void * SnapshotReader::ReadInPlace( unsigned int size )
+{
+	if( m_failed || size > m_size - m_pos )
+	{
+		m_failed = true;
+		return( 0 );
+	}
+
+	const void * bytes = m_image + m_pos;
+	m_pos += size;
+	return( bytes );
+}
+
+const char * SnapshotReader::ReadString( void )
+{
+	const char * string = (const char *)( m_image + m_pos );
+	const void * end = m_failed ? 0 : memchr( string, 0, m_size - m_pos );
+	if( !end )
+	{
+		m_failed = true;
+		return( "" );
+	}
+
+	m_pos += (unsigned int)( (const char *)end - string ) + 1;
+	return( string );
+}
+
+MSG_Data SnapshotReader::ReadMsgData( void )
+{
+	MSG_Data_Value type = Read<MSG_Data_Value>();
+	if( type != MSG_DATA_VECTOR3 && type != MSG_DATA_PAYLOAD ) {
+		return( Read<MSG_Data>() );
+	}
+
+	const char * payloadType = ReadString();
+	unsigned int count = Read<unsigned int>();
+	unsigned int size = Read<unsigned int>();
+	const void * bytes = ReadInPlace( size );
+	if( !bytes || ( count > 0 && size % count != 0 ) || ( type == MSG_DATA_VECTOR3 && size != sizeof( Vector3 ) ) )
+	{
+		Fail();
+		return( MSG_Data() );
+	}
+
+	if( type == MSG_DATA_VECTOR3 ) {
+		return( MSG_Data( *(const Vector3*)bytes ) );
+	}
+	return( MSG_Data( CreateMsgPayload( bytes, count > 0 ? size / count : 0, count, InternPayloadType( payloadType ) ) ) );
+}
+
+
+StateMachineRegistration::StateMachineRegistration( const char * name, StateMachineCreator creator )
+{
+	GetStateMachineCreators()[name] = creator;
+}
+
+StateMachine * StateMachineRegistration::Create( const char * name, GameObject & object )
+{
+	StateMachineCreatorMap::iterator i = GetStateMachineCreators().find( name );
+	return( i != GetStateMachineCreators().end() ? i->second( object ) : 0 );
+}
+
+bool StateMachineRegistration::IsRegistered( const char * name )
+{
+	return( GetStateMachineCreators().find( name ) != GetStateMachineCreators().end() );
+}
@@ -0,0 +1,110 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include <vector>
+#include <typeinfo>
+
+
+#define SNAPSHOT_MAGIC (0x53535253)		//"SRSS"
+#define SNAPSHOT_VERSION (5)			//Bump whenever the layout of anything saved changes
+
+class GameObject;
+class StateMachine;
+class MSG_Data;
+
+typedef std::vector<unsigned char> SnapshotImage;
+
+
+//A snapshot is a binary image of the whole simulation: the database objects (with
+//their IDs and slot table), each state machine manager's queues, each state machine's
+//states, scopes, variables, timers and state stack, the pending delayed messages,
+//the topic subscriptions, the publishes and area broadcasts queued for the next frame
+//and the CC subscriptions.
+//Times are stored relative to the time of the snapshot, so a restored simulation 
+//carries on from the current time. It has to be taken between frames (not during a 
+//parallel update or while delivering messages). Not saved: pointer state variables 
+//and message data (they are copied as is), and the animation of the rendered
+//characters (their movement goals are saved, the speed of their move animation isn't).
+bool SaveSnapshot( SnapshotImage & image );
+bool SaveSnapshot( const char * filename );
+
+//Restores into an empty database. The image can be a memory mapped file (it is
+//only read). Returns false if the image is invalid or from another version.
+bool RestoreSnapshot( const void * image, unsigned int size );
+bool RestoreSnapshot( const char * filename );
+
+
+//Appends values to a snapshot image
+class SnapshotWriter
+{
+public:
+	SnapshotWriter( SnapshotImage & image, double baseTime ) : m_image( image ), m_baseTime( baseTime ), m_failed( false )	{}
+
+	template <class T> inline void Write( const T & value )		{ WriteBytes( &value, sizeof( T ) ); }
+	inline void WriteTime( double time )						{ Write( time - m_baseTime ); }		//Relative to the snapshot
+	void WriteBytes( const void * data, unsigned int size );
+	void WriteString( const char * string );
+	void WriteMsgData( MSG_Data & data );						//Including out of line data (pointers are copied as is)
+
+	inline bool IsValid( void )									{ return( !m_failed ); }
+	inline void Fail( void )									{ m_failed = true; }		//Something can't be saved
+
+private:
+	SnapshotImage & m_image;
+	double m_baseTime;
+	bool m_failed;
+};
+
+
+//Reads values back out of a snapshot image. Reading past the end (or a string 
+//that isn't terminated) fails the reader, after which every read returns zeros.
+class SnapshotReader
+{
+public:
+	SnapshotReader( const void * image, unsigned int size, double baseTime );
+
+	template <class T> inline T Read( void )					{ T value; ReadBytes( &value, sizeof( T ) ); return( value ); }
+	inline double ReadTime( void )								{ return( Read<double>() + m_baseTime ); }
+	void ReadBytes( void * data, unsigned int size );
+	const char * ReadString( void );							//Points into the image
+	const void * ReadInPlace( unsigned int size );				//Points into the image (0 if past the end)
+	MSG_Data ReadMsgData( void );								//Out of line data is copied into the MsgRoute frame arena
+
+	inline bool IsValid( void )									{ return( !m_failed ); }
+	inline void Fail( void )									{ m_failed = true; }
+	inline bool IsAtEnd( void )									{ return( m_pos == m_size ); }
+
+private:
+	const unsigned char * m_image;
+	unsigned int m_size;
+	unsigned int m_pos;
+	double m_baseTime;
+	bool m_failed;
+};
+
+
+//State machines are recreated from a snapshot by class name, so each state machine
+//class that can be in a snapshot registers itself in its .cpp file:
+//	REGISTER_STATE_MACHINE( Example )
+typedef StateMachine * (*StateMachineCreator)( GameObject & object );
+
+class StateMachineRegistration
+{
+public:
+	StateMachineRegistration( const char * name, StateMachineCreator creator );
+
+	static StateMachine * Create( const char * name, GameObject & object );		//0 if the class isn't registered
+	static bool IsRegistered( const char * name );
+};
+
+#define REGISTER_STATE_MACHINE(type)	static StateMachine * CreateStateMachine##type( GameObject & object ) { return( new type( object ) ); } \
+										static StateMachineRegistration stateMachineRegistration##type( typeid( type ).name(), CreateStateMachine##type );
@@ -0,0 +1,497 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "spatialgrid.h"
+#include "gameobject.h"
+#include <algorithm>
+
+
+#define SPATIAL_GRID_INITIAL_TABLE_SIZE (64)	//Power of two
+
+
+static inline unsigned int HashCell( int x, int z )
+{
+	return( ( (unsigned int)x * 73856093u ) ^ ( (unsigned int)z * 19349663u ) );
+}
+
+
+SpatialGrid::SpatialGrid( float cellSize )
+: m_cellSize( cellSize ),
+  m_invCellSize( 1.0f / cellSize ),
+  m_numEntries( 0 ),
+  m_minX( 0 ),
+  m_maxX( -1 ),
+  m_minZ( 0 ),
+  m_maxZ( -1 )
+{
+	ASSERTMSG( cellSize > 0.0f, "SpatialGrid::SpatialGrid - The cell size must be positive." );
+	m_table.assign( SPATIAL_GRID_INITIAL_TABLE_SIZE, SPATIAL_GRID_NO_ENTRY );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Insert
+
+  Description:  Adds an object to the grid. Released entries are reused first.
+
+  Arguments:    object : the object
+                pos    : its position (must stay valid until Remove)
+
+  Returns:      The grid entry.
+ *---------------------------------------------------------------------------*/
+unsigned int SpatialGrid::Insert( GameObject & object, Vector3 * pos )
+{
+	unsigned int entry;
+	if( !m_freeEntries.empty() )
+	{
+		entry = m_freeEntries.back();
+		m_freeEntries.pop_back();
+	}
+	else
+	{
+		entry = (unsigned int)m_entries.size();
+		m_entries.push_back( Entry() );
+	}
+
+	Entry & e = m_entries[entry];
+	e.m_object = &object;
+	e.m_source = pos;
+	e.m_x = pos->x;
+	e.m_z = pos->z;
+	Link( entry );
+
+	m_numEntries++;
+	return( entry );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Remove
+
+  Description:  Takes an object out of the grid.
+
+  Arguments:    entry : the grid entry
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::Remove( unsigned int entry )
+{
+	ASSERTMSG( entry < m_entries.size() && m_entries[entry].m_object, "SpatialGrid::Remove - Entry isn't in use." );
+
+	Unlink( entry );
+	m_entries[entry].m_object = 0;
+	m_entries[entry].m_source = 0;
+	m_freeEntries.push_back( entry );
+	m_numEntries--;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Move
+
+  Description:  Reads the position of an entry again, relinking it if it is
+                now in another cell.
+
+  Arguments:    entry : the grid entry
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::Move( unsigned int entry )
+{
+	Entry & e = m_entries[entry];
+	e.m_x = e.m_source->x;
+	e.m_z = e.m_source->z;
+
+	const Cell & cell = m_cells[e.m_cell];
+	if( cell.m_x != GetCellCoord( e.m_x ) || cell.m_z != GetCellCoord( e.m_z ) )
+	{
+		Unlink( entry );
+		Link( entry );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Refresh
+
+  Description:  Reads the positions of all entries again. Time complexity
+                O(n), plus a relink for each entry that changed cell.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::Refresh( void )
+{
+	for( unsigned int i=0; i<m_entries.size(); ++i )
+	{
+		if( m_entries[i].m_object ) {
+			Move( i );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindInRadius
+
+  Description:  Finds the objects within a distance of a point. Only the
+                cells overlapping the circle are visited.
+
+  Arguments:    center  : the point
+                radius  : the distance
+                result  : filled with the objects (in no particular order)
+                type    : the object types to accept
+                exclude : an object to skip (optional)
+
+  Returns:      None. (The result is stored in the result argument.)
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::FindInRadius( const Vector3 & center, float radius, SpatialObjectList & result, unsigned int type, GameObject * exclude )
+{
+	result.clear();
+
+	int x0 = std::max( GetCellCoord( center.x - radius ), m_minX );
+	int x1 = std::min( GetCellCoord( center.x + radius ), m_maxX );
+	int z0 = std::max( GetCellCoord( center.z - radius ), m_minZ );
+	int z1 = std::min( GetCellCoord( center.z + radius ), m_maxZ );
+	float radiusSq = radius * radius;
+
+	for( int z=z0; z<=z1; ++z )
+	{
+		for( int x=x0; x<=x1; ++x )
+		{
+			unsigned int cell = FindCell( x, z );
+			if( cell == SPATIAL_GRID_NO_ENTRY ) {
+				continue;
+			}
+
+			const std::vector<unsigned int> & entries = m_cells[cell].m_entries;
+			for( unsigned int i=0; i<entries.size(); ++i )
+			{
+				const Entry & e = m_entries[entries[i]];
+				float dx = e.m_x - center.x;
+				float dz = e.m_z - center.z;
+				if( dx * dx + dz * dz <= radiusSq && Accepts( entries[i], type, exclude ) ) {
+					result.push_back( e.m_object );
+				}
+			}
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindNearest
+
+  Description:  Finds the objects closest to a point. The search visits rings
+                of cells around the point and stops once no unvisited cell
+                can hold anything closer than what was found.
+
+  Arguments:    center  : the point
+                count   : how many objects to find (at most)
+                result  : filled with the objects, nearest first
+                type    : the object types to accept
+                exclude : an object to skip (optional)
+
+  Returns:      None. (The result is stored in the result argument.)
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::FindNearest( const Vector3 & center, unsigned int count, SpatialObjectList & result, unsigned int type, GameObject * exclude )
+{
+	result.clear();
+	if( count == 0 || m_numEntries == 0 ) {
+		return;
+	}
+
+	int cx = GetCellCoord( center.x );
+	int cz = GetCellCoord( center.z );
+	int maxRing = std::max( std::max( cx - m_minX, m_maxX - cx ), std::max( cz - m_minZ, m_maxZ - cz ) );
+
+	CandidateList candidates;
+	for( int ring=0; ring<=maxRing; ++ring )
+	{
+		if( ring == 0 )
+		{
+			GatherCell( FindCell( cx, cz ), center, type, exclude, candidates );
+		}
+		else
+		{
+			for( int d=-ring; d<=ring; ++d )
+			{	//Top and bottom rows, then the sides without the corners
+				GatherCell( FindCell( cx + d, cz - ring ), center, type, exclude, candidates );
+				GatherCell( FindCell( cx + d, cz + ring ), center, type, exclude, candidates );
+				if( d != -ring && d != ring )
+				{
+					GatherCell( FindCell( cx - ring, cz + d ), center, type, exclude, candidates );
+					GatherCell( FindCell( cx + ring, cz + d ), center, type, exclude, candidates );
+				}
+			}
+		}
+
+		if( candidates.size() >= count )
+		{	//Everything beyond this ring is at least ring cells away
+			std::nth_element( candidates.begin(), candidates.begin() + ( count - 1 ), candidates.end() );
+			float reach = (float)ring * m_cellSize;
+			if( candidates[count - 1].m_distSq <= reach * reach ) {
+				break;
+			}
+		}
+	}
+
+	unsigned int found = std::min( count, (unsigned int)candidates.size() );
+	std::partial_sort( candidates.begin(), candidates.begin() + found, candidates.end() );
+	for( unsigned int i=0; i<found; ++i )
+	{
+		result.push_back( m_entries[candidates[i].m_index].m_object );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindFarthest
+
+  Description:  Finds the object farthest from a point. The occupied cells
+                are visited by their farthest possible distance, so the scan
+                stops at the first cell that can't beat the best so far.
+
+  Arguments:    center  : the point
+                type    : the object types to accept
+                exclude : an object to skip (optional)
+
+  Returns:      The object, or 0 if none (or all are at the point itself).
+ *---------------------------------------------------------------------------*/
+GameObject * SpatialGrid::FindFarthest( const Vector3 & center, unsigned int type, GameObject * exclude )
+{
+	CandidateList cells;
+	for( unsigned int i=0; i<m_cells.size(); ++i )
+	{
+		if( m_cells[i].m_entries.empty() ) {
+			continue;
+		}
+
+		float x0 = (float)m_cells[i].m_x * m_cellSize;
+		float z0 = (float)m_cells[i].m_z * m_cellSize;
+		float dx = std::max( fabsf( center.x - x0 ), fabsf( center.x - ( x0 + m_cellSize ) ) );
+		float dz = std::max( fabsf( center.z - z0 ), fabsf( center.z - ( z0 + m_cellSize ) ) );
+
+		Candidate candidate;
+		candidate.m_distSq = dx * dx + dz * dz;
+		candidate.m_index = i;
+		cells.push_back( candidate );
+	}
+	std::sort( cells.rbegin(), cells.rend() );		//Farthest first
+
+	float farthestDistSq = 0.0f;
+	GameObject * farthest = 0;
+	for( unsigned int c=0; c<cells.size() && cells[c].m_distSq > farthestDistSq; ++c )
+	{
+		const std::vector<unsigned int> & entries = m_cells[cells[c].m_index].m_entries;
+		for( unsigned int i=0; i<entries.size(); ++i )
+		{
+			const Entry & e = m_entries[entries[i]];
+			float dx = e.m_x - center.x;
+			float dz = e.m_z - center.z;
+			float distSq = dx * dx + dz * dz;
+			if( distSq > farthestDistSq && Accepts( entries[i], type, exclude ) )
+			{
+				farthestDistSq = distSq;
+				farthest = e.m_object;
+			}
+		}
+	}
+
+	return( farthest );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindCell
+
+  Description:  Looks up a cell by its coordinates.
+
+  Arguments:    x : the cell column
+                z : the cell row
+
+  Returns:      The cell, or SPATIAL_GRID_NO_ENTRY if it was never created.
+ *---------------------------------------------------------------------------*/
+unsigned int SpatialGrid::FindCell( int x, int z )
+{
+	unsigned int mask = (unsigned int)m_table.size() - 1;
+	for( unsigned int slot = HashCell( x, z ) & mask; m_table[slot] != SPATIAL_GRID_NO_ENTRY; slot = ( slot + 1 ) & mask )
+	{
+		const Cell & cell = m_cells[m_table[slot]];
+		if( cell.m_x == x && cell.m_z == z ) {
+			return( m_table[slot] );
+		}
+	}
+	return( SPATIAL_GRID_NO_ENTRY );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetCell
+
+  Description:  Looks up a cell by its coordinates, creating it if needed.
+                The hash table is kept at most half full.
+
+  Arguments:    x : the cell column
+                z : the cell row
+
+  Returns:      The cell.
+ *---------------------------------------------------------------------------*/
+unsigned int SpatialGrid::GetCell( int x, int z )
+{
+	unsigned int cell = FindCell( x, z );
+	if( cell != SPATIAL_GRID_NO_ENTRY ) {
+		return( cell );
+	}
+
+	cell = (unsigned int)m_cells.size();
+	m_cells.push_back( Cell() );
+	m_cells[cell].m_x = x;
+	m_cells[cell].m_z = z;
+
+	if( m_cells.size() * 2 > m_table.size() )
+	{
+		Rehash( (unsigned int)m_table.size() * 2 );
+	}
+	else
+	{
+		unsigned int mask = (unsigned int)m_table.size() - 1;
+		unsigned int slot = HashCell( x, z ) & mask;
+		while( m_table[slot] != SPATIAL_GRID_NO_ENTRY ) {
+			slot = ( slot + 1 ) & mask;
+		}
+		m_table[slot] = cell;
+	}
+
+	if( m_minX > m_maxX )
+	{	//First cell
+		m_minX = m_maxX = x;
+		m_minZ = m_maxZ = z;
+	}
+	else
+	{
+		m_minX = std::min( m_minX, x );
+		m_maxX = std::max( m_maxX, x );
+		m_minZ = std::min( m_minZ, z );
+		m_maxZ = std::max( m_maxZ, z );
+	}
+
+	return( cell );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Rehash
+
+  Description:  Rebuilds the hash table at a new size.
+
+  Arguments:    size : the number of slots (a power of two)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::Rehash( unsigned int size )
+{
+	m_table.assign( size, SPATIAL_GRID_NO_ENTRY );
+
+	unsigned int mask = size - 1;
+	for( unsigned int i=0; i<m_cells.size(); ++i )
+	{
+		unsigned int slot = HashCell( m_cells[i].m_x, m_cells[i].m_z ) & mask;
+		while( m_table[slot] != SPATIAL_GRID_NO_ENTRY ) {
+			slot = ( slot + 1 ) & mask;
+		}
+		m_table[slot] = i;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Link
+
+  Description:  Adds an entry to the cell of its position.
+
+  Arguments:    entry : the grid entry
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::Link( unsigned int entry )
+{
+	unsigned int cell = GetCell( GetCellCoord( m_entries[entry].m_x ), GetCellCoord( m_entries[entry].m_z ) );
+
+	Entry & e = m_entries[entry];
+	e.m_cell = cell;
+	e.m_slot = (unsigned int)m_cells[cell].m_entries.size();
+	m_cells[cell].m_entries.push_back( entry );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Unlink
+
+  Description:  Takes an entry out of its cell (the last entry of the cell
+                takes its place).
+
+  Arguments:    entry : the grid entry
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::Unlink( unsigned int entry )
+{
+	Entry & e = m_entries[entry];
+	std::vector<unsigned int> & entries = m_cells[e.m_cell].m_entries;
+
+	unsigned int last = entries.back();
+	entries[e.m_slot] = last;
+	m_entries[last].m_slot = e.m_slot;
+	entries.pop_back();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Accepts
+
+  Description:  Whether a query takes an entry.
+
+  Arguments:    entry   : the grid entry
+                type    : the object types to accept
+                exclude : an object to skip
+
+  Returns:      True if the entry passes the filter.
+ *---------------------------------------------------------------------------*/
+bool SpatialGrid::Accepts( unsigned int entry, unsigned int type, GameObject * exclude )
+{
+	GameObject * object = m_entries[entry].m_object;
+	return( object != exclude && ( type == SPATIAL_GRID_ANY_TYPE || ( object->GetType() & type ) ) );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GatherCell
+
+  Description:  Adds the accepted entries of a cell to a candidate list.
+
+  Arguments:    cell       : the cell (SPATIAL_GRID_NO_ENTRY does nothing)
+                center     : the point to measure from
+                type       : the object types to accept
+                exclude    : an object to skip
+                candidates : the list to add to
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void SpatialGrid::GatherCell( unsigned int cell, const Vector3 & center, unsigned int type, GameObject * exclude, CandidateList & candidates )
+{
+	if( cell == SPATIAL_GRID_NO_ENTRY ) {
+		return;
+	}
+
+	const std::vector<unsigned int> & entries = m_cells[cell].m_entries;
+	for( unsigned int i=0; i<entries.size(); ++i )
+	{
+		if( Accepts( entries[i], type, exclude ) )
+		{
+			const Entry & e = m_entries[entries[i]];
+			float dx = e.m_x - center.x;
+			float dz = e.m_z - center.z;
+
+			Candidate candidate;
+			candidate.m_distSq = dx * dx + dz * dz;
+			candidate.m_index = entries[i];
+			candidates.push_back( candidate );
+		}
+	}
+}
@@ -0,0 +1,108 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+#include "vector.h"
+#include <vector>
+#include <math.h>
+
+class GameObject;
+
+
+#define SPATIAL_GRID_NO_ENTRY (0xFFFFFFFF)		//Grid entry of a body that isn't in the grid
+#define SPATIAL_GRID_ANY_TYPE (0)				//Query filter that accepts every object type (OBJECT_Ignore_Type)
+
+typedef std::vector<GameObject*> SpatialObjectList;
+
+
+//Optional uniform grid over the positions of the bodies, for neighbor queries
+//that don't visit every object. Cells are squares on the ground plane (x/z),
+//found through a hash table, so the world needs no fixed bounds. Distances
+//are measured on the ground plane too (y is ignored).
+//
+//Each body registers itself when created and keeps its entry up to date when
+//its position is set. Movement writes the positions directly, so the database
+//calls Refresh after each movement sweep; only the entries that crossed into
+//another cell are relinked. Queries see the positions as of the last Refresh
+//(or SetPos). Queries only read the grid, so they can run during a parallel
+//update; registration and Refresh are for the main thread.
+class SpatialGrid : public Singleton <SpatialGrid>
+{
+public:
+
+	SpatialGrid( float cellSize );
+	~SpatialGrid( void ) {}
+
+	//Registration (done by the bodies)
+	unsigned int Insert( GameObject & object, Vector3 * pos );
+	void Remove( unsigned int entry );
+	void Move( unsigned int entry );		//The position of the entry was set
+	void Refresh( void );					//The positions of any entries may have changed
+
+	inline float GetCellSize( void )		{ return( m_cellSize ); }
+	inline unsigned int GetNumEntries( void )	{ return( m_numEntries ); }
+
+	//Queries (type is an object type mask, exclude is skipped - usually the asking object)
+	void FindInRadius( const Vector3 & center, float radius, SpatialObjectList & result, unsigned int type = SPATIAL_GRID_ANY_TYPE, GameObject * exclude = 0 );
+	void FindNearest( const Vector3 & center, unsigned int count, SpatialObjectList & result, unsigned int type = SPATIAL_GRID_ANY_TYPE, GameObject * exclude = 0 );	//Nearest first
+	GameObject * FindFarthest( const Vector3 & center, unsigned int type = SPATIAL_GRID_ANY_TYPE, GameObject * exclude = 0 );	//0 if none
+
+private:
+
+	struct Entry
+	{
+		GameObject * m_object;	//0 if the entry is free
+		Vector3 * m_source;		//The position field of the body
+		float m_x;				//Position as of the last update
+		float m_z;
+		unsigned int m_cell;
+		unsigned int m_slot;	//Index in the entry list of the cell
+	};
+
+	struct Cell
+	{
+		int m_x;
+		int m_z;
+		std::vector<unsigned int> m_entries;
+	};
+
+	//An entry or cell with its (squared) distance, for sorting
+	struct Candidate
+	{
+		float m_distSq;
+		unsigned int m_index;
+		inline bool operator<( const Candidate & rhs ) const	{ return( m_distSq < rhs.m_distSq ); }
+	};
+	typedef std::vector<Candidate> CandidateList;
+
+	float m_cellSize;
+	float m_invCellSize;
+
+	std::vector<Entry> m_entries;
+	std::vector<unsigned int> m_freeEntries;
+	unsigned int m_numEntries;
+
+	std::vector<Cell> m_cells;				//Cells are kept once created (empty ones cost a slot)
+	std::vector<unsigned int> m_table;		//Open addressing hash of cell coordinates to cells
+	int m_minX, m_maxX, m_minZ, m_maxZ;		//Bounds of the cells created so far
+
+	inline int GetCellCoord( float value )	{ return( (int)floorf( value * m_invCellSize ) ); }
+	unsigned int FindCell( int x, int z );	//SPATIAL_GRID_NO_ENTRY if not created
+	unsigned int GetCell( int x, int z );	//Created if needed
+	void Link( unsigned int entry );
+	void Unlink( unsigned int entry );
+	void Rehash( unsigned int size );
+	bool Accepts( unsigned int entry, unsigned int type, GameObject * exclude );
+	void GatherCell( unsigned int cell, const Vector3 & center, unsigned int type, GameObject * exclude, CandidateList & candidates );
+
+};
@@ -0,0 +1,260 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "stateinspector.h"
+#include "database.h"
+#include "gameobject.h"
+#include "time.h"
+#include <typeinfo>
+
+
+StateInspector::StateInspector( void )
+: m_mapping( 0 ),
+  m_header( 0 ),
+  m_machines( 0 ),
+  m_records( 0 )
+{
+
+}
+
+StateInspector::~StateInspector( void )
+{
+	Close();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Open
+
+  Description:  Creates the shared memory segment and lays out an empty
+                table in it.
+
+  Arguments:    segmentName : the name viewers open the segment with (0 for
+                              an unnamed segment)
+                capacity    : the most records published per frame
+
+  Returns:      False if the segment couldn't be created (or a segment with
+                that name exists and is too small).
+ *---------------------------------------------------------------------------*/
+bool StateInspector::Open( const char * segmentName, unsigned int capacity )
+{
+	Close();
+
+	unsigned int machineOffset = sizeof( StateInspectorHeader );
+	unsigned int recordOffset = machineOffset + STATE_INSPECTOR_MAX_MACHINES * sizeof( StateInspectorMachine );
+	unsigned int size = recordOffset + capacity * sizeof( StateInspectorRecord );
+
+	m_mapping = CreateFileMappingA( INVALID_HANDLE_VALUE, 0, PAGE_READWRITE, 0, size, segmentName );
+	if( !m_mapping ) {
+		return( false );
+	}
+	void * view = MapViewOfFile( m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size );
+	if( !view )
+	{	//An existing segment smaller than asked for
+		CloseHandle( m_mapping );
+		m_mapping = 0;
+		return( false );
+	}
+
+	memset( view, 0, size );
+	m_header = (StateInspectorHeader*)view;
+	m_machines = (StateInspectorMachine*)( (char*)view + machineOffset );
+	m_records = (StateInspectorRecord*)( (char*)view + recordOffset );
+
+	m_header->m_version = STATE_INSPECTOR_VERSION;
+	m_header->m_capacity = capacity;
+	m_header->m_machineOffset = machineOffset;
+	m_header->m_recordOffset = recordOffset;
+	m_header->m_magic = STATE_INSPECTOR_MAGIC;		//Last, so a viewer never sees a half laid out table as valid
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Close
+
+  Description:  Unmaps the segment. Viewers that still have it mapped keep
+                the last table.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateInspector::Close( void )
+{
+	if( m_header ) {
+		UnmapViewOfFile( m_header );
+	}
+	if( m_mapping ) {
+		CloseHandle( m_mapping );
+	}
+	m_mapping = 0;
+	m_header = 0;
+	m_machines = 0;
+	m_records = 0;
+	m_machineIndex.clear();
+	m_definitions.clear();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Publish
+
+  Description:  Rewrites the table with the active state machine of each
+                queue of every object. Object names are only copied when a
+				record changes hands, and state names the first time they
+				are seen, so a frame mostly writes a few numbers per record.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateInspector::Publish( void )
+{
+	if( !m_header ) {
+		return;
+	}
+
+	InterlockedIncrement( &m_header->m_sequence );		//Odd: being written
+
+	unsigned int count = 0;
+	unsigned int truncated = 0;
+	dbCompositionList & objects = g_database.GetObjectsOfType( OBJECT_Ignore_Type );
+	for( dbCompositionList::iterator i=objects.begin(); i!=objects.end(); ++i )
+	{
+		StateMachineManager * mgr = (*i)->GetStateMachineManager();
+		if( !mgr ) {
+			continue;
+		}
+
+		for( unsigned int q=0; q<mgr->GetNumQueues(); ++q )
+		{
+			StateMachine * machine = mgr->GetStateMachine( (StateMachineQueue)q );
+			if( !machine ) {
+				continue;
+			}
+			if( count == m_header->m_capacity )
+			{
+				truncated++;
+				continue;
+			}
+
+			StateInspectorRecord & record = m_records[count++];
+			if( record.m_id != (*i)->GetID() )
+			{
+				record.m_id = (*i)->GetID();
+				CopyName( record.m_name, STATE_INSPECTOR_NAME_LENGTH, (*i)->GetName() );
+			}
+			record.m_queue = q;
+			record.m_machine = FindMachine( *machine );
+			record.m_state = machine->GetState();
+			record.m_substate = machine->GetSubstate();
+			record.m_timeInState = (float)( g_frame.m_time - machine->GetTimeEnteredState() );
+
+			if( record.m_machine != STATE_INSPECTOR_NO_MACHINE )
+			{	//Names that weren't known yet
+				StateInspectorMachine & entry = m_machines[record.m_machine];
+				const StateNameTable & names = m_definitions[record.m_machine]->m_names;
+				if( record.m_state >= 0 && record.m_state < MAX_STATE_NAMES && entry.m_stateNames[record.m_state][0] == 0 ) {
+					CopyName( entry.m_stateNames[record.m_state], STATE_INSPECTOR_NAME_LENGTH, names.GetStateName( record.m_state ) );
+				}
+				if( record.m_substate >= 0 && record.m_substate < MAX_STATE_NAMES && entry.m_substateNames[record.m_substate][0] == 0 ) {
+					CopyName( entry.m_substateNames[record.m_substate], STATE_INSPECTOR_NAME_LENGTH, names.GetSubstateName( record.m_substate ) );
+				}
+			}
+		}
+	}
+
+	m_header->m_frame = g_database.GetUpdateFrame();
+	m_header->m_time = g_frame.m_time;
+	m_header->m_numRecords = count;
+	m_header->m_numTruncated = truncated;
+
+	InterlockedIncrement( &m_header->m_sequence );		//Even: complete
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetStateName / GetSubstateName
+
+  Description:  Looks up the name of the state or substate of a record.
+
+  Arguments:    record : the record
+
+  Returns:      The name ("" if not known).
+ *---------------------------------------------------------------------------*/
+const char * StateInspector::GetStateName( const StateInspectorRecord & record )
+{
+	if( record.m_machine >= m_header->m_numMachines || record.m_state < 0 || record.m_state >= MAX_STATE_NAMES ) {
+		return( "" );
+	}
+	return( m_machines[record.m_machine].m_stateNames[record.m_state] );
+}
+
+const char * StateInspector::GetSubstateName( const StateInspectorRecord & record )
+{
+	if( record.m_machine >= m_header->m_numMachines || record.m_substate < 0 || record.m_substate >= MAX_STATE_NAMES ) {
+		return( "" );
+	}
+	return( m_machines[record.m_machine].m_substateNames[record.m_substate] );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FindMachine
+
+  Description:  Finds the table entry of a state machine's class, adding
+                the class if it is new.
+
+  Arguments:    machine : the state machine
+
+  Returns:      The index in the machine table, or STATE_INSPECTOR_NO_MACHINE
+                if the class hasn't run yet or the table is full.
+ *---------------------------------------------------------------------------*/
+unsigned int StateInspector::FindMachine( StateMachine & machine )
+{
+	const StateMachineDefinition * definition = machine.GetDefinition();
+	if( !definition ) {
+		return( STATE_INSPECTOR_NO_MACHINE );
+	}
+
+	MachineIndex::iterator i = m_machineIndex.find( definition );
+	if( i != m_machineIndex.end() ) {
+		return( i->second );
+	}
+
+	unsigned int index = (unsigned int)m_definitions.size();
+	if( index == STATE_INSPECTOR_MAX_MACHINES ) {
+		return( STATE_INSPECTOR_NO_MACHINE );
+	}
+
+	const char * name = typeid( machine ).name();
+	if( strncmp( name, "class ", 6 ) == 0 ) {
+		name += 6;
+	}
+	CopyName( m_machines[index].m_className, STATE_INSPECTOR_CLASS_NAME_LENGTH, name );
+	m_machineIndex[definition] = index;
+	m_definitions.push_back( definition );
+	m_header->m_numMachines = index + 1;
+	return( index );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CopyName
+
+  Description:  Copies a name into a fixed size field, cutting it if needed.
+
+  Arguments:    destination : the field
+                size        : the size of the field
+				source      : the name
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateInspector::CopyName( char * destination, unsigned int size, const char * source )
+{
+	strncpy( destination, source ? source : "", size - 1 );
+	destination[size - 1] = 0;
+}
@@ -0,0 +1,107 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "statemch.h"
+#include <map>
+#include <vector>
+
+
+#define STATE_INSPECTOR_MAGIC (0x50534E49)			//"INSP"
+#define STATE_INSPECTOR_VERSION (1)					//Bump whenever the layout below changes
+#define STATE_INSPECTOR_NAME_LENGTH (32)			//Object, state and substate names (longer ones are cut)
+#define STATE_INSPECTOR_CLASS_NAME_LENGTH (64)
+#define STATE_INSPECTOR_MAX_MACHINES (32)			//State machine classes with names in the table
+#define STATE_INSPECTOR_NO_MACHINE (0xFFFFFFFF)
+
+
+//Layout of the shared memory segment: the header, the machine table, then the
+//records. Offsets are from the start of the segment. The whole table is rewritten
+//at the end of each world update; m_sequence is odd while it is being written, so a
+//viewer copies what it needs and retries if the sequence was odd or has changed.
+struct StateInspectorHeader
+{
+	unsigned int m_magic;
+	unsigned int m_version;
+	volatile LONG m_sequence;
+	unsigned int m_frame;					//Database update number
+	double m_time;							//Simulation time
+	unsigned int m_numRecords;
+	unsigned int m_numTruncated;			//Records that didn't fit this frame
+	unsigned int m_numMachines;
+	unsigned int m_capacity;				//Records
+	unsigned int m_machineOffset;
+	unsigned int m_recordOffset;
+};
+
+//A state machine class. Names are filled in as states are first seen (they
+//are only known for classes with STATE_MACHINE_DEBUG_TRACE) and never change.
+struct StateInspectorMachine
+{
+	char m_className[STATE_INSPECTOR_CLASS_NAME_LENGTH];
+	char m_stateNames[MAX_STATE_NAMES][STATE_INSPECTOR_NAME_LENGTH];
+	char m_substateNames[MAX_STATE_NAMES][STATE_INSPECTOR_NAME_LENGTH];
+};
+
+//The active state machine of one queue of an object (objects in update order, queues in order)
+struct StateInspectorRecord
+{
+	objectID m_id;
+	unsigned int m_queue;
+	unsigned int m_machine;					//Index in the machine table, or STATE_INSPECTOR_NO_MACHINE
+	int m_state;
+	int m_substate;							//-1 if none
+	float m_timeInState;
+	char m_name[STATE_INSPECTOR_NAME_LENGTH];	//Object name
+};
+
+
+//Publishes the current state of every object into a compact table in a named
+//shared memory segment, which an external viewer maps and reads in place. The
+//in-app overlay reads the same table, so it only formats the rows it shows.
+class StateInspector
+{
+public:
+
+	StateInspector( void );
+	~StateInspector( void );
+
+	bool Open( const char * segmentName, unsigned int capacity );	//0 for an unnamed segment (in-app use only)
+	void Close( void );
+	inline bool IsOpen( void )												{ return( m_header != 0 ); }
+
+	void Publish( void );		//Main thread, with the world bound
+
+	//Reading the table (in process - a viewer in another process maps the segment
+	//by name and follows the sequence protocol, see StateInspectorHeader)
+	inline const StateInspectorHeader * GetHeader( void )					{ return( m_header ); }
+	inline const StateInspectorMachine * GetMachine( unsigned int index )	{ return( index < m_header->m_numMachines ? &m_machines[index] : 0 ); }
+	inline const StateInspectorRecord * GetRecord( unsigned int index )		{ return( index < m_header->m_numRecords ? &m_records[index] : 0 ); }
+	const char * GetStateName( const StateInspectorRecord & record );
+	const char * GetSubstateName( const StateInspectorRecord & record );
+
+private:
+
+	typedef std::map<const StateMachineDefinition*, unsigned int> MachineIndex;
+	typedef std::vector<const StateMachineDefinition*> MachineDefinitionContainer;
+
+	HANDLE m_mapping;
+	StateInspectorHeader * m_header;
+	StateInspectorMachine * m_machines;
+	StateInspectorRecord * m_records;
+	MachineIndex m_machineIndex;
+	MachineDefinitionContainer m_definitions;	//By machine table index
+
+	unsigned int FindMachine( StateMachine & machine );
+	void CopyName( char * destination, unsigned int size, const char * source );
+
+};
@@ -11,15 +11,38 @@
 #include "DXUT.h"
 #include "statemch.h"
 #include "msgroute.h"
+#include "database.h"
+#include "telemetry.h"
+#include "statemchpool.h"
+#include "stateprobecache.h"
+#include "snapshot.h"
+#ifdef STATE_MACHINE_PROFILING
+#include "profiler.h"
+#endif
 
 
-#define MAX_STATE_STACK_SIZE 10
-
 
 
 StateMachine::StateMachine( GameObject & object )
 : m_owner( &object ),
-  m_queue( STATE_MACHINE_QUEUE_NULL )
+  m_queue( STATE_MACHINE_QUEUE_NULL ),
+  m_updateFrames( 1 ),
+  m_updatePhase( 0 ),
+  m_updateInterval( 0.0f ),
+  m_nextUpdateTime( 0.0 ),
+  m_stateVariables( 0 ),
+  m_substateVariables( 0 ),
+  m_numStateVariables( 0 ),
+  m_numSubstateVariables( 0 ),
+  m_stateVariableCapacity( 0 ),
+  m_substateVariableCapacity( 0 ),
+  m_handlerDepth( 0 ),
+  m_probing( false ),
+  m_probeStateVariables( 0 ),
+  m_probeSubstateVariables( 0 ),
+  m_definition( 0 ),
+  m_traced( false ),
+  m_pool( 0 )
 {
 	ASSERTMSG( m_owner->GetStateMachineManager(), "StateMachine::StateMachine - StateMachineManager not set yet in GameObject" );
 
@@ -29,8 +52,8 @@ StateMachine::StateMachine( GameObject & object )
 
 StateMachine::~StateMachine( void )
 {
-	DeleteAllStateVariables();
-	DeleteAllSubstateVariables();
+	delete[] m_stateVariables;
+	FreeRetiredVariables();
 }
 
 /*---------------------------------------------------------------------------*
@@ -46,6 +69,7 @@ void StateMachine::Initialize( void )
 {
 	m_scopeState = 0;
 	m_scopeSubstate = 0;
+	m_scopeStateMachine = 0;
 	m_currentState = 0;
 	m_updateIteration = 0;
 	m_currentSubstate = -1;
@@ -56,15 +80,21 @@ void StateMachine::Initialize( void )
 	m_delayedSubstateChangeQueued = false;
 	m_stateChangeAllowed = true;
 	m_registeredEvents = 0;
-	m_timeOnEnterState = 0.0f;
-	m_timeOnEnterSubstate = 0.0f;
+	m_probeArmedTimer = false;
+	m_numTimers = 0;
+	m_wakeTime = 0.0;
+	m_firingTimer = -1;
+	m_registeredMsgsSubstate.reset();
+	m_registeredMsgsState.reset();
+	m_registeredMsgsStateMachine.reset();
+	m_timeOnEnterState = 0.0;
+	m_timeOnEnterSubstate = 0.0;
+	m_timeLastUpdate = g_frame.m_time;
 	m_ccMessagesToGameObject = 0;
 
-	m_currentStateNameString[0] = 0;
-	m_currentSubstateNameString[0] = 0;
-  
+
 	m_broadcastList.clear();
-	m_stack.clear();
+	m_stack.Clear();
 	DeleteAllStateVariables();
 	DeleteAllSubstateVariables();
 }
@@ -83,41 +113,304 @@ void StateMachine::Initialize( void )
 void StateMachine::Reset( void )
 {
 	Initialize();
-	Process( EVENT_Probe, 0 );
+	m_scopeState = m_scopeSubstate = m_scopeStateMachine = m_owner->GetStateMachineManager()->GetNewScope( m_queue );
+	ProbeScope( -1, -1 );
+	ProbeScope( static_cast<int>( m_currentState ), -1 );
 	Process( EVENT_Enter, 0 );
 }
 
+/*---------------------------------------------------------------------------*
+  Name:         Recycle
+
+  Description:  Readies a pooled state machine for another owner, as if it
+                had just been constructed.
+
+  Arguments:    object : the new owner
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::Recycle( GameObject & object )
+{
+	ASSERTMSG( object.GetStateMachineManager(), "StateMachine::Recycle - StateMachineManager not set yet in GameObject" );
+
+	m_owner = &object;
+	m_mgr = object.GetStateMachineManager();
+	m_queue = STATE_MACHINE_QUEUE_NULL;
+	m_updateFrames = 1;
+	m_updatePhase = 0;
+	m_updateInterval = 0.0f;
+	m_nextUpdateTime = 0.0;
+	Initialize();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Save
+
+  Description:  Saves the state, scopes, variables, timers and state stack.
+                The class of the state machine is saved by the manager.
+
+  Arguments:    writer : the snapshot being written
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::Save( SnapshotWriter & writer )
+{
+	writer.Write( m_scopeState );
+	writer.Write( m_scopeSubstate );
+	writer.Write( m_scopeStateMachine );
+	writer.Write( m_currentState );
+	writer.Write( m_nextState );
+	writer.Write( m_updateIteration );
+	writer.Write( m_currentSubstate );
+	writer.Write( m_nextSubstate );
+	writer.Write( m_stateChangeAllowed );
+	writer.Write( m_delayedStateChangeQueued );
+	writer.Write( m_delayedSubstateChangeQueued );
+	writer.Write( m_stateChange );
+	writer.WriteTime( m_timeOnEnterState );
+	writer.WriteTime( m_timeOnEnterSubstate );
+	writer.WriteTime( m_timeLastUpdate );
+	writer.Write( m_updateFrames );
+	writer.Write( m_updatePhase );
+	writer.Write( m_updateInterval );
+	writer.WriteTime( m_nextUpdateTime );
+	writer.Write( m_registeredEvents );
+	writer.Write( m_registeredMsgsSubstate );
+	writer.Write( m_registeredMsgsState );
+	writer.Write( m_registeredMsgsStateMachine );
+	writer.Write( m_ccMessagesToGameObject );
+	writer.Write( m_stack );
+
+	writer.Write( (unsigned int)m_broadcastList.size() );
+	for( BroadcastListContainer::iterator i = m_broadcastList.begin(); i != m_broadcastList.end(); ++i ) {
+		writer.Write( *i );
+	}
+
+	writer.Write( m_numStateVariables );
+	writer.Write( m_numSubstateVariables );
+	writer.WriteBytes( m_stateVariables, m_numStateVariables * sizeof( StateMachinePersistentData ) );
+	writer.WriteBytes( m_substateVariables, m_numSubstateVariables * sizeof( StateMachinePersistentData ) );
+
+	writer.Write( m_numTimers );
+	for( int i=0; i<m_numTimers; i++ )
+	{
+		writer.WriteTime( m_timers[i].m_time );
+		writer.Write( m_timers[i].m_period );
+		writer.Write( m_timers[i].m_index );
+		writer.Write( m_timers[i].m_scope );
+		writer.Write( m_timers[i].m_substateScoped );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Restore
+
+  Description:  Restores what Save saved into a state machine that was just
+                constructed, without sending any events. The timers ask 
+				MsgRoute for a wake-up again.
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::Restore( SnapshotReader & reader )
+{
+	m_scopeState = reader.Read<unsigned int>();
+	m_scopeSubstate = reader.Read<unsigned int>();
+	m_scopeStateMachine = reader.Read<unsigned int>();
+	m_currentState = reader.Read<unsigned int>();
+	m_nextState = reader.Read<unsigned int>();
+	m_updateIteration = reader.Read<int>();
+	m_currentSubstate = reader.Read<int>();
+	m_nextSubstate = reader.Read<int>();
+	m_stateChangeAllowed = reader.Read<bool>();
+	m_delayedStateChangeQueued = reader.Read<bool>();
+	m_delayedSubstateChangeQueued = reader.Read<bool>();
+	m_stateChange = reader.Read<State_Change>();
+	m_timeOnEnterState = reader.ReadTime();
+	m_timeOnEnterSubstate = reader.ReadTime();
+	m_timeLastUpdate = reader.ReadTime();
+	m_updateFrames = reader.Read<unsigned int>();
+	m_updatePhase = reader.Read<unsigned int>();
+	m_updateInterval = reader.Read<float>();
+	m_nextUpdateTime = reader.ReadTime();
+	m_registeredEvents = reader.Read<unsigned int>();
+	m_registeredMsgsSubstate = reader.Read<MsgNameSet>();
+	m_registeredMsgsState = reader.Read<MsgNameSet>();
+	m_registeredMsgsStateMachine = reader.Read<MsgNameSet>();
+	m_ccMessagesToGameObject = reader.Read<objectID>();
+	m_stack = reader.Read<StateStack>();
+
+	m_broadcastList.clear();
+	unsigned int numBroadcast = reader.Read<unsigned int>();
+	for( unsigned int i=0; i<numBroadcast && reader.IsValid(); i++ ) {
+		m_broadcastList.push_back( reader.Read<objectID>() );
+	}
+
+	//The class definition isn't known until States first runs, so the block is sized here
+	int numStateVariables = reader.Read<int>();
+	int numSubstateVariables = reader.Read<int>();
+	if( numStateVariables < 0 || numSubstateVariables < 0 || m_stack.GetSize() > MAX_STATE_STACK_SIZE ) {
+		reader.Fail();
+		return;
+	}
+	if( numStateVariables > m_stateVariableCapacity || numSubstateVariables > m_substateVariableCapacity )
+	{
+		delete[] m_stateVariables;
+		m_stateVariables = new StateMachinePersistentData[numStateVariables + numSubstateVariables];
+		m_substateVariables = m_stateVariables + numStateVariables;
+		m_stateVariableCapacity = numStateVariables;
+		m_substateVariableCapacity = numSubstateVariables;
+	}
+	m_numStateVariables = numStateVariables;
+	m_numSubstateVariables = numSubstateVariables;
+	reader.ReadBytes( m_stateVariables, numStateVariables * sizeof( StateMachinePersistentData ) );
+	reader.ReadBytes( m_substateVariables, numSubstateVariables * sizeof( StateMachinePersistentData ) );
+
+	m_numTimers = reader.Read<int>();
+	if( m_numTimers < 0 || m_numTimers > STATE_MACHINE_MAX_TIMERS ) {
+		m_numTimers = 0;
+		reader.Fail();
+	}
+	for( int i=0; i<m_numTimers; i++ )
+	{
+		m_timers[i].m_time = reader.ReadTime();
+		m_timers[i].m_period = reader.Read<float>();
+		m_timers[i].m_index = reader.Read<unsigned char>();
+		m_timers[i].m_scope = reader.Read<unsigned char>();
+		m_timers[i].m_substateScoped = reader.Read<bool>();
+	}
+	m_wakeTime = 0.0;
+	ScheduleTimerWake();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetStateMachineQueue
+
+  Description:  Sets the queue this state machine is on.
+
+  Arguments:    queue : the queue
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SetStateMachineQueue( StateMachineQueue queue )
+{
+	ASSERTMSG( (unsigned int)queue < m_mgr->GetNumQueues(), "StateMachine::SetQueue - invalid queue" );
+	m_queue = queue;
+}
+
 /*---------------------------------------------------------------------------*
   Name:         Update
 
   Description:  An update event is sent to the state machine.
 
-  Arguments:    None.
+  Arguments:    frame : the current tick
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::Update( void )
+void StateMachine::Update( const FrameContext & frame )
 {
-	if( ( m_registeredEvents & REGISTERED_EVENT_UPDATE ) && !m_owner->IsMarkedForDeletion())
+	if( ( m_registeredEvents & REGISTERED_EVENT_UPDATE ) && !m_owner->IsMarkedForDeletion() && IsUpdateDue( frame ) )
 	{
+#ifdef STATE_MACHINE_PROFILING
+		ProfileScope profile( *this, EVENT_Update, 0 );
+#endif
+		CountTelemetry( TELEMETRY_EVENTS_PROCESSED );
 		m_updateIteration++;
 
 		bool handled = false;
 		if( m_currentSubstate >= 0 && ( m_registeredEvents & REGISTERED_EVENT_UPDATE_SUBSTATE ) )
 		{	//Send to current substate
-			handled = States( EVENT_Update, 0, m_currentState, m_currentSubstate );
+			handled = RunHandlers( EVENT_Update, 0, m_currentState, m_currentSubstate );
 		}
 		if( !handled && ( m_registeredEvents & REGISTERED_EVENT_UPDATE_STATE ) )
 		{	//Send to current state
-			handled = States( EVENT_Update, 0, m_currentState, -1 );
+			handled = RunHandlers( EVENT_Update, 0, m_currentState, -1 );
 		}
 		if( !handled && ( m_registeredEvents & REGISTERED_EVENT_UPDATE_STATEMACHINE ) )
 		{	//Send to global state
-			handled = States( EVENT_Update, 0, -1, -1 );
+			handled = RunHandlers( EVENT_Update, 0, -1, -1 );
 		}
 		
-		PerformStateChanges();
+		m_timeLastUpdate = frame.m_time;
+		PerformStateChanges( frame );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetUpdateEveryNthFrame
+
+  Description:  Sends EVENT_Update only every Nth frame of the database 
+                update. The frame within the period is picked from the 
+				object ID, so objects with the same setting are spread 
+				evenly over the frames.
+
+  Arguments:    frames : the number of frames between updates (1 is every frame)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SetUpdateEveryNthFrame( unsigned int frames )
+{
+	ASSERTMSG( frames > 0, "StateMachine::SetUpdateEveryNthFrame - Argument must be > 0." );
+
+	m_updateFrames = frames > 0 ? frames : 1;
+	m_updatePhase = m_owner->GetID() % m_updateFrames;
+	m_updateInterval = 0.0f;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetUpdateRate
+
+  Description:  Sends EVENT_Update at a fixed rate (but at most once per frame).
+                The first update is offset by a fraction of the interval
+				picked from the object ID, so objects with the same rate
+				don't all update on the same frame.
+
+  Arguments:    hz : updates per second
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SetUpdateRate( float hz )
+{
+	ASSERTMSG( hz > 0.0f, "StateMachine::SetUpdateRate - Argument must be > 0." );
+
+	if( hz > 0.0f )
+	{
+		m_updateFrames = 1;
+		m_updatePhase = 0;
+		m_updateInterval = 1.0f / hz;
+		m_nextUpdateTime = g_frame.m_time + m_updateInterval * (float)( m_owner->GetID() % UPDATE_RATE_PHASES ) / (float)UPDATE_RATE_PHASES;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         IsUpdateDue
+
+  Description:  Checks the update LOD setting to see if this frame should
+                send EVENT_Update.
+
+  Arguments:    frame : the current tick
+
+  Returns:      True if the state machine should be updated this frame.
+ *---------------------------------------------------------------------------*/
+bool StateMachine::IsUpdateDue( const FrameContext & frame )
+{
+	if( m_updateInterval > 0.0f )
+	{
+		double time = frame.m_time;
+		if( time < m_nextUpdateTime ) {
+			return( false );
+		}
+
+		m_nextUpdateTime += m_updateInterval;
+		if( m_nextUpdateTime <= time )
+		{	//Fell behind (long frame), so don't try to catch up
+			m_nextUpdateTime = time + m_updateInterval;
+		}
+		return( true );
 	}
+
+	return( m_updateFrames <= 1 || ( g_database.GetUpdateFrame() + m_updatePhase ) % m_updateFrames == 0 );
 }
 
 /*---------------------------------------------------------------------------*
@@ -138,27 +431,75 @@ void StateMachine::Process( State_Machine_Event event, MSG_Object * msg )
 {
 	if( !m_owner->IsMarkedForDeletion() )
 	{
-		if( GetCCReceiver() > 0 && event == EVENT_Message && msg )
-		{	//CC this message
-			SendCCMsg( msg->GetName(), GetCCReceiver(), msg->GetMsgData() );
+#ifdef STATE_MACHINE_PROFILING
+		ProfileScope profile( *this, event, msg );
+#endif
+		CountTelemetry( TELEMETRY_EVENTS_PROCESSED );
+		bool ccBatched = false;
+		if( event == EVENT_Message && msg && ( GetCCReceiver() > 0 || m_owner->IsCCObserved() ) )
+		{	//CC this message (delivered once this processing ends, see MsgRoute::SubscribeCC)
+			ccBatched = g_msgroute.BeginCC( *msg, *m_owner, GetCCReceiver() );
 		}
 
 		//Process this event inside the state machine
+		//(a scope is skipped if probing found no handler for the message)
 		bool handled = false;
 		if( m_currentSubstate >= 0 )
 		{	//Send to current substate
-			handled = States( event, msg, m_currentState, m_currentSubstate );
+			if( !IsMsgFiltered( event, msg, m_registeredMsgsSubstate ) ) {
+				handled = RunHandlers( event, msg, m_currentState, m_currentSubstate );
+			}
+			else {
+				LogFilteredMsg( msg, static_cast<int>( m_currentState ), m_currentSubstate );
+			}
 		}
 		if( !handled )
 		{	//Send to current state
-			handled = States( event, msg, m_currentState, -1 );
+			if( !IsMsgFiltered( event, msg, m_registeredMsgsState ) ) {
+				handled = RunHandlers( event, msg, m_currentState, -1 );
+			}
+			else {
+				LogFilteredMsg( msg, static_cast<int>( m_currentState ), -1 );
+			}
 		}
 		if( !handled )
 		{	//Send to global state
-			handled = States( event, msg, -1, -1 );
+			if( !IsMsgFiltered( event, msg, m_registeredMsgsStateMachine ) ) {
+				handled = RunHandlers( event, msg, -1, -1 );
+			}
+			else {
+				LogFilteredMsg( msg, -1, -1 );
+			}
 		}
 		
-		PerformStateChanges();
+		if( m_stateChange != NO_STATE_CHANGE )
+		{	//Events come in outside the update too, so read the tick only when it's needed
+			PerformStateChanges( g_frame );
+		}
+
+		if( ccBatched ) {
+			g_msgroute.EndCC();
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         LogFilteredMsg
+
+  Description:  Logs a message that was not sent to a scope because the scope
+                has no handler for it. This is the same entry the state
+				machine macros would have logged for an unhandled message.
+
+  Arguments:    msg      : the message
+                state    : the state scope to log (-1 for the global state)
+				substate : the substate scope to log (-1 if not a substate)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::LogFilteredMsg( MSG_Object * msg, int state, int substate )
+{
+	if( m_traced && m_owner->IsDebugLogged() ) {
+		g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, GetStateNameTable(), state, substate, EVENT_Message, false );
 	}
 }
 
@@ -170,16 +511,22 @@ void StateMachine::Process( State_Machine_Event event, MSG_Object * msg )
 				avoid an infinite loop of state changes, it is stopped after
 				a fixed number of times.
 
-  Arguments:    None.
+  Arguments:    frame : the current tick
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::PerformStateChanges( void )
+void StateMachine::PerformStateChanges( const FrameContext & frame )
 {
 	//Check for a state change
 	int safetyCount = 20;
+	bool changed = false;
 	while( m_stateChange != NO_STATE_CHANGE && (--safetyCount >= 0) )
 	{
+#ifdef STATE_MACHINE_PROFILING
+		ProfileScope profile( *this, PROFILE_EVENT_STATE_CHANGE, 0 );
+#endif
+		CountTelemetry( TELEMETRY_STATE_CHANGES );
+		changed = true;
 		ASSERTMSG( safetyCount > 0, "StateMachine::PerformStateChanges - States are flip-flopping in an infinite loop." );
 
 		m_stateChangeAllowed = false;
@@ -190,11 +537,11 @@ void StateMachine::PerformStateChanges( void )
 		//Let the last state clean-up
 		if( m_currentSubstate >= 0 && ( m_registeredEvents & REGISTERED_EVENT_EXIT_SUBSTATE ) )
 		{	//Moving from a substate - OnExit exists in substate, so send event
-			States( EVENT_Exit, 0, static_cast<int>( m_currentState ), m_currentSubstate );
+			RunHandlers( EVENT_Exit, 0, static_cast<int>( m_currentState ), m_currentSubstate );
 		}
 		if( m_nextSubstate < 0 && ( m_registeredEvents & REGISTERED_EVENT_EXIT_STATE ) )
 		{	//Leaving current state - OnExit exists in state, so send event
-			States( EVENT_Exit, 0, static_cast<int>( m_currentState ), -1 );
+			RunHandlers( EVENT_Exit, 0, static_cast<int>( m_currentState ), -1 );
 		}
 		
 
@@ -204,44 +551,40 @@ void StateMachine::PerformStateChanges( void )
 			case STATE_CHANGE:
 				if( m_nextSubstate < 0 )
 				{	//This is a state change and not a substate change
-					//Store the old state on the state stack
-					m_stack.push_back( m_currentState );
-					//Restrict stack size
-					if( m_stack.size() > MAX_STATE_STACK_SIZE ) {
-						m_stack.pop_front();
-					}
+					//Store the old state on the state stack (drops the oldest one when full)
+					m_stack.Push( m_currentState );
 				}
 				//Set the new state
 				m_currentState = m_nextState;
 				m_currentSubstate = m_nextSubstate;
-#ifdef DEBUG_STATE_MACHINE_MACROS
-				g_debuglog.LogStateMachineStateChange( m_owner->GetID(), m_owner->GetName(), m_currentState, m_currentSubstate );
-#endif
+				if( m_traced && m_owner->IsDebugLogged() ) {
+					g_debuglog.LogStateMachineStateChange( m_owner->GetID(), m_owner->GetName(), m_currentState, m_currentSubstate );
+				}
 				break;
 				
 			case STATE_POP:
-				if( !m_stack.empty() ) {
+				if( !m_stack.IsEmpty() ) {
 					//Get last state off stack and pop it
-					m_currentState = m_stack.back();
+					m_currentState = m_stack.Pop();
 					m_currentSubstate = -1;
-					m_stack.pop_back();
+					m_nextSubstate = -1;
 				}
 				else {
 					ASSERTMSG( 0, "StateMachine::PerformStateChanges - Hit bottom of state stack. Can't pop state." );
 				}
-#ifdef DEBUG_STATE_MACHINE_MACROS
-				g_debuglog.LogStateMachineStateChange( m_owner->GetID(), m_owner->GetName(), m_currentState, m_currentSubstate );
-#endif
+				if( m_traced && m_owner->IsDebugLogged() ) {
+					g_debuglog.LogStateMachineStateChange( m_owner->GetID(), m_owner->GetName(), m_currentState, m_currentSubstate );
+				}
 				break;
 			
 			default:
 				ASSERTMSG( 0, "StateMachine::PerformStateChanges - Invalid state change." );
 		}
 				
-		//Increment the scope (every state change gets a unique scope)
-		m_scopeSubstate++;
+		//New scope (every state change gets a unique scope)
+		m_scopeSubstate = m_owner->GetStateMachineManager()->GetNewScope( m_queue );
 		if( m_nextSubstate < 0 ) {
-			m_scopeState++;
+			m_scopeState = m_scopeSubstate;
 		}
 
 		DeleteAllSubstateVariables();
@@ -249,11 +592,12 @@ void StateMachine::PerformStateChanges( void )
 		{	//Properly delete any state variables before going into new state (not to be done on Substate changes)
 			DeleteAllStateVariables();
 		}
+		ClearTimers( m_nextSubstate >= 0 );
 
 		//Remember the time we entered this state
-		m_timeOnEnterSubstate = g_time.GetCurTime();
+		m_timeOnEnterSubstate = frame.m_time;
 		if( m_nextSubstate < 0 ) {
-			m_timeOnEnterState = g_time.GetCurTime();
+			m_timeOnEnterState = frame.m_time;
 		}
 
 		//Let the new state initialize
@@ -263,29 +607,123 @@ void StateMachine::PerformStateChanges( void )
 		if( m_nextSubstate < 0 )
 		{	//Moving to a state
 			m_registeredEvents &= REGISTERED_EVENT_STATEMACHINE;	//Only keep state machine bits
+			m_registeredMsgsState.reset();
+			m_registeredMsgsSubstate.reset();
 		}
 		else
 		{	//Moving to a substate
 			m_registeredEvents &= (REGISTERED_EVENT_STATE | REGISTERED_EVENT_STATEMACHINE);	//Only keep state and state machine bits
+			m_registeredMsgsSubstate.reset();
 		}
 
-		States( EVENT_Probe, 0, static_cast<int>( m_currentState ), m_currentSubstate );
+		ProbeScope( static_cast<int>( m_currentState ), m_currentSubstate );
 		if( m_nextSubstate < 0 )
 		{
 			if( m_registeredEvents & REGISTERED_EVENT_ENTER_STATE )
 			{	//OnEnter exists in state, so send event
-				States( EVENT_Enter, 0, static_cast<int>( m_currentState ), m_currentSubstate );
+				RunHandlers( EVENT_Enter, 0, static_cast<int>( m_currentState ), m_currentSubstate );
 			}
 		}
 		else
 		{
 			if( m_registeredEvents & REGISTERED_EVENT_ENTER_SUBSTATE ) 
 			{	//OnEnter exists in substate, so send event
-				States( EVENT_Enter, 0, static_cast<int>( m_currentState ), m_currentSubstate );
+				RunHandlers( EVENT_Enter, 0, static_cast<int>( m_currentState ), m_currentSubstate );
+			}
+		}
+	}
+
+	if( changed )
+	{	//The registered events changed, so the owner may join or leave the update
+		m_mgr->RefreshUpdateActive();
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ProbeScope
+
+  Description:  Registers the events, messages and variables of a state or
+                substate that was just entered. The first time a scope of
+				this class is entered it is probed through States(), and
+				the result is cached in the class definition. Later entries
+				replay the cached result without calling States(). Scopes
+				that arm timers are always probed, since the delays are 
+				expressions that are evaluated on every entry. The global
+				scope is only probed by Reset, and isn't cached.
+				The probe doesn't run as a handler (see RunHandlers), so the
+				variable block can grow once it is done.
+
+  Arguments:    state    : the state entered (-1 for the global scope)
+                substate : the substate entered (-1 if entering the state)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::ProbeScope( int state, int substate )
+{
+	StateProbeCache * cache = 0;
+	if( m_definition && state >= 0 )
+	{
+		cache = m_definition->m_probeCache;
+		if( !cache )
+		{	//First state change of this class (possibly on several job threads at once)
+			StateProbeCache * newCache = new StateProbeCache();
+			cache = (StateProbeCache*)InterlockedCompareExchangePointer( (PVOID volatile*)&m_definition->m_probeCache, newCache, 0 );
+			if( cache ) {
+				delete( newCache );
+			}
+			else {
+				cache = newCache;
 			}
 		}
 	}
 
+	const StateProbeResult * cached = cache ? cache->Find( state, substate ) : 0;
+	if( cached && !cached->m_armsTimers )
+	{	//Replay the probe
+		m_registeredEvents |= cached->m_events;
+		if( substate < 0 ) {
+			m_registeredMsgsState = cached->m_msgs;
+		}
+		else {
+			m_registeredMsgsSubstate = cached->m_msgs;
+		}
+		if( cached->m_numVariables > 0 ) {
+			DeclareVariable( cached->m_numVariables - 1, substate < 0 ? STATE_VARIABLE_SCOPE : SUBSTATE_VARIABLE_SCOPE );
+		}
+		return;
+	}
+
+	m_probeArmedTimer = false;
+	m_probing = true;
+	m_probeStateVariables = 0;
+	m_probeSubstateVariables = 0;
+	States( EVENT_Probe, 0, state, substate );
+	m_probing = false;
+
+	//The probe's proxies are gone, so the block can grow now
+	if( m_probeStateVariables > 0 ) {
+		DeclareVariable( m_probeStateVariables - 1, STATE_VARIABLE_SCOPE );
+	}
+	if( m_probeSubstateVariables > 0 ) {
+		DeclareVariable( m_probeSubstateVariables - 1, SUBSTATE_VARIABLE_SCOPE );
+	}
+
+	if( cache && !cached )
+	{
+		StateProbeResult result;
+		if( substate < 0 ) {
+			result.m_events = m_registeredEvents & REGISTERED_EVENT_STATE;
+			result.m_msgs = m_registeredMsgsState;
+			result.m_numVariables = m_numStateVariables;
+		}
+		else {
+			result.m_events = m_registeredEvents & REGISTERED_EVENT_SUBSTATE;
+			result.m_msgs = m_registeredMsgsSubstate;
+			result.m_numVariables = m_numSubstateVariables;
+		}
+		result.m_armsTimers = m_probeArmedTimer;
+		cache->Insert( state, substate, result );
+	}
 }
 
 /*---------------------------------------------------------------------------*
@@ -516,7 +954,7 @@ void StateMachine::SendMsgToSingleQueue( MSG_Name name, StateMachineQueue queue,
 {
 	ASSERTMSG( queue != m_queue, "StateMachine::SendMsgToSingleQueue - Use SendMsgToStateMachine instead" );
 	ASSERTMSG( queue != STATE_MACHINE_QUEUE_ALL, "StateMachine::SendMsgToSingleQueue - Use SendMsgToAllQueues instead" );
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachine::SendMsgToSingleQueue - Argument queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_mgr->GetNumQueues(), "StateMachine::SendMsgToSingleQueue - Argument queue out of bounds" );
 
 	SendMsgDelayedToMeHelper( ONE_FRAME, name, SCOPE_TO_STATE_MACHINE, queue, data, false );
 }
@@ -537,7 +975,7 @@ void StateMachine::SendMsgToSingleQueueNow( MSG_Name name, StateMachineQueue que
 {
 	ASSERTMSG( queue != m_queue, "StateMachine::SendMsgToSingleQueue - Use SendMsgToStateMachine instead" );
 	ASSERTMSG( queue != STATE_MACHINE_QUEUE_ALL, "StateMachine::SendMsgToSingleQueue - Use SendMsgToAllQueues instead" );
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachine::SendMsgToSingleQueue - Argument queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_mgr->GetNumQueues(), "StateMachine::SendMsgToSingleQueue - Argument queue out of bounds" );
 
 	SendMsgDelayedToMeHelper( 0.0f, name, SCOPE_TO_STATE_MACHINE, queue, data, false );
 }
@@ -587,7 +1025,7 @@ void StateMachine::SendMsgToAllQueuesNow( MSG_Name name, MSG_Data& data )
  *---------------------------------------------------------------------------*/
 void StateMachine::SendMsgToAllOtherQueues( MSG_Name name, MSG_Data& data )
 {
-	for( int queue=0; queue<STATE_MACHINE_NUM_QUEUES; ++queue )
+	for( int queue=0; queue<(int)m_mgr->GetNumQueues(); ++queue )
 	{
 		if( queue != m_queue ) {
 			SendMsgDelayedToMeHelper( ONE_FRAME, name, SCOPE_TO_STATE_MACHINE, (StateMachineQueue)queue, data, false );
@@ -608,7 +1046,7 @@ void StateMachine::SendMsgToAllOtherQueues( MSG_Name name, MSG_Data& data )
  *---------------------------------------------------------------------------*/
 void StateMachine::SendMsgToAllOtherQueuesNow( MSG_Name name, MSG_Data& data )
 {
-	for( int queue=0; queue<STATE_MACHINE_NUM_QUEUES; ++queue )
+	for( int queue=0; queue<(int)m_mgr->GetNumQueues(); ++queue )
 	{
 		if( queue != m_queue ) {
 			SendMsgDelayedToMeHelper( 0.0f, name, SCOPE_TO_STATE_MACHINE, (StateMachineQueue)queue, data, false );
@@ -715,7 +1153,7 @@ void StateMachine::SendMsgDelayedToSingleQueue( float delay, MSG_Name name, Stat
 {
 	ASSERTMSG( queue != m_queue, "StateMachine::SendMsgDelayedToSingleQueue - Use SendMsgDelayedToStateMachine instead" );
 	ASSERTMSG( queue != STATE_MACHINE_QUEUE_ALL, "StateMachine::SendMsgDelayedToSingleQueue - Use SendMsgDelayedToAllQueues instead" );
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachine::SendMsgDelayedToSingleQueue - Argument queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_mgr->GetNumQueues(), "StateMachine::SendMsgDelayedToSingleQueue - Argument queue out of bounds" );
 
 	SendMsgDelayedToMeHelper( delay, name, SCOPE_TO_STATE_MACHINE, queue, data, false );
 }
@@ -751,7 +1189,7 @@ void StateMachine::SendMsgDelayedToAllQueues( float delay, MSG_Name name, MSG_Da
  *---------------------------------------------------------------------------*/
 void StateMachine::SendMsgDelayedToAllOtherQueues( float delay, MSG_Name name, MSG_Data& data )
 {
-	for( int queue=0; queue<STATE_MACHINE_NUM_QUEUES; ++queue )
+	for( int queue=0; queue<(int)m_mgr->GetNumQueues(); ++queue )
 	{
 		if( queue != m_queue ) {
 			SendMsgDelayedToMeHelper( delay, name, SCOPE_TO_STATE_MACHINE, (StateMachineQueue)queue, data, false );
@@ -824,6 +1262,45 @@ void StateMachine::SendMsgBroadcastToListNow( MSG_Name name, MSG_Data& data )
 	}
 }
 
+/*---------------------------------------------------------------------------*
+  Name:         SendMsgBroadcastInRadiusNow
+
+  Description:  Broadcast a message to the objects near a point (for example
+                a noise or an explosion).
+  
+  Arguments:    name   : the name of the message
+                center : the point
+				radius : the distance from the point (on the ground plane)
+                type   : the type of object to broadcast the message to
+				data   : associated data to deliver with the message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SendMsgBroadcastInRadiusNow( MSG_Name name, const Vector3& center, float radius, unsigned int type, MSG_Data& data )
+{
+	MSG_Object msg( 0.0f, name, m_owner->GetID(), 0, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
+	g_msgroute.SendMsgBroadcastInRadius( msg, center, radius, type, false );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SendMsgBroadcastInRadius
+
+  Description:  Broadcast a message next frame to the objects near a point.
+  
+  Arguments:    name   : the name of the message
+                center : the point
+				radius : the distance from the point (on the ground plane)
+                type   : the type of object to broadcast the message to
+				data   : associated data to deliver with the message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SendMsgBroadcastInRadius( MSG_Name name, const Vector3& center, float radius, unsigned int type, MSG_Data& data )
+{
+	MSG_Object msg( 0.0f, name, m_owner->GetID(), 0, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
+	g_msgroute.SendMsgBroadcastInRadius( msg, center, radius, type, true );
+}
+
 /*---------------------------------------------------------------------------*
   Name:         BroadcastClearList
 
@@ -853,156 +1330,480 @@ void StateMachine::BroadcastAddToList( objectID id )
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         SetTimerSubstate
+  Name:         SubscribeSubstate
 
-  Description:  Set a timer to deliver a message periodically to yourself.
-				Only valid if substate doesn't change.
+  Description:  Subscribe to a topic until the current substate is exited.
   
-  Arguments:    delay : the number of seconds in the future to deliver the message
-                name  : the name of the message
+  Arguments:    topic : the topic
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::SetTimerSubstate( float delay, MSG_Name name )
+void StateMachine::SubscribeSubstate( MsgTopic topic )
 {
-	//pass in delay as data, so timer can be resent when received
-	if( delay < ONE_FRAME )
-	{	//Enforce minimum to avoid ugly bugs (effectively the next frame)
-		delay = ONE_FRAME;
-	}
-
-	MSG_Data data( delay );
-	SendMsgDelayedToMeHelper( delay, name, SCOPE_TO_SUBSTATE, m_queue, data, true );
+	SubscribeHelper( topic, SCOPE_TO_SUBSTATE );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         SetTimerState
+  Name:         SubscribeState
 
-  Description:  Set a timer to deliver a message periodically to yourself.
-				Only valid if state doesn't change.
+  Description:  Subscribe to a topic until the current state is exited.
   
-  Arguments:    delay : the number of seconds in the future to deliver the message
-                name  : the name of the message
+  Arguments:    topic : the topic
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::SetTimerState( float delay, MSG_Name name )
+void StateMachine::SubscribeState( MsgTopic topic )
 {
-	//pass in delay as data, so timer can be resent when received
-	if( delay < ONE_FRAME )
-	{	//Enforce minimum to avoid ugly bugs (effectively the next frame)
-		delay = ONE_FRAME;
-	}
+	SubscribeHelper( topic, SCOPE_TO_STATE );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SubscribeStateMachine
+
+  Description:  Subscribe to a topic until this state machine is reset or
+                replaced. A publish while a pushed state machine covers it
+				ends the subscription as well.
+  
+  Arguments:    topic : the topic
 
-	MSG_Data data( delay );
-	SendMsgDelayedToMeHelper( delay, name, SCOPE_TO_SUBSTATE, m_queue, data, true );
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SubscribeStateMachine( MsgTopic topic )
+{
+	SubscribeHelper( topic, SCOPE_TO_STATE_MACHINE );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         SetTimerStateMachine
+  Name:         SubscribeHelper
 
-  Description:  Set a timer to deliver a message periodically to yourself.
-				Valid regardless of substate or state changes.
+  Description:  Helper function for the topic subscriptions.
   
-  Arguments:    delay : the number of seconds in the future to deliver the message
-                name  : the name of the message
+  Arguments:    topic : the topic
+                rule  : what the subscription is scoped to
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::SetTimerStateMachine( float delay, MSG_Name name )
+void StateMachine::SubscribeHelper( MsgTopic topic, Scope_Rule rule )
 {
-	//pass in delay as data, so timer can be resent when received
-	if( delay < ONE_FRAME )
-	{	//Enforce minimum to avoid ugly bugs (effectively the next frame)
-		delay = ONE_FRAME;
+	unsigned int scope = m_scopeStateMachine;
+	
+	if( rule == SCOPE_TO_SUBSTATE ) {	
+		scope = m_scopeSubstate;
+	}
+	else if( rule == SCOPE_TO_STATE ) {
+		scope = m_scopeState;
 	}
 
-	MSG_Data data( delay );
-	SendMsgDelayedToMeHelper( delay, name, SCOPE_TO_STATE_MACHINE, m_queue, data, true );
+	g_msgroute.Subscribe( topic, m_owner->GetID(), m_queue, rule, scope );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         SetTimerExternal
+  Name:         Unsubscribe
 
-  Description:  Used by msgroute to reset timer after it's been sent.
+  Description:  End the subscription to a topic before its scope is left.
   
-  Arguments:    delay : the number of seconds in the future to deliver the message
-                name  : the name of the message
-				rule  : the scoping rule for the message
+  Arguments:    topic : the topic
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::SetTimerExternal( float delay, MSG_Name name, Scope_Rule rule )
+void StateMachine::Unsubscribe( MsgTopic topic )
 {
-	MSG_Data data( delay );
-	SendMsgDelayedToMeHelper( delay, name, rule, m_queue, data, true );
+	g_msgroute.Unsubscribe( topic, m_owner->GetID(), m_queue );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         StopTimer
+  Name:         SendMsgToTopic
 
-  Description:  Stop a timer based on the message name.
+  Description:  Send a message next frame to the state machines subscribed
+                to a topic. The publish is queued once and fanned out to 
+				the subscribers of the next frame.
   
   Arguments:    name  : the name of the message
+                topic : the topic
+				data  : associated data to deliver with the message
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::StopTimer( MSG_Name name )
+void StateMachine::SendMsgToTopic( MSG_Name name, MsgTopic topic, MSG_Data& data )
 {
-	g_msgroute.RemoveMsg( name, m_owner->GetID(), m_owner->GetID(), true );
+	MSG_Object msg( 0.0f, name, m_owner->GetID(), 0, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
+	g_msgroute.Publish( topic, msg, true );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         SendCCMsg
+  Name:         SendMsgToTopicNow
 
-  Description:  Send a CCd message to the receiver. This is like a regular
-                message, but the CC flag is on.
+  Description:  Send a message immediately to the state machines subscribed
+                to a topic.
   
-  Arguments:    name     : the name of the message
-                receiver : the receiver of the message
-				data     : associated data to deliver with the message
+  Arguments:    name  : the name of the message
+                topic : the topic
+				data  : associated data to deliver with the message
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::SendCCMsg( MSG_Name name, objectID receiver, MSG_Data& data )
+void StateMachine::SendMsgToTopicNow( MSG_Name name, MsgTopic topic, MSG_Data& data )
 {
-	g_msgroute.SendMsg( 0, name, receiver, m_owner->GetID(), SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, true );
+	MSG_Object msg( 0.0f, name, m_owner->GetID(), 0, SCOPE_TO_STATE_MACHINE, 0, STATE_MACHINE_QUEUE_ALL, data, false, false );
+	g_msgroute.Publish( topic, msg, false );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         SendMsgDelayedToMeHelper
+  Name:         SetTimerSubstate
 
-  Description:  Helper function for several other functions to send a message
-                to yourself.
+  Description:  Set a timer to deliver a message periodically to yourself.
+				Only valid if substate doesn't change.
   
   Arguments:    delay : the number of seconds in the future to deliver the message
                 name  : the name of the message
-                rule  : the scoping rule for the message
-				queue : the queue to send it to
-				data  : associated data to deliver with the message
-				timer : whether this is a periodic timer message
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::SendMsgDelayedToMeHelper( float delay, MSG_Name name, Scope_Rule rule, StateMachineQueue queue, MSG_Data& data, bool timer )
+void StateMachine::SetTimerSubstate( float delay, MSG_Name name )
 {
-	unsigned int scope = 0;
-	
-	if( rule == SCOPE_TO_SUBSTATE ) {	
-		scope = m_scopeSubstate;
-	}
-	else if( rule == SCOPE_TO_STATE ) {
-		scope = m_scopeState;
-	}
-
-	g_msgroute.SendMsg( delay, name, m_owner->GetID(), m_owner->GetID(), rule, scope, queue, data, timer, false );
+	MSG_Data data( 0 );
+	SetTimerHelper( delay, name, SCOPE_TO_SUBSTATE, data );
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         RandDelay
+  Name:         SetTimerState
 
-  Description:  Returns a random delay within the range [min,max].
-  
+  Description:  Set a timer to deliver a message periodically to yourself.
+				Only valid if state doesn't change.
+  
+  Arguments:    delay : the number of seconds in the future to deliver the message
+                name  : the name of the message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SetTimerState( float delay, MSG_Name name )
+{
+	MSG_Data data( 0 );
+	SetTimerHelper( delay, name, SCOPE_TO_SUBSTATE, data );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetTimerStateMachine
+
+  Description:  Set a timer to deliver a message periodically to yourself.
+				Valid regardless of substate or state changes.
+  
+  Arguments:    delay : the number of seconds in the future to deliver the message
+                name  : the name of the message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SetTimerStateMachine( float delay, MSG_Name name )
+{
+	MSG_Data data( 0 );
+	SetTimerHelper( delay, name, SCOPE_TO_STATE_MACHINE, data );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetTimerHelper
+
+  Description:  Helper function for the timers. The period is kept in the
+                pending message, which msgroute reschedules in place each
+				time it's delivered (until the scope is left or the timer
+				is stopped).
+  
+  Arguments:    delay : the number of seconds between deliveries
+                name  : the name of the message
+                rule  : the scoping rule for the message
+				data  : associated data to deliver with the message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SetTimerHelper( float delay, MSG_Name name, Scope_Rule rule, MSG_Data& data )
+{
+	if( delay < ONE_FRAME )
+	{	//Enforce minimum to avoid ugly bugs (effectively the next frame)
+		delay = ONE_FRAME;
+	}
+
+	SendMsgDelayedToMeHelper( delay, name, rule, m_queue, data, true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ArmTimer
+
+  Description:  Arms the deadline slot of an OnTimeIn... handler when its
+                scope is entered (during the probe). MsgRoute is only asked
+				for a wake-up when the new deadline is the earliest one.
+  
+  Arguments:    state    : the state of the handler (-1 for the global state)
+                substate : the substate of the handler (-1 if not a substate)
+				index    : the handler number within its scope
+				delay    : the number of seconds until the handler runs
+				rule     : SCOPE_TO_SUBSTATE if substate changes clear the slot
+				periodic : whether the handler runs every delay seconds
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::ArmTimer( int state, int substate, int index, float delay, Scope_Rule rule, bool periodic )
+{
+	if( delay < ONE_FRAME )
+	{	//Enforce minimum to avoid ugly bugs (effectively the next frame)
+		delay = ONE_FRAME;
+	}
+
+	unsigned char scope = TIMER_SCOPE_STATEMACHINE;
+	if( state >= 0 ) {
+		scope = substate < 0 ? TIMER_SCOPE_STATE : TIMER_SCOPE_SUBSTATE;
+	}
+
+	//Reuse the slot if the scope is probed again
+	int slot = 0;
+	while( slot < m_numTimers && ( m_timers[slot].m_scope != scope || m_timers[slot].m_index != index ) ) {
+		slot++;
+	}
+	if( slot == m_numTimers )
+	{
+		if( m_numTimers >= STATE_MACHINE_MAX_TIMERS ) {
+			ASSERTMSG( 0, "StateMachine::ArmTimer - Too many OnTimeIn handlers armed at once. Increase STATE_MACHINE_MAX_TIMERS." );
+			return;
+		}
+		m_numTimers++;
+	}
+
+	TimerSlot & timer = m_timers[slot];
+	timer.m_time = g_frame.m_time + delay;
+	timer.m_period = periodic ? delay : 0.0f;
+	timer.m_index = (unsigned char)index;
+	timer.m_scope = scope;
+	timer.m_substateScoped = ( rule == SCOPE_TO_SUBSTATE || scope == TIMER_SCOPE_SUBSTATE );
+
+	if( m_wakeTime == 0.0 || timer.m_time < m_wakeTime )
+	{	//A later wake-up already scheduled is ignored when it comes due
+		m_wakeTime = timer.m_time;
+		g_msgroute.ScheduleTimerWake( m_wakeTime, m_owner->GetID(), m_queue );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FireTimers
+
+  Description:  Runs the OnTimeIn... handlers that are due, earliest first.
+                Periodic handlers are rearmed, then a wake-up is scheduled
+				for the earliest slot left.
+  
+  Arguments:    wakeTime : the time of the wake-up (wake-ups that have been
+                           superseded are ignored)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::FireTimers( double wakeTime )
+{
+	if( wakeTime != m_wakeTime || m_owner->IsMarkedForDeletion() ) {
+		return;
+	}
+	m_wakeTime = 0.0;
+
+	double time = g_frame.m_time;
+	int safetyCount = STATE_MACHINE_MAX_TIMERS * 2;
+	while( --safetyCount >= 0 && !m_owner->IsMarkedForDeletion() )
+	{
+		int due = -1;
+		for( int i=0; i<m_numTimers; i++ )
+		{
+			if( m_timers[i].m_time <= time && ( due < 0 || m_timers[i].m_time < m_timers[due].m_time ) ) {
+				due = i;
+			}
+		}
+		if( due < 0 ) {
+			break;
+		}
+
+		TimerSlot timer = m_timers[due];
+		if( timer.m_period > 0.0f )
+		{	//Keep the period (unless it fell more than a period behind)
+			m_timers[due].m_time += timer.m_period;
+			if( m_timers[due].m_time <= time ) {
+				m_timers[due].m_time = time + timer.m_period;
+			}
+		}
+		else
+		{
+			m_timers[due] = m_timers[--m_numTimers];
+		}
+
+#ifdef STATE_MACHINE_PROFILING
+		ProfileScope profile( *this, EVENT_Timer, 0 );
+#endif
+		CountTelemetry( TELEMETRY_EVENTS_PROCESSED );
+
+		int state = timer.m_scope == TIMER_SCOPE_STATEMACHINE ? -1 : static_cast<int>( m_currentState );
+		int substate = timer.m_scope == TIMER_SCOPE_SUBSTATE ? m_currentSubstate : -1;
+		m_firingTimer = timer.m_index;
+		RunHandlers( EVENT_Timer, 0, state, substate );
+		m_firingTimer = -1;
+
+		if( m_stateChange != NO_STATE_CHANGE ) {
+			PerformStateChanges( g_frame );
+		}
+	}
+
+	ScheduleTimerWake();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ClearTimers
+
+  Description:  Disarms the OnTimeIn... handlers of the scope being left.
+                The wake-up already scheduled is left alone (it finds 
+				nothing due).
+  
+  Arguments:    substateOnly : only the slots cleared by a substate change
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::ClearTimers( bool substateOnly )
+{
+	if( !substateOnly )
+	{
+		m_numTimers = 0;
+		return;
+	}
+
+	int i = 0;
+	while( i < m_numTimers )
+	{
+		if( m_timers[i].m_substateScoped ) {
+			m_timers[i] = m_timers[--m_numTimers];
+		}
+		else {
+			i++;
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         ScheduleTimerWake
+
+  Description:  Asks MsgRoute to wake the state machine when the earliest
+                armed slot is due.
+  
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::ScheduleTimerWake( void )
+{
+	double earliest = 0.0;
+	for( int i=0; i<m_numTimers; i++ )
+	{
+		if( earliest == 0.0 || m_timers[i].m_time < earliest ) {
+			earliest = m_timers[i].m_time;
+		}
+	}
+
+	if( earliest != 0.0 && ( m_wakeTime == 0.0 || earliest < m_wakeTime ) )
+	{
+		m_wakeTime = earliest;
+		g_msgroute.ScheduleTimerWake( m_wakeTime, m_owner->GetID(), m_queue );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         IsCoroutineEvent
+
+  Description:  Whether an event starts or resumes the coroutine of a scope.
+                It starts on EVENT_Enter and resumes on the message it is
+				waiting for (MSG_GENERIC_COROUTINE for its own timed wait).
+
+  Arguments:    event      : the event
+                msg        : the message (if the event is a message)
+				line       : the resume point (0 if not started, -1 if done)
+				awaitedMsg : the message name waited for (MSG_NULL for a timed wait)
+
+  Returns:      True if the coroutine should run.
+ *---------------------------------------------------------------------------*/
+bool StateMachine::IsCoroutineEvent( State_Machine_Event event, MSG_Object * msg, int line, int awaitedMsg )
+{
+	if( EVENT_Enter == event ) {
+		return( line == 0 );
+	}
+	if( EVENT_Message == event && msg && line > 0 )
+	{
+		if( awaitedMsg != MSG_NULL ) {
+			return( msg->GetName() == awaitedMsg );
+		}
+		return( msg->GetName() == MSG_GENERIC_COROUTINE && msg->GetIntData() == line );
+	}
+	return( false );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         CoroutineWait
+
+  Description:  Resumes a coroutine after a delay, unless its scope is left 
+                first.
+
+  Arguments:    delay    : the number of seconds to wait
+                line     : the resume point
+				substate : the substate of the coroutine (-1 for a state)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::CoroutineWait( float delay, int line, int substate )
+{
+	if( delay < ONE_FRAME )
+	{	//Enforce minimum (effectively the next frame)
+		delay = ONE_FRAME;
+	}
+
+	MSG_Data data( line );
+	SendMsgDelayedToMeHelper( delay, MSG_GENERIC_COROUTINE, substate < 0 ? SCOPE_TO_STATE : SCOPE_TO_SUBSTATE, m_queue, data, false );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         StopTimer
+
+  Description:  Stop a timer based on the message name.
+  
+  Arguments:    name  : the name of the message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::StopTimer( MSG_Name name )
+{
+	g_msgroute.RemoveMsg( name, m_owner->GetID(), m_owner->GetID(), true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SendMsgDelayedToMeHelper
+
+  Description:  Helper function for several other functions to send a message
+                to yourself.
+  
+  Arguments:    delay : the number of seconds in the future to deliver the message
+                name  : the name of the message
+                rule  : the scoping rule for the message
+				queue : the queue to send it to
+				data  : associated data to deliver with the message
+				timer : whether this is a periodic timer message
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::SendMsgDelayedToMeHelper( float delay, MSG_Name name, Scope_Rule rule, StateMachineQueue queue, MSG_Data& data, bool timer )
+{
+	unsigned int scope = 0;
+	
+	if( rule == SCOPE_TO_SUBSTATE ) {	
+		scope = m_scopeSubstate;
+	}
+	else if( rule == SCOPE_TO_STATE ) {
+		scope = m_scopeState;
+	}
+
+	g_msgroute.SendMsg( delay, name, m_owner->GetID(), m_owner->GetID(), rule, scope, queue, data, timer, false );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RandDelay
+
+  Description:  Returns a random delay within the range [min,max].
+  
   Arguments:    min : the lower bound
                 max : the higher bound
 
@@ -1152,52 +1953,179 @@ void StateMachine::DeleteStateMachineQueue( StateMachineQueue queue )
  *---------------------------------------------------------------------------*/
 void StateMachine::DeclareVariable( int id, StateVariableScope scope )
 {
-	if( scope == STATE_VARIABLE_SCOPE && (int)m_stateVariables.size() <= id )
-	{	//Doesn't exist yet, so add it
-		StateMachinePersistentData* data = new StateMachinePersistentData();
-		m_stateVariables.push_back( data );
+	ASSERTMSG( id >= 0 && id < STATE_MACHINE_MAX_VARIABLES, "StateMachine::DeclareVariable - Too many variables. Increase STATE_MACHINE_MAX_VARIABLES." );
+
+	if( scope == STATE_VARIABLE_SCOPE )
+	{
+		if( id >= m_stateVariableCapacity )
+		{
+			if( m_probing )
+			{	//Grown once the probe is done (see ProbeScope)
+				if( id >= m_probeStateVariables ) {
+					m_probeStateVariables = id + 1;
+				}
+				return;
+			}
+			ReserveVariables( id + 1, 0 );
+		}
+		while( m_numStateVariables <= id && m_numStateVariables < STATE_MACHINE_MAX_VARIABLES )
+		{	//Doesn't exist yet, so add it
+			m_stateVariables[m_numStateVariables++].SetInt( 0 );
+		}
 	}
-	else if( scope == SUBSTATE_VARIABLE_SCOPE && (int)m_substateVariables.size() <= id )
-	{	//Doesn't exist yet, so add it
-		StateMachinePersistentData* data = new StateMachinePersistentData();
-		m_substateVariables.push_back( data );
+	else if( scope == SUBSTATE_VARIABLE_SCOPE )
+	{
+		if( id >= m_substateVariableCapacity )
+		{
+			if( m_probing )
+			{	//Grown once the probe is done (see ProbeScope)
+				if( id >= m_probeSubstateVariables ) {
+					m_probeSubstateVariables = id + 1;
+				}
+				return;
+			}
+			ReserveVariables( 0, id + 1 );
+		}
+		while( m_numSubstateVariables <= id && m_numSubstateVariables < STATE_MACHINE_MAX_VARIABLES )
+		{	//Doesn't exist yet, so add it
+			m_substateVariables[m_numSubstateVariables++].SetInt( 0 );
+		}
 	}
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         DeleteAllStateVariables
+  Name:         ReserveVariables
 
-  Description:  Deletes all state variables.
+  Description:  Grows the variable storage to hold at least the given number
+                of state and substate variables, and at least as many as any
+				instance of this class has needed so far. Normally called
+				between handlers (see m_stateVariables). A nested state change
+				(from a message the state machine sent itself right away) can
+				enter a state no instance has probed while a handler is
+				running; the proxies of that handler may point into the old
+				block, so it is kept until the handler returns.
 
-  Arguments:    None.
+  Arguments:    numStateVariables    : state variables needed
+                numSubstateVariables : substate variables needed
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::DeleteAllStateVariables( void )
+void StateMachine::ReserveVariables( int numStateVariables, int numSubstateVariables )
 {
-	for( std::vector<StateMachinePersistentData*>::iterator i = m_stateVariables.begin(); i != m_stateVariables.end(); ++i )
-	{
-		delete( *i );
+	ASSERTMSG( m_definition, "StateMachine::ReserveVariables - variables declared outside of States" );
+
+	if( m_definition )
+	{	//Record the high-water mark for the class, so later instances allocate once
+		if( numStateVariables > m_definition->m_maxStateVariables ) {
+			m_definition->m_maxStateVariables = numStateVariables;
+		}
+		if( numSubstateVariables > m_definition->m_maxSubstateVariables ) {
+			m_definition->m_maxSubstateVariables = numSubstateVariables;
+		}
+		numStateVariables = m_definition->m_maxStateVariables;
+		numSubstateVariables = m_definition->m_maxSubstateVariables;
+	}
+	if( numStateVariables < m_stateVariableCapacity ) {
+		numStateVariables = m_stateVariableCapacity;
+	}
+	if( numSubstateVariables < m_substateVariableCapacity ) {
+		numSubstateVariables = m_substateVariableCapacity;
+	}
+
+	StateMachinePersistentData * variables = new StateMachinePersistentData[numStateVariables + numSubstateVariables];
+	for( int i=0; i<m_numStateVariables; ++i ) {
+		variables[i] = m_stateVariables[i];
+	}
+	for( int i=0; i<m_numSubstateVariables; ++i ) {
+		variables[numStateVariables + i] = m_substateVariables[i];
+	}
+	if( m_handlerDepth > 0 )
+	{	//Freed by RunHandlers once no handler is running
+		if( m_stateVariables ) {
+			m_retiredVariables.push_back( m_stateVariables );
+		}
+	}
+	else {
+		delete[] m_stateVariables;
 	}
-	m_stateVariables.clear();
+
+	m_stateVariables = variables;
+	m_substateVariables = variables + numStateVariables;
+	m_stateVariableCapacity = numStateVariables;
+	m_substateVariableCapacity = numSubstateVariables;
 }
 
 /*---------------------------------------------------------------------------*
-  Name:         DeleteAllSubstateVariables
+  Name:         ReserveClassVariables
 
-  Description:  Deletes all substate variables.
+  Description:  Grows the variable storage to what the class has needed so
+                far, before the first handler runs (so a nested state change
+				into a state another instance has probed doesn't grow it
+				under a running handler).
 
   Arguments:    None.
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachine::DeleteAllSubstateVariables( void )
+void StateMachine::ReserveClassVariables( void )
 {
-	for( std::vector<StateMachinePersistentData*>::iterator i = m_substateVariables.begin(); i != m_substateVariables.end(); ++i )
+	ReserveVariables( 0, 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         FreeRetiredVariables
+
+  Description:  Frees the variable blocks replaced while a handler was
+                running, once no handler is.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachine::FreeRetiredVariables( void )
+{
+	for( unsigned int i=0; i<m_retiredVariables.size(); ++i ) {
+		delete[] m_retiredVariables[i];
+	}
+	m_retiredVariables.clear();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BindStateVariable
+
+  Description:  Returns the storage for a variable so a StateVariable proxy can
+                reference it directly. Reads and writes through the proxy then
+                go straight to the state machine with no copy or write-back.
+				The storage is in the variable block, which can be replaced
+				when a state needs more variables than the class has used so
+				far (see ReserveVariables). A replaced block is kept until no
+				handler of this state machine is running, so the reference
+				stays valid for the handler that bound it.
+
+  Arguments:    id    : the index of the variable
+                scope : state or substate scope
+                init  : whether the variable is being declared (probe event)
+
+  Returns:      The variable storage.
+ *---------------------------------------------------------------------------*/
+StateMachinePersistentData & StateMachine::BindStateVariable( int id, StateVariableScope scope, bool init )
+{
+	if( init )
 	{
-		delete( *i );
+		DeclareVariable( id, scope );
+		if( m_probing && id >= ( scope == STATE_VARIABLE_SCOPE ? m_numStateVariables : m_numSubstateVariables ) ) {
+			return( m_probeScratch );	//Not stored until the probe is done (the probe doesn't run handlers)
+		}
+	}
+
+	if( scope == STATE_VARIABLE_SCOPE ) {
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::BindStateVariable - id out of range" );
+		return m_stateVariables[id];
+	}
+	else {
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::BindStateVariable - id out of range" );
+		return m_substateVariables[id];
 	}
-	m_substateVariables.clear();
 }
 
 /*---------------------------------------------------------------------------*
@@ -1214,12 +2142,12 @@ void StateMachine::DeleteAllSubstateVariables( void )
 void StateMachine::SetStateVariableInt( int value, int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::SetStateVariableInt - id out of range" );
-		m_stateVariables[id]->SetInt( value );
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::SetStateVariableInt - id out of range" );
+		m_stateVariables[id].SetInt( value );
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::SetStateVariableInt - id out of range" );
-		m_substateVariables[id]->SetInt( value );
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::SetStateVariableInt - id out of range" );
+		m_substateVariables[id].SetInt( value );
 	}
 
 }
@@ -1227,72 +2155,72 @@ void StateMachine::SetStateVariableInt( int value, int id, StateVariableScope sc
 void StateMachine::SetStateVariableFloat( float value, int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::SetStateVariableFloat - id out of range" );
-		m_stateVariables[id]->SetFloat( value );
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::SetStateVariableFloat - id out of range" );
+		m_stateVariables[id].SetFloat( value );
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::SetStateVariableFloat - id out of range" );
-		m_substateVariables[id]->SetFloat( value );
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::SetStateVariableFloat - id out of range" );
+		m_substateVariables[id].SetFloat( value );
 	}
 }
 
 void StateMachine::SetStateVariableBool( bool value, int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::SetStateVariableBool - id out of range" );
-		m_stateVariables[id]->SetBool( value );
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::SetStateVariableBool - id out of range" );
+		m_stateVariables[id].SetBool( value );
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::SetStateVariableBool - id out of range" );
-		m_substateVariables[id]->SetBool( value );
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::SetStateVariableBool - id out of range" );
+		m_substateVariables[id].SetBool( value );
 	}
 }
 
 void StateMachine::SetStateVariableObjectID( objectID value, int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::SetStateVariableObjectID - id out of range" );
-		m_stateVariables[id]->SetObjectID( value );
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::SetStateVariableObjectID - id out of range" );
+		m_stateVariables[id].SetObjectID( value );
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::SetStateVariableObjectID - id out of range" );
-		m_substateVariables[id]->SetObjectID( value );
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::SetStateVariableObjectID - id out of range" );
+		m_substateVariables[id].SetObjectID( value );
 	}
 }
 
 void StateMachine::SetStateVariablePointer( void* value, int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::SetStateVariablePointer - id out of range" );
-		m_stateVariables[id]->SetPointer( value );
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::SetStateVariablePointer - id out of range" );
+		m_stateVariables[id].SetPointer( value );
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::SetStateVariablePointer - id out of range" );
-		m_substateVariables[id]->SetPointer( value );
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::SetStateVariablePointer - id out of range" );
+		m_substateVariables[id].SetPointer( value );
 	}
 }
 
-void StateMachine::SetStateVariableVector2( D3DXVECTOR2* value, int id, StateVariableScope scope )
+void StateMachine::SetStateVariableVector2( Vector2* value, int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::SetStateVariableVector2 - id out of range" );
-		m_stateVariables[id]->SetVector2( value );
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::SetStateVariableVector2 - id out of range" );
+		m_stateVariables[id].SetVector2( value );
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::SetStateVariableVector2 - id out of range" );
-		m_substateVariables[id]->SetVector2( value );
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::SetStateVariableVector2 - id out of range" );
+		m_substateVariables[id].SetVector2( value );
 	}
 }
 
-void StateMachine::SetStateVariableVector3( D3DXVECTOR3* value, int id, StateVariableScope scope )
+void StateMachine::SetStateVariableVector3( Vector3* value, int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::SetStateVariableVector3 - id out of range" );
-		m_stateVariables[id]->SetVector3( value );
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::SetStateVariableVector3 - id out of range" );
+		m_stateVariables[id].SetVector3( value );
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::SetStateVariableVector3 - id out of range" );
-		m_substateVariables[id]->SetVector3( value );
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::SetStateVariableVector3 - id out of range" );
+		m_substateVariables[id].SetVector3( value );
 	}
 }
 
@@ -1310,84 +2238,84 @@ void StateMachine::SetStateVariableVector3( D3DXVECTOR3* value, int id, StateVar
 int StateMachine::GetStateVariableInt( int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::GetStateVariableInt - id out of range" );
-		return m_stateVariables[id]->GetInt();
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::GetStateVariableInt - id out of range" );
+		return m_stateVariables[id].GetInt();
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::GetStateVariableInt - id out of range" );
-		return m_substateVariables[id]->GetInt();
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::GetStateVariableInt - id out of range" );
+		return m_substateVariables[id].GetInt();
 	}
 }
 
 float StateMachine::GetStateVariableFloat( int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::GetStateVariableFloat - id out of range" );
-		return m_stateVariables[id]->GetFloat();
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::GetStateVariableFloat - id out of range" );
+		return m_stateVariables[id].GetFloat();
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::GetStateVariableFloat - id out of range" );
-		return m_substateVariables[id]->GetFloat();
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::GetStateVariableFloat - id out of range" );
+		return m_substateVariables[id].GetFloat();
 	}
 }
 
 bool StateMachine::GetStateVariableBool( int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::GetStateVariableBool - id out of range" );
-		return m_stateVariables[id]->GetBool();
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::GetStateVariableBool - id out of range" );
+		return m_stateVariables[id].GetBool();
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::GetStateVariableBool - id out of range" );
-		return m_substateVariables[id]->GetBool();
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::GetStateVariableBool - id out of range" );
+		return m_substateVariables[id].GetBool();
 	}
 }
 
 objectID StateMachine::GetStateVariableObjectID( int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::GetStateVariableObjectID - id out of range" );
-		return m_stateVariables[id]->GetObjectID();
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::GetStateVariableObjectID - id out of range" );
+		return m_stateVariables[id].GetObjectID();
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::GetStateVariableObjectID - id out of range" );
-		return m_substateVariables[id]->GetObjectID();
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::GetStateVariableObjectID - id out of range" );
+		return m_substateVariables[id].GetObjectID();
 	}
 }
 
 void* StateMachine::GetStateVariablePointer( int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::GetStateVariablePointer - id out of range" );
-		return m_stateVariables[id]->GetPointer();
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::GetStateVariablePointer - id out of range" );
+		return m_stateVariables[id].GetPointer();
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::GetStateVariablePointer - id out of range" );
-		return m_substateVariables[id]->GetPointer();
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::GetStateVariablePointer - id out of range" );
+		return m_substateVariables[id].GetPointer();
 	}
 }
 
-D3DXVECTOR2* StateMachine::GetStateVariableVector2( int id, StateVariableScope scope )
+Vector2* StateMachine::GetStateVariableVector2( int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::GetStateVariableVector2 - id out of range" );
-		return m_stateVariables[id]->GetVector2();
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::GetStateVariableVector2 - id out of range" );
+		return m_stateVariables[id].GetVector2();
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::GetStateVariableVector2 - id out of range" );
-		return m_substateVariables[id]->GetVector2();
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::GetStateVariableVector2 - id out of range" );
+		return m_substateVariables[id].GetVector2();
 	}
 }
 
-D3DXVECTOR3* StateMachine::GetStateVariableVector3( int id, StateVariableScope scope )
+Vector3* StateMachine::GetStateVariableVector3( int id, StateVariableScope scope )
 {
 	if( scope == STATE_VARIABLE_SCOPE ) {
-		ASSERTMSG( id >= 0 && id < (int)m_stateVariables.size(), "StateMachine::GetStateVariableVector3 - id out of range" );
-		return m_stateVariables[id]->GetVector3();
+		ASSERTMSG( id >= 0 && id < m_numStateVariables, "StateMachine::GetStateVariableVector3 - id out of range" );
+		return m_stateVariables[id].GetVector3();
 	}
 	else {
-		ASSERTMSG( id >= 0 && id < (int)m_substateVariables.size(), "StateMachine::GetStateVariableVector3 - id out of range" );
-		return m_substateVariables[id]->GetVector3();
+		ASSERTMSG( id >= 0 && id < m_numSubstateVariables, "StateMachine::GetStateVariableVector3 - id out of range" );
+		return m_substateVariables[id].GetVector3();
 	}
 }
 
@@ -1396,19 +2324,44 @@ D3DXVECTOR3* StateMachine::GetStateVariableVector3( int id, StateVariableScope s
 
 
 
-StateMachineManager::StateMachineManager( GameObject & object )
-: m_owner( &object )
+StateMachineManager::StateMachineManager( GameObject & object, unsigned int numQueues )
+: m_owner( &object ),
+  m_numQueues( numQueues ),
+  m_activeQueues( 0 ),
+  m_lazyQueues( 0 )
 {
-	for( int i=0; i<STATE_MACHINE_NUM_QUEUES; ++i )
+	ASSERTMSG( numQueues > 0 && numQueues <= STATE_MACHINE_MAX_QUEUES, "StateMachineManager::StateMachineManager - number of queues out of range" );
+	COMPILE_TIME_ASSERT( STATE_MACHINE_MAX_QUEUES <= 32, active_queue_mask_holds_32_queues );
+	COMPILE_TIME_ASSERT( STATE_MACHINE_QUEUE_ALL < 32, msg_queue_field_holds_5_bits );
+
+	m_stateMachineList = (stateMachineListContainer*)MemoryTracker::Allocate( m_numQueues * sizeof( stateMachineListContainer ), MEMORY_TAG_STATE_MACHINE_MANAGER );
+	m_stateMachineChange = (StateMachineChange*)MemoryTracker::Allocate( m_numQueues * sizeof( StateMachineChange ), MEMORY_TAG_STATE_MACHINE_MANAGER );
+	m_newStateMachine = (StateMachine**)MemoryTracker::Allocate( m_numQueues * sizeof( StateMachine* ), MEMORY_TAG_STATE_MACHINE_MANAGER );
+	m_lastScope = (unsigned int*)MemoryTracker::Allocate( m_numQueues * sizeof( unsigned int ), MEMORY_TAG_STATE_MACHINE_MANAGER );
+	m_activeStateMachine = (StateMachine**)MemoryTracker::Allocate( m_numQueues * sizeof( StateMachine* ), MEMORY_TAG_STATE_MACHINE_MANAGER );
+
+	for( unsigned int i=0; i<m_numQueues; ++i )
 	{
+		::new( &m_stateMachineList[i] ) stateMachineListContainer();
 		m_stateMachineChange[i] = NO_STATE_MACHINE_CHANGE;
 		m_newStateMachine[i] = 0;
+		m_lastScope[i] = 0;
+		m_activeStateMachine[i] = 0;
 	}
 }
 
 StateMachineManager::~StateMachineManager( void )
 {
-	DeleteStateMachineQueue( STATE_MACHINE_QUEUE_ALL );
+	DeleteStateMachines( STATE_MACHINE_QUEUE_ALL );
+
+	for( unsigned int i=0; i<m_numQueues; ++i ) {
+		m_stateMachineList[i].~stateMachineListContainer();
+	}
+	MemoryTracker::Free( m_stateMachineList );
+	MemoryTracker::Free( m_stateMachineChange );
+	MemoryTracker::Free( m_newStateMachine );
+	MemoryTracker::Free( m_lastScope );
+	MemoryTracker::Free( m_activeStateMachine );
 }
 
 /*---------------------------------------------------------------------------*
@@ -1416,38 +2369,137 @@ StateMachineManager::~StateMachineManager( void )
 
   Description:  Updates the currently active state machine in each queue.
 
+  Arguments:    frame : the current tick
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineManager::Update( const FrameContext & frame )
+{
+	for( int queue=GetNextActiveQueue( 0 ); queue<(int)m_numQueues; queue=GetNextActiveQueue( queue + 1 ) )
+	{
+		ProcessStateMachineChangeRequests((StateMachineQueue)queue);
+		m_activeStateMachine[queue]->Update( frame );
+	}
+
+	RefreshUpdateActive();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RefreshUpdateActive
+
+  Description:  The owner only needs to be updated if the active state machine
+                in a queue has an OnUpdate, or if a state machine change is
+				pending (they are processed during the update).
+
   Arguments:    None.
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachineManager::Update( void )
+void StateMachineManager::RefreshUpdateActive( void )
+{
+	bool active = false;
+	for( int queue=0; queue<(int)m_numQueues && !active; ++queue )
+	{
+		if( m_stateMachineChange[queue] != NO_STATE_MACHINE_CHANGE ) {
+			active = true;
+		}
+		else if( m_activeStateMachine[queue] && m_activeStateMachine[queue]->IsUpdateRegistered() ) {
+			active = true;
+		}
+	}
+
+	m_owner->SetUpdateActive( active );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Save
+
+  Description:  Saves the state machines of every queue (bottom to top),
+                each with the name of its class.
+
+  Arguments:    writer : the snapshot being written
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineManager::Save( SnapshotWriter & writer )
+{
+	for( unsigned int queue=0; queue<m_numQueues; ++queue )
+	{
+		ASSERTMSG( m_stateMachineChange[queue] == NO_STATE_MACHINE_CHANGE, "StateMachineManager::Save - Can't save a pending state machine change" );
+		if( m_stateMachineChange[queue] != NO_STATE_MACHINE_CHANGE ) {
+			writer.Fail();
+		}
+
+		writer.Write( m_lastScope[queue] );
+		writer.Write( (unsigned int)m_stateMachineList[queue].size() );
+		for( stateMachineListContainer::iterator i = m_stateMachineList[queue].begin(); i != m_stateMachineList[queue].end(); ++i )
+		{
+			const char * name = typeid( **i ).name();
+			ASSERTMSG( StateMachineRegistration::IsRegistered( name ), "StateMachineManager::Save - State machine class not registered (see REGISTER_STATE_MACHINE)" );
+			if( !StateMachineRegistration::IsRegistered( name ) ) {
+				writer.Fail();
+			}
+
+			writer.WriteString( name );
+			(*i)->Save( writer );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Restore
+
+  Description:  Recreates the state machines saved by Save, in the same
+                queues and order. No events are sent to them.
+
+  Arguments:    reader : the snapshot being read
+
+  Returns:      Whether the state machines were restored.
+ *---------------------------------------------------------------------------*/
+bool StateMachineManager::Restore( SnapshotReader & reader )
 {
-	for( int queue=0; queue<STATE_MACHINE_NUM_QUEUES; ++queue )
+	for( unsigned int queue=0; queue<m_numQueues && reader.IsValid(); ++queue )
 	{
-		if( !m_stateMachineList[queue].empty() )
+		m_lastScope[queue] = reader.Read<unsigned int>();
+		unsigned int count = reader.Read<unsigned int>();
+		for( unsigned int i=0; i<count && reader.IsValid(); ++i )
 		{
-			ProcessStateMachineChangeRequests((StateMachineQueue)queue);
-			m_stateMachineList[queue].back()->Update();
+			StateMachine * mch = StateMachineRegistration::Create( reader.ReadString(), *m_owner );
+			if( !mch ) {
+				ASSERTMSG( !reader.IsValid(), "StateMachineManager::Restore - State machine class not registered (see REGISTER_STATE_MACHINE)" );
+				reader.Fail();
+				break;
+			}
+
+			PushStateMachine( *mch, (StateMachineQueue)queue, false );
+			mch->Restore( reader );
 		}
 	}
+
+	RefreshUpdateActive();
+	return( reader.IsValid() );
 }
 
 /*---------------------------------------------------------------------------*
   Name:         SendMsg
 
-  Description:  Sends a message to the currently active state machine in each queue
+  Description:  Sends a message to the currently active state machine in each
+                queue. The message isn't copied, so broadcasts construct one
+				message and pass it to every receiver (handlers only read it).
 
-  Arguments:    MSG_Object
+  Arguments:    msg : the message
 
   Returns:      None.
  *---------------------------------------------------------------------------*/
-void StateMachineManager::SendMsg( MSG_Object msg )
+void StateMachineManager::SendMsg( MSG_Object & msg )
 {
-	for( int queue=0; queue<STATE_MACHINE_NUM_QUEUES; ++queue )
+	if( m_lazyQueues ) {
+		InitializeLazyQueues();
+	}
+
+	for( int queue=GetNextActiveQueue( 0 ); queue<(int)m_numQueues; queue=GetNextActiveQueue( queue + 1 ) )
 	{
-		if( !m_stateMachineList[queue].empty() ) {
-			m_stateMachineList[queue].back()->Process( EVENT_Message, &msg );
-		}
+		m_activeStateMachine[queue]->Process( EVENT_Message, &msg );
 	}
 }
 
@@ -1463,19 +2515,21 @@ void StateMachineManager::SendMsg( MSG_Object msg )
  *---------------------------------------------------------------------------*/
 void StateMachineManager::Process( State_Machine_Event event, MSG_Object * msg, StateMachineQueue queue )
 {
-	if( queue < STATE_MACHINE_NUM_QUEUES )
+	if( m_lazyQueues ) {
+		InitializeLazyQueues();
+	}
+
+	if( (unsigned int)queue < m_numQueues )
 	{
-		if( !m_stateMachineList[queue].empty() ) {
-			m_stateMachineList[queue].back()->Process( event, msg );
+		if( m_activeStateMachine[queue] ) {
+			m_activeStateMachine[queue]->Process( event, msg );
 		}
 	}
 	else if( queue == STATE_MACHINE_QUEUE_ALL )
 	{
-		for( int i=0; i<STATE_MACHINE_NUM_QUEUES; ++i )
+		for( int i=GetNextActiveQueue( 0 ); i<(int)m_numQueues; i=GetNextActiveQueue( i + 1 ) )
 		{
-			if( !m_stateMachineList[i].empty() ) {
-				m_stateMachineList[i].back()->Process( event, msg );
-			}
+			m_activeStateMachine[i]->Process( event, msg );
 		}
 	}
 }
@@ -1533,6 +2587,11 @@ void StateMachineManager::ProcessStateMachineChangeRequests( StateMachineQueue q
 				g_msgroute.PurgeScopedMsg( m_owner->GetID(), queue ); //Remove all delayed messages addressed to me that are scoped
 				PopStateMachine( queue );
 				break;
+
+			case STATE_MACHINE_INITIALIZE:
+				m_lazyQueues &= ~( 1u << queue );
+				ResetStateMachine( queue );
+				break;
 				
 			default:
 				ASSERTMSG( 0, "GameObject::ProcessStateMachineChangeRequests - invalid StateMachineChange request." );
@@ -1544,6 +2603,27 @@ void StateMachineManager::ProcessStateMachineChangeRequests( StateMachineQueue q
 	}
 }
 
+/*---------------------------------------------------------------------------*
+  Name:         InitializeLazyQueues
+
+  Description:  Initializes the lazily pushed state machines before they 
+                handle their first event, if that comes before their first
+				update.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineManager::InitializeLazyQueues( void )
+{
+	unsigned long queue;
+	while( _BitScanForward( &queue, m_lazyQueues ) )
+	{
+		ProcessStateMachineChangeRequests( (StateMachineQueue)queue );
+		m_lazyQueues &= ~( 1u << queue );
+	}
+}
+
 /*---------------------------------------------------------------------------*
   Name:         RequestStateMachineChange
 
@@ -1561,6 +2641,8 @@ void StateMachineManager::RequestStateMachineChange( StateMachine * mch, StateMa
 
 	m_newStateMachine[queue] = mch;
 	m_stateMachineChange[queue] = change;
+
+	RefreshUpdateActive();
 }
 
 /*---------------------------------------------------------------------------*
@@ -1574,13 +2656,15 @@ void StateMachineManager::RequestStateMachineChange( StateMachine * mch, StateMa
  *---------------------------------------------------------------------------*/
 void StateMachineManager::ResetStateMachine( StateMachineQueue queue )
 {
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachineManager::ResetStateMachine - queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_numQueues, "StateMachineManager::ResetStateMachine - queue out of bounds" );
 	ASSERTMSG( m_stateMachineList[queue].size() > 0, "StateMachineManager::ResetStateMachine - No existing state machine to reset." );
 
 	if( m_stateMachineList[queue].size() > 0 ) {
 		StateMachine * mch = m_stateMachineList[queue].back();
 		mch->Reset();
 	}
+
+	RefreshUpdateActive();
 }
 
 /*---------------------------------------------------------------------------*
@@ -1597,7 +2681,7 @@ void StateMachineManager::ResetStateMachine( StateMachineQueue queue )
  *---------------------------------------------------------------------------*/
 void StateMachineManager::ReplaceStateMachine( StateMachine & mch, StateMachineQueue queue )
 {
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachineManager::ReplaceStateMachine - queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_numQueues, "StateMachineManager::ReplaceStateMachine - queue out of bounds" );
 	ASSERTMSG( m_stateMachineList[queue].size() > 0, "StateMachineManager::ReplaceStateMachine - No existing state machine to replace." );
 
 	mch.SetStateMachineQueue( queue );
@@ -1605,7 +2689,8 @@ void StateMachineManager::ReplaceStateMachine( StateMachine & mch, StateMachineQ
 	if( m_stateMachineList[queue].size() > 0 ) {
 		StateMachine * temp = m_stateMachineList[queue].back();
 		m_stateMachineList[queue].pop_back();
-		delete( temp );
+		RefreshActiveStateMachine( queue );
+		DestroyStateMachine( temp );
 	}
 	PushStateMachine( mch, queue, true );
 }
@@ -1624,7 +2709,7 @@ void StateMachineManager::ReplaceStateMachine( StateMachine & mch, StateMachineQ
  *---------------------------------------------------------------------------*/
 void StateMachineManager::QueueStateMachine( StateMachine & mch, StateMachineQueue queue )
 {
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachineManager::QueueStateMachine - queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_numQueues, "StateMachineManager::QueueStateMachine - queue out of bounds" );
 
 	mch.SetStateMachineQueue( queue );
 
@@ -1653,13 +2738,14 @@ void StateMachineManager::QueueStateMachine( StateMachine & mch, StateMachineQue
  *---------------------------------------------------------------------------*/
 void StateMachineManager::RequeueStateMachine( StateMachineQueue queue )
 {
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachineManager::RequeueStateMachine - queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_numQueues, "StateMachineManager::RequeueStateMachine - queue out of bounds" );
 	ASSERTMSG( m_stateMachineList[queue].size() > 0, "StateMachineManager::RequeueStateMachine - No existing state machines to requeue." );
 
 	if( m_stateMachineList[queue].size() > 1 ) {
 		StateMachine * mch = m_stateMachineList[queue].back();
 		QueueStateMachine( *mch, queue );
 		m_stateMachineList[queue].pop_back();
+		RefreshActiveStateMachine( queue );
 
 		//Initialize new state machine
 		mch = m_stateMachineList[queue].back();
@@ -1670,6 +2756,8 @@ void StateMachineManager::RequeueStateMachine( StateMachineQueue queue )
 		StateMachine * mch = m_stateMachineList[queue].back();
 		mch->Reset();	
 	}
+
+	RefreshUpdateActive();
 }
 
 /*---------------------------------------------------------------------------*
@@ -1685,15 +2773,40 @@ void StateMachineManager::RequeueStateMachine( StateMachineQueue queue )
  *---------------------------------------------------------------------------*/
 void StateMachineManager::PushStateMachine( StateMachine & mch, StateMachineQueue queue, bool initialize )
 {
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachineManager::PushStateMachine - queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_numQueues, "StateMachineManager::PushStateMachine - queue out of bounds" );
 
 	mch.SetStateMachineQueue( queue );
 	m_stateMachineList[queue].push_back( &mch );
+	RefreshActiveStateMachine( queue );
 	
 	if( initialize )
 	{
 		mch.Reset();
 	}
+
+	RefreshUpdateActive();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         PushStateMachineLazy
+
+  Description:  Pushes a state machine without initializing it. It is 
+                initialized on the owner's first update (or first event, if
+				that comes first), so spawning a batch of objects doesn't
+				run every OnEnter up front, and a parallel update spreads
+				them over the job threads. Must be the last change to the
+				queue before that update.
+
+  Arguments:    mch   : the new state machine
+				queue : the queue to operate on
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineManager::PushStateMachineLazy( StateMachine & mch, StateMachineQueue queue )
+{
+	PushStateMachine( mch, queue, false );
+	m_lazyQueues |= 1u << queue;
+	RequestStateMachineChange( 0, STATE_MACHINE_INITIALIZE, queue );	//Makes the owner update active
 }
 
 /*---------------------------------------------------------------------------*
@@ -1707,18 +2820,21 @@ void StateMachineManager::PushStateMachine( StateMachine & mch, StateMachineQueu
  *---------------------------------------------------------------------------*/
 void StateMachineManager::PopStateMachine( StateMachineQueue queue )
 {
-	ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachineManager::PopStateMachine - queue out of bounds" );
+	ASSERTMSG( (unsigned int)queue < m_numQueues, "StateMachineManager::PopStateMachine - queue out of bounds" );
 	ASSERTMSG( m_stateMachineList[queue].size() > 1, "StateMachineManager::PopStateMachine - Can't pop last state machine." );
 
 	if( m_stateMachineList[queue].size() > 1 ) {
 		StateMachine * mch = m_stateMachineList[queue].back();
 		m_stateMachineList[queue].pop_back();
-		delete( mch );
+		RefreshActiveStateMachine( queue );
+		DestroyStateMachine( mch );
 		
 		//Initialize new state machine
 		mch = m_stateMachineList[queue].back();
 		mch->Reset();
 	}
+
+	RefreshUpdateActive();
 }
 
 /*---------------------------------------------------------------------------*
@@ -1731,24 +2847,85 @@ void StateMachineManager::PopStateMachine( StateMachineQueue queue )
   Returns:      None.
  *---------------------------------------------------------------------------*/
 void StateMachineManager::DeleteStateMachineQueue( StateMachineQueue queue )
+{
+	DeleteStateMachines( queue );
+	RefreshUpdateActive();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DeleteStateMachines
+
+  Description:  Deletes all state machines in the state machine queue without
+                touching the owner (also used by the destructor).
+
+  Arguments:    queue : the queue(s) to delete
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineManager::DeleteStateMachines( StateMachineQueue queue )
 {
 	if( queue == STATE_MACHINE_QUEUE_ALL )
 	{
-		for( int i=0; i<STATE_MACHINE_NUM_QUEUES; ++i )
+		for( int i=0; i<(int)m_numQueues; ++i )
 		{
 			while( m_stateMachineList[i].size() > 0 ) {
 				StateMachine * mch = m_stateMachineList[i].back();
 				m_stateMachineList[i].pop_back();
-				delete( mch );
+				DestroyStateMachine( mch );
 			}
+			RefreshActiveStateMachine( (StateMachineQueue)i );
 		}
 	}
-	else if( queue < STATE_MACHINE_NUM_QUEUES )
+	else if( (unsigned int)queue < m_numQueues )
 	{
 		while( m_stateMachineList[queue].size() > 0 ) {
 			StateMachine * mch = m_stateMachineList[queue].back();
 			m_stateMachineList[queue].pop_back();
-			delete( mch );
+			DestroyStateMachine( mch );
 		}
+		RefreshActiveStateMachine( queue );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         DestroyStateMachine
+
+  Description:  Deletes a state machine that has been taken off its queue,
+                or hands it back to its pool.
+
+  Arguments:    mch : the state machine
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineManager::DestroyStateMachine( StateMachine * mch )
+{
+	if( mch->GetPool() ) {
+		mch->GetPool()->Release( mch );
+	}
+	else {
+		delete( mch );
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         RefreshActiveStateMachine
+
+  Description:  Caches the top of a queue after its list has changed.
+
+  Arguments:    queue : the queue that changed
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateMachineManager::RefreshActiveStateMachine( StateMachineQueue queue )
+{
+	if( m_stateMachineList[queue].empty() )
+	{
+		m_activeStateMachine[queue] = 0;
+		m_activeQueues &= ~( 1u << queue );
+	}
+	else
+	{
+		m_activeStateMachine[queue] = m_stateMachineList[queue].back();
+		m_activeQueues |= 1u << queue;
 	}
 }
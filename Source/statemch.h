@@ -13,84 +13,158 @@
 #pragma warning(disable: 4995)
 
 #include <vector>
+#include <bitset>
+#include <intrin.h>
+
+//Declared before the includes, since the debug log records events
+enum State_Machine_Event {
+	EVENT_INVALID,
+	EVENT_Update,
+	EVENT_Message,
+	EVENT_CCMessage,
+	EVENT_Enter,
+	EVENT_Exit,
+	EVENT_Probe,
+	EVENT_Timer
+};
+
 #include "gameobject.h"
 #include "msg.h"
 #include "msgroute.h"
 #include "debuglog.h"
 #include "time.h"
+#include "memtrack.h"
 
 
-#define MAX_STATE_NAME_SIZE (64)
-#define ONE_FRAME (0.0001f)
-
-
-#define DEBUG_STATE_MACHINE_MACROS		//Comment out to get the release macros (no string state/substate names and no debug logging info)
-#ifdef DEBUG_STATE_MACHINE_MACROS
-	#define BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_1				char eventbuffer[5];
-	#define BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_2				const char statename[MAX_STATE_NAME_SIZE] = "STATE_Global"; const char substatename[MAX_STATE_NAME_SIZE] = "";
-	#define END_STATE_MACHINE_ADDITIONAL_DEBUG_1				g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, itoa(event, eventbuffer, 10), false );
-	#define DECLARE_STATE_ADDITIONAL_DEBUG_1					g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, itoa(event, eventbuffer, 10), false );
-	#define DECLARE_STATE_ADDITIONAL_DEBUG_2(name)				int DUPLICATE_DeclareState_ ## name = 0;
-	#define DECLARE_STATE_ADDITIONAL_DEBUG_3(name)				const char statename[MAX_STATE_NAME_SIZE] = #name; const char substatename[MAX_STATE_NAME_SIZE] = ""; int verifystatecontext = 0; if( EVENT_Enter == event ) { SetCurrentStateName( #name ); } if( EVENT_Probe == event ) { RegisterOnEnter( state, substate ); }
-	#define DECLARE_SUBSTATE_ADDITIONAL_DEBUG_1(name)			const char statename[MAX_STATE_NAME_SIZE] = ""; const char substatename[MAX_STATE_NAME_SIZE] = #name; int verifysubstatecontext = 0; if( EVENT_Enter == event ) { SetCurrentSubstateName( #name ); } if( EVENT_Probe == event ) { RegisterOnEnter( state, substate ); } SubstateName verifysubstatename = name;
-	#define ONMSG_ADDITIONAL_DEBUG_1(msgname)					VerifyMessageEnum( msgname ); g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, #msgname, true );
-	#define ONEITHERMSG_ADDITIONAL_DEBUG_1(msgname1, msgname2)	VerifyMessageEnum( msgname1 ); VerifyMessageEnum( msgname2 ); if( msgname1 == msg->GetName() ) { g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, #msgname1, true ); } else { g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, #msgname2, true ); }
-	#define ONBOTHMSG_ADDITIONAL_DEBUG_1(msgname1, msgname2)	if( msgname1 == msg->GetName() ) { g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, #msgname1, true ); } else { g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, #msgname2, true ); }
-	#define ONANYMSG_ADDITIONAL_DEBUG_1							g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, msg->GetName(), true );
-	#define ONANYUNHANDLEDMSGDEBUGBREAK_ADDITIONAL_DEBUG_1		return( true ); } } while( false ); do { if( EVENT_Message == event && msg ) { __debugbreak();
-	#define ONCCMSG_ADDITIONAL_DEBUG_1(msgname)					g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, #msgname, true );
-	#define ONTIMEINSTATE_ADDITIONAL_DEBUG_1					g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, "MSG_GENERIC_TIMER", true );
-	#define ONEVENT_ADDITIONAL_DEBUG_1(a)						g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, #a, true );
-	#define ONNTHUPDATE_ADDITIONAL_DEBUG_1(n)					g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, "EVENT_Update", true ); COMPILE_TIME_ASSERT( n>0, argument_must_be_greater_than_zero );
-	#define ONEVERYNTHUPDATE_ADDITIONAL_DEBUG_1(n)				g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, "EVENT_Update", true ); COMPILE_TIME_ASSERT( n>1, argument_must_be_greater_than_one );
-	#define ONEVERYODDUPDATE_ADDITIONAL_DEBUG_1					g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, statename, substatename, "EVENT_Update", true );
-	#define VERIFYSTATECONTEXT_ADDITIONAL_DEBUG_1				verifystatecontext;
-	#define VERIFYSUBSTATECONTEXT_ADDITIONAL_DEBUG_1			verifysubstatecontext;
-#else
-	#define BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_1
-	#define BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_2
-	#define END_STATE_MACHINE_ADDITIONAL_DEBUG_1
-	#define DECLARE_STATE_ADDITIONAL_DEBUG_1
-	#define DECLARE_STATE_ADDITIONAL_DEBUG_2(name)
-	#define DECLARE_STATE_ADDITIONAL_DEBUG_3(name)
-	#define DECLARE_SUBSTATE_ADDITIONAL_DEBUG_1(name)
-	#define ONMSG_ADDITIONAL_DEBUG_1(msgname)
-	#define ONEITHERMSG_ADDITIONAL_DEBUG_1(msgname1, msgname2)
-	#define ONBOTHMSG_ADDITIONAL_DEBUG_1(msgname1, msgname2)
-	#define ONANYMSG_ADDITIONAL_DEBUG_1
-	#define ONANYUNHANDLEDMSGDEBUGBREAK_ADDITIONAL_DEBUG_1
-	#define ONCCMSG_ADDITIONAL_DEBUG_1(msgname)
-	#define ONTIMEINSTATE_ADDITIONAL_DEBUG_1
-	#define ONEVENT_ADDITIONAL_DEBUG_1(a)
-	#define ONNTHUPDATE_ADDITIONAL_DEBUG_1(n)
-	#define ONEVERYNTHUPDATE_ADDITIONAL_DEBUG_1(n)
-	#define ONEVERYODDUPDATE_ADDITIONAL_DEBUG_1
-	#define VERIFYSTATECONTEXT_ADDITIONAL_DEBUG_1
-	#define VERIFYSUBSTATECONTEXT_ADDITIONAL_DEBUG_1
-#endif
+#define MAX_STATE_NAMES (64)		//State and substate enums at or above this have no debug name
+#define ONE_FRAME (NEXT_FRAME)			//Delay of the sends that go through MsgRoute's next frame queue
+#define UPDATE_RATE_PHASES (16)		//Number of evenly spaced start offsets used to stagger state machines with an update rate
+#define STATE_MACHINE_DEFAULT_NUM_QUEUES (4)	//Queues a StateMachineManager gets unless the owner asks for a different number
+
+
+//Debug names of the states and substates of one state machine class, indexed by the enums.
+//There is one table per States function (a static declared by BeginStateMachine), filled in
+//as each state or substate is probed. Since it has no constructor, it is zero initialized
+//before any code runs and is safe to use from job threads (every writer stores the same value).
+struct StateNameTable
+{
+	const char * m_stateNames[MAX_STATE_NAMES];		//String literals (0 if not seen yet)
+	const char * m_substateNames[MAX_STATE_NAMES];	//String literals (0 if not seen yet)
+
+	inline void SetStateName( int state, const char * name )			{ if( state >= 0 && state < MAX_STATE_NAMES ) { m_stateNames[state] = name; } }
+	inline void SetSubstateName( int substate, const char * name )		{ if( substate >= 0 && substate < MAX_STATE_NAMES ) { m_substateNames[substate] = name; } }
+	inline const char * GetStateName( int state ) const					{ return( state >= 0 && state < MAX_STATE_NAMES && m_stateNames[state] ? m_stateNames[state] : "" ); }
+	inline const char * GetSubstateName( int substate ) const			{ return( substate >= 0 && substate < MAX_STATE_NAMES && m_substateNames[substate] ? m_substateNames[substate] : "" ); }
+};
+
+
+class StateProbeCache;
+
+//What all the instances of one state machine class share, so each instance only keeps its own
+//context (current state, scopes, timers and variable values). There is one per States function
+//(a static declared by BeginStateMachine). Like the StateNameTable it has no constructor and is
+//zero initialized. The variable counts only grow; if two job threads race, a lost update just
+//costs a later instance one extra resize of its variable storage.
+struct StateMachineDefinition
+{
+	StateNameTable m_names;				//Debug names (only filled in for classes with STATE_MACHINE_DEBUG_TRACE)
+	int m_maxStateVariables;			//Most state variables declared by any state probed so far
+	int m_maxSubstateVariables;			//Most substate variables declared by any substate probed so far
+	StateProbeCache * m_probeCache;		//Probe results per (state, substate), created on the first state change (see stateprobecache.h)
+};
+
+
+//Debug instrumentation policies. Each state machine class picks one with DeclareDebugPolicy
+//in its class declaration (classes that don't get STATE_MACHINE_DEFAULT_DEBUG_POLICY), so hot
+//machines can run lean while the ones under investigation keep full tracing in the same build.
+//The policy is a compile-time constant of the class, so the instrumentation of a lean class
+//is dead code the compiler strips from its States().
+#define STATE_MACHINE_DEBUG_LEAN		(0)		//No state/substate names and no debug logging info
+#define STATE_MACHINE_DEBUG_TRACE		(1)		//Names are recorded and events, messages and state changes are logged (for objects with debug logging on)
+
+#define STATE_MACHINE_DEFAULT_DEBUG_POLICY (STATE_MACHINE_DEBUG_TRACE)	//Set to STATE_MACHINE_DEBUG_LEAN to make lean the default
+#define STATE_MACHINE_SWITCH_DISPATCH	//Comment out to dispatch States() with the original chain of if statements
+//#define STATE_MACHINE_PROFILING		//Uncomment to time Process, Update and state changes per state machine class, state and event (see profiler.h)
+
+//In the class declaration of a state machine (private is fine):
+//	DeclareDebugPolicy( STATE_MACHINE_DEBUG_LEAN )
+#define DeclareDebugPolicy(policy)								enum { statemachinedebugpolicy = (policy) };
+
+#define IS_STATE_MACHINE_TRACED									( statemachinedebugpolicy == STATE_MACHINE_DEBUG_TRACE )
+#define LOG_STATE_MACHINE_EVENT(eventname, handled)				if( IS_STATE_MACHINE_TRACED && m_owner->IsDebugLogged() ) { g_debuglog.LogStateMachineEvent( m_owner->GetID(), m_owner->GetName(), msg, &statenametable, state, substate, eventname, handled ); }
+#define BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_1					StateNameTable & statenametable = statemachinedefinition.m_names;
+#define BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_2
+#define END_STATE_MACHINE_ADDITIONAL_DEBUG_1					LOG_STATE_MACHINE_EVENT( event, false )
+#define DECLARE_STATE_ADDITIONAL_DEBUG_1						LOG_STATE_MACHINE_EVENT( event, false )
+#define DECLARE_STATE_ADDITIONAL_DEBUG_2(name)					int DUPLICATE_DeclareState_ ## name = 0; (void)DUPLICATE_DeclareState_ ## name;
+#define DECLARE_STATE_ADDITIONAL_DEBUG_3(name)					int verifystatecontext = 0; (void)verifystatecontext; if( IS_STATE_MACHINE_TRACED && EVENT_Probe == event ) { statenametable.SetStateName( name, #name ); RegisterOnEnter( state, substate ); }
+#define DECLARE_SUBSTATE_ADDITIONAL_DEBUG_1(name)				int verifysubstatecontext = 0; if( IS_STATE_MACHINE_TRACED && EVENT_Probe == event ) { statenametable.SetSubstateName( name, #name ); RegisterOnEnter( state, substate ); } SubstateName verifysubstatename = name; (void)verifysubstatecontext; (void)verifysubstatename;
+#define ONMSG_ADDITIONAL_DEBUG_1(msgname)						VerifyMessageEnum( msgname ); LOG_STATE_MACHINE_EVENT( #msgname, true )
+#define ONEITHERMSG_ADDITIONAL_DEBUG_1(msgname1, msgname2)		VerifyMessageEnum( msgname1 ); VerifyMessageEnum( msgname2 ); if( msgname1 == msg->GetName() ) { LOG_STATE_MACHINE_EVENT( #msgname1, true ) } else { LOG_STATE_MACHINE_EVENT( #msgname2, true ) }
+#define ONBOTHMSG_ADDITIONAL_DEBUG_1(msgname1, msgname2)		if( msgname1 == msg->GetName() ) { LOG_STATE_MACHINE_EVENT( #msgname1, true ) } else { LOG_STATE_MACHINE_EVENT( #msgname2, true ) }
+#define ONANYMSG_ADDITIONAL_DEBUG_1								LOG_STATE_MACHINE_EVENT( msg->GetName(), true )
+#define ONANYUNHANDLEDMSGDEBUGBREAK_ADDITIONAL_DEBUG_1			return( true ); } } while( false ); do { if( EVENT_Probe == event ) { if( IS_STATE_MACHINE_TRACED ) { RegisterOnAnyMsg( state, substate ); } continue; } if( IS_STATE_MACHINE_TRACED && EVENT_Message == event && msg ) { __debugbreak();
+#define ONCCMSG_ADDITIONAL_DEBUG_1(msgname)						LOG_STATE_MACHINE_EVENT( #msgname, true )
+#define ONTIMEINSTATE_ADDITIONAL_DEBUG_1						LOG_STATE_MACHINE_EVENT( "OnTimeIn", true )
+#define ONEVENT_ADDITIONAL_DEBUG_1(a)							LOG_STATE_MACHINE_EVENT( #a, true )
+#define ONNTHUPDATE_ADDITIONAL_DEBUG_1(n)						LOG_STATE_MACHINE_EVENT( "EVENT_Update", true ) COMPILE_TIME_ASSERT( n>0, argument_must_be_greater_than_zero );
+#define ONEVERYNTHUPDATE_ADDITIONAL_DEBUG_1(n)					LOG_STATE_MACHINE_EVENT( "EVENT_Update", true ) COMPILE_TIME_ASSERT( n>1, argument_must_be_greater_than_one );
+#define ONEVERYODDUPDATE_ADDITIONAL_DEBUG_1						LOG_STATE_MACHINE_EVENT( "EVENT_Update", true )
+#define VERIFYSTATECONTEXT_ADDITIONAL_DEBUG_1					(void)verifystatecontext;
+#define VERIFYSUBSTATECONTEXT_ADDITIONAL_DEBUG_1				(void)verifysubstatecontext;
 
 
 //State Machine Language Macros (put the keywords in the file USERTYPE.DAT in the same directory as MSDEV.EXE to get keyword highlighting)
-#define BeginStateMachine						StateName laststatedeclared; BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_1 if( state < 0 ) { BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_2 if( EVENT_Message == event && msg && MSG_CHANGE_STATE_DELAYED == msg->GetName() ) { ChangeState( static_cast<unsigned int>( msg->GetIntData() ) ); return( true ); } if( EVENT_Message == event && msg && MSG_CHANGE_SUBSTATE_DELAYED == msg->GetName() ) { ChangeSubstate( static_cast<unsigned int>( msg->GetIntData() ) ); return( true ); } do { if(0) {
-#define EndStateMachine							return( true ); } } while( false ); END_STATE_MACHINE_ADDITIONAL_DEBUG_1 return( false ); } ASSERTMSG( 0, "Invalid State" ); return( false );
+#ifdef STATE_MACHINE_SWITCH_DISPATCH
+	//States and substates are case labels of nested switch statements, so finding the code for the current
+	//state and substate is a jump table lookup instead of a test against every DeclareState in the file.
+	//Duplicate states or substates are caught by the compiler as duplicate case values.
+	#define BeginStateMachine						StateName laststatedeclared; (void)laststatedeclared; static StateMachineDefinition statemachinedefinition; SetDefinition( &statemachinedefinition, IS_STATE_MACHINE_TRACED ); BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_1 switch( state < 0 ? -1 : state ) { case -1: switch( -1 ) { case -1: { BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_2 int timerindexinternal = 0; (void)timerindexinternal; if( EVENT_Probe == event ) { RegisterOnMsg( -1, -1, MSG_CHANGE_STATE_DELAYED ); RegisterOnMsg( -1, -1, MSG_CHANGE_SUBSTATE_DELAYED ); } if( EVENT_Message == event && msg && MSG_CHANGE_STATE_DELAYED == msg->GetName() ) { ChangeState( static_cast<unsigned int>( msg->GetIntData() ) ); return( true ); } if( EVENT_Message == event && msg && MSG_CHANGE_SUBSTATE_DELAYED == msg->GetName() ) { ChangeSubstate( static_cast<unsigned int>( msg->GetIntData() ) ); return( true ); } do { if(0) {
+	#define EndStateMachine							return( true ); } } while( false ); END_STATE_MACHINE_ADDITIONAL_DEBUG_1 return( false ); } } break; } ASSERTMSG( 0, "Invalid State" ); return( false );
+
+	#define DeclareState(name)						return( true ); } } while( false ); DECLARE_STATE_ADDITIONAL_DEBUG_1 return( false ); } } break; case name: laststatedeclared = name; switch( substate < 0 ? -1 : substate ) { case -1: { int statevariableindexinternal = 0; int substatevariableindexinternal = 0; int timerindexinternal = 0; (void)statevariableindexinternal; (void)substatevariableindexinternal; (void)timerindexinternal; DECLARE_STATE_ADDITIONAL_DEBUG_3( name ) do { if(0) { 
+	#define DeclareSubstate(name)					return( true ); } } while( false ); return( false ); } case name: { int statevariableindexinternal = 0; int substatevariableindexinternal = 0; int timerindexinternal = 0; (void)statevariableindexinternal; (void)substatevariableindexinternal; (void)timerindexinternal; DECLARE_SUBSTATE_ADDITIONAL_DEBUG_1(name) do { if(0) { 
+#else
+	#define BeginStateMachine						StateName laststatedeclared; static StateMachineDefinition statemachinedefinition; SetDefinition( &statemachinedefinition, IS_STATE_MACHINE_TRACED ); BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_1 if( state < 0 ) { BEGIN_STATE_MACHINE_ADDITIONAL_DEBUG_2 int timerindexinternal = 0; (void)timerindexinternal; if( EVENT_Probe == event ) { RegisterOnMsg( -1, -1, MSG_CHANGE_STATE_DELAYED ); RegisterOnMsg( -1, -1, MSG_CHANGE_SUBSTATE_DELAYED ); } if( EVENT_Message == event && msg && MSG_CHANGE_STATE_DELAYED == msg->GetName() ) { ChangeState( static_cast<unsigned int>( msg->GetIntData() ) ); return( true ); } if( EVENT_Message == event && msg && MSG_CHANGE_SUBSTATE_DELAYED == msg->GetName() ) { ChangeSubstate( static_cast<unsigned int>( msg->GetIntData() ) ); return( true ); } do { if(0) {
+	#define EndStateMachine							return( true ); } } while( false ); END_STATE_MACHINE_ADDITIONAL_DEBUG_1 return( false ); } ASSERTMSG( 0, "Invalid State" ); return( false );
 
-#define DeclareState(name)						return( true ); } } while( false ); DECLARE_STATE_ADDITIONAL_DEBUG_1 return( false ); } laststatedeclared = name; DECLARE_STATE_ADDITIONAL_DEBUG_2( name ) if( name == state && substate < 0 ) { int statevariableindexinternal = 0; int substatevariableindexinternal = 0; DECLARE_STATE_ADDITIONAL_DEBUG_3( name ) do { if(0) { 
-#define DeclareSubstate(name)					return( true ); } } while( false ); return( false ); } if( laststatedeclared == state && name == substate ) { int statevariableindexinternal = 0; int substatevariableindexinternal = 0; DECLARE_SUBSTATE_ADDITIONAL_DEBUG_1(name) do { if(0) { 
+	#define DeclareState(name)						return( true ); } } while( false ); DECLARE_STATE_ADDITIONAL_DEBUG_1 return( false ); } laststatedeclared = name; DECLARE_STATE_ADDITIONAL_DEBUG_2( name ) if( name == state && substate < 0 ) { int statevariableindexinternal = 0; int substatevariableindexinternal = 0; int timerindexinternal = 0; (void)statevariableindexinternal; (void)substatevariableindexinternal; (void)timerindexinternal; DECLARE_STATE_ADDITIONAL_DEBUG_3( name ) do { if(0) { 
+	#define DeclareSubstate(name)					return( true ); } } while( false ); return( false ); } if( laststatedeclared == state && name == substate ) { int statevariableindexinternal = 0; int substatevariableindexinternal = 0; int timerindexinternal = 0; (void)statevariableindexinternal; (void)substatevariableindexinternal; (void)timerindexinternal; DECLARE_SUBSTATE_ADDITIONAL_DEBUG_1(name) do { if(0) { 
+#endif
 
-#define OnMsg(msgname)							return( true ); } } while( false ); do { if( EVENT_Message == event && msg && msgname == msg->GetName() ) { ONMSG_ADDITIONAL_DEBUG_1( msgname )
-#define OnEitherMsg(msgname1, msgname2)			return( true ); } } while( false ); do { if( EVENT_Message == event && msg && (msgname1 == msg->GetName() || msgname2 == msg->GetName()) ) { ONEITHERMSG_ADDITIONAL_DEBUG_1( msgname1, msgname2 )
-#define OnBothMsg(msgname1, msgname2)			return( true ); } } while( false ); int variableindexinternal__ ## msgname1 ## msgname2; StateVariableScope onbothmsgvariablescope__ ## msgname1 ## msgname2; if( substate < 0 ) { variableindexinternal__ ## msgname1 ## msgname2 = statevariableindexinternal++; onbothmsgvariablescope__ ## msgname1 ## msgname2 = STATE_VARIABLE_SCOPE; } else { variableindexinternal__ ## msgname1 ## msgname2 = substatevariableindexinternal++; onbothmsgvariablescope__ ## msgname1 ## msgname2 = SUBSTATE_VARIABLE_SCOPE; } StateVariableInt msgname1 ## msgname2( variableindexinternal__ ## msgname1 ## msgname2, this, onbothmsgvariablescope__ ## msgname1 ## msgname2, EVENT_Probe == event ); do { if( EVENT_Message == event && msg ) { if( msgname1 == msg->GetName() ) { msgname1 ## msgname2 |= 0x01; } if( msgname2 == msg->GetName() ) { msgname1 ## msgname2 |= 0x10; } if( msgname1 ## msgname2 != 0x11 ) { continue; } msgname1 ## msgname2 = 0; VerifyMessageEnum( msgname1 ); VerifyMessageEnum( msgname2 ); ONBOTHMSG_ADDITIONAL_DEBUG_1( msgname1, msgname2 )
-#define OnAnyMsg								return( true ); } } while( false ); do { if( EVENT_Message == event && msg ) { ONANYMSG_ADDITIONAL_DEBUG_1
+#define OnMsg(msgname)							return( true ); } } while( false ); do { if( EVENT_Probe == event ) { RegisterOnMsg( state, substate, msgname ); continue; } if( EVENT_Message == event && msg && msgname == msg->GetName() ) { ONMSG_ADDITIONAL_DEBUG_1( msgname )
+#define OnEitherMsg(msgname1, msgname2)			return( true ); } } while( false ); do { if( EVENT_Probe == event ) { RegisterOnMsg( state, substate, msgname1 ); RegisterOnMsg( state, substate, msgname2 ); continue; } if( EVENT_Message == event && msg && (msgname1 == msg->GetName() || msgname2 == msg->GetName()) ) { ONEITHERMSG_ADDITIONAL_DEBUG_1( msgname1, msgname2 )
+#define OnBothMsg(msgname1, msgname2)			return( true ); } } while( false ); int variableindexinternal__ ## msgname1 ## msgname2; StateVariableScope onbothmsgvariablescope__ ## msgname1 ## msgname2; if( substate < 0 ) { variableindexinternal__ ## msgname1 ## msgname2 = statevariableindexinternal++; onbothmsgvariablescope__ ## msgname1 ## msgname2 = STATE_VARIABLE_SCOPE; } else { variableindexinternal__ ## msgname1 ## msgname2 = substatevariableindexinternal++; onbothmsgvariablescope__ ## msgname1 ## msgname2 = SUBSTATE_VARIABLE_SCOPE; } StateVariableInt msgname1 ## msgname2( variableindexinternal__ ## msgname1 ## msgname2, this, onbothmsgvariablescope__ ## msgname1 ## msgname2, EVENT_Probe == event ); do { if( EVENT_Probe == event ) { RegisterOnMsg( state, substate, msgname1 ); RegisterOnMsg( state, substate, msgname2 ); continue; } if( EVENT_Message == event && msg ) { if( msgname1 == msg->GetName() ) { msgname1 ## msgname2 |= 0x01; } if( msgname2 == msg->GetName() ) { msgname1 ## msgname2 |= 0x10; } if( msgname1 ## msgname2 != 0x11 ) { continue; } msgname1 ## msgname2 = 0; VerifyMessageEnum( msgname1 ); VerifyMessageEnum( msgname2 ); ONBOTHMSG_ADDITIONAL_DEBUG_1( msgname1, msgname2 )
+#define OnAnyMsg								return( true ); } } while( false ); do { if( EVENT_Probe == event ) { RegisterOnAnyMsg( state, substate ); continue; } if( EVENT_Message == event && msg ) { ONANYMSG_ADDITIONAL_DEBUG_1
 #define OnAnyUnhandledMsgDebugBreak				ONANYUNHANDLEDMSGDEBUGBREAK_ADDITIONAL_DEBUG_1
 #define OnCCMsg(msgname)						return( true ); } } while( false ); do { if( EVENT_CCMessage == event && msg && msgname == msg->GetName() ) { ONCCMSG_ADDITIONAL_DEBUG_1( msgname )
 
-#define ONTIME_INTERNAL_HELPER(f, s)			return( true ); } } while( false ); do { if( EVENT_Probe == event ) { f( s, MSG_GENERIC_TIMER, MSG_Data( __LINE__ ) ); continue; } if( EVENT_Message == event && msg && MSG_GENERIC_TIMER == msg->GetName() && msg->GetIntData() == __LINE__ ) { ONTIMEINSTATE_ADDITIONAL_DEBUG_1
-#define OnTimeInSubstate(s)						ONTIME_INTERNAL_HELPER( SendMsgDelayedToSubstate, s )
-#define OnTimeInState(s)						ONTIME_INTERNAL_HELPER( SendMsgDelayedToState, s )
-
-#define ONPERIODIC_INTERNAL_HELPER(f, s)		return( true ); } } while( false ); do { if( EVENT_Probe == event ) { f( s, MSG_GENERIC_TIMER, MSG_Data( __LINE__ ) ); continue; } if( EVENT_Message == event && msg && MSG_GENERIC_TIMER == msg->GetName() && msg->GetIntData() == __LINE__ ) { f( s, MSG_GENERIC_TIMER, MSG_Data( __LINE__ ) ); ONTIMEINSTATE_ADDITIONAL_DEBUG_1
-#define OnPeriodicTimeInSubstate(s)				ONPERIODIC_INTERNAL_HELPER( SendMsgDelayedToSubstate, s )
-#define OnPeriodicTimeInState(s)				ONPERIODIC_INTERNAL_HELPER( SendMsgDelayedToState, s )
+//Timed handlers are numbered in order within their scope. Entering the scope arms a deadline slot
+//per handler in the state machine, and MsgRoute wakes the state machine when the earliest one is
+//due, which then runs the handler by its number (EVENT_Timer). Leaving the scope (the substate for
+//the Substate versions) clears the slots.
+#define ONTIME_INTERNAL_HELPER(r, p, s)			return( true ); } } while( false ); timerindexinternal++; do { if( EVENT_Probe == event ) { RegisterTimer(); ArmTimer( state, substate, timerindexinternal - 1, s, r, p ); continue; } if( EVENT_Timer == event && IsTimerFiring( timerindexinternal - 1 ) ) { ONTIMEINSTATE_ADDITIONAL_DEBUG_1
+#define OnTimeInSubstate(s)						ONTIME_INTERNAL_HELPER( SCOPE_TO_SUBSTATE, false, s )
+#define OnTimeInState(s)						ONTIME_INTERNAL_HELPER( SCOPE_TO_STATE, false, s )
+#define OnPeriodicTimeInSubstate(s)				ONTIME_INTERNAL_HELPER( SCOPE_TO_SUBSTATE, true, s )
+#define OnPeriodicTimeInState(s)				ONTIME_INTERNAL_HELPER( SCOPE_TO_STATE, true, s )
+
+//Coroutine handler - the body starts when the scope is entered and can wait in the middle of the code:
+//	OnCoroutine
+//		PlayAnimation();
+//		CoWaitSeconds( 2.0f );
+//		SendMsg( MSG_Arrived, target );
+//		CoWaitMsg( MSG_Tagged );		//msg is the MSG_Tagged message after this line
+//		ChangeState( STATE_Idle );
+//	EndCoroutine
+//The resume point is a variable of the scope and a timed wait is a message scoped to the state or
+//substate, so leaving the scope cancels the coroutine. It is stackless: locals don't survive a
+//wait (declare state variables instead) and can't be declared across one outside of braces.
+//One per scope, declared before any OnEnter of the scope. The scope is sent every message.
+#define OnCoroutine								return( true ); } } while( false ); StateVariableInt coroutineline( substate < 0 ? statevariableindexinternal++ : substatevariableindexinternal++, this, substate < 0 ? STATE_VARIABLE_SCOPE : SUBSTATE_VARIABLE_SCOPE, EVENT_Probe == event ); StateVariableInt coroutinemsg( substate < 0 ? statevariableindexinternal++ : substatevariableindexinternal++, this, substate < 0 ? STATE_VARIABLE_SCOPE : SUBSTATE_VARIABLE_SCOPE, EVENT_Probe == event ); do { if( EVENT_Probe == event ) { RegisterOnEnter( state, substate ); RegisterOnAnyMsg( state, substate ); continue; } if( IsCoroutineEvent( event, msg, coroutineline, coroutinemsg ) ) { coroutinemsg = MSG_NULL; switch( coroutineline ) { case 0:
+#define CoWaitSeconds(s)						coroutineline = __LINE__; CoroutineWait( s, __LINE__, substate ); if( EVENT_Enter == event ) { continue; } return( true ); case __LINE__:
+#define CoWaitMsg(msgname)						coroutineline = __LINE__; coroutinemsg = msgname; if( EVENT_Enter == event ) { continue; } return( true ); case __LINE__:
+#define EndCoroutine							coroutineline = -1; } if( EVENT_Enter == event ) { continue; }
 
 #define ONEVENT_INTERNAL_HELPER(a, f)			return( true ); } } while( false ); do { if( EVENT_Probe == event ) { f( state, substate ); continue; } if( a == event ) { ONEVENT_ADDITIONAL_DEBUG_1( a )
 #define OnUpdate								ONEVENT_INTERNAL_HELPER( EVENT_Update, RegisterOnUpdate )
@@ -134,16 +208,6 @@
 #define WATCHPOINT_ID(id)					if( m_owner->GetID() == id ) { __debugbreak(); }
 #define WATCHPOINT_NAME(name)				if( strcmp(name, m_owner->GetName() ) == 0 ) { __debugbreak(); }
 
-enum State_Machine_Event {
-	EVENT_INVALID,
-	EVENT_Update,
-	EVENT_Message,
-	EVENT_CCMessage,
-	EVENT_Enter,
-	EVENT_Exit,
-	EVENT_Probe
-};
-
 #define REGISTERED_EVENT_NULL					(0)
 #define REGISTERED_EVENT_ENTER_SUBSTATE			(1<<1)
 #define REGISTERED_EVENT_ENTER_STATE			(1<<2)
@@ -162,12 +226,26 @@ enum State_Machine_Event {
 #define REGISTERED_EVENT_STATEMACHINE			(REGISTERED_EVENT_ENTER_STATEMACHINE | REGISTERED_EVENT_EXIT_STATEMACHINE | REGISTERED_EVENT_UPDATE_STATEMACHINE | REGISTERED_EVENT_MESSAGE_STATEMACHINE)
 #define REGISTERED_EVENT_UPDATE					(REGISTERED_EVENT_UPDATE_SUBSTATE | REGISTERED_EVENT_UPDATE_STATE | REGISTERED_EVENT_UPDATE_STATEMACHINE)
 
+typedef std::bitset<MSG_NUM> MsgNameSet;	//One bit per message name (used to record which messages a scope handles)
+
 enum StateMachineQueue {
 	STATE_MACHINE_QUEUE_0,
 	STATE_MACHINE_QUEUE_1,
 	STATE_MACHINE_QUEUE_2,
 	STATE_MACHINE_QUEUE_3,
-	STATE_MACHINE_NUM_QUEUES,
+	STATE_MACHINE_QUEUE_4,
+	STATE_MACHINE_QUEUE_5,
+	STATE_MACHINE_QUEUE_6,
+	STATE_MACHINE_QUEUE_7,
+	STATE_MACHINE_QUEUE_8,
+	STATE_MACHINE_QUEUE_9,
+	STATE_MACHINE_QUEUE_10,
+	STATE_MACHINE_QUEUE_11,
+	STATE_MACHINE_QUEUE_12,
+	STATE_MACHINE_QUEUE_13,
+	STATE_MACHINE_QUEUE_14,
+	STATE_MACHINE_QUEUE_15,
+	STATE_MACHINE_MAX_QUEUES,
 	STATE_MACHINE_QUEUE_ALL,
 	STATE_MACHINE_QUEUE_NULL
 };
@@ -179,7 +257,8 @@ enum StateMachineChange {
 	STATE_MACHINE_QUEUE,
 	STATE_MACHINE_REQUEUE,
 	STATE_MACHINE_PUSH,
-	STATE_MACHINE_POP
+	STATE_MACHINE_POP,
+	STATE_MACHINE_INITIALIZE		//Pushed lazily - initialized on the first update or event
 };
 
 enum StateVariableScope {
@@ -187,6 +266,8 @@ enum StateVariableScope {
 	SUBSTATE_VARIABLE_SCOPE
 };
 
+#define STATE_MACHINE_MAX_VARIABLES 32		//Per scope (state variables and substate variables)
+
 union StateMachine_Data_Union
 {
 	int intValue;
@@ -194,13 +275,15 @@ union StateMachine_Data_Union
 	bool boolValue;
 	objectID objectIDValue;
 	void* pointerValue;
-	D3DXVECTOR2* vector2Value;
-	D3DXVECTOR3* vector3Value;
+	Vector2* vector2Value;
+	Vector3* vector3Value;
 };
 
 class StateMachinePersistentData
 {
 public:
+	DeclareMemoryTag( MEMORY_TAG_STATE_VARIABLES )
+
 	StateMachinePersistentData( void )				{ m_data.intValue = 0; }
 	~StateMachinePersistentData( void )				{}
 
@@ -209,16 +292,25 @@ public:
 	inline void SetBool( bool value )				{ m_data.boolValue = value; }
 	inline void SetObjectID( objectID value )		{ m_data.objectIDValue = value; }
 	inline void SetPointer( void* value )			{ m_data.pointerValue = value; }
-	inline void SetVector2( D3DXVECTOR2* value )	{ m_data.vector2Value = value; }
-	inline void SetVector3( D3DXVECTOR3* value )	{ m_data.vector3Value = value; }
+	inline void SetVector2( Vector2* value )	{ m_data.vector2Value = value; }
+	inline void SetVector3( Vector3* value )	{ m_data.vector3Value = value; }
 
 	inline int GetInt( void )						{ return m_data.intValue; }
 	inline float GetFloat( void )					{ return m_data.floatValue; }
 	inline bool GetBool( void )						{ return m_data.boolValue; }
 	inline objectID GetObjectID( void )				{ return m_data.objectIDValue; }
 	inline void* GetPointer( void )					{ return m_data.pointerValue; }
-	inline D3DXVECTOR2* GetVector2( void )			{ return m_data.vector2Value; }
-	inline D3DXVECTOR3* GetVector3( void )			{ return m_data.vector3Value; }
+	inline Vector2* GetVector2( void )			{ return m_data.vector2Value; }
+	inline Vector3* GetVector3( void )			{ return m_data.vector3Value; }
+
+	//References straight into the storage (used by the StateVariable proxies)
+	inline int & RefInt( void )						{ return m_data.intValue; }
+	inline float & RefFloat( void )					{ return m_data.floatValue; }
+	inline bool & RefBool( void )					{ return m_data.boolValue; }
+	inline objectID & RefObjectID( void )			{ return m_data.objectIDValue; }
+	inline void* & RefPointer( void )				{ return m_data.pointerValue; }
+	inline Vector2* & RefVector2( void )		{ return m_data.vector2Value; }
+	inline Vector3* & RefVector3( void )		{ return m_data.vector3Value; }
 
 private:
 	StateMachine_Data_Union m_data;
@@ -226,38 +318,92 @@ private:
 };
 
 
+#define MAX_STATE_STACK_SIZE 10		//Past states remembered for PopState
+#define STATE_MACHINE_MAX_TIMERS 8	//OnTimeIn... handlers armed at once (global, state and substate together)
+
+//Stack of past states (used for PopState), kept in a ring buffer inside the
+//state machine so state changes never allocate. Once full, pushing a state
+//drops the oldest one.
+class StateStack
+{
+public:
+	StateStack( void ) : m_top( 0 ), m_size( 0 )	{}
+
+	inline void Clear( void )						{ m_top = 0; m_size = 0; }
+	inline bool IsEmpty( void )						{ return( m_size == 0 ); }
+	inline unsigned int GetSize( void )				{ return( m_size ); }
+
+	inline void Push( unsigned int state )			{ m_states[m_top] = state; m_top = ( m_top + 1 ) % MAX_STATE_STACK_SIZE; if( m_size < MAX_STATE_STACK_SIZE ) { m_size++; } }
+	inline unsigned int Pop( void )					{ ASSERTMSG( m_size > 0, "StateStack::Pop - stack is empty" ); m_top = ( m_top + MAX_STATE_STACK_SIZE - 1 ) % MAX_STATE_STACK_SIZE; m_size--; return( m_states[m_top] ); }
+
+private:
+	unsigned int m_states[MAX_STATE_STACK_SIZE];
+	unsigned int m_top;								//Slot the next push goes into
+	unsigned int m_size;
+};
+
+
 //Forward declarations
 class StateMachineManager;
+class StateMachinePoolBase;
+class SnapshotWriter;
+class SnapshotReader;
 
 
 class StateMachine
 {
 public:
 
+	DeclareMemoryTag( MEMORY_TAG_STATE_MACHINE )
+
 	StateMachine( GameObject & object );
 	virtual ~StateMachine( void );
 
-	void SetStateMachineQueue( StateMachineQueue queue )	{ ASSERTMSG( queue < STATE_MACHINE_NUM_QUEUES, "StateMachine::SetQueue - invalid queue" ); m_queue = queue; }
+	void SetStateMachineQueue( StateMachineQueue queue );
 
 	//Should only be called by GameObject
-	void Update( void );
+	void Update( const FrameContext & frame );
 	void Reset( void );
 
-	//Only to be used by msgroute!
-	void SetTimerExternal( float delay, MSG_Name name, Scope_Rule rule );
+	//Should only be called by StateMachinePool (see statemchpool.h)
+	void Recycle( GameObject & object );
+	inline void SetPool( StateMachinePoolBase * pool )	{ m_pool = pool; }
+	inline StateMachinePoolBase * GetPool( void )		{ return( m_pool ); }
+
+	//Should only be called by StateMachineManager (see snapshot.h)
+	void Save( SnapshotWriter & writer );
+	void Restore( SnapshotReader & reader );
+
+	//Should only be called by MsgRoute, when the wake-up scheduled for this state machine is due
+	//(runs the OnTimeIn... handlers that are due)
+	void FireTimers( double wakeTime );
+
+	//Update LOD - EVENT_Update is only sent every Nth frame or at a fixed rate (defaults to every frame).
+	//State machines with the same setting are staggered so they don't all update on the same frame.
+	void SetUpdateEveryNthFrame( unsigned int frames );
+	void SetUpdateRate( float hz );
+	inline void SetUpdateEveryFrame( void )				{ SetUpdateEveryNthFrame( 1 ); }
+
+	//Whether the state machine has an OnUpdate in its current state, substate or global state
+	inline bool IsUpdateRegistered( void )				{ return( ( m_registeredEvents & REGISTERED_EVENT_UPDATE ) != 0 ); }
 
 	//Access state and scope
 	inline int GetState( void )							{ return( (int)m_currentState ); }
 	inline int GetSubstate( void )						{ return( m_currentSubstate ); }
 	inline unsigned int GetScopeState( void )			{ return( m_scopeState ); }
 	inline unsigned int GetScopeSubstate( void )		{ return( m_scopeSubstate ); }
+	inline unsigned int GetScopeStateMachine( void )	{ return( m_scopeStateMachine ); }	//Kept until the state machine is reset or replaced
+	inline double GetTimeEnteredState( void )			{ return( m_timeOnEnterState ); }
 	
 	//Main state machine code stored in here
 	void Process( State_Machine_Event event, MSG_Object * msg );
 
-	//Debug info
-	inline char * GetCurrentStateNameString( void )		{ return( m_currentStateNameString ); }
-	inline char * GetCurrentSubstateNameString( void )	{ return( m_currentSubstateNameString ); }
+	//Debug info (names are only known for classes with STATE_MACHINE_DEBUG_TRACE, see DeclareDebugPolicy)
+	inline bool IsTraced( void )								{ return( m_traced ); }
+	inline const char * GetCurrentStateNameString( void )		{ return( m_definition ? m_definition->m_names.GetStateName( (int)m_currentState ) : "" ); }
+	inline const char * GetCurrentSubstateNameString( void )	{ return( m_definition ? m_definition->m_names.GetSubstateName( m_currentSubstate ) : "" ); }
+	inline const StateNameTable * GetStateNameTable( void )		{ return( m_definition ? &m_definition->m_names : 0 ); }
+	inline const StateMachineDefinition * GetDefinition( void )	{ return( m_definition ); }
 
 	//Used for state variables (internal only - don't call directly from state machine)
 	void SetStateVariableInt( int value, int id, StateVariableScope scope );
@@ -265,8 +411,8 @@ public:
 	void SetStateVariableBool( bool value, int id, StateVariableScope scope );
 	void SetStateVariableObjectID( objectID value, int id, StateVariableScope scope );
 	void SetStateVariablePointer( void* value, int id, StateVariableScope scope );
-	void SetStateVariableVector2( D3DXVECTOR2* value, int id, StateVariableScope scope );
-	void SetStateVariableVector3( D3DXVECTOR3* value, int id, StateVariableScope scope );
+	void SetStateVariableVector2( Vector2* value, int id, StateVariableScope scope );
+	void SetStateVariableVector3( Vector3* value, int id, StateVariableScope scope );
 
 	//Used for state variables (internal only - don't call directly from state machine)
 	int GetStateVariableInt( int id, StateVariableScope scope );
@@ -274,9 +420,10 @@ public:
 	bool GetStateVariableBool( int id, StateVariableScope scope );
 	objectID GetStateVariableObjectID( int id, StateVariableScope scope );
 	void* GetStateVariablePointer( int id, StateVariableScope scope );
-	D3DXVECTOR2* GetStateVariableVector2( int id, StateVariableScope scope );
-	D3DXVECTOR3* GetStateVariableVector3( int id, StateVariableScope scope );
+	Vector2* GetStateVariableVector2( int id, StateVariableScope scope );
+	Vector3* GetStateVariableVector3( int id, StateVariableScope scope );
 	void DeclareVariable( int id, StateVariableScope scope );
+	StateMachinePersistentData & BindStateVariable( int id, StateVariableScope scope, bool init );
 
 
 protected:
@@ -341,12 +488,27 @@ protected:
 	void SendMsgBroadcastToList( MSG_Name name, MSG_Data& data = MSG_Data() );
 	//Send broadcast message immediately to every agent on the list (with optional data)
 	void SendMsgBroadcastToListNow( MSG_Name name, MSG_Data& data = MSG_Data() );
+	//Send broadcast message immediately to every agent of a particular type within a radius of a point (with optional data)
+	void SendMsgBroadcastInRadiusNow( MSG_Name name, const Vector3& center, float radius, unsigned int type, MSG_Data& data = MSG_Data() );
+	//Send broadcast message next frame to every agent of a particular type within a radius of a point (with optional data)
+	//Note: All of these are delivered together, to the agents in the area next frame
+	void SendMsgBroadcastInRadius( MSG_Name name, const Vector3& center, float radius, unsigned int type, MSG_Data& data = MSG_Data() );
 
 
 	//Broadcast List
 	void BroadcastClearList( void );
 	void BroadcastAddToList( objectID id );
 
+	//Topics (see MsgRoute::Publish) - the subscription ends by itself when its scope is left
+	void SubscribeSubstate( MsgTopic topic );
+	void SubscribeState( MsgTopic topic );
+	void SubscribeStateMachine( MsgTopic topic );
+	void Unsubscribe( MsgTopic topic );
+	//Send message next frame to every state machine subscribed to the topic (with optional data)
+	void SendMsgToTopic( MSG_Name name, MsgTopic topic, MSG_Data& data = MSG_Data() );
+	//Send message immediately to every state machine subscribed to the topic (with optional data)
+	void SendMsgToTopicNow( MSG_Name name, MsgTopic topic, MSG_Data& data = MSG_Data() );
+
 	//CCing other objects
 	inline void SetCCReceiver( objectID id )			{ m_ccMessagesToGameObject = id; }
 	inline void ClearCCReceiver( void )					{ m_ccMessagesToGameObject = 0; }
@@ -357,6 +519,15 @@ protected:
 	void SetTimerState( float delay, MSG_Name name );			//Timer will be destroyed if current state is exited
 	void SetTimerStateMachine( float delay, MSG_Name name );	//Timer will be destroyed if current state machine is exited
 	void StopTimer( MSG_Name name );
+	void SetTimerHelper( float delay, MSG_Name name, Scope_Rule rule, MSG_Data& data );
+
+	//Deadline slots of the OnTimeIn... handlers (used by the macros)
+	void ArmTimer( int state, int substate, int index, float delay, Scope_Rule rule, bool periodic );
+	inline bool IsTimerFiring( int index )						{ return( index == m_firingTimer ); }
+
+	//Coroutines (used by the OnCoroutine macros)
+	bool IsCoroutineEvent( State_Machine_Event event, MSG_Object * msg, int line, int awaitedMsg );
+	void CoroutineWait( float delay, int line, int substate );
 	
 	//Change State
 	void PopState( void );
@@ -382,8 +553,9 @@ protected:
 	void MarkForDeletion( void )						{ m_owner->MarkForDeletion(); }
 
 	//Helper functions
-	inline float GetTimeInState( void )					{ return( g_time.GetCurTime() - m_timeOnEnterState ); }
-	inline float GetTimeInSubstate( void )				{ return( g_time.GetCurTime() - m_timeOnEnterSubstate ); }
+	inline float GetTimeInState( void )					{ return( (float)( g_frame.m_time - m_timeOnEnterState ) ); }
+	inline float GetTimeInSubstate( void )				{ return( (float)( g_frame.m_time - m_timeOnEnterSubstate ) ); }
+	inline float GetTimeSinceLastUpdate( void )			{ return( (float)( g_frame.m_time - m_timeLastUpdate ) ); }
 	inline bool IsChangeStateDelayedQueued( void )		{ return( m_delayedStateChangeQueued ); }
 	inline bool IsChangeSubstateDelayedQueued( void )	{ return( m_delayedSubstateChangeQueued ); }
 	inline bool IsUpdateIteration( int i )				{ ASSERTMSG( i > 0, "StateMachine::OnNthUpdate - Argument must be > 0."); return( i == m_updateIteration ); }
@@ -403,23 +575,29 @@ protected:
 	inline void RegisterOnUpdateSubstate( void )				{ m_registeredEvents |= REGISTERED_EVENT_UPDATE_SUBSTATE; }
 	inline void RegisterOnUpdateState( void )					{ m_registeredEvents |= REGISTERED_EVENT_UPDATE_STATE; }
 	inline void RegisterOnUpdateStateMachine( void )			{ m_registeredEvents |= REGISTERED_EVENT_UPDATE_STATEMACHINE; }
-	inline void RegisterOnMsg( int state, int substate )		{ if( state >= 0 ) { if( substate < 0 ) { RegisterOnMsgState(); } else { RegisterOnMsgSubstate(); } } else { RegisterOnMsgStateMachine(); } }
-	inline void RegisterOnMsgSubstate( void )					{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_SUBSTATE; }
-	inline void RegisterOnMsgState( void )						{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_STATE; }
-	inline void RegisterOnMsgStateMachine( void )				{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_STATEMACHINE; }
+	inline void RegisterOnMsg( int state, int substate, MSG_Name name )	{ if( state >= 0 ) { if( substate < 0 ) { RegisterOnMsgState( name ); } else { RegisterOnMsgSubstate( name ); } } else { RegisterOnMsgStateMachine( name ); } }
+	inline void RegisterOnMsgSubstate( MSG_Name name )			{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_SUBSTATE; m_registeredMsgsSubstate.set( name ); }
+	inline void RegisterOnMsgState( MSG_Name name )				{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_STATE; m_registeredMsgsState.set( name ); }
+	inline void RegisterOnMsgStateMachine( MSG_Name name )		{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_STATEMACHINE; m_registeredMsgsStateMachine.set( name ); }
+	inline void RegisterOnAnyMsg( int state, int substate )		{ if( state >= 0 ) { if( substate < 0 ) { RegisterOnAnyMsgState(); } else { RegisterOnAnyMsgSubstate(); } } else { RegisterOnAnyMsgStateMachine(); } }
+	inline void RegisterOnAnyMsgSubstate( void )				{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_SUBSTATE; m_registeredMsgsSubstate.set(); }
+	inline void RegisterOnAnyMsgState( void )					{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_STATE; m_registeredMsgsState.set(); }
+	inline void RegisterOnAnyMsgStateMachine( void )			{ m_registeredEvents |= REGISTERED_EVENT_MESSAGE_STATEMACHINE; m_registeredMsgsStateMachine.set(); }
+	inline void RegisterTimer( void )							{ m_probeArmedTimer = true; }
 
 	//Used to verify proper message enums
 	inline void VerifyMessageEnum( MSG_Name name ) {}
 
-	//Used for debug to capture current state/substate name string
-	inline void SetCurrentStateName( char * state )				{ strcpy( m_currentStateNameString, state ); m_currentSubstateNameString[0] = 0; }
-	inline void SetCurrentSubstateName( char * substate )		{ strcpy( m_currentSubstateNameString, substate ); }
+	//Used to find the shared definition of this state machine class (and its debug policy)
+	inline void SetDefinition( StateMachineDefinition * definition, bool traced )	{ m_definition = definition; m_traced = traced; }
+
+	//Debug policy of classes that don't declare their own (see DeclareDebugPolicy)
+	enum { statemachinedebugpolicy = STATE_MACHINE_DEFAULT_DEBUG_POLICY };
 
 
 private:
 
-	typedef std::vector<objectID> BroadcastListContainer;	//Container to hold game objects to broadcast to
-	typedef std::list<unsigned int> StateListContainer;		//Container to hold past states
+	typedef std::vector<objectID, MemoryTagAllocator<objectID, MEMORY_TAG_STATE_MACHINE> > BroadcastListContainer;	//Container to hold game objects to broadcast to
 
 	enum State_Change {							//Possible state change requests
 		NO_STATE_CHANGE,						//No change pending
@@ -429,6 +607,7 @@ private:
 
 	unsigned int m_scopeState;					//The current scope of the state
 	unsigned int m_scopeSubstate;				//The current scope of the substate
+	unsigned int m_scopeStateMachine;			//The scope of the state machine (since its last reset)
 	unsigned int m_currentState;				//Current state
 	unsigned int m_nextState;					//Next state to switch to
 	int m_updateIteration;						//The update iteration within this substate
@@ -438,29 +617,98 @@ private:
 	bool m_delayedStateChangeQueued;			//If a delayed state change was queued
 	bool m_delayedSubstateChangeQueued;			//If a delayed state change was queued
 	State_Change m_stateChange;					//If a state change is pending
-	float m_timeOnEnterState;					//Time since state was entered
-	float m_timeOnEnterSubstate;				//Time since substate was entered
+	double m_timeOnEnterState;					//Time since state was entered
+	double m_timeOnEnterSubstate;				//Time since substate was entered
+	double m_timeLastUpdate;						//Time of the last EVENT_Update
+	unsigned int m_updateFrames;				//Update every Nth frame (1 is every frame)
+	unsigned int m_updatePhase;					//Frame offset within m_updateFrames
+	float m_updateInterval;						//Seconds between updates (0 if updating by frames)
+	double m_nextUpdateTime;						//Time of the next update (if updating at a rate)
 	unsigned int m_registeredEvents;			//Whether particular events are registered
+	MsgNameSet m_registeredMsgsSubstate;		//Messages handled by the current substate
+	MsgNameSet m_registeredMsgsState;			//Messages handled by the current state
+	MsgNameSet m_registeredMsgsStateMachine;	//Messages handled by the global state
+	bool m_probeArmedTimer;						//The last probe armed a timer (so its result can't simply be replayed)
+
+	//Deadline slots of the armed OnTimeIn... handlers
+	struct TimerSlot
+	{
+		double m_time;							//When the handler is due
+		float m_period;							//Seconds between runs (0 if it runs once)
+		unsigned char m_index;					//Handler number within its scope
+		unsigned char m_scope;					//Scope that declared the handler (TIMER_SCOPE_...)
+		bool m_substateScoped;					//Cleared on substate changes too
+	};
+	enum {
+		TIMER_SCOPE_STATEMACHINE,
+		TIMER_SCOPE_STATE,
+		TIMER_SCOPE_SUBSTATE
+	};
+	TimerSlot m_timers[STATE_MACHINE_MAX_TIMERS];
+	int m_numTimers;
+	double m_wakeTime;							//Wake-up scheduled with MsgRoute (0 if none)
+	int m_firingTimer;							//Handler number being run by EVENT_Timer (-1 if none)
 	objectID m_ccMessagesToGameObject;			//A GameObject to CC messages to
 	BroadcastListContainer m_broadcastList;		//List of GameObjects to broadcast to
-	StateListContainer m_stack;					//Stack of past states (used for PopState)
-
-	std::vector<StateMachinePersistentData*> m_stateVariables;		//Container of state variables
-	std::vector<StateMachinePersistentData*> m_substateVariables;	//Container of substate variables
-
-	//Debug info
-	char m_currentStateNameString[MAX_STATE_NAME_SIZE];		//Current state name string
-	char m_currentSubstateNameString[MAX_STATE_NAME_SIZE];	//Current substate name string
+	StateStack m_stack;							//Stack of past states (used for PopState)
+
+	//One block holds the state variables and then the substate variables. It is sized from the
+	//class definition, so it only grows while the first instances probe their states. StateVariable
+	//proxies point into it, so it is only grown between handlers: before the first handler runs
+	//(to the size the class needs so far) and after a probe (declarations made while probing bind
+	//to a scratch slot). A nested state change can still enter a state the class has never
+	//probed while a handler is running; then the old block is kept until the handler returns.
+	StateMachinePersistentData * m_stateVariables;
+	StateMachinePersistentData * m_substateVariables;
+	int m_numStateVariables;
+	int m_numSubstateVariables;
+	int m_stateVariableCapacity;
+	int m_substateVariableCapacity;
+	int m_handlerDepth;							//Handlers of this state machine running (nested by immediate messages)
+	bool m_probing;								//Variables declared by the probe in progress are counted, not stored
+	int m_probeStateVariables;					//Variables the probe in progress declared
+	int m_probeSubstateVariables;
+	StateMachinePersistentData m_probeScratch;	//What the proxies of the probe in progress bind to
+	std::vector<StateMachinePersistentData*> m_retiredVariables;	//Blocks replaced while a handler was running
+
+	StateMachineDefinition * m_definition;		//Shared definition of this state machine class (0 until States first runs)
+	bool m_traced;								//The class has STATE_MACHINE_DEBUG_TRACE (known once States first runs)
+
+	StateMachinePoolBase * m_pool;				//Pool this state machine goes back to (0 if it is deleted)
 
 	void Initialize( void );
+	void ReserveVariables( int numStateVariables, int numSubstateVariables );
+	void ReserveClassVariables( void );
+	void FreeRetiredVariables( void );
 	virtual bool States( State_Machine_Event event, MSG_Object * msg, int state, int substate ) = 0;
-	void PerformStateChanges( void );
-	void SendCCMsg( MSG_Name name, objectID receiver, MSG_Data& data );
+
+	//Every call to States except the probe (see m_stateVariables)
+	inline bool RunHandlers( State_Machine_Event event, MSG_Object * msg, int state, int substate )
+	{
+		if( m_handlerDepth++ == 0 && m_definition && ( m_stateVariableCapacity < m_definition->m_maxStateVariables || m_substateVariableCapacity < m_definition->m_maxSubstateVariables ) ) {
+			ReserveClassVariables();
+		}
+		bool handled = States( event, msg, state, substate );
+		if( --m_handlerDepth == 0 && !m_retiredVariables.empty() ) {
+			FreeRetiredVariables();
+		}
+		return( handled );
+	}
+	void PerformStateChanges( const FrameContext & frame );
+	void ProbeScope( int state, int substate );
+	void ClearTimers( bool substateOnly );
+	void ScheduleTimerWake( void );
+	bool IsUpdateDue( const FrameContext & frame );
+	void LogFilteredMsg( MSG_Object * msg, int state, int substate );
 	void SendMsgDelayedToMeHelper( float delay, MSG_Name name, Scope_Rule scope, StateMachineQueue queue, MSG_Data& data, bool timer );
+	void SubscribeHelper( MsgTopic topic, Scope_Rule rule );
+
+	//A message event is filtered out if the scope has no handler for that message name (other events are never filtered)
+	inline bool IsMsgFiltered( State_Machine_Event event, MSG_Object * msg, MsgNameSet & registered )	{ return( EVENT_Message == event && msg && !registered[msg->GetName()] ); }
 
 	//Used for state variables (internal only - don't call directly from state machine)
-	void DeleteAllStateVariables( void );
-	void DeleteAllSubstateVariables( void );
+	inline void DeleteAllStateVariables( void )			{ m_numStateVariables = 0; }
+	inline void DeleteAllSubstateVariables( void )		{ m_numSubstateVariables = 0; }
 
 };
 
@@ -468,33 +716,67 @@ private:
 class StateMachineManager
 {
 public:
-	StateMachineManager( GameObject & object );
+	DeclareMemoryTag( MEMORY_TAG_STATE_MACHINE_MANAGER )
+
+	StateMachineManager( GameObject & object, unsigned int numQueues = STATE_MACHINE_DEFAULT_NUM_QUEUES );
 	~StateMachineManager( void );
 
-	void Update( void );
-	void SendMsg( MSG_Object msg );
+	inline unsigned int GetNumQueues( void )						{ return( m_numQueues ); }
+
+	void Update( const FrameContext & frame );
+	void SendMsg( MSG_Object & msg );		//Not copied - a broadcast passes the same message to every receiver
 	void Process( State_Machine_Event event, MSG_Object * msg, StateMachineQueue queue );
 
-	inline StateMachine* GetStateMachine( StateMachineQueue queue )	{ if( m_stateMachineList[queue].empty() ) { return( 0 ); } else { return( m_stateMachineList[queue].back() ); } }
-	inline int GetNumStateMachinesInQueue( StateMachineQueue queue )	{ return( (int)m_stateMachineList[queue].size() ); }
+	inline StateMachine* GetStateMachine( StateMachineQueue queue )	{ return( (unsigned int)queue < m_numQueues ? m_activeStateMachine[queue] : 0 ); }
+	inline int GetNumStateMachinesInQueue( StateMachineQueue queue )	{ return( (unsigned int)queue < m_numQueues ? (int)m_stateMachineList[queue].size() : 0 ); }
 	void RequestStateMachineChange( StateMachine * mch, StateMachineChange change, StateMachineQueue queue );
 	void ResetStateMachine( StateMachineQueue queue );
 	void ReplaceStateMachine( StateMachine & mch, StateMachineQueue queue );
 	void QueueStateMachine( StateMachine & mch, StateMachineQueue queue );
 	void RequeueStateMachine( StateMachineQueue queue );
 	void PushStateMachine( StateMachine & mch, StateMachineQueue queue, bool initialize );
+	void PushStateMachineLazy( StateMachine & mch, StateMachineQueue queue );	//For batched spawns (see Database::StoreBatch)
 	void PopStateMachine( StateMachineQueue queue );
 	void DeleteStateMachineQueue( StateMachineQueue queue );
 
+	//Recomputes whether the owner needs to be updated every frame
+	void RefreshUpdateActive( void );
+
+	//Snapshots (see snapshot.h) - the queues must have no pending state machine change
+	void Save( SnapshotWriter & writer );
+	bool Restore( SnapshotReader & reader );
+
+	//Scopes are unique per queue across all of the owner's state machines, so
+	//messages scoped to a machine that was swapped out never match the next one
+	inline unsigned int GetNewScope( StateMachineQueue queue )		{ ASSERTMSG( (unsigned int)queue < m_numQueues, "StateMachineManager::GetNewScope - queue out of bounds" ); return( ++m_lastScope[queue] ); }
+
 private:
 
 	GameObject * m_owner;													//GameObject that owns this state machine
 
-	typedef std::list<StateMachine*> stateMachineListContainer;				//Queue of state machines. Top one is active.
-	stateMachineListContainer m_stateMachineList[STATE_MACHINE_NUM_QUEUES];	//Array of state machine queues
-	StateMachineChange m_stateMachineChange[STATE_MACHINE_NUM_QUEUES];		//Directions for any pending state machine changes
-	StateMachine * m_newStateMachine[STATE_MACHINE_NUM_QUEUES];				//A state machine that will be added to the queue later
+	//The per queue arrays below hold m_numQueues entries (set at construction,
+	//at most STATE_MACHINE_MAX_QUEUES), so an object only pays for the queues it uses
+	unsigned int m_numQueues;
+
+	typedef std::list<StateMachine*, MemoryTagAllocator<StateMachine*, MEMORY_TAG_STATE_MACHINE_MANAGER> > stateMachineListContainer;				//Queue of state machines. Top one is active.
+	stateMachineListContainer * m_stateMachineList;							//Array of state machine queues
+	StateMachineChange * m_stateMachineChange;								//Directions for any pending state machine changes
+	StateMachine ** m_newStateMachine;										//A state machine that will be added to the queue later
+	unsigned int * m_lastScope;												//Last scope handed out on each queue
+
+	//Top of each queue (0 if empty) and a bit per non-empty queue, kept in step
+	//with the lists so events don't have to look through every queue
+	StateMachine ** m_activeStateMachine;
+	unsigned int m_activeQueues;
+	unsigned int m_lazyQueues;			//A bit per queue whose top state machine hasn't been initialized yet
+
+	void RefreshActiveStateMachine( StateMachineQueue queue );
+	inline int GetNextActiveQueue( int queue )		{ unsigned long i; return( _BitScanForward( &i, m_activeQueues & ( ~0u << queue ) ) ? (int)i : (int)m_numQueues ); }	//First non-empty queue from queue on (m_numQueues if none)
+
 	void ProcessStateMachineChangeRequests( StateMachineQueue queue );
+	void InitializeLazyQueues( void );
+	void DeleteStateMachines( StateMachineQueue queue );
+	void DestroyStateMachine( StateMachine * mch );
 
 };
 
@@ -502,23 +784,22 @@ private:
 class StateVariableInt
 {
 public:
-	StateVariableInt( int id, StateMachine* sm, StateVariableScope scope, bool init )	{ m_writeback = false; if( !init ) { m_id = id; m_stateMachine = sm; m_scope = scope; m_int = m_stateMachine->GetStateVariableInt( m_id, m_scope ); } else { sm->DeclareVariable( id, scope ); } }
-	~StateVariableInt( void )															{ if( m_writeback ) { m_stateMachine->SetStateVariableInt(m_int, m_id, m_scope); } }
+	StateVariableInt( int id, StateMachine* sm, StateVariableScope scope, bool init )	: m_int( sm->BindStateVariable( id, scope, init ).RefInt() ) {}
 	
 	inline operator int()			{ return m_int; }
-	inline int operator= (int a)	{ m_writeback = true; return( m_int = a ); }
+	inline int operator= (int a)	{ return( m_int = a ); }
 	inline int operator+ (int a)	{ return( m_int + a ); }
 	inline int operator- (int a)	{ return( m_int - a ); }
 	inline int operator* (int a)	{ return( m_int * a ); }
 	inline int operator/ (int a)	{ return( m_int / a ); }
-	inline int operator+= (int a)	{ m_writeback = true; return( m_int += a ); }
-	inline int operator-= (int a)	{ m_writeback = true; return( m_int -= a ); }
-	inline int operator*= (int a)	{ m_writeback = true; return( m_int *= a ); }
-	inline int operator/= (int a)	{ m_writeback = true; return( m_int /= a ); }
-	inline int operator++ (int)		{ m_writeback = true; return( m_int++ ); }
-	inline int operator++ ()		{ m_writeback = true; return( ++m_int ); }
-	inline int operator-- (int)		{ m_writeback = true; return( m_int-- ); }
-	inline int operator-- ()		{ m_writeback = true; return( --m_int ); }
+	inline int operator+= (int a)	{ return( m_int += a ); }
+	inline int operator-= (int a)	{ return( m_int -= a ); }
+	inline int operator*= (int a)	{ return( m_int *= a ); }
+	inline int operator/= (int a)	{ return( m_int /= a ); }
+	inline int operator++ (int)		{ return( m_int++ ); }
+	inline int operator++ ()		{ return( ++m_int ); }
+	inline int operator-- (int)		{ return( m_int-- ); }
+	inline int operator-- ()		{ return( --m_int ); }
 	inline bool operator< (int a)	{ return( m_int < a ); }
 	inline bool operator<= (int a)	{ return( m_int <= a ); }
 	inline bool operator> (int a)	{ return( m_int > a ); }
@@ -527,35 +808,30 @@ public:
 	inline bool operator== (int a)	{ return( m_int == a ); }
 	inline int operator<< (int a)	{ return( m_int << a ); }
 	inline int operator>> (int a)	{ return( m_int >> a ); }
-	inline int operator<<= (int a)	{ m_writeback = true; return( m_int <<= a ); }
-	inline int operator>>= (int a)	{ m_writeback = true; return( m_int >>= a ); }
+	inline int operator<<= (int a)	{ return( m_int <<= a ); }
+	inline int operator>>= (int a)	{ return( m_int >>= a ); }
 	inline int operator% (int a)	{ return( m_int % a ); }
 	inline int operator| (int a)	{ return( m_int | a ); }
 	inline int operator& (int a)	{ return( m_int & a ); }
 	inline int operator^ (int a)	{ return( m_int ^ a ); }
-	inline int operator%= (int a)	{ m_writeback = true; return( m_int %= a ); }
-	inline int operator|= (int a)	{ m_writeback = true; return( m_int |= a ); }
-	inline int operator&= (int a)	{ m_writeback = true; return( m_int &= a ); }
-	inline int operator^= (int a)	{ m_writeback = true; return( m_int ^= a ); }
+	inline int operator%= (int a)	{ return( m_int %= a ); }
+	inline int operator|= (int a)	{ return( m_int |= a ); }
+	inline int operator&= (int a)	{ return( m_int &= a ); }
+	inline int operator^= (int a)	{ return( m_int ^= a ); }
 	inline int operator~ ()			{ return ~m_int; }
 
 private:
-	int m_int;
-	int m_id;
-	StateVariableScope m_scope;
-	StateMachine* m_stateMachine;
-	bool m_writeback;
+	int & m_int;		//Bound directly to the variable storage (no copy or write-back)
 };
 
 class StateVariableFloat
 {
 public:
-	StateVariableFloat( int id, StateMachine* sm, StateVariableScope scope, bool init )	{ m_writeback = false; if( !init ) { m_id = id; m_stateMachine = sm; m_scope = scope; m_float = m_stateMachine->GetStateVariableFloat( m_id, m_scope ); } else { sm->DeclareVariable( id, scope ); } }
-	~StateVariableFloat( void )															{ if( m_writeback ) { m_stateMachine->SetStateVariableFloat(m_float, m_id, m_scope); } }
+	StateVariableFloat( int id, StateMachine* sm, StateVariableScope scope, bool init )	: m_float( sm->BindStateVariable( id, scope, init ).RefFloat() ) {}
 
 	inline operator float()				{ return m_float; }
-	inline float operator= (float a)	{ m_writeback = true; return( m_float = a ); }
-	inline float operator= (int a)		{ m_writeback = true; return( m_float = (float)a ); }
+	inline float operator= (float a)	{ return( m_float = a ); }
+	inline float operator= (int a)		{ return( m_float = (float)a ); }
 	inline float operator+ (float a)	{ return( m_float + a ); }
 	inline float operator+ (int a)		{ return( m_float + (float)a ); }
 	inline float operator- (float a)	{ return( m_float - a ); }
@@ -564,14 +840,14 @@ public:
 	inline float operator* (int a)		{ return( m_float * (float)a ); }
 	inline float operator/ (float a)	{ return( m_float / a ); }
 	inline float operator/ (int a)		{ return( m_float / (float)a ); }
-	inline float operator+= (float a)	{ m_writeback = true; return( m_float += a ); }
-	inline float operator+= (int a)		{ m_writeback = true; return( m_float += (float)a ); }
-	inline float operator-= (float a)	{ m_writeback = true; return( m_float -= a ); }
-	inline float operator-= (int a)		{ m_writeback = true; return( m_float -= (float)a ); }
-	inline float operator*= (float a)	{ m_writeback = true; return( m_float *= a ); }
-	inline float operator*= (int a)		{ m_writeback = true; return( m_float *= a ); }
-	inline float operator/= (float a)	{ m_writeback = true; return( m_float /= (float)a ); }
-	inline float operator/= (int a)		{ m_writeback = true; return( m_float /= (float)a ); }
+	inline float operator+= (float a)	{ return( m_float += a ); }
+	inline float operator+= (int a)		{ return( m_float += (float)a ); }
+	inline float operator-= (float a)	{ return( m_float -= a ); }
+	inline float operator-= (int a)		{ return( m_float -= (float)a ); }
+	inline float operator*= (float a)	{ return( m_float *= a ); }
+	inline float operator*= (int a)		{ return( m_float *= a ); }
+	inline float operator/= (float a)	{ return( m_float /= (float)a ); }
+	inline float operator/= (int a)		{ return( m_float /= (float)a ); }
 	inline bool operator< (float a)		{ return( m_float < a ); }
 	inline bool operator< (int a)		{ return( m_float < (float)a ); }
 	inline bool operator<= (float a)	{ return( m_float <= a ); }
@@ -586,102 +862,73 @@ public:
 	inline bool operator== (int a)		{ return( m_float == (float)a ); }
 
 private:
-	float m_float;
-	int m_id;
-	StateVariableScope m_scope;
-	StateMachine* m_stateMachine;
-	bool m_writeback;
+	float & m_float;		//Bound directly to the variable storage (no copy or write-back)
 };
 
 class StateVariableBool
 {
 public:
-	StateVariableBool( int id, StateMachine* sm, StateVariableScope scope, bool init )	{ m_writeback = false; if( !init ) { m_id = id; m_stateMachine = sm; m_scope = scope; m_bool = m_stateMachine->GetStateVariableBool( m_id, m_scope ); } else { sm->DeclareVariable( id, scope ); } }
-	~StateVariableBool( void )															{ if( m_writeback ) { m_stateMachine->SetStateVariableBool(m_bool, m_id, m_scope); } }
+	StateVariableBool( int id, StateMachine* sm, StateVariableScope scope, bool init )	: m_bool( sm->BindStateVariable( id, scope, init ).RefBool() ) {}
 
 	inline operator bool()			{ return m_bool; }
-	inline bool operator= (bool a)	{ m_writeback = true; return( m_bool = a ); }
+	inline bool operator= (bool a)	{ return( m_bool = a ); }
 	inline bool operator!= (bool a)	{ return( m_bool != a ); }
 	inline bool operator== (bool a)	{ return( m_bool == a ); }
 	inline bool operator! ()		{ return !m_bool; }
 
 private:
-	bool m_bool;
-	int m_id;
-	StateVariableScope m_scope;
-	StateMachine* m_stateMachine;
-	bool m_writeback;
+	bool & m_bool;		//Bound directly to the variable storage (no copy or write-back)
 };
 
 class StateVariableObjectID
 {
 public:
-	StateVariableObjectID( int id, StateMachine* sm, StateVariableScope scope, bool init )	{ m_writeback = false; if( !init ) { m_id = id; m_stateMachine = sm; m_scope = scope; m_objectID = m_stateMachine->GetStateVariableObjectID( m_id, m_scope ); } else { sm->DeclareVariable( id, scope ); } }
-	~StateVariableObjectID( void )															{ if( m_writeback ) { m_stateMachine->SetStateVariableObjectID(m_objectID, m_id, m_scope); } }
+	StateVariableObjectID( int id, StateMachine* sm, StateVariableScope scope, bool init )	: m_objectID( sm->BindStateVariable( id, scope, init ).RefObjectID() ) {}
 
 	inline operator objectID()				{ return m_objectID; }
-	inline objectID operator= (objectID a)	{ m_writeback = true; return( m_objectID = a ); }
+	inline objectID operator= (objectID a)	{ return( m_objectID = a ); }
 	inline bool operator!= (objectID a)		{ return( m_objectID != a ); }
 	inline bool operator== (objectID a)		{ return( m_objectID == a ); }
 
 private:
-	objectID m_objectID;
-	int m_id;
-	StateVariableScope m_scope;
-	StateMachine* m_stateMachine;
-	bool m_writeback;
+	objectID & m_objectID;		//Bound directly to the variable storage (no copy or write-back)
 };
 
 class StateVariablePointerVoid
 {
 public:
-	StateVariablePointerVoid( int id, StateMachine* sm, StateVariableScope scope, bool init )	{ m_writeback = false; if( !init ) { m_id = id; m_stateMachine = sm; m_scope = scope; m_pointervoid = m_stateMachine->GetStateVariablePointer( m_id, m_scope ); } else { sm->DeclareVariable( id, scope ); } }
-	~StateVariablePointerVoid( void )															{ if( m_writeback ) { m_stateMachine->SetStateVariablePointer(m_pointervoid, m_id, m_scope); } }
+	StateVariablePointerVoid( int id, StateMachine* sm, StateVariableScope scope, bool init )	: m_pointervoid( sm->BindStateVariable( id, scope, init ).RefPointer() ) {}
 	
 	inline operator void*()				{ return m_pointervoid; }
-	inline void* operator= (void* a)	{ m_writeback = true; return( m_pointervoid = a ); }
+	inline void* operator= (void* a)	{ return( m_pointervoid = a ); }
 	inline void* operator-> ()			{ return m_pointervoid; }
 
 private:
-	void* m_pointervoid;
-	int m_id;
-	StateVariableScope m_scope;
-	StateMachine* m_stateMachine;
-	bool m_writeback;
+	void* & m_pointervoid;		//Bound directly to the variable storage (no copy or write-back)
 };
 
 class StateVariablePointerVector2
 {
 public:
-	StateVariablePointerVector2( int id, StateMachine* sm, StateVariableScope scope, bool init )	{ m_writeback = false; if( !init ) { m_id = id; m_stateMachine = sm; m_scope = scope; m_pointervector2 = m_stateMachine->GetStateVariableVector2( m_id, m_scope ); } else { sm->DeclareVariable( id, scope ); } }
-	~StateVariablePointerVector2( void )															{ if( m_writeback ) { m_stateMachine->SetStateVariableVector2(m_pointervector2, m_id, m_scope); } }
+	StateVariablePointerVector2( int id, StateMachine* sm, StateVariableScope scope, bool init )	: m_pointervector2( sm->BindStateVariable( id, scope, init ).RefVector2() ) {}
 
-	inline operator D3DXVECTOR2*()					{ return m_pointervector2; }
-	inline D3DXVECTOR2* operator= (D3DXVECTOR2* a)	{ m_writeback = true; return( m_pointervector2 = a ); }
-	inline D3DXVECTOR2* operator-> ()				{ return m_pointervector2; }
+	inline operator Vector2*()					{ return m_pointervector2; }
+	inline Vector2* operator= (Vector2* a)	{ return( m_pointervector2 = a ); }
+	inline Vector2* operator-> ()				{ return m_pointervector2; }
 
 private:
-	D3DXVECTOR2* m_pointervector2;
-	int m_id;
-	StateVariableScope m_scope;
-	StateMachine* m_stateMachine;
-	bool m_writeback;
+	Vector2* & m_pointervector2;		//Bound directly to the variable storage (no copy or write-back)
 };
 
 class StateVariablePointerVector3
 {
 public:
-	StateVariablePointerVector3( int id, StateMachine* sm, StateVariableScope scope, bool init )	{ m_writeback = false; if( !init ) { m_id = id; m_stateMachine = sm; m_scope = scope; m_pointervector3 = m_stateMachine->GetStateVariableVector3( m_id, m_scope ); } else { sm->DeclareVariable( id, scope ); } }
-	~StateVariablePointerVector3( void )															{ if( m_writeback ) { m_stateMachine->SetStateVariableVector3(m_pointervector3, m_id, m_scope); } }
+	StateVariablePointerVector3( int id, StateMachine* sm, StateVariableScope scope, bool init )	: m_pointervector3( sm->BindStateVariable( id, scope, init ).RefVector3() ) {}
 
-	inline operator D3DXVECTOR3*()					{ return m_pointervector3; }
-	inline D3DXVECTOR3* operator= (D3DXVECTOR3* a)	{ m_writeback = true; return( m_pointervector3 = a ); }
-	inline D3DXVECTOR3* operator-> ()				{ return m_pointervector3; }
+	inline operator Vector3*()					{ return m_pointervector3; }
+	inline Vector3* operator= (Vector3* a)	{ return( m_pointervector3 = a ); }
+	inline Vector3* operator-> ()				{ return m_pointervector3; }
 
 private:
-	D3DXVECTOR3* m_pointervector3;
-	int m_id;
-	StateVariableScope m_scope;
-	StateMachine* m_stateMachine;
-	bool m_writeback;
+	Vector3* & m_pointervector3;		//Bound directly to the variable storage (no copy or write-back)
 };
@@ -0,0 +1,83 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "statemch.h"
+#include <vector>
+
+
+//Where the StateMachineManager hands back pooled state machines when they
+//are popped, replaced or deleted (instead of deleting them)
+class StateMachinePoolBase
+{
+public:
+	virtual void Release( StateMachine * mch ) = 0;
+};
+
+
+//Recycles the state machines of one class, for short lived machines that 
+//are pushed and popped often (reactions, staggers, interrupts):
+//  PushStateMachine( *StateMachinePool<Stagger>::Acquire( *m_owner ) );
+//A recycled machine isn't constructed again, it is Reset when it becomes
+//active like any other. So pooled classes can only take the GameObject in
+//their constructor, and any members must be set up in OnEnter (or be state
+//variables). Thread safe, since machines are also pushed from job threads.
+template <class T> class StateMachinePool : public StateMachinePoolBase
+{
+public:
+
+	StateMachinePool( void ) : m_numCreated( 0 )	{ InitializeCriticalSection( &m_lock ); }
+	~StateMachinePool( void )						{ for( unsigned int i=0; i<m_free.size(); ++i ) { delete( m_free[i] ); } DeleteCriticalSection( &m_lock ); }
+
+	static inline T * Acquire( GameObject & object )	{ return( s_pool.AcquireMachine( object ) ); }
+	static inline StateMachinePool<T> & GetPool( void )	{ return( s_pool ); }
+
+	virtual void Release( StateMachine * mch )		{ EnterCriticalSection( &m_lock ); m_free.push_back( static_cast<T*>( mch ) ); LeaveCriticalSection( &m_lock ); }
+
+	inline unsigned int GetNumFree( void )			{ return( (unsigned int)m_free.size() ); }
+	inline unsigned int GetNumCreated( void )		{ return( m_numCreated ); }
+
+private:
+
+	std::vector<T*> m_free;
+	unsigned int m_numCreated;
+	CRITICAL_SECTION m_lock;
+
+	static StateMachinePool<T> s_pool;
+
+	T * AcquireMachine( GameObject & object )
+	{
+		T * mch = 0;
+		EnterCriticalSection( &m_lock );
+		if( !m_free.empty() )
+		{
+			mch = m_free.back();
+			m_free.pop_back();
+		}
+		else
+		{
+			m_numCreated++;
+		}
+		LeaveCriticalSection( &m_lock );
+
+		if( mch ) {
+			mch->Recycle( object );
+		}
+		else {
+			mch = new T( object );
+		}
+		mch->SetPool( this );
+		return( mch );
+	}
+
+};
+
+template <class T> StateMachinePool<T> StateMachinePool<T>::s_pool;
@@ -0,0 +1,97 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "stateprobecache.h"
+
+
+
+StateProbeCache::StateProbeCache( void )
+: m_count( 0 )
+{
+	COMPILE_TIME_ASSERT( STATE_PROBE_CACHE_SIZE == 256, slot_hash_assumes_256_entries );
+
+	for( unsigned int i=0; i<STATE_PROBE_CACHE_SIZE; ++i ) {
+		m_entries[i].m_key = 0;
+	}
+	InitializeCriticalSection( &m_lock );
+}
+
+StateProbeCache::~StateProbeCache( void )
+{
+	DeleteCriticalSection( &m_lock );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Find
+
+  Description:  Finds the probe result of a state or substate.
+
+  Arguments:    state    : the state
+                substate : the substate (-1 for the state itself)
+
+  Returns:      The cached result, or 0 if the scope hasn't been cached.
+ *---------------------------------------------------------------------------*/
+const StateProbeResult * StateProbeCache::Find( int state, int substate )
+{
+	LONG key = GetKey( state, substate );
+	unsigned int slot = GetSlot( key );
+	for( unsigned int i=0; i<STATE_PROBE_CACHE_SIZE; ++i )
+	{
+		Entry & entry = m_entries[( slot + i ) & ( STATE_PROBE_CACHE_SIZE - 1 )];
+		LONG entryKey = entry.m_key;
+		if( entryKey == key ) {
+			return( &entry.m_result );
+		}
+		if( entryKey == 0 ) {
+			break;
+		}
+	}
+	return( 0 );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Insert
+
+  Description:  Caches the probe result of a state or substate. Does nothing
+                if it is already cached (another thread got there first) or
+				the cache is full.
+
+  Arguments:    state    : the state
+                substate : the substate (-1 for the state itself)
+				result   : what probing the scope found
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void StateProbeCache::Insert( int state, int substate, StateProbeResult & result )
+{
+	LONG key = GetKey( state, substate );
+	unsigned int slot = GetSlot( key );
+
+	EnterCriticalSection( &m_lock );
+	if( m_count < STATE_PROBE_CACHE_SIZE - 1 )
+	{	//Leave one slot empty so a failed Find always stops
+		for( unsigned int i=0; i<STATE_PROBE_CACHE_SIZE; ++i )
+		{
+			Entry & entry = m_entries[( slot + i ) & ( STATE_PROBE_CACHE_SIZE - 1 )];
+			if( entry.m_key == key ) {
+				break;
+			}
+			if( entry.m_key == 0 )
+			{	//Publish the key after the result, so readers never see a partial entry
+				entry.m_result = result;
+				InterlockedExchange( &entry.m_key, key );
+				m_count++;
+				break;
+			}
+		}
+	}
+	LeaveCriticalSection( &m_lock );
+}
@@ -0,0 +1,63 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "statemch.h"
+
+
+#define STATE_PROBE_CACHE_SIZE (256)		//Most (state, substate) scopes cached per state machine class (power of 2)
+
+
+//What probing one state or substate found: the events and messages it
+//handles and how many variables it declares
+struct StateProbeResult
+{
+	unsigned int m_events;			//Registered event bits of the scope's level (REGISTERED_EVENT_STATE or REGISTERED_EVENT_SUBSTATE)
+	MsgNameSet m_msgs;				//Messages handled by the scope
+	int m_numVariables;				//State variables (for a state) or substate variables (for a substate)
+	bool m_armsTimers;				//Scope has OnTimeIn... handlers, so it must still be probed on entry
+};
+
+
+//Per state machine class cache of probe results, keyed on (state, substate).
+//Probing is deterministic apart from the timers it arms, so once a scope has
+//been probed, entering it again can replay the result instead of running
+//States() with EVENT_Probe. Lookups are lock free, since state machines
+//change state on job threads. An entry is published by writing its key last;
+//inserts are serialized. When the table is full, scopes are simply probed.
+class StateProbeCache
+{
+public:
+
+	StateProbeCache( void );
+	~StateProbeCache( void );
+
+	const StateProbeResult * Find( int state, int substate );
+	void Insert( int state, int substate, StateProbeResult & result );
+
+	inline unsigned int GetSize( void )			{ return( m_count ); }
+
+private:
+
+	struct Entry
+	{
+		volatile LONG m_key;		//0 if empty
+		StateProbeResult m_result;
+	};
+
+	Entry m_entries[STATE_PROBE_CACHE_SIZE];
+	unsigned int m_count;
+	CRITICAL_SECTION m_lock;
+
+	static inline LONG GetKey( int state, int substate )	{ return( (LONG)( ( ( state + 1 ) << 16 ) | ( ( substate + 2 ) & 0xFFFF ) ) ); }	//Never 0
+	static inline unsigned int GetSlot( LONG key )			{ return( ( (unsigned int)key * 2654435761u ) >> 24 ); }
+
+};
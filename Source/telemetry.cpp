@@ -0,0 +1,196 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "telemetry.h"
+#include <algorithm>
+#include <vector>
+
+
+static const char* TelemetrySeriesText[] =
+{
+	"object_update",
+	"deliver_delayed_messages",
+	"deletion_sweep",
+	"animate",
+	"advance_time_and_draw",
+	"msgs_sent",
+	"msgs_delivered",
+	"msgs_deferred",
+	"msgs_dropped_by_scope",
+	"msgs_over_limit",
+	"state_changes",
+	"events_processed"
+};
+
+
+FrameTelemetry::FrameTelemetry( void )
+: m_numFrames( 0 ),
+  m_frameStarted( false )
+{
+	COMPILE_TIME_ASSERT( sizeof( TelemetrySeriesText ) / sizeof( TelemetrySeriesText[0] ) == TELEMETRY_NUM_SERIES, telemetry_series_names_must_match_enum );
+
+	LARGE_INTEGER qwFreq;
+	QueryPerformanceFrequency( &qwFreq );
+	m_ticksPerSecond = (double)qwFreq.QuadPart;
+
+	for( int i=0; i<TELEMETRY_NUM_SERIES; ++i )
+	{
+		m_frameTicks[i] = 0;
+		m_frameCounts[i] = 0;
+		m_totals[i] = 0.0;
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         BeginFrame
+
+  Description:  Moves the values of the current frame into the history and
+                clears them for the next frame. Nothing is recorded the
+				first time, since there was no frame before it.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void FrameTelemetry::BeginFrame( void )
+{
+	unsigned int slot = m_numFrames % TELEMETRY_HISTORY_FRAMES;
+
+	for( int i=0; i<TELEMETRY_NUM_SERIES; ++i )
+	{
+		if( m_frameStarted )
+		{
+			if( IsTimer( (TelemetrySeries)i ) ) {
+				m_history[i][slot] = (double)m_frameTicks[i] / m_ticksPerSecond;
+			}
+			else {
+				m_history[i][slot] = (double)m_frameCounts[i];
+			}
+			m_totals[i] += m_history[i][slot];
+		}
+		m_frameTicks[i] = 0;
+		m_frameCounts[i] = 0;
+	}
+
+	if( m_frameStarted ) {
+		m_numFrames++;
+	}
+	m_frameStarted = true;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetStats
+
+  Description:  Computes the statistics of a series over the history.
+                Time complexity O(n log n) for n history frames.
+
+  Arguments:    series : the timer or counter
+                stats  : filled with the result
+
+  Returns:      False if no frame has completed yet.
+ *---------------------------------------------------------------------------*/
+bool FrameTelemetry::GetStats( TelemetrySeries series, TelemetryStats & stats )
+{
+	unsigned int count = m_numFrames < TELEMETRY_HISTORY_FRAMES ? m_numFrames : TELEMETRY_HISTORY_FRAMES;
+	if( count == 0 ) {
+		return( false );
+	}
+
+	std::vector<double> sorted( m_history[series], m_history[series] + count );
+	std::sort( sorted.begin(), sorted.end() );
+
+	double total = 0.0;
+	for( unsigned int i=0; i<count; ++i )
+	{
+		total += sorted[i];
+	}
+
+	stats.m_last = m_history[series][( m_numFrames - 1 ) % TELEMETRY_HISTORY_FRAMES];
+	stats.m_mean = total / (double)count;
+	stats.m_p50 = sorted[( count - 1 ) * 50 / 100];
+	stats.m_p95 = sorted[( count - 1 ) * 95 / 100];
+	stats.m_p99 = sorted[( count - 1 ) * 99 / 100];
+	stats.m_max = sorted[count - 1];
+	return( true );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         GetSeriesName
+
+  Description:  The name of a series, as used when exporting.
+
+  Arguments:    series : the timer or counter
+
+  Returns:      The name.
+ *---------------------------------------------------------------------------*/
+const char * FrameTelemetry::GetSeriesName( TelemetrySeries series )
+{
+	return( TelemetrySeriesText[series] );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Export
+
+  Description:  Passes the statistics of every series to a sink (for example
+                a metrics pipeline). Does nothing until a frame completes.
+
+  Arguments:    sink    : the function to call for each series
+                context : passed through to the sink
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void FrameTelemetry::Export( TelemetrySink sink, void * context )
+{
+	TelemetryStats stats;
+	for( int i=0; i<TELEMETRY_NUM_SERIES; ++i )
+	{
+		if( GetStats( (TelemetrySeries)i, stats ) ) {
+			sink( GetSeriesName( (TelemetrySeries)i ), IsTimer( (TelemetrySeries)i ), stats, context );
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         WriteJSON
+
+  Description:  Writes the statistics of every series as a JSON object
+                (timers in milliseconds, counters per frame).
+
+  Arguments:    filename : the file to write
+
+  Returns:      True if the file was written.
+ *---------------------------------------------------------------------------*/
+bool FrameTelemetry::WriteJSON( const char * filename )
+{
+	FILE * file = fopen( filename, "w" );
+	if( file == 0 ) {
+		return( false );
+	}
+
+	fprintf( file, "{\n\t\"frames\": %u,\n\t\"series\": {\n", m_numFrames );
+	for( int i=0; i<TELEMETRY_NUM_SERIES; ++i )
+	{
+		TelemetryStats stats;
+		if( !GetStats( (TelemetrySeries)i, stats ) ) {
+			memset( &stats, 0, sizeof( stats ) );
+		}
+
+		double scale = IsTimer( (TelemetrySeries)i ) ? 1000.0 : 1.0;
+		fprintf( file, "\t\t\"%s\": { \"unit\": \"%s\", \"last\": %.4f, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f }%s\n",
+			GetSeriesName( (TelemetrySeries)i ), IsTimer( (TelemetrySeries)i ) ? "ms" : "count",
+			stats.m_last * scale, stats.m_mean * scale, stats.m_p50 * scale, stats.m_p95 * scale, stats.m_p99 * scale, stats.m_max * scale,
+			i+1 < TELEMETRY_NUM_SERIES ? "," : "" );
+	}
+	fprintf( file, "\t}\n}\n" );
+
+	fclose( file );
+	return( true );
+}
@@ -0,0 +1,114 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+#include "global.h"
+#include "singleton.h"
+
+
+#define TELEMETRY_HISTORY_FRAMES (256)		//Frames kept for the rolling percentiles
+
+//Per frame measurements of the World tick
+enum TelemetrySeries {
+	//Scoped timers (seconds per frame)
+	TELEMETRY_OBJECT_UPDATE,
+	TELEMETRY_DELIVER_DELAYED_MESSAGES,
+	TELEMETRY_DELETION_SWEEP,
+	TELEMETRY_ANIMATE,
+	TELEMETRY_ADVANCE_TIME_AND_DRAW,
+
+	//Counters (events per frame)
+	TELEMETRY_MSGS_SENT,
+	TELEMETRY_MSGS_DELIVERED,
+	TELEMETRY_MSGS_DEFERRED,
+	TELEMETRY_MSGS_DROPPED_BY_SCOPE,
+	TELEMETRY_MSGS_OVER_LIMIT,		//Sends over a MsgRoute flow limit
+	TELEMETRY_STATE_CHANGES,
+	TELEMETRY_EVENTS_PROCESSED,		//State machine Process and Update calls
+
+	TELEMETRY_NUM_SERIES
+};
+
+#define TELEMETRY_FIRST_COUNTER TELEMETRY_MSGS_SENT
+
+//Statistics of a series over the history
+struct TelemetryStats
+{
+	double m_last;			//Last completed frame
+	double m_mean;
+	double m_p50;
+	double m_p95;
+	double m_p99;
+	double m_max;
+};
+
+//Receives each series when exporting to an external metrics system
+typedef void (*TelemetrySink)( const char * name, bool timer, TelemetryStats & stats, void * context );
+
+
+//Frame level timers and counters. A frame runs from one World::Update to the
+//next, so it includes the draw of that frame. Timers are only used on the main
+//thread; counters may be bumped from job threads during a parallel update.
+class FrameTelemetry : public Singleton <FrameTelemetry>
+{
+public:
+
+	FrameTelemetry( void );
+	~FrameTelemetry( void ) {}
+
+	//Closes the current frame (its values go into the history) and starts a new one
+	void BeginFrame( void );
+
+	inline void AddTicks( TelemetrySeries series, LONGLONG ticks )	{ m_frameTicks[series] += ticks; }
+	inline void Count( TelemetrySeries series )						{ InterlockedIncrement( &m_frameCounts[series] ); }
+
+	//Querying (completed frames only)
+	inline unsigned int GetNumFrames( void )						{ return( m_numFrames ); }
+	inline double GetTotal( TelemetrySeries series )				{ return( m_totals[series] ); }	//Sum over all completed frames
+	bool GetStats( TelemetrySeries series, TelemetryStats & stats );
+	const char * GetSeriesName( TelemetrySeries series );
+	inline bool IsTimer( TelemetrySeries series )					{ return( series < TELEMETRY_FIRST_COUNTER ); }
+
+	//Exporting
+	void Export( TelemetrySink sink, void * context );
+	bool WriteJSON( const char * filename );
+
+private:
+
+	LONGLONG m_frameTicks[TELEMETRY_NUM_SERIES];		//Current frame (timers)
+	volatile LONG m_frameCounts[TELEMETRY_NUM_SERIES];	//Current frame (counters)
+	double m_history[TELEMETRY_NUM_SERIES][TELEMETRY_HISTORY_FRAMES];
+	double m_totals[TELEMETRY_NUM_SERIES];
+	unsigned int m_numFrames;							//Completed frames
+	bool m_frameStarted;
+	double m_ticksPerSecond;
+
+};
+
+
+//Adds the time spent in the enclosing block to a timer, if telemetry exists
+class TelemetryScope
+{
+public:
+
+	inline TelemetryScope( TelemetrySeries series )	: m_series( series ), m_active( FrameTelemetry::DoesSingletonExist() ) { if( m_active ) { LARGE_INTEGER qwTime; QueryPerformanceCounter( &qwTime ); m_start = qwTime.QuadPart; } }
+	inline ~TelemetryScope( void )					{ if( m_active ) { LARGE_INTEGER qwTime; QueryPerformanceCounter( &qwTime ); g_telemetry.AddTicks( m_series, qwTime.QuadPart - m_start ); } }
+
+private:
+
+	TelemetrySeries m_series;
+	bool m_active;
+	LONGLONG m_start;
+
+};
+
+//Bumps a counter, if telemetry exists
+inline void CountTelemetry( TelemetrySeries series )	{ if( FrameTelemetry::DoesSingletonExist() ) { g_telemetry.Count( series ); } }
@@ -9,15 +9,44 @@
  */
 
 #include "DXUT.h"
+#include "global.h"
 #include "time.h"
 #include <windows.h>
 
 
 Time::Time( void )
 {
-	m_currentTime = 0.0f;
+	LARGE_INTEGER qwTime, qwFreq;
+	QueryPerformanceCounter( &qwTime );
+	QueryPerformanceFrequency( &qwFreq );
+
+	m_currentTime = 0.0;
 	m_timeLastTick = 0.001f;
-	m_startTime = timeGetTime();
+	m_startTicks = qwTime.QuadPart;
+	m_ticksPerSecond = qwFreq.QuadPart;
+	m_currentTicks = 0;
+	m_realTicks = 0;
+	m_stepTicks = 0;
+
+	m_frame.m_time = m_currentTime;
+	m_frame.m_delta = m_timeLastTick;
+	m_frame.m_frame = 0;
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         PublishFrame
+
+  Description:  Makes the newly marked tick the current FrameContext.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Time::PublishFrame( void )
+{
+	m_frame.m_time = m_currentTime;
+	m_frame.m_delta = m_timeLastTick;
+	m_frame.m_frame++;
 }
 
 /*---------------------------------------------------------------------------*
@@ -25,7 +54,9 @@ Time::Time( void )
 
   Description:  Marks the current time for this tick (frame). This can be
                 referenced during the frame to simulate a consistent moment 
-				in time.
+				in time. The time is kept as 64-bit performance counter ticks
+				and converted to double seconds, so it stays precise for the
+				whole uptime of a server.
   
   Arguments:    None.
 
@@ -33,16 +64,116 @@ Time::Time( void )
  *---------------------------------------------------------------------------*/
 void Time::MarkTimeThisTick( void )
 {
-	unsigned int timeInMS = timeGetTime();
-	float newTime = (timeInMS - m_startTime) / 1000.0f;
+	LARGE_INTEGER qwTime;
+	QueryPerformanceCounter( &qwTime );
+	m_currentTicks = qwTime.QuadPart - m_startTicks;
 
-	m_timeLastTick = newTime - m_currentTime;
+	double newTime = (double)m_currentTicks / (double)m_ticksPerSecond;
+
+	m_timeLastTick = (float)( newTime - m_currentTime );
 	m_currentTime = newTime;
 
 	if( m_timeLastTick <= 0.0f ) {
 		m_timeLastTick = 0.001f;
 	}
 
+	PublishFrame();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         SetFixedTimestep
+
+  Description:  Switches to fixed timestep mode, where the simulation time
+                only advances in whole steps (see MarkRealTimeThisFrame).
+
+  Arguments:    seconds : the length of a step (0 turns fixed timestep off)
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Time::SetFixedTimestep( double seconds )
+{
+	m_stepTicks = (LONGLONG)( seconds * (double)m_ticksPerSecond + 0.5 );
+	m_realTicks = m_currentTicks;
+
+	if( seconds > 0.0 && m_stepTicks <= 0 ) {
+		m_stepTicks = 1;
+	}
 }
 
+/*---------------------------------------------------------------------------*
+  Name:         MarkRealTimeThisFrame
+
+  Description:  Marks the real time for this frame in fixed timestep mode,
+                and returns how many simulation steps are due. If the 
+				simulation fell behind by more than maxSteps, the extra 
+				time is dropped (the game slows down instead of spiraling).
+
+  Arguments:    maxSteps : the most catch-up steps to run this frame
+
+  Returns:      The number of times to call MarkFixedStep and update.
+ *---------------------------------------------------------------------------*/
+unsigned int Time::MarkRealTimeThisFrame( unsigned int maxSteps )
+{
+	ASSERTMSG( IsFixedTimestep(), "Time::MarkRealTimeThisFrame - Fixed timestep not set" );
 
+	LARGE_INTEGER qwTime;
+	QueryPerformanceCounter( &qwTime );
+	LONGLONG realTicks = qwTime.QuadPart - m_startTicks;
+
+	LONGLONG steps = ( realTicks - m_currentTicks ) / m_stepTicks;
+	if( steps > (LONGLONG)maxSteps )
+	{	//Drop the time that can't be caught up with
+		m_startTicks += ( steps - maxSteps ) * m_stepTicks;
+		realTicks -= ( steps - maxSteps ) * m_stepTicks;
+		steps = maxSteps;
+	}
+	if( steps < 0 ) {
+		steps = 0;
+	}
+
+	m_realTicks = realTicks;
+	return( (unsigned int)steps );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         MarkFixedStep
+
+  Description:  Advances the simulation time by one fixed step.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Time::MarkFixedStep( void )
+{
+	ASSERTMSG( IsFixedTimestep(), "Time::MarkFixedStep - Fixed timestep not set" );
+
+	m_currentTicks += m_stepTicks;
+	m_currentTime = (double)m_currentTicks / (double)m_ticksPerSecond;
+	m_timeLastTick = (float)GetFixedTimestep();
+	PublishFrame();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         MarkReplayedTime
+
+  Description:  Sets the simulation time to the recorded time of a frame, so
+                a replay sees the same times as the recording (whatever the
+				timestep mode of either).
+
+  Arguments:    seconds : the simulation time
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void Time::MarkReplayedTime( double seconds )
+{
+	m_timeLastTick = (float)( seconds - m_currentTime );
+	m_currentTime = seconds;
+	m_currentTicks = (LONGLONG)( seconds * (double)m_ticksPerSecond + 0.5 );
+	m_realTicks = m_currentTicks;
+
+	if( m_timeLastTick <= 0.0f ) {
+		m_timeLastTick = 0.001f;
+	}
+	PublishFrame();
+}
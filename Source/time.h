@@ -11,7 +11,24 @@
 #pragma once
 
 #include "singleton.h"
+#ifndef STATE_MACHINE_HEADLESS
 #include "DXUT\DXUTmisc.h"
+#endif
+
+
+//The current tick, as seen by the simulation. It is written once when a tick (or a
+//fixed step) is marked and only read for the rest of the tick. Database::Update reads
+//it once and passes it down the object update (including the parallel jobs), the 
+//state changes and the delayed message delivery. Any thread bound to the world can
+//still read it through g_frame, but that goes through the thread local Time instance
+//(see singleton.h), so code that runs per object or per message should use the frame
+//it was handed.
+struct FrameContext
+{
+	double m_time;				//Simulation time (seconds since startup)
+	float m_delta;				//Time since the previous tick
+	unsigned int m_frame;		//Ticks marked since startup
+};
 
 
 class Time : public Singleton <Time>
@@ -22,17 +39,43 @@ public:
 	~Time( void ) {}
 
 	void MarkTimeThisTick( void );
+
+	//Fixed timestep mode (a step of 0 goes back to marking the real time each tick)
+	void SetFixedTimestep( double seconds );
+	inline bool IsFixedTimestep( void )			{ return( m_stepTicks > 0 ); }
+	inline double GetFixedTimestep( void )		{ return( (double)m_stepTicks / (double)m_ticksPerSecond ); }
+	unsigned int MarkRealTimeThisFrame( unsigned int maxSteps );
+	void MarkFixedStep( void );
+	void MarkReplayedTime( double seconds );	//Sets the simulation time of a recorded frame (see MsgRecorder)
+	inline float GetFixedStepAlpha( void )		{ return( m_stepTicks > 0 ? (float)( m_realTicks - m_currentTicks ) / (float)m_stepTicks : 1.0f ); }
 	inline float GetElapsedTime( void )			{ return( m_timeLastTick ); }
-	inline float GetCurTime( void )				{ return( m_currentTime ); }
+	inline double GetCurTime( void )			{ return( m_currentTime ); }		//Seconds since startup (double, so long uptimes keep sub-millisecond precision)
+	static inline const FrameContext & GetFrame( void )	{ return( GetSingleton().m_frame ); }	//The current tick (see FrameContext)
+	inline LONGLONG GetCurTicks( void )			{ return( m_currentTicks ); }		//Performance counter ticks since startup
+#ifndef STATE_MACHINE_HEADLESS
 	inline double GetAbsoluteTime( void )		{ return( m_timer.GetAbsoluteTime() ); }
+#else
+	inline double GetAbsoluteTime( void )		{ return( GetHighestResolutionTime() / GetHighestResolutionFrequency() ); }
+#endif
 	inline double GetHighestResolutionTime( void )	{ LARGE_INTEGER qwTime; QueryPerformanceCounter( &qwTime ); return((double)qwTime.QuadPart); }
+	inline double GetHighestResolutionFrequency( void )	{ LARGE_INTEGER qwFreq; QueryPerformanceFrequency( &qwFreq ); return((double)qwFreq.QuadPart); }	//Ticks per second of GetHighestResolutionTime
 
 
 private:
 
-	unsigned int m_startTime;
-	float m_currentTime;
+	LONGLONG m_startTicks;
+	LONGLONG m_ticksPerSecond;
+	LONGLONG m_currentTicks;
+	LONGLONG m_realTicks;		//Fixed timestep: real ticks since startup (minus dropped catch-up time)
+	LONGLONG m_stepTicks;		//Fixed timestep: ticks per simulation step (0 if not fixed)
+	double m_currentTime;
 	float m_timeLastTick;
+
+	FrameContext m_frame;
+
+	void PublishFrame( void );
+#ifndef STATE_MACHINE_HEADLESS
 	CDXUTTimer m_timer;
+#endif
 
 };
@@ -10,6 +10,7 @@
 
 #include "DXUT.h"
 #include "unittest1.h"
+#include "snapshot.h"
 #include "msgroute.h"
 
 #include <stdio.h>
@@ -54,6 +55,8 @@ enum SubstateName {
 //11. PopState
 
 
+REGISTER_STATE_MACHINE( UnitTest1 )
+
 bool UnitTest1::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
@@ -10,7 +10,9 @@
 
 #include "DXUT.h"
 #include "unittest2a.h"
+#include "snapshot.h"
 #include "unittest2b.h"
+#include "statemchpool.h"
 #include "body.h"
 
 
@@ -43,6 +45,8 @@ enum SubstateName {
 //4. RequeueStateMachine
 
 
+REGISTER_STATE_MACHINE( UnitTest2a )
+
 bool UnitTest2a::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
@@ -63,7 +67,7 @@ BeginStateMachine
 		OnMsg( MSG_UnitTestMessage )
 			if( m_owner->GetBody().GetHealth() != 100 )
 			{
-				StateMachine* mch = new UnitTest2b( *m_owner );
+				StateMachine* mch = StateMachinePool<UnitTest2b>::Acquire( *m_owner );
 				PushStateMachine( *mch );
 			}
 			else
@@ -10,7 +10,9 @@
 
 #include "DXUT.h"
 #include "unittest2b.h"
+#include "snapshot.h"
 #include "unittest2c.h"
+#include "statemchpool.h"
 #include "body.h"
 
 
@@ -42,6 +44,8 @@ enum SubstateName {
 //3. QueueStateMachine
 //4. RequeueStateMachine
 
+REGISTER_STATE_MACHINE( UnitTest2b )
+
 bool UnitTest2b::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
@@ -67,7 +71,7 @@ BeginStateMachine
 	DeclareState( STATE_Chain1 )
 		
 		OnEnter
-			StateMachine* mch = new UnitTest2c( *m_owner );
+			StateMachine* mch = StateMachinePool<UnitTest2c>::Acquire( *m_owner );
 			QueueStateMachine( *mch );	//Put this new one between UnitTest2a and UnitTest2b
 			ChangeStateDelayed( 1.0f, STATE_Chain2 );
 
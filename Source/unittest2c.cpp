@@ -10,6 +10,7 @@
 
 #include "DXUT.h"
 #include "unittest2c.h"
+#include "snapshot.h"
 #include "body.h"
 
 
@@ -41,6 +42,8 @@ enum SubstateName {
 //3. QueueStateMachine
 //4. RequeueStateMachine
 
+REGISTER_STATE_MACHINE( UnitTest2c )
+
 bool UnitTest2c::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
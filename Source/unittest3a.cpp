@@ -10,6 +10,7 @@
 
 #include "DXUT.h"
 #include "unittest3a.h"
+#include "snapshot.h"
 
 
 //Add new states here
@@ -42,6 +43,8 @@ enum SubstateName {
 //5. SetCCReceiver
 //6. OnMsgCC
 
+REGISTER_STATE_MACHINE( UnitTest3a )
+
 bool UnitTest3a::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
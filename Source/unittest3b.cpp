@@ -10,6 +10,7 @@
 
 #include "DXUT.h"
 #include "unittest3b.h"
+#include "snapshot.h"
 
 
 //Add new states here
@@ -43,6 +44,8 @@ enum SubstateName {
 //5. SetCCReceiver
 //6. OnMsgCC
 
+REGISTER_STATE_MACHINE( UnitTest3b )
+
 bool UnitTest3b::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
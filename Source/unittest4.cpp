@@ -10,6 +10,7 @@
 
 #include "DXUT.h"
 #include "unittest4.h"
+#include "snapshot.h"
 
 
 
@@ -42,6 +43,8 @@ enum SubstateName {
 //Within substates: OnEnter, OnExit, OnMsg, scoping
 //DisableUpdateEvents
 
+REGISTER_STATE_MACHINE( UnitTest4 )
+
 bool UnitTest4::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
@@ -10,6 +10,7 @@
 
 #include "DXUT.h"
 #include "unittest5.h"
+#include "snapshot.h"
 
 
 //Not in unit tests yet:
@@ -54,6 +55,8 @@ enum SubstateName {
 //DeclareStateInt, DeclareStateFloat, DeclareStateBool, DeclareStateObjectID
 //DeclareSubstateInt, DeclareSubstateFloat, DeclareSubstateBool, DeclareSubstateObjectID
 
+REGISTER_STATE_MACHINE( UnitTest5 )
+
 bool UnitTest5::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
@@ -10,6 +10,7 @@
 
 #include "DXUT.h"
 #include "unittest6.h"
+#include "snapshot.h"
 
 
 
@@ -26,6 +27,8 @@ enum StateName {
 	STATE_Chain8,
 	STATE_Chain9,
 	STATE_Chain10,
+	STATE_Chain11,
+	STATE_Chain12,
 	STATE_Success,
 	STATE_Broken
 };
@@ -42,9 +45,14 @@ enum SubstateName {
 //OnNthUpdate
 //OnFirstUpdate - OnFifthUpdate
 //OnEveryNthUpdate, OnEveryOddUpdate, OnEveryEvenUpdate
+//OnTimeInState, OnPeriodicTimeInState
+//OnCoroutine, CoWaitSeconds, CoWaitMsg
+//Coalescing of duplicate next frame (ONE_FRAME) sends
 
 
 
+REGISTER_STATE_MACHINE( UnitTest6 )
+
 bool UnitTest6::States( State_Machine_Event event, MSG_Object * msg, int state, int substate )
 {
 BeginStateMachine
@@ -283,8 +291,52 @@ BeginStateMachine
 		OnPeriodicTimeInState( 0.1f )
 			count++;
 			if( count == 6 ) {
+				ChangeState( STATE_Chain11 );
+			}
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain11 )
+
+		DeclareStateInt( count )
+
+		OnCoroutine
+			ChangeStateDelayed( 2.0f, STATE_Broken );
+			count = 1;
+			CoWaitSeconds( 0.2f );
+			count++;
+			SendMsgToState( MSG_UnitTestMessage );
+			CoWaitMsg( MSG_UnitTestMessage );
+			if( count == 2 && msg->GetName() == MSG_UnitTestMessage ) {
+				ChangeState( STATE_Chain12 );
+			}
+		EndCoroutine
+
+
+	///////////////////////////////////////////////////////////////
+	DeclareState( STATE_Chain12 )
+
+		DeclareStateInt( count )
+		DeclareStateInt( data )
+
+		OnEnter
+			//MSG_SetTargetPosition is COALESCE_LATEST_WINS, so only the second send is delivered
+			SendMsgDelayedToState( ONE_FRAME, MSG_SetTargetPosition, MSG_Data(1) );
+			SendMsgDelayedToState( ONE_FRAME, MSG_SetTargetPosition, MSG_Data(2) );
+			SendMsgDelayedToState( 0.2f, MSG_UnitTestMessage );
+			ChangeStateDelayed( 1.0f, STATE_Broken );
+
+		OnMsg( MSG_SetTargetPosition )
+			count++;
+			data = msg->GetIntData();
+
+		OnMsg( MSG_UnitTestMessage )
+			if( count == 1 && data == 2 ) {
 				ChangeState( STATE_Success );
 			}
+			else {
+				ChangeState( STATE_Broken );
+			}
 
 
 	///////////////////////////////////////////////////////////////
@@ -0,0 +1,58 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+//Vector types used by the state machine engine. The game build uses the D3DX
+//vectors directly, the headless library (STATE_MACHINE_HEADLESS) uses plain
+//structs with the same members and operators, so no Direct3D code is needed.
+
+#ifndef STATE_MACHINE_HEADLESS
+
+typedef D3DXVECTOR2 Vector2;
+typedef D3DXVECTOR3 Vector3;
+
+#else
+
+struct Vector2
+{
+	float x, y;
+
+	Vector2( void )											{}
+	Vector2( float vx, float vy ) : x( vx ), y( vy )		{}
+
+	inline Vector2 operator+ ( const Vector2& v ) const		{ return( Vector2( x + v.x, y + v.y ) ); }
+	inline Vector2 operator- ( const Vector2& v ) const		{ return( Vector2( x - v.x, y - v.y ) ); }
+	inline Vector2 operator* ( float s ) const				{ return( Vector2( x * s, y * s ) ); }
+	inline Vector2& operator+= ( const Vector2& v )			{ x += v.x; y += v.y; return( *this ); }
+	inline Vector2& operator-= ( const Vector2& v )			{ x -= v.x; y -= v.y; return( *this ); }
+	inline Vector2& operator*= ( float s )					{ x *= s; y *= s; return( *this ); }
+	inline bool operator== ( const Vector2& v ) const		{ return( x == v.x && y == v.y ); }
+	inline bool operator!= ( const Vector2& v ) const		{ return( x != v.x || y != v.y ); }
+};
+
+struct Vector3
+{
+	float x, y, z;
+
+	Vector3( void )													{}
+	Vector3( float vx, float vy, float vz ) : x( vx ), y( vy ), z( vz )	{}
+
+	inline Vector3 operator+ ( const Vector3& v ) const		{ return( Vector3( x + v.x, y + v.y, z + v.z ) ); }
+	inline Vector3 operator- ( const Vector3& v ) const		{ return( Vector3( x - v.x, y - v.y, z - v.z ) ); }
+	inline Vector3 operator* ( float s ) const				{ return( Vector3( x * s, y * s, z * s ) ); }
+	inline Vector3& operator+= ( const Vector3& v )			{ x += v.x; y += v.y; z += v.z; return( *this ); }
+	inline Vector3& operator-= ( const Vector3& v )			{ x -= v.x; y -= v.y; z -= v.z; return( *this ); }
+	inline Vector3& operator*= ( float s )					{ x *= s; y *= s; z *= s; return( *this ); }
+	inline bool operator== ( const Vector3& v ) const		{ return( x == v.x && y == v.y && z == v.z ); }
+	inline bool operator!= ( const Vector3& v ) const		{ return( x != v.x || y != v.y || z != v.z ); }
+};
+
+#endif
@@ -18,6 +18,17 @@
 #include "gameobject.h"
 #include "movement.h"
 #include "debuglog.h"
+#include "jobsystem.h"
+#include "profiler.h"
+#include "telemetry.h"
+#include "bodystore.h"
+#include "spatialgrid.h"
+#include "snapshot.h"
+#include "msgrecorder.h"
+#include "animationlod.h"
+#include "footstepvoices.h"
+#include "shard.h"
+#include "stateinspector.h"
 #include "MultiAnimation.h"
 #include "Tiny.h"
 
@@ -37,32 +48,86 @@
 
 //#define UNIT_TESTING
 
+#define WORLD_BODY_STORE_CAPACITY (4096)	//Bodies beyond this keep their own fields
+#define WORLD_SPATIAL_GRID_CELL_SIZE (0.1f)	//The characters walk within [0,1] on x and z
+#define WORLD_NUM_NPCS (10)
+
 
 World::World(void)
-: m_initialized(false)
+: m_initialized(false),
+  m_maxStepsPerFrame(5),
+  m_inspector(0),
+  m_multiAnim(0)
 {
 
 }
 
 World::~World(void)
 {
-	delete m_time;
-	delete m_database;
-	delete m_msgroute;
-	delete m_debuglog;
+	//Deleted with the world bound (each subsystem unbinds itself), then the thread
+	//gets back whatever it had bound unless it was this world
+	WorldContext previous = WorldContext::Capture();
+	m_context.Bind();
+
+	delete m_inspector;
+	delete m_context.m_time;
+	delete m_context.m_database;
+	delete m_context.m_msgroute;
+	delete m_context.m_debuglog;
+	delete m_context.m_jobsystem;
+	delete m_context.m_profiler;
+	delete m_context.m_telemetry;
+	delete m_context.m_bodystore;		//After the database (the bodies release their store indices)
+	delete m_context.m_spatialgrid;		//After the database (the bodies leave the grid)
+	delete m_context.m_msgrecorder;		//Closes a recording that is still open
+	delete m_context.m_animationlod;
+	delete m_context.m_footstepvoices;
+	delete m_context.m_shard;
+
+	if( previous.m_time != m_context.m_time ) {
+		previous.Bind();
+	}
 }
 
-void World::InitializeSingletons( void )
+void World::InitializeSingletons( unsigned int numWorkers )
 {
+	//Created with nothing bound, so each world gets its own
+	WorldContext::Unbind();
+
 	//Create Singletons
-	m_time = new Time();
-	m_database = new Database();
-	m_msgroute = new MsgRoute();
-	m_debuglog = new DebugLog();
+	m_context.m_time = new Time();
+	m_context.m_database = new Database();
+	m_context.m_msgroute = new MsgRoute();
+	m_context.m_debuglog = new DebugLog();
+	m_context.m_jobsystem = new JobSystem( numWorkers );
+	m_context.m_profiler = new StateMachineProfiler();
+	m_context.m_telemetry = new FrameTelemetry();
+	m_context.m_bodystore = new BodyStore( WORLD_BODY_STORE_CAPACITY );
+	m_context.m_spatialgrid = new SpatialGrid( WORLD_SPATIAL_GRID_CELL_SIZE );
+	m_context.m_msgrecorder = new MsgRecorder();
+	m_context.m_animationlod = new AnimationLOD();
+	m_context.m_footstepvoices = new FootstepVoices();
+}
+
+void World::CreateShard( unsigned int localShard, unsigned int numShards, ShardTransport & transport )
+{
+	WorldContextScope bind( m_context );
+	m_context.m_shard = new Shard( localShard, numShards, transport );
+}
+
+bool World::CreateStateInspector( const char * segmentName, unsigned int capacity )
+{
+	if( !m_inspector ) {
+		m_inspector = new StateInspector();
+	}
+	return( m_inspector->Open( segmentName, capacity ) );
 }
 
 void World::Initialize( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoundManager *pSM, double dTimeCurrent )
 {
+	WorldContextScope bind( m_context );
+
+	m_multiAnim = pMA;
 	if(!m_initialized)
 	{
 		m_initialized = true;
@@ -115,12 +180,18 @@ void World::Initialize( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoun
 
 #else
 
-	for( int i=0; i<10; i++ )
+	//Spawned as one batch (the state machines initialize on the first update)
+	dbObjectIDList ids;
+	dbCompositionList npcs;
+	g_database.GetNewObjectIDs( WORLD_NUM_NPCS, ids );
+	pMA->SetInstanceLimits( TINY_MAX_TRACKS, TINY_MAX_TRACK_EVENTS );
+	pMA->ReserveInstances( WORLD_NUM_NPCS );	//Their animation instances are created up front
+	for( int i=0; i<WORLD_NUM_NPCS; i++ )
 	{
 		//Create game objects
 		char name[10] = "NPC";
 		sprintf( name, "%s%d", name, i );
-		GameObject* npc = new GameObject( g_database.GetNewObjectID(), OBJECT_NPC, name );
+		GameObject* npc = new GameObject( ids[i], OBJECT_NPC, name );
 		D3DXVECTOR3 pos(0.0f, 0.0f, 0.0f);
 		pos.x = ((float)(rand()%100)) / 100.0f;
 		pos.z = ((float)(rand()%100)) / 100.0f;
@@ -128,11 +199,12 @@ void World::Initialize( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoun
 		npc->CreateMovement();
 		npc->CreateTiny( pMA, pv_pChars, pSM, dTimeCurrent );
 		npc->CreateStateMachineManager();
-		g_database.Store( *npc );
 
 		//Give the game object a state machine
-		npc->GetStateMachineManager()->PushStateMachine( *new Example( *npc ), STATE_MACHINE_QUEUE_0, TRUE );
+		npc->GetStateMachineManager()->PushStateMachineLazy( *new Example( *npc ), STATE_MACHINE_QUEUE_0 );
+		npcs.push_back( npc );
 	}
+	g_database.StoreBatch( npcs );
 
 
 #endif
@@ -143,32 +215,123 @@ void World::Initialize( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoun
 
 void World::PostInitialize()
 {
+	WorldContextScope bind( m_context );
 	g_database.Initialize();
 }
 
 
+bool World::SaveSnapshot( const char * filename )
+{
+	WorldContextScope bind( m_context );
+	return( ::SaveSnapshot( filename ) );
+}
+
+bool World::RestoreSnapshot( const char * filename, CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoundManager *pSM, double dTimeCurrent )
+{
+	WorldContextScope bind( m_context );
+
+	if( m_initialized || !::RestoreSnapshot( filename ) ) {
+		return( false );
+	}
+	m_initialized = true;
+	m_multiAnim = pMA;
+
+	//The characters (the objects that move) get a new model
+	dbCompositionList objects;
+	g_database.ComposeList( objects );
+	unsigned int numCharacters = 0;
+	for( dbCompositionList::iterator i = objects.begin(); i != objects.end(); ++i )
+	{
+		if( (*i)->HasMovement() ) {
+			numCharacters++;
+		}
+	}
+	pMA->SetInstanceLimits( TINY_MAX_TRACKS, TINY_MAX_TRACK_EVENTS );
+	pMA->ReserveInstances( numCharacters );
+	for( dbCompositionList::iterator i = objects.begin(); i != objects.end(); ++i )
+	{
+		if( (*i)->HasMovement() ) {
+			(*i)->CreateTiny( pMA, pv_pChars, pSM, dTimeCurrent );
+		}
+	}
+	return( true );
+}
+
+
+void World::SetFixedTimestep( double seconds, unsigned int maxStepsPerFrame )
+{
+	WorldContextScope bind( m_context );
+	g_time.SetFixedTimestep( seconds );
+	m_maxStepsPerFrame = maxStepsPerFrame;
+}
+
 void World::Update()
 {
-	g_time.MarkTimeThisTick();
-	g_database.Update();
+	WorldContextScope bind( m_context );
+	g_msgroute.SetMainThread();		//Whichever thread runs the world this frame
+
+	g_telemetry.BeginFrame();
+
+	if( !g_time.IsFixedTimestep() )
+	{
+		g_time.MarkTimeThisTick();
+		g_database.Update();
+	}
+	else
+	{	//Fixed timestep: AI and movement run in whole steps, rendering is interpolated
+		unsigned int steps = g_time.MarkRealTimeThisFrame( m_maxStepsPerFrame );
+		for( unsigned int i=0; i<steps; ++i )
+		{
+			g_database.BeginStep();
+			g_time.MarkFixedStep();
+			g_database.Update();
+
+			TelemetryScope telemetry( TELEMETRY_ANIMATE );
+			g_database.Animate( g_time.GetFixedTimestep() );
+		}
+		g_database.Interpolate( g_time.GetFixedStepAlpha() );
+	}
+
+	if( m_inspector ) {
+		m_inspector->Publish();
+	}
 }
 
 void World::Animate( double dTimeDelta )
 {
-	g_database.Animate( dTimeDelta );
+	WorldContextScope bind( m_context );
+
+	if( !g_time.IsFixedTimestep() )
+	{	//Movement already ran in the fixed steps
+		TelemetryScope telemetry( TELEMETRY_ANIMATE );
+		g_database.Animate( dTimeDelta );
+	}
 }
 
 void World::AdvanceTimeAndDraw( IDirect3DDevice9* pd3dDevice, D3DXMATRIX* pViewProj, double dTimeDelta, D3DXVECTOR3 *pvEye )
 {
+	WorldContextScope bind( m_context );
+	TelemetryScope telemetry( TELEMETRY_ADVANCE_TIME_AND_DRAW );
+
+	//The characters only queue their bone palettes; the crowd is drawn with instancing at the end
+	bool crowd = m_multiAnim && m_multiAnim->BeginCrowd();
+	if( m_multiAnim ) {
+		m_multiAnim->ClearPoseCache();	//Characters in the same pose share its palette this frame
+	}
 	g_database.AdvanceTimeAndDraw( pd3dDevice, pViewProj, dTimeDelta, pvEye );
+	if( crowd ) {
+		m_multiAnim->EndCrowd();
+	}
 }
 
 void World::RestoreDeviceObjects( LPDIRECT3DDEVICE9 pd3dDevice )
 {
+	WorldContextScope bind( m_context );
 	return( g_database.RestoreDeviceObjects( pd3dDevice ) );
 }
 
 void World::InvalidateDeviceObjects( void )
 {
+	WorldContextScope bind( m_context );
 	g_database.InvalidateDeviceObjects();
 }
@@ -10,29 +10,46 @@
 
 #pragma once
 
-class Time;
-class Database;
-class MsgRoute;
-class DebugLog;
 class AnimationManager;
+class ShardTransport;
 class CMultiAnim;
 class CTiny;
+class StateInspector;
 
 #include <vector>
 #include "DXUT\SDKsound.h"
+#include "worldcontext.h"
 
+//A simulation with its own subsystems (see worldcontext.h). Every call binds the
+//world's context to the calling thread for its duration, so a process can run 
+//several worlds, one thread at a time each. InitializeSingletons leaves the new 
+//world bound, so with a single world the g_ macros work anywhere on that thread.
 class World
 {
 public:
 	World();
 	~World();
 
-	void InitializeSingletons( void );
+	void InitializeSingletons( unsigned int numWorkers = 0 );	//Job workers including the calling thread (0 = one per hardware thread)
+	void CreateShard( unsigned int localShard, unsigned int numShards, ShardTransport & transport );	//Optional, before any object (see shard.h)
+	inline void Bind( void )						{ m_context.Bind(); }		//For code outside the World calls (one world per thread at a time)
+	inline WorldContext & GetContext( void )		{ return( m_context ); }
+
+	//Optional - publishes the state of every object into a shared memory segment at the end of each update (see stateinspector.h)
+	bool CreateStateInspector( const char * segmentName, unsigned int capacity );
+	inline StateInspector * GetStateInspector( void )	{ return( m_inspector ); }
 	void Initialize( CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoundManager *pSM, double dTimeCurrent );
 	void PostInitialize();
 
+	//Snapshots of the whole simulation (see snapshot.h). Restoring takes the place of Initialize.
+	bool SaveSnapshot( const char * filename );
+	bool RestoreSnapshot( const char * filename, CMultiAnim *pMA, std::vector< CTiny* > *pv_pChars, CSoundManager *pSM, double dTimeCurrent );
+
 	void Update();
 	void Animate( double dTimeDelta );
+
+	//Run the simulation in fixed steps (0 for one variable step per frame), with a cap on catch-up steps per frame
+	void SetFixedTimestep( double seconds, unsigned int maxStepsPerFrame = 5 );
 	void AdvanceTimeAndDraw( IDirect3DDevice9* pd3dDevice, D3DXMATRIX* pViewProj, double dTimeDelta, D3DXVECTOR3 *pvEye );
     void RestoreDeviceObjects( LPDIRECT3DDEVICE9 pd3dDevice );
 
@@ -43,12 +60,12 @@ public:
 protected:
 
 	bool m_initialized;
-	Time* m_time;
-	Database* m_database;
-	MsgRoute* m_msgroute;
-	DebugLog* m_debuglog;
+	unsigned int m_maxStepsPerFrame;
+	WorldContext m_context;		//The subsystems (owned)
+	StateInspector * m_inspector;
 
 	AnimationManager* m_animationManager;
+	CMultiAnim* m_multiAnim;	//Draws the characters as one crowd
 
 };
 
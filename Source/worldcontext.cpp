@@ -0,0 +1,127 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#include "DXUT.h"
+#include "worldcontext.h"
+#include "time.h"
+#include "database.h"
+#include "msgroute.h"
+#include "debuglog.h"
+#include "jobsystem.h"
+#include "profiler.h"
+#include "telemetry.h"
+#include "bodystore.h"
+#include "spatialgrid.h"
+#include "msgrecorder.h"
+#ifndef STATE_MACHINE_HEADLESS
+#include "animationlod.h"
+#include "footstepvoices.h"
+#endif
+#include "shard.h"
+
+
+
+/*---------------------------------------------------------------------------*
+  Name:         WorldContext
+
+  Description:  Constructor. An empty context (nothing bound).
+ *---------------------------------------------------------------------------*/
+WorldContext::WorldContext( void )
+: m_time( 0 ),
+  m_database( 0 ),
+  m_msgroute( 0 ),
+  m_debuglog( 0 ),
+  m_jobsystem( 0 ),
+  m_profiler( 0 ),
+  m_telemetry( 0 ),
+  m_bodystore( 0 ),
+  m_spatialgrid( 0 ),
+  m_msgrecorder( 0 ),
+  m_animationlod( 0 ),
+  m_footstepvoices( 0 ),
+  m_shard( 0 )
+{
+
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Capture
+
+  Description:  Returns the instances bound to the calling thread.
+
+  Arguments:    None.
+
+  Returns:      The context.
+ *---------------------------------------------------------------------------*/
+WorldContext WorldContext::Capture( void )
+{
+	WorldContext context;
+	context.m_time = Time::GetSingletonPtr();
+	context.m_database = Database::GetSingletonPtr();
+	context.m_msgroute = MsgRoute::GetSingletonPtr();
+	context.m_debuglog = DebugLog::GetSingletonPtr();
+	context.m_jobsystem = JobSystem::GetSingletonPtr();
+	context.m_profiler = StateMachineProfiler::GetSingletonPtr();
+	context.m_telemetry = FrameTelemetry::GetSingletonPtr();
+	context.m_bodystore = BodyStore::GetSingletonPtr();
+	context.m_spatialgrid = SpatialGrid::GetSingletonPtr();
+	context.m_msgrecorder = MsgRecorder::GetSingletonPtr();
+#ifndef STATE_MACHINE_HEADLESS
+	context.m_animationlod = AnimationLOD::GetSingletonPtr();
+	context.m_footstepvoices = FootstepVoices::GetSingletonPtr();
+#endif
+	context.m_shard = Shard::GetSingletonPtr();
+	return( context );
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Unbind
+
+  Description:  Binds nothing to the calling thread, so the subsystems of
+                another world can be constructed.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void WorldContext::Unbind( void )
+{
+	WorldContext empty;
+	empty.Bind();
+}
+
+/*---------------------------------------------------------------------------*
+  Name:         Bind
+
+  Description:  Binds the instances of this context to the calling thread.
+                A subsystem the world doesn't have is unbound.
+
+  Arguments:    None.
+
+  Returns:      None.
+ *---------------------------------------------------------------------------*/
+void WorldContext::Bind( void )
+{
+	Time::Bind( m_time );
+	Database::Bind( m_database );
+	MsgRoute::Bind( m_msgroute );
+	DebugLog::Bind( m_debuglog );
+	JobSystem::Bind( m_jobsystem );
+	StateMachineProfiler::Bind( m_profiler );
+	FrameTelemetry::Bind( m_telemetry );
+	BodyStore::Bind( m_bodystore );
+	SpatialGrid::Bind( m_spatialgrid );
+	MsgRecorder::Bind( m_msgrecorder );
+#ifndef STATE_MACHINE_HEADLESS
+	AnimationLOD::Bind( m_animationlod );
+	FootstepVoices::Bind( m_footstepvoices );
+#endif
+	Shard::Bind( m_shard );
+}
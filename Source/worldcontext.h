@@ -0,0 +1,82 @@
+/* Copyright Steve Rabin, 2010. 
+ * All rights reserved worldwide.
+ *
+ * This software is provided "as is" without express or implied
+ * warranties. You may freely copy and compile this source into
+ * applications you distribute provided that the copyright text
+ * below is included in the resulting source code, for example:
+ * "Portions Copyright Steve Rabin, 2010"
+ */
+
+#pragma once
+
+class Time;
+class Database;
+class MsgRoute;
+class DebugLog;
+class JobSystem;
+class StateMachineProfiler;
+class FrameTelemetry;
+class BodyStore;
+class SpatialGrid;
+class MsgRecorder;
+class AnimationLOD;
+class FootstepVoices;
+class Shard;
+
+
+//The subsystems of one simulation (a World). Game code and state machines reach
+//them through the g_ macros (see global.h), which go to the instances bound to the
+//calling thread, so a process can host several independent worlds:
+//
+//  - A world's subsystems are created with nothing bound (Unbind), and make up
+//    its context (Capture).
+//  - Whatever runs a world binds its context first (WorldContextScope), so the
+//    world's objects, state machines and messages only ever see their own world.
+//  - The job workers of a world bind the context of the thread that hands them
+//    the work (see JobSystem::ParallelFor).
+//
+//Worlds share no mutable state apart from the state machine definitions and
+//pools, which are already safe to use from several threads, so separate worlds
+//can be run on separate threads at the same time.
+class WorldContext
+{
+public:
+
+	WorldContext( void );
+
+	static WorldContext Capture( void );	//The instances bound to the calling thread
+	static void Unbind( void );				//Binds nothing (before creating another world's subsystems)
+	void Bind( void );						//Binds these instances to the calling thread
+
+	Time * m_time;
+	Database * m_database;
+	MsgRoute * m_msgroute;
+	DebugLog * m_debuglog;
+	JobSystem * m_jobsystem;
+	StateMachineProfiler * m_profiler;
+	FrameTelemetry * m_telemetry;
+	BodyStore * m_bodystore;
+	SpatialGrid * m_spatialgrid;
+	MsgRecorder * m_msgrecorder;
+	AnimationLOD * m_animationlod;			//Not in headless builds
+	FootstepVoices * m_footstepvoices;		//Not in headless builds
+	Shard * m_shard;						//Optional (the host creates it)
+
+};
+
+
+//Binds a world's context to the calling thread for a scope, then
+//binds the previous one again
+class WorldContextScope
+{
+public:
+
+	WorldContextScope( WorldContext & context ) : m_previous( WorldContext::Capture() )	{ context.Bind(); }
+	~WorldContextScope( void )															{ m_previous.Bind(); }
+
+private:
+
+	WorldContext m_previous;
+
+};